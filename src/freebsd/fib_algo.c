@@ -42,11 +42,13 @@
 #include <sys/kernel.h>
 #include <sys/priv.h>
 #include <sys/proc.h>
+#include <sys/sdt.h>
 #include <sys/socket.h>
 #include <sys/socketvar.h>
 #include <sys/stdarg.h>
 #include <sys/sysctl.h>
 #include <sys/syslog.h>
+#include <sys/taskqueue.h>
 #include <sys/queue.h>
 #include <net/vnet.h>
 
@@ -89,6 +91,47 @@
  * 4) automatic algorithm selection based on the provided preference.
  *
  *
+ * PARTIAL REBUILDS
+ * Algorithms providing flm_change_range_cb() are not rebuilt from scratch
+ *  when the change queue grows past its limit or a change cannot be
+ *  applied. Instead, each change marks the address chunk (/8 for IPv4, /16
+ *  for IPv6) holding its prefix, or the prefix itself when it is wider
+ *  than a chunk, and the algo is handed the current rib routes of the dirty
+ *  ranges only, walked with rnh_walktree_from(). The change queue itself
+ *  starts at the size used by the previous sync and grows on demand.
+ *
+ *
+ * AGGREGATION
+ * Algorithms with FLM_F_AGGREGATE are fed the aggregated rib: routes whose
+ *  nexthop is the one of the closest covering route are left out, as the
+ *  covering route gives the same lookup result. Changes to such algos are
+ *  always batched, and a batch is applied as a partial rebuild of the
+ *  changed prefixes, which holds all the routes whose aggregation may have
+ *  changed. Nexthops stay referenced for all rib routes.
+ *
+ *
+ * BACKGROUND REBUILDS
+ * Scheduled rebuilds of algorithms with FLM_F_UNLOCKED_DUMP and batch
+ *  change support run on a taskqueue instead of the rib callout. The new
+ *  instance subscribes to the rib and queues all changes, takes a snapshot
+ *  of the routes under the rib read lock, and is built from the snapshot
+ *  without any rib lock. The changes made after the snapshot are then
+ *  replayed under the write lock, right after the new instance is linked
+ *  to the datapath. Writers are only blocked for the snapshot and the
+ *  replay.
+ *
+ *
+ * ADAPTIVE SELECTION
+ * With net.route.algo.adaptive set, the active instance periodically
+ *  measures its lookup cost on destinations sampled from the rib, and
+ *  its memory footprint. Results are kept per fib and algo. Candidates
+ *  not measured at the current table scale are tried, and the measured
+ *  best one replaces the current algo if it is cheaper by the configured
+ *  margin. Switches are at least adaptive_hold_ms apart. The static
+ *  preference only forces a switch if the current algo cannot handle
+ *  the table.
+ *
+ *
  * DATAPATH
  * For each supported address family, there is a an allocated array of fib_dp
  *  structures, indexed by fib number. Each array entry contains callback function
@@ -103,6 +146,13 @@ SYSCTL_DECL(_net_route);
 SYSCTL_NODE(_net_route, OID_AUTO, algo, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
     "Fib algorithm lookups");
 
+/* Instance builds: rib, algo name, background build, then the result */
+SDT_PROVIDER_DECLARE(route);
+SDT_PROBE_DEFINE3(route, fib_algo, rebuild, start, "struct rib_head *",
+    "char *", "bool");
+SDT_PROBE_DEFINE4(route, fib_algo, rebuild, done, "struct rib_head *",
+    "char *", "bool", "enum flm_op_result");
+
 /* Algorithm sync policy */
 
 /* Time interval to bucket updates */
@@ -123,6 +173,52 @@ VNET_DEFINE_STATIC(unsigned int, fib_max_sync_delay_ms) = 1000;
 SYSCTL_UINT(_net_route_algo, OID_AUTO, fib_max_sync_delay_ms, CTLFLAG_RW | CTLFLAG_VNET,
     &VNET_NAME(fib_max_sync_delay_ms), 0, "Maximum time to delay sync (ms)");
 
+/* Queued changes, in percent of the table, to switch to range resync */
+VNET_DEFINE_STATIC(unsigned int, fib_queue_limit_pct) = 5;
+#define	V_fib_queue_limit_pct	VNET(fib_queue_limit_pct)
+SYSCTL_UINT(_net_route_algo, OID_AUTO, queue_limit_pct, CTLFLAG_RW | CTLFLAG_VNET,
+    &VNET_NAME(fib_queue_limit_pct), 0,
+    "Change queue size (% of prefixes) to resync by address range");
+
+/* Build scheduled instances in the background */
+VNET_DEFINE_STATIC(bool, fib_bg_rebuild) = true;
+#define	V_fib_bg_rebuild	VNET(fib_bg_rebuild)
+SYSCTL_BOOL(_net_route_algo, OID_AUTO, bg_rebuild, CTLFLAG_RW | CTLFLAG_VNET,
+    &VNET_NAME(fib_bg_rebuild), 0,
+    "Build new algo instances without holding the rib write lock");
+
+/* Select algo by the measured lookup cost */
+VNET_DEFINE_STATIC(bool, fib_adaptive) = false;
+#define	V_fib_adaptive	VNET(fib_adaptive)
+SYSCTL_BOOL(_net_route_algo, OID_AUTO, adaptive, CTLFLAG_RW | CTLFLAG_VNET,
+    &VNET_NAME(fib_adaptive), 0,
+    "Select algo by measured lookup cost and memory footprint");
+
+/* Lookup cost sampling interval */
+VNET_DEFINE_STATIC(unsigned int, fib_adaptive_probe_ms) = 10000;
+#define	V_fib_adaptive_probe_ms	VNET(fib_adaptive_probe_ms)
+SYSCTL_UINT(_net_route_algo, OID_AUTO, adaptive_probe_ms, CTLFLAG_RW | CTLFLAG_VNET,
+    &VNET_NAME(fib_adaptive_probe_ms), 0, "Lookup cost sampling interval (ms)");
+
+/* Minimum time between adaptive switches */
+VNET_DEFINE_STATIC(unsigned int, fib_adaptive_hold_ms) = 60000;
+#define	V_fib_adaptive_hold_ms	VNET(fib_adaptive_hold_ms)
+SYSCTL_UINT(_net_route_algo, OID_AUTO, adaptive_hold_ms, CTLFLAG_RW | CTLFLAG_VNET,
+    &VNET_NAME(fib_adaptive_hold_ms), 0, "Minimum time between algo switches (ms)");
+
+/* Candidate has to be this percent cheaper than the current to switch */
+VNET_DEFINE_STATIC(unsigned int, fib_adaptive_margin_pct) = 20;
+#define	V_fib_adaptive_margin_pct	VNET(fib_adaptive_margin_pct)
+SYSCTL_UINT(_net_route_algo, OID_AUTO, adaptive_margin_pct, CTLFLAG_RW | CTLFLAG_VNET,
+    &VNET_NAME(fib_adaptive_margin_pct), 0, "Minimum cost improvement (%) to switch");
+
+/* Memory footprint weighted as 1ns of lookup cost */
+VNET_DEFINE_STATIC(unsigned int, fib_adaptive_mem_kb) = 1024;
+#define	V_fib_adaptive_mem_kb	VNET(fib_adaptive_mem_kb)
+SYSCTL_UINT(_net_route_algo, OID_AUTO, adaptive_mem_kb, CTLFLAG_RW | CTLFLAG_VNET,
+    &VNET_NAME(fib_adaptive_mem_kb), 0,
+    "Memory footprint (KB) costing as much as 1ns of lookup time");
+
 
 #ifdef INET6
 VNET_DEFINE_STATIC(bool, algo_fixed_inet6) = false;
@@ -140,16 +236,46 @@ SYSCTL_NODE(_net_route_algo, OID_AUTO, inet, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
 /* Fib instance counter */
 static uint32_t fib_gen = 0;
 
+/*
+ * Dense nexthop index table of the fd.
+ * Indexes are handed out lowest first; index 0 is never used. Nexthops
+ *  are found by pointer through the hash chains, linked by index, which
+ *  can be walked without the rib lock within the epoch.
+ * The index of the unreferenced nexthop is reused only after the nexthop
+ *  release at the end of the epoch, so datapath never returns a wrong
+ *  nexthop for a stale index.
+ * A full table is replaced by a copy twice as large. The replaced tables
+ *  are kept till the fd is destroyed: algo instances keep using the nhop
+ *  array they were built with.
+ */
 struct nhop_ref_table {
-	uint32_t		count;
-	int32_t			refcnt[0];
+	uint32_t		count;		/* # of used or released indexes */
+	uint32_t		size;		/* # of indexes, power of 2 */
+	uint32_t		free_hint;	/* no free indexes below */
+	struct nhop_ref_table	*prev;		/* replaced table */
+	struct nhop_object	**nh_idx;	/* nhop idx->ptr array */
+	int32_t			*refcnt;	/* # of refs, -1 if being released */
+	uint32_t		*hash;		/* hash chain heads */
+	uint32_t		*next;		/* hash chain links */
+};
+
+struct nhop_release_data {
+	struct nhop_object	*nh;
+	struct fib_data		*fd;
+	uint32_t		idx;
+	struct nhop_release_data	*next;	/* released indexes list */
+	struct epoch_context	ctx;
 };
 
+/* Max ranges wider than a chunk pending resync */
+#define	FIB_MAX_WIDE_RANGES	16
+
 enum fib_callout_action {
 	FDA_NONE,	/* No callout scheduled */
 	FDA_REBUILD,	/* Asks to rebuild algo instance */
 	FDA_EVAL,	/* Asks to evaluate if the current algo is still be best */
 	FDA_BATCH,	/* Asks to submit batch of updates to the algo */
+	FDA_PROBE,	/* Asks to measure the algo lookup cost */
 };
 
 struct fib_sync_status {
@@ -158,19 +284,36 @@ struct fib_sync_status {
 	uint32_t		bucket_changes;	/* num changes within the current bucket */
 	uint64_t		bucket_id;	/* 50ms bucket # */
 	struct fib_change_queue	fd_change_queue;/* list of scheduled entries */
+	uint32_t		queue_hiwat;	/* queue length at the last sync */
+	uint32_t		num_dirty;	/* # of chunks pending resync */
+	uint64_t		*dirty_chunks;	/* bitmap of chunks pending resync */
+	uint32_t		*nh_unref;	/* pending unrefs, by nhop index */
+	uint32_t		num_wide;	/* # of ranges wider than a chunk */
+	struct fib_range	wide[FIB_MAX_WIDE_RANGES];
+	struct fib_change_queue	fd_agg_queue;	/* aggregated routes of the ranges */
+};
+
+/* Route considered by the aggregation */
+struct fib_agg_entry {
+	struct fib_change_entry	ce;
+	struct rtentry		*rt;		/* dumped route */
+	bool			keep;		/* not covered by the same nhop */
 };
 
 /*
  * Data structure for the fib lookup instance tied to the particular rib.
  */
 struct fib_data {
-	uint32_t		number_nhops;	/* current # of nhops */
 	uint8_t			hit_nhops;	/* true if out of nhop limit */
 	uint8_t			init_done;	/* true if init is competed */
 	uint32_t		fd_dead:1;	/* Scheduled for deletion */
 	uint32_t		fd_linked:1;	/* true if linked */
 	uint32_t		fd_need_rebuild:1;	/* true if rebuild scheduled */
 	uint32_t		fd_batch:1;	/* true if batched notification scheduled */
+	uint32_t		fd_range:1;	/* true if changes are resynced by range */
+	uint32_t		fd_bg_build:1;	/* true if built in the background */
+	uint32_t		fd_bg_failed:1;	/* true if changes were lost during build */
+	uint32_t		fd_bg_pending:1;	/* true if being replaced in the background */
 	uint8_t			fd_family;	/* family */
 	uint32_t		fd_fibnum;	/* fibnum */
 	uint32_t		fd_failed_rebuilds;	/* stat: failed rebuilds */
@@ -178,8 +321,9 @@ struct fib_data {
 	struct callout		fd_callout;	/* rebuild callout */
 	enum fib_callout_action	fd_callout_action;	/* Callout action to take */
 	void			*fd_algo_data;	/* algorithm data */
-	struct nhop_object	**nh_idx;	/* nhop idx->ptr array */
-	struct nhop_ref_table	*nh_ref_table;	/* array with # of nhop references */
+	struct nhop_ref_table	*nh_ref_table;	/* nhop index table */
+	struct nhop_release_data	*fd_nh_released;	/* indexes to reuse */
+	u_int			fd_nh_releasing;	/* # of pending nhop releases */
 	struct rib_head		*fd_rh;		/* RIB table we're attached to */
 	struct rib_subscription	*fd_rs;		/* storing table subscription */
 	struct fib_dp		fd_dp;		/* fib datapath data */
@@ -193,12 +337,13 @@ struct fib_data {
 
 static bool rebuild_fd(struct fib_data *fd, const char *reason);
 static bool rebuild_fd_flm(struct fib_data *fd, struct fib_lookup_module *flm_new);
+static bool schedule_bg_rebuild(struct fib_data *fd, struct fib_lookup_module *flm);
 static void handle_fd_callout(void *_data);
 static void destroy_fd_instance_epoch(epoch_context_t ctx);
-static bool is_idx_free(struct fib_data *fd, uint32_t index);
 static void set_algo_fixed(struct rib_head *rh);
 static bool is_algo_fixed(struct rib_head *rh);
 
+static struct nhop_ref_table *alloc_nhop_table(uint32_t size);
 static uint32_t fib_ref_nhop(struct fib_data *fd, struct nhop_object *nh);
 static void fib_unref_nhop(struct fib_data *fd, struct nhop_object *nh);
 
@@ -206,6 +351,10 @@ static struct fib_lookup_module *fib_check_best_algo(struct rib_head *rh,
     struct fib_lookup_module *orig_flm);
 static void fib_unref_algo(struct fib_lookup_module *flm);
 static bool flm_error_check(const struct fib_lookup_module *flm, uint32_t fibnum);
+static struct fib_lookup_module *fib_check_adaptive_algo(struct fib_data *fd);
+static void schedule_fd_probe(struct fib_data *fd);
+static void fib_score_clear_flm(struct fib_lookup_module *flm);
+static void fib_score_clear(void);
 
 struct mtx fib_mtx;
 #define	FIB_MOD_LOCK()		mtx_lock(&fib_mtx)
@@ -222,9 +371,20 @@ MTX_SYSINIT(fib_mtx, &fib_mtx, "algo list mutex", MTX_DEF);
 #define	ALGO_EVAL_NUM_ROUTES	100
 /* Try to setup algorithm X times */
 #define	FIB_MAX_TRIES		32
-/* Max amount of supported nexthops */
+/* Initial and max amount of supported nexthops */
+#define	FIB_MIN_NHOPS		16
 #define	FIB_MAX_NHOPS		262144
 #define	FIB_CALLOUT_DELAY_MS	50
+/* Max algo instances per rib synced directly at the end of a batch */
+#define	FIB_MAX_BATCH_FDS	4
+/* Minimum change queue size */
+#define	FIB_QUEUE_MIN_SIZE	256
+/* Chunk length of the partial rebuild ranges */
+#define	FIB_RANGE_CHUNK_INET	8
+#define	FIB_RANGE_CHUNK_INET6	16
+/* Number of sampled destinations and passes of a lookup cost probe */
+#define	FIB_PROBE_KEYS		1024
+#define	FIB_PROBE_ROUNDS	4
 
 
 /* Debug */
@@ -290,6 +450,31 @@ struct fib_error {
 VNET_DEFINE_STATIC(TAILQ_HEAD(fib_error_head, fib_error), fib_error_list);
 #define	V_fib_error_list VNET(fib_error_list)
 
+/* Measured cost of the lookup module in a particular rtable */
+struct fib_score {
+	uint32_t			fs_fibnum;
+	struct fib_lookup_module	*fs_flm;
+	uint64_t			fs_lookup_ps;	/* avg lookup time, 0 if unknown */
+	uint64_t			fs_mem;		/* footprint (bytes), 0 if unknown */
+	uint32_t			fs_num_prefixes;/* table size when measured */
+	struct timeval			fs_since;	/* ts of the switch to @fs_flm */
+	TAILQ_ENTRY(fib_score)		entries;
+};
+VNET_DEFINE_STATIC(TAILQ_HEAD(fib_score_head, fib_score), fib_score_list);
+#define	V_fib_score_list VNET(fib_score_list)
+
+/* Background rebuild request */
+struct fib_bg_req {
+	struct rib_head			*rh;
+	struct fib_lookup_module	*flm;		/* referenced algo to build */
+	uint32_t			old_gen;	/* gen# of the instance to replace */
+	TAILQ_ENTRY(fib_bg_req)		entries;
+};
+VNET_DEFINE_STATIC(TAILQ_HEAD(fib_bg_head, fib_bg_req), fib_bg_list);
+#define	V_fib_bg_list	VNET(fib_bg_list)
+VNET_DEFINE_STATIC(struct task, fib_bg_task);
+#define	V_fib_bg_task	VNET(fib_bg_task)
+
 /* Per-family array of fibnum -> {func, arg} mappings used in datapath */
 struct fib_dp_header {
 	struct epoch_context	fdh_epoch_ctx;
@@ -686,28 +871,8 @@ need_immediate_sync(struct fib_data *fd, struct rib_cmd_info *rc)
 	return (false);
 }
 
-static bool
-apply_rtable_changes(struct fib_data *fd)
-{
-	enum flm_op_result result;
-	struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
-
-	result = fd->fd_flm->flm_change_rib_items_cb(fd->fd_rh, q, fd->fd_algo_data);
-
-	if (result == FLM_SUCCESS) {
-		sync_rib_gen(fd);
-		for (int i = 0; i < q->count; i++)
-			if (q->entries[i].nh_old)
-				fib_unref_nhop(fd, q->entries[i].nh_old);
-		q->count = 0;
-	}
-	fd->fd_batch = false;
-
-	return (result == FLM_SUCCESS);
-}
-
-static bool
-fill_change_entry(struct fib_data *fd, struct fib_change_entry *ce, struct rib_cmd_info *rc)
+static void
+fill_change_prefix(struct fib_data *fd, struct fib_change_entry *ce, struct rib_cmd_info *rc)
 {
 	int plen = 0;
 
@@ -727,6 +892,13 @@ fill_change_entry(struct fib_data *fd, struct fib_change_entry *ce, struct rib_c
 	ce->plen = plen;
 	ce->nh_old = rc->rc_nh_old;
 	ce->nh_new = rc->rc_nh_new;
+}
+
+static bool
+fill_change_entry(struct fib_data *fd, struct fib_change_entry *ce, struct rib_cmd_info *rc)
+{
+
+	fill_change_prefix(fd, ce, rc);
 	if (ce->nh_new != NULL) {
 		if (fib_ref_nhop(fd, ce->nh_new) == 0)
 			return (false);
@@ -735,226 +907,981 @@ fill_change_entry(struct fib_data *fd, struct fib_change_entry *ce, struct rib_c
 	return (true);
 }
 
+/*
+ * Grows change queue @q to hold at least one more entry.
+ * An empty queue starts at the length reached by the previous sync.
+ */
 static bool
-queue_rtable_change(struct fib_data *fd, struct rib_cmd_info *rc)
+grow_change_queue(struct fib_data *fd, struct fib_change_queue *q)
 {
-	struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
+	uint32_t q_size;
 
-	if (q->count >= q->size) {
-		uint32_t q_size;
+	if (q->count < q->size)
+		return (true);
 
-		if (q->size == 0)
-			q_size = 256; /* ~18k memory */
-		else
-			q_size = q->size * 2;
+	if (q->size == 0)
+		q_size = MAX(FIB_QUEUE_MIN_SIZE, fd->fd_ss.queue_hiwat);
+	else
+		q_size = q->size * 2;
 
-		size_t size = q_size * sizeof(struct fib_change_entry);
-		void *a = realloc(q->entries, size, M_TEMP, M_NOWAIT | M_ZERO);
-		if (a == NULL) {
-			FD_PRINTF(LOG_INFO, fd, "Unable to realloc queue for %u elements",
-			    q_size);
-			return (false);
-		}
-		q->entries = a;
-		q->size = q_size;
+	size_t size = q_size * sizeof(struct fib_change_entry);
+	void *a = realloc(q->entries, size, M_TEMP, M_NOWAIT | M_ZERO);
+	if (a == NULL) {
+		FD_PRINTF(LOG_INFO, fd, "Unable to realloc queue for %u elements",
+		    q_size);
+		return (false);
 	}
+	q->entries = a;
+	q->size = q_size;
 
-	return (fill_change_entry(fd, &q->entries[q->count++], rc));
+	return (true);
 }
 
 /*
- * Rib subscription handler. Checks if the algorithm is ready to
- *  receive updates, handles nexthop refcounting and passes change
- *  data to the algorithm callback.
+ * Records the queue length of a completed sync and releases the queue
+ *  memory when the last sync used less than a quarter of it.
  */
 static void
-handle_rtable_change_cb(struct rib_head *rnh, struct rib_cmd_info *rc,
-    void *_data)
+trim_change_queue(struct fib_data *fd)
 {
-	struct fib_data *fd = (struct fib_data *)_data;
-	enum flm_op_result result;
-
-	RIB_WLOCK_ASSERT(rnh);
-
-	/*
-	 * There is a small gap between subscribing for route changes
-	 *  and initiating rtable dump. Avoid receiving route changes
-	 *  prior to finishing rtable dump by checking `init_done`.
-	 */
-	if (!fd->init_done)
-		return;
-
-	bool immediate_sync = need_immediate_sync(fd, rc);
-
-	/* Consider scheduling algorithm re-evaluation */
-	update_algo_state(fd);
+	struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
 
-	/*
-	 * If algo requested rebuild, stop sending updates by default.
-	 * This simplifies nexthop refcount handling logic.
-	 */
-	if (fd->fd_need_rebuild) {
-		if (immediate_sync)
-			rebuild_fd(fd, "rtable change type enforced sync");
-		return;
+	fd->fd_ss.queue_hiwat = q->count;
+	q->count = 0;
+	if (q->size > FIB_QUEUE_MIN_SIZE &&
+	    q->size / 4 > MAX(fd->fd_ss.queue_hiwat, FIB_QUEUE_MIN_SIZE)) {
+		free(q->entries, M_TEMP);
+		q->entries = NULL;
+		q->size = 0;
 	}
+}
 
-	/*
-	 * Algo requested updates to be delivered in batches.
-	 * Add the current change to the queue and return.
-	 */
-	if (fd->fd_batch) {
-		if (immediate_sync) {
-			if (!queue_rtable_change(fd, rc) || !apply_rtable_changes(fd))
-				rebuild_fd(fd, "batch sync failed");
-		} else {
-			if (!queue_rtable_change(fd, rc))
-				schedule_fd_rebuild(fd, "batch queue failed");
-		}
-		return;
-	}
+/*
+ * Returns the number of queued changes after which the changes are
+ *  resynced by range instead.
+ */
+static uint32_t
+get_queue_limit(const struct fib_data *fd)
+{
+	uint64_t limit;
 
-	/*
-	 * Maintain guarantee that every nexthop returned by the dataplane
-	 *  lookup has > 0 refcount, so can be safely referenced within current
-	 *  epoch.
-	 */
-	if (rc->rc_nh_new != NULL) {
-		if (fib_ref_nhop(fd, rc->rc_nh_new) == 0) {
-			/* ran out of indexes */
-			schedule_fd_rebuild(fd, "ran out of nhop indexes");
-			return;
-		}
-	}
+	limit = (uint64_t)fd->fd_rh->rnh_prefixes * V_fib_queue_limit_pct / 100;
 
-	result = fd->fd_flm->flm_change_rib_item_cb(rnh, rc, fd->fd_algo_data);
+	return (MAX(limit, FIB_QUEUE_MIN_SIZE));
+}
 
-	switch (result) {
-	case FLM_SUCCESS:
-		sync_rib_gen(fd);
-		/* Unref old nexthop on success */
-		if (rc->rc_nh_old != NULL)
-			fib_unref_nhop(fd, rc->rc_nh_old);
-		break;
-	case FLM_BATCH:
+static int
+range_chunk_plen(const struct fib_data *fd)
+{
 
-		/*
-		 * Algo asks to batch the changes.
-		 */
-		if (queue_rtable_change(fd, rc)) {
-			if (!immediate_sync) {
-				fd->fd_batch = true;
-				mark_diverge_time(fd);
-				update_rebuild_delay(fd, FDA_BATCH);
-				break;
-			}
-			if (apply_rtable_changes(fd))
-				break;
-		}
-		FD_PRINTF(LOG_ERR, fd, "batched sync failed, force the rebuild");
+	if (fd->fd_family == AF_INET6)
+		return (FIB_RANGE_CHUNK_INET6);
+	return (FIB_RANGE_CHUNK_INET);
+}
 
-	case FLM_REBUILD:
+static uint32_t
+range_chunk_idx(const struct fib_data *fd, const uint8_t *addr)
+{
 
-		/*
-		 * Algo is not able to apply the update.
-		 * Schedule algo rebuild.
-		 */
-		if (!immediate_sync) {
-			mark_diverge_time(fd);
-			schedule_fd_rebuild(fd, "algo requested rebuild");
-			break;
-		}
+	if (range_chunk_plen(fd) == 16)
+		return ((addr[0] << 8) | addr[1]);
+	return (addr[0]);
+}
 
-		FD_PRINTF(LOG_INFO, fd, "running sync rebuild");
-		rebuild_fd(fd, "rtable change type enforced sync");
-		break;
-	case FLM_ERROR:
+/*
+ * Returns true if the first @plen bits of @a and @b are equal.
+ */
+static bool
+prefix_match(const uint8_t *a, const uint8_t *b, int plen)
+{
+	int i;
 
-		/*
-		 * Algo reported a non-recoverable error.
-		 * Record the error and schedule rebuild, which will
-		 *  trigger best algo selection.
-		 */
-		FD_PRINTF(LOG_ERR, fd, "algo reported non-recoverable error");
-		if (!flm_error_add(fd->fd_flm, fd->fd_fibnum))
-			FD_PRINTF(LOG_ERR, fd, "failed to ban algo");
-		schedule_fd_rebuild(fd, "algo reported non-recoverable error");
+	for (i = 0; plen >= 8; i++, plen -= 8) {
+		if (a[i] != b[i])
+			return (false);
 	}
+
+	return (plen == 0 || ((a[i] ^ b[i]) & (0xff00 >> plen) & 0xff) == 0);
 }
 
-static void
-estimate_nhop_scale(const struct fib_data *old_fd, struct fib_data *fd)
+static bool
+alloc_range_state(struct fib_data *fd)
 {
+	struct fib_sync_status *fd_ss = &fd->fd_ss;
+	size_t size;
 
-	if (old_fd == NULL) {
-		// TODO: read from rtable
-		fd->number_nhops = 16;
-		return;
+	if (fd_ss->dirty_chunks == NULL) {
+		size = (1 << range_chunk_plen(fd)) / 8;
+		fd_ss->dirty_chunks = malloc(size, M_TEMP, M_NOWAIT | M_ZERO);
+	}
+	if (fd_ss->nh_unref == NULL) {
+		size = fd->nh_ref_table->size * sizeof(uint32_t);
+		fd_ss->nh_unref = malloc(size, M_TEMP, M_NOWAIT | M_ZERO);
+	}
+	if (fd_ss->dirty_chunks == NULL || fd_ss->nh_unref == NULL) {
+		FD_PRINTF(LOG_INFO, fd, "Unable to allocate range resync state");
+		return (false);
 	}
 
-	if (old_fd->hit_nhops && old_fd->number_nhops < FIB_MAX_NHOPS)
-		fd->number_nhops = 2 * old_fd->number_nhops;
-	else
-		fd->number_nhops = old_fd->number_nhops;
+	return (true);
 }
 
-struct walk_cbdata {
-	struct fib_data		*fd;
-	flm_dump_t		*func;
-	enum flm_op_result	result;
-};
-
 /*
- * Handler called after all rtenties have been dumped.
- * Performs post-dump framework checks and calls
- * algo:flm_dump_end_cb().
- *
- * Updates walk_cbdata result.
+ * Adds range @addr/@plen, wider than a chunk, to the set of wide ranges,
+ *  keeping them non-overlapping.
  */
-static void
-sync_algo_end_cb(struct rib_head *rnh, enum rib_walk_hook stage, void *_data)
+static bool
+add_wide_range(struct fib_data *fd, const uint8_t *addr, int plen)
 {
-	struct walk_cbdata *w = (struct walk_cbdata *)_data;
-	struct fib_data *fd = w->fd;
+	struct fib_sync_status *fd_ss = &fd->fd_ss;
+	struct fib_range *r;
+	uint32_t i, n;
 
-	RIB_WLOCK_ASSERT(w->fd->fd_rh);
+	for (i = 0; i < fd_ss->num_wide; i++) {
+		r = &fd_ss->wide[i];
+		if (r->plen <= plen &&
+		    prefix_match(addr, (const uint8_t *)&r->addr6, r->plen))
+			return (true);
+	}
 
-	if (rnh->rib_dying) {
-		w->result = FLM_ERROR;
-		return;
+	/* Drop the ranges covered by the new one */
+	for (i = 0, n = 0; i < fd_ss->num_wide; i++) {
+		r = &fd_ss->wide[i];
+		if (!prefix_match(addr, (const uint8_t *)&r->addr6, plen))
+			fd_ss->wide[n++] = *r;
 	}
+	fd_ss->num_wide = n;
 
-	if (fd->hit_nhops) {
-		FD_PRINTF(LOG_INFO, fd, "ran out of nexthops at %u nhops",
-		    fd->nh_ref_table->count);
-		if (w->result == FLM_SUCCESS)
-			w->result = FLM_REBUILD;
-		return;
+	if (n == FIB_MAX_WIDE_RANGES) {
+		FD_PRINTF(LOG_INFO, fd, "too many wide ranges to resync");
+		return (false);
 	}
+	r = &fd_ss->wide[fd_ss->num_wide++];
+	memset(r, 0, sizeof(*r));
+	memcpy(&r->addr6, addr, fd->fd_family == AF_INET6 ? 16 : 4);
+	r->plen = plen;
 
-	if (stage != RIB_WALK_HOOK_POST || w->result != FLM_SUCCESS)
-		return;
+	return (true);
+}
 
-	/* Post-dump hook, dump successful */
-	w->result = fd->fd_flm->flm_dump_end_cb(fd->fd_algo_data, &fd->fd_dp);
+/*
+ * Marks the range holding the prefix of @ce for resync and defers the
+ *  release of its old nexthop till then.
+ * The new nexthop is expected to be referenced already.
+ */
+static bool
+mark_range_change(struct fib_data *fd, const struct fib_change_entry *ce)
+{
+	struct fib_sync_status *fd_ss = &fd->fd_ss;
+	const uint8_t *addr = (const uint8_t *)&ce->addr6;
+	uint32_t idx;
 
-	if (w->result == FLM_SUCCESS) {
-		/* Mark init as done to allow routing updates */
-		fd->init_done = 1;
+	if (!fd->fd_range) {
+		if (!alloc_range_state(fd))
+			return (false);
+		fd->fd_range = true;
 	}
+
+	if (ce->plen >= range_chunk_plen(fd)) {
+		idx = range_chunk_idx(fd, addr);
+		if ((fd_ss->dirty_chunks[idx / 64] & (1ULL << (idx % 64))) == 0) {
+			fd_ss->dirty_chunks[idx / 64] |= 1ULL << (idx % 64);
+			fd_ss->num_dirty++;
+		}
+	} else if (!add_wide_range(fd, addr, ce->plen))
+		return (false);
+
+	if (ce->nh_old != NULL)
+		fd_ss->nh_unref[fib_get_nhop_idx(fd, ce->nh_old)]++;
+
+	return (true);
 }
 
 /*
- * Callback for each entry in rib.
- * Calls algo:flm_dump_rib_item_cb func as a part of initial
- *  route table synchronisation.
+ * Moves all queued changes to the ranges pending resync.
  */
-static int
-sync_algo_cb(struct rtentry *rt, void *_data)
+static bool
+spill_change_queue(struct fib_data *fd)
 {
-	struct walk_cbdata *w = (struct walk_cbdata *)_data;
-
-	RIB_WLOCK_ASSERT(w->fd->fd_rh);
+	struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
+
+	for (uint32_t i = 0; i < q->count; i++) {
+		if (!mark_range_change(fd, &q->entries[i]))
+			return (false);
+	}
+	FD_PRINTF(LOG_INFO, fd, "switching %u queued changes to range resync",
+	    q->count);
+	fd->fd_ss.queue_hiwat = q->count;
+	q->count = 0;
+
+	return (true);
+}
+
+/*
+ * Records rib change @rc whose new nexthop is already referenced.
+ */
+static bool
+record_range_change(struct fib_data *fd, struct rib_cmd_info *rc)
+{
+	struct fib_change_entry ce;
+
+	fill_change_prefix(fd, &ce, rc);
+
+	return (mark_range_change(fd, &ce));
+}
+
+struct range_walk_cbdata {
+	struct fib_data		*fd;
+	struct fib_range	*r;
+	struct fib_change_queue	*q;
+};
+
+/*
+ * Callback for each entry below the resynced range.
+ * Appends the routes inside the range to the queue.
+ */
+static int
+sync_range_cb(struct rtentry *rt, void *_data)
+{
+	struct range_walk_cbdata *w = (struct range_walk_cbdata *)_data;
+	struct fib_data *fd = w->fd;
+	struct fib_change_entry *ce;
+	int plen = 0;
+
+	RIB_WLOCK_ASSERT(fd->fd_rh);
+
+	if (!grow_change_queue(fd, w->q))
+		return (ENOMEM);
+	ce = &w->q->entries[w->q->count];
+
+	switch (fd->fd_family) {
+#ifdef INET
+	case AF_INET:
+		rt_get_inet_prefix_plen(rt, &ce->addr4, &plen, &ce->scopeid);
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		rt_get_inet6_prefix_plen(rt, &ce->addr6, &plen, &ce->scopeid);
+		break;
+#endif
+	}
+
+	/* The walk may include wider prefixes sharing the subtree */
+	if (plen < w->r->plen || !prefix_match((const uint8_t *)&ce->addr6,
+	    (const uint8_t *)&w->r->addr6, w->r->plen))
+		return (0);
+
+	ce->plen = plen;
+	ce->nh_old = NULL;
+	ce->nh_new = rt_get_raw_nhop(rt);
+	w->q->count++;
+	w->r->count++;
+
+	return (0);
+}
+
+static bool
+is_fd_aggregated(const struct fib_data *fd)
+{
+
+	return ((fd->fd_flm->flm_flags & FLM_F_AGGREGATE) != 0);
+}
+
+static int
+agg_entry_cmp(const void *_a, const void *_b)
+{
+	const struct fib_agg_entry *a = _a, *b = _b;
+	int r;
+
+	r = memcmp(&a->ce.addr6, &b->ce.addr6, sizeof(struct in6_addr));
+	if (r != 0)
+		return (r);
+
+	return ((int)a->ce.plen - (int)b->ce.plen);
+}
+
+/*
+ * Marks the entries of @e which are not covered by a prefix with the same
+ *  nexthop. @e is sorted by address, then plen, and @cover_nh is the
+ *  nexthop of the closest route covering all of @e, if any.
+ *
+ * Returns the number of entries to keep.
+ */
+static uint32_t
+aggregate_entries(struct fib_agg_entry *e, uint32_t count,
+    struct nhop_object *cover_nh)
+{
+	uint32_t stack[129], n = 0;
+	struct nhop_object *nh;
+	int sp = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		while (sp > 0 && !prefix_match((const uint8_t *)&e[i].ce.addr6,
+		    (const uint8_t *)&e[stack[sp - 1]].ce.addr6,
+		    e[stack[sp - 1]].ce.plen))
+			sp--;
+		nh = (sp > 0) ? e[stack[sp - 1]].ce.nh_new : cover_nh;
+		e[i].keep = (e[i].ce.nh_new != nh);
+		if (e[i].keep)
+			n++;
+		stack[sp++] = i;
+	}
+
+	return (n);
+}
+
+/*
+ * Returns the nexthop of the closest rib route wider than @plen covering
+ *  @dst, or NULL. @dst is masked in the process.
+ */
+static struct nhop_object *
+find_cover_nhop(struct fib_data *fd, struct sockaddr *dst, int plen)
+{
+	struct route_nhop_data rnd;
+
+	for (int l = plen - 1; l >= 0; l--) {
+		if (rib_lookup_prefix_plen(fd->fd_rh, dst, l, &rnd) != NULL)
+			return (rnd.rnd_nhop);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Leaves out the routes of range @r, just walked to the queue of @rq,
+ *  that are covered by a route with the same nexthop. @dst is the
+ *  range prefix.
+ */
+static bool
+aggregate_range(struct fib_data *fd, struct fib_range_queue *rq,
+    struct fib_range *r, struct sockaddr *dst)
+{
+	struct fib_change_entry *ce = &rq->q->entries[r->start];
+	struct fib_agg_entry *e;
+	uint32_t i, n;
+
+	if (r->count == 0)
+		return (true);
+	e = malloc(sizeof(struct fib_agg_entry) * r->count, M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (e == NULL) {
+		FD_PRINTF(LOG_INFO, fd, "Unable to aggregate %u routes", r->count);
+		return (false);
+	}
+
+	for (i = 0; i < r->count; i++) {
+		if (fd->fd_family == AF_INET6)
+			e[i].ce.addr6 = ce[i].addr6;
+		else
+			e[i].ce.addr4 = ce[i].addr4;
+		e[i].ce.scopeid = ce[i].scopeid;
+		e[i].ce.plen = ce[i].plen;
+		e[i].ce.nh_new = ce[i].nh_new;
+	}
+	qsort(e, r->count, sizeof(struct fib_agg_entry), agg_entry_cmp);
+	aggregate_entries(e, r->count, find_cover_nhop(fd, dst, r->plen));
+
+	for (i = 0, n = 0; i < r->count; i++) {
+		if (e[i].keep)
+			ce[n++] = e[i].ce;
+	}
+	free(e, M_TEMP);
+	rq->q->count = r->start + n;
+	r->count = n;
+
+	return (true);
+}
+
+/*
+ * Appends the rib routes inside range @r to the queue of @rq.
+ * Routes are aggregated if the algo asks for it.
+ */
+static bool
+walk_range(struct fib_data *fd, struct fib_range_queue *rq, struct fib_range *r)
+{
+	struct range_walk_cbdata w = { .fd = fd, .r = r, .q = rq->q };
+	struct sockaddr_storage ss_dst, ss_mask;
+	int error;
+
+	memset(&ss_dst, 0, sizeof(ss_dst));
+	memset(&ss_mask, 0, sizeof(ss_mask));
+
+	switch (fd->fd_family) {
+#ifdef INET
+	case AF_INET:
+		{
+			struct sockaddr_in *dst = (struct sockaddr_in *)&ss_dst;
+			struct sockaddr_in *mask = (struct sockaddr_in *)&ss_mask;
+
+			dst->sin_len = mask->sin_len = sizeof(struct sockaddr_in);
+			dst->sin_family = mask->sin_family = AF_INET;
+			dst->sin_addr = r->addr4;
+			mask->sin_addr.s_addr = htonl(r->plen ?
+			    0xFFFFFFFF << (32 - r->plen) : 0);
+		}
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		{
+			struct sockaddr_in6 *dst = (struct sockaddr_in6 *)&ss_dst;
+			struct sockaddr_in6 *mask = (struct sockaddr_in6 *)&ss_mask;
+
+			dst->sin6_len = mask->sin6_len = sizeof(struct sockaddr_in6);
+			dst->sin6_family = mask->sin6_family = AF_INET6;
+			dst->sin6_addr = r->addr6;
+			ip6_writemask(&mask->sin6_addr, r->plen);
+		}
+		break;
+#endif
+	}
+
+	r->start = rq->q->count;
+	r->count = 0;
+	error = fd->fd_rh->rnh_walktree_from(&fd->fd_rh->head, &ss_dst, &ss_mask,
+	    (walktree_f_t *)sync_range_cb, &w);
+	if (error == 0 && is_fd_aggregated(fd))
+		return (aggregate_range(fd, rq, r, (struct sockaddr *)&ss_dst));
+
+	return (error == 0);
+}
+
+static void
+set_chunk_range(struct fib_data *fd, struct fib_range *r, uint32_t idx)
+{
+	uint8_t *addr = (uint8_t *)&r->addr6;
+
+	memset(r, 0, sizeof(*r));
+	r->plen = range_chunk_plen(fd);
+	if (r->plen == 16) {
+		addr[0] = idx >> 8;
+		addr[1] = idx & 0xFF;
+	} else
+		addr[0] = idx;
+}
+
+/*
+ * Resyncs the algo with the rib routes of all dirty ranges.
+ * Releases the nexthops of the replaced routes on success.
+ */
+static bool
+apply_range_changes(struct fib_data *fd)
+{
+	struct fib_sync_status *fd_ss = &fd->fd_ss;
+	struct fib_range_queue rq = { .q = &fd_ss->fd_change_queue };
+	struct fib_range *wide = fd_ss->wide, tmp;
+	struct nhop_ref_table *tab;
+	enum flm_op_result result = FLM_REBUILD;
+	uint32_t i, j, idx, end, num_chunks;
+	int alen = (fd->fd_family == AF_INET6) ? 16 : 4;
+
+	RIB_WLOCK_ASSERT(fd->fd_rh);
+	KASSERT(rq.q->count == 0, ("change queue not spilled"));
+
+	rq.ranges = malloc(sizeof(struct fib_range) *
+	    (fd_ss->num_dirty + fd_ss->num_wide), M_TEMP, M_NOWAIT | M_ZERO);
+	if (rq.ranges == NULL) {
+		FD_PRINTF(LOG_INFO, fd, "Unable to allocate %u ranges",
+		    fd_ss->num_dirty + fd_ss->num_wide);
+		return (false);
+	}
+
+	/* Wide ranges do not overlap, order them by address */
+	for (i = 1; i < fd_ss->num_wide; i++) {
+		for (j = i; j > 0 && memcmp(&wide[j - 1].addr6, &wide[j].addr6,
+		    alen) > 0; j--) {
+			tmp = wide[j];
+			wide[j] = wide[j - 1];
+			wide[j - 1] = tmp;
+		}
+	}
+
+	/* Interleave the dirty chunks with the wide ranges covering them */
+	num_chunks = 1 << range_chunk_plen(fd);
+	idx = 0;
+	for (i = 0; i <= fd_ss->num_wide; i++) {
+		end = num_chunks;
+		if (i < fd_ss->num_wide)
+			end = range_chunk_idx(fd, (const uint8_t *)&wide[i].addr6);
+		for (; idx < end; idx++) {
+			if ((fd_ss->dirty_chunks[idx / 64] & (1ULL << (idx % 64))) == 0)
+				continue;
+			set_chunk_range(fd, &rq.ranges[rq.num_ranges], idx);
+			if (!walk_range(fd, &rq, &rq.ranges[rq.num_ranges++]))
+				goto done;
+		}
+		if (i == fd_ss->num_wide)
+			break;
+		rq.ranges[rq.num_ranges] = wide[i];
+		if (!walk_range(fd, &rq, &rq.ranges[rq.num_ranges++]))
+			goto done;
+		idx = end + (1 << (range_chunk_plen(fd) - wide[i].plen));
+	}
+
+	result = fd->fd_flm->flm_change_range_cb(fd->fd_rh, &rq, fd->fd_algo_data);
+done:
+	FD_PRINTF(LOG_INFO, fd, "range resync: %u ranges, %u routes, result: %s",
+	    rq.num_ranges, rq.q->count, print_op_result(result));
+	free(rq.ranges, M_TEMP);
+	/* Walked routes carry no references */
+	rq.q->count = 0;
+	if (result != FLM_SUCCESS)
+		return (false);
+
+	sync_rib_gen(fd);
+	tab = fd->nh_ref_table;
+	for (idx = 0; idx < tab->size; idx++) {
+		for (; fd_ss->nh_unref[idx] > 0; fd_ss->nh_unref[idx]--)
+			fib_unref_nhop(fd, tab->nh_idx[idx]);
+	}
+	memset(fd_ss->dirty_chunks, 0, num_chunks / 8);
+	fd_ss->num_dirty = 0;
+	fd_ss->num_wide = 0;
+	fd->fd_range = false;
+
+	return (true);
+}
+
+static int
+range_cmp(const void *_a, const void *_b)
+{
+	const struct fib_range *a = _a, *b = _b;
+	int r;
+
+	r = memcmp(&a->addr6, &b->addr6, sizeof(struct in6_addr));
+	if (r != 0)
+		return (r);
+
+	return ((int)a->plen - (int)b->plen);
+}
+
+/*
+ * Applies the queued changes to the aggregating algo by resyncing the
+ *  changed prefixes: aggregation of a route only depends on the routes
+ *  covering it.
+ * Releases the nexthops of the replaced routes on success.
+ */
+static bool
+apply_agg_changes(struct fib_data *fd)
+{
+	struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
+	struct fib_range_queue rq = { .q = &fd->fd_ss.fd_agg_queue };
+	struct fib_range *r;
+	enum flm_op_result result = FLM_REBUILD;
+	uint32_t i, n;
+
+	RIB_WLOCK_ASSERT(fd->fd_rh);
+
+	rq.ranges = malloc(sizeof(struct fib_range) * (q->count + 1), M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (rq.ranges == NULL) {
+		FD_PRINTF(LOG_INFO, fd, "Unable to allocate %u ranges", q->count);
+		return (false);
+	}
+	for (i = 0; i < q->count; i++) {
+		if (fd->fd_family == AF_INET6)
+			rq.ranges[i].addr6 = q->entries[i].addr6;
+		else
+			rq.ranges[i].addr4 = q->entries[i].addr4;
+		rq.ranges[i].plen = q->entries[i].plen;
+	}
+
+	/* Keep the outermost prefixes only, so that ranges do not overlap */
+	qsort(rq.ranges, q->count, sizeof(struct fib_range), range_cmp);
+	for (i = 0, n = 0; i < q->count; i++) {
+		r = &rq.ranges[i];
+		if (n > 0 && prefix_match((const uint8_t *)&r->addr6,
+		    (const uint8_t *)&rq.ranges[n - 1].addr6, rq.ranges[n - 1].plen))
+			continue;
+		rq.ranges[n++] = *r;
+	}
+	for (i = 0; i < n; i++) {
+		rq.num_ranges++;
+		if (!walk_range(fd, &rq, &rq.ranges[i]))
+			goto done;
+	}
+
+	result = fd->fd_flm->flm_change_range_cb(fd->fd_rh, &rq, fd->fd_algo_data);
+done:
+	FD_PRINTF(LOG_DEBUG, fd, "aggregated sync: %u changes, %u ranges, "
+	    "%u routes, result: %s", q->count, rq.num_ranges, rq.q->count,
+	    print_op_result(result));
+	free(rq.ranges, M_TEMP);
+	/* Walked routes carry no references */
+	rq.q->count = 0;
+	if (result != FLM_SUCCESS)
+		return (false);
+
+	sync_rib_gen(fd);
+	for (i = 0; i < q->count; i++) {
+		if (q->entries[i].nh_old != NULL)
+			fib_unref_nhop(fd, q->entries[i].nh_old);
+	}
+	trim_change_queue(fd);
+
+	return (true);
+}
+
+static bool
+apply_rtable_changes(struct fib_data *fd)
+{
+	enum flm_op_result result;
+	struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
+
+	fd->fd_batch = false;
+	if (fd->fd_range)
+		return (apply_range_changes(fd));
+	if (is_fd_aggregated(fd))
+		return (apply_agg_changes(fd));
+
+	result = fd->fd_flm->flm_change_rib_items_cb(fd->fd_rh, q, fd->fd_algo_data);
+
+	if (result == FLM_REBUILD && fd->fd_flm->flm_change_range_cb != NULL) {
+		/* Resync the ranges holding the changes instead */
+		return (spill_change_queue(fd) && apply_range_changes(fd));
+	}
+
+	if (result == FLM_SUCCESS) {
+		sync_rib_gen(fd);
+		for (int i = 0; i < q->count; i++)
+			if (q->entries[i].nh_old)
+				fib_unref_nhop(fd, q->entries[i].nh_old);
+		trim_change_queue(fd);
+	}
+
+	return (result == FLM_SUCCESS);
+}
+
+static bool
+queue_rtable_change(struct fib_data *fd, struct rib_cmd_info *rc)
+{
+	struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
+	struct fib_change_entry ce;
+
+	if (!fd->fd_range) {
+		bool range_ok = fd->fd_flm->flm_change_range_cb != NULL;
+
+		if (q->count < q->size || (!(range_ok && q->count >= get_queue_limit(fd)) &&
+		    grow_change_queue(fd, q)))
+			return (fill_change_entry(fd, &q->entries[q->count++], rc));
+
+		/* Queue is over the limit, resync by range */
+		if (!range_ok || !spill_change_queue(fd))
+			return (false);
+	}
+
+	return (fill_change_entry(fd, &ce, rc) && mark_range_change(fd, &ce));
+}
+
+/*
+ * Rib subscription handler. Checks if the algorithm is ready to
+ *  receive updates, handles nexthop refcounting and passes change
+ *  data to the algorithm callback.
+ */
+static void
+handle_rtable_change_cb(struct rib_head *rnh, struct rib_cmd_info *rc,
+    void *_data)
+{
+	struct fib_data *fd = (struct fib_data *)_data;
+	enum flm_op_result result;
+
+	RIB_WLOCK_ASSERT(rnh);
+
+	/*
+	 * Instance is being built in the background, queue everything
+	 *  for the replay.
+	 */
+	if (fd->fd_bg_build) {
+		struct fib_change_queue *q = &fd->fd_ss.fd_change_queue;
+
+		if (!fd->fd_bg_failed && (!grow_change_queue(fd, q) ||
+		    !fill_change_entry(fd, &q->entries[q->count++], rc)))
+			fd->fd_bg_failed = true;
+		return;
+	}
+
+	/*
+	 * There is a small gap between subscribing for route changes
+	 *  and initiating rtable dump. Avoid receiving route changes
+	 *  prior to finishing rtable dump by checking `init_done`.
+	 */
+	if (!fd->init_done)
+		return;
+
+	bool immediate_sync = need_immediate_sync(fd, rc);
+
+	/* Consider scheduling algorithm re-evaluation */
+	update_algo_state(fd);
+
+	/*
+	 * If algo requested rebuild, stop sending updates by default.
+	 * This simplifies nexthop refcount handling logic.
+	 */
+	if (fd->fd_need_rebuild) {
+		if (immediate_sync)
+			rebuild_fd(fd, "rtable change type enforced sync");
+		return;
+	}
+
+	/*
+	 * Changes made by rib_{add,del}_routes_batch() are queued and
+	 *  delivered in a single batch by fib_rib_batch_end(), before the
+	 *  rib lock is released.
+	 */
+	if (rnh->rib_batch && (fd->fd_flm->flm_change_rib_items_cb != NULL ||
+	    is_fd_aggregated(fd))) {
+		if (!queue_rtable_change(fd, rc))
+			schedule_fd_rebuild(fd, "batch queue failed");
+		return;
+	}
+
+	/*
+	 * Aggregating algos get all changes in batches, see
+	 *  apply_agg_changes().
+	 */
+	if (!fd->fd_batch && is_fd_aggregated(fd)) {
+		if (!queue_rtable_change(fd, rc))
+			schedule_fd_rebuild(fd, "batch queue failed");
+		else if (immediate_sync) {
+			if (!apply_rtable_changes(fd))
+				rebuild_fd(fd, "batch sync failed");
+		} else {
+			fd->fd_batch = true;
+			mark_diverge_time(fd);
+			update_rebuild_delay(fd, FDA_BATCH);
+		}
+		return;
+	}
+
+	/*
+	 * Algo requested updates to be delivered in batches.
+	 * Add the current change to the queue and return.
+	 */
+	if (fd->fd_batch) {
+		if (immediate_sync) {
+			if (!queue_rtable_change(fd, rc) || !apply_rtable_changes(fd))
+				rebuild_fd(fd, "batch sync failed");
+		} else {
+			if (!queue_rtable_change(fd, rc))
+				schedule_fd_rebuild(fd, "batch queue failed");
+		}
+		return;
+	}
+
+	/*
+	 * Maintain guarantee that every nexthop returned by the dataplane
+	 *  lookup has > 0 refcount, so can be safely referenced within current
+	 *  epoch.
+	 */
+	if (rc->rc_nh_new != NULL) {
+		if (fib_ref_nhop(fd, rc->rc_nh_new) == 0) {
+			/* ran out of indexes */
+			schedule_fd_rebuild(fd, "ran out of nhop indexes");
+			return;
+		}
+	}
+
+	result = fd->fd_flm->flm_change_rib_item_cb(rnh, rc, fd->fd_algo_data);
+
+	switch (result) {
+	case FLM_SUCCESS:
+		sync_rib_gen(fd);
+		/* Unref old nexthop on success */
+		if (rc->rc_nh_old != NULL)
+			fib_unref_nhop(fd, rc->rc_nh_old);
+		break;
+	case FLM_BATCH:
+
+		/*
+		 * Algo asks to batch the changes.
+		 */
+		if (queue_rtable_change(fd, rc)) {
+			if (!immediate_sync) {
+				fd->fd_batch = true;
+				mark_diverge_time(fd);
+				update_rebuild_delay(fd, FDA_BATCH);
+				break;
+			}
+			if (apply_rtable_changes(fd))
+				break;
+		}
+		FD_PRINTF(LOG_ERR, fd, "batched sync failed, force the rebuild");
+
+	case FLM_REBUILD:
+
+		/*
+		 * Algo is not able to apply the update.
+		 * Resync the range holding the change if the algo supports
+		 *  it, schedule algo rebuild otherwise.
+		 */
+		if (result == FLM_REBUILD && fd->fd_flm->flm_change_range_cb != NULL &&
+		    record_range_change(fd, rc)) {
+			if (!immediate_sync) {
+				fd->fd_batch = true;
+				mark_diverge_time(fd);
+				update_rebuild_delay(fd, FDA_BATCH);
+				break;
+			}
+			if (apply_rtable_changes(fd))
+				break;
+		}
+		if (!immediate_sync) {
+			mark_diverge_time(fd);
+			schedule_fd_rebuild(fd, "algo requested rebuild");
+			break;
+		}
+
+		FD_PRINTF(LOG_INFO, fd, "running sync rebuild");
+		rebuild_fd(fd, "rtable change type enforced sync");
+		break;
+	case FLM_ERROR:
+
+		/*
+		 * Algo reported a non-recoverable error.
+		 * Record the error and schedule rebuild, which will
+		 *  trigger best algo selection.
+		 */
+		FD_PRINTF(LOG_ERR, fd, "algo reported non-recoverable error");
+		if (!flm_error_add(fd->fd_flm, fd->fd_fibnum))
+			FD_PRINTF(LOG_ERR, fd, "failed to ban algo");
+		schedule_fd_rebuild(fd, "algo reported non-recoverable error");
+	}
+}
+
+/*
+ * Returns the initial nhop table size, large enough to hold the nexthops
+ *  of @old_fd. The table grows on demand, so this only saves the regrowth.
+ */
+static uint32_t
+estimate_nhop_scale(const struct fib_data *old_fd)
+{
+	uint32_t size = FIB_MIN_NHOPS;
+
+	if (old_fd == NULL || old_fd->nh_ref_table == NULL)
+		return (size);
+
+	while (size <= old_fd->nh_ref_table->count && size < FIB_MAX_NHOPS)
+		size *= 2;
+
+	return (size);
+}
+
+struct walk_cbdata {
+	struct fib_data		*fd;
+	flm_dump_t		*func;
+	enum flm_op_result	result;
+	struct rtentry		**rts;		/* routes to aggregate */
+	uint32_t		count;
+	uint32_t		size;
+};
+
+/*
+ * Dumps the routes @rts, all rib routes, to the aggregating algo of @fd.
+ * Runs without the rib lock for the background builds.
+ */
+static enum flm_op_result
+dump_aggregated(struct fib_data *fd, struct rtentry **rts, uint32_t count)
+{
+	enum flm_op_result result = FLM_SUCCESS;
+	struct fib_agg_entry *e;
+	uint32_t i, n;
+	int plen = 0;
+
+	e = malloc(sizeof(struct fib_agg_entry) * (count + 1), M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (e == NULL) {
+		FD_PRINTF(LOG_INFO, fd, "Unable to aggregate %u routes", count);
+		return (FLM_REBUILD);
+	}
+
+	for (i = 0; i < count; i++) {
+		switch (fd->fd_family) {
+#ifdef INET
+		case AF_INET:
+			rt_get_inet_prefix_plen(rts[i], &e[i].ce.addr4, &plen,
+			    &e[i].ce.scopeid);
+			break;
+#endif
+#ifdef INET6
+		case AF_INET6:
+			rt_get_inet6_prefix_plen(rts[i], &e[i].ce.addr6, &plen,
+			    &e[i].ce.scopeid);
+			break;
+#endif
+		}
+		e[i].ce.plen = plen;
+		e[i].ce.nh_new = rt_get_raw_nhop(rts[i]);
+		e[i].rt = rts[i];
+	}
+	qsort(e, count, sizeof(struct fib_agg_entry), agg_entry_cmp);
+	n = aggregate_entries(e, count, NULL);
+
+	for (i = 0; i < count && result == FLM_SUCCESS; i++) {
+		if (e[i].keep)
+			result = fd->fd_flm->flm_dump_rib_item_cb(e[i].rt,
+			    fd->fd_algo_data);
+	}
+	free(e, M_TEMP);
+	FD_PRINTF(LOG_INFO, fd, "aggregated %u routes to %u", count, n);
+
+	return (result);
+}
+
+/*
+ * Handler called after all rtenties have been dumped.
+ * Performs post-dump framework checks and calls
+ * algo:flm_dump_end_cb().
+ *
+ * Updates walk_cbdata result.
+ */
+static void
+sync_algo_end_cb(struct rib_head *rnh, enum rib_walk_hook stage, void *_data)
+{
+	struct walk_cbdata *w = (struct walk_cbdata *)_data;
+	struct fib_data *fd = w->fd;
+
+	RIB_WLOCK_ASSERT(w->fd->fd_rh);
+
+	if (rnh->rib_dying) {
+		w->result = FLM_ERROR;
+		return;
+	}
+
+	if (fd->hit_nhops) {
+		FD_PRINTF(LOG_INFO, fd, "ran out of nexthops at %u nhops",
+		    fd->nh_ref_table->count);
+		if (w->result == FLM_SUCCESS)
+			w->result = FLM_REBUILD;
+		return;
+	}
+
+	if (stage != RIB_WALK_HOOK_POST || w->result != FLM_SUCCESS)
+		return;
+
+	/* Post-dump hook, dump successful */
+	if (w->rts != NULL)
+		w->result = dump_aggregated(fd, w->rts, w->count);
+	if (w->result == FLM_SUCCESS)
+		w->result = fd->fd_flm->flm_dump_end_cb(fd->fd_algo_data, &fd->fd_dp);
+
+	if (w->result == FLM_SUCCESS) {
+		/* Mark init as done to allow routing updates */
+		fd->init_done = 1;
+	}
+}
+
+/*
+ * Callback for each entry in rib.
+ * Calls algo:flm_dump_rib_item_cb func as a part of initial
+ *  route table synchronisation.
+ */
+static int
+sync_algo_cb(struct rtentry *rt, void *_data)
+{
+	struct walk_cbdata *w = (struct walk_cbdata *)_data;
+
+	RIB_WLOCK_ASSERT(w->fd->fd_rh);
 
 	if (w->result == FLM_SUCCESS && w->func) {
 
@@ -964,8 +1891,12 @@ sync_algo_cb(struct rtentry *rt, void *_data)
 		 *  and can be safely referenced within current epoch.
 		 */
 		struct nhop_object *nh = rt_get_raw_nhop(rt);
-		if (fib_ref_nhop(w->fd, nh) != 0)
+		if (fib_ref_nhop(w->fd, nh) == 0)
+			w->result = FLM_REBUILD;
+		else if (w->rts == NULL)
 			w->result = w->func(rt, w->fd->fd_algo_data);
+		else if (w->count < w->size)
+			w->rts[w->count++] = rt;
 		else
 			w->result = FLM_REBUILD;
 	}
@@ -985,7 +1916,17 @@ sync_algo(struct fib_data *fd)
 		.result = FLM_SUCCESS,
 	};
 
+	/* Aggregation needs all the routes, collect them first */
+	if (is_fd_aggregated(fd)) {
+		w.size = fd->fd_rh->rnh_prefixes;
+		w.rts = malloc(sizeof(struct rtentry *) * (w.size + 1), M_TEMP,
+		    M_NOWAIT);
+		if (w.rts == NULL)
+			return (FLM_REBUILD);
+	}
+
 	rib_walk_ext_locked(fd->fd_rh, sync_algo_cb, sync_algo_end_cb, &w);
+	free(w.rts, M_TEMP);
 
 	FD_PRINTF(LOG_INFO, fd,
 	    "initial dump completed (rtable version: %d), result: %s",
@@ -1076,6 +2017,44 @@ fib_cleanup_algo(struct rib_head *rh, bool keep_first, bool in_callout)
 	NET_EPOCH_EXIT(et);
 }
 
+/*
+ * Passes the changes queued during a batched rib update to every algo
+ *  instance attached to @rh in a single flm_change_rib_items_cb call.
+ */
+void
+fib_rib_batch_end(struct rib_head *rh)
+{
+	struct fib_data *fds[FIB_MAX_BATCH_FDS], *fd;
+	int count = 0;
+
+	NET_EPOCH_ASSERT();
+	RIB_WLOCK_ASSERT(rh);
+
+	FIB_MOD_LOCK();
+	TAILQ_FOREACH(fd, &V_fib_data_list, entries) {
+		if (fd->fd_rh != rh || fd->fd_dead || fd->fd_need_rebuild ||
+		    (fd->fd_ss.fd_change_queue.count == 0 && !fd->fd_range))
+			continue;
+		if (count < FIB_MAX_BATCH_FDS) {
+			fds[count++] = fd;
+			continue;
+		}
+		/* Unlikely: leave the rest to the batch callout */
+		if (!fd->fd_batch) {
+			fd->fd_batch = true;
+			mark_diverge_time(fd);
+			update_rebuild_delay(fd, FDA_BATCH);
+		}
+	}
+	FIB_MOD_UNLOCK();
+
+	/* Algo callbacks may update the datapath, which takes FIB_MOD_LOCK */
+	for (int i = 0; i < count; i++) {
+		if (!apply_rtable_changes(fds[i]))
+			rebuild_fd(fds[i], "batch sync failed");
+	}
+}
+
 void
 fib_destroy_rib(struct rib_head *rh)
 {
@@ -1085,6 +2064,7 @@ fib_destroy_rib(struct rib_head *rh)
 	 *  sync_algo() stage, preventing new entries to be added to the list
 	 *  of active algos. Remove all existing entries for the particular rib.
 	 */
+	fib_bg_drain(rh);
 	fib_cleanup_algo(rh, false, false);
 }
 
@@ -1094,6 +2074,8 @@ fib_destroy_rib(struct rib_head *rh)
 static void
 destroy_fd_instance(struct fib_data *fd)
 {
+	struct nhop_ref_table *tab, *prev;
+	struct nhop_release_data *nrd;
 
 	FD_PRINTF(LOG_INFO, fd, "destroy fd %p", fd);
 
@@ -1101,22 +2083,34 @@ destroy_fd_instance(struct fib_data *fd)
 	if (fd->fd_algo_data != NULL)
 		fd->fd_flm->flm_destroy_cb(fd->fd_algo_data);
 
-	/* Nhop table */
-	if ((fd->nh_idx != NULL) && (fd->nh_ref_table != NULL)) {
-		for (int i = 0; i < fd->number_nhops; i++) {
-			if (!is_idx_free(fd, i)) {
-				FD_PRINTF(LOG_DEBUG2, fd, " FREE nhop %d %p",
-				    i, fd->nh_idx[i]);
-				nhop_free_any(fd->nh_idx[i]);
+	/* Nhop table. Released indexes had their nexthops freed already. */
+	tab = fd->nh_ref_table;
+	if (tab != NULL) {
+		for (uint32_t i = 1; i < tab->size; i++) {
+			if (tab->refcnt[i] > 0) {
+				FD_PRINTF(LOG_DEBUG2, fd, " FREE nhop %u %p",
+				    i, tab->nh_idx[i]);
+				nhop_free_any(tab->nh_idx[i]);
 			}
 		}
-		free(fd->nh_idx, M_RTABLE);
 	}
-	if (fd->nh_ref_table != NULL)
-		free(fd->nh_ref_table, M_RTABLE);
+	for (; tab != NULL; tab = prev) {
+		prev = tab->prev;
+		free(tab, M_RTABLE);
+	}
+	while ((nrd = fd->fd_nh_released) != NULL) {
+		fd->fd_nh_released = nrd->next;
+		free(nrd, M_TEMP);
+	}
 
 	if (fd->fd_ss.fd_change_queue.entries != NULL)
 		free(fd->fd_ss.fd_change_queue.entries, M_TEMP);
+	if (fd->fd_ss.dirty_chunks != NULL)
+		free(fd->fd_ss.dirty_chunks, M_TEMP);
+	if (fd->fd_ss.nh_unref != NULL)
+		free(fd->fd_ss.nh_unref, M_TEMP);
+	if (fd->fd_ss.fd_agg_queue.entries != NULL)
+		free(fd->fd_ss.fd_agg_queue.entries, M_TEMP);
 
 	fib_unref_algo(fd->fd_flm);
 
@@ -1133,29 +2127,32 @@ destroy_fd_instance_epoch(epoch_context_t ctx)
 
 	fd = __containerof(ctx, struct fib_data, fd_epoch_ctx);
 
+	/* Nexthop releases scheduled before the detach refer to the fd */
+	if (atomic_load_acq_int(&fd->fd_nh_releasing) != 0) {
+		fib_epoch_call(destroy_fd_instance_epoch, &fd->fd_epoch_ctx);
+		return;
+	}
+
 	CURVNET_SET(fd->fd_vnet);
 	destroy_fd_instance(fd);
 	CURVNET_RESTORE();
 }
 
 /*
- * Tries to setup fd instance.
+ * Allocates fd instance.
  * - Allocates fd/nhop table
  * - Runs algo:flm_init_cb algo init
- * - Subscribes fd to the rib
- * - Runs rtable dump
- * - Adds instance to the list of active instances.
- *
- * Returns: operation result. Fills in @pfd with resulting fd on success.
  *
+ * Returns: operation result. Fills in @pfd with the allocated fd, which
+ *  needs to be destroyed on failure as well.
  */
 static enum flm_op_result
-try_setup_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
+alloc_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
     struct fib_data *old_fd, struct fib_data **pfd)
 {
 	struct fib_data *fd;
-	size_t size;
 	enum flm_op_result result;
+	uint32_t size;
 
 	/* Allocate */
 	fd = malloc(sizeof(struct fib_data), M_RTABLE, M_NOWAIT | M_ZERO);
@@ -1166,8 +2163,6 @@ try_setup_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
 	}
 	*pfd = fd;
 
-	estimate_nhop_scale(old_fd, fd);
-
 	fd->fd_rh = rh;
 	fd->fd_family = rh->rib_family;
 	fd->fd_fibnum = rh->rib_fibnum;
@@ -1182,31 +2177,45 @@ try_setup_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
 
 	FD_PRINTF(LOG_DEBUG, fd, "allocated fd %p", fd);
 
-	/* Allocate nhidx -> nhop_ptr table */
-	size = fd->number_nhops * sizeof(void *);
-	fd->nh_idx = malloc(size, M_RTABLE, M_NOWAIT | M_ZERO);
-	if (fd->nh_idx == NULL) {
-		FD_PRINTF(LOG_INFO, fd, "Unable to allocate nhop table idx (sz:%zu)", size);
-		return (FLM_REBUILD);
-	}
-
-	/* Allocate nhop index refcount table */
-	size = sizeof(struct nhop_ref_table);
-	size += fd->number_nhops * sizeof(uint32_t);
-	fd->nh_ref_table = malloc(size, M_RTABLE, M_NOWAIT | M_ZERO);
+	/* Allocate nhop index table */
+	size = estimate_nhop_scale(old_fd);
+	fd->nh_ref_table = alloc_nhop_table(size);
 	if (fd->nh_ref_table == NULL) {
-		FD_PRINTF(LOG_INFO, fd, "Unable to allocate nhop refcount table (sz:%zu)", size);
+		FD_PRINTF(LOG_INFO, fd, "Unable to allocate nhop table (%u indexes)", size);
 		return (FLM_REBUILD);
 	}
-	FD_PRINTF(LOG_DEBUG, fd, "Allocated %u nhop indexes", fd->number_nhops);
+	FD_PRINTF(LOG_DEBUG, fd, "Allocated %u nhop indexes", size);
 
 	/* Okay, we're ready for algo init */
 	void *old_algo_data = (old_fd != NULL) ? old_fd->fd_algo_data : NULL;
 	result = flm->flm_init_cb(fd->fd_fibnum, fd, old_algo_data, &fd->fd_algo_data);
-	if (result != FLM_SUCCESS) {
+	if (result != FLM_SUCCESS)
 		FD_PRINTF(LOG_INFO, fd, "%s algo init failed", flm->flm_name);
+
+	return (result);
+}
+
+/*
+ * Tries to setup fd instance.
+ * - Allocates fd instance, see alloc_fd_instance()
+ * - Subscribes fd to the rib
+ * - Runs rtable dump
+ * - Adds instance to the list of active instances.
+ *
+ * Returns: operation result. Fills in @pfd with resulting fd on success.
+ *
+ */
+static enum flm_op_result
+try_setup_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
+    struct fib_data *old_fd, struct fib_data **pfd)
+{
+	struct fib_data *fd;
+	enum flm_op_result result;
+
+	result = alloc_fd_instance(flm, rh, old_fd, pfd);
+	if (result != FLM_SUCCESS)
 		return (result);
-	}
+	fd = *pfd;
 
 	/* Try to subscribe */
 	if (flm->flm_change_rib_item_cb != NULL) {
@@ -1236,6 +2245,8 @@ try_setup_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
 	fd->fd_linked = true;
 	FIB_MOD_UNLOCK();
 
+	schedule_fd_probe(fd);
+
 	return (FLM_SUCCESS);
 }
 
@@ -1253,6 +2264,7 @@ setup_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
 	NET_EPOCH_ASSERT();
 	RIB_WLOCK_ASSERT(rh);
 
+	SDT_PROBE3(route, fib_algo, rebuild, start, rh, flm->flm_name, false);
 	prev_fd = orig_fd;
 	new_fd = NULL;
 	for (int i = 0; i < FIB_MAX_TRIES; i++) {
@@ -1303,6 +2315,8 @@ setup_fd_instance(struct fib_lookup_module *flm, struct rib_head *rh,
 			new_fd = NULL;
 		}
 	}
+	SDT_PROBE4(route, fib_algo, rebuild, done, rh, flm->flm_name, false,
+	    result);
 
 	*pfd = new_fd;
 	return (result);
@@ -1323,13 +2337,21 @@ execute_callout_action(struct fib_data *fd)
 	NET_EPOCH_ASSERT();
 	RIB_WLOCK_ASSERT(fd->fd_rh);
 
+	/* Instance is about to be replaced by the background rebuild */
+	if (fd->fd_bg_pending)
+		return (true);
+
 	fd->fd_need_rebuild = false;
 	fd->fd_batch = false;
 	fd->fd_num_changes = 0;
 
 	/* First, check if we're still OK to use this algo */
-	if (!is_algo_fixed(fd->fd_rh))
-		flm_new = fib_check_best_algo(fd->fd_rh, fd->fd_flm);
+	if (!is_algo_fixed(fd->fd_rh)) {
+		if (action == FDA_PROBE)
+			flm_new = fib_check_adaptive_algo(fd);
+		if (flm_new == NULL)
+			flm_new = fib_check_best_algo(fd->fd_rh, fd->fd_flm);
+	}
 	if (flm_new != NULL)
 		action = FDA_REBUILD;
 
@@ -1339,8 +2361,13 @@ execute_callout_action(struct fib_data *fd)
 			action = FDA_REBUILD;
 	}
 
-	if (action == FDA_REBUILD)
-		result = rebuild_fd_flm(fd, flm_new != NULL ? flm_new : fd->fd_flm);
+	if (action == FDA_REBUILD) {
+		struct fib_lookup_module *flm = flm_new != NULL ? flm_new : fd->fd_flm;
+
+		if (!schedule_bg_rebuild(fd, flm))
+			result = rebuild_fd_flm(fd, flm);
+	} else
+		schedule_fd_probe(fd);
 	if (flm_new != NULL)
 		fib_unref_algo(flm_new);
 
@@ -1396,26 +2423,292 @@ rebuild_fd_flm(struct fib_data *fd, struct fib_lookup_module *flm_new)
 	return (true);
 }
 
-static bool
-rebuild_fd(struct fib_data *fd, const char *reason)
+static bool
+rebuild_fd(struct fib_data *fd, const char *reason)
+{
+	struct fib_lookup_module *flm_new = NULL;
+	bool result;
+
+	if (!is_algo_fixed(fd->fd_rh))
+		flm_new = fib_check_best_algo(fd->fd_rh, fd->fd_flm);
+
+	FD_PRINTF(LOG_INFO, fd, "running sync rebuild: %s", reason);
+	result = rebuild_fd_flm(fd, flm_new != NULL ? flm_new : fd->fd_flm);
+	if (flm_new != NULL)
+		fib_unref_algo(flm_new);
+
+	if (!result) {
+		FD_PRINTF(LOG_ERR, fd, "sync rebuild failed");
+		schedule_fd_rebuild(fd, "sync rebuild failed");
+	}
+
+	return (result);
+}
+
+/*
+ * Queues the background build of a new @flm instance replacing @fd.
+ * Changes are not passed to @fd until it is replaced.
+ * Returns false if the rebuild has to be done synchronously.
+ */
+static bool
+schedule_bg_rebuild(struct fib_data *fd, struct fib_lookup_module *flm)
+{
+	struct fib_bg_req *req;
+
+	RIB_WLOCK_ASSERT(fd->fd_rh);
+
+	/* Failed background builds fall back to the synchronous one */
+	if (!V_fib_bg_rebuild || fd->fd_failed_rebuilds > 0 ||
+	    !(flm->flm_flags & FLM_F_UNLOCKED_DUMP) ||
+	    flm->flm_change_rib_items_cb == NULL)
+		return (false);
+
+	req = malloc(sizeof(struct fib_bg_req), M_RTABLE, M_NOWAIT | M_ZERO);
+	if (req == NULL)
+		return (false);
+	req->rh = fd->fd_rh;
+	req->flm = flm;
+	req->old_gen = fd->fd_gen;
+
+	FIB_MOD_LOCK();
+	flm->flm_refcount++;
+	TAILQ_INSERT_TAIL(&V_fib_bg_list, req, entries);
+	FIB_MOD_UNLOCK();
+
+	fd->fd_bg_pending = true;
+	fd->fd_need_rebuild = true;
+	taskqueue_enqueue(taskqueue_thread, &V_fib_bg_task);
+	FD_PRINTF(LOG_INFO, fd, "scheduled background rebuild (%s)", flm->flm_name);
+
+	return (true);
+}
+
+/*
+ * Returns the live instance with generation @gen attached to @rh.
+ */
+static struct fib_data *
+find_fd_gen(struct rib_head *rh, uint32_t gen)
+{
+	struct fib_data *fd;
+
+	RIB_WLOCK_ASSERT(rh);
+
+	FIB_MOD_LOCK();
+	TAILQ_FOREACH(fd, &V_fib_data_list, entries) {
+		if (fd->fd_rh == rh && fd->fd_gen == gen && !fd->fd_dead)
+			break;
+	}
+	FIB_MOD_UNLOCK();
+
+	return (fd);
+}
+
+struct snapshot_cbdata {
+	struct fib_data		*fd;
+	struct rtentry		**rts;
+	uint32_t		count;
+	uint32_t		size;
+};
+
+/*
+ * Callback for each entry in rib during the background rebuild snapshot.
+ * Saves the entry and references its nexthop.
+ */
+static int
+snapshot_rt_cb(struct rtentry *rt, void *_data)
+{
+	struct snapshot_cbdata *s = (struct snapshot_cbdata *)_data;
+
+	if (s->count == s->size || fib_ref_nhop(s->fd, rt_get_raw_nhop(rt)) == 0)
+		return (ENOMEM);
+	s->rts[s->count++] = rt;
+
+	return (0);
+}
+
+/*
+ * Builds a new instance for request @req and replaces the old one with it.
+ * The rtentries of the snapshot stay valid till the end of the epoch,
+ *  even if deleted meanwhile: these deletions are part of the replay.
+ */
+static void
+run_bg_rebuild(struct fib_bg_req *req)
+{
+	struct rib_head *rh = req->rh;
+	struct fib_lookup_module *flm = req->flm;
+	struct snapshot_cbdata s = {};
+	struct fib_data *fd = NULL, *old_fd;
+	struct fib_change_queue *q;
+	struct epoch_tracker et;
+	enum flm_op_result result;
+	uint32_t skip = 0, snap_gen = 0;
+	int error;
+	RIB_RLOCK_TRACKER;
+
+	NET_EPOCH_ENTER(et);
+
+	/* Setup the instance and queue rib changes from now on */
+	RIB_WLOCK(rh);
+	old_fd = find_fd_gen(rh, req->old_gen);
+	if (old_fd == NULL || rh->rib_dying) {
+		/* Replaced by a synchronous rebuild meanwhile */
+		RIB_WUNLOCK(rh);
+		NET_EPOCH_EXIT(et);
+		return;
+	}
+	SDT_PROBE3(route, fib_algo, rebuild, start, rh, flm->flm_name, true);
+	result = alloc_fd_instance(flm, rh, old_fd, &fd);
+	if (result == FLM_SUCCESS) {
+		fd->fd_bg_build = true;
+		fd->fd_rs = rib_subscribe_locked(rh, handle_rtable_change_cb, fd,
+		    RIB_NOTIFY_IMMEDIATE);
+		if (fd->fd_rs == NULL)
+			result = FLM_REBUILD;
+	}
+	RIB_WUNLOCK(rh);
+	if (result != FLM_SUCCESS)
+		goto fail;
+
+	/* Snapshot the rib; changes queued so far are part of it */
+	RIB_RLOCK(rh);
+	s.fd = fd;
+	s.size = rh->rnh_prefixes;
+	s.rts = malloc(sizeof(struct rtentry *) * (s.size + 1), M_TEMP, M_NOWAIT);
+	error = ENOMEM;
+	if (s.rts != NULL)
+		error = rh->rnh_walktree(&rh->head, (walktree_f_t *)snapshot_rt_cb, &s);
+	skip = fd->fd_ss.fd_change_queue.count;
+	snap_gen = rh->rnh_gen_rib;
+	RIB_RUNLOCK(rh);
+	if (error != 0) {
+		FD_PRINTF(LOG_INFO, fd, "rib snapshot failed at %u routes", s.count);
+		result = FLM_REBUILD;
+		goto fail;
+	}
+
+	/* Build without the rib lock */
+	result = FLM_SUCCESS;
+	if (is_fd_aggregated(fd))
+		result = dump_aggregated(fd, s.rts, s.count);
+	else {
+		for (uint32_t i = 0; i < s.count && result == FLM_SUCCESS; i++)
+			result = flm->flm_dump_rib_item_cb(s.rts[i], fd->fd_algo_data);
+	}
+	if (result == FLM_SUCCESS)
+		result = flm->flm_dump_end_cb(fd->fd_algo_data, &fd->fd_dp);
+	if (result != FLM_SUCCESS)
+		goto fail;
+
+	/* Switch to the new instance, then replay the changes since the snapshot */
+	RIB_WLOCK(rh);
+	old_fd = find_fd_gen(rh, req->old_gen);
+	if (old_fd == NULL || rh->rib_dying || fd->fd_bg_failed ||
+	    fd->hit_nhops || !fib_set_datapath_ptr(fd, &fd->fd_dp)) {
+		RIB_WUNLOCK(rh);
+		result = FLM_REBUILD;
+		goto fail;
+	}
+	sync_rib_gen(fd);
+	FIB_MOD_LOCK();
+	TAILQ_INSERT_HEAD(&V_fib_data_list, fd, entries);
+	fd->fd_linked = true;
+	FIB_MOD_UNLOCK();
+	schedule_destroy_fd_instance(old_fd, false);
+
+	q = &fd->fd_ss.fd_change_queue;
+	for (uint32_t i = 0; i < skip; i++) {
+		if (q->entries[i].nh_new != NULL)
+			fib_unref_nhop(fd, q->entries[i].nh_new);
+	}
+	q->count -= skip;
+	memmove(q->entries, q->entries + skip, q->count * sizeof(q->entries[0]));
+	fd->fd_bg_build = false;
+	fd->init_done = 1;
+	schedule_fd_probe(fd);
+
+	FD_PRINTF(LOG_INFO, fd, "background rebuild: %u routes at gen %u, "
+	    "replaying %u changes up to gen %u", s.count, snap_gen, q->count,
+	    rh->rnh_gen_rib);
+	if (q->count > 0 && !apply_rtable_changes(fd))
+		schedule_fd_rebuild(fd, "background rebuild replay failed");
+	RIB_WUNLOCK(rh);
+	SDT_PROBE4(route, fib_algo, rebuild, done, rh, flm->flm_name, true,
+	    FLM_SUCCESS);
+
+	free(s.rts, M_TEMP);
+	NET_EPOCH_EXIT(et);
+	return;
+
+fail:
+	SDT_PROBE4(route, fib_algo, rebuild, done, rh, flm->flm_name, true,
+	    result);
+	free(s.rts, M_TEMP);
+	RIB_WLOCK(rh);
+	if (fd != NULL) {
+		FD_PRINTF(LOG_INFO, fd, "background rebuild failed: %s",
+		    print_op_result(result));
+		schedule_destroy_fd_instance(fd, false);
+	}
+	old_fd = find_fd_gen(rh, req->old_gen);
+	if (old_fd != NULL && !rh->rib_dying) {
+		/* Retry synchronously */
+		old_fd->fd_bg_pending = false;
+		old_fd->fd_need_rebuild = false;
+		old_fd->fd_failed_rebuilds++;
+		if (result == FLM_ERROR)
+			flm_error_add(flm, rh->rib_fibnum);
+		schedule_fd_rebuild(old_fd, "background rebuild failed");
+	}
+	RIB_WUNLOCK(rh);
+	NET_EPOCH_EXIT(et);
+}
+
+static void
+handle_bg_task(void *_vnet, int pending)
 {
-	struct fib_lookup_module *flm_new = NULL;
-	bool result;
+	struct fib_bg_req *req;
 
-	if (!is_algo_fixed(fd->fd_rh))
-		flm_new = fib_check_best_algo(fd->fd_rh, fd->fd_flm);
+	CURVNET_SET((struct vnet *)_vnet);
+	for (;;) {
+		FIB_MOD_LOCK();
+		req = TAILQ_FIRST(&V_fib_bg_list);
+		if (req != NULL)
+			TAILQ_REMOVE(&V_fib_bg_list, req, entries);
+		FIB_MOD_UNLOCK();
+		if (req == NULL)
+			break;
 
-	FD_PRINTF(LOG_INFO, fd, "running sync rebuild: %s", reason);
-	result = rebuild_fd_flm(fd, flm_new != NULL ? flm_new : fd->fd_flm);
-	if (flm_new != NULL)
-		fib_unref_algo(flm_new);
+		run_bg_rebuild(req);
+		fib_unref_algo(req->flm);
+		free(req, M_RTABLE);
+	}
+	CURVNET_RESTORE();
+}
 
-	if (!result) {
-		FD_PRINTF(LOG_ERR, fd, "sync rebuild failed");
-		schedule_fd_rebuild(fd, "sync rebuild failed");
+/*
+ * Cancels the pending background rebuilds of @rh and waits for the
+ *  running one.
+ */
+static void
+fib_bg_drain(struct rib_head *rh)
+{
+	struct fib_bg_head tmp_head = TAILQ_HEAD_INITIALIZER(tmp_head);
+	struct fib_bg_req *req, *req_tmp;
+
+	FIB_MOD_LOCK();
+	TAILQ_FOREACH_SAFE(req, &V_fib_bg_list, entries, req_tmp) {
+		if (rh == NULL || req->rh == rh) {
+			TAILQ_REMOVE(&V_fib_bg_list, req, entries);
+			TAILQ_INSERT_TAIL(&tmp_head, req, entries);
+		}
 	}
+	FIB_MOD_UNLOCK();
 
-	return (result);
+	TAILQ_FOREACH_SAFE(req, &tmp_head, entries, req_tmp) {
+		fib_unref_algo(req->flm);
+		free(req, M_RTABLE);
+	}
+	taskqueue_drain(taskqueue_thread, &V_fib_bg_task);
 }
 
 /*
@@ -1750,74 +3043,245 @@ fib_get_rh(struct fib_data *fd)
 }
 
 /*
- * Accessor to export idx->nhop array
+ * Accessor to export idx->nhop array.
+ * The array is replaced when the nhop table grows: algo should get it
+ *  after the nexthops it is going to use got their indexes, e.g. at the
+ *  end of the dump. The replaced arrays stay valid while @fd exists.
  */
 struct nhop_object **
 fib_get_nhop_array(struct fib_data *fd)
 {
+	struct nhop_ref_table *tab;
 
-	return (fd->nh_idx);
+	tab = (struct nhop_ref_table *)atomic_load_acq_ptr(
+	    (uintptr_t *)&fd->nh_ref_table);
+	return (tab->nh_idx);
 }
 
 static uint32_t
-get_nhop_idx(struct nhop_object *nh)
+nhop_hash(const struct nhop_object *nh, uint32_t size)
 {
-#ifdef ROUTE_MPATH
-	if (NH_IS_NHGRP(nh))
-		return (nhgrp_get_idx((struct nhgrp_object *)nh));
-	else
-#endif
-		return (nhop_get_idx(nh));
+	uintptr_t v = (uintptr_t)nh >> 6;
+	uint32_t h;
+
+	h = (uint32_t)(v ^ (v >> 24)) * 0x9e3779b1;
+	h ^= h >> 16;
+
+	return (h & (size - 1));
+}
+
+/*
+ * Returns index of @nh in @tab or 0. Safe without the rib lock within
+ *  the epoch, if @nh stays referenced.
+ */
+static uint32_t
+find_nhop_idx(struct nhop_ref_table *tab, const struct nhop_object *nh)
+{
+	uint32_t idx;
+
+	idx = atomic_load_acq_int(&tab->hash[nhop_hash(nh, tab->size)]);
+	for (; idx != 0; idx = atomic_load_acq_int(&tab->next[idx])) {
+		if (tab->nh_idx[idx] == nh)
+			break;
+	}
+
+	return (idx);
 }
 
 uint32_t
 fib_get_nhop_idx(struct fib_data *fd, struct nhop_object *nh)
 {
+	struct nhop_ref_table *tab;
+
+	tab = (struct nhop_ref_table *)atomic_load_acq_ptr(
+	    (uintptr_t *)&fd->nh_ref_table);
+	return (find_nhop_idx(tab, nh));
+}
+
+static void
+link_nhop_idx(struct nhop_ref_table *tab, uint32_t idx, struct nhop_object *nh)
+{
+	uint32_t *head = &tab->hash[nhop_hash(nh, tab->size)];
+
+	tab->nh_idx[idx] = nh;
+	tab->next[idx] = *head;
+	atomic_store_rel_int(head, idx);
+}
+
+/*
+ * Removes @idx from its hash chain. The link of @idx is kept, as the
+ *  lockless readers may still walk through it till the end of the epoch.
+ */
+static void
+unlink_nhop_idx(struct nhop_ref_table *tab, uint32_t idx)
+{
+	uint32_t *pidx;
+
+	pidx = &tab->hash[nhop_hash(tab->nh_idx[idx], tab->size)];
+	while (*pidx != idx)
+		pidx = &tab->next[*pidx];
+	atomic_store_rel_int(pidx, tab->next[idx]);
+}
+
+static struct nhop_ref_table *
+alloc_nhop_table(uint32_t size)
+{
+	struct nhop_ref_table *tab;
+	size_t sz;
 
-	return (get_nhop_idx(nh));
+	sz = sizeof(struct nhop_ref_table) + size * (sizeof(struct nhop_object *) +
+	    sizeof(int32_t) + 2 * sizeof(uint32_t));
+	tab = malloc(sz, M_RTABLE, M_NOWAIT | M_ZERO);
+	if (tab == NULL)
+		return (NULL);
+	tab->size = size;
+	tab->free_hint = 1;
+	tab->nh_idx = (struct nhop_object **)(tab + 1);
+	tab->refcnt = (int32_t *)(tab->nh_idx + size);
+	tab->hash = (uint32_t *)(tab->refcnt + size);
+	tab->next = tab->hash + size;
+
+	return (tab);
 }
 
+/*
+ * Replaces the full nhop table of @fd with a copy twice as large.
+ * Lockless readers may keep using the old table, which stays valid and
+ *  unchanged till @fd is destroyed.
+ */
 static bool
-is_idx_free(struct fib_data *fd, uint32_t index)
+grow_nhop_table(struct fib_data *fd)
 {
+	struct nhop_ref_table *tab, *old_tab = fd->nh_ref_table;
+	struct fib_sync_status *fd_ss = &fd->fd_ss;
+	uint32_t *nh_unref = NULL;
+	uint32_t size = old_tab->size * 2;
+
+	if (size > FIB_MAX_NHOPS)
+		return (false);
+	tab = alloc_nhop_table(size);
+	if (fd_ss->nh_unref != NULL)
+		nh_unref = malloc(size * sizeof(uint32_t), M_TEMP, M_NOWAIT | M_ZERO);
+	if (tab == NULL || (fd_ss->nh_unref != NULL && nh_unref == NULL)) {
+		FD_PRINTF(LOG_INFO, fd, "Unable to grow nhop table to %u indexes", size);
+		free(tab, M_RTABLE);
+		free(nh_unref, M_TEMP);
+		return (false);
+	}
+
+	/* Indexes being released are not linked to the hash chains */
+	for (uint32_t i = 1; i < old_tab->size; i++) {
+		tab->refcnt[i] = old_tab->refcnt[i];
+		if (tab->refcnt[i] > 0)
+			link_nhop_idx(tab, i, old_tab->nh_idx[i]);
+		else
+			tab->nh_idx[i] = old_tab->nh_idx[i];
+	}
+	tab->count = old_tab->count;
+	tab->free_hint = old_tab->free_hint;
+	tab->prev = old_tab;
+	if (nh_unref != NULL) {
+		memcpy(nh_unref, fd_ss->nh_unref, old_tab->size * sizeof(uint32_t));
+		free(fd_ss->nh_unref, M_TEMP);
+		fd_ss->nh_unref = nh_unref;
+	}
 
-	return (fd->nh_ref_table->refcnt[index] == 0);
+	atomic_store_rel_ptr((uintptr_t *)&fd->nh_ref_table, (uintptr_t)tab);
+	FD_PRINTF(LOG_INFO, fd, "grew nhop table to %u indexes", size);
+
+	return (true);
+}
+
+/*
+ * Makes the indexes whose nexthops were released at the end of the
+ *  epoch available for reuse.
+ */
+static void
+reclaim_nhop_idx(struct fib_data *fd)
+{
+	struct nhop_ref_table *tab = fd->nh_ref_table;
+	struct nhop_release_data *nrd, *next;
+
+	nrd = (struct nhop_release_data *)atomic_swap_ptr(
+	    (uintptr_t *)&fd->fd_nh_released, 0);
+	for (; nrd != NULL; nrd = next) {
+		next = nrd->next;
+		tab->nh_idx[nrd->idx] = NULL;
+		tab->refcnt[nrd->idx] = 0;
+		tab->count--;
+		if (nrd->idx < tab->free_hint)
+			tab->free_hint = nrd->idx;
+		free(nrd, M_TEMP);
+	}
 }
 
+/*
+ * Returns the lowest free index of @fd, growing the table if needed.
+ * Returns 0 if the table is full and cannot grow.
+ */
 static uint32_t
-fib_ref_nhop(struct fib_data *fd, struct nhop_object *nh)
+alloc_nhop_idx(struct fib_data *fd)
 {
-	uint32_t idx = get_nhop_idx(nh);
+	struct nhop_ref_table *tab;
+	uint32_t idx;
 
-	if (idx >= fd->number_nhops) {
-		fd->hit_nhops = 1;
-		return (0);
+	reclaim_nhop_idx(fd);
+	tab = fd->nh_ref_table;
+	if (tab->count + 1 >= tab->size) {
+		if (!grow_nhop_table(fd))
+			return (0);
+		tab = fd->nh_ref_table;
 	}
 
-	if (is_idx_free(fd, idx)) {
+	for (idx = tab->free_hint; tab->refcnt[idx] != 0; idx++)
+		;
+	tab->free_hint = idx + 1;
+	tab->count++;
+
+	return (idx);
+}
+
+static uint32_t
+fib_ref_nhop(struct fib_data *fd, struct nhop_object *nh)
+{
+	struct nhop_ref_table *tab = fd->nh_ref_table;
+	uint32_t idx;
+
+	idx = find_nhop_idx(tab, nh);
+	if (idx == 0) {
+		idx = alloc_nhop_idx(fd);
+		if (idx == 0) {
+			fd->hit_nhops = 1;
+			return (0);
+		}
+		tab = fd->nh_ref_table;
 		nhop_ref_any(nh);
-		fd->nh_idx[idx] = nh;
-		fd->nh_ref_table->count++;
-		FD_PRINTF(LOG_DEBUG2, fd, " REF nhop %u %p", idx, fd->nh_idx[idx]);
+		link_nhop_idx(tab, idx, nh);
+		FD_PRINTF(LOG_DEBUG2, fd, " REF nhop %u %p", idx, nh);
 	}
-	fd->nh_ref_table->refcnt[idx]++;
+	tab->refcnt[idx]++;
 
 	return (idx);
 }
 
-struct nhop_release_data {
-	struct nhop_object	*nh;
-	struct epoch_context	ctx;
-};
-
+/*
+ * Releases the nexthop and queues its index for reuse.
+ */
 static void
 release_nhop_epoch(epoch_context_t ctx)
 {
 	struct nhop_release_data *nrd;
+	struct fib_data *fd;
 
 	nrd = __containerof(ctx, struct nhop_release_data, ctx);
+	fd = nrd->fd;
 	nhop_free_any(nrd->nh);
-	free(nrd, M_TEMP);
+
+	do {
+		nrd->next = fd->fd_nh_released;
+	} while (!atomic_cmpset_ptr((uintptr_t *)&fd->fd_nh_released,
+	    (uintptr_t)nrd->next, (uintptr_t)nrd));
+	atomic_subtract_int(&fd->fd_nh_releasing, 1);
 }
 
 /*
@@ -1826,20 +3290,26 @@ release_nhop_epoch(epoch_context_t ctx)
  *  nexthop may still be returned till the end of current epoch. Delay
  *  refcount removal, as we may be removing the last instance, which will
  *  trigger nexthop deletion, rendering returned nexthop invalid.
+ * The index stays allocated till the release for the same reason.
  */
 static void
-fib_schedule_release_nhop(struct fib_data *fd, struct nhop_object *nh)
+fib_schedule_release_nhop(struct fib_data *fd, uint32_t idx)
 {
 	struct nhop_release_data *nrd;
+	struct nhop_object *nh = fd->nh_ref_table->nh_idx[idx];
 
 	nrd = malloc(sizeof(struct nhop_release_data), M_TEMP, M_NOWAIT | M_ZERO);
 	if (nrd != NULL) {
 		nrd->nh = nh;
-		fib_epoch_call(release_nhop_epoch, &nrd->ctx);
+		nrd->fd = fd;
+		nrd->idx = idx;
+		atomic_add_int(&fd->fd_nh_releasing, 1);
+		NET_EPOCH_CALL_SIZE(release_nhop_epoch, &nrd->ctx,
+		    sizeof(struct nhop_release_data));
 	} else {
 		/*
-		 * Unable to allocate memory. Leak nexthop to maintain guarantee
-		 *  that each nhop can be referenced.
+		 * Unable to allocate memory. Leak nexthop and its index to
+		 *  maintain guarantee that each nhop can be referenced.
 		 */
 		FD_PRINTF(LOG_ERR, fd, "unable to schedule nhop %p deletion", nh);
 	}
@@ -1848,15 +3318,17 @@ fib_schedule_release_nhop(struct fib_data *fd, struct nhop_object *nh)
 static void
 fib_unref_nhop(struct fib_data *fd, struct nhop_object *nh)
 {
-	uint32_t idx = get_nhop_idx(nh);
+	struct nhop_ref_table *tab = fd->nh_ref_table;
+	uint32_t idx;
 
-	KASSERT((idx < fd->number_nhops), ("invalid nhop index"));
-	KASSERT((nh == fd->nh_idx[idx]), ("index table contains whong nh"));
+	idx = find_nhop_idx(tab, nh);
+	KASSERT((idx != 0), ("nhop %p is not referenced", nh));
 
-	fd->nh_ref_table->refcnt[idx]--;
-	if (fd->nh_ref_table->refcnt[idx] == 0) {
-		FD_PRINTF(LOG_DEBUG, fd, " FREE nhop %d %p", idx, fd->nh_idx[idx]);
-		fib_schedule_release_nhop(fd, fd->nh_idx[idx]);
+	if (--tab->refcnt[idx] == 0) {
+		FD_PRINTF(LOG_DEBUG, fd, " FREE nhop %u %p", idx, nh);
+		unlink_nhop_idx(tab, idx);
+		tab->refcnt[idx] = -1;
+		fib_schedule_release_nhop(fd, idx);
 	}
 }
 
@@ -1926,6 +3398,9 @@ fib_check_best_algo(struct rib_head *rh, struct fib_lookup_module *orig_flm)
 		if (flm == orig_flm)
 			curr_preference = preference;
 	}
+	/* Adaptive mode switches by preference only if the current algo can't cope */
+	if (V_fib_adaptive && orig_flm != NULL && curr_preference > 0)
+		best_flm = NULL;
 	if ((best_flm != NULL) && (curr_preference + BEST_DIFF_PERCENT < best_preference))
 		best_flm->flm_refcount++;
 	else
@@ -1940,6 +3415,318 @@ fib_check_best_algo(struct rib_head *rh, struct fib_lookup_module *orig_flm)
 	return (best_flm);
 }
 
+/*
+ * Schedules the lookup cost probe of the active instance @fd, unless
+ *  other callout work is pending.
+ */
+static void
+schedule_fd_probe(struct fib_data *fd)
+{
+
+	RIB_WLOCK_ASSERT(fd->fd_rh);
+
+	if (V_fib_adaptive && !is_algo_fixed(fd->fd_rh) &&
+	    !callout_pending(&fd->fd_callout))
+		schedule_callout(fd, FDA_PROBE, V_fib_adaptive_probe_ms);
+}
+
+static struct fib_score *
+fib_score_find(const struct fib_lookup_module *flm, uint32_t fibnum)
+{
+	struct fib_score *fs;
+
+	FIB_MOD_LOCK_ASSERT();
+
+	TAILQ_FOREACH(fs, &V_fib_score_list, entries) {
+		if ((fs->fs_flm == flm) && (fs->fs_fibnum == fibnum))
+			return (fs);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Returns the score of @flm in @fibnum, allocating it if needed.
+ */
+static struct fib_score *
+fib_score_get(struct fib_lookup_module *flm, uint32_t fibnum)
+{
+	struct fib_score *fs;
+
+	FIB_MOD_LOCK_ASSERT();
+
+	fs = fib_score_find(flm, fibnum);
+	if (fs != NULL)
+		return (fs);
+
+	fs = malloc(sizeof(struct fib_score), M_TEMP, M_NOWAIT | M_ZERO);
+	if (fs == NULL)
+		return (NULL);
+	fs->fs_flm = flm;
+	fs->fs_fibnum = fibnum;
+	getmicrouptime(&fs->fs_since);
+	TAILQ_INSERT_HEAD(&V_fib_score_list, fs, entries);
+
+	return (fs);
+}
+
+/*
+ * Clear all scores of algo specified by @flm.
+ */
+static void
+fib_score_clear_flm(struct fib_lookup_module *flm)
+{
+	struct fib_score *fs, *fs_tmp;
+
+	FIB_MOD_LOCK_ASSERT();
+
+	TAILQ_FOREACH_SAFE(fs, &V_fib_score_list, entries, fs_tmp) {
+		if (fs->fs_flm == flm) {
+			TAILQ_REMOVE(&V_fib_score_list, fs, entries);
+			free(fs, M_TEMP);
+		}
+	}
+}
+
+/*
+ * Clears all scores in current VNET.
+ */
+static void
+fib_score_clear(void)
+{
+	struct fib_score *fs, *fs_tmp;
+
+	FIB_MOD_LOCK_ASSERT();
+
+	TAILQ_FOREACH_SAFE(fs, &V_fib_score_list, entries, fs_tmp) {
+		TAILQ_REMOVE(&V_fib_score_list, fs, entries);
+		free(fs, M_TEMP);
+	}
+}
+
+/*
+ * True if @fs has to be (re)measured for the table of @num_prefixes.
+ */
+static bool
+fib_score_stale(const struct fib_score *fs, uint32_t num_prefixes)
+{
+
+	if (fs == NULL || fs->fs_lookup_ps == 0)
+		return (true);
+	return (num_prefixes > 2 * fs->fs_num_prefixes + 64 ||
+	    fs->fs_num_prefixes > 2 * num_prefixes + 64);
+}
+
+/*
+ * Returns the cost of @fs in picoseconds. Memory footprint is only
+ *  accounted if known for both @fs and @fs_other.
+ */
+static uint64_t
+fib_score_cost(const struct fib_score *fs, const struct fib_score *fs_other)
+{
+	uint64_t cost = fs->fs_lookup_ps;
+	uint32_t mem_kb = V_fib_adaptive_mem_kb;
+
+	if (fs->fs_mem != 0 && fs_other->fs_mem != 0 && mem_kb != 0)
+		cost += fs->fs_mem * 1000 / 1024 / mem_kb;
+
+	return (cost);
+}
+
+union probe_key {
+	struct in_addr		addr4;
+	struct in6_addr		addr6;
+};
+
+struct probe_cbdata {
+	struct fib_data		*fd;
+	union probe_key		*keys;
+	uint32_t		count;
+	uint32_t		step;
+	uint32_t		skip;
+};
+
+/*
+ * Callback for each entry in rib during the probe key sampling.
+ * Takes every @step-th prefix with random host bits.
+ */
+static int
+probe_key_cb(struct rtentry *rt, void *_data)
+{
+	struct probe_cbdata *w = (struct probe_cbdata *)_data;
+	union probe_key *key;
+	uint32_t scopeid, host;
+	int plen;
+
+	if (w->skip-- > 0)
+		return (0);
+	w->skip = w->step - 1;
+	if (w->count == FIB_PROBE_KEYS)
+		return (EEXIST);
+	key = &w->keys[w->count++];
+
+	switch (w->fd->fd_family) {
+#ifdef INET
+	case AF_INET:
+		rt_get_inet_prefix_plen(rt, &key->addr4, &plen, &scopeid);
+		host = (plen == 0) ? 0xFFFFFFFF : (1U << (32 - plen)) - 1;
+		key->addr4.s_addr |= htonl(arc4random() & host);
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		rt_get_inet6_prefix_plen(rt, &key->addr6, &plen, &scopeid);
+		for (int i = plen / 8; i < 16; i++) {
+			host = (i == plen / 8) ? 0xFF >> (plen % 8) : 0xFF;
+			key->addr6.s6_addr[i] |= arc4random() & host;
+		}
+		break;
+#endif
+	}
+
+	return (0);
+}
+
+/*
+ * Measures the average datapath lookup time of the active instance @fd,
+ *  in picoseconds, over destinations sampled from the rib.
+ * Returns 0 if the table is empty or the memory is exhausted.
+ */
+static uint64_t
+probe_fd_lookup(struct fib_data *fd)
+{
+	struct probe_cbdata w = { .fd = fd };
+	struct rib_head *rh = fd->fd_rh;
+	struct flm_lookup_key key;
+	struct fib_dp dp;
+	sbintime_t sbt;
+	uint64_t ns;
+
+	NET_EPOCH_ASSERT();
+	RIB_WLOCK_ASSERT(rh);
+
+	if (rh->rnh_prefixes == 0)
+		return (0);
+	w.keys = malloc(sizeof(union probe_key) * FIB_PROBE_KEYS, M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (w.keys == NULL)
+		return (0);
+	w.step = MAX(rh->rnh_prefixes / FIB_PROBE_KEYS, 1);
+	w.skip = arc4random() % w.step;
+	rh->rnh_walktree(&rh->head, (walktree_f_t *)probe_key_cb, &w);
+
+	/* Use the live datapath, batch updates may have replaced fd_dp */
+	dp = (*get_family_dp_ptr(fd->fd_family))[fd->fd_fibnum];
+	sbt = sbinuptime();
+	for (int r = 0; r < FIB_PROBE_ROUNDS; r++) {
+		for (uint32_t i = 0; i < w.count; i++) {
+			if (fd->fd_family == AF_INET)
+				key.addr4 = w.keys[i].addr4;
+			else
+				key.addr6 = &w.keys[i].addr6;
+			dp.f(dp.arg, key, 0);
+		}
+	}
+	ns = sbttons(sbinuptime() - sbt);
+	free(w.keys, M_TEMP);
+
+	if (w.count == 0)
+		return (0);
+	/* Zero is "unknown", clamp sub-picosecond results */
+	return (MAX(ns * 1000 / (w.count * FIB_PROBE_ROUNDS), 1));
+}
+
+/*
+ * Records the measured cost of the active instance @fd and checks if
+ *  the other algos are measurably better for its rib.
+ *
+ * Returns referenced algo to switch to or NULL.
+ */
+static struct fib_lookup_module *
+fib_check_adaptive_algo(struct fib_data *fd)
+{
+	struct fib_lookup_module *flm, *best_flm = NULL;
+	struct fib_score *fs_curr, *fs, *fs_best = NULL;
+	struct rib_head *rh = fd->fd_rh;
+	struct rib_rtable_info rinfo;
+	uint64_t lookup_ps, mem = 0, curr_cost, cost, best_cost = 0;
+	struct timeval tv;
+
+	if (!V_fib_adaptive)
+		return (NULL);
+
+	lookup_ps = probe_fd_lookup(fd);
+	if (lookup_ps == 0)
+		return (NULL);
+	if (fd->fd_flm->flm_get_mem_cb != NULL)
+		mem = fd->fd_flm->flm_get_mem_cb(fd->fd_algo_data);
+	fib_get_rtable_info(rh, &rinfo);
+	getmicrouptime(&tv);
+
+	FIB_MOD_LOCK();
+	fs_curr = fib_score_get(fd->fd_flm, fd->fd_fibnum);
+	if (fs_curr == NULL) {
+		FIB_MOD_UNLOCK();
+		return (NULL);
+	}
+	fs_curr->fs_lookup_ps = lookup_ps;
+	fs_curr->fs_mem = mem;
+	fs_curr->fs_num_prefixes = rinfo.num_prefixes;
+
+	/* Hysteresis: stay with the current algo for the hold time */
+	if (get_tv_diff_ms(&fs_curr->fs_since, &tv) < V_fib_adaptive_hold_ms) {
+		FIB_MOD_UNLOCK();
+		return (NULL);
+	}
+
+	TAILQ_FOREACH(flm, &all_algo_list, entries) {
+		if (flm->flm_family != fd->fd_family || flm == fd->fd_flm)
+			continue;
+		if (flm_error_check(flm, fd->fd_fibnum))
+			continue;
+		/* Skip algos unable to handle the table */
+		if (flm->flm_get_pref(&rinfo) == 0)
+			continue;
+		fs = fib_score_find(flm, fd->fd_fibnum);
+		if (fib_score_stale(fs, rinfo.num_prefixes)) {
+			/* Not measured at this scale yet, try it */
+			best_flm = flm;
+			fs_best = NULL;
+			break;
+		}
+		cost = fib_score_cost(fs, fs_curr);
+		if (best_flm == NULL || cost < best_cost) {
+			best_flm = flm;
+			fs_best = fs;
+			best_cost = cost;
+		}
+	}
+	if (fs_best != NULL) {
+		curr_cost = fib_score_cost(fs_curr, fs_best);
+		best_cost = fib_score_cost(fs_best, fs_curr);
+		if (best_cost * (100 + V_fib_adaptive_margin_pct) >= curr_cost * 100)
+			best_flm = NULL;
+	}
+	if (best_flm != NULL) {
+		/* Start the hold time of the new algo */
+		fs = fib_score_get(best_flm, fd->fd_fibnum);
+		if (fs != NULL) {
+			fs->fs_since = tv;
+			best_flm->flm_refcount++;
+		} else
+			best_flm = NULL;
+	}
+	FIB_MOD_UNLOCK();
+
+	FD_PRINTF(LOG_INFO, fd, "lookup %ju.%03ju ns, %ju KB, result: %s%s",
+	    (uintmax_t)(lookup_ps / 1000), (uintmax_t)(lookup_ps % 1000),
+	    (uintmax_t)(mem / 1024),
+	    best_flm ? best_flm->flm_name : fd->fd_flm->flm_name,
+	    (best_flm != NULL && fs_best == NULL) ? " (unmeasured)" : "");
+
+	return (best_flm);
+}
+
 /*
  * Called when new route table is created.
  * Selects, allocates and attaches fib algo for the table.
@@ -1992,7 +3779,8 @@ fib_setup_family(int family, uint32_t num_tables)
 
 	for (int i = 0; i < num_tables; i++) {
 		struct rib_head *rh = rt_tables_get_rnh(i, family);
-		if (rh->rib_algo_init)
+		/* Not instantiated yet, lookups go to dummy_lookup */
+		if (rh == NULL || rh->rib_algo_init)
 			continue;
 		if (!fib_select_algo_initial(rh, &new_fdh->fdh_idx[i]))
 			continue;
@@ -2027,6 +3815,11 @@ int
 fib_module_register(struct fib_lookup_module *flm)
 {
 
+	/* Aggregated changes are applied as partial rebuilds */
+	if ((flm->flm_flags & FLM_F_AGGREGATE) != 0 &&
+	    flm->flm_change_range_cb == NULL)
+		return (EINVAL);
+
 	FIB_MOD_LOCK();
 	ALGO_PRINTF(LOG_INFO, "attaching %s to %s", flm->flm_name,
 	    print_family(flm->flm_family));
@@ -2052,6 +3845,7 @@ fib_module_unregister(struct fib_lookup_module *flm)
 		return (EBUSY);
 	}
 	fib_error_clear_flm(flm);
+	fib_score_clear_flm(flm);
 	ALGO_PRINTF(LOG_INFO, "detaching %s from %s", flm->flm_name,
 	    print_family(flm->flm_family));
 	TAILQ_REMOVE(&all_algo_list, flm, entries);
@@ -2065,13 +3859,18 @@ vnet_fib_init(void)
 {
 
 	TAILQ_INIT(&V_fib_data_list);
+	TAILQ_INIT(&V_fib_bg_list);
+	TAILQ_INIT(&V_fib_score_list);
+	TASK_INIT(&V_fib_bg_task, 0, handle_bg_task, curvnet);
 }
 
 void
 vnet_fib_destroy(void)
 {
 
+	fib_bg_drain(NULL);
 	FIB_MOD_LOCK();
 	fib_error_clear();
+	fib_score_clear();
 	FIB_MOD_UNLOCK();
 }
@@ -67,6 +67,27 @@ struct fib_change_queue {
 	struct fib_change_entry	*entries;
 };
 
+/* Address range resynced by a partial rebuild */
+struct fib_range {
+	union {
+		struct in_addr	addr4;
+		struct in6_addr	addr6;
+	};
+	uint8_t			plen;
+	uint32_t		start;		/* first route in the queue */
+	uint32_t		count;		/* # of routes in the range */
+};
+
+/*
+ * Partial rebuild request: non-overlapping ranges sorted by address and,
+ *  for each of them, all rib routes of at least range plen inside it.
+ */
+struct fib_range_queue {
+	uint32_t		num_ranges;
+	struct fib_range	*ranges;
+	struct fib_change_queue	*q;		/* routes, nh_new set */
+};
+
 
 typedef struct nhop_object *flm_lookup_t(void *algo_data,
     const struct flm_lookup_key key, uint32_t scopeid);
@@ -79,7 +100,14 @@ typedef enum flm_op_result flm_change_t(struct rib_head *rnh,
     struct rib_cmd_info *rc, void *data);
 typedef enum flm_op_result flm_change_batch_t(struct rib_head *rnh,
     struct fib_change_queue *q, void *data);
+typedef enum flm_op_result flm_change_range_t(struct rib_head *rnh,
+    const struct fib_range_queue *rq, void *data);
 typedef uint8_t flm_get_pref_t(const struct rib_rtable_info *rinfo);
+typedef size_t flm_get_mem_t(void *data);
+
+/* flm_flags */
+#define	FLM_F_UNLOCKED_DUMP	0x0001	/* dump callbacks may run without rib lock */
+#define	FLM_F_AGGREGATE		0x0002	/* feed algo the aggregated rib, needs flm_change_range_cb */
 
 struct fib_lookup_module {
 	char		*flm_name;		/* algo name */
@@ -95,7 +123,9 @@ struct fib_lookup_module {
 	flm_lookup_t	*flm_lookup;		/* lookup function */
 	flm_get_pref_t	*flm_get_pref;		/* get algo preference */
 	flm_change_batch_t	*flm_change_rib_items_cb;/* routing table change hook */
-	void		*spare[8];		/* Spare callbacks */
+	flm_change_range_t	*flm_change_range_cb;	/* partial rebuild hook */
+	flm_get_mem_t	*flm_get_mem_cb;	/* instance memory footprint */
+	void		*spare[6];		/* Spare callbacks */
 	TAILQ_ENTRY(fib_lookup_module)	entries;
 };
 
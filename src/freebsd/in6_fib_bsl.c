@@ -0,0 +1,528 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Binary search on prefix lengths: IPv6 lookup algorithm (Waldvogel et al).
+ *
+ * Prefixes are kept in one hash table per populated prefix length, the
+ *  lengths sorted into an array. The lookup binary searches that array:
+ *  a hit at a length means a longer match may exist, a miss that only
+ *  shorter ones may. For the search not to miss long prefixes, each
+ *  prefix leaves a marker at every shorter length the search visits
+ *  on its way to the prefix length. Each entry, marker or not, carries
+ *  its best matching prefix, so the last hit is the answer.
+ * The lookup takes about log2(number of lengths) probes, e.g. 5-6 for
+ *  the 20-40 lengths common in IPv6 tables.
+ *
+ * The tables are built from the rib dump. Route changes trigger the
+ *  rebuild.
+ */
+
+#include <sys/cdefs.h>
+#include "opt_inet6.h"
+
+#include <sys/param.h>
+#include <sys/endian.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/rmlock.h>
+#include <sys/malloc.h>
+#include <sys/module.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <net/vnet.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet6/in6_var.h>
+#include <netinet6/scope6_var.h>
+
+#include <net/route.h>
+#include <net/route/nhop.h>
+#include <net/route/route_ctl.h>
+#include <net/route/route_var.h>
+#include <net/route/fib_algo.h>
+
+#define	BSL_PREFIXES_INITIAL	256
+#define	BSL_MAXLEN		128
+
+static MALLOC_DEFINE(M_BSL6, "bsl6", "IPv6 binary search on lengths data");
+
+#define	BSL_E_PREFIX	0x01	/* entry is a prefix, not only a marker */
+
+struct bsl_entry {
+	uint64_t		hi;	/* masked key, host byte order */
+	uint64_t		lo;
+	uint32_t		bmp;	/* best matching prefix nexthop index */
+	uint8_t			flags;
+	uint8_t			used;
+};
+
+struct bsl_level {
+	struct bsl_entry	*slots;
+	uint32_t		mask;	/* number of slots - 1 */
+	uint32_t		count;	/* entries to size the table for */
+	uint8_t			plen;
+};
+
+struct bsl_prefix {
+	uint64_t		hi;
+	uint64_t		lo;
+	uint32_t		nh_idx;
+	uint8_t			plen;
+};
+
+struct bsl6 {
+	struct bsl_level	levels[BSL_MAXLEN];	/* populated lengths, sorted */
+	uint32_t		num_levels;
+	uint32_t		def_nh;		/* ::/0 nexthop index */
+	struct bsl_entry	*slots;		/* storage of all levels */
+	uint32_t		num_slots;
+	struct nhop_object	**nh_idx;	/* framework nexthop array */
+	struct bsl_prefix	*prefixes;	/* used during the build only */
+	uint32_t		num_prefixes;
+	uint32_t		prefixes_size;
+	struct fib_data		*fd;
+};
+
+/* Clears all but the first @plen bits of the (@hi, @lo) key */
+static inline void
+bsl_mask(uint64_t *hi, uint64_t *lo, int plen)
+{
+
+	if (plen <= 64) {
+		*hi = (plen == 0) ? 0 : *hi & (~0ULL << (64 - plen));
+		*lo = 0;
+	} else if (plen < 128)
+		*lo &= ~0ULL << (128 - plen);
+}
+
+static inline uint32_t
+bsl_hash(uint64_t hi, uint64_t lo)
+{
+	uint64_t h;
+
+	h = hi * 0x9e3779b97f4a7c15ULL ^ lo * 0xc2b2ae3d27d4eb4fULL;
+	return ((uint32_t)(h ^ (h >> 32)));
+}
+
+static inline const struct bsl_entry *
+bsl_find(const struct bsl_level *lvl, uint64_t hi, uint64_t lo)
+{
+	const struct bsl_entry *e;
+	uint32_t i;
+
+	for (i = bsl_hash(hi, lo) & lvl->mask;; i = (i + 1) & lvl->mask) {
+		e = &lvl->slots[i];
+		if (!e->used)
+			return (NULL);
+		if (e->hi == hi && e->lo == lo)
+			return (e);
+	}
+}
+
+/*
+ * Returns the entry of the (@hi, @lo) key at @lvl, inserting an empty
+ *  one if missing. Tables are sized for all their entries upfront.
+ */
+static struct bsl_entry *
+bsl_insert(struct bsl_level *lvl, uint64_t hi, uint64_t lo)
+{
+	struct bsl_entry *e;
+	uint32_t i;
+
+	for (i = bsl_hash(hi, lo) & lvl->mask;; i = (i + 1) & lvl->mask) {
+		e = &lvl->slots[i];
+		if (!e->used) {
+			e->hi = hi;
+			e->lo = lo;
+			e->used = 1;
+			return (e);
+		}
+		if (e->hi == hi && e->lo == lo)
+			return (e);
+	}
+}
+
+/* Loads @addr as a key, embedding @scopeid into link-local addresses */
+static inline void
+bsl_key(const struct in6_addr *addr, uint32_t scopeid, uint64_t *hi,
+    uint64_t *lo)
+{
+
+	*hi = be64dec(&addr->s6_addr[0]);
+	*lo = be64dec(&addr->s6_addr[8]);
+	if (IN6_IS_SCOPE_LINKLOCAL(addr))
+		*hi |= (uint64_t)(scopeid & 0xffff) << 32;
+}
+
+static struct nhop_object *
+bsl6_lookup(void *algo_data, const struct flm_lookup_key key,
+    uint32_t scopeid)
+{
+	const struct bsl6 *bsl = (const struct bsl6 *)algo_data;
+	const struct bsl_level *lvl;
+	const struct bsl_entry *e;
+	uint64_t hi, lo, mhi, mlo;
+	uint32_t bmp = bsl->def_nh;
+	int l = 0, r = (int)bsl->num_levels - 1, m;
+
+	bsl_key(key.addr6, scopeid, &hi, &lo);
+	while (l <= r) {
+		m = (l + r) / 2;
+		lvl = &bsl->levels[m];
+		mhi = hi;
+		mlo = lo;
+		bsl_mask(&mhi, &mlo, lvl->plen);
+		if ((e = bsl_find(lvl, mhi, mlo)) != NULL) {
+			bmp = e->bmp;
+			l = m + 1;
+		} else
+			r = m - 1;
+	}
+
+	return (bsl->nh_idx[bmp]);
+}
+
+/*
+ * Calls @cb for each level the lookup visits, and finds a hit at, on its
+ *  way to the level @target: those are the levels needing a marker.
+ */
+static void
+bsl_marker_levels(struct bsl6 *bsl, int target,
+    void (*cb)(struct bsl6 *, struct bsl_level *, const struct bsl_prefix *),
+    const struct bsl_prefix *p)
+{
+	int l = 0, r = (int)bsl->num_levels - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (m == target)
+			return;
+		if (m < target) {
+			cb(bsl, &bsl->levels[m], p);
+			l = m + 1;
+		} else
+			r = m - 1;
+	}
+}
+
+static void
+bsl_count_marker(struct bsl6 *bsl, struct bsl_level *lvl,
+    const struct bsl_prefix *p)
+{
+
+	lvl->count++;
+}
+
+static void
+bsl_add_marker(struct bsl6 *bsl, struct bsl_level *lvl,
+    const struct bsl_prefix *p)
+{
+	uint64_t hi = p->hi, lo = p->lo;
+
+	bsl_mask(&hi, &lo, lvl->plen);
+	bsl_insert(lvl, hi, lo);
+}
+
+/*
+ * Best matching prefix of a marker at @lvl: the longest prefix, at this
+ *  level or a shorter one, covering the marker key.
+ */
+static uint32_t
+bsl_marker_bmp(struct bsl6 *bsl, int level, const struct bsl_entry *me)
+{
+	const struct bsl_level *lvl;
+	const struct bsl_entry *e;
+	uint64_t hi, lo;
+
+	for (; level >= 0; level--) {
+		lvl = &bsl->levels[level];
+		hi = me->hi;
+		lo = me->lo;
+		bsl_mask(&hi, &lo, lvl->plen);
+		e = bsl_find(lvl, hi, lo);
+		if (e != NULL && (e->flags & BSL_E_PREFIX))
+			return (e->bmp);
+	}
+
+	return (bsl->def_nh);
+}
+
+static bool
+bsl_grow_prefixes(struct bsl6 *bsl, uint32_t count)
+{
+	struct bsl_prefix *buf;
+	uint32_t new_size;
+
+	if (count <= bsl->prefixes_size)
+		return (true);
+	new_size = MAX(bsl->prefixes_size * 2, count);
+	buf = realloc(bsl->prefixes, new_size * sizeof(struct bsl_prefix),
+	    M_BSL6, M_NOWAIT);
+	if (buf == NULL)
+		return (false);
+	bsl->prefixes = buf;
+	bsl->prefixes_size = new_size;
+
+	return (true);
+}
+
+static bool
+bsl_build(struct bsl6 *bsl)
+{
+	struct bsl_level *by_plen[BSL_MAXLEN + 1] = { NULL };
+	const struct bsl_prefix *p;
+	struct bsl_level *lvl;
+	struct bsl_entry *e;
+	uint32_t i, size, total = 0;
+	int n;
+
+	/* Populated lengths, in increasing order; ::/0 is not a level */
+	for (i = 0; i < bsl->num_prefixes; i++) {
+		p = &bsl->prefixes[i];
+		if (p->plen == 0)
+			bsl->def_nh = p->nh_idx;
+		else
+			by_plen[p->plen] = &bsl->levels[0];
+	}
+	for (n = 1; n <= BSL_MAXLEN; n++) {
+		if (by_plen[n] == NULL)
+			continue;
+		lvl = &bsl->levels[bsl->num_levels++];
+		lvl->plen = n;
+		by_plen[n] = lvl;
+	}
+
+	/* Size the tables for the prefixes and all the markers */
+	for (i = 0; i < bsl->num_prefixes; i++) {
+		p = &bsl->prefixes[i];
+		if (p->plen == 0)
+			continue;
+		by_plen[p->plen]->count++;
+		bsl_marker_levels(bsl, by_plen[p->plen] - bsl->levels,
+		    bsl_count_marker, p);
+	}
+	for (n = 0; n < bsl->num_levels; n++) {
+		lvl = &bsl->levels[n];
+		for (size = 2; size < lvl->count * 2; size *= 2)
+			;
+		lvl->mask = size - 1;
+		total += size;
+	}
+	bsl->slots = mallocarray(MAX(total, 1), sizeof(struct bsl_entry),
+	    M_BSL6, M_NOWAIT | M_ZERO);
+	if (bsl->slots == NULL)
+		return (false);
+	bsl->num_slots = total;
+	for (n = 0, total = 0; n < bsl->num_levels; n++) {
+		lvl = &bsl->levels[n];
+		lvl->slots = &bsl->slots[total];
+		total += lvl->mask + 1;
+	}
+
+	/* Prefixes first, so that markers can find their best match */
+	for (i = 0; i < bsl->num_prefixes; i++) {
+		p = &bsl->prefixes[i];
+		if (p->plen == 0)
+			continue;
+		e = bsl_insert(by_plen[p->plen], p->hi, p->lo);
+		e->flags |= BSL_E_PREFIX;
+		e->bmp = p->nh_idx;
+	}
+	for (i = 0; i < bsl->num_prefixes; i++) {
+		p = &bsl->prefixes[i];
+		if (p->plen == 0)
+			continue;
+		bsl_marker_levels(bsl, by_plen[p->plen] - bsl->levels,
+		    bsl_add_marker, p);
+	}
+	for (n = 0; n < bsl->num_levels; n++) {
+		lvl = &bsl->levels[n];
+		for (i = 0; i <= lvl->mask; i++) {
+			e = &lvl->slots[i];
+			if (e->used && (e->flags & BSL_E_PREFIX) == 0)
+				e->bmp = bsl_marker_bmp(bsl, n, e);
+		}
+	}
+
+	return (true);
+}
+
+static void
+bsl6_destroy(void *_data)
+{
+	struct bsl6 *bsl = (struct bsl6 *)_data;
+
+	free(bsl->slots, M_BSL6);
+	free(bsl->prefixes, M_BSL6);
+	free(bsl, M_BSL6);
+}
+
+static enum flm_op_result
+bsl6_init(uint32_t fibnum, struct fib_data *fd, void *_old_data, void **data)
+{
+	struct rib_rtable_info rinfo;
+	struct bsl6 *bsl;
+	uint32_t count;
+
+	bsl = malloc(sizeof(struct bsl6), M_BSL6, M_NOWAIT | M_ZERO);
+	if (bsl == NULL)
+		return (FLM_REBUILD);
+	bsl->fd = fd;
+	bsl->nh_idx = fib_get_nhop_array(fd);
+
+	fib_get_rtable_info(fib_get_rh(fd), &rinfo);
+	count = MAX(rinfo.num_prefixes + rinfo.num_prefixes / 8,
+	    BSL_PREFIXES_INITIAL);
+	if (!bsl_grow_prefixes(bsl, count)) {
+		bsl6_destroy(bsl);
+		return (FLM_REBUILD);
+	}
+
+	*data = bsl;
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+bsl6_dump_rib_item(struct rtentry *rt, void *_data)
+{
+	struct bsl6 *bsl = (struct bsl6 *)_data;
+	struct bsl_prefix *p;
+	struct in6_addr addr6;
+	uint32_t scopeid;
+	int plen;
+
+	if (!bsl_grow_prefixes(bsl, bsl->num_prefixes + 1))
+		return (FLM_REBUILD);
+
+	rt_get_inet6_prefix_plen(rt, &addr6, &plen, &scopeid);
+	p = &bsl->prefixes[bsl->num_prefixes++];
+	bsl_key(&addr6, scopeid, &p->hi, &p->lo);
+	bsl_mask(&p->hi, &p->lo, plen);
+	p->plen = plen;
+	p->nh_idx = fib_get_nhop_idx(bsl->fd, rt_get_raw_nhop(rt));
+
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+bsl6_dump_end(void *_data, struct fib_dp *dp)
+{
+	struct bsl6 *bsl = (struct bsl6 *)_data;
+
+	/* Dump may have grown the nexthop array */
+	bsl->nh_idx = fib_get_nhop_array(bsl->fd);
+	if (!bsl_build(bsl))
+		return (FLM_REBUILD);
+
+	FIB_PRINTF(LOG_INFO, bsl->fd, "%u prefixes -> %u lengths %u slots",
+	    bsl->num_prefixes, bsl->num_levels, bsl->num_slots);
+
+	/* The prefix list is not needed after the build */
+	free(bsl->prefixes, M_BSL6);
+	bsl->prefixes = NULL;
+	bsl->prefixes_size = 0;
+
+	dp->f = bsl6_lookup;
+	dp->arg = bsl;
+
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+bsl6_change_rib_item(struct rib_head *rnh, struct rib_cmd_info *rc,
+    void *_data)
+{
+
+	return (FLM_REBUILD);
+}
+
+/*
+ * Lookup cost follows the number of lengths, not the table size, while
+ *  the radix walk gets deeper and more miss-heavy as the table grows.
+ *  Tiny tables are left to radix, as the markers and the rebuild on each
+ *  change do not pay off there.
+ */
+static uint8_t
+bsl6_get_pref(const struct rib_rtable_info *rinfo)
+{
+
+	if (rinfo->num_prefixes < 10)
+		return (1);
+	else if (rinfo->num_prefixes < 1000)
+		return (120);
+	else if (rinfo->num_prefixes < 500000)
+		return (230);
+	else
+		return (200);
+}
+
+static size_t
+bsl6_get_mem(void *_data)
+{
+	struct bsl6 *bsl = (struct bsl6 *)_data;
+
+	return (sizeof(struct bsl6) +
+	    sizeof(struct bsl_entry) * bsl->num_slots +
+	    sizeof(struct bsl_prefix) * bsl->prefixes_size);
+}
+
+static struct fib_lookup_module flm_bsl6 = {
+	.flm_name = "bsl6",
+	.flm_family = AF_INET6,
+	.flm_init_cb = bsl6_init,
+	.flm_destroy_cb = bsl6_destroy,
+	.flm_dump_rib_item_cb = bsl6_dump_rib_item,
+	.flm_dump_end_cb = bsl6_dump_end,
+	.flm_change_rib_item_cb = bsl6_change_rib_item,
+	.flm_get_pref = bsl6_get_pref,
+	.flm_get_mem_cb = bsl6_get_mem,
+};
+
+static int
+bsl6_modevent(module_t mod, int type, void *unused)
+{
+	int error;
+
+	switch (type) {
+	case MOD_LOAD:
+		fib_module_register(&flm_bsl6);
+		return (0);
+	case MOD_UNLOAD:
+		error = fib_module_unregister(&flm_bsl6);
+		return (error);
+	default:
+		return (EOPNOTSUPP);
+	}
+}
+
+static moduledata_t bsl6_mod = {
+	.name = "fib_bsl6",
+	.evhand = bsl6_modevent,
+};
+
+DECLARE_MODULE(fib_bsl6, bsl6_mod, SI_SUB_PSEUDO, SI_ORDER_ANY);
+MODULE_VERSION(fib_bsl6, 1);
@@ -0,0 +1,710 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * DXR: direct / range IPv4 lookup algorithm.
+ *
+ * The address space is cut into 2^DXR_D chunks, indexed directly by the
+ *  upper DXR_D bits of the destination address. Each chunk either maps
+ *  to a single nexthop (no ranges) or points to a sorted run of
+ *  { start, nhop index } ranges inside the shared range table, which is
+ *  binary-searched on the remaining (32 - DXR_D) bits.
+ *
+ * The structure is immutable once built. Route changes are requested in
+ *  batches (FLM_BATCH) and applied by building a new instance from the
+ *  previous prefix list and switching the datapath pointer. The old
+ *  instance is reclaimed after the epoch. Partial rebuilds replace the
+ *  prefixes of the resynced ranges the same way, without a rib dump.
+ * The framework aggregates the prefixes (FLM_F_AGGREGATE), which shortens
+ *  the prefix list every rebuild starts from.
+ */
+
+#include <sys/cdefs.h>
+#include "opt_inet.h"
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/rmlock.h>
+#include <sys/malloc.h>
+#include <sys/module.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/syslog.h>
+#include <net/vnet.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <net/route.h>
+#include <net/route/nhop.h>
+#include <net/route/route_ctl.h>
+#include <net/route/route_var.h>
+#include <net/route/fib_algo.h>
+
+#define	DXR_D			16
+#define	DXR_TRIE_SIZE		(1U << DXR_D)
+#define	DXR_RANGE_SHIFT		(32 - DXR_D)
+#define	DXR_RANGE_MASK		((1U << DXR_RANGE_SHIFT) - 1)
+#define	DXR_HOSTMASK(_plen)	((1U << (32 - (_plen))) - 1)
+
+/* Number of prefixes to preallocate on instance creation */
+#define	DXR_PREFIXES_INITIAL	1024
+
+static MALLOC_DEFINE(M_DXRAUX, "dxr_aux", "DXR auxiliary data");
+
+/* Chunk descriptor: single nexthop if nranges == 0, range run otherwise */
+struct dxr_direct {
+	uint32_t		base;		/* nhop index or first range */
+	uint32_t		nranges;	/* number of ranges in chunk */
+};
+
+struct dxr_range {
+	uint16_t		start;		/* lower bits of range start */
+	uint16_t		spare;
+	uint32_t		nh_idx;		/* nexthop index */
+};
+
+/* Prefix as seen in the RIB, in host byte order */
+struct dxr_prefix {
+	uint32_t		addr;
+	uint32_t		nh_idx;
+	uint8_t			plen;
+};
+
+/* Queued change to a prefix not present in the current instance */
+struct dxr_change {
+	struct dxr_prefix	p;
+	uint32_t		seq;		/* position in the change queue */
+};
+
+/* Boundary of the flattened address space */
+struct dxr_bp {
+	uint32_t		start;
+	uint32_t		nh_idx;
+};
+
+struct dxr {
+	struct dxr_direct	*d;		/* direct table, DXR_TRIE_SIZE */
+	struct dxr_range	*r;		/* range table */
+	struct nhop_object	**nh_idx;	/* framework nexthop array */
+	struct dxr_prefix	*prefixes;	/* sorted prefix list */
+	uint32_t		num_prefixes;
+	uint32_t		prefixes_size;
+	uint32_t		num_ranges;
+	uint32_t		fibnum;
+	struct fib_data		*fd;
+	struct epoch_context	epoch_ctx;
+};
+
+static struct nhop_object *
+dxr_lookup(void *algo_data, const struct flm_lookup_key key, uint32_t scopeid)
+{
+	const struct dxr *dxr = (const struct dxr *)algo_data;
+	const struct dxr_direct *de;
+	const struct dxr_range *r;
+	uint32_t dst, lo, hi, mid;
+	uint16_t k;
+
+	dst = ntohl(key.addr4.s_addr);
+	de = &dxr->d[dst >> DXR_RANGE_SHIFT];
+	if (de->nranges == 0)
+		return (dxr->nh_idx[de->base]);
+
+	/* Find the last range starting at or before @k */
+	r = &dxr->r[de->base];
+	k = dst & DXR_RANGE_MASK;
+	lo = 0;
+	hi = de->nranges - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) >> 1;
+		if (r[mid].start <= k)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return (dxr->nh_idx[r[lo].nh_idx]);
+}
+
+static int
+dxr_prefix_cmp(const void *_a, const void *_b)
+{
+	const struct dxr_prefix *a = _a, *b = _b;
+
+	if (a->addr != b->addr)
+		return (a->addr < b->addr ? -1 : 1);
+	if (a->plen != b->plen)
+		return (a->plen < b->plen ? -1 : 1);
+	return (0);
+}
+
+static int
+dxr_change_cmp(const void *_a, const void *_b)
+{
+	const struct dxr_change *a = _a, *b = _b;
+	int r;
+
+	r = dxr_prefix_cmp(&a->p, &b->p);
+	if (r != 0)
+		return (r);
+	return (a->seq < b->seq ? -1 : 1);
+}
+
+static inline uint64_t
+dxr_prefix_end(const struct dxr_prefix *p)
+{
+
+	return ((uint64_t)p->addr + (1ULL << (32 - p->plen)) - 1);
+}
+
+/*
+ * Appends address space boundary @start -> @nh_idx to the @bp list,
+ *  merging adjacent boundaries with the same nexthop.
+ */
+static void
+dxr_bp_add(struct dxr_bp *bp, uint32_t *count, uint32_t start, uint32_t nh_idx)
+{
+	uint32_t n = *count;
+
+	if (n > 0 && bp[n - 1].start == start) {
+		/* More specific prefix starting at the same address */
+		n--;
+	}
+	if (n > 0 && bp[n - 1].nh_idx == nh_idx) {
+		*count = n;
+		return;
+	}
+	bp[n].start = start;
+	bp[n].nh_idx = nh_idx;
+	*count = n + 1;
+}
+
+/*
+ * Flattens the sorted prefix list into the list of non-overlapping
+ *  boundaries covering the whole IPv4 address space.
+ * Addresses not covered by any prefix map to nexthop index 0 (NULL).
+ *
+ * Returns number of boundaries written to @bp.
+ */
+static uint32_t
+dxr_flatten(const struct dxr *dxr, struct dxr_bp *bp)
+{
+	struct {
+		uint64_t	end;
+		uint32_t	nh_idx;
+	} stack[33];
+	uint32_t count = 0;
+	int sp = 0;
+
+	dxr_bp_add(bp, &count, 0, 0);
+	for (uint32_t i = 0; i < dxr->num_prefixes; i++) {
+		const struct dxr_prefix *p = &dxr->prefixes[i];
+
+		/* Close all prefixes not covering @p */
+		while (sp > 0 && stack[sp - 1].end < p->addr) {
+			sp--;
+			dxr_bp_add(bp, &count, stack[sp].end + 1,
+			    sp > 0 ? stack[sp - 1].nh_idx : 0);
+		}
+		dxr_bp_add(bp, &count, p->addr, p->nh_idx);
+		stack[sp].end = dxr_prefix_end(p);
+		stack[sp].nh_idx = p->nh_idx;
+		sp++;
+	}
+	while (sp > 0) {
+		sp--;
+		if (stack[sp].end >= 0xFFFFFFFF)
+			continue;
+		dxr_bp_add(bp, &count, stack[sp].end + 1,
+		    sp > 0 ? stack[sp - 1].nh_idx : 0);
+	}
+
+	return (count);
+}
+
+/*
+ * Builds direct and range tables from the current prefix list.
+ */
+static enum flm_op_result
+dxr_build(struct dxr *dxr)
+{
+	struct dxr_bp *bp;
+	uint32_t num_bp, i, chunk, nr;
+
+	/* Each prefix generates at most 2 boundaries */
+	bp = malloc(sizeof(struct dxr_bp) * (2 * dxr->num_prefixes + 1),
+	    M_TEMP, M_NOWAIT);
+	if (bp == NULL)
+		return (FLM_REBUILD);
+	num_bp = dxr_flatten(dxr, bp);
+
+	dxr->d = malloc(sizeof(struct dxr_direct) * DXR_TRIE_SIZE, M_DXRAUX,
+	    M_NOWAIT);
+	/* Each chunk has at most one leading range not present in @bp */
+	dxr->r = malloc(sizeof(struct dxr_range) * (num_bp + DXR_TRIE_SIZE),
+	    M_DXRAUX, M_NOWAIT);
+	if (dxr->d == NULL || dxr->r == NULL) {
+		free(bp, M_TEMP);
+		return (FLM_REBUILD);
+	}
+
+	nr = 0;
+	i = 0;
+	for (chunk = 0; chunk < DXR_TRIE_SIZE; chunk++) {
+		uint32_t c_start = chunk << DXR_RANGE_SHIFT;
+		uint32_t c_end = c_start | DXR_RANGE_MASK;
+		struct dxr_direct *de = &dxr->d[chunk];
+
+		/* @bp[i] is the boundary covering the chunk start */
+		while (i + 1 < num_bp && bp[i + 1].start <= c_start)
+			i++;
+		if (i + 1 >= num_bp || bp[i + 1].start > c_end) {
+			de->base = bp[i].nh_idx;
+			de->nranges = 0;
+			continue;
+		}
+
+		de->base = nr;
+		dxr->r[nr].start = 0;
+		dxr->r[nr].spare = 0;
+		dxr->r[nr++].nh_idx = bp[i].nh_idx;
+		while (i + 1 < num_bp && bp[i + 1].start <= c_end) {
+			i++;
+			dxr->r[nr].start = bp[i].start & DXR_RANGE_MASK;
+			dxr->r[nr].spare = 0;
+			dxr->r[nr++].nh_idx = bp[i].nh_idx;
+		}
+		de->nranges = nr - de->base;
+	}
+	dxr->num_ranges = nr;
+	free(bp, M_TEMP);
+
+	return (FLM_SUCCESS);
+}
+
+static bool
+dxr_grow_prefixes(struct dxr *dxr, uint32_t new_size)
+{
+	struct dxr_prefix *p;
+
+	if (new_size <= dxr->prefixes_size)
+		return (true);
+	p = realloc(dxr->prefixes, sizeof(struct dxr_prefix) * new_size,
+	    M_DXRAUX, M_NOWAIT);
+	if (p == NULL)
+		return (false);
+	dxr->prefixes = p;
+	dxr->prefixes_size = new_size;
+
+	return (true);
+}
+
+static void
+dxr_destroy(void *_data)
+{
+	struct dxr *dxr = (struct dxr *)_data;
+
+	free(dxr->d, M_DXRAUX);
+	free(dxr->r, M_DXRAUX);
+	free(dxr->prefixes, M_DXRAUX);
+	free(dxr, M_DXRAUX);
+}
+
+static void
+epoch_dxr_destroy(epoch_context_t ctx)
+{
+	struct dxr *dxr = __containerof(ctx, struct dxr, epoch_ctx);
+
+	dxr_destroy(dxr);
+}
+
+static struct dxr *
+dxr_alloc(struct fib_data *fd, uint32_t fibnum, uint32_t num_prefixes)
+{
+	struct dxr *dxr;
+
+	dxr = malloc(sizeof(struct dxr), M_DXRAUX, M_NOWAIT | M_ZERO);
+	if (dxr == NULL)
+		return (NULL);
+	dxr->fd = fd;
+	dxr->fibnum = fibnum;
+	dxr->nh_idx = fib_get_nhop_array(fd);
+	if (!dxr_grow_prefixes(dxr, num_prefixes)) {
+		free(dxr, M_DXRAUX);
+		return (NULL);
+	}
+
+	return (dxr);
+}
+
+static enum flm_op_result
+dxr_init(uint32_t fibnum, struct fib_data *fd, void *_old_data, void **data)
+{
+	struct dxr *old_dxr = (struct dxr *)_old_data;
+	struct rib_rtable_info rinfo;
+	struct dxr *dxr;
+	uint32_t count;
+
+	fib_get_rtable_info(fib_get_rh(fd), &rinfo);
+	count = MAX(rinfo.num_prefixes + rinfo.num_prefixes / 8,
+	    DXR_PREFIXES_INITIAL);
+	if (old_dxr != NULL)
+		count = MAX(count, old_dxr->prefixes_size);
+
+	dxr = dxr_alloc(fd, fibnum, count);
+	if (dxr == NULL)
+		return (FLM_REBUILD);
+
+	*data = dxr;
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+dxr_dump_rib_item(struct rtentry *rt, void *_data)
+{
+	struct dxr *dxr = (struct dxr *)_data;
+	struct dxr_prefix *p;
+	struct in_addr addr4;
+	uint32_t scopeid;
+	int plen;
+
+	if (dxr->num_prefixes >= dxr->prefixes_size &&
+	    !dxr_grow_prefixes(dxr, dxr->prefixes_size * 2))
+		return (FLM_REBUILD);
+
+	rt_get_inet_prefix_plen(rt, &addr4, &plen, &scopeid);
+	p = &dxr->prefixes[dxr->num_prefixes++];
+	p->addr = ntohl(addr4.s_addr);
+	p->plen = plen;
+	p->nh_idx = fib_get_nhop_idx(dxr->fd, rt_get_raw_nhop(rt));
+
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+dxr_dump_end(void *_data, struct fib_dp *dp)
+{
+	struct dxr *dxr = (struct dxr *)_data;
+	enum flm_op_result result;
+
+	/* Dump may have grown the nexthop array */
+	dxr->nh_idx = fib_get_nhop_array(dxr->fd);
+	qsort(dxr->prefixes, dxr->num_prefixes, sizeof(struct dxr_prefix),
+	    dxr_prefix_cmp);
+
+	result = dxr_build(dxr);
+	if (result != FLM_SUCCESS)
+		return (result);
+
+	FIB_PRINTF(LOG_INFO, dxr->fd, "%u prefixes -> %u ranges, %zu KB",
+	    dxr->num_prefixes, dxr->num_ranges,
+	    (sizeof(struct dxr_direct) * DXR_TRIE_SIZE +
+	    sizeof(struct dxr_range) * dxr->num_ranges) / 1024);
+
+	dp->f = dxr_lookup;
+	dp->arg = dxr;
+
+	return (FLM_SUCCESS);
+}
+
+/*
+ * Builds @new_dxr and switches the datapath from @dxr to it.
+ * @new_dxr is destroyed on failure.
+ */
+static enum flm_op_result
+dxr_switch(struct dxr *dxr, struct dxr *new_dxr)
+{
+	struct fib_dp new_dp;
+	enum flm_op_result result;
+
+	result = dxr_build(new_dxr);
+	if (result != FLM_SUCCESS) {
+		dxr_destroy(new_dxr);
+		return (result);
+	}
+
+	new_dp.f = dxr_lookup;
+	new_dp.arg = new_dxr;
+	if (!fib_set_datapath_ptr(dxr->fd, &new_dp)) {
+		FIB_PRINTF(LOG_ERR, dxr->fd, "fib_set_datapath_ptr() failed");
+		dxr_destroy(new_dxr);
+		return (FLM_REBUILD);
+	}
+	fib_set_algo_ptr(dxr->fd, new_dxr);
+	fib_epoch_call(epoch_dxr_destroy, &dxr->epoch_ctx);
+
+	return (FLM_SUCCESS);
+}
+
+static void
+dxr_range_bounds(const struct fib_range *r, uint32_t *start, uint32_t *end)
+{
+
+	*start = ntohl(r->addr4.s_addr);
+	*end = *start | (r->plen == 0 ? 0xFFFFFFFF : DXR_HOSTMASK(r->plen));
+}
+
+static enum flm_op_result
+dxr_change_rib_item(struct rib_head *rnh, struct rib_cmd_info *rc,
+    void *_data)
+{
+
+	/* All changes are applied in batches */
+	return (FLM_BATCH);
+}
+
+/*
+ * Applies the queued changes by merging them into the sorted prefix
+ *  list of the new instance and rebuilding the lookup tables.
+ * The datapath is switched to the new instance on success.
+ */
+static enum flm_op_result
+dxr_change_rib_batch(struct rib_head *rnh, struct fib_change_queue *q,
+    void *_data)
+{
+	struct dxr *dxr = (struct dxr *)_data;
+	const struct dxr_prefix *old = dxr->prefixes;
+	struct dxr_change *added;
+	struct dxr_prefix key, *p;
+	struct dxr *new_dxr;
+	uint32_t *nh_upd;
+	uint32_t num_added = 0, i, j, n;
+	enum flm_op_result result;
+
+	new_dxr = dxr_alloc(dxr->fd, dxr->fibnum,
+	    MAX(dxr->num_prefixes + q->count, DXR_PREFIXES_INITIAL));
+	if (new_dxr == NULL)
+		return (FLM_REBUILD);
+
+	added = malloc(sizeof(struct dxr_change) * (q->count + 1), M_TEMP,
+	    M_NOWAIT);
+	nh_upd = malloc(sizeof(uint32_t) * (dxr->num_prefixes + 1), M_TEMP,
+	    M_NOWAIT);
+	if (added == NULL || nh_upd == NULL) {
+		free(added, M_TEMP);
+		free(nh_upd, M_TEMP);
+		dxr_destroy(new_dxr);
+		return (FLM_REBUILD);
+	}
+
+	/* Existing prefixes get their nexthop updated, 0 marks deletion */
+	for (i = 0; i < dxr->num_prefixes; i++)
+		nh_upd[i] = old[i].nh_idx;
+	for (i = 0; i < q->count; i++) {
+		struct fib_change_entry *ce = &q->entries[i];
+
+		key.addr = ntohl(ce->addr4.s_addr);
+		key.plen = ce->plen;
+		key.nh_idx = (ce->nh_new != NULL) ?
+		    fib_get_nhop_idx(dxr->fd, ce->nh_new) : 0;
+		p = bsearch(&key, old, dxr->num_prefixes,
+		    sizeof(struct dxr_prefix), dxr_prefix_cmp);
+		if (p != NULL) {
+			nh_upd[p - old] = key.nh_idx;
+			continue;
+		}
+		added[num_added].p = key;
+		added[num_added].seq = i;
+		num_added++;
+	}
+
+	/* Keep the latest change for the prefixes changed multiple times */
+	qsort(added, num_added, sizeof(struct dxr_change), dxr_change_cmp);
+	for (i = 0, n = 0; i < num_added; i++) {
+		if (i + 1 < num_added &&
+		    dxr_prefix_cmp(&added[i].p, &added[i + 1].p) == 0)
+			continue;
+		if (added[i].p.nh_idx != 0)
+			added[n++] = added[i];
+	}
+	num_added = n;
+
+	/* Merge the updated old list with the added prefixes */
+	i = j = n = 0;
+	while (i < dxr->num_prefixes || j < num_added) {
+		if (i < dxr->num_prefixes && nh_upd[i] == 0) {
+			i++;
+			continue;
+		}
+		if (j >= num_added || (i < dxr->num_prefixes &&
+		    dxr_prefix_cmp(&old[i], &added[j].p) < 0)) {
+			new_dxr->prefixes[n] = old[i];
+			new_dxr->prefixes[n++].nh_idx = nh_upd[i++];
+		} else
+			new_dxr->prefixes[n++] = added[j++].p;
+	}
+	new_dxr->num_prefixes = n;
+	free(added, M_TEMP);
+	free(nh_upd, M_TEMP);
+
+	result = dxr_switch(dxr, new_dxr);
+	if (result == FLM_SUCCESS)
+		FIB_PRINTF(LOG_DEBUG, new_dxr->fd, "applied %u changes, %u prefixes",
+		    q->count, new_dxr->num_prefixes);
+
+	return (result);
+}
+
+/*
+ * Replaces the prefixes inside the resynced ranges with the current rib
+ *  routes of these ranges and switches to the rebuilt instance.
+ */
+static enum flm_op_result
+dxr_change_range(struct rib_head *rnh, const struct fib_range_queue *rq,
+    void *_data)
+{
+	struct dxr *dxr = (struct dxr *)_data;
+	const struct dxr_prefix *old = dxr->prefixes;
+	const struct fib_change_queue *q = rq->q;
+	struct dxr_prefix *added;
+	struct dxr *new_dxr;
+	uint32_t i, j, n, r, r_start, r_end;
+	enum flm_op_result result;
+
+	new_dxr = dxr_alloc(dxr->fd, dxr->fibnum,
+	    MAX(dxr->num_prefixes + q->count, DXR_PREFIXES_INITIAL));
+	if (new_dxr == NULL)
+		return (FLM_REBUILD);
+	added = malloc(sizeof(struct dxr_prefix) * (q->count + 1), M_TEMP,
+	    M_NOWAIT);
+	if (added == NULL) {
+		dxr_destroy(new_dxr);
+		return (FLM_REBUILD);
+	}
+
+	for (i = 0; i < q->count; i++) {
+		added[i].addr = ntohl(q->entries[i].addr4.s_addr);
+		added[i].plen = q->entries[i].plen;
+		added[i].nh_idx = fib_get_nhop_idx(dxr->fd, q->entries[i].nh_new);
+	}
+	qsort(added, q->count, sizeof(struct dxr_prefix), dxr_prefix_cmp);
+
+	/*
+	 * Merge the old prefixes outside of the ranges with the range routes.
+	 * Both the prefixes and the ranges are sorted by address.
+	 */
+	i = j = n = r = 0;
+	r_start = r_end = 0;
+	if (rq->num_ranges > 0)
+		dxr_range_bounds(&rq->ranges[0], &r_start, &r_end);
+	while (i < dxr->num_prefixes || j < q->count) {
+		if (i < dxr->num_prefixes) {
+			while (r + 1 < rq->num_ranges && old[i].addr > r_end)
+				dxr_range_bounds(&rq->ranges[++r], &r_start, &r_end);
+			if (r < rq->num_ranges && old[i].addr >= r_start &&
+			    old[i].addr <= r_end && old[i].plen >= rq->ranges[r].plen) {
+				i++;
+				continue;
+			}
+		}
+		if (j >= q->count || (i < dxr->num_prefixes &&
+		    dxr_prefix_cmp(&old[i], &added[j]) < 0))
+			new_dxr->prefixes[n++] = old[i++];
+		else
+			new_dxr->prefixes[n++] = added[j++];
+	}
+	new_dxr->num_prefixes = n;
+	free(added, M_TEMP);
+
+	result = dxr_switch(dxr, new_dxr);
+	if (result == FLM_SUCCESS)
+		FIB_PRINTF(LOG_DEBUG, new_dxr->fd,
+		    "resynced %u ranges, %u routes, %u prefixes", rq->num_ranges,
+		    q->count, new_dxr->num_prefixes);
+
+	return (result);
+}
+
+/*
+ * Lookup cost is constant, but the 512k direct table and the full rebuild
+ *  on each batch only pay off for the large tables.
+ */
+static uint8_t
+dxr_get_pref(const struct rib_rtable_info *rinfo)
+{
+
+	if (rinfo->num_prefixes < 10)
+		return (1);
+	else if (rinfo->num_prefixes < 1000)
+		return (50);
+	else if (rinfo->num_prefixes < 100000)
+		return (200);
+	else
+		return (253);
+}
+
+static size_t
+dxr_get_mem(void *_data)
+{
+	struct dxr *dxr = (struct dxr *)_data;
+
+	return (sizeof(struct dxr) +
+	    sizeof(struct dxr_direct) * DXR_TRIE_SIZE +
+	    sizeof(struct dxr_range) * dxr->num_ranges +
+	    sizeof(struct dxr_prefix) * dxr->prefixes_size);
+}
+
+static struct fib_lookup_module flm_dxr = {
+	.flm_name = "dxr",
+	.flm_family = AF_INET,
+	.flm_flags = FLM_F_UNLOCKED_DUMP | FLM_F_AGGREGATE,
+	.flm_init_cb = dxr_init,
+	.flm_destroy_cb = dxr_destroy,
+	.flm_dump_rib_item_cb = dxr_dump_rib_item,
+	.flm_dump_end_cb = dxr_dump_end,
+	.flm_change_rib_item_cb = dxr_change_rib_item,
+	.flm_change_rib_items_cb = dxr_change_rib_batch,
+	.flm_change_range_cb = dxr_change_range,
+	.flm_get_pref = dxr_get_pref,
+	.flm_get_mem_cb = dxr_get_mem,
+};
+
+static int
+dxr_modevent(module_t mod, int type, void *unused)
+{
+	int error;
+
+	switch (type) {
+	case MOD_LOAD:
+		fib_module_register(&flm_dxr);
+		return (0);
+	case MOD_UNLOAD:
+		error = fib_module_unregister(&flm_dxr);
+		return (error);
+	default:
+		return (EOPNOTSUPP);
+	}
+}
+
+static moduledata_t dxr_mod = {
+	.name = "fib_dxr",
+	.evhand = dxr_modevent,
+};
+
+DECLARE_MODULE(fib_dxr, dxr_mod, SI_SUB_PSEUDO, SI_ORDER_ANY);
+MODULE_VERSION(fib_dxr, 1);
@@ -0,0 +1,422 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Poptrie: multibit trie IPv4 lookup algorithm.
+ *
+ * Each node covers POPTRIE_STRIDE (6) bits of the address and holds two
+ *  64-bit bitmaps instead of the child pointer array:
+ *  - vector: bit is set if the slot points to an internal child node
+ *  - leafvec: bit is set where a new run of identical leaves starts
+ * Children and leaves of a node are stored contiguously, so the slot
+ *  index is recovered with popcount() of the bitmap below the slot.
+ *
+ * The trie is built from the sorted prefix list gathered from the rib
+ *  dump. Route changes trigger the rebuild, which is cheap for the medium
+ *  sized tables this algo is preferred for.
+ */
+
+#include <sys/cdefs.h>
+#include "opt_inet.h"
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/rmlock.h>
+#include <sys/malloc.h>
+#include <sys/module.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/syslog.h>
+#include <net/vnet.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <net/route.h>
+#include <net/route/nhop.h>
+#include <net/route/route_ctl.h>
+#include <net/route/route_var.h>
+#include <net/route/fib_algo.h>
+
+#define	POPTRIE_STRIDE		6
+#define	POPTRIE_SLOTS		(1 << POPTRIE_STRIDE)
+
+#define	POPTRIE_PREFIXES_INITIAL	256
+
+static MALLOC_DEFINE(M_POPTRIE, "poptrie", "Poptrie lookup data");
+
+struct poptrie_node {
+	uint64_t		vector;		/* internal node slots */
+	uint64_t		leafvec;	/* leaf run starts */
+	uint32_t		base0;		/* first leaf index */
+	uint32_t		base1;		/* first child index */
+};
+
+struct poptrie_prefix {
+	uint32_t		addr;		/* host byte order */
+	uint32_t		nh_idx;
+	uint8_t			plen;
+};
+
+struct poptrie {
+	struct poptrie_node	*nodes;
+	uint32_t		*leaves;	/* nexthop indexes */
+	struct nhop_object	**nh_idx;	/* framework nexthop array */
+	uint32_t		num_nodes;
+	uint32_t		nodes_size;
+	uint32_t		num_leaves;
+	uint32_t		leaves_size;
+	struct poptrie_prefix	*prefixes;	/* used during the build only */
+	uint32_t		num_prefixes;
+	uint32_t		prefixes_size;
+	struct fib_data		*fd;
+};
+
+/* Returns @stride bits of @key64 at bit @offset, counting from the MSB */
+#define	POPTRIE_INDEX(_key64, _offset)	\
+	(((_key64) >> (64 - POPTRIE_STRIDE - (_offset))) & (POPTRIE_SLOTS - 1))
+
+static struct nhop_object *
+poptrie_lookup(void *algo_data, const struct flm_lookup_key key,
+    uint32_t scopeid)
+{
+	const struct poptrie *pt = (const struct poptrie *)algo_data;
+	const struct poptrie_node *node = &pt->nodes[0];
+	uint64_t key64, mask;
+	uint32_t v, offset = 0;
+
+	key64 = (uint64_t)ntohl(key.addr4.s_addr) << 32;
+	v = POPTRIE_INDEX(key64, offset);
+	while (node->vector & (1ULL << v)) {
+		/* Bits up to and including @v */
+		mask = (2ULL << v) - 1;
+		node = &pt->nodes[node->base1 +
+		    bitcount64(node->vector & mask) - 1];
+		offset += POPTRIE_STRIDE;
+		v = POPTRIE_INDEX(key64, offset);
+	}
+	mask = (2ULL << v) - 1;
+
+	return (pt->nh_idx[pt->leaves[node->base0 +
+	    bitcount64(node->leafvec & mask) - 1]]);
+}
+
+static int
+poptrie_prefix_cmp(const void *_a, const void *_b)
+{
+	const struct poptrie_prefix *a = _a, *b = _b;
+
+	if (a->addr != b->addr)
+		return (a->addr < b->addr ? -1 : 1);
+	if (a->plen != b->plen)
+		return (a->plen < b->plen ? -1 : 1);
+	return (0);
+}
+
+static bool
+poptrie_grow(void **pbuf, uint32_t *psize, uint32_t count, size_t item_size)
+{
+	uint32_t new_size;
+	void *buf;
+
+	if (count <= *psize)
+		return (true);
+	new_size = MAX(*psize * 2, count);
+	buf = realloc(*pbuf, new_size * item_size, M_POPTRIE, M_NOWAIT);
+	if (buf == NULL)
+		return (false);
+	*pbuf = buf;
+	*psize = new_size;
+
+	return (true);
+}
+
+/*
+ * Fills node @node_idx covering the address space starting at @offset bits
+ *  with the prefixes [@lo, @hi). Slots not covered by a prefix inherit
+ *  @def_nh from the parent slot.
+ * Child nodes are allocated contiguously before descending into them.
+ */
+static bool
+poptrie_build_node(struct poptrie *pt, uint32_t node_idx, uint32_t offset,
+    uint32_t lo, uint32_t hi, uint32_t def_nh)
+{
+	uint32_t slot_nh[POPTRIE_SLOTS];
+	uint32_t child_lo[POPTRIE_SLOTS], child_hi[POPTRIE_SLOTS];
+	uint64_t vector = 0, leafvec = 0;
+	uint32_t base0, base1, nchildren, prev = 0;
+	bool have_prev = false;
+	int s;
+
+	for (s = 0; s < POPTRIE_SLOTS; s++) {
+		slot_nh[s] = def_nh;
+		child_lo[s] = child_hi[s] = 0;
+	}
+
+	/*
+	 * Prefixes are sorted by (addr, plen), so less specific prefixes
+	 *  are expanded first and get overwritten by more specific ones.
+	 */
+	for (uint32_t i = lo; i < hi; i++) {
+		const struct poptrie_prefix *p = &pt->prefixes[i];
+		uint64_t key64 = (uint64_t)p->addr << 32;
+
+		if (p->plen <= offset)
+			continue;
+		s = POPTRIE_INDEX(key64, offset);
+		if (p->plen <= offset + POPTRIE_STRIDE) {
+			int span = 1 << (offset + POPTRIE_STRIDE - p->plen);
+
+			for (int j = s; j < s + span; j++)
+				slot_nh[j] = p->nh_idx;
+			continue;
+		}
+		if ((vector & (1ULL << s)) == 0) {
+			vector |= 1ULL << s;
+			child_lo[s] = i;
+		}
+		child_hi[s] = i + 1;
+	}
+
+	/* Allocate leaf runs for the non-internal slots */
+	base0 = pt->num_leaves;
+	for (s = 0; s < POPTRIE_SLOTS; s++) {
+		if (vector & (1ULL << s))
+			continue;
+		if (have_prev && slot_nh[s] == prev)
+			continue;
+		if (!poptrie_grow((void **)&pt->leaves, &pt->leaves_size,
+		    pt->num_leaves + 1, sizeof(uint32_t)))
+			return (false);
+		pt->leaves[pt->num_leaves++] = slot_nh[s];
+		leafvec |= 1ULL << s;
+		prev = slot_nh[s];
+		have_prev = true;
+	}
+
+	nchildren = bitcount64(vector);
+	base1 = pt->num_nodes;
+	if (!poptrie_grow((void **)&pt->nodes, &pt->nodes_size,
+	    pt->num_nodes + nchildren, sizeof(struct poptrie_node)))
+		return (false);
+	pt->num_nodes += nchildren;
+
+	pt->nodes[node_idx].vector = vector;
+	pt->nodes[node_idx].leafvec = leafvec;
+	pt->nodes[node_idx].base0 = base0;
+	pt->nodes[node_idx].base1 = base1;
+
+	for (s = 0; s < POPTRIE_SLOTS && nchildren > 0; s++) {
+		if ((vector & (1ULL << s)) == 0)
+			continue;
+		if (!poptrie_build_node(pt, base1++, offset + POPTRIE_STRIDE,
+		    child_lo[s], child_hi[s], slot_nh[s]))
+			return (false);
+	}
+
+	return (true);
+}
+
+static void
+poptrie_destroy(void *_data)
+{
+	struct poptrie *pt = (struct poptrie *)_data;
+
+	free(pt->nodes, M_POPTRIE);
+	free(pt->leaves, M_POPTRIE);
+	free(pt->prefixes, M_POPTRIE);
+	free(pt, M_POPTRIE);
+}
+
+static enum flm_op_result
+poptrie_init(uint32_t fibnum, struct fib_data *fd, void *_old_data, void **data)
+{
+	struct rib_rtable_info rinfo;
+	struct poptrie *pt;
+	uint32_t count;
+
+	pt = malloc(sizeof(struct poptrie), M_POPTRIE, M_NOWAIT | M_ZERO);
+	if (pt == NULL)
+		return (FLM_REBUILD);
+	pt->fd = fd;
+	pt->nh_idx = fib_get_nhop_array(fd);
+
+	fib_get_rtable_info(fib_get_rh(fd), &rinfo);
+	count = MAX(rinfo.num_prefixes + rinfo.num_prefixes / 8,
+	    POPTRIE_PREFIXES_INITIAL);
+	if (!poptrie_grow((void **)&pt->prefixes, &pt->prefixes_size, count,
+	    sizeof(struct poptrie_prefix))) {
+		poptrie_destroy(pt);
+		return (FLM_REBUILD);
+	}
+
+	*data = pt;
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+poptrie_dump_rib_item(struct rtentry *rt, void *_data)
+{
+	struct poptrie *pt = (struct poptrie *)_data;
+	struct poptrie_prefix *p;
+	struct in_addr addr4;
+	uint32_t scopeid;
+	int plen;
+
+	if (!poptrie_grow((void **)&pt->prefixes, &pt->prefixes_size,
+	    pt->num_prefixes + 1, sizeof(struct poptrie_prefix)))
+		return (FLM_REBUILD);
+
+	rt_get_inet_prefix_plen(rt, &addr4, &plen, &scopeid);
+	p = &pt->prefixes[pt->num_prefixes++];
+	p->addr = ntohl(addr4.s_addr);
+	p->plen = plen;
+	p->nh_idx = fib_get_nhop_idx(pt->fd, rt_get_raw_nhop(rt));
+
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+poptrie_dump_end(void *_data, struct fib_dp *dp)
+{
+	struct poptrie *pt = (struct poptrie *)_data;
+	uint32_t root_nh = 0;
+	uint32_t i = 0;
+
+	/* Dump may have grown the nexthop array */
+	pt->nh_idx = fib_get_nhop_array(pt->fd);
+	qsort(pt->prefixes, pt->num_prefixes, sizeof(struct poptrie_prefix),
+	    poptrie_prefix_cmp);
+
+	/* Default route is the only prefix not handled by the root node */
+	if (pt->num_prefixes > 0 && pt->prefixes[0].plen == 0)
+		root_nh = pt->prefixes[i++].nh_idx;
+
+	if (!poptrie_grow((void **)&pt->nodes, &pt->nodes_size,
+	    pt->num_prefixes / 4 + 1, sizeof(struct poptrie_node)) ||
+	    !poptrie_grow((void **)&pt->leaves, &pt->leaves_size,
+	    pt->num_prefixes + POPTRIE_SLOTS, sizeof(uint32_t)))
+		return (FLM_REBUILD);
+	pt->num_nodes = 1;
+	if (!poptrie_build_node(pt, 0, 0, i, pt->num_prefixes, root_nh))
+		return (FLM_REBUILD);
+
+	FIB_PRINTF(LOG_INFO, pt->fd, "%u prefixes -> %u nodes %u leaves",
+	    pt->num_prefixes, pt->num_nodes, pt->num_leaves);
+
+	/* The prefix list is not needed after the build */
+	free(pt->prefixes, M_POPTRIE);
+	pt->prefixes = NULL;
+	pt->prefixes_size = 0;
+
+	dp->f = poptrie_lookup;
+	dp->arg = pt;
+
+	return (FLM_SUCCESS);
+}
+
+static enum flm_op_result
+poptrie_change_rib_item(struct rib_head *rnh, struct rib_cmd_info *rc,
+    void *_data)
+{
+
+	return (FLM_REBUILD);
+}
+
+/*
+ * Trie depth and the rebuild cost grow with the table size, so the algo
+ *  is preferred for the medium sized tables and loses to dxr on full
+ *  tables. Large number of distinct nexthops defeats leaf compression.
+ */
+static uint8_t
+poptrie_get_pref(const struct rib_rtable_info *rinfo)
+{
+	uint8_t pref;
+
+	if (rinfo->num_prefixes < 10)
+		return (10);
+	else if (rinfo->num_prefixes < 1000)
+		pref = 180;
+	else if (rinfo->num_prefixes < 100000)
+		pref = 240;
+	else
+		pref = 100;
+
+	if (rinfo->num_nhops + rinfo->num_nhgrp > rinfo->num_prefixes / 4)
+		pref -= 30;
+
+	return (pref);
+}
+
+static size_t
+poptrie_get_mem(void *_data)
+{
+	struct poptrie *pt = (struct poptrie *)_data;
+
+	return (sizeof(struct poptrie) +
+	    sizeof(struct poptrie_node) * pt->nodes_size +
+	    sizeof(uint32_t) * pt->leaves_size +
+	    sizeof(struct poptrie_prefix) * pt->prefixes_size);
+}
+
+static struct fib_lookup_module flm_poptrie = {
+	.flm_name = "poptrie",
+	.flm_family = AF_INET,
+	.flm_init_cb = poptrie_init,
+	.flm_destroy_cb = poptrie_destroy,
+	.flm_dump_rib_item_cb = poptrie_dump_rib_item,
+	.flm_dump_end_cb = poptrie_dump_end,
+	.flm_change_rib_item_cb = poptrie_change_rib_item,
+	.flm_get_pref = poptrie_get_pref,
+	.flm_get_mem_cb = poptrie_get_mem,
+};
+
+static int
+poptrie_modevent(module_t mod, int type, void *unused)
+{
+	int error;
+
+	switch (type) {
+	case MOD_LOAD:
+		fib_module_register(&flm_poptrie);
+		return (0);
+	case MOD_UNLOAD:
+		error = fib_module_unregister(&flm_poptrie);
+		return (error);
+	default:
+		return (EOPNOTSUPP);
+	}
+}
+
+static moduledata_t poptrie_mod = {
+	.name = "fib_poptrie",
+	.evhand = poptrie_modevent,
+};
+
+DECLARE_MODULE(fib_poptrie, poptrie_mod, SI_SUB_PSEUDO, SI_ORDER_ANY);
+MODULE_VERSION(fib_poptrie, 1);
@@ -31,6 +31,7 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rmlock.h>
 #include <sys/rwlock.h>
 #include <sys/malloc.h>
@@ -88,19 +89,6 @@ static void consider_resize(struct nh_control *ctl, uint32_t new_gr_buckets,
     uint32_t new_idx_items);
 
 static int cmp_nhgrp(const struct nhgrp_priv *a, const struct nhgrp_priv *b);
-static unsigned int hash_nhgrp(const struct nhgrp_priv *obj);
-
-static unsigned
-djb_hash(const unsigned char *h, const int len)
-{
-	unsigned int result = 0;
-	int i;
-
-	for (i = 0; i < len; i++)
-		result = 33 * result ^ h[i];
-
-	return (result);
-}
 
 static int
 cmp_nhgrp(const struct nhgrp_priv *a, const struct nhgrp_priv *b)
@@ -114,21 +102,44 @@ cmp_nhgrp(const struct nhgrp_priv *a, const struct nhgrp_priv *b)
 	 */
 	if (a->nhg_nh_count != b->nhg_nh_count || a->nhg_uidx != b->nhg_uidx)
 		return (0);
+	if (a->nhg_res_flags != b->nhg_res_flags ||
+	    a->nhg_res_idle != b->nhg_res_idle)
+		return (0);
 	return !memcmp(a->nhg_nh_weights, b->nhg_nh_weights,
 	    sizeof(struct weightened_nhop) * a->nhg_nh_count);
 }
 
+/* Final mix of MurmurHash3 */
+static inline uint64_t
+hash_fmix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (h);
+}
+
 /*
- * Hash callback: calculate hash of an object
+ * Calculates hash of the group control plane data, a word per
+ *  nexthop pointer and per weight/storage pair.
+ * The result is cached in nhg_hash by nhgrp_get_nhgrp() before
+ *  the group is looked up or linked.
  */
-static unsigned int
+uint32_t
 hash_nhgrp(const struct nhgrp_priv *obj)
 {
-	const unsigned char *key;
+	const struct weightened_nhop *wn = obj->nhg_nh_weights;
+	uint64_t h = obj->nhg_nh_count;
 
-	key = (const unsigned char *)obj->nhg_nh_weights;
+	for (int i = 0; i < obj->nhg_nh_count; i++) {
+		h = hash_fmix64(h ^ (uint64_t)(uintptr_t)wn[i].nh);
+		h = hash_fmix64(h ^ (((uint64_t)wn[i].weight << 32) | wn[i].storage));
+	}
 
-	return (djb_hash(key, sizeof(struct weightened_nhop) * obj->nhg_nh_count));
+	return ((uint32_t)h);
 }
 
 /*
@@ -316,6 +327,7 @@ nhgrp_ctl_init(struct nh_control *ctl)
 	 * routes will not be necessarily used.
 	 */
 	CHT_SLIST_INIT(&ctl->gr_head, NULL, 0);
+	nhgrp_res_init(ctl);
 	return (0);
 }
 
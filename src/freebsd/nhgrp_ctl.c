@@ -29,7 +29,9 @@
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/callout.h>
 #include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rmlock.h>
 #include <sys/malloc.h>
 #include <sys/mbuf.h>
@@ -79,6 +81,9 @@ static void sort_weightened_nhops(struct weightened_nhop *wn, int num_nhops);
 
 static struct nhgrp_priv *get_nhgrp(struct nh_control *ctl,
     struct weightened_nhop *wn, int num_nhops, uint32_t uidx, int *perror);
+static struct nhgrp_object *nhgrp_alloc_type(uint32_t fibnum, int family,
+    struct weightened_nhop *wn, int num_nhops, bool resilient, uint16_t idle,
+    int *perror);
 static void destroy_nhgrp(struct nhgrp_priv *nhg_priv);
 static void destroy_nhgrp_epoch(epoch_context_t ctx);
 static void free_nhgrp_nhops(struct nhgrp_priv *nhg_priv);
@@ -223,31 +228,25 @@ get_nhgrp_alloc_size(uint32_t nhg_size, uint32_t num_nhops)
 }
 
 /*
- * Compile actual list of nexthops to be used by datapath from
- *  the nexthop group @dst.
- *
- * For example, compiling control plane list of 2 nexthops
- *  [(200, A), (100, B)] would result in the datapath array
- *  [A, A, B]
+ * Calculates the number of dataplane slots each of the @num_nhops
+ *  nexthops in @x gets out of @num_slots, storing the result in @slots.
  */
 static void
-compile_nhgrp(struct nhgrp_priv *dst_priv, const struct weightened_nhop *x,
-    uint32_t num_slots)
+calc_nhgrp_slots(const struct weightened_nhop *x, int num_nhops,
+    uint32_t num_slots, uint32_t *slots)
 {
-	struct nhgrp_object *dst;
 	int i, slot_idx, remaining_slots;
 	uint64_t remaining_sum, nh_weight, nh_slots;
 
 	slot_idx  = 0;
-	dst = dst_priv->nhg;
 	/* Calculate sum of all weights */
 	remaining_sum = 0;
-	for (i = 0; i < dst_priv->nhg_nh_count; i++)
+	for (i = 0; i < num_nhops; i++)
 		remaining_sum += x[i].weight;
 	remaining_slots = num_slots;
 	FIB_NH_LOG(LOG_DEBUG3, x[0].nh, "sum: %lu, slots: %d",
 	    remaining_sum, remaining_slots);
-	for (i = 0; i < dst_priv->nhg_nh_count; i++) {
+	for (i = 0; i < num_nhops; i++) {
 		/* Calculate number of slots for the current nexthop */
 		if (remaining_sum > 0) {
 			nh_weight = (uint64_t)x[i].weight;
@@ -264,31 +263,52 @@ compile_nhgrp(struct nhgrp_priv *dst_priv, const struct weightened_nhop *x,
 
 		KASSERT((slot_idx + nh_slots <= num_slots),
 		    ("index overflow during nhg compilation"));
-		while (nh_slots-- > 0)
+		slots[i] = nh_slots;
+		slot_idx += nh_slots;
+	}
+}
+
+/*
+ * Compile actual list of nexthops to be used by datapath from
+ *  the nexthop group @dst.
+ *
+ * For example, compiling control plane list of 2 nexthops
+ *  [(200, A), (100, B)] would result in the datapath array
+ *  [A, A, B]
+ */
+static void
+compile_nhgrp(struct nhgrp_priv *dst_priv, const struct weightened_nhop *x,
+    uint32_t num_slots)
+{
+	uint32_t slots[RIB_MAX_MPATH_WIDTH];
+	struct nhgrp_object *dst;
+	int i, slot_idx;
+
+	dst = dst_priv->nhg;
+	calc_nhgrp_slots(x, dst_priv->nhg_nh_count, num_slots, slots);
+	for (i = 0, slot_idx = 0; i < dst_priv->nhg_nh_count; i++) {
+		while (slots[i]-- > 0)
 			dst->nhops[slot_idx++] = x[i].nh;
 	}
 }
 
 /*
- * Allocates new nexthop group for the list of weightened nexthops.
- * Assume sorted list.
- * Does NOT reference any nexthops in the group.
+ * Allocates and initialises nexthop group storage for @num_nhops nexthops
+ * in @wn and @nhgrp_size dataplane slots.
+ * Leaves the dataplane slots empty.
  * Returns group with refcount=1 or NULL.
  */
 static struct nhgrp_priv *
-alloc_nhgrp(struct weightened_nhop *wn, int num_nhops)
+alloc_nhgrp_storage(const struct weightened_nhop *wn, int num_nhops,
+    uint32_t nhgrp_size, bool resilient)
 {
-	uint32_t nhgrp_size;
 	struct nhgrp_object *nhg;
 	struct nhgrp_priv *nhg_priv;
 
-	nhgrp_size = calc_min_mpath_slots(wn, num_nhops);
-	if (nhgrp_size == 0) {
-		/* Zero weights, abort */
-		return (NULL);
-	}
-
 	size_t sz = get_nhgrp_alloc_size(nhgrp_size, num_nhops);
+	/* Resilient groups keep bucket activity time after the nexthops */
+	if (resilient)
+		sz += nhgrp_size * sizeof(uint32_t);
 	nhg = malloc(sz, M_NHOP, M_NOWAIT | M_ZERO);
 	if (nhg == NULL) {
 		FIB_NH_LOG(LOG_INFO, wn[0].nh,
@@ -311,15 +331,395 @@ alloc_nhgrp(struct weightened_nhop *wn, int num_nhops)
 	nhg_priv->nhg = nhg;
 	memcpy(&nhg_priv->nhg_nh_weights[0], wn,
 	  num_nhops * sizeof(struct weightened_nhop));
+	if (resilient) {
+		nhg->nhg_flags |= MPF_RESILIENT;
+		nhg_priv->nhg_res_flags = NHG_RES_F_RESILIENT;
+		nhg_priv->nhg_res_atime =
+		    (uint32_t *)&nhg_priv->nhg_nh_weights[num_nhops];
+	}
+
+	return (nhg_priv);
+}
+
+/*
+ * Allocates new nexthop group for the list of weightened nexthops.
+ * Assume sorted list.
+ * Does NOT reference any nexthops in the group.
+ * Returns group with refcount=1 or NULL.
+ */
+static struct nhgrp_priv *
+alloc_nhgrp(struct weightened_nhop *wn, int num_nhops)
+{
+	uint32_t nhgrp_size;
+	struct nhgrp_priv *nhg_priv;
+
+	nhgrp_size = calc_min_mpath_slots(wn, num_nhops);
+	if (nhgrp_size == 0) {
+		/* Zero weights, abort */
+		return (NULL);
+	}
+
+	nhg_priv = alloc_nhgrp_storage(wn, num_nhops, nhgrp_size, false);
+	if (nhg_priv == NULL)
+		return (NULL);
 
 	FIB_NH_LOG(LOG_DEBUG, wn[0].nh, "num_nhops: %d, compiled_nhop: %u",
 	    num_nhops, nhgrp_size);
 
-	compile_nhgrp(nhg_priv, wn, nhg->nhg_size);
+	compile_nhgrp(nhg_priv, wn, nhgrp_size);
+
+	return (nhg_priv);
+}
+
+static uint32_t
+gcd_slots(uint32_t a, uint32_t b)
+{
+	uint32_t t;
+
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return (a);
+}
+
+/*
+ * Fills @slots with the number of dataplane slots occupied by each
+ * control plane nexthop of @nhg_priv.
+ * compile_nhgrp() lays the slots out in the control plane order, so
+ * a single pass over the dataplane array is enough.
+ */
+static void
+get_nhgrp_slots(const struct nhgrp_priv *nhg_priv, uint32_t *slots)
+{
+	const struct nhgrp_object *nhg = nhg_priv->nhg;
+	int i = 0;
+
+	memset(slots, 0, nhg_priv->nhg_nh_count * sizeof(uint32_t));
+	for (int j = 0; j < nhg->nhg_size; j++) {
+		while (nhg_priv->nhg_nh_weights[i].nh != nhg->nhops[j])
+			i++;
+		KASSERT((i < nhg_priv->nhg_nh_count),
+		    ("dataplane slot %d not in the control plane list", j));
+		slots[i]++;
+	}
+}
+
+/*
+ * Derives the dataplane part of the group for the sorted list of
+ * nexthops in @wn from the already compiled group @src_priv, without
+ * calling calc_min_mpath_slots() / compile_nhgrp().
+ *
+ * This only works if @src_priv slots are exactly proportional to the
+ * weights, which always holds for the equal-cost groups. In that case
+ * nexthops retained from @src_priv keep their slot counts, new nexthops
+ * get the slot count matching their weight and the result is reduced
+ * by the common divisor.
+ * Does NOT reference any nexthops in the group.
+ * Returns group with refcount=1 or NULL if the group has to be compiled
+ *  from scratch.
+ */
+static struct nhgrp_priv *
+alloc_nhgrp_derived(const struct nhgrp_priv *src_priv,
+    const struct weightened_nhop *wn, int num_nhops)
+{
+	uint32_t src_slots[RIB_MAX_MPATH_WIDTH], slots[RIB_MAX_MPATH_WIDTH];
+	const struct weightened_nhop *src_wn = src_priv->nhg_nh_weights;
+	struct nhgrp_object *nhg;
+	struct nhgrp_priv *nhg_priv;
+	uint64_t base_weight, base_slots;
+	uint32_t g, nhgrp_size;
+	int i, j, slot_idx;
+
+	get_nhgrp_slots(src_priv, src_slots);
+	base_weight = src_wn[0].weight;
+	base_slots = src_slots[0];
+	if (base_weight == 0 || base_slots == 0)
+		return (NULL);
+	for (i = 1; i < src_priv->nhg_nh_count; i++) {
+		if (src_wn[i].weight * base_slots != src_slots[i] * base_weight)
+			return (NULL);
+	}
+
+	g = 0;
+	nhgrp_size = 0;
+	for (i = 0, j = 0; i < num_nhops; i++) {
+		uint32_t idx = wn[i].nh->nh_priv->nh_idx;
+
+		while (j < src_priv->nhg_nh_count &&
+		    src_wn[j].nh->nh_priv->nh_idx < idx)
+			j++;
+		if (j < src_priv->nhg_nh_count && src_wn[j].nh == wn[i].nh &&
+		    src_wn[j].weight == wn[i].weight) {
+			slots[i] = src_slots[j];
+		} else {
+			uint64_t w = wn[i].weight * base_slots;
+
+			if (w == 0 || (w % base_weight) != 0 ||
+			    w / base_weight > RIB_MAX_MPATH_WIDTH)
+				return (NULL);
+			slots[i] = w / base_weight;
+		}
+		g = gcd_slots(slots[i], g);
+		nhgrp_size += slots[i];
+	}
+	nhgrp_size /= g;
+	if (nhgrp_size > RIB_MAX_MPATH_WIDTH)
+		return (NULL);
+
+	nhg_priv = alloc_nhgrp_storage(wn, num_nhops, nhgrp_size, false);
+	if (nhg_priv == NULL)
+		return (NULL);
+
+	FIB_NH_LOG(LOG_DEBUG, wn[0].nh, "num_nhops: %d, derived_nhop: %u",
+	    num_nhops, nhgrp_size);
+
+	nhg = nhg_priv->nhg;
+	for (i = 0, slot_idx = 0; i < num_nhops; i++) {
+		for (uint32_t k = 0; k < slots[i] / g; k++)
+			nhg->nhops[slot_idx++] = wn[i].nh;
+	}
+
+	return (nhg_priv);
+}
+
+/*
+ * Resilient nexthop groups.
+ *
+ * Resilient group has a fixed number of dataplane slots (buckets),
+ *  NHGRP_RES_BUCKETS. When a group is derived from the resilient one,
+ *  buckets of the retained nexthops are kept as-is and only the buckets
+ *  of the removed nexthops, plus the surplus buckets of the overloaded
+ *  ones, are reassigned. That way a membership change moves only the
+ *  flows which have to be moved.
+ *
+ * Datapath records the bucket activity time in nhgrp_res_touch().
+ * Surplus buckets are reassigned only after being idle for nhg_res_idle
+ *  seconds to avoid breaking active flows. Groups left unbalanced are
+ *  revisited by the per-nh_control callout, which moves the buckets
+ *  in-place: cmp_nhgrp() only considers the control plane part, so the
+ *  bucket mapping is not a part of the group identity.
+ */
+CTASSERT(NHGRP_RES_BUCKETS <= UINT8_MAX);
+CTASSERT(NHGRP_RES_BUCKETS >= RIB_MAX_MPATH_WIDTH);
+
+static void nhgrp_res_schedule(struct nh_control *ctl);
+
+/*
+ * Returns index of @nh in the sorted control plane list of @nhg_priv
+ *  or -1.
+ */
+static int
+find_nhgrp_member(const struct nhgrp_priv *nhg_priv,
+    const struct nhop_object *nh)
+{
+	const struct weightened_nhop *wn = nhg_priv->nhg_nh_weights;
+	int l, r, m;
+	uint32_t idx;
+
+	if (nh == NULL)
+		return (-1);
+	idx = nh->nh_priv->nh_idx;
+	l = 0;
+	r = nhg_priv->nhg_nh_count - 1;
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (wn[m].nh->nh_priv->nh_idx == idx)
+			return ((wn[m].nh == nh) ? m : -1);
+		if (wn[m].nh->nh_priv->nh_idx < idx)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+
+	return (-1);
+}
+
+/*
+ * Reassigns buckets of the resilient group @nhg_priv towards the
+ *  distribution compile_nhgrp() would produce. Buckets not pointing to
+ *  the group members are always reassigned, surplus buckets of the
+ *  overloaded members only if they have been idle long enough.
+ * Caller guarantees there are no concurrent rebalancers for the group.
+ * Returns true if some of the members are still overloaded.
+ */
+static bool
+rebalance_res_buckets(struct nhgrp_priv *nhg_priv, uint32_t now)
+{
+	uint32_t targets[RIB_MAX_MPATH_WIDTH], counts[RIB_MAX_MPATH_WIDTH];
+	int8_t members[NHGRP_RES_BUCKETS];
+	uint8_t moved[NHGRP_RES_BUCKETS];
+	struct nhgrp_object *nhg = nhg_priv->nhg;
+	uint32_t *atime = nhg_priv->nhg_res_atime;
+	int i, m, num_moved;
+
+	calc_nhgrp_slots(nhg_priv->nhg_nh_weights, nhg_priv->nhg_nh_count,
+	    nhg->nhg_size, targets);
+	memset(counts, 0, nhg_priv->nhg_nh_count * sizeof(uint32_t));
+	for (i = 0; i < nhg->nhg_size; i++) {
+		members[i] = find_nhgrp_member(nhg_priv, nhg->nhops[i]);
+		if (members[i] >= 0)
+			counts[members[i]]++;
+	}
+
+	num_moved = 0;
+	for (i = 0; i < nhg->nhg_size; i++) {
+		m = members[i];
+		if (m >= 0) {
+			if (counts[m] <= targets[m])
+				continue;
+			if (now - atomic_load_int(&atime[i]) < nhg_priv->nhg_res_idle)
+				continue;
+			counts[m]--;
+		}
+		moved[num_moved++] = i;
+	}
+
+	for (i = 0, m = 0; i < num_moved; i++) {
+		while (counts[m] >= targets[m])
+			m++;
+		KASSERT((m < nhg_priv->nhg_nh_count),
+		    ("no room for bucket %d during nhg rebalance", moved[i]));
+		counts[m]++;
+		atomic_store_rel_ptr((volatile uintptr_t *)&nhg->nhops[moved[i]],
+		    (uintptr_t)nhg_priv->nhg_nh_weights[m].nh);
+		atomic_store_int(&atime[moved[i]], now);
+	}
+
+	for (m = 0; m < nhg_priv->nhg_nh_count; m++) {
+		if (counts[m] > targets[m])
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Allocates new resilient group for the sorted list of nexthops @wn.
+ * Does NOT reference any nexthops in the group.
+ * Returns group with refcount=1 or NULL.
+ */
+static struct nhgrp_priv *
+alloc_nhgrp_res(struct weightened_nhop *wn, int num_nhops, uint16_t idle)
+{
+	struct nhgrp_priv *nhg_priv;
+
+	nhg_priv = alloc_nhgrp_storage(wn, num_nhops, NHGRP_RES_BUCKETS, true);
+	if (nhg_priv == NULL)
+		return (NULL);
+	nhg_priv->nhg_res_idle = idle;
+
+	FIB_NH_LOG(LOG_DEBUG, wn[0].nh, "num_nhops: %d, resilient buckets: %u",
+	    num_nhops, NHGRP_RES_BUCKETS);
+
+	compile_nhgrp(nhg_priv, wn, NHGRP_RES_BUCKETS);
 
 	return (nhg_priv);
 }
 
+/*
+ * Derives the resilient group for the sorted list of nexthops @wn from
+ *  the resilient group @src_priv, keeping the bucket mapping and the
+ *  activity time of the buckets which can stay in place.
+ * Does NOT reference any nexthops in the group.
+ * Returns group with refcount=1 or NULL.
+ */
+static struct nhgrp_priv *
+alloc_nhgrp_res_derived(const struct nhgrp_priv *src_priv,
+    const struct weightened_nhop *wn, int num_nhops)
+{
+	const struct nhgrp_object *src = src_priv->nhg;
+	struct nhgrp_priv *nhg_priv;
+	struct nhgrp_object *nhg;
+
+	nhg_priv = alloc_nhgrp_storage(wn, num_nhops, src->nhg_size, true);
+	if (nhg_priv == NULL)
+		return (NULL);
+	nhg_priv->nhg_res_idle = src_priv->nhg_res_idle;
+
+	nhg = nhg_priv->nhg;
+	for (int i = 0; i < src->nhg_size; i++) {
+		nhg->nhops[i] = src->nhops[i];
+		nhg_priv->nhg_res_atime[i] =
+		    atomic_load_int(&src_priv->nhg_res_atime[i]);
+	}
+	if (rebalance_res_buckets(nhg_priv, time_uptime))
+		nhg_priv->nhg_res_pending = 1;
+
+	FIB_NH_LOG(LOG_DEBUG, wn[0].nh, "num_nhops: %d, derived resilient%s",
+	    num_nhops, nhg_priv->nhg_res_pending ? " (unbalanced)" : "");
+
+	return (nhg_priv);
+}
+
+/*
+ * Datapath hook recording the activity of the resilient group bucket
+ *  @slot. Writes at most once per second per bucket.
+ */
+void
+nhgrp_res_touch(struct nhgrp_object *nhg, uint32_t slot)
+{
+	uint32_t *atime = NHGRP_PRIV(nhg)->nhg_res_atime;
+	uint32_t now = time_uptime;
+
+	if (atomic_load_int(&atime[slot]) != now)
+		atomic_store_int(&atime[slot], now);
+}
+
+/*
+ * Per-nh_control callout moving idle surplus buckets of the unbalanced
+ *  resilient groups.
+ */
+static void
+nhgrp_res_callout(void *arg)
+{
+	struct nh_control *ctl = (struct nh_control *)arg;
+	struct nhgrp_priv *nhg_priv;
+	struct epoch_tracker et;
+	bool pending = false;
+
+	CURVNET_SET(ctl->ctl_rh->rib_vnet);
+	NET_EPOCH_ENTER(et);
+	NHOPS_RLOCK(ctl);
+	CHT_SLIST_FOREACH(&ctl->gr_head, mpath, nhg_priv) {
+		if (nhg_priv->nhg_res_pending == 0)
+			continue;
+		if (rebalance_res_buckets(nhg_priv, time_uptime))
+			pending = true;
+		else
+			nhg_priv->nhg_res_pending = 0;
+	} CHT_SLIST_FOREACH_END;
+	NHOPS_RUNLOCK(ctl);
+	NET_EPOCH_EXIT(et);
+
+	if (pending)
+		nhgrp_res_schedule(ctl);
+	CURVNET_RESTORE();
+}
+
+static void
+nhgrp_res_schedule(struct nh_control *ctl)
+{
+
+	if (callout_pending(&ctl->gr_res_callout) == 0)
+		callout_reset_sbt(&ctl->gr_res_callout, SBT_1S, SBT_1MS * 500,
+		    nhgrp_res_callout, ctl, 0);
+}
+
+void
+nhgrp_res_init(struct nh_control *ctl)
+{
+
+	callout_init(&ctl->gr_res_callout, 1);
+}
+
+void
+nhgrp_res_destroy(struct nh_control *ctl)
+{
+
+	callout_drain(&ctl->gr_res_callout);
+}
+
 void
 nhgrp_ref_object(struct nhgrp_object *nhg)
 {
@@ -407,6 +807,8 @@ destroy_nhgrp(struct nhgrp_priv *nhg_priv)
 		    nhgbuf, sizeof(nhgbuf)));
 	}
 
+	if (nhg_priv->nhg_filtered != NULL)
+		nhgrp_free(nhg_priv->nhg_filtered->nhg);
 	free_nhgrp_nhops(nhg_priv);
 	destroy_nhgrp_int(nhg_priv);
 }
@@ -452,6 +854,28 @@ free_nhgrp_nhops(struct nhgrp_priv *nhg_priv)
 		nhop_free(nhg_priv->nhg_nh_weights[i].nh);
 }
 
+/*
+ * Sorts nexthops in @wn and checks there are no duplicates.
+ * Returns 0 on success or errno.
+ */
+static int
+sort_check_nhops(struct nh_control *ctl, struct weightened_nhop *wn,
+    int num_nhops)
+{
+	uint32_t last_id = 0;
+
+	sort_weightened_nhops(wn, num_nhops);
+	for (int i = 0; i < num_nhops; i++) {
+		if (wn[i].nh->nh_priv->nh_control != ctl)
+			return (EINVAL);
+		if (wn[i].nh->nh_priv->nh_idx == last_id)
+			return (EEXIST);
+		last_id = wn[i].nh->nh_priv->nh_idx;
+	}
+
+	return (0);
+}
+
 /*
  * Allocate nexthop group of size @num_nhops with nexthops specified by
  * @wn. Nexthops have to be unique and match the fibnum/family of the group.
@@ -461,6 +885,15 @@ struct nhgrp_object *
 nhgrp_alloc(uint32_t fibnum, int family, struct weightened_nhop *wn, int num_nhops,
     int *perror)
 {
+
+	return (nhgrp_alloc_type(fibnum, family, wn, num_nhops, false, 0,
+	    perror));
+}
+
+static struct nhgrp_object *
+nhgrp_alloc_type(uint32_t fibnum, int family, struct weightened_nhop *wn,
+    int num_nhops, bool resilient, uint16_t idle, int *perror)
+{
 	struct rib_head *rh = rt_tables_get_rnh(fibnum, family);
 	struct nhgrp_priv *nhg_priv;
 	struct nh_control *ctl;
@@ -485,22 +918,14 @@ nhgrp_alloc(uint32_t fibnum, int family, struct weightened_nhop *wn, int num_nho
 		}
 	}
 
-	/* Sort nexthops & check there are no duplicates */
-	sort_weightened_nhops(wn, num_nhops);
-	uint32_t last_id = 0;
-	for (int i = 0; i < num_nhops; i++) {
-		if (wn[i].nh->nh_priv->nh_control != ctl) {
-			*perror = EINVAL;
-			return (NULL);
-		}
-		if (wn[i].nh->nh_priv->nh_idx == last_id) {
-			*perror = EEXIST;
-			return (NULL);
-		}
-		last_id = wn[i].nh->nh_priv->nh_idx;
-	}
+	if ((*perror = sort_check_nhops(ctl, wn, num_nhops)) != 0)
+		return (NULL);
 
-	if ((nhg_priv = alloc_nhgrp(wn, num_nhops)) == NULL) {
+	if (resilient)
+		nhg_priv = alloc_nhgrp_res(wn, num_nhops, idle);
+	else
+		nhg_priv = alloc_nhgrp(wn, num_nhops);
+	if (nhg_priv == NULL) {
 		*perror = ENOMEM;
 		return (NULL);
 	}
@@ -520,6 +945,7 @@ nhgrp_get_nhgrp(struct nhgrp_object *nhg, int *perror)
 	struct nhgrp_priv *nhg_priv, *key = NHGRP_PRIV(nhg);
 	struct nh_control *ctl = key->nh_control;
 
+	key->nhg_hash = hash_nhgrp(key);
 	nhg_priv = find_nhgrp(ctl, key);
 	if (nhg_priv != NULL) {
 		/*
@@ -549,6 +975,8 @@ nhgrp_get_nhgrp(struct nhgrp_object *nhg, int *perror)
 			destroy_nhgrp_int(key);
 			return (NULL);
 		}
+		if (key->nhg_res_pending != 0)
+			nhgrp_res_schedule(ctl);
 		*perror = 0;
 		return (nhg);
 	}
@@ -578,6 +1006,45 @@ get_nhgrp(struct nh_control *ctl, struct weightened_nhop *wn, int num_nhops,
 	return (NULL);
 }
 
+/*
+ * Creates or looks up an existing nexthop group based on @wn and @num_nhops,
+ *  reusing the compiled dataplane of the group @src_priv it is derived from
+ *  when possible.
+ *
+ * Returns referenced nhop group or NULL, passing error code in @perror.
+ */
+static struct nhgrp_priv *
+get_derived_nhgrp(struct nh_control *ctl, const struct nhgrp_priv *src_priv,
+    struct weightened_nhop *wn, int num_nhops, int *perror)
+{
+	struct nhgrp_priv *nhg_priv;
+	struct nhgrp_object *nhg;
+
+	if (num_nhops > RIB_MAX_MPATH_WIDTH) {
+		*perror = E2BIG;
+		return (NULL);
+	}
+	if ((*perror = sort_check_nhops(ctl, wn, num_nhops)) != 0)
+		return (NULL);
+
+	if (src_priv->nhg_res_flags & NHG_RES_F_RESILIENT) {
+		nhg_priv = alloc_nhgrp_res_derived(src_priv, wn, num_nhops);
+		if (nhg_priv == NULL) {
+			*perror = ENOMEM;
+			return (NULL);
+		}
+	} else {
+		nhg_priv = alloc_nhgrp_derived(src_priv, wn, num_nhops);
+		if (nhg_priv == NULL)
+			return (get_nhgrp(ctl, wn, num_nhops, 0, perror));
+	}
+	nhg_priv->nh_control = ctl;
+
+	nhg = nhgrp_get_nhgrp(nhg_priv->nhg, perror);
+	if (nhg != NULL)
+		return (NHGRP_PRIV(nhg));
+	return (NULL);
+}
 
 /*
  * Appends one or more nexthops denoted by @wm to the nexthop group @gr_orig.
@@ -622,7 +1089,7 @@ append_nhops(struct nh_control *ctl, const struct nhgrp_object *gr_orig,
 	memcpy(&pnhops[curr_nhops], wn, num_nhops * sizeof(struct weightened_nhop));
 	curr_nhops += num_nhops;
 
-	nhg_priv = get_nhgrp(ctl, pnhops, curr_nhops, 0, perror);
+	nhg_priv = get_derived_nhgrp(ctl, src_priv, pnhops, curr_nhops, perror);
 
 	if (pnhops != (struct weightened_nhop *)&storage[0])
 		free(pnhops, M_TEMP);
@@ -656,6 +1123,78 @@ nhgrp_get_group(struct rib_head *rh, struct weightened_nhop *wn, int num_nhops,
 	return (error);
 }
 
+/*
+ * Creates/finds resilient nexthop group based on @wn and @num_nhops.
+ * Groups derived from the resilient group by adding or removing nexthops
+ *  are resilient as well and move only the buckets of the changed
+ *  nexthops. Surplus buckets are moved after being idle for
+ *  @idle_timer seconds.
+ * Returns 0 on success with referenced group in @pnhg, or errno.
+ */
+int
+nhgrp_get_resilient_group(struct rib_head *rh, struct weightened_nhop *wn,
+    int num_nhops, uint32_t uidx, uint16_t idle_timer,
+    struct nhgrp_object **pnhg)
+{
+	struct nhgrp_object *nhg;
+	int error;
+
+	nhg = nhgrp_alloc_type(rh->rib_fibnum, rh->rib_family, wn, num_nhops,
+	    true, idle_timer, &error);
+	if (nhg == NULL)
+		return (error);
+	nhgrp_set_uidx(nhg, uidx);
+	nhg = nhgrp_get_nhgrp(nhg, &error);
+	if (nhg != NULL)
+		*pnhg = nhg;
+
+	return (error);
+}
+
+/*
+ * Returns referenced group consisting of the nexthops @wn left after
+ *  filtering @src_priv, or NULL with non-zero @perror.
+ *
+ * Deleting a nexthop results in the same filtering being applied to every
+ * route referencing @src_priv. The first caller derives the group and
+ * publishes it in @src_priv->nhg_filtered with a single pointer swap, so
+ * the remaining routes get the group by acquiring a reference instead of
+ * allocating, compiling and looking it up in the hash again.
+ * The cached group always has less nexthops than @src_priv, hence the
+ * cache references can't form a loop.
+ */
+static struct nhgrp_priv *
+get_filtered_nhgrp(struct nh_control *ctl, struct nhgrp_priv *src_priv,
+    struct weightened_nhop *wn, int num_nhops, int *perror)
+{
+	struct nhgrp_priv *nhg_priv, *old_priv;
+
+	NET_EPOCH_ASSERT();
+
+	nhg_priv = (struct nhgrp_priv *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&src_priv->nhg_filtered);
+	if (nhg_priv != NULL && nhg_priv->nhg_nh_count == num_nhops &&
+	    memcmp(nhg_priv->nhg_nh_weights, wn,
+	    num_nhops * sizeof(struct weightened_nhop)) == 0 &&
+	    refcount_acquire_if_not_zero(&nhg_priv->nhg_refcount) != 0) {
+		*perror = 0;
+		return (nhg_priv);
+	}
+
+	nhg_priv = get_derived_nhgrp(ctl, src_priv, wn, num_nhops, perror);
+	if (nhg_priv == NULL)
+		return (NULL);
+
+	/* The cache holds its own reference */
+	nhgrp_ref_object(nhg_priv->nhg);
+	old_priv = (struct nhgrp_priv *)atomic_swap_ptr(
+	    (volatile uintptr_t *)&src_priv->nhg_filtered, (uintptr_t)nhg_priv);
+	if (old_priv != NULL)
+		nhgrp_free(old_priv->nhg);
+
+	return (nhg_priv);
+}
+
 /*
  * Creates new nexthop group based on @src group without the nexthops
  * chosen by @flt_func.
@@ -670,10 +1209,12 @@ nhgrp_get_filtered_group(struct rib_head *rh, const struct rtentry *rt,
 	struct nh_control *ctl = rh->nh_control;
 	struct weightened_nhop *pnhops;
 	const struct nhgrp_priv *mp_priv, *src_priv;
+	struct nhgrp_priv *src_mut;
 	size_t sz;
 	int error, i, num_nhops;
 
 	src_priv = NHGRP_PRIV_CONST(src);
+	src_mut = __DECONST(struct nhgrp_priv *, src_priv);
 
 	sz = src_priv->nhg_nh_count * (sizeof(struct weightened_nhop));
 	/* optimize for <= 4 paths, each path=16 bytes */
@@ -702,8 +1243,15 @@ nhgrp_get_filtered_group(struct rib_head *rh, const struct rtentry *rt,
 		rnd->rnd_weight = pnhops[0].weight;
 		if (nhop_try_ref_object(rnd->rnd_nhop) == 0)
 			error = EAGAIN;
+	} else if (num_nhops == src_priv->nhg_nh_count &&
+	    src_priv->nhg_uidx == 0 &&
+	    refcount_acquire_if_not_zero(&src_mut->nhg_refcount) != 0) {
+		/* Nothing filtered out, the result is @src itself */
+		rnd->rnd_nhgrp = src_mut->nhg;
+		rnd->rnd_weight = 0;
 	} else {
-		mp_priv = get_nhgrp(ctl, pnhops, num_nhops, 0, &error);
+		mp_priv = get_filtered_nhgrp(ctl, src_mut, pnhops, num_nhops,
+		    &error);
 		if (mp_priv != NULL)
 			rnd->rnd_nhgrp = mp_priv->nhg;
 		rnd->rnd_weight = 0;
@@ -951,7 +1499,8 @@ nhgrp_dump_sysctl(struct rib_head *rh, struct sysctl_req *w)
 	/* Calculate the maximum nhop group size in bytes */
 	sz = sizeof(struct rt_msghdr) + sizeof(struct nhgrp_external);
 	sz += 2 * sizeof(struct nhgrp_container);
-	sz += 2 * sizeof(struct nhgrp_nhop_external) * RIB_MAX_MPATH_WIDTH;
+	sz += sizeof(struct nhgrp_nhop_external) * RIB_MAX_MPATH_WIDTH;
+	sz += sizeof(struct nhgrp_nhop_external) * NHGRP_RES_BUCKETS;
 	buffer = malloc(sz, M_TEMP, M_NOWAIT);
 	if (buffer == NULL)
 		return (ENOMEM);
@@ -37,9 +37,10 @@
 
 /* nhgrp hash definition */
 /* produce hash value for an object */
-#define	mpath_hash_obj(_obj)	(hash_nhgrp(_obj))
-/* compare two objects */
-#define	mpath_cmp(_one, _two)	(cmp_nhgrp(_one, _two))
+#define	mpath_hash_obj(_obj)	((_obj)->nhg_hash)
+/* compare two objects, cached hash first */
+#define	mpath_cmp(_one, _two)	\
+	((_one)->nhg_hash == (_two)->nhg_hash && cmp_nhgrp(_one, _two))
 /* next object accessor */
 #define	mpath_next(_obj)	(_obj)->nhg_priv_next
 
@@ -48,22 +49,34 @@ struct nhgrp_priv {
 	uint32_t		nhg_uidx;
 	uint8_t			nhg_nh_count;	/* number of items in nh_weights */
 	uint8_t			nhg_origin;	/* protocol which created the group */
-	uint8_t			nhg_spare[2];
+	uint8_t			nhg_res_flags;	/* NHG_RES_F_ group type flags */
+	uint8_t			nhg_res_pending;/* resilient group is unbalanced */
+	uint16_t		nhg_res_idle;	/* bucket idle timer, seconds */
+	uint16_t		nhg_spare;
 	u_int			nhg_refcount;	/* use refcount */
 	u_int			nhg_linked;	/* refcount(9), == 2 if linked to the list */
+	uint32_t		nhg_hash;	/* hash_nhgrp() value */
 	struct nh_control	*nh_control;	/* parent control structure */
 	struct nhgrp_priv	*nhg_priv_next;
 	struct nhgrp_object	*nhg;
+	struct nhgrp_priv	*nhg_filtered;	/* last filtered group, referenced */
+	uint32_t		*nhg_res_atime;	/* bucket activity time */
 	struct epoch_context	nhg_epoch_ctx;	/* epoch data for nhop */
 	struct weightened_nhop	nhg_nh_weights[0];
 };
 
+#define	NHG_RES_F_RESILIENT	0x01	/* fixed buckets, minimal disruption */
+
+/* Number of dataplane buckets in the resilient groups */
+#define	NHGRP_RES_BUCKETS	128
+
 #define	_NHGRP_PRIV(_src)	 (&(_src)->nhops[(_src)->nhg_size])
 #define	NHGRP_PRIV(_src)	 ((struct nhgrp_priv *)_NHGRP_PRIV(_src))
 #define	NHGRP_PRIV_CONST(_src)	 ((const struct nhgrp_priv *)_NHGRP_PRIV(_src))
 
 /* nhgrp.c */
 bool nhgrp_ctl_alloc_default(struct nh_control *ctl, int malloc_flags);
+uint32_t hash_nhgrp(const struct nhgrp_priv *obj);
 struct nhgrp_priv *find_nhgrp(struct nh_control *ctl, const struct nhgrp_priv *key);
 int link_nhgrp(struct nh_control *ctl, struct nhgrp_priv *grp_priv);
 struct nhgrp_priv *unlink_nhgrp(struct nh_control *ctl, struct nhgrp_priv *key);
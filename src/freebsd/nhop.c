@@ -32,6 +32,7 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rwlock.h>
 #include <sys/malloc.h>
 #include <sys/mbuf.h>
@@ -62,7 +63,8 @@ _DECLARE_DEBUG(LOG_INFO);
  *  ifp, ifa, aifp, mtu, gw addr(if set), nh_type, nh_family, mask of rt_flags and
  *    NHF_DEFAULT
  *
- * All nexthops are stored in the resizable hash table.
+ * All nexthops are stored in the sharded resizable hash table with
+ *  lockless lookups, see nhop_var.h.
  * Additionally, each nexthop gets assigned its unique index (nexthop index)
  * so userland programs can interact with the nexthops easier. Index allocation
  * is backed by the bitmask array.
@@ -72,24 +74,47 @@ MALLOC_DEFINE(M_NHOP, "nhops", "nexthops data");
 
 /* Hash management functions */
 
+static struct nhop_buckets *
+alloc_nhop_buckets(uint32_t num_buckets, int flags)
+{
+	struct nhop_buckets *nb;
+
+	nb = malloc(sizeof(*nb) + num_buckets * sizeof(struct nhop_priv *),
+	    M_NHOP, flags | M_ZERO);
+	if (nb != NULL)
+		nb->nb_size = num_buckets;
+
+	return (nb);
+}
+
+static void
+free_nhop_buckets_epoch(epoch_context_t ctx)
+{
+	struct nhop_buckets *nb;
+
+	nb = __containerof(ctx, struct nhop_buckets, nb_epoch_ctx);
+	free(nb, M_NHOP);
+}
+
 int
 nhops_init_rib(struct rib_head *rh)
 {
 	struct nh_control *ctl;
-	size_t alloc_size;
-	uint32_t num_buckets, num_items;
+	uint32_t num_items;
 	void *ptr;
 
 	ctl = malloc(sizeof(struct nh_control), M_NHOP, M_WAITOK | M_ZERO);
 
 	/*
-	 * Allocate nexthop hash. Start with 16 items by default (128 bytes).
-	 * This will be enough for most of the cases.
+	 * Allocate nexthop hash. Start with 4 buckets per shard (64 total),
+	 * this will be enough for most of the cases.
 	 */
-	num_buckets = 16;
-	alloc_size = CHT_SLIST_GET_RESIZE_SIZE(num_buckets);
-	ptr = malloc(alloc_size, M_NHOP, M_WAITOK | M_ZERO);
-	CHT_SLIST_INIT(&ctl->nh_head, ptr, num_buckets);
+	for (int i = 0; i < NHOP_SHARDS; i++) {
+		struct nhop_shard *ns = &ctl->nh_shards[i];
+
+		ns->ns_buckets = alloc_nhop_buckets(NHOP_SHARD_MIN_BUCKETS, M_WAITOK);
+		NHOPS_SHARD_LOCK_INIT(ns);
+	}
 
 	/*
 	 * Allocate nexthop index bitmask.
@@ -98,7 +123,13 @@ nhops_init_rib(struct rib_head *rh)
 	ptr = malloc(bitmask_get_size(num_items), M_NHOP, M_WAITOK | M_ZERO);
 	bitmask_init(&ctl->nh_idx_head, ptr, num_items);
 
+	for (int i = 0; i < NHOP_IFP_BUCKETS; i++)
+		LIST_INIT(&ctl->nh_ifp_idx[i]);
+
 	NHOPS_LOCK_INIT(ctl);
+#ifdef ROUTE_MPATH
+	nhgrp_ctl_init(ctl);
+#endif
 
 	rh->nh_control = ctl;
 	ctl->ctl_rh = rh;
@@ -113,7 +144,10 @@ destroy_ctl(struct nh_control *ctl)
 {
 
 	NHOPS_LOCK_DESTROY(ctl);
-	free(ctl->nh_head.ptr, M_NHOP);
+	for (int i = 0; i < NHOP_SHARDS; i++) {
+		NHOPS_SHARD_LOCK_DESTROY(&ctl->nh_shards[i]);
+		free(ctl->nh_shards[i].ns_buckets, M_NHOP);
+	}
 	free(ctl->nh_idx_head.idx, M_NHOP);
 #ifdef ROUTE_MPATH
 	nhgrp_ctl_free(ctl);
@@ -155,11 +189,17 @@ nhops_destroy_rib(struct rib_head *rh)
 	 *  details.
 	 */
 
+#ifdef ROUTE_MPATH
+	nhgrp_res_destroy(ctl);
+#endif
+
 	NHOPS_WLOCK(ctl);
-	CHT_SLIST_FOREACH(&ctl->nh_head, nhops, nh_priv) {
+	nhops_shards_lock(ctl);
+	NHOPS_FOREACH(ctl, nh_priv) {
 		FIB_RH_LOG(LOG_DEBUG3, rh, "marking nhop %u unlinked", nh_priv->nh_idx);
 		refcount_release(&nh_priv->nh_linked);
-	} CHT_SLIST_FOREACH_END;
+	} NHOPS_FOREACH_END;
+	nhops_shards_unlock(ctl);
 #ifdef ROUTE_MPATH
 	nhgrp_ctl_unlink_all(ctl);
 #endif
@@ -197,150 +237,254 @@ struct _hash_data {
 	uint32_t	gw_addr;
 };
 
-static unsigned
-djb_hash(const unsigned char *h, const int len)
+/* Final mix of MurmurHash3 */
+static inline uint64_t
+hash_fmix64(uint64_t h)
 {
-	unsigned int result = 0;
-	int i;
-
-	for (i = 0; i < len; i++)
-		result = 33 * result ^ h[i];
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
 
-	return (result);
+	return (h);
 }
 
+/*
+ * Hashes the 8-byte key as a single word. Both the shard (lower bits)
+ *  and the bucket (upper bits) indices depend on every key bit.
+ */
 static uint32_t
 hash_priv(const struct nhop_priv *priv)
 {
 	struct nhop_object *nh = priv->nh;
-	struct _hash_data key = {
-	    .ifentropy = (uint16_t)((((uintptr_t)nh->nh_ifp) >> 6) & 0xFFFF),
-	    .family = nh->gw_sa.sa_family,
-	    .nh_type = priv->nh_type & 0xFF,
-	    .gw_addr = (nh->gw_sa.sa_family == AF_INET6) ?
-		nh->gw6_sa.sin6_addr.s6_addr32[3] :
-		nh->gw4_sa.sin_addr.s_addr
+	union {
+		struct _hash_data	data;
+		uint64_t		word;
+	} key = {
+	    .data = {
+		.ifentropy = (uint16_t)((((uintptr_t)nh->nh_ifp) >> 6) & 0xFFFF),
+		.family = nh->gw_sa.sa_family,
+		.nh_type = priv->nh_type & 0xFF,
+		.gw_addr = (nh->gw_sa.sa_family == AF_INET6) ?
+		    nh->gw6_sa.sin6_addr.s6_addr32[3] :
+		    nh->gw4_sa.sin_addr.s_addr
+	    }
 	};
+	_Static_assert(sizeof(key.data) == sizeof(key.word), "hash key size");
 
-	return (uint32_t)(djb_hash((const unsigned char *)&key, sizeof(key)));
+	return ((uint32_t)hash_fmix64(key.word));
 }
 
 /*
- * Checks if hash needs resizing and performs this resize if necessary
- *
+ * Returns the new bucket count for the shard @ns or 0 if the current
+ *  one is fine. Same policy as CHT_SLIST_GET_RESIZE_BUCKETS().
+ */
+static uint32_t
+get_shard_resize_buckets(const struct nhop_shard *ns)
+{
+	uint32_t size = ns->ns_buckets->nb_size;
+
+	if (ns->ns_items * 2 > size && size < NHOP_SHARD_MAX_BUCKETS)
+		return (size * 2);
+	if (ns->ns_items * 4 < size && size > NHOP_SHARD_MIN_BUCKETS)
+		return (size / 2);
+
+	return (0);
+}
+
+/*
+ * Resizes shard @ns bucket array to @new_buckets if still needed.
+ * Only this shard is locked, lookups proceed and fall back to the
+ *  locked path if they overlap.
  */
 static void
-consider_resize(struct nh_control *ctl, uint32_t new_nh_buckets, uint32_t new_idx_items)
+resize_shard(struct nh_control *ctl, struct nhop_shard *ns, uint32_t new_buckets)
 {
-	void *nh_ptr, *nh_idx_ptr;
-	void *old_idx_ptr;
-	size_t alloc_size;
+	struct nhop_buckets *nb, *nb_old;
+	struct nhop_priv *nh_priv, *next;
+	uint32_t idx;
+
+	nb = alloc_nhop_buckets(new_buckets, M_NOWAIT);
+	if (nb == NULL) {
+		/* Retry at the next link/unlink */
+		return;
+	}
 
-	nh_ptr = NULL;
-	if (new_nh_buckets != 0) {
-		alloc_size = CHT_SLIST_GET_RESIZE_SIZE(new_nh_buckets);
-		nh_ptr = malloc(alloc_size, M_NHOP, M_NOWAIT | M_ZERO);
+	NHOPS_SHARD_LOCK(ns);
+	nb_old = ns->ns_buckets;
+	if (get_shard_resize_buckets(ns) != new_buckets) {
+		NHOPS_SHARD_UNLOCK(ns);
+		free(nb, M_NHOP);
+		return;
 	}
 
-	nh_idx_ptr = NULL;
-	if (new_idx_items != 0) {
-		alloc_size = bitmask_get_size(new_idx_items);
-		nh_idx_ptr = malloc(alloc_size, M_NHOP, M_NOWAIT | M_ZERO);
+	atomic_store_rel_32(&ns->ns_gen, ns->ns_gen + 1);
+	for (uint32_t i = 0; i < nb_old->nb_size; i++) {
+		for (nh_priv = nb_old->nb_ptr[i]; nh_priv != NULL; nh_priv = next) {
+			next = nh_priv->nh_next;
+			idx = NHOP_BUCKET_IDX(nb, nh_priv->nh_hash);
+			atomic_store_rel_ptr((uintptr_t *)&nh_priv->nh_next,
+			    (uintptr_t)nb->nb_ptr[idx]);
+			nb->nb_ptr[idx] = nh_priv;
+		}
 	}
+	atomic_store_rel_ptr((uintptr_t *)&ns->ns_buckets, (uintptr_t)nb);
+	atomic_store_rel_32(&ns->ns_gen, ns->ns_gen + 1);
+	NHOPS_SHARD_UNLOCK(ns);
+
+	FIB_CTL_LOG(LOG_DEBUG, ctl, "resized nhop shard %u: %u -> %u buckets",
+	    (uint32_t)(ns - ctl->nh_shards), nb_old->nb_size, new_buckets);
+
+	/* Lockless readers may still traverse the old array */
+	NET_EPOCH_CALL(free_nhop_buckets_epoch, &nb_old->nb_epoch_ctx);
+}
+
+/*
+ * Checks if nexthop index needs resizing and performs this resize
+ *  if necessary.
+ */
+static void
+consider_idx_resize(struct nh_control *ctl, uint32_t new_idx_items)
+{
+	void *nh_idx_ptr, *old_idx_ptr;
+	size_t alloc_size;
 
-	if (nh_ptr == NULL && nh_idx_ptr == NULL) {
-		/* Either resize is not required or allocations have failed. */
+	if (new_idx_items == 0)
+		return;
+
+	alloc_size = bitmask_get_size(new_idx_items);
+	nh_idx_ptr = malloc(alloc_size, M_NHOP, M_NOWAIT | M_ZERO);
+	if (nh_idx_ptr == NULL) {
+		/* Allocation has failed. */
 		return;
 	}
 
-	FIB_CTL_LOG(LOG_DEBUG, ctl,
-	    "going to resize: nh:[ptr:%p sz:%u] idx:[ptr:%p sz:%u]",
-	    nh_ptr, new_nh_buckets, nh_idx_ptr, new_idx_items);
+	FIB_CTL_LOG(LOG_DEBUG, ctl, "going to resize: idx:[ptr:%p sz:%u]",
+	    nh_idx_ptr, new_idx_items);
 
 	old_idx_ptr = NULL;
 
 	NHOPS_WLOCK(ctl);
-	if (nh_ptr != NULL) {
-		CHT_SLIST_RESIZE(&ctl->nh_head, nhops, nh_ptr, new_nh_buckets);
-	}
-	if (nh_idx_ptr != NULL) {
-		if (bitmask_copy(&ctl->nh_idx_head, nh_idx_ptr, new_idx_items) == 0)
-			bitmask_swap(&ctl->nh_idx_head, nh_idx_ptr, new_idx_items, &old_idx_ptr);
-	}
+	if (bitmask_copy(&ctl->nh_idx_head, nh_idx_ptr, new_idx_items) == 0)
+		bitmask_swap(&ctl->nh_idx_head, nh_idx_ptr, new_idx_items, &old_idx_ptr);
+	else
+		old_idx_ptr = nh_idx_ptr;
 	NHOPS_WUNLOCK(ctl);
 
-	if (nh_ptr != NULL)
-		free(nh_ptr, M_NHOP);
 	if (old_idx_ptr != NULL)
 		free(old_idx_ptr, M_NHOP);
 }
 
 /*
- * Links nextop @nh_priv to the nexhop hash table and allocates
- *  nexhop index.
+ * Links nextop @nh_priv to the nexhop hash table and the interface
+ *  index and allocates nexhop index.
  * Returns allocated index or 0 on failure.
  */
 int
 link_nhop(struct nh_control *ctl, struct nhop_priv *nh_priv)
 {
+	struct nhop_shard *ns;
+	struct nhop_buckets *nb;
 	uint16_t idx;
-	uint32_t num_buckets_new, num_items_new;
+	uint32_t hash, bucket, num_buckets_new, num_items_new;
 
 	KASSERT((nh_priv->nh_idx == 0), ("nhop index is already allocated"));
-	NHOPS_WLOCK(ctl);
 
 	/*
-	 * Check if we need to resize hash and index.
-	 * The following 2 functions returns either new size or 0
+	 * Index allocation is the only part serialized across the shards.
+	 * bitmask_get_resize_items() returns either new size or 0
 	 *  if resize is not required.
 	 */
-	num_buckets_new = CHT_SLIST_GET_RESIZE_BUCKETS(&ctl->nh_head);
+	NHOPS_WLOCK(ctl);
 	num_items_new = bitmask_get_resize_items(&ctl->nh_idx_head);
-
 	if (bitmask_alloc_idx(&ctl->nh_idx_head, &idx) != 0) {
 		NHOPS_WUNLOCK(ctl);
 		FIB_CTL_LOG(LOG_INFO, ctl, "Unable to allocate nhop index");
 		RTSTAT_INC(rts_nh_idx_alloc_failure);
-		consider_resize(ctl, num_buckets_new, num_items_new);
+		consider_idx_resize(ctl, num_items_new);
 		return (0);
 	}
+	LIST_INSERT_HEAD(&ctl->nh_ifp_idx[NHOP_IFP_IDX(nh_priv->nh->nh_ifp)],
+	    nh_priv, nh_ifp_link);
+	NHOPS_WUNLOCK(ctl);
 
 	nh_priv->nh_idx = idx;
 	nh_priv->nh_control = ctl;
 	nh_priv->nh_finalized = 1;
 
-	CHT_SLIST_INSERT_HEAD(&ctl->nh_head, nhops, nh_priv);
+	hash = hash_priv(nh_priv);
+	nh_priv->nh_hash = hash;
+	ns = &ctl->nh_shards[NHOP_SHARD_IDX(hash)];
 
-	NHOPS_WUNLOCK(ctl);
+	NHOPS_SHARD_LOCK(ns);
+	nb = ns->ns_buckets;
+	bucket = NHOP_BUCKET_IDX(nb, hash);
+	nh_priv->nh_next = nb->nb_ptr[bucket];
+	/* Publish fully initialized nexthop to the lockless readers */
+	atomic_store_rel_ptr((uintptr_t *)&nb->nb_ptr[bucket], (uintptr_t)nh_priv);
+	ns->ns_items++;
+	num_buckets_new = get_shard_resize_buckets(ns);
+	NHOPS_SHARD_UNLOCK(ns);
 
 	FIB_RH_LOG(LOG_DEBUG2, ctl->ctl_rh,
 	    "Linked nhop priv %p to %d, hash %u, ctl %p",
-	    nh_priv, idx, hash_priv(nh_priv), ctl);
-	consider_resize(ctl, num_buckets_new, num_items_new);
+	    nh_priv, idx, hash, ctl);
+	if (num_buckets_new != 0)
+		resize_shard(ctl, ns, num_buckets_new);
+	consider_idx_resize(ctl, num_items_new);
 
 	return (idx);
 }
 
 /*
  * Unlinks nexthop specified by @nh_priv data from the hash.
+ * The unlinked nexthop keeps its nh_next pointer, so the lockless
+ *  readers currently at it can continue the traversal.
  *
  * Returns found nexthop or NULL.
  */
 struct nhop_priv *
 unlink_nhop(struct nh_control *ctl, struct nhop_priv *nh_priv_del)
 {
-	struct nhop_priv *priv_ret;
+	struct nhop_priv *priv_ret, *prev;
+	struct nhop_shard *ns;
+	struct nhop_buckets *nb;
 	int idx;
-	uint32_t num_buckets_new, num_items_new;
+	uint32_t hash, bucket, num_buckets_new, num_items_new;
 
 	idx = 0;
+	hash = nh_priv_del->nh_hash;
+	ns = &ctl->nh_shards[NHOP_SHARD_IDX(hash)];
+
+	NHOPS_SHARD_LOCK(ns);
+	nb = ns->ns_buckets;
+	bucket = NHOP_BUCKET_IDX(nb, hash);
+	prev = NULL;
+	for (priv_ret = nb->nb_ptr[bucket]; priv_ret != NULL;
+	    prev = priv_ret, priv_ret = priv_ret->nh_next) {
+		if (priv_ret == nh_priv_del)
+			break;
+	}
+	if (priv_ret != NULL) {
+		if (prev == NULL)
+			atomic_store_rel_ptr((uintptr_t *)&nb->nb_ptr[bucket],
+			    (uintptr_t)priv_ret->nh_next);
+		else
+			atomic_store_rel_ptr((uintptr_t *)&prev->nh_next,
+			    (uintptr_t)priv_ret->nh_next);
+		ns->ns_items--;
+	}
+	/* Check if hash needs to be resized */
+	num_buckets_new = get_shard_resize_buckets(ns);
+	NHOPS_SHARD_UNLOCK(ns);
 
-	NHOPS_WLOCK(ctl);
-	CHT_SLIST_REMOVE(&ctl->nh_head, nhops, nh_priv_del, priv_ret);
-
+	num_items_new = 0;
 	if (priv_ret != NULL) {
+		NHOPS_WLOCK(ctl);
 		idx = priv_ret->nh_idx;
 		priv_ret->nh_idx = 0;
+		LIST_REMOVE(priv_ret, nh_ifp_link);
 
 		KASSERT((idx != 0), ("bogus nhop index 0"));
 		if ((bitmask_free_idx(&ctl->nh_idx_head, idx)) != 0) {
@@ -348,28 +492,57 @@ unlink_nhop(struct nh_control *ctl, struct nhop_priv *nh_priv_del)
 			    "Unable to remove index %d from fib %u af %d",
 			    idx, ctl->ctl_rh->rib_fibnum, ctl->ctl_rh->rib_family);
 		}
+		/* Check if index needs to be resized */
+		num_items_new = bitmask_get_resize_items(&ctl->nh_idx_head);
+		NHOPS_WUNLOCK(ctl);
 	}
 
-	/* Check if hash or index needs to be resized */
-	num_buckets_new = CHT_SLIST_GET_RESIZE_BUCKETS(&ctl->nh_head);
-	num_items_new = bitmask_get_resize_items(&ctl->nh_idx_head);
-
-	NHOPS_WUNLOCK(ctl);
-
 	if (priv_ret == NULL) {
 		FIB_CTL_LOG(LOG_INFO, ctl,
 		    "Unable to unlink nhop priv %p from hash, hash %u ctl %p",
-		    nh_priv_del, hash_priv(nh_priv_del), ctl);
+		    nh_priv_del, hash, ctl);
 	} else {
 		FIB_CTL_LOG(LOG_DEBUG2, ctl, "Unlinked nhop %p priv idx %d",
 		    priv_ret, idx);
 	}
 
-	consider_resize(ctl, num_buckets_new, num_items_new);
+	if (num_buckets_new != 0)
+		resize_shard(ctl, ns, num_buckets_new);
+	consider_idx_resize(ctl, num_items_new);
 
 	return (priv_ret);
 }
 
+/*
+ * Searches shard @ns for the nexthop matching @nh_priv.
+ * Lockless version, returns false if the traversal overlapped a
+ *  resize and may have missed the nexthop.
+ */
+static bool
+find_nhop_lockless(struct nhop_shard *ns, const struct nhop_priv *nh_priv,
+    uint32_t hash, struct nhop_priv **pnh_priv)
+{
+	struct nhop_buckets *nb;
+	struct nhop_priv *nh_priv_ret;
+	uint32_t gen;
+
+	gen = atomic_load_acq_32(&ns->ns_gen);
+	if (gen & 1)
+		return (false);
+
+	nb = (struct nhop_buckets *)atomic_load_acq_ptr((uintptr_t *)&ns->ns_buckets);
+	nh_priv_ret = (struct nhop_priv *)atomic_load_acq_ptr(
+	    (uintptr_t *)&nb->nb_ptr[NHOP_BUCKET_IDX(nb, hash)]);
+	for (; nh_priv_ret != NULL; nh_priv_ret = (struct nhop_priv *)
+	    atomic_load_acq_ptr((uintptr_t *)&nh_priv_ret->nh_next)) {
+		if (nh_priv_ret->nh_hash == hash && cmp_priv(nh_priv, nh_priv_ret))
+			break;
+	}
+	*pnh_priv = nh_priv_ret;
+
+	return (nh_priv_ret != NULL || atomic_load_acq_32(&ns->ns_gen) == gen);
+}
+
 /*
  * Searches for the nexthop by data specifcied in @nh_priv.
  * Returns referenced nexthop or NULL.
@@ -377,17 +550,65 @@ unlink_nhop(struct nh_control *ctl, struct nhop_priv *nh_priv_del)
 struct nhop_priv *
 find_nhop(struct nh_control *ctl, const struct nhop_priv *nh_priv)
 {
+	struct epoch_tracker et;
 	struct nhop_priv *nh_priv_ret;
-
-	NHOPS_RLOCK(ctl);
-	CHT_SLIST_FIND_BYOBJ(&ctl->nh_head, nhops, nh_priv, nh_priv_ret);
+	struct nhop_shard *ns;
+	struct nhop_buckets *nb;
+	uint32_t hash;
+
+	hash = hash_priv(nh_priv);
+	ns = &ctl->nh_shards[NHOP_SHARD_IDX(hash)];
+
+	NET_EPOCH_ENTER(et);
+	if (!find_nhop_lockless(ns, nh_priv, hash, &nh_priv_ret)) {
+		NHOPS_SHARD_LOCK(ns);
+		nb = ns->ns_buckets;
+		nh_priv_ret = nb->nb_ptr[NHOP_BUCKET_IDX(nb, hash)];
+		for (; nh_priv_ret != NULL; nh_priv_ret = nh_priv_ret->nh_next) {
+			if (nh_priv_ret->nh_hash == hash && cmp_priv(nh_priv, nh_priv_ret))
+				break;
+		}
+		NHOPS_SHARD_UNLOCK(ns);
+	}
 	if (nh_priv_ret != NULL) {
 		if (refcount_acquire_if_not_zero(&nh_priv_ret->nh_refcnt) == 0){
 			/* refcount was 0 -> nhop is being deleted */
 			nh_priv_ret = NULL;
 		}
 	}
-	NHOPS_RUNLOCK(ctl);
+	NET_EPOCH_EXIT(et);
 
 	return (nh_priv_ret);
 }
+
+/*
+ * Locks all hash shards, stopping nexthop link/unlink.
+ */
+void
+nhops_shards_lock(struct nh_control *ctl)
+{
+	for (int i = 0; i < NHOP_SHARDS; i++)
+		NHOPS_SHARD_LOCK(&ctl->nh_shards[i]);
+}
+
+void
+nhops_shards_unlock(struct nh_control *ctl)
+{
+	for (int i = NHOP_SHARDS - 1; i >= 0; i--)
+		NHOPS_SHARD_UNLOCK(&ctl->nh_shards[i]);
+}
+
+/*
+ * Returns the number of linked nexthops. Not synchronized with
+ *  link/unlink unless nhops_shards_lock() is held.
+ */
+uint32_t
+nhops_count(struct nh_control *ctl)
+{
+	uint32_t count = 0;
+
+	for (int i = 0; i < NHOP_SHARDS; i++)
+		count += atomic_load_int(&ctl->nh_shards[i].ns_items);
+
+	return (count);
+}
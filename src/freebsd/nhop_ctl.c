@@ -33,6 +33,7 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rwlock.h>
 #include <sys/malloc.h>
 #include <sys/socket.h>
@@ -57,6 +58,10 @@
 #include <net/route/route_debug.h>
 _DECLARE_DEBUG(LOG_INFO);
 
+SDT_PROBE_DEFINE1(route, nhop, nhop_get_nhop, entry, "struct nhop_object *");
+SDT_PROBE_DEFINE2(route, nhop, nhop_get_nhop, return, "struct nhop_object *",
+    "int");
+
 /*
  * This file contains core functionality for the nexthop ("nhop") route subsystem.
  * The business logic needed to create nexhop objects is implemented here.
@@ -314,13 +319,16 @@ nhop_get_nhop(struct nhop_object *nh, int *perror)
 {
 	struct rib_head *rnh = nhop_get_rh(nh);
 
+	SDT_PROBE1(route, nhop, nhop_get_nhop, entry, nh);
 	if (__predict_false(rnh == NULL)) {
 		*perror = EAFNOSUPPORT;
 		nhop_free(nh);
-		return (NULL);
-	}
+		nh = NULL;
+	} else
+		nh = nhop_get_nhop_internal(rnh, nh, perror);
+	SDT_PROBE2(route, nhop, nhop_get_nhop, return, nh, *perror);
 
-	return (nhop_get_nhop_internal(rnh, nh, perror));
+	return (nh);
 }
 
 struct nhop_object *
@@ -638,7 +646,8 @@ nhop_free(struct nhop_object *nh)
 	}
 	NET_EPOCH_EXIT(et);
 
-	NET_EPOCH_CALL(destroy_nhop_epoch, &nh_priv->nh_epoch_ctx);
+	NET_EPOCH_CALL_SIZE(destroy_nhop_epoch, &nh_priv->nh_epoch_ctx,
+	    NHOP_OBJECT_ALIGNED_SIZE + NHOP_PRIV_ALIGNED_SIZE);
 }
 
 void
@@ -1051,6 +1060,10 @@ nhop_set_origin(struct nhop_object *nh, uint8_t origin)
 	nh->nh_priv->nh_origin = origin;
 }
 
+/*
+ * Updates the MTU of the nexthops over @ifp, found through the
+ *  interface index.
+ */
 void
 nhops_update_ifmtu(struct rib_head *rh, struct ifnet *ifp, uint32_t mtu)
 {
@@ -1061,7 +1074,7 @@ nhops_update_ifmtu(struct rib_head *rh, struct ifnet *ifp, uint32_t mtu)
 	ctl = rh->nh_control;
 
 	NHOPS_WLOCK(ctl);
-	CHT_SLIST_FOREACH(&ctl->nh_head, nhops, nh_priv) {
+	LIST_FOREACH(nh_priv, &ctl->nh_ifp_idx[NHOP_IFP_IDX(ifp)], nh_ifp_link) {
 		nh = nh_priv->nh;
 		if (nh->nh_ifp == ifp) {
 			if ((nh_priv->rt_flags & RTF_FIXEDMTU) == 0 ||
@@ -1070,9 +1083,33 @@ nhops_update_ifmtu(struct rib_head *rh, struct ifnet *ifp, uint32_t mtu)
 				nh->nh_mtu = mtu;
 			}
 		}
-	} CHT_SLIST_FOREACH_END;
+	}
 	NHOPS_WUNLOCK(ctl);
+}
+
+/*
+ * Returns true if any nexthop of @rh, multipath group members
+ *  included, goes over @ifp. Routes can only use linked nexthops.
+ */
+bool
+nhops_ifp_used(struct rib_head *rh, const struct ifnet *ifp)
+{
+	struct nh_control *ctl;
+	struct nhop_priv *nh_priv;
+	bool used = false;
+
+	ctl = rh->nh_control;
+
+	NHOPS_RLOCK(ctl);
+	LIST_FOREACH(nh_priv, &ctl->nh_ifp_idx[NHOP_IFP_IDX(ifp)], nh_ifp_link) {
+		if (nh_priv->nh->nh_ifp == ifp) {
+			used = true;
+			break;
+		}
+	}
+	NHOPS_RUNLOCK(ctl);
 
+	return (used);
 }
 
 struct nhop_object *
@@ -1083,10 +1120,11 @@ nhops_iter_start(struct nhop_iter *iter)
 	if (iter->rh != NULL) {
 		struct nh_control *ctl = iter->rh->nh_control;
 
-		NHOPS_RLOCK(ctl);
+		nhops_shards_lock(ctl);
 
+		iter->_s = 0;
 		iter->_i = 0;
-		iter->_next = CHT_FIRST(&ctl->nh_head, iter->_i);
+		iter->_next = ctl->nh_shards[0].ns_buckets->nb_ptr[0];
 
 		return (nhops_iter_next(iter));
 	} else
@@ -1104,12 +1142,18 @@ nhops_iter_next(struct nhop_iter *iter)
 	}
 
 	struct nh_control *ctl = iter->rh->nh_control;
-	while (++iter->_i < ctl->nh_head.hash_size) {
-		nh_priv = CHT_FIRST(&ctl->nh_head, iter->_i);
-		if (nh_priv != NULL) {
-			iter->_next = nh_priv->nh_next;
-			return (nh_priv->nh);
+	while (iter->_s < NHOP_SHARDS) {
+		struct nhop_buckets *nb = ctl->nh_shards[iter->_s].ns_buckets;
+
+		while (++iter->_i < nb->nb_size) {
+			nh_priv = nb->nb_ptr[iter->_i];
+			if (nh_priv != NULL) {
+				iter->_next = nh_priv->nh_next;
+				return (nh_priv->nh);
+			}
 		}
+		iter->_s++;
+		iter->_i = -1;
 	}
 
 	return (NULL);
@@ -1121,7 +1165,7 @@ nhops_iter_stop(struct nhop_iter *iter)
 	if (iter->rh != NULL) {
 		struct nh_control *ctl = iter->rh->nh_control;
 
-		NHOPS_RUNLOCK(ctl);
+		nhops_shards_unlock(ctl);
 	}
 }
 
@@ -1263,9 +1307,7 @@ nhops_get_count(struct rib_head *rh)
 
 	ctl = rh->nh_control;
 
-	NHOPS_RLOCK(ctl);
-	count = ctl->nh_head.items_count;
-	NHOPS_RUNLOCK(ctl);
+	count = nhops_count(ctl);
 
 	return (count);
 }
@@ -1279,16 +1321,16 @@ nhops_dump_sysctl(struct rib_head *rh, struct sysctl_req *w)
 
 	ctl = rh->nh_control;
 
-	NHOPS_RLOCK(ctl);
-	FIB_RH_LOG(LOG_DEBUG, rh, "dump %u items", ctl->nh_head.items_count);
-	CHT_SLIST_FOREACH(&ctl->nh_head, nhops, nh_priv) {
+	nhops_shards_lock(ctl);
+	FIB_RH_LOG(LOG_DEBUG, rh, "dump %u items", nhops_count(ctl));
+	NHOPS_FOREACH(ctl, nh_priv) {
 		error = dump_nhop_entry(rh, nh_priv->nh, w);
 		if (error != 0) {
-			NHOPS_RUNLOCK(ctl);
+			nhops_shards_unlock(ctl);
 			return (error);
 		}
-	} CHT_SLIST_FOREACH_END;
-	NHOPS_RUNLOCK(ctl);
+	} NHOPS_FOREACH_END;
+	nhops_shards_unlock(ctl);
 
 	return (0);
 }
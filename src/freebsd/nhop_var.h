@@ -37,25 +37,71 @@
 
 MALLOC_DECLARE(M_NHOP);
 
-/* define nhop hash table */
+/*
+ * Nexthop hash table.
+ * Split into NHOP_SHARDS shards by the lower hash bits, each with its
+ *  own writer lock and bucket array, resized independently.
+ * Lookups are lockless: buckets and chains are read inside the net
+ *  epoch, replaced bucket arrays are freed after the epoch ends.
+ *  A shard resize relinks the chains, so a lookup overlapping it
+ *  (ns_gen changed or odd) retries under the shard lock.
+ * Chains are matched by the cached nh_hash before the full comparison.
+ */
+#define	NHOP_SHARDS		16	/* power of 2 */
+#define	NHOP_SHARD_MIN_BUCKETS	4
+#define	NHOP_SHARD_MAX_BUCKETS	(65536 / NHOP_SHARDS)
+
 struct nhop_priv;
-CHT_SLIST_DEFINE(nhops, struct nhop_priv);
-/* produce hash value for an object */
-#define	nhops_hash_obj(_obj)	hash_priv(_obj)
-/* compare two objects */
-#define	nhops_cmp(_one, _two)	cmp_priv(_one, _two)
-/* next object accessor */
-#define	nhops_next(_obj)	(_obj)->nh_next
+struct nhop_buckets {
+	struct epoch_context	nb_epoch_ctx;	/* deferred free after resize */
+	uint32_t		nb_size;	/* power of 2 */
+	struct nhop_priv	*nb_ptr[];
+};
+
+struct nhop_shard {
+	struct mtx		ns_lock;	/* writers lock */
+	struct nhop_buckets	*ns_buckets;	/* current bucket array */
+	uint32_t		ns_items;	/* nexthops in the shard */
+	uint32_t		ns_gen;		/* resize seq, odd while resizing */
+} __aligned(CACHE_LINE_SIZE);
+
+#define	NHOP_SHARD_IDX(_hash)	((_hash) & (NHOP_SHARDS - 1))
+#define	NHOP_BUCKET_IDX(_nb, _hash)	(((_hash) / NHOP_SHARDS) & ((_nb)->nb_size - 1))
+
+#define	NHOPS_SHARD_LOCK_INIT(ns)	mtx_init(&(ns)->ns_lock, "nhop_shard", NULL, MTX_DEF)
+#define	NHOPS_SHARD_LOCK_DESTROY(ns)	mtx_destroy(&(ns)->ns_lock)
+#define	NHOPS_SHARD_LOCK(ns)		mtx_lock(&(ns)->ns_lock)
+#define	NHOPS_SHARD_UNLOCK(ns)		mtx_unlock(&(ns)->ns_lock)
+
+/* Iterates over all nexthops, nhops_shards_lock() must be held */
+#define	NHOPS_FOREACH(_ctl, _x)						\
+	for (int _s = 0; _s < NHOP_SHARDS; _s++) {			\
+		struct nhop_buckets *_nb = (_ctl)->nh_shards[_s].ns_buckets;\
+		for (uint32_t _i = 0; _i < _nb->nb_size; _i++) {	\
+			for (_x = _nb->nb_ptr[_i]; _x != NULL; _x = _x->nh_next)
+#define	NHOPS_FOREACH_END	} }
+
+/*
+ * Reverse index of the linked nexthops by nh_ifp, under ctl_lock.
+ * Interface events only visit the nexthops of the buckets of their ifp.
+ */
+#define	NHOP_IFP_BUCKETS	64	/* power of 2 */
+#define	NHOP_IFP_IDX(_ifp)	\
+	((((uintptr_t)(_ifp) >> 6) ^ ((uintptr_t)(_ifp) >> 14)) & (NHOP_IFP_BUCKETS - 1))
+
+LIST_HEAD(nhop_ifp_head, nhop_priv);
 
 /* define multipath hash table */
 struct nhgrp_priv;
 CHT_SLIST_DEFINE(nhgroups, struct nhgrp_priv);
 
 struct nh_control {
-	struct nhops_head	nh_head;	/* hash table head */
+	struct nhop_shard	nh_shards[NHOP_SHARDS];	/* nhop hash table */
+	struct nhop_ifp_head	nh_ifp_idx[NHOP_IFP_BUCKETS]; /* nhops by ifp */
 	struct bitmask_head	nh_idx_head;	/* nhop index head */
 	struct nhgroups_head	gr_head;	/* nhgrp hash table head */
-	struct rwlock		ctl_lock;	/* overall ctl lock */
+	struct callout		gr_res_callout;	/* resilient nhgrp rebalance */
+	struct rwlock		ctl_lock;	/* nhop index and nhgrp lock */
 	struct rib_head		*ctl_rh;	/* pointer back to rnh */
 	struct epoch_context	ctl_epoch_ctx;	/* epoch ctl helper */
 };
@@ -81,6 +127,7 @@ struct nhop_priv {
 	/* nhop lookup comparison end */
 	uint32_t		nh_idx;		/* nexthop index */
 	uint32_t		nh_fibnum;	/* nexthop fib */
+	uint32_t		nh_hash;	/* hash_priv() value, set on link */
 	void			*cb_func;	/* function handling additional rewrite caps */
 	u_int			nh_refcnt;	/* number of references, refcount(9)  */
 	u_int			nh_linked;	/* refcount(9), == 2 if linked to the list */
@@ -89,6 +136,7 @@ struct nhop_priv {
 	struct nhop_object	*nh;		/* backreference to the dataplane nhop */
 	struct nh_control	*nh_control;	/* backreference to the rnh */
 	struct nhop_priv	*nh_next;	/* hash table membership */
+	LIST_ENTRY(nhop_priv)	nh_ifp_link;	/* nh_ifp_idx membership */
 	struct vnet		*nh_vnet;	/* vnet nhop belongs to */
 	struct epoch_context	nh_epoch_ctx;	/* epoch data for nhop */
 };
@@ -104,6 +152,9 @@ struct nhop_priv *find_nhop(struct nh_control *ctl,
     const struct nhop_priv *nh_priv);
 int link_nhop(struct nh_control *ctl, struct nhop_priv *nh_priv);
 struct nhop_priv *unlink_nhop(struct nh_control *ctl, struct nhop_priv *nh_priv);
+void nhops_shards_lock(struct nh_control *ctl);
+void nhops_shards_unlock(struct nh_control *ctl);
+uint32_t nhops_count(struct nh_control *ctl);
 
 /* nhop_ctl.c */
 int cmp_priv(const struct nhop_priv *_one, const struct nhop_priv *_two);
@@ -41,6 +41,7 @@
 #include <sys/_lock.h>
 #include <sys/_mutex.h>
 #include <sys/_rmlock.h>
+#include <sys/epoch.h>
 #endif
 
 #ifdef MALLOC_DECLARE
@@ -100,6 +101,7 @@ struct radix_mask {
 		struct	radix_node *rmu_leaf;	/* for normal routes */
 	}	rm_rmu;
 	int	rm_refs;		/* # of references to this struct */
+	struct	epoch_context rm_epoch_ctx;	/* deferred free, lookups walk unlocked */
 };
 
 #define	rm_mask rm_rmu.rmu_mask
@@ -108,6 +110,7 @@ struct radix_mask {
 struct radix_head;
 
 typedef int walktree_f_t(struct radix_node *, void *);
+typedef int walktree_batch_f_t(struct radix_node **, int, void *);
 typedef struct radix_node *rn_matchaddr_f_t(const void *v,
     struct radix_head *head);
 typedef struct radix_node *rn_addaddr_f_t(void *v, const void *mask,
@@ -157,11 +160,22 @@ void rn_inithead_internal(struct radix_head *rh, struct radix_node *base_nodes,
 #define R_Malloc(p, t, n) (p = (t) malloc((unsigned int)(n)))
 #define R_Zalloc(p, t, n) (p = (t) calloc(1,(unsigned int)(n)))
 #define R_Free(p) free((char *)p);
+#define R_MaskMalloc(p, t, n) R_Malloc(p, t, n)
+#define R_MaskZalloc(p, t, n) R_Zalloc(p, t, n)
+#define R_MaskFree(p) R_Free(p)
 #else
 #define R_Malloc(p, t, n) (p = (t) malloc((unsigned long)(n), M_RTABLE, M_NOWAIT))
 #define R_Zalloc(p, t, n) (p = (t) malloc((unsigned long)(n), M_RTABLE, M_NOWAIT | M_ZERO))
 #define R_Free(p) free((caddr_t)p, M_RTABLE);
 
+/* Netmasks and mask lists, a malloc type of their own where there is one */
+#ifndef M_RTMASK
+#define M_RTMASK M_RTABLE
+#endif
+#define R_MaskMalloc(p, t, n) (p = (t) malloc((unsigned long)(n), M_RTMASK, M_NOWAIT))
+#define R_MaskZalloc(p, t, n) (p = (t) malloc((unsigned long)(n), M_RTMASK, M_NOWAIT | M_ZERO))
+#define R_MaskFree(p) free((caddr_t)p, M_RTMASK);
+
 #define	RADIX_NODE_HEAD_RLOCK_TRACKER	struct rm_priotracker _rnh_tracker
 #define	RADIX_NODE_HEAD_LOCK_INIT(rnh)	\
     rm_init(&(rnh)->rnh_lock, "radix node head")
@@ -185,8 +199,64 @@ struct radix_node *rn_delete(const void *, const void *, struct radix_head *);
 struct radix_node *rn_lookup (const void *v_arg, const void *m_arg,
     struct radix_head *head);
 struct radix_node *rn_match(const void *, struct radix_head *);
+struct radix_node *rn_match_in4(const void *, struct radix_head *);
+struct radix_node *rn_match_in6(const void *, struct radix_head *);
 int rn_walktree_from(struct radix_head *h, void *a, void *m,
     walktree_f_t *f, void *w);
 int rn_walktree(struct radix_head *, walktree_f_t *, void *);
+int rn_match_all(const void *, struct radix_head *, walktree_f_t *, void *);
+int rn_walk_subtree(struct radix_head *, const void *, const void *,
+    walktree_f_t *, void *);
+void rn_freemasks(struct radix_head *);
+int rn_check(struct radix_head *);
+int rn_check_range(struct radix_head *, struct radix_node **, int *);
+struct radix_node *rn_next_leaf(struct radix_node *);
+struct radix_node *rn_seek_after(const void *, const void *,
+    struct radix_head *);
+
+/* rn_walktree() handing the callback up to RN_WALK_BATCH leaves at once */
+#define	RN_WALK_BATCH	16
+int rn_walktree_batch(struct radix_head *, walktree_batch_f_t *, void *);
+
+/*
+ * Entry of a sorted array passed to rn_bulkload(): key, optional mask
+ * and the 2 nodes rn_addroute() would take as treenodes.
+ */
+struct rn_bulk_entry {
+	void			*rbe_key;
+	const void		*rbe_mask;
+	struct radix_node	*rbe_nodes;
+};
+int rn_bulkload(struct radix_head *, struct rn_bulk_entry *, int);
+
+/*
+ * Lookup-only copy of a tree, see rn_freeze(). Nodes are laid out in
+ * breadth-first order; children index rf_nodes, 0 meaning none, and
+ * rfn_lo indexes the sorted prefixes in rf_bits and rf_leaves.
+ */
+struct rn_frozen_node {
+	uint16_t	rfn_bit;	/* prefix length / bit to test */
+	uint16_t	rfn_flags;
+#define	RFN_PREFIX	0x01		/* prefix rfn_lo ends here */
+	uint32_t	rfn_lo;		/* first prefix in the subtree */
+	uint32_t	rfn_child[2];
+};
+
+struct rn_frozen {
+	struct rn_frozen_node	*rf_nodes;
+	u_char			*rf_bits;	/* masked keys, rf_width each */
+	struct radix_node	**rf_leaves;
+	uint32_t		rf_nnodes;
+	uint32_t		rf_nleaves;
+	int			rf_off;		/* key offset, bytes */
+	int			rf_width;	/* key bytes from rf_off */
+};
+int rn_freeze(struct radix_head *, int, struct rn_frozen **);
+int rn_freeze_overlay(struct radix_head *, struct radix_head *, int,
+    struct rn_frozen **);
+void rn_frozen_free(struct rn_frozen *);
+struct radix_node *rn_frozen_match(const void *, const struct rn_frozen *);
+void rn_frozen_match_burst(const void * const *, int, struct radix_node **,
+    const struct rn_frozen *);
 
 #endif /* _RADIX_H_ */
@@ -75,6 +75,8 @@ VNET_PCPUSTAT_SYSINIT(rtstat);
 VNET_PCPUSTAT_SYSUNINIT(rtstat);
 #endif
 
+SDT_PROVIDER_DEFINE(route);
+
 SYSCTL_DECL(_net_route);
 SYSCTL_VNET_PCPUSTAT(_net_route, OID_AUTO, stats, struct rtstat,
     rtstat, "route statistics");
@@ -129,7 +131,16 @@ rt_table_init(int offset, int family, u_int fibnum)
 	/* Finally, set base callbacks */
 	rh->rnh_addaddr = rn_addroute;
 	rh->rnh_deladdr = rn_delete;
-	rh->rnh_matchaddr = rn_match;
+	switch (family) {
+	case AF_INET:
+		rh->rnh_matchaddr = rn_match_in4;
+		break;
+	case AF_INET6:
+		rh->rnh_matchaddr = rn_match_in6;
+		break;
+	default:
+		rh->rnh_matchaddr = rn_match;
+	}
 	rh->rnh_lookup = rn_lookup;
 	rh->rnh_walktree = rn_walktree;
 	rh->rnh_walktree_from = rn_walktree_from;
@@ -351,11 +362,23 @@ rt_ifdelroute(const struct rtentry *rt, const struct nhop_object *nh, void *arg)
 	return (1);
 }
 
+/*
+ * Deletes the routes over @ifp. Only the tables with nexthops over
+ *  @ifp, according to their interface index, are traversed.
+ */
 void
 rt_flushifroutes(struct ifnet *ifp)
 {
+	struct rib_head *rnh;
 
-	rib_foreach_table_walk_del(AF_UNSPEC, rt_ifdelroute, ifp);
+	for (uint32_t fibnum = 0; fibnum < rt_numfibs; fibnum++) {
+		for (int family = 1; family <= AF_MAX; family++) {
+			rnh = rt_tables_get_rnh(fibnum, family);
+			if (rnh == NULL || !nhops_ifp_used(rnh, ifp))
+				continue;
+			rib_walk_del(fibnum, family, rt_ifdelroute, ifp, 0);
+		}
+	}
 }
 
 /*
@@ -516,9 +539,9 @@ rt_updatemtu(struct ifnet *ifp)
 	int i, j;
 
 	/*
-	 * Try to update rt_mtu for all routes using this interface
-	 * Unfortunately the only way to do this is to traverse all
-	 * routing tables in all fibs/domains.
+	 * Update the MTU of all nexthops using this interface, in
+	 * all fibs/domains. Each table only visits its nexthops over
+	 * the interface, see nhops_update_ifmtu().
 	 */
 	for (i = 1; i <= AF_MAX; i++) {
 		mtu = if_getmtu_family(ifp, i);
@@ -296,6 +296,16 @@ struct rt_msghdr {
 #define	RTM_IFANNOUNCE	0x11	/* (5) iface arrival/departure */
 #define	RTM_IEEE80211	0x12	/* (5) IEEE80211 wireless event */
 #define	RTM_IPFWLOG	0x13	/* (1) IPFW rule match log event */
+#define	RTM_BATCH	0x14	/* (1) Add/delete many routes, see below */
+#define	RTM_RESYNC	0x15	/* (1) Route changes were lost, dump the table */
+
+/*
+ * RTM_BATCH header is followed by complete RTM_ADD and RTM_DELETE
+ *  messages, each sizeof(long) aligned, its rtm_msglen covering them all.
+ * The reply is the header followed by an int errno per message, 0 if it
+ *  was applied; rtm_errno holds the first error.
+ * The kernel uses the same layout to send coalesced route changes.
+ */
 
 #endif /* NETLINK_COMPAT*/
 
@@ -328,6 +338,91 @@ struct rt_msghdr {
 
 #endif /* NETLINK_COMPAT*/
 
+/*
+ * Resumable route table dump, next to the NET_RT_* sysctl ops:
+ *  { CTL_NET, PF_ROUTE, 0, af, NET_RT_DUMPC, 0, fib[, plen, addr...] }
+ * Returns the complete routes fitting the buffer that follow the cursor
+ *  (plen and address words of the last route returned), nothing at the end.
+ */
+#define	NET_RT_DUMPC	16
+
+/*
+ * Compact route encoding, an alternative to struct rt_msghdr for dumps
+ *  ({ CTL_NET, PF_ROUTE, 0, af, NET_RT_DUMPT, 0, fib[, RTT_F_*] }) and
+ *  for route change notifications on sockets with the ROUTE_TLV option
+ *  (level PF_ROUTE, int). Replies to requests keep the rt_msghdr format.
+ *
+ * A message is a struct rt_tlvhdr, laid out as the start of rt_msghdr
+ *  so that both can be told apart by the version, followed by attributes.
+ *  Each attribute is a struct rt_tlv and its payload, padded to 4 bytes.
+ *  Prefixes carry the significant address bytes only. In dumps nexthops
+ *  and nexthop groups are sent once, before the first route using them,
+ *  and routes refer to them by index. With RTT_F_DELTA consecutive
+ *  prefixes only carry the bytes that differ from the previous one.
+ */
+#define	NET_RT_DUMPT	17
+#define	ROUTE_TLV	2
+
+struct rt_tlvhdr {
+	uint16_t	rth_len;	/* message length */
+	uint8_t		rth_version;	/* RTT_VERSION */
+	uint8_t		rth_type;	/* RTM_* or RTT_* */
+	uint32_t	rth_fibnum;	/* RT_ALL_FIBS if unknown */
+};
+
+struct rt_tlv {
+	uint16_t	rtt_len;	/* attribute length, without padding */
+	uint16_t	rtt_type;	/* RTTA_* */
+};
+
+#define	RTT_VERSION	0x81
+#define	RTT_ALIGN(len)	roundup2(len, 4)
+#define	RTT_F_DELTA	0x01		/* delta encoded prefixes */
+
+#define	RTT_NHOP	0x81		/* nexthop, dumps only */
+#define	RTT_NHGRP	0x82		/* nexthop group, dumps only */
+
+#define	RTTA_DST	1	/* u8 family, u8 plen, address bytes */
+#define	RTTA_DST_DELTA	2	/* u8 plen, u8 bytes from the previous prefix, rest */
+#define	RTTA_GATEWAY	3	/* u8 family, address */
+#define	RTTA_NHIDX	4	/* u32 nexthop index */
+#define	RTTA_NHGRPIDX	5	/* u32 nexthop group index */
+#define	RTTA_NHWEIGHT	6	/* u32 nexthop index, u32 weight */
+#define	RTTA_IFINDEX	7	/* u32 */
+#define	RTTA_FLAGS	8	/* u32 RTF_* */
+#define	RTTA_MTU	9	/* u32 */
+#define	RTTA_WEIGHT	10	/* u32, if not RT_DEFAULT_WEIGHT */
+
+/*
+ * Nexthop-indexed route table dump:
+ *  { CTL_NET, PF_ROUTE, 0, af, NET_RT_DUMPNH, 0, fib }
+ * Returns three sections, each starting with a struct rt_nhsection: the
+ *  nexthops and the nexthop groups, in the NET_RT_NHOP and NET_RT_NHGRP
+ *  formats, then a struct rt_nhroute per route referring to them by index.
+ */
+#define	NET_RT_DUMPNH	18
+
+struct rt_nhsection {
+	u_short	rns_msglen;	/* sizeof(struct rt_nhsection) */
+	u_char	rns_version;	/* RTM_VERSION */
+	u_char	rns_type;	/* RTM_NHSECTION */
+	int	rns_op;		/* NET_RT_NHOP, NET_RT_NHGRP or NET_RT_DUMP */
+	u_int	rns_count;	/* estimated number of records */
+};
+
+struct rt_nhroute {
+	u_short	rtn_msglen;
+	u_char	rtn_version;	/* RTM_VERSION */
+	u_char	rtn_type;	/* RTM_GET */
+	uint32_t rtn_nhidx;	/* nexthop or, with RTF_MPATH, group index */
+	int	rtn_flags;	/* RTF_* */
+	uint8_t	rtn_plen;
+	uint8_t	rtn_spare[3];
+	/* howmany(rtn_plen, 8) address bytes, padded to 4 bytes */
+};
+
+#define	RTM_NHSECTION	0x16	/* NET_RT_DUMPNH section start */
+
 /*
  * Index offsets for sockaddr array for alternate internal encoding.
  */
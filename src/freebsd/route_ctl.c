@@ -39,6 +39,7 @@
 #include <sys/syslog.h>
 #include <sys/kernel.h>
 #include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rmlock.h>
 
 #include <net/if.h>
@@ -61,6 +62,11 @@
 #include <net/route/route_debug.h>
 _DECLARE_DEBUG(LOG_INFO);
 
+SDT_PROBE_DEFINE3(route, ctl, rib_action, entry, "uint32_t", "int",
+    "struct sockaddr *");
+SDT_PROBE_DEFINE4(route, ctl, rib_action, return, "uint32_t", "int",
+    "struct rib_cmd_info *", "int");
+
 /*
  * This file contains control plane routing tables functions.
  *
@@ -74,6 +80,14 @@ union sockaddr_union {
 	char			_buf[32];
 };
 
+static int check_info_netmask(struct rib_head *rnh, struct rt_addrinfo *info);
+static int prepare_route_byinfo(struct rib_head *rnh, struct rt_addrinfo *info,
+    struct rtentry **prt, struct route_nhop_data *rnd_add, int *op_flags);
+static int del_route_byinfo(struct rib_head *rnh, struct rt_addrinfo *info,
+    struct rib_cmd_info *rc);
+static void del_route_finalize(struct rib_head *rnh, struct rib_cmd_info *rc);
+static void rib_batch_begin(struct rib_head *rnh);
+static void rib_batch_end(struct rib_head *rnh);
 static int add_route_byinfo(struct rib_head *rnh, struct rt_addrinfo *info,
     struct rib_cmd_info *rc);
 static int change_route_byinfo(struct rib_head *rnh, struct rtentry *rt,
@@ -701,16 +715,9 @@ rib_add_route(uint32_t fibnum, struct rt_addrinfo *info,
 	if (rnh == NULL)
 		return (EAFNOSUPPORT);
 
-	/*
-	 * Check consistency between RTF_HOST flag and netmask
-	 * existence.
-	 */
-	if (info->rti_flags & RTF_HOST)
-		info->rti_info[RTAX_NETMASK] = NULL;
-	else if (info->rti_info[RTAX_NETMASK] == NULL) {
-		FIB_RH_LOG(LOG_DEBUG, rnh, "error: no RTF_HOST and empty netmask");
-		return (EINVAL);
-	}
+	error = check_info_netmask(rnh, info);
+	if (error != 0)
+		return (error);
 
 	bzero(rc, sizeof(struct rib_cmd_info));
 	rc->rc_cmd = RTM_ADD;
@@ -722,11 +729,48 @@ rib_add_route(uint32_t fibnum, struct rt_addrinfo *info,
 	return (error);
 }
 
+/*
+ * Check consistency between RTF_HOST flag and netmask
+ * existence.
+ */
+static int
+check_info_netmask(struct rib_head *rnh, struct rt_addrinfo *info)
+{
+
+	if (info->rti_flags & RTF_HOST)
+		info->rti_info[RTAX_NETMASK] = NULL;
+	else if (info->rti_info[RTAX_NETMASK] == NULL) {
+		FIB_RH_LOG(LOG_DEBUG, rnh, "error: no RTF_HOST and empty netmask");
+		return (EINVAL);
+	}
+
+	return (0);
+}
+
 static int
 add_route_byinfo(struct rib_head *rnh, struct rt_addrinfo *info,
     struct rib_cmd_info *rc)
 {
 	struct route_nhop_data rnd_add;
+	struct rtentry *rt;
+	int error, op_flags;
+
+	error = prepare_route_byinfo(rnh, info, &rt, &rnd_add, &op_flags);
+	if (error != 0)
+		return (error);
+
+	return (add_route_flags(rnh, rt, &rnd_add, op_flags, rc));
+}
+
+/*
+ * Allocates rtentry and nexthop for the route defined by @info.
+ * Returns 0 on success, storing the referenced objects and the
+ *  add_route_flags() operation flags in @prt, @rnd_add and @op_flags.
+ */
+static int
+prepare_route_byinfo(struct rib_head *rnh, struct rt_addrinfo *info,
+    struct rtentry **prt, struct route_nhop_data *rnd_add, int *op_flags)
+{
 	struct nhop_object *nh;
 	struct rtentry *rt;
 	struct sockaddr *dst, *gateway, *netmask;
@@ -768,19 +812,20 @@ add_route_byinfo(struct rib_head *rnh, struct rt_addrinfo *info,
 		return (error);
 	}
 
-	rnd_add.rnd_nhop = nh;
-	rnd_add.rnd_weight = get_info_weight(info, RT_DEFAULT_WEIGHT);
+	rnd_add->rnd_nhop = nh;
+	rnd_add->rnd_weight = get_info_weight(info, RT_DEFAULT_WEIGHT);
 
-	int op_flags = RTM_F_CREATE;
+	*op_flags = RTM_F_CREATE;
 
 	/*
 	 * Set the desired action when the route already exists:
 	 * If RTF_PINNED is present, assume the direct kernel routes that cannot be multipath.
 	 * Otherwise, append the path.
 	 */
-	op_flags |= (info->rti_flags & RTF_PINNED) ? RTM_F_REPLACE : RTM_F_APPEND;
+	*op_flags |= (info->rti_flags & RTF_PINNED) ? RTM_F_REPLACE : RTM_F_APPEND;
+	*prt = rt;
 
-	return (add_route_flags(rnh, rt, &rnd_add, op_flags, rc));
+	return (0);
 }
 
 static int
@@ -924,8 +969,6 @@ int
 rib_del_route(uint32_t fibnum, struct rt_addrinfo *info, struct rib_cmd_info *rc)
 {
 	struct rib_head *rnh;
-	struct sockaddr *dst, *netmask;
-	struct sockaddr_storage mdst;
 	int error;
 
 	NET_EPOCH_ASSERT();
@@ -937,6 +980,33 @@ rib_del_route(uint32_t fibnum, struct rt_addrinfo *info, struct rib_cmd_info *rc
 	bzero(rc, sizeof(struct rib_cmd_info));
 	rc->rc_cmd = RTM_DELETE;
 
+	RIB_WLOCK(rnh);
+	error = del_route_byinfo(rnh, info, rc);
+	RIB_WUNLOCK(rnh);
+
+	if (error != 0)
+		return (error);
+
+	del_route_finalize(rnh, rc);
+
+	return (0);
+}
+
+/*
+ * Unlinks route or route paths defined by @info from @rnh.
+ * Returns 0 on success with operation result stored in @rc.
+ */
+static int
+del_route_byinfo(struct rib_head *rnh, struct rt_addrinfo *info,
+    struct rib_cmd_info *rc)
+{
+	struct sockaddr *dst, *netmask;
+	struct sockaddr_storage mdst;
+	struct route_nhop_data rnd;
+	struct rtentry *rt;
+
+	RIB_WLOCK_ASSERT(rnh);
+
 	dst = info->rti_info[RTAX_DST];
 	netmask = info->rti_info[RTAX_NETMASK];
 
@@ -964,18 +1034,20 @@ rib_del_route(uint32_t fibnum, struct rt_addrinfo *info, struct rib_cmd_info *rc
 
 	int prio = get_prio_from_info(info);
 
-	RIB_WLOCK(rnh);
-	struct route_nhop_data rnd;
-	struct rtentry *rt = lookup_prefix_bysa(rnh, dst, netmask, &rnd);
-	if (rt != NULL) {
-		error = rt_delete_conditional(rnh, rt, prio, filter_func,
-		    filter_arg, rc);
-	} else
-		error = ESRCH;
-	RIB_WUNLOCK(rnh);
+	rt = lookup_prefix_bysa(rnh, dst, netmask, &rnd);
+	if (rt == NULL)
+		return (ESRCH);
 
-	if (error != 0)
-		return (error);
+	return (rt_delete_conditional(rnh, rt, prio, filter_func, filter_arg, rc));
+}
+
+/*
+ * Sends delayed notification for the successful deletion in @rc and
+ *  frees the unlinked objects. Called without the rib lock.
+ */
+static void
+del_route_finalize(struct rib_head *rnh, struct rib_cmd_info *rc)
+{
 
 	rib_notify(rnh, RIB_NOTIFY_DELAYED, rc);
 
@@ -991,8 +1063,221 @@ rib_del_route(uint32_t fibnum, struct rt_addrinfo *info, struct rib_cmd_info *rc
 		nhop_free_any(rc->rc_nh_old);
 	}
 #endif
+}
 
-	return (0);
+/*
+ * Starts a batched update of @rnh: per-route generation bumps are
+ *  coalesced and algo changes are queued until rib_batch_end().
+ */
+static void
+rib_batch_begin(struct rib_head *rnh)
+{
+
+	RIB_WLOCK_ASSERT(rnh);
+
+	rnh->rib_batch = 1;
+	rnh->rib_batch_dirty = 0;
+}
+
+static void
+rib_batch_end(struct rib_head *rnh)
+{
+
+	RIB_WLOCK_ASSERT(rnh);
+
+	rnh->rib_batch = 0;
+	if (rnh->rib_batch_dirty) {
+		rnh->rib_batch_dirty = 0;
+		rib_bump_gen(rnh);
+	}
+#ifdef FIB_ALGO
+	fib_rib_batch_end(rnh);
+#endif
+	rib_notify_batch_end(rnh);
+}
+
+struct rib_batch_item {
+	struct rtentry		*rt;
+	struct route_nhop_data	rnd;
+	int			op_flags;
+	int			error;
+	bool			replaced;	/* rc_nh_old needs to be freed */
+	bool			deferred;	/* mpath append after unlock */
+};
+
+static int
+rib_batch_result(int num, const struct rib_batch_item *items, int *errors)
+{
+	int error = 0;
+
+	for (int i = 0; i < num; i++) {
+		if (errors != NULL)
+			errors[i] = items[i].error;
+		if (error == 0)
+			error = items[i].error;
+	}
+
+	return (error);
+}
+
+/*
+ * Adds @num routes defined by the @info array into the kernel table
+ *  specified by @fibnum and sa_family of the destinations, which must
+ *  all be the same.
+ * All routes are inserted under a single rib lock hold, with a single
+ *  generation bump and a single algo batch update. Appending a path to
+ *  an existing multipath route requires rebuilding the nexthop group
+ *  without the lock, so such routes are handled one by one afterwards.
+ *
+ * Stores per-route results in @rc and, if not NULL, in @errors.
+ * Returns 0 if all routes were added or the first error otherwise.
+ */
+int
+rib_add_routes_batch(uint32_t fibnum, struct rt_addrinfo *info, int num,
+    struct rib_cmd_info *rc, int *errors)
+{
+	struct rib_batch_item *items, *bi;
+	struct route_nhop_data rnd_orig;
+	struct rtentry *rt_orig;
+	struct rib_head *rnh;
+	int error;
+
+	NET_EPOCH_ASSERT();
+
+	if (num <= 0)
+		return (0);
+
+	rnh = get_rnh(fibnum, &info[0]);
+	if (rnh == NULL)
+		return (EAFNOSUPPORT);
+
+	items = malloc(num * sizeof(struct rib_batch_item), M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (items == NULL)
+		return (ENOMEM);
+
+	/* Allocate rtentries and nexthops without holding the lock */
+	for (int i = 0; i < num; i++) {
+		bi = &items[i];
+		bzero(&rc[i], sizeof(struct rib_cmd_info));
+		rc[i].rc_cmd = RTM_ADD;
+
+		if (info[i].rti_info[RTAX_DST] == NULL ||
+		    info[i].rti_info[RTAX_DST]->sa_family != rnh->rib_family) {
+			bi->error = EAFNOSUPPORT;
+			continue;
+		}
+		bi->error = check_info_netmask(rnh, &info[i]);
+		if (bi->error == 0)
+			bi->error = prepare_route_byinfo(rnh, &info[i], &bi->rt,
+			    &bi->rnd, &bi->op_flags);
+	}
+
+	RIB_WLOCK(rnh);
+	rib_batch_begin(rnh);
+	for (int i = 0; i < num; i++) {
+		bi = &items[i];
+		if (bi->error != 0)
+			continue;
+
+		rt_orig = lookup_prefix_rt(rnh, bi->rt, &rnd_orig);
+		if (rt_orig == NULL) {
+			bi->error = add_route(rnh, bi->rt, &bi->rnd, &rc[i]);
+			continue;
+		}
+		if (bi->op_flags & RTM_F_REPLACE) {
+			if (nhop_get_prio(rnd_orig.rnd_nhop) == NH_PRIORITY_HIGH)
+				bi->error = EEXIST;
+			else {
+				change_route(rnh, rt_orig, &bi->rnd, &rc[i]);
+				bi->replaced = true;
+			}
+			continue;
+		}
+		bi->deferred = true;
+	}
+	rib_batch_end(rnh);
+	RIB_WUNLOCK(rnh);
+
+	for (int i = 0; i < num; i++) {
+		bi = &items[i];
+		if (bi->rt == NULL)
+			continue;
+		if (bi->deferred) {
+			bi->error = add_route_flags(rnh, bi->rt, &bi->rnd,
+			    bi->op_flags, &rc[i]);
+		} else if (bi->error != 0) {
+			rt_free_immediate(bi->rt);
+			nhop_free_any(bi->rnd.rnd_nhop);
+		} else if (bi->replaced) {
+			rt_free_immediate(bi->rt);
+			nhop_free_any(rc[i].rc_nh_old);
+		}
+		if (bi->error == 0)
+			rib_notify(rnh, RIB_NOTIFY_DELAYED, &rc[i]);
+	}
+
+	error = rib_batch_result(num, items, errors);
+	free(items, M_TEMP);
+
+	return (error);
+}
+
+/*
+ * Removes @num routes defined by the @info array from the kernel table
+ *  specified by @fibnum and sa_family of the destinations, under a single
+ *  rib lock hold with a single generation bump and algo batch update.
+ *
+ * Stores per-route results in @rc and, if not NULL, in @errors.
+ * Returns 0 if all routes were deleted or the first error otherwise.
+ */
+int
+rib_del_routes_batch(uint32_t fibnum, struct rt_addrinfo *info, int num,
+    struct rib_cmd_info *rc, int *errors)
+{
+	struct rib_batch_item *items;
+	struct rib_head *rnh;
+	int error;
+
+	NET_EPOCH_ASSERT();
+
+	if (num <= 0)
+		return (0);
+
+	rnh = get_rnh(fibnum, &info[0]);
+	if (rnh == NULL)
+		return (EAFNOSUPPORT);
+
+	items = malloc(num * sizeof(struct rib_batch_item), M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (items == NULL)
+		return (ENOMEM);
+
+	RIB_WLOCK(rnh);
+	rib_batch_begin(rnh);
+	for (int i = 0; i < num; i++) {
+		bzero(&rc[i], sizeof(struct rib_cmd_info));
+		rc[i].rc_cmd = RTM_DELETE;
+
+		if (info[i].rti_info[RTAX_DST] == NULL ||
+		    info[i].rti_info[RTAX_DST]->sa_family != rnh->rib_family) {
+			items[i].error = EAFNOSUPPORT;
+			continue;
+		}
+		items[i].error = del_route_byinfo(rnh, &info[i], &rc[i]);
+	}
+	rib_batch_end(rnh);
+	RIB_WUNLOCK(rnh);
+
+	for (int i = 0; i < num; i++) {
+		if (items[i].error == 0)
+			del_route_finalize(rnh, &rc[i]);
+	}
+
+	error = rib_batch_result(num, items, errors);
+	free(items, M_TEMP);
+
+	return (error);
 }
 
 /*
@@ -1396,6 +1681,8 @@ rib_action(uint32_t fibnum, int action, struct rt_addrinfo *info,
 {
 	int error;
 
+	SDT_PROBE3(route, ctl, rib_action, entry, fibnum, action,
+	    info->rti_info[RTAX_DST]);
 	switch (action) {
 	case RTM_ADD:
 		error = rib_add_route(fibnum, info, rc);
@@ -1409,6 +1696,7 @@ rib_action(uint32_t fibnum, int action, struct rt_addrinfo *info,
 	default:
 		error = ENOTSUP;
 	}
+	SDT_PROBE4(route, ctl, rib_action, return, fibnum, action, rc, error);
 
 	return (error);
 }
@@ -1461,9 +1749,54 @@ rt_checkdelroute(struct radix_node *rn, void *arg)
 	return (0);
 }
 
+/*
+ * Reclaims rtentries unlinked by rt_checkdelroute(), running delayed
+ *  notifications and rtsock reporting. Must be called without the RIB lock.
+ */
+static void
+rt_delinfo_reclaim(struct rt_delinfo *di, bool report)
+{
+	struct rib_head *rnh = di->rnh;
+	struct rtentry *rt;
+	struct nhop_object *nh;
+
+	bzero(&di->rc, sizeof(di->rc));
+	di->rc.rc_cmd = RTM_DELETE;
+	while (di->head != NULL) {
+		rt = di->head;
+		di->head = rt->rt_chain;
+		rt->rt_chain = NULL;
+		nh = rt->rt_nhop;
+
+		di->rc.rc_rt = rt;
+		di->rc.rc_nh_old = nh;
+		rib_notify(rnh, RIB_NOTIFY_DELAYED, &di->rc);
+
+		if (report) {
+#ifdef ROUTE_MPATH
+			struct nhgrp_object *nhg;
+			const struct weightened_nhop *wn;
+			uint32_t num_nhops;
+			if (NH_IS_NHGRP(nh)) {
+				nhg = (struct nhgrp_object *)nh;
+				wn = nhgrp_get_nhops(nhg, &num_nhops);
+				for (int i = 0; i < num_nhops; i++)
+					rt_routemsg(RTM_DELETE, rt, wn[i].nh,
+					    rnh->rib_fibnum);
+			} else
+#endif
+			rt_routemsg(RTM_DELETE, rt, nh, rnh->rib_fibnum);
+		}
+		rt_free(rt);
+	}
+}
+
 /*
  * Iterates over a routing table specified by @fibnum and @family and
  *  deletes elements marked by @filter_f.
+ * Matching routes are unlinked as a single batch: one generation bump,
+ *  one algo update and one async subscriber wakeup. The rtentries are
+ *  reclaimed after the lock is dropped and freed at the end of the epoch.
  * @fibnum: rtable id
  * @family: AF_ address family
  * @filter_f: function returning non-zero value for items to delete
@@ -1475,8 +1808,6 @@ rib_walk_del(u_int fibnum, int family, rib_filter_f_t *filter_f, void *filter_ar
     bool report)
 {
 	struct rib_head *rnh;
-	struct rtentry *rt;
-	struct nhop_object *nh;
 	struct epoch_tracker et;
 
 	rnh = rt_tables_get_rnh(fibnum, family);
@@ -1493,38 +1824,47 @@ rib_walk_del(u_int fibnum, int family, rib_filter_f_t *filter_f, void *filter_ar
 	NET_EPOCH_ENTER(et);
 
 	RIB_WLOCK(rnh);
+	rib_batch_begin(rnh);
 	rnh->rnh_walktree(&rnh->head, rt_checkdelroute, &di);
+	rib_batch_end(rnh);
 	RIB_WUNLOCK(rnh);
 
 	/* We might have something to reclaim. */
-	bzero(&di.rc, sizeof(di.rc));
-	di.rc.rc_cmd = RTM_DELETE;
-	while (di.head != NULL) {
-		rt = di.head;
-		di.head = rt->rt_chain;
-		rt->rt_chain = NULL;
-		nh = rt->rt_nhop;
+	rt_delinfo_reclaim(&di, report);
 
-		di.rc.rc_rt = rt;
-		di.rc.rc_nh_old = nh;
-		rib_notify(rnh, RIB_NOTIFY_DELAYED, &di.rc);
+	NET_EPOCH_EXIT(et);
+}
 
-		if (report) {
-#ifdef ROUTE_MPATH
-			struct nhgrp_object *nhg;
-			const struct weightened_nhop *wn;
-			uint32_t num_nhops;
-			if (NH_IS_NHGRP(nh)) {
-				nhg = (struct nhgrp_object *)nh;
-				wn = nhgrp_get_nhops(nhg, &num_nhops);
-				for (int i = 0; i < num_nhops; i++)
-					rt_routemsg(RTM_DELETE, rt, wn[i].nh, fibnum);
-			} else
-#endif
-			rt_routemsg(RTM_DELETE, rt, nh, fibnum);
-		}
-		rt_free(rt);
-	}
+/*
+ * Same as rib_walk_del(), but instead of traversing the whole tree
+ *  checks only the rtentries returned by @next_f, which is called with
+ *  the RIB write lock held until it returns NULL.
+ * All deletions are done under a single lock acquisition.
+ */
+void
+rib_walk_del_list(struct rib_head *rnh, rib_next_f_t *next_f, void *next_arg,
+    rib_filter_f_t *filter_f, void *filter_arg, bool report)
+{
+	struct rtentry *rt;
+	struct epoch_tracker et;
+
+	struct rt_delinfo di = {
+		.rnh = rnh,
+		.filter_f = filter_f,
+		.filter_arg = filter_arg,
+		.prio = NH_PRIORITY_NORMAL,
+	};
+
+	NET_EPOCH_ENTER(et);
+
+	RIB_WLOCK(rnh);
+	rib_batch_begin(rnh);
+	while ((rt = next_f(rnh, next_arg)) != NULL)
+		rt_checkdelroute((struct radix_node *)rt, &di);
+	rib_batch_end(rnh);
+	RIB_WUNLOCK(rnh);
+
+	rt_delinfo_reclaim(&di, report);
 
 	NET_EPOCH_EXIT(et);
 }
@@ -73,6 +73,10 @@ int rib_del_route(uint32_t fibnum, struct rt_addrinfo *info,
   struct rib_cmd_info *rc);
 int rib_change_route(uint32_t fibnum, struct rt_addrinfo *info,
   struct rib_cmd_info *rc);
+int rib_add_routes_batch(uint32_t fibnum, struct rt_addrinfo *info, int num,
+  struct rib_cmd_info *rc, int *errors);
+int rib_del_routes_batch(uint32_t fibnum, struct rt_addrinfo *info, int num,
+  struct rib_cmd_info *rc, int *errors);
 int rib_action(uint32_t fibnum, int action, struct rt_addrinfo *info,
   struct rib_cmd_info *rc);
 int rib_match_gw(const struct rtentry *rt, const struct nhop_object *nh,
@@ -112,6 +116,21 @@ void rib_walk_ext_locked(struct rib_head *rnh, rib_walktree_f_t *wa_f,
 void rib_walk_from(uint32_t fibnum, int family, uint32_t flags, struct sockaddr *prefix,
     struct sockaddr *mask, rib_walktree_f_t *wa_f, void *arg);
 
+/* Position of a chunked walk, see rib_walk_cursor() */
+struct rib_cursor {
+	u_int			rc_gen;		/* rib generation rc_next is valid for */
+	uint32_t		rc_flags;
+#define	RIB_CURSOR_STARTED	0x01
+#define	RIB_CURSOR_DONE		0x02
+#define	RIB_CURSOR_MASK		0x04	/* rc_mask is set */
+	struct radix_node	*rc_next;	/* next leaf, NULL when done */
+	struct sockaddr_storage	rc_key;		/* last route returned */
+	struct sockaddr_storage	rc_mask;
+};
+void rib_cursor_init(struct rib_cursor *rc);
+int rib_walk_cursor(uint32_t fibnum, int family, struct rib_cursor *rc,
+    int limit, rib_walktree_f_t *wa_f, void *arg);
+
 void rib_walk_del(u_int fibnum, int family, rib_filter_f_t *filter_f,
     void *filter_arg, bool report);
 
@@ -162,6 +181,7 @@ struct nhop_iter {
 	uint32_t		fibnum;
 	uint8_t			family;
 	struct rib_head		*rh;
+	int			_s;
 	int			_i;
 	struct nhop_priv	*_next;
 };
@@ -178,6 +198,9 @@ const struct weightened_nhop *nhgrp_get_nhops(const struct nhgrp_object *nhg,
 uint32_t nhgrp_get_count(struct rib_head *rh);
 int nhgrp_get_group(struct rib_head *rh, struct weightened_nhop *wn, int num_nhops,
     uint32_t uidx, struct nhgrp_object **pnhg);
+int nhgrp_get_resilient_group(struct rib_head *rh, struct weightened_nhop *wn,
+    int num_nhops, uint32_t uidx, uint16_t idle_timer,
+    struct nhgrp_object **pnhg);
 
 /* Route subscriptions */
 enum rib_subscription_type {
@@ -202,6 +225,35 @@ void rib_unsubscribe_locked(struct rib_subscription *rs);
 void rib_notify(struct rib_head *rnh, enum rib_subscription_type type,
     struct rib_cmd_info *rc);
 
+/*
+ * Asynchronous subscriptions.
+ * Changes are queued as compact records to the per-subscriber ring
+ *  and delivered in batches from a taskqueue, in the net epoch.
+ *  Nexthops in the records are referenced for the callback duration.
+ * When the ring is full, further changes are dropped and the resync
+ *  callback is called instead, with the RIB read lock held, so the
+ *  subscriber can rebuild its state from the table.
+ */
+struct rib_change_rec {
+	uint8_t			rcr_cmd;	/* RTM_ADD|RTM_DELETE|RTM_CHANGE */
+	uint8_t			rcr_family;	/* AF_INET|AF_INET6 */
+	uint8_t			rcr_plen;	/* prefix length */
+	uint8_t			rcr_spare;
+	uint32_t		rcr_nh_weight;	/* new nhop weight */
+	uint32_t		rcr_scopeid;	/* IPv6 prefix zone */
+	uint8_t			rcr_addr[16];	/* in_addr or in6_addr */
+	struct nhop_object	*rcr_nh_old;	/* nhop OR mpath */
+	struct nhop_object	*rcr_nh_new;	/* nhop OR mpath */
+};
+
+typedef void rib_async_cb_t(struct rib_head *rnh,
+    const struct rib_change_rec *recs, int num, void *arg);
+typedef void rib_resync_cb_t(struct rib_head *rnh, void *arg);
+
+struct rib_subscription *rib_subscribe_async(struct rib_head *rnh,
+    rib_async_cb_t *f, rib_resync_cb_t *resync_f, void *arg,
+    uint32_t ring_size, bool waitok);
+
 /* Event bridge */
 typedef void route_event_f(uint32_t fibnum, const struct rib_cmd_info *rc);
 typedef void ifmsg_event_f(struct ifnet *ifp, int if_flags_mask);
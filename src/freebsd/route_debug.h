@@ -32,6 +32,14 @@
 
 #include <sys/sysctl.h>
 #include <sys/syslog.h>
+#include <sys/sdt.h>
+
+/*
+ * Static tracepoints of the routing code, route:<module>:<function>:<name>.
+ * Unlike the logging below they are compiled in and cost a branch until
+ * enabled with dtrace(1).
+ */
+SDT_PROVIDER_DECLARE(route);
 
 /* DEBUG logic */
 #if defined(DEBUG_MOD_NAME) && defined(DEBUG_MAX_LEVEL)
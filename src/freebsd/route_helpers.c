@@ -43,6 +43,7 @@
 #include <sys/domain.h>
 #include <sys/kernel.h>
 #include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rmlock.h>
 
 #include <net/if.h>
@@ -165,6 +166,91 @@ rib_walk_from(uint32_t fibnum, int family, uint32_t flags, struct sockaddr *pref
 		RIB_RUNLOCK(rnh);
 }
 
+static u_int
+rib_cursor_gen(const struct rib_head *rnh)
+{
+#ifdef FIB_ALGO
+	return (rnh->rnh_gen_rib);
+#else
+	return (rnh->rnh_gen);
+#endif
+}
+
+void
+rib_cursor_init(struct rib_cursor *rc)
+{
+
+	bzero(rc, sizeof(*rc));
+}
+
+/*
+ * Calls @wa_f with @arg for up to @limit entries of the table specified
+ * by @family and @fibnum, starting after the last entry passed by the
+ * previous call with the same @rc. The table lock is only held for the
+ * duration of a call, so large dumps do not stall route updates.
+ *
+ * While the rib generation is unchanged the walk resumes from the saved
+ * leaf. Otherwise the leaf may be gone and the walk seeks past the saved
+ * key and mask instead: entries present during the whole walk are passed
+ * exactly once, in the rnh_walktree() order.
+ *
+ * Returns the number of entries passed to @wa_f, 0 once done. A non-zero
+ * return from @wa_f ends the call after that entry.
+ */
+int
+rib_walk_cursor(uint32_t fibnum, int family, struct rib_cursor *rc,
+    int limit, rib_walktree_f_t *wa_f, void *arg)
+{
+	RIB_RLOCK_TRACKER;
+	struct rib_head *rnh;
+	struct radix_node *rn;
+	struct rtentry *rt;
+	const struct sockaddr *sa;
+	int count = 0;
+
+	KASSERT(limit > 0, ("%s: limit %d", __func__, limit));
+	if (rc->rc_flags & RIB_CURSOR_DONE)
+		return (0);
+	if ((rnh = rt_tables_get_rnh(fibnum, family)) == NULL)
+		return (0);
+
+	RIB_RLOCK(rnh);
+	if (!(rc->rc_flags & RIB_CURSOR_STARTED)) {
+		rn = rn_seek_after(NULL, NULL, &rnh->head);
+		rc->rc_flags |= RIB_CURSOR_STARTED;
+	} else if (rc->rc_gen == rib_cursor_gen(rnh) && !rnh->rib_batch &&
+	    !rnh->rib_batch_dirty)
+		rn = rc->rc_next;
+	else
+		rn = rn_seek_after(&rc->rc_key, (rc->rc_flags & RIB_CURSOR_MASK) ?
+		    &rc->rc_mask : NULL, &rnh->head);
+
+	for (; rn != NULL && count < limit; count++) {
+		rt = RNTORT(rn);
+		rn = rn_next_leaf(rn);
+
+		sa = rt_key_const(rt);
+		memcpy(&rc->rc_key, sa, min(sa->sa_len, sizeof(rc->rc_key)));
+		rc->rc_flags &= ~RIB_CURSOR_MASK;
+		if ((sa = rt_mask_const(rt)) != NULL) {
+			memcpy(&rc->rc_mask, sa, min(sa->sa_len, sizeof(rc->rc_mask)));
+			rc->rc_flags |= RIB_CURSOR_MASK;
+		}
+
+		if (wa_f(rt, arg) != 0) {
+			count++;
+			break;
+		}
+	}
+	rc->rc_next = rn;
+	rc->rc_gen = rib_cursor_gen(rnh);
+	if (rn == NULL)
+		rc->rc_flags |= RIB_CURSOR_DONE;
+	RIB_RUNLOCK(rnh);
+
+	return (count);
+}
+
 /*
  * Iterates over all existing fibs in system calling
  *  @hook_f function before/after traversing each fib.
@@ -106,6 +106,10 @@ rib_handle_ifaddr_info(uint32_t fibnum, int cmd, struct rt_addrinfo *info)
 		didwork = (error == 0);
 	} else {
 		for (fibnum = 0; fibnum < V_rt_numfibs; fibnum++) {
+			/* Tables created later copy the kernel routes */
+			if (rt_tables_get_rnh(fibnum,
+			    info->rti_info[RTAX_DST]->sa_family) == NULL)
+				continue;
 			error = rib_handle_ifaddr_one(fibnum, cmd, info);
 			if (error == 0)
 				didwork = true;
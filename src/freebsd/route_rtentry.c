@@ -153,7 +153,8 @@ rt_free(struct rtentry *rt)
 
 	KASSERT(rt != NULL, ("%s: NULL rt", __func__));
 
-	NET_EPOCH_CALL(destroy_rtentry_epoch, &rt->rt_epoch_ctx);
+	NET_EPOCH_CALL_SIZE(destroy_rtentry_epoch, &rt->rt_epoch_ctx,
+	    sizeof(struct rtentry));
 }
 
 void
@@ -35,12 +35,25 @@
 #include <sys/kernel.h>
 #include <sys/lock.h>
 #include <sys/rmlock.h>
+#include <sys/taskqueue.h>
 
 #include <net/route.h>
 #include <net/route/route_ctl.h>
 #include <net/route/route_var.h>
 #include <net/route/nhop.h>
 
+#include <netinet/in.h>
+
+/*
+ * Asynchronous subscribers have a single-producer single-consumer ring.
+ * The producer side is the rib_notify() caller, serialised by the RIB
+ *  write lock. The consumer side is the per-rib dispatcher task, which
+ *  hands the records out in contiguous batches.
+ */
+#define	RIB_ASYNC_RING_MIN	64
+#define	RIB_ASYNC_RING_MAX	65536
+#define	RIB_ASYNC_BATCH		256
+
 struct rib_subscription {
 	CK_STAILQ_ENTRY(rib_subscription)	next;
 	rib_subscription_cb_t			*func;
@@ -48,10 +61,200 @@ struct rib_subscription {
 	struct rib_head				*rnh;
 	enum rib_subscription_type		type;
 	struct epoch_context			epoch_ctx;
+	/* Asynchronous mode */
+	rib_async_cb_t				*async_func;
+	rib_resync_cb_t				*resync_func;
+	struct rib_change_rec			*ring;
+	uint32_t				ring_mask;
+	uint32_t				ring_head;	/* producer */
+	uint32_t				ring_tail;	/* consumer */
+	uint32_t				ring_overflow;	/* resync needed */
+	uint64_t				ring_drops;
+};
+
+struct rib_async {
+	struct task				ra_task;
+	struct rib_head				*ra_rnh;
+	u_int					ra_pending;
 };
 
 static void destroy_subscription_epoch(epoch_context_t ctx);
 
+static void
+rib_async_kick(struct rib_head *rnh)
+{
+	struct rib_async *ra = rnh->rib_async;
+
+	/* Pairs with the fence in rib_async_dispatch() */
+	atomic_thread_fence_seq_cst();
+	if (atomic_load_int(&ra->ra_pending) == 0 &&
+	    atomic_cmpset_int(&ra->ra_pending, 0, 1))
+		taskqueue_enqueue(taskqueue_thread, &ra->ra_task);
+}
+
+static void
+rib_async_fill(struct rib_change_rec *rec, const struct rib_cmd_info *rc)
+{
+	const struct rtentry *rt = rc->rc_rt;
+	int plen = 0;
+
+	rec->rcr_cmd = rc->rc_cmd;
+	rec->rcr_family = rt_key_const(rt)->sa_family;
+	rec->rcr_nh_weight = rc->rc_nh_weight;
+	rec->rcr_scopeid = 0;
+	switch (rec->rcr_family) {
+#ifdef INET
+	case AF_INET:
+		rt_get_inet_prefix_plen(rt, (struct in_addr *)rec->rcr_addr,
+		    &plen, &rec->rcr_scopeid);
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		rt_get_inet6_prefix_plen(rt, (struct in6_addr *)rec->rcr_addr,
+		    &plen, &rec->rcr_scopeid);
+		break;
+#endif
+	default:
+		memset(rec->rcr_addr, 0, sizeof(rec->rcr_addr));
+		break;
+	}
+	rec->rcr_plen = plen;
+
+	/* Keep nexthops alive until the record is consumed */
+	if ((rec->rcr_nh_old = rc->rc_nh_old) != NULL)
+		nhop_ref_any(rec->rcr_nh_old);
+	if ((rec->rcr_nh_new = rc->rc_nh_new) != NULL)
+		nhop_ref_any(rec->rcr_nh_new);
+}
+
+static void
+rib_async_release(struct rib_change_rec *rec)
+{
+
+	if (rec->rcr_nh_old != NULL)
+		nhop_free_any(rec->rcr_nh_old);
+	if (rec->rcr_nh_new != NULL)
+		nhop_free_any(rec->rcr_nh_new);
+}
+
+/*
+ * Queues the change to the subscriber ring. Called with RIB write lock held.
+ * Never waits for the consumer: when the ring is full, the record is dropped
+ *  and the subscriber is flagged for resync instead.
+ */
+static void
+rib_async_enqueue(struct rib_head *rnh, struct rib_subscription *rs,
+    const struct rib_cmd_info *rc)
+{
+	uint32_t head, tail;
+
+	RIB_WLOCK_ASSERT(rnh);
+
+	if (atomic_load_acq_int(&rs->ring_overflow) != 0) {
+		rs->ring_drops++;
+		return;
+	}
+
+	head = rs->ring_head;
+	tail = atomic_load_acq_int(&rs->ring_tail);
+	if (head - tail > rs->ring_mask) {
+		rs->ring_drops++;
+		atomic_store_rel_int(&rs->ring_overflow, 1);
+	} else {
+		rib_async_fill(&rs->ring[head & rs->ring_mask], rc);
+		atomic_store_rel_int(&rs->ring_head, head + 1);
+	}
+
+	/*
+	 * Batched updates wake the dispatcher once the ring is half full
+	 *  and at the end of the batch, see rib_notify_batch_end().
+	 */
+	if (rnh->rib_batch && head - tail < rs->ring_mask / 2) {
+		rnh->rib_batch_kick = 1;
+		return;
+	}
+	rib_async_kick(rnh);
+}
+
+/*
+ * Overflowed subscriber: discards everything queued and lets the subscriber
+ *  rebuild its state. The read lock keeps writers out, so no change can
+ *  slip between the discarded records and the resync view of the table.
+ */
+static void
+rib_async_resync(struct rib_head *rnh, struct rib_subscription *rs)
+{
+	struct rib_change_rec *rec;
+	uint32_t head, tail;
+	RIB_RLOCK_TRACKER;
+
+	RIB_RLOCK(rnh);
+	head = atomic_load_acq_int(&rs->ring_head);
+	for (tail = rs->ring_tail; tail != head; tail++) {
+		rec = &rs->ring[tail & rs->ring_mask];
+		rib_async_release(rec);
+	}
+	atomic_store_rel_int(&rs->ring_tail, tail);
+	atomic_store_rel_int(&rs->ring_overflow, 0);
+	if (rs->resync_func != NULL)
+		rs->resync_func(rnh, rs->arg);
+	RIB_RUNLOCK(rnh);
+}
+
+static void
+rib_async_drain(struct rib_head *rnh, struct rib_subscription *rs)
+{
+	struct rib_change_rec *recs;
+	uint32_t head, tail, num;
+
+	NET_EPOCH_ASSERT();
+
+	tail = rs->ring_tail;
+	for (;;) {
+		if (atomic_load_acq_int(&rs->ring_overflow) != 0) {
+			rib_async_resync(rnh, rs);
+			tail = rs->ring_tail;
+			continue;
+		}
+		head = atomic_load_acq_int(&rs->ring_head);
+		if (head == tail)
+			break;
+
+		/* Contiguous chunk up to the ring wrap */
+		num = min(head - tail, rs->ring_mask + 1 - (tail & rs->ring_mask));
+		num = min(num, RIB_ASYNC_BATCH);
+		recs = &rs->ring[tail & rs->ring_mask];
+		rs->async_func(rnh, recs, num, rs->arg);
+		for (uint32_t i = 0; i < num; i++)
+			rib_async_release(&recs[i]);
+		tail += num;
+		atomic_store_rel_int(&rs->ring_tail, tail);
+	}
+}
+
+static void
+rib_async_dispatch(void *_ctx, int pending __unused)
+{
+	struct rib_async *ra = (struct rib_async *)_ctx;
+	struct rib_head *rnh = ra->ra_rnh;
+	struct rib_subscription *rs;
+	struct epoch_tracker et;
+
+	/* Any record queued after this point re-kicks the task */
+	atomic_store_rel_int(&ra->ra_pending, 0);
+	atomic_thread_fence_seq_cst();
+
+	CURVNET_SET(rnh->rib_vnet);
+	NET_EPOCH_ENTER(et);
+	CK_STAILQ_FOREACH(rs, &rnh->rnh_subscribers, next) {
+		if (rs->ring != NULL)
+			rib_async_drain(rnh, rs);
+	}
+	NET_EPOCH_EXIT(et);
+	CURVNET_RESTORE();
+}
+
 void
 rib_notify(struct rib_head *rnh, enum rib_subscription_type type,
     struct rib_cmd_info *rc)
@@ -59,11 +262,31 @@ rib_notify(struct rib_head *rnh, enum rib_subscription_type type,
 	struct rib_subscription *rs;
 
 	CK_STAILQ_FOREACH(rs, &rnh->rnh_subscribers, next) {
-		if (rs->type == type)
+		if (rs->type != type)
+			continue;
+		if (rs->ring != NULL)
+			rib_async_enqueue(rnh, rs, rc);
+		else
 			rs->func(rnh, rc, rs->arg);
 	}
 }
 
+/*
+ * Wakes the async dispatcher for the records queued by a batched update.
+ * Called with RIB write lock held.
+ */
+void
+rib_notify_batch_end(struct rib_head *rnh)
+{
+
+	RIB_WLOCK_ASSERT(rnh);
+
+	if (rnh->rib_batch_kick) {
+		rnh->rib_batch_kick = 0;
+		rib_async_kick(rnh);
+	}
+}
+
 static struct rib_subscription *
 allocate_subscription(rib_subscription_cb_t *f, void *arg,
     enum rib_subscription_type type, bool waitok)
@@ -99,6 +322,11 @@ rib_subscribe(uint32_t fibnum, int family, rib_subscription_cb_t *f, void *arg,
 	KASSERT((fibnum < rt_numfibs), ("%s: bad fibnum", __func__));
 	rnh = rt_tables_get_rnh(fibnum, family);
 	NET_EPOCH_EXIT(et);
+	/* Tables are created on first use */
+	if (rnh == NULL && waitok)
+		rnh = rt_tables_get_rnh_create(fibnum, family);
+	if (rnh == NULL)
+		return (NULL);
 
 	return (rib_subscribe_internal(rnh, f, arg, type, waitok));
 }
@@ -141,6 +369,50 @@ rib_subscribe_locked(struct rib_head *rnh, rib_subscription_cb_t *f, void *arg,
 	return (rs);
 }
 
+/*
+ * Subscribe for the changes in the routing table @rnh in asynchronous mode.
+ * Changes are batched to @f from the taskqueue context, up to @ring_size
+ *  records (rounded up to power of 2) behind the writers. On ring overflow
+ *  @resync_f is called instead, with the RIB read lock held.
+ *
+ * Returns pointer to the subscription structure on success.
+ */
+struct rib_subscription *
+rib_subscribe_async(struct rib_head *rnh, rib_async_cb_t *f,
+    rib_resync_cb_t *resync_f, void *arg, uint32_t ring_size, bool waitok)
+{
+	struct rib_subscription *rs;
+	struct epoch_tracker et;
+	uint32_t size;
+	int flags = M_ZERO | (waitok ? M_WAITOK : M_NOWAIT);
+
+	ring_size = max(ring_size, RIB_ASYNC_RING_MIN);
+	ring_size = min(ring_size, RIB_ASYNC_RING_MAX);
+	for (size = RIB_ASYNC_RING_MIN; size < ring_size; size <<= 1)
+		;
+
+	rs = allocate_subscription(NULL, arg, RIB_NOTIFY_IMMEDIATE, waitok);
+	if (rs == NULL)
+		return (NULL);
+	rs->ring = malloc(size * sizeof(struct rib_change_rec), M_RTABLE, flags);
+	if (rs->ring == NULL) {
+		free(rs, M_RTABLE);
+		return (NULL);
+	}
+	rs->ring_mask = size - 1;
+	rs->async_func = f;
+	rs->resync_func = resync_f;
+	rs->rnh = rnh;
+
+	NET_EPOCH_ENTER(et);
+	RIB_WLOCK(rnh);
+	CK_STAILQ_INSERT_HEAD(&rnh->rnh_subscribers, rs, next);
+	RIB_WUNLOCK(rnh);
+	NET_EPOCH_EXIT(et);
+
+	return (rs);
+}
+
 /*
  * Remove rtable subscription @rs from the routing table.
  * Needs to be run in network epoch.
@@ -182,14 +454,26 @@ destroy_subscription_epoch(epoch_context_t ctx)
 
 	rs = __containerof(ctx, struct rib_subscription, epoch_ctx);
 
+	if (rs->ring != NULL) {
+		/* Dispatcher can no longer see @rs, drop what is left */
+		for (uint32_t i = rs->ring_tail; i != rs->ring_head; i++)
+			rib_async_release(&rs->ring[i & rs->ring_mask]);
+		free(rs->ring, M_RTABLE);
+	}
 	free(rs, M_RTABLE);
 }
 
 void
 rib_init_subscriptions(struct rib_head *rnh)
 {
+	struct rib_async *ra;
 
 	CK_STAILQ_INIT(&rnh->rnh_subscribers);
+
+	ra = malloc(sizeof(struct rib_async), M_RTABLE, M_WAITOK | M_ZERO);
+	ra->ra_rnh = rnh;
+	TASK_INIT(&ra->ra_task, 0, rib_async_dispatch, ra);
+	rnh->rib_async = ra;
 }
 
 void
@@ -206,4 +490,9 @@ rib_destroy_subscriptions(struct rib_head *rnh)
 	}
 	RIB_WUNLOCK(rnh);
 	NET_EPOCH_EXIT(et);
+
+	/* No producers left, wait for the last dispatcher run */
+	taskqueue_drain(taskqueue_thread, &rnh->rib_async->ra_task);
+	free(rnh->rib_async, M_RTABLE);
+	rnh->rib_async = NULL;
 }
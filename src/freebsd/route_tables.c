@@ -72,6 +72,8 @@
 #endif
 
 static void grow_rtables(uint32_t num_fibs);
+static inline struct rib_head *rt_tables_get_rnh_ptr(uint32_t table,
+    sa_family_t family);
 
 VNET_DEFINE_STATIC(struct sx, rtables_lock);
 #define	V_rtables_lock		VNET(rtables_lock)
@@ -80,7 +82,22 @@ VNET_DEFINE_STATIC(struct sx, rtables_lock);
 #define	RTABLES_LOCK_INIT()	sx_init(&V_rtables_lock, "rtables lock")
 #define	RTABLES_LOCK_ASSERT()	sx_assert(&V_rtables_lock, SA_LOCKED)
 
-VNET_DEFINE_STATIC(struct rib_head **, rt_tables);
+/*
+ * Tables are indexed through a fixed directory of chunks, each holding
+ * the per-family pointers of RTABLES_CHUNK consecutive fibs. A chunk is
+ * allocated along with the first table of one of its fibs and tables
+ * are created on first use, see rt_tables_instantiate(), so growing the
+ * number of fibs neither copies the index nor creates any table.
+ */
+#define	RTABLES_CHUNK_SHIFT	4
+#define	RTABLES_CHUNK		(1 << RTABLES_CHUNK_SHIFT)
+#define	RTABLES_NCHUNKS		((RT_MAXFIBS + RTABLES_CHUNK) / RTABLES_CHUNK)
+
+struct rtables_chunk {
+	struct rib_head	*rc_rnh[RTABLES_CHUNK][AF_MAX + 1];
+};
+
+VNET_DEFINE_STATIC(struct rtables_chunk **, rt_tables);
 #define	V_rt_tables	VNET(rt_tables)
 
 VNET_DEFINE(uint32_t, _rt_numfibs) = RT_NUMFIBS;
@@ -154,9 +171,11 @@ sys_setfib(struct thread *td, struct setfib_args *uap)
 	int error = 0;
 
 	CURVNET_SET(TD_TO_VNET(td));
-	if (uap->fibnum >= 0 && uap->fibnum < V_rt_numfibs)
+	if (uap->fibnum >= 0 && uap->fibnum < V_rt_numfibs) {
+		/* Sockets of the process will look the fib up */
+		rt_tables_instantiate(uap->fibnum);
 		td->td_proc->p_fibnum = uap->fibnum;
-	else
+	} else
 		error = EINVAL;
 	CURVNET_RESTORE();
 
@@ -197,86 +216,169 @@ SYSINIT(rtables_init, SI_SUB_PROTO_DOMAIN, SI_ORDER_THIRD, rtables_init, NULL);
 
 
 /*
- * If required, copy interface routes from existing tables to the
- * newly-created routing table.
+ * If required, copy interface routes from the existing tables to the
+ * newly-created routing table. Only instantiated tables are visited,
+ * the others get their copies when they are created.
  */
 static void
-populate_kernel_routes(struct rib_head **new_rt_tables, struct rib_head *rh)
+populate_kernel_routes(struct rib_head *rh)
 {
+	struct rib_head *rh_src;
+
 	for (int i = 0; i < V_rt_numfibs; i++) {
-		struct rib_head *rh_src = new_rt_tables[i * (AF_MAX + 1) + rh->rib_family];
+		rh_src = rt_tables_get_rnh_safe(i, rh->rib_family);
 		if ((rh_src != NULL) && (rh_src != rh))
 			rib_copy_kernel_routes(rh_src, rh);
 	}
 }
 
+static struct rib_head **
+rt_tables_slot(uint32_t table, sa_family_t family)
+{
+	struct rtables_chunk *chunk;
+
+	chunk = (struct rtables_chunk *)atomic_load_acq_ptr(
+	    (uintptr_t *)&V_rt_tables[table >> RTABLES_CHUNK_SHIFT]);
+	if (chunk == NULL)
+		return (NULL);
+	return (&chunk->rc_rnh[table & (RTABLES_CHUNK - 1)][family]);
+}
+
+/*
+ * Creates the @family table of fib @table unless it exists already.
+ * Returns the table or NULL if it could not be created.
+ */
+static struct rib_head *
+rtables_attach(uint32_t table, struct domain *dom)
+{
+	struct rtables_chunk **pchunk, *chunk;
+	struct rib_head **prnh, *rh;
+
+	RTABLES_LOCK_ASSERT();
+
+	pchunk = &V_rt_tables[table >> RTABLES_CHUNK_SHIFT];
+	if ((chunk = *pchunk) == NULL) {
+		chunk = malloc(sizeof(*chunk), M_RTABLE, M_WAITOK | M_ZERO);
+		atomic_store_rel_ptr((uintptr_t *)pchunk, (uintptr_t)chunk);
+	}
+	prnh = &chunk->rc_rnh[table & (RTABLES_CHUNK - 1)][dom->dom_family];
+	if (*prnh != NULL)
+		return (*prnh);
+
+	rh = dom->dom_rtattach(table);
+	if (rh == NULL) {
+		log(LOG_ERR, "unable to create routing table for %d.%d\n",
+		    dom->dom_family, table);
+		return (NULL);
+	}
+	populate_kernel_routes(rh);
+
+	/* Ensure the table is fully set up before publishing it */
+	atomic_store_rel_ptr((uintptr_t *)prnh, (uintptr_t)rh);
+	return (rh);
+}
+
+/*
+ * Creates the tables of fib @table for every family that has none yet.
+ * Tables other than the default fib ones only exist once used: the
+ * first route added from the routing socket, a subscription or a
+ * process switching to the fib instantiate them.
+ * May sleep, must not be called from within the network epoch.
+ */
+void
+rt_tables_instantiate(uint32_t table)
+{
+	struct domain *dom;
+
+	if (table >= V_rt_numfibs)
+		return;
+
+	RTABLES_LOCK();
+	SLIST_FOREACH(dom, &domains, dom_next) {
+		if (dom->dom_rtattach == NULL)
+			continue;
+		if (rt_tables_get_rnh_ptr(table, dom->dom_family) != NULL)
+			continue;
+		if (rtables_attach(table, dom) == NULL)
+			continue;
+#ifdef FIB_ALGO
+		fib_setup_family(dom->dom_family, V_rt_numfibs);
+#endif
+	}
+	RTABLES_UNLOCK();
+}
+
+/*
+ * Returns the @family table of fib @table, creating it if needed.
+ * May sleep, must not be called from within the network epoch.
+ */
+struct rib_head *
+rt_tables_get_rnh_create(uint32_t table, sa_family_t family)
+{
+	struct domain *dom;
+	struct rib_head *rh;
+
+	if (table >= V_rt_numfibs || family > AF_MAX)
+		return (NULL);
+	if ((rh = rt_tables_get_rnh_ptr(table, family)) != NULL)
+		return (rh);
+
+	RTABLES_LOCK();
+	SLIST_FOREACH(dom, &domains, dom_next) {
+		if (dom->dom_family == family && dom->dom_rtattach != NULL)
+			break;
+	}
+	if (dom != NULL && (rh = rtables_attach(table, dom)) != NULL) {
+#ifdef FIB_ALGO
+		fib_setup_family(family, V_rt_numfibs);
+#endif
+	}
+	RTABLES_UNLOCK();
+
+	return (rh);
+}
+
 /*
- * Grows up the number of routing tables in the current fib.
- * Function creates new index array for all rtables and allocates
- *  remaining routing tables.
+ * Returns true if tables of @family can be created: a missing table of
+ * such family is empty rather than unsupported.
+ */
+bool
+rt_tables_has_family(sa_family_t family)
+{
+	struct domain *dom;
+
+	SLIST_FOREACH(dom, &domains, dom_next) {
+		if (dom->dom_family == family)
+			return (dom->dom_rtattach != NULL);
+	}
+	return (false);
+}
+
+/*
+ * Grows up the number of routing tables in the current vnet.
+ * Only the default fib tables are created, the others on first use.
  */
 static void
 grow_rtables(uint32_t num_tables)
 {
 	struct domain *dom;
-	struct rib_head **prnh, *rh;
-	struct rib_head **new_rt_tables, **old_rt_tables;
-	int family;
 
 	RTABLES_LOCK_ASSERT();
 
 	KASSERT(num_tables >= V_rt_numfibs, ("num_tables(%u) < rt_numfibs(%u)\n",
 				num_tables, V_rt_numfibs));
 
-	new_rt_tables = mallocarray(num_tables * (AF_MAX + 1), sizeof(void *),
-	    M_RTABLE, M_WAITOK | M_ZERO);
-
 #ifdef FIB_ALGO
 	fib_grow_rtables(num_tables);
 #endif
 
-	/*
-	 * Current rt_tables layout:
-	 * fib0[af0, af1, af2, .., AF_MAX]fib1[af0, af1, af2, .., Af_MAX]..
-	 * this allows to copy existing tables data by using memcpy()
-	 */
-	if (V_rt_tables != NULL)
-		memcpy(new_rt_tables, V_rt_tables,
-		    V_rt_numfibs * (AF_MAX + 1) * sizeof(void *));
-
-	/* Populate the remainders */
 	SLIST_FOREACH(dom, &domains, dom_next) {
-		if (dom->dom_rtattach == NULL)
-			continue;
-		family = dom->dom_family;
-		for (int i = 0; i < num_tables; i++) {
-			prnh = &new_rt_tables[i * (AF_MAX + 1) + family];
-			if (*prnh != NULL)
-				continue;
-			rh = dom->dom_rtattach(i);
-			if (rh == NULL)
-				log(LOG_ERR, "unable to create routing table for %d.%d\n",
-				    dom->dom_family, i);
-			else
-				populate_kernel_routes(new_rt_tables, rh);
-			*prnh = rh;
-		}
+		if (dom->dom_rtattach != NULL)
+			rtables_attach(RT_DEFAULT_FIB, dom);
 	}
 
-	/*
-	 * Update rtables pointer.
-	 * Ensure all writes to new_rt_tables has been completed before
-	 *  switching pointer.
-	 */
-	atomic_thread_fence_rel();
-	old_rt_tables = V_rt_tables;
-	V_rt_tables = new_rt_tables;
-
-	/* Wait till all cpus see new pointers */
+	/* Make the new fibs valid once the readers see their index */
 	atomic_thread_fence_rel();
-	NET_EPOCH_WAIT();
-
-	/* Set number of fibs to a new value */
 	V_rt_numfibs = num_tables;
 
 #ifdef FIB_ALGO
@@ -286,9 +388,6 @@ grow_rtables(uint32_t num_tables)
 			fib_setup_family(dom->dom_family, num_tables);
 	}
 #endif
-
-	if (old_rt_tables != NULL)
-		free(old_rt_tables, M_RTABLE);
 }
 
 static void
@@ -309,6 +408,8 @@ vnet_rtables_init(const void *unused __unused)
 #endif
 	RTABLES_LOCK_INIT();
 
+	V_rt_tables = mallocarray(RTABLES_NCHUNKS, sizeof(struct rtables_chunk *),
+	    M_RTABLE, M_WAITOK | M_ZERO);
 	RTABLES_LOCK();
 	grow_rtables(V_rt_numfibs);
 	RTABLES_UNLOCK();
@@ -331,7 +432,8 @@ rtables_destroy(const void *unused __unused)
 		family = dom->dom_family;
 		for (int i = 0; i < V_rt_numfibs; i++) {
 			rnh = rt_tables_get_rnh(i, family);
-			dom->dom_rtdetach(rnh);
+			if (rnh != NULL)
+				dom->dom_rtdetach(rnh);
 		}
 	}
 	RTABLES_UNLOCK();
@@ -346,6 +448,8 @@ rtables_destroy(const void *unused __unused)
 	 */
 	NET_EPOCH_DRAIN_CALLBACKS();
 
+	for (int i = 0; i < RTABLES_NCHUNKS; i++)
+		free(V_rt_tables[i], M_RTABLE);
 	free(V_rt_tables, M_RTABLE);
 	vnet_rtzone_destroy();
 #ifdef FIB_ALGO
@@ -367,12 +471,10 @@ rt_tables_get_rnh_ptr(uint32_t table, sa_family_t family)
 	KASSERT(family < (AF_MAX + 1),
 	    ("%s: fam out of bounds (%d < %d)", __func__, family, AF_MAX + 1));
 
-	/* rnh is [fib=0][af=0]. */
-	prnh = V_rt_tables;
-	/* Get the offset to the requested table and fam. */
-	prnh += table * (AF_MAX + 1) + family;
-
-	return (*prnh);
+	/* NULL until the table is instantiated */
+	if ((prnh = rt_tables_slot(table, family)) == NULL)
+		return (NULL);
+	return ((struct rib_head *)atomic_load_acq_ptr((uintptr_t *)prnh));
 }
 
 struct rib_head *
@@ -397,8 +499,9 @@ rt_tables_get_gen(uint32_t table, sa_family_t family)
 {
 	struct rib_head *rnh;
 
+	/* Tables not instantiated yet never changed */
 	rnh = rt_tables_get_rnh_ptr(table, family);
-	KASSERT(rnh != NULL, ("%s: NULL rib_head pointer table %d family %d",
-	    __func__, table, family));
+	if (rnh == NULL)
+		return (0);
 	return (rnh->rnh_gen);
 }
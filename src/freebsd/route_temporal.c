@@ -28,6 +28,18 @@
 /*
  * This file contains code responsible for expiring temporal routes
  * (typically, redirect-originated) from the route tables.
+ *
+ * Temporal routes are indexed by their expiration time in a hierarchical
+ * timer wheel: TMPR_WHEEL_LEVELS levels of TMPR_WHEEL_SIZE slots, level
+ * N slots spanning TMPR_WHEEL_SIZE^N seconds. Entries are cascaded to the
+ * lower level when the time reaches their slot, so each callout run only
+ * touches the routes due at that time. Entries store the prefix rather
+ * than the rtentry pointer and are checked against the current route
+ * when due, so route deletion or nexthop change does not need to update
+ * the wheel. The wheel is protected by the RIB write lock.
+ *
+ * If an entry cannot be allocated, the next run falls back to the full
+ * table walk.
  */
 
 #include <sys/param.h>
@@ -35,6 +47,8 @@
 #include <sys/socket.h>
 #include <sys/kernel.h>
 #include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/queue.h>
 #include <sys/ck.h>
 #include <sys/rmlock.h>
 #include <sys/callout.h>
@@ -45,6 +59,148 @@
 #include <net/route/route_var.h>
 #include <net/vnet.h>
 
+#define	TMPR_WHEEL_BITS		6
+#define	TMPR_WHEEL_SIZE		(1 << TMPR_WHEEL_BITS)
+#define	TMPR_WHEEL_MASK		(TMPR_WHEEL_SIZE - 1)
+#define	TMPR_WHEEL_LEVELS	4	/* 2^24 seconds span */
+#define	TMPR_WHEEL_SPAN		(1U << (TMPR_WHEEL_BITS * TMPR_WHEEL_LEVELS))
+
+union tmproute_sa {
+	struct sockaddr		sa;
+	struct sockaddr_in6	sin6;
+};
+
+struct tmproute {
+	TAILQ_ENTRY(tmproute)	tr_link;
+	uint32_t		tr_expire;	/* nhop_get_expire() value */
+	bool			tr_host;	/* no netmask */
+	union tmproute_sa	tr_dst;
+	union tmproute_sa	tr_mask;
+};
+TAILQ_HEAD(tmproute_list, tmproute);
+
+struct tmproutes_wheel {
+	struct tmproute_list	tw_slots[TMPR_WHEEL_LEVELS][TMPR_WHEEL_SIZE];
+	struct tmproute_list	tw_due;		/* entries being expired */
+	uint32_t		tw_now;		/* time the wheel is advanced to */
+	uint32_t		tw_count;	/* entries in the slots */
+	bool			tw_rescan;	/* walk the whole table next run */
+};
+
+/*
+ * Links @tr to the slot of the lowest level covering its expire time,
+ * or to the due list if it has expired already.
+ * Entries beyond the wheel span are parked at the last level and
+ * re-inserted when due.
+ */
+static void
+tmproutes_insert(struct tmproutes_wheel *tw, struct tmproute *tr)
+{
+	uint32_t expire, delta;
+	int level;
+
+	expire = tr->tr_expire;
+	if (expire <= tw->tw_now) {
+		TAILQ_INSERT_TAIL(&tw->tw_due, tr, tr_link);
+		return;
+	}
+	delta = expire - tw->tw_now;
+	if (delta >= TMPR_WHEEL_SPAN) {
+		delta = TMPR_WHEEL_SPAN - 1;
+		expire = tw->tw_now + delta;
+	}
+
+	for (level = 0; level < TMPR_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1U << (TMPR_WHEEL_BITS * (level + 1))))
+			break;
+	}
+	TAILQ_INSERT_TAIL(&tw->tw_slots[level][(expire >> (TMPR_WHEEL_BITS * level)) &
+	    TMPR_WHEEL_MASK], tr, tr_link);
+	tw->tw_count++;
+}
+
+/* Re-inserts the entries of @level slot @idx relative to the current time */
+static void
+tmproutes_cascade(struct tmproutes_wheel *tw, int level, int idx)
+{
+	struct tmproute_list list;
+	struct tmproute *tr;
+
+	TAILQ_INIT(&list);
+	TAILQ_CONCAT(&list, &tw->tw_slots[level][idx], tr_link);
+	while ((tr = TAILQ_FIRST(&list)) != NULL) {
+		TAILQ_REMOVE(&list, tr, tr_link);
+		tw->tw_count--;
+		tmproutes_insert(tw, tr);
+	}
+}
+
+/*
+ * Advances the wheel to @now, moving the expired entries to tw_due.
+ */
+static void
+tmproutes_advance(struct tmproutes_wheel *tw, uint32_t now)
+{
+	struct tmproute *tr;
+	int idx, level;
+
+	if (now - tw->tw_now > TMPR_WHEEL_SIZE) {
+		/* Fell far behind, re-insert everything instead of stepping */
+		tw->tw_now = now;
+		for (level = 0; level < TMPR_WHEEL_LEVELS; level++) {
+			for (idx = 0; idx < TMPR_WHEEL_SIZE; idx++)
+				tmproutes_cascade(tw, level, idx);
+		}
+	}
+
+	while (tw->tw_now != now) {
+		tw->tw_now++;
+		for (level = 1; level < TMPR_WHEEL_LEVELS; level++) {
+			if ((tw->tw_now & ((1U << (TMPR_WHEEL_BITS * level)) - 1)) != 0)
+				break;
+			tmproutes_cascade(tw, level,
+			    (tw->tw_now >> (TMPR_WHEEL_BITS * level)) & TMPR_WHEEL_MASK);
+		}
+
+		idx = tw->tw_now & TMPR_WHEEL_MASK;
+		while ((tr = TAILQ_FIRST(&tw->tw_slots[0][idx])) != NULL) {
+			TAILQ_REMOVE(&tw->tw_slots[0][idx], tr, tr_link);
+			tw->tw_count--;
+			/* Moves to tw_due unless parked beyond the wheel span */
+			tmproutes_insert(tw, tr);
+		}
+	}
+}
+
+/*
+ * Returns the time the wheel needs to be advanced at next, or 0 if
+ * it is empty.
+ */
+static uint32_t
+tmproutes_next(const struct tmproutes_wheel *tw)
+{
+	uint32_t next = 0, base, t;
+	int level, shift;
+
+	if (tw->tw_count == 0)
+		return (0);
+
+	for (level = 0; level < TMPR_WHEEL_LEVELS; level++) {
+		shift = TMPR_WHEEL_BITS * level;
+		base = tw->tw_now >> shift;
+		for (int i = 1; i <= TMPR_WHEEL_SIZE; i++) {
+			if (TAILQ_EMPTY(&tw->tw_slots[level][(base + i) & TMPR_WHEEL_MASK]))
+				continue;
+			t = (base + i) << shift;
+			if (next == 0 || t < next)
+				next = t;
+			break;
+		}
+	}
+
+	return (next);
+}
+
 /*
  * Callback returning 1 for the expired routes.
  * Updates time of the next nearest route expiration as a side effect.
@@ -74,26 +230,80 @@ expire_route(const struct rtentry *rt, const struct nhop_object *nh, void *arg)
 }
 
 /*
- * Per-rnh callout function traversing the tree and deleting
- * expired routes. Calculates next callout run by looking at
- * the nh_expire time for the remaining temporal routes.
+ * rib_walk_del_list() iterator returning the rtentries of the due
+ * entries. Entries for prefixes no longer in the table are dropped,
+ * routes with a later expire time got their own entry on update.
+ */
+static struct rtentry *
+expire_next(struct rib_head *rnh, void *arg)
+{
+	struct tmproutes_wheel *tw = rnh->tmproutes;
+	struct route_nhop_data rnd;
+	struct rt_addrinfo info;
+	struct tmproute *tr;
+	struct rtentry *rt;
+
+	while ((tr = TAILQ_FIRST(&tw->tw_due)) != NULL) {
+		TAILQ_REMOVE(&tw->tw_due, tr, tr_link);
+
+		bzero(&info, sizeof(info));
+		info.rti_info[RTAX_DST] = &tr->tr_dst.sa;
+		if (!tr->tr_host)
+			info.rti_info[RTAX_NETMASK] = &tr->tr_mask.sa;
+		rt = lookup_prefix(rnh, &info, &rnd);
+		free(tr, M_RTABLE);
+		if (rt != NULL)
+			return (rt);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Per-rnh callout function deleting the expired routes. Only the
+ * routes due according to the wheel are checked, unless an entry
+ * allocation failed and the tree has to be traversed.
+ * Calculates next callout run from the wheel.
  */
 static void
 expire_callout(void *arg)
 {
 	struct rib_head *rnh;
+	struct tmproutes_wheel *tw;
 	time_t next_expire;
+	uint32_t next;
+	bool rescan, due;
 	int seconds;
 
 	rnh = (struct rib_head *)arg;
+	tw = rnh->tmproutes;
 
 	CURVNET_SET(rnh->rib_vnet);
 	next_expire = 0;
 
-	rib_walk_del(rnh->rib_fibnum, rnh->rib_family, expire_route,
-	    (void *)&next_expire, 1);
+	RIB_WLOCK(rnh);
+	rescan = tw->tw_rescan;
+	tw->tw_rescan = false;
+	tmproutes_advance(tw, time_uptime);
+	due = !TAILQ_EMPTY(&tw->tw_due);
+	RIB_WUNLOCK(rnh);
+
+	if (rescan)
+		rib_walk_del(rnh->rib_fibnum, rnh->rib_family, expire_route,
+		    (void *)&next_expire, 1);
+	if (due) {
+		time_t unused = 0;
+
+		/* Routes updated to a later time got their own entry */
+		rib_walk_del_list(rnh, expire_next, NULL, expire_route,
+		    (void *)&unused, 1);
+	}
 
 	RIB_WLOCK(rnh);
+	if ((next = tmproutes_next(tw)) != 0) {
+		if (next_expire == 0 || next_expire > next)
+			next_expire = next;
+	}
 	if (next_expire > 0) {
 		seconds = (next_expire - time_uptime);
 		if (seconds < 0)
@@ -113,6 +323,36 @@ expire_callout(void *arg)
 	CURVNET_RESTORE();
 }
 
+/*
+ * Adds @rt expiration to the wheel. On failure, makes the next
+ * callout run traverse the whole table.
+ */
+static void
+tmproutes_add(struct rib_head *rnh, struct rtentry *rt, uint32_t nh_expire)
+{
+	struct tmproutes_wheel *tw = rnh->tmproutes;
+	const struct sockaddr *dst = rt_key_const(rt);
+	const struct sockaddr *mask = rt_mask_const(rt);
+	struct tmproute *tr;
+
+	if (dst->sa_len > sizeof(tr->tr_dst) ||
+	    (mask != NULL && mask->sa_len > sizeof(tr->tr_mask)) ||
+	    (tr = malloc(sizeof(*tr), M_RTABLE, M_NOWAIT | M_ZERO)) == NULL) {
+		tw->tw_rescan = true;
+		return;
+	}
+	tr->tr_expire = nh_expire;
+	bcopy(dst, &tr->tr_dst, dst->sa_len);
+	if (mask != NULL)
+		bcopy(mask, &tr->tr_mask, mask->sa_len);
+	else
+		tr->tr_host = true;
+
+	if (tw->tw_count == 0 && TAILQ_EMPTY(&tw->tw_due))
+		tw->tw_now = time_uptime;
+	tmproutes_insert(tw, tr);
+}
+
 /*
  * Function responsible for updating the time of the next calllout
  * w.r.t. new temporal routes insertion.
@@ -128,6 +368,8 @@ tmproutes_update(struct rib_head *rnh, struct rtentry *rt, struct nhop_object *n
 
 	RIB_WLOCK_ASSERT(rnh);
 
+	tmproutes_add(rnh, rt, nh_expire);
+
 	if (rnh->next_expire == 0 || rnh->next_expire > nh_expire) {
 		/*
 		 * Callback is not scheduled, is executing,
@@ -148,13 +390,42 @@ tmproutes_update(struct rib_head *rnh, struct rtentry *rt, struct nhop_object *n
 void
 tmproutes_init(struct rib_head *rh)
 {
+	struct tmproutes_wheel *tw;
 
 	callout_init(&rh->expire_callout, 1);
+
+	tw = malloc(sizeof(*tw), M_RTABLE, M_WAITOK | M_ZERO);
+	for (int level = 0; level < TMPR_WHEEL_LEVELS; level++) {
+		for (int i = 0; i < TMPR_WHEEL_SIZE; i++)
+			TAILQ_INIT(&tw->tw_slots[level][i]);
+	}
+	TAILQ_INIT(&tw->tw_due);
+	rh->tmproutes = tw;
+}
+
+static void
+tmproutes_free_list(struct tmproute_list *list)
+{
+	struct tmproute *tr;
+
+	while ((tr = TAILQ_FIRST(list)) != NULL) {
+		TAILQ_REMOVE(list, tr, tr_link);
+		free(tr, M_RTABLE);
+	}
 }
 
 void
 tmproutes_destroy(struct rib_head *rh)
 {
+	struct tmproutes_wheel *tw = rh->tmproutes;
 
 	callout_drain(&rh->expire_callout);
+
+	for (int level = 0; level < TMPR_WHEEL_LEVELS; level++) {
+		for (int i = 0; i < TMPR_WHEEL_SIZE; i++)
+			tmproutes_free_list(&tw->tw_slots[level][i]);
+	}
+	tmproutes_free_list(&tw->tw_due);
+	free(tw, M_RTABLE);
+	rh->tmproutes = NULL;
 }
@@ -40,6 +40,8 @@
 #include <net/route/nhop.h>
 
 struct nh_control;
+struct tmproutes_wheel;
+struct rib_async;
 /* Sets prefix-specific nexthop flags (NHF_DEFAULT, RTF/NHF_HOST, RTF_BROADCAST,..) */
 typedef int rnh_set_nh_pfxflags_f_t(u_int fibnum, const struct sockaddr *addr,
 	const struct sockaddr *mask, struct nhop_object *nh);
@@ -65,14 +67,19 @@ struct rib_head {
 	u_int			rib_fibnum;	/* fib number */
 	struct callout		expire_callout;	/* Callout for expiring dynamic routes */
 	time_t			next_expire;	/* Next expire run ts */
+	struct tmproutes_wheel	*tmproutes;	/* Temporal routes by expire time */
 	uint32_t		rnh_prefixes;	/* Number of prefixes */
 	rt_gen_t		rnh_gen_rib;	/* fib algo: rib generation counter */
 	uint32_t		rib_dying:1;	/* rib is detaching */
 	uint32_t		rib_algo_fixed:1;/* fixed algorithm */
 	uint32_t		rib_algo_init:1;/* algo init done */
+	uint32_t		rib_batch:1;	/* batched update in progress */
+	uint32_t		rib_batch_dirty:1;/* gen bump pending for the batch */
+	uint32_t		rib_batch_kick:1;/* async records queued by the batch */
 	struct nh_control	*nh_control;	/* nexthop subsystem data */
 	rnh_augment_nh_f_t	*rnh_augment_nh;/* hook to alter nexthop prior to insertion */
 	CK_STAILQ_HEAD(, rib_subscription)	rnh_subscribers;/* notification subscribers */
+	struct rib_async	*rib_async;	/* async subscriptions dispatcher */
 };
 
 #define	RIB_RLOCK_TRACKER	struct rm_priotracker _rib_tracker
@@ -117,6 +124,11 @@ _Static_assert(__offsetof(struct route, ro_dst) == __offsetof(_ro_new, _dst_new)
 static inline void
 rib_bump_gen(struct rib_head *rnh)
 {
+	/* Batched updates bump the generation once, at the end of the batch */
+	if (rnh->rib_batch) {
+		rnh->rib_batch_dirty = 1;
+		return;
+	}
 #ifdef FIB_ALGO
 	rnh->rnh_gen_rib++;
 #else
@@ -125,6 +137,9 @@ rib_bump_gen(struct rib_head *rnh)
 }
 
 struct rib_head *rt_tables_get_rnh(uint32_t table, sa_family_t family);
+struct rib_head *rt_tables_get_rnh_create(uint32_t table, sa_family_t family);
+void rt_tables_instantiate(uint32_t table);
+bool rt_tables_has_family(sa_family_t family);
 int rt_getifa_fib(struct rt_addrinfo *info, u_int fibnum);
 struct rib_cmd_info;
 
@@ -222,6 +237,11 @@ struct rtentry *lookup_prefix_rt(struct rib_head *rnh, const struct rtentry *rt,
 int rib_copy_route(struct rtentry *rt, const struct route_nhop_data *rnd_src,
     struct rib_head *rh_dst, struct rib_cmd_info *rc);
 
+/* Returns the next rtentry to check, called with RIB_WLOCK held */
+typedef struct rtentry *rib_next_f_t(struct rib_head *rnh, void *arg);
+void rib_walk_del_list(struct rib_head *rnh, rib_next_f_t *next_f, void *next_arg,
+    rib_filter_f_t *filter_f, void *filter_arg, bool report);
+
 bool nhop_can_multipath(const struct nhop_object *nh);
 bool match_nhop_gw(const struct nhop_object *nh, const struct sockaddr *gw);
 int check_info_match_nhop(const struct rt_addrinfo *info,
@@ -239,6 +259,7 @@ struct rtentry *rt_alloc(struct rib_head *rnh, const struct sockaddr *dst,
 /* subscriptions */
 void rib_init_subscriptions(struct rib_head *rnh);
 void rib_destroy_subscriptions(struct rib_head *rnh);
+void rib_notify_batch_end(struct rib_head *rnh);
 
 /* route_ifaddrs.c */
 void rib_copy_kernel_routes(struct rib_head *rh_src, struct rib_head *rh_dst);
@@ -262,10 +283,12 @@ int nhop_create_from_nhop(struct rib_head *rnh, const struct nhop_object *nh_ori
     struct rt_addrinfo *info, struct nhop_object **pnh_priv);
 
 void nhops_update_ifmtu(struct rib_head *rh, struct ifnet *ifp, uint32_t mtu);
+bool nhops_ifp_used(struct rib_head *rh, const struct ifnet *ifp);
 int nhops_dump_sysctl(struct rib_head *rh, struct sysctl_req *w);
 
 /* MULTIPATH */
 #define	MPF_MULTIPATH	0x08	/* need to be consistent with NHF_MULTIPATH */
+#define	MPF_RESILIENT	0x8000	/* resilient group, not used by NHF_ */
 
 struct nhgrp_object {
 	uint16_t		nhg_flags;	/* nexthop group flags */
@@ -274,6 +297,8 @@ struct nhgrp_object {
 	struct nhop_object	*nhops[0];	/* nhops */
 };
 
+void nhgrp_res_touch(struct nhgrp_object *nhg, uint32_t slot);
+
 static inline struct nhop_object *
 nhop_select(struct nhop_object *nh, uint32_t flowid)
 {
@@ -281,7 +306,11 @@ nhop_select(struct nhop_object *nh, uint32_t flowid)
 #ifdef ROUTE_MPATH
 	if (NH_IS_NHGRP(nh)) {
 		struct nhgrp_object *nhg = (struct nhgrp_object *)nh;
-		nh = nhg->nhops[flowid % nhg->nhg_size];
+		uint32_t slot = flowid % nhg->nhg_size;
+
+		if (__predict_false(nhg->nhg_flags & MPF_RESILIENT))
+			nhgrp_res_touch(nhg, slot);
+		nh = nhg->nhops[slot];
 	}
 #endif
 	return (nh);
@@ -314,6 +343,8 @@ int nhgrp_get_addition_group(struct rib_head *rnh,
 void nhgrp_ref_object(struct nhgrp_object *nhg);
 uint32_t nhgrp_get_idx(const struct nhgrp_object *nhg);
 void nhgrp_free(struct nhgrp_object *nhg);
+void nhgrp_res_init(struct nh_control *ctl);
+void nhgrp_res_destroy(struct nh_control *ctl);
 
 /* rtsock */
 int rtsock_routemsg(int cmd, struct rtentry *rt, struct nhop_object *nh,
@@ -326,6 +357,7 @@ int rtsock_addrmsg(int cmd, struct ifaddr *ifa, int fibnum);
 void fib_grow_rtables(uint32_t new_num_tables);
 void fib_setup_family(int family, uint32_t num_tables);
 void fib_destroy_rib(struct rib_head *rh);
+void fib_rib_batch_end(struct rib_head *rh);
 void vnet_fib_init(void);
 void vnet_fib_destroy(void);
 
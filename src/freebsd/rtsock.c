@@ -37,6 +37,8 @@
 #include <sys/jail.h>
 #include <sys/kernel.h>
 #include <sys/eventhandler.h>
+#include <sys/callout.h>
+#include <sys/hash.h>
 #include <sys/domain.h>
 #include <sys/lock.h>
 #include <sys/malloc.h>
@@ -136,6 +138,19 @@ struct linear_buffer {
 };
 #define	SCRATCH_BUFFER_SIZE	1024
 
+/* Output of the compact TLV encoding */
+struct rtt_buf {
+	char		*rb_base;
+	int		rb_size;
+	int		rb_off;
+	int		rb_msg;		/* start of the open message */
+	bool		rb_full;	/* the open message does not fit */
+	bool		rb_delta;	/* RTT_F_DELTA */
+	sa_family_t	rb_prev_family;	/* previous prefix */
+	u_char		rb_prev[16];
+};
+#define	RTT_MSG_MAX	128		/* route or nexthop message */
+
 #define	RTS_PID_LOG(_l, _fmt, ...)					\
 	RT_LOG_##_l(_l, "PID %d: " _fmt, curproc ? curproc->p_pid : 0,	\
 	    ## __VA_ARGS__)
@@ -163,6 +178,7 @@ struct rcb {
 	LIST_ENTRY(rcb) list;
 	struct socket	*rcb_socket;
 	sa_family_t	rcb_family;
+	bool		rcb_tlv;	/* ROUTE_TLV notifications */
 };
 
 typedef struct {
@@ -191,6 +207,23 @@ struct walkarg {
 	struct sysctl_req *w_req;
 	struct sockaddr *dst;
 	struct sockaddr *mask;
+	caddr_t	w_arena;		/* route dump output batch */
+	int	w_arena_size;
+	int	w_arena_off;		/* bytes used */
+	int	w_route_off;		/* offset of the current route */
+	bool	w_chunk;		/* stop when the arena is full */
+	bool	w_full;			/* stopped at a route not fitting */
+	int	w_cursor_plen;		/* skip routes up to the cursor, -1 if unset */
+	union {
+		struct in_addr	addr4;
+		struct in6_addr	addr6;
+	} w_cursor;
+	uint32_t w_count;		/* routes dumped */
+	uint32_t w_fibnum;
+	int	w_error;		/* error stopping the walk */
+	struct rtt_buf w_rtt;		/* NET_RT_DUMPT output */
+	uint32_t *w_seen;		/* nexthops and groups sent */
+	u_int	w_seen_size;		/* bits */
 };
 
 static void	rts_input(struct mbuf *m);
@@ -219,6 +252,13 @@ static void	send_rtm_reply(struct socket *so, struct rt_msghdr *rtm,
 			int rtm_errno);
 static void	rtsock_notify_event(uint32_t fibnum, const struct rib_cmd_info *rc);
 static void	rtsock_ifmsg(struct ifnet *ifp, int if_flags_mask);
+static void	rts_coalesce_init(void);
+#ifdef VIMAGE
+static void	rts_coalesce_destroy(void);
+#endif
+static bool	rts_coalesce_route(struct mbuf *m, uint32_t fibnum,
+			sa_family_t family);
+static struct mbuf *rtsock_msg_tlv(struct mbuf *m);
 
 static struct netisr_handler rtsock_nh = {
 	.nh_name = "rtsock",
@@ -259,6 +299,7 @@ vnet_rts_init(void)
 	 else
 		netisr_register_vnet(&rtsock_nh);
 #endif
+	rts_coalesce_init();
 }
 VNET_SYSINIT(vnet_rtsock, SI_SUB_PROTO_DOMAIN, SI_ORDER_THIRD,
     vnet_rts_init, NULL);
@@ -268,6 +309,7 @@ static void
 vnet_rts_uninit(void)
 {
 
+	rts_coalesce_destroy();
 	netisr_unregister_vnet(&rtsock_nh);
 }
 VNET_SYSUNINIT(vnet_rts_uninit, SI_SUB_PROTO_DOMAIN, SI_ORDER_THIRD,
@@ -346,6 +388,8 @@ rts_input(struct mbuf *m)
 {
 	struct rcb *rcb;
 	struct socket *last;
+	struct mbuf *t = NULL;
+	bool t_done = false;
 
 	last = NULL;
 	RTSOCK_LOCK();
@@ -356,6 +400,21 @@ rts_input(struct mbuf *m)
 		if ((m->m_flags & RTS_FILTER_FIB) &&
 		    M_GETFIB(m) != rcb->rcb_socket->so_fibnum)
 			continue;
+		if (rcb->rcb_tlv) {
+			/* Encoded once for all the TLV listeners */
+			if (!t_done) {
+				t = rtsock_msg_tlv(m);
+				t_done = true;
+			}
+			if (t != NULL) {
+				struct mbuf *n;
+
+				n = m_copym(t, 0, M_COPYALL, M_NOWAIT);
+				if (n != NULL)
+					rts_append_data(rcb->rcb_socket, n);
+				continue;
+			}
+		}
 		if (last != NULL) {
 			struct mbuf *n;
 
@@ -370,6 +429,8 @@ rts_input(struct mbuf *m)
 	else
 		m_freem(m);
 	RTSOCK_UNLOCK();
+	if (t != NULL)
+		m_freem(t);
 }
 
 static void
@@ -387,6 +448,12 @@ SYSCTL_ULONG(_net_rtsock, OID_AUTO, sendspace, CTLFLAG_RW, &rts_sendspace, 0,
 static u_long rts_recvspace = 8192;
 SYSCTL_ULONG(_net_rtsock, OID_AUTO, recvspace, CTLFLAG_RW, &rts_recvspace, 0,
     "Default routing socket receive space");
+static u_long rts_dump_arena = 256 * 1024;
+SYSCTL_ULONG(_net_rtsock, OID_AUTO, dump_arena, CTLFLAG_RW, &rts_dump_arena, 0,
+    "Route dump output batch size");
+static u_long rts_dump_chunk_max = 16 * 1024 * 1024;
+SYSCTL_ULONG(_net_rtsock, OID_AUTO, dump_chunk_max, CTLFLAG_RW,
+    &rts_dump_chunk_max, 0, "Maximum reply size of a resumable route dump");
 
 static int
 rts_attach(struct socket *so, int proto, struct thread *td)
@@ -401,6 +468,7 @@ rts_attach(struct socket *so, int proto, struct thread *td)
 	rcb = malloc(sizeof(*rcb), M_PCB, M_WAITOK);
 	rcb->rcb_socket = so;
 	rcb->rcb_family = proto;
+	rcb->rcb_tlv = false;
 
 	so->so_pcb = rcb;
 	so->so_fibnum = td->td_proc->p_fibnum;
@@ -442,6 +510,19 @@ rts_ctloutput(struct socket *so, struct sockopt *sopt)
 				break;
 			}
 			break;
+		case PF_ROUTE:
+			switch (sopt->sopt_name) {
+			case ROUTE_TLV:
+				error = sooptcopyin(sopt, &optval,
+				    sizeof(optval), sizeof(optval));
+				if (error != 0)
+					break;
+				RTSOCK_LOCK();
+				((struct rcb *)so->so_pcb)->rcb_tlv = optval != 0;
+				RTSOCK_UNLOCK();
+				break;
+			}
+			break;
 		}
 	}
 	return (error);
@@ -1053,6 +1134,165 @@ alloc_sockaddr_aligned(struct linear_buffer *lb, int len)
 }
 #endif
 
+/* Records of a RTM_BATCH message applied under a single rib lock hold */
+#define	RTS_BATCH_MAX	256
+
+struct rts_batch {
+	struct rt_addrinfo	info[RTS_BATCH_MAX];
+	struct rib_cmd_info	rc[RTS_BATCH_MAX];
+	union sockaddr_union	gw[RTS_BATCH_MAX];	/* blackhole gateways */
+	int			errors[RTS_BATCH_MAX];
+	int			idx[RTS_BATCH_MAX];	/* record number */
+	char			scratch[RTS_BATCH_MAX][SCRATCH_BUFFER_SIZE];
+};
+
+static void
+rts_batch_flush(struct rts_batch *b, int num, int type, u_int fibnum,
+    int *errors)
+{
+
+	if (num == 0)
+		return;
+	if (type == RTM_ADD)
+		rib_add_routes_batch(fibnum, b->info, num, b->rc, b->errors);
+	else
+		rib_del_routes_batch(fibnum, b->info, num, b->rc, b->errors);
+	for (int i = 0; i < num; i++) {
+		errors[b->idx[i]] = b->errors[i];
+		if (b->errors[i] == 0)
+			rtsock_notify_event(fibnum, &b->rc[i]);
+	}
+}
+
+/*
+ * Creates the @family table of @fibnum ahead of an RTM_ADD, tables
+ * other than the default fib ones being created on first use. This may
+ * sleep, so the epoch section @et of the caller is left meanwhile:
+ * nothing obtained within it may be used across the call.
+ */
+static void
+rts_instantiate_table(u_int fibnum, sa_family_t family,
+    struct epoch_tracker *et)
+{
+
+	if (rt_tables_get_rnh_safe(fibnum, family) != NULL ||
+	    !rt_tables_has_family(family))
+		return;
+	NET_EPOCH_EXIT(*et);
+	rt_tables_get_rnh_create(fibnum, family);
+	NET_EPOCH_ENTER(*et);
+}
+
+/*
+ * Handles RTM_BATCH message @rtm of @len bytes: consecutive RTM_ADD or
+ *  RTM_DELETE records for the same family are applied together by
+ *  rib_add_routes_batch() and rib_del_routes_batch(), avoiding the
+ *  per-message lock, generation bump and algo update.
+ *
+ * Replaces @rtm with the reply, the header and an errno per record.
+ * Returns 0 if all records were applied or the first error otherwise.
+ */
+static int
+handle_rtm_batch(struct rt_msghdr **prtm, int len, u_int fibnum,
+    struct epoch_tracker *et)
+{
+	struct rt_msghdr *rtm = *prtm, *r, *reply;
+	struct rts_batch *b;
+	struct sockaddr *dst;
+	int error, *errors, nrec = 0, num = 0, type = 0, off;
+	sa_family_t family = AF_UNSPEC;
+
+	for (off = sizeof(*rtm); off < len; off += r->rtm_msglen) {
+		r = (struct rt_msghdr *)((char *)rtm + off);
+		if (len - off < sizeof(*r) || r->rtm_msglen < sizeof(*r) ||
+		    r->rtm_msglen > len - off ||
+		    (r->rtm_msglen % sizeof(long)) != 0)
+			return (EINVAL);
+		if (r->rtm_version != RTM_VERSION)
+			return (EPROTONOSUPPORT);
+		nrec++;
+	}
+	if (nrec == 0)
+		return (EINVAL);
+	if ((error = priv_check(curthread, PRIV_NET_ROUTE)) != 0)
+		return (error);
+
+	reply = malloc(sizeof(*rtm) + nrec * sizeof(int), M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (reply == NULL)
+		return (ENOBUFS);
+	b = malloc(sizeof(*b), M_TEMP, M_NOWAIT);
+	if (b == NULL) {
+		free(reply, M_TEMP);
+		return (ENOBUFS);
+	}
+	errors = (int *)(reply + 1);
+
+	r = (struct rt_msghdr *)(rtm + 1);
+	for (int i = 0; i < nrec; i++,
+	    r = (struct rt_msghdr *)((char *)r + r->rtm_msglen)) {
+		if ((r->rtm_type != RTM_ADD && r->rtm_type != RTM_DELETE) ||
+		    (r->rtm_flags & RTF_LLDATA)) {
+			errors[i] = EOPNOTSUPP;
+			continue;
+		}
+		if (!(r->rtm_addrs & RTA_DST)) {
+			errors[i] = EINVAL;
+			continue;
+		}
+
+		/* Batch functions take a single family */
+		dst = (struct sockaddr *)(r + 1);
+		if (r->rtm_type == RTM_ADD)
+			rts_instantiate_table(fibnum, dst->sa_family, et);
+		if (num == RTS_BATCH_MAX || (num > 0 &&
+		    (r->rtm_type != type || dst->sa_family != family))) {
+			rts_batch_flush(b, num, type, fibnum, errors);
+			num = 0;
+		}
+		type = r->rtm_type;
+		family = dst->sa_family;
+
+		struct linear_buffer lb = {
+			.base = b->scratch[num],
+			.size = SCRATCH_BUFFER_SIZE,
+		};
+		struct rt_addrinfo *info = &b->info[num];
+
+		bzero(info, sizeof(*info));
+		error = fill_addrinfo(r, r->rtm_msglen, &lb, fibnum, info);
+		if (error == 0 && (r->rtm_flags & (RTF_BLACKHOLE|RTF_REJECT))) {
+			if ((r->rtm_flags & (RTF_BLACKHOLE|RTF_REJECT)) !=
+			    (RTF_BLACKHOLE|RTF_REJECT))
+				error = fill_blackholeinfo(info, &b->gw[num]);
+			else
+				error = EINVAL;
+		}
+		if (error == 0 && type == RTM_ADD &&
+		    info->rti_info[RTAX_GATEWAY] == NULL)
+			error = EINVAL;
+		if (error != 0) {
+			errors[i] = error;
+			continue;
+		}
+		b->idx[num++] = i;
+	}
+	rts_batch_flush(b, num, type, fibnum, errors);
+	free(b, M_TEMP);
+
+	error = 0;
+	for (int i = 0; i < nrec && error == 0; i++)
+		error = errors[i];
+
+	*reply = *rtm;
+	reply->rtm_msglen = sizeof(*rtm) + nrec * sizeof(int);
+	reply->rtm_pid = curproc->p_pid;
+	free(rtm, M_TEMP);
+	*prtm = reply;
+
+	return (error);
+}
+
 static int
 rts_send(struct socket *so, int flags, struct mbuf *m,
     struct sockaddr *nam, struct mbuf *control, struct thread *td)
@@ -1121,6 +1361,11 @@ rts_send(struct socket *so, int flags, struct mbuf *m,
 	 * caller PID and error value.
 	 */
 
+	if (rtm->rtm_type == RTM_BATCH) {
+		error = handle_rtm_batch(&rtm, len, fibnum, &et);
+		goto flush;
+	}
+
 	if ((error = fill_addrinfo(rtm, len, &lb, fibnum, &info)) != 0) {
 		senderr(error);
 	}
@@ -1158,6 +1403,7 @@ rts_send(struct socket *so, int flags, struct mbuf *m,
 				RTS_PID_LOG(LOG_DEBUG, "RTM_ADD w/o gateway");
 				senderr(EINVAL);
 			}
+			rts_instantiate_table(fibnum, saf, &et);
 		}
 		error = rib_action(fibnum, rtm->rtm_type, &info, &rc);
 		if (error == 0) {
@@ -2030,6 +2276,286 @@ rtsock_addrmsg(int cmd, struct ifaddr *ifa, int fibnum)
 	return (0);
 }
 
+/*
+ * Route notification coalescing.
+ *
+ * With net.rtsock.coalesce_ms set, route changes past coalesce_thresh in
+ *  a window are queued instead of dispatched. The queue holds the latest
+ *  message per fib and route addresses, in order of the first change,
+ *  and is flushed at the end of the window as RTM_BATCH messages, one per
+ *  fib and family. Past coalesce_max queued routes the queue is dropped
+ *  and listeners get a single RTM_RESYNC telling them to dump the table.
+ */
+#define	RTS_COALESCE_HASH	1024
+#define	RTS_COALESCE_MSGLEN	256		/* larger messages are sent as is */
+#define	RTS_COALESCE_BATCH	(32 * 1024)	/* RTM_BATCH length limit */
+
+static u_int rts_coalesce_ms = 0;
+SYSCTL_UINT(_net_rtsock, OID_AUTO, coalesce_ms, CTLFLAG_RW,
+    &rts_coalesce_ms, 0,
+    "Route notification coalescing window, 0 to send them as they happen");
+static u_int rts_coalesce_thresh = 64;
+SYSCTL_UINT(_net_rtsock, OID_AUTO, coalesce_thresh, CTLFLAG_RW,
+    &rts_coalesce_thresh, 0,
+    "Route notifications per window sent before coalescing starts");
+static u_int rts_coalesce_max = 65536;
+SYSCTL_UINT(_net_rtsock, OID_AUTO, coalesce_max, CTLFLAG_RW,
+    &rts_coalesce_max, 0,
+    "Queued route notifications before listeners are asked to resync");
+
+struct rts_pending {
+	TAILQ_ENTRY(rts_pending)	rp_link;	/* order of first change */
+	LIST_ENTRY(rts_pending)		rp_hash;
+	uint32_t			rp_fibnum;
+	uint32_t			rp_hashval;
+	sa_family_t			rp_family;
+	struct rt_msghdr		rp_msg;		/* followed by addresses */
+};
+TAILQ_HEAD(rts_pending_queue, rts_pending);
+
+struct rts_coalesce {
+	struct mtx			rc_mtx;
+	struct callout			rc_callout;
+	struct vnet			*rc_vnet;
+	struct rts_pending_queue	rc_queue;
+	LIST_HEAD(, rts_pending)	*rc_hash;
+	u_int				rc_count;	/* queued routes */
+	u_int				rc_window;	/* changes in the window */
+	int				rc_window_start;/* ticks */
+	bool				rc_overflow;	/* resync pending */
+	bool				rc_scheduled;
+};
+VNET_DEFINE_STATIC(struct rts_coalesce, rts_coalesce);
+#define	V_rts_coalesce	VNET(rts_coalesce)
+
+static void
+rts_coalesce_init(void)
+{
+	struct rts_coalesce *rc = &V_rts_coalesce;
+
+	mtx_init(&rc->rc_mtx, "rtsock coalesce", NULL, MTX_DEF);
+	callout_init(&rc->rc_callout, 1);
+	rc->rc_vnet = curvnet;
+	TAILQ_INIT(&rc->rc_queue);
+	rc->rc_hash = malloc(RTS_COALESCE_HASH * sizeof(*rc->rc_hash),
+	    M_RTABLE, M_WAITOK | M_ZERO);
+}
+
+/* Unlinks the queue of @rc into @queue */
+static void
+rts_coalesce_take(struct rts_coalesce *rc, struct rts_pending_queue *queue)
+{
+
+	mtx_assert(&rc->rc_mtx, MA_OWNED);
+
+	TAILQ_CONCAT(queue, &rc->rc_queue, rp_link);
+	bzero(rc->rc_hash, RTS_COALESCE_HASH * sizeof(*rc->rc_hash));
+	rc->rc_count = 0;
+}
+
+static void
+rts_coalesce_free(struct rts_pending_queue *queue)
+{
+	struct rts_pending *rp;
+
+	while ((rp = TAILQ_FIRST(queue)) != NULL) {
+		TAILQ_REMOVE(queue, rp, rp_link);
+		free(rp, M_RTABLE);
+	}
+}
+
+#ifdef VIMAGE
+static void
+rts_coalesce_destroy(void)
+{
+	struct rts_coalesce *rc = &V_rts_coalesce;
+	struct rts_pending_queue queue = TAILQ_HEAD_INITIALIZER(queue);
+
+	callout_drain(&rc->rc_callout);
+	mtx_lock(&rc->rc_mtx);
+	rts_coalesce_take(rc, &queue);
+	mtx_unlock(&rc->rc_mtx);
+	rts_coalesce_free(&queue);
+	free(rc->rc_hash, M_RTABLE);
+	mtx_destroy(&rc->rc_mtx);
+}
+#endif
+
+static void
+rts_send_resync(void)
+{
+	struct rt_msghdr *rtm;
+	struct mbuf *m;
+
+	if ((m = m_gethdr(M_NOWAIT, MT_DATA)) == NULL)
+		return;
+	m->m_pkthdr.len = m->m_len = sizeof(*rtm);
+	rtm = mtod(m, struct rt_msghdr *);
+	bzero(rtm, sizeof(*rtm));
+	rtm->rtm_msglen = sizeof(*rtm);
+	rtm->rtm_version = RTM_VERSION;
+	rtm->rtm_type = RTM_RESYNC;
+	rt_dispatch(m, AF_UNSPEC);
+}
+
+/*
+ * Sends queued messages for the fib and family of the first one in
+ *  @queue as a RTM_BATCH, up to RTS_COALESCE_BATCH bytes.
+ *
+ * Returns false if the messages were lost.
+ */
+static bool
+rts_coalesce_send(struct rts_pending_queue *queue)
+{
+	struct rts_pending *rp, *rp_next;
+	struct rt_msghdr *rtm;
+	struct mbuf *m;
+	uint32_t fibnum;
+	sa_family_t family;
+	int len = sizeof(*rtm);
+
+	rp = TAILQ_FIRST(queue);
+	fibnum = rp->rp_fibnum;
+	family = rp->rp_family;
+
+	if ((m = m_gethdr(M_NOWAIT, MT_DATA)) != NULL) {
+		m->m_pkthdr.len = m->m_len = sizeof(*rtm);
+		rtm = mtod(m, struct rt_msghdr *);
+		bzero(rtm, sizeof(*rtm));
+		rtm->rtm_version = RTM_VERSION;
+		rtm->rtm_type = RTM_BATCH;
+	}
+
+	TAILQ_FOREACH_SAFE(rp, queue, rp_link, rp_next) {
+		if (rp->rp_fibnum != fibnum || rp->rp_family != family)
+			continue;
+		if (len + rp->rp_msg.rtm_msglen > RTS_COALESCE_BATCH)
+			break;
+		if (m != NULL && m_append(m, rp->rp_msg.rtm_msglen,
+		    (c_caddr_t)&rp->rp_msg) == 0) {
+			m_freem(m);
+			m = NULL;
+		}
+		len += rp->rp_msg.rtm_msglen;
+		TAILQ_REMOVE(queue, rp, rp_link);
+		free(rp, M_RTABLE);
+	}
+	if (m == NULL)
+		return (false);
+
+	mtod(m, struct rt_msghdr *)->rtm_msglen = len;
+	M_SETFIB(m, fibnum);
+	m->m_flags |= RTS_FILTER_FIB;
+	rt_dispatch(m, family);
+
+	return (true);
+}
+
+static void
+rts_coalesce_flush(void *arg)
+{
+	struct rts_coalesce *rc = arg;
+	struct rts_pending_queue queue = TAILQ_HEAD_INITIALIZER(queue);
+	bool lost;
+
+	CURVNET_SET(rc->rc_vnet);
+	mtx_lock(&rc->rc_mtx);
+	rts_coalesce_take(rc, &queue);
+	lost = rc->rc_overflow;
+	rc->rc_overflow = false;
+	rc->rc_scheduled = false;
+	mtx_unlock(&rc->rc_mtx);
+
+	while (!TAILQ_EMPTY(&queue)) {
+		if (!rts_coalesce_send(&queue))
+			lost = true;
+	}
+	if (lost)
+		rts_send_resync();
+	CURVNET_RESTORE();
+}
+
+/*
+ * Queues route message @m for fib @fibnum if coalescing is on and the
+ *  change rate calls for it, replacing a queued message for the same
+ *  route.
+ *
+ * Returns true if @m was consumed.
+ */
+static bool
+rts_coalesce_route(struct mbuf *m, uint32_t fibnum, sa_family_t family)
+{
+	struct rts_coalesce *rc = &V_rts_coalesce;
+	union {
+		struct rt_msghdr	rtm;
+		char			buf[RTS_COALESCE_MSGLEN];
+	} msg;
+	struct rts_pending *rp;
+	int len = m->m_pkthdr.len, window;
+	uint32_t hv;
+
+	if (rts_coalesce_ms == 0 || len > RTS_COALESCE_MSGLEN)
+		return (false);
+	window = MAX(1, (int)((uint64_t)rts_coalesce_ms * hz / 1000));
+
+	mtx_lock(&rc->rc_mtx);
+	if (ticks - rc->rc_window_start >= window ||
+	    ticks - rc->rc_window_start < 0) {
+		rc->rc_window_start = ticks;
+		rc->rc_window = 0;
+	}
+	/* Queued messages go first to keep the order */
+	if (++rc->rc_window <= rts_coalesce_thresh &&
+	    TAILQ_EMPTY(&rc->rc_queue) && !rc->rc_overflow) {
+		mtx_unlock(&rc->rc_mtx);
+		return (false);
+	}
+	if (rc->rc_overflow) {
+		/* Listeners dump the table after the flush anyway */
+		mtx_unlock(&rc->rc_mtx);
+		m_freem(m);
+		return (true);
+	}
+
+	m_copydata(m, 0, len, msg.buf);
+	msg.rtm.rtm_msglen = len;
+	hv = hash32_buf(&msg.rtm + 1, len - sizeof(msg.rtm), fibnum);
+	LIST_FOREACH(rp, &rc->rc_hash[hv % RTS_COALESCE_HASH], rp_hash) {
+		if (rp->rp_hashval == hv && rp->rp_fibnum == fibnum &&
+		    rp->rp_msg.rtm_msglen == len &&
+		    memcmp(&rp->rp_msg + 1, &msg.rtm + 1, len - sizeof(msg.rtm)) == 0)
+			break;
+	}
+	if (rp != NULL) {
+		/* Same addresses, only the header has to be updated */
+		rp->rp_msg = msg.rtm;
+	} else if (rc->rc_count >= rts_coalesce_max || (rp = malloc(
+	    offsetof(struct rts_pending, rp_msg) + len, M_RTABLE,
+	    M_NOWAIT)) == NULL) {
+		struct rts_pending_queue queue = TAILQ_HEAD_INITIALIZER(queue);
+
+		rts_coalesce_take(rc, &queue);
+		rts_coalesce_free(&queue);
+		rc->rc_overflow = true;
+	} else {
+		rp->rp_fibnum = fibnum;
+		rp->rp_hashval = hv;
+		rp->rp_family = family;
+		memcpy(&rp->rp_msg, msg.buf, len);
+		TAILQ_INSERT_TAIL(&rc->rc_queue, rp, rp_link);
+		LIST_INSERT_HEAD(&rc->rc_hash[hv % RTS_COALESCE_HASH], rp, rp_hash);
+		rc->rc_count++;
+	}
+	if (!rc->rc_scheduled) {
+		rc->rc_scheduled = true;
+		callout_reset(&rc->rc_callout, window, rts_coalesce_flush, rc);
+	}
+	mtx_unlock(&rc->rc_mtx);
+	m_freem(m);
+
+	return (true);
+}
+
 /*
  * Announce route addition/removal to rtsock based on @rt data.
  * Callers are advives to use rt_routemsg() instead of using this
@@ -2098,6 +2624,10 @@ rtsock_routemsg_info(int cmd, struct rt_addrinfo *info, int fibnum)
 	rtm->rtm_flags = info->rti_flags;
 
 	sa = info->rti_info[RTAX_DST];
+	if (fibnum != RT_ALL_FIBS && (cmd == RTM_ADD || cmd == RTM_DELETE ||
+	    cmd == RTM_CHANGE) && rts_coalesce_route(m, fibnum,
+	    sa ? sa->sa_family : AF_UNSPEC))
+		return (0);
 	rt_dispatch(m, sa ? sa->sa_family : AF_UNSPEC);
 
 	return (0);
@@ -2233,36 +2763,635 @@ rt_dispatch(struct mbuf *m, sa_family_t saf)
 	netisr_queue(NETISR_ROUTE, m);	/* mbuf is free'd on failure. */
 }
 
+/*
+ * Passes the dump messages batched in the arena to the caller.
+ */
+static int
+sysctl_flush_arena(struct walkarg *w)
+{
+	int error = 0;
+
+	if (w->w_arena_off > 0) {
+		error = SYSCTL_OUT(w->w_req, w->w_arena, w->w_arena_off);
+		w->w_arena_off = 0;
+	}
+	return (error);
+}
+
+/*
+ * True if @rt follows the dump cursor in the tree order: by address,
+ *  then from the more specific prefix to the less specific one.
+ */
+static bool
+rt_after_cursor(const struct rtentry *rt, const struct walkarg *w)
+{
+	struct in6_addr addr6;
+	struct in_addr addr4;
+	uint32_t scopeid;
+	int cmp = 1, plen = 0;
+
+	switch (w->family) {
+#ifdef INET
+	case AF_INET:
+		rt_get_inet_prefix_plen(rt, &addr4, &plen, &scopeid);
+		cmp = memcmp(&addr4, &w->w_cursor.addr4, sizeof(addr4));
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		rt_get_inet6_prefix_plen(rt, &addr6, &plen, &scopeid);
+		cmp = memcmp(&addr6, &w->w_cursor.addr6, sizeof(addr6));
+		break;
+#endif
+	}
+
+	return (cmp > 0 || (cmp == 0 && plen < w->w_cursor_plen));
+}
+
 /*
  * This is used in dumping the kernel table via sysctl().
  */
+/*
+ * Compact TLV encoding, see struct rt_tlvhdr.
+ */
+static void
+rtt_msg_begin(struct rtt_buf *rb, int type, uint32_t fibnum)
+{
+	struct rt_tlvhdr *rth;
+
+	rb->rb_msg = rb->rb_off;
+	rb->rb_full = rb->rb_off + sizeof(*rth) > rb->rb_size;
+	if (rb->rb_full)
+		return;
+	rth = (struct rt_tlvhdr *)(rb->rb_base + rb->rb_off);
+	bzero(rth, sizeof(*rth));
+	rth->rth_version = RTT_VERSION;
+	rth->rth_type = type;
+	rth->rth_fibnum = fibnum;
+	rb->rb_off += sizeof(*rth);
+}
+
+/* Returns the payload of a new @len bytes attribute, NULL if full */
+static u_char *
+rtt_put(struct rtt_buf *rb, int type, int len)
+{
+	struct rt_tlv *tlv;
+	int size = sizeof(*tlv) + RTT_ALIGN(len);
+
+	if (rb->rb_full || rb->rb_off + size > rb->rb_size) {
+		rb->rb_full = true;
+		return (NULL);
+	}
+	tlv = (struct rt_tlv *)(rb->rb_base + rb->rb_off);
+	tlv->rtt_len = sizeof(*tlv) + len;
+	tlv->rtt_type = type;
+	bzero((char *)(tlv + 1) + len, RTT_ALIGN(len) - len);
+	rb->rb_off += size;
+	return ((u_char *)(tlv + 1));
+}
+
+static void
+rtt_put_u32(struct rtt_buf *rb, int type, uint32_t value)
+{
+	u_char *p;
+
+	if ((p = rtt_put(rb, type, sizeof(value))) != NULL)
+		memcpy(p, &value, sizeof(value));
+}
+
+/* Completes the open message, dropping it if it did not fit */
+static bool
+rtt_msg_end(struct rtt_buf *rb)
+{
+
+	if (rb->rb_full) {
+		rb->rb_off = rb->rb_msg;
+		return (false);
+	}
+	((struct rt_tlvhdr *)(rb->rb_base + rb->rb_msg))->rth_len =
+	    rb->rb_off - rb->rb_msg;
+	return (true);
+}
+
+/* Copies the address of @sa without embedded scope to @addr */
+static int
+rtt_addr(const struct sockaddr *sa, u_char *addr)
+{
+
+	switch (sa->sa_family) {
+#ifdef INET
+	case AF_INET:
+		memcpy(addr, &((const struct sockaddr_in *)sa)->sin_addr,
+		    sizeof(struct in_addr));
+		return (sizeof(struct in_addr));
+#endif
+#ifdef INET6
+	case AF_INET6:
+		memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr,
+		    sizeof(struct in6_addr));
+		in6_clearscope((struct in6_addr *)addr);
+		return (sizeof(struct in6_addr));
+#endif
+	}
+	return (0);
+}
+
+/* Prefix length of @dst with netmask @mask, NULL for host routes */
+static int
+rtt_sa_plen(const struct sockaddr *dst, const struct sockaddr *mask)
+{
+	const u_char *p, *end;
+	u_char addr[16];
+	int alen, plen = 0;
+
+	if ((alen = rtt_addr(dst, addr)) == 0 || mask == NULL)
+		return (alen * 8);
+	p = (const u_char *)mask + ((dst->sa_family == AF_INET) ?
+	    offsetof(struct sockaddr_in, sin_addr) :
+	    offsetof(struct sockaddr_in6, sin6_addr));
+	end = (const u_char *)mask + mask->sa_len;
+	for (int i = 0; i < alen && p + i < end; i++)
+		plen += bitcount32(p[i]);
+	return (plen);
+}
+
+static void
+rtt_put_prefix(struct rtt_buf *rb, const struct sockaddr *dst, int plen)
+{
+	u_char addr[16], *p;
+	int common = 0, sig;
+
+	if (rtt_addr(dst, addr) == 0)
+		return;
+	sig = howmany(plen, 8);
+	if (rb->rb_delta && rb->rb_prev_family == dst->sa_family) {
+		while (common < sig && addr[common] == rb->rb_prev[common])
+			common++;
+		if ((p = rtt_put(rb, RTTA_DST_DELTA, 2 + sig - common)) != NULL) {
+			p[0] = plen;
+			p[1] = common;
+			memcpy(p + 2, addr + common, sig - common);
+		}
+	} else if ((p = rtt_put(rb, RTTA_DST, 2 + sig)) != NULL) {
+		p[0] = dst->sa_family;
+		p[1] = plen;
+		memcpy(p + 2, addr, sig);
+	}
+	rb->rb_prev_family = dst->sa_family;
+	bzero(rb->rb_prev, sizeof(rb->rb_prev));
+	memcpy(rb->rb_prev, addr, sig);
+}
+
+static void
+rtt_put_gateway(struct rtt_buf *rb, const struct sockaddr *gw)
+{
+	u_char addr[16], *p;
+	int alen;
+
+	/* Interface routes are told apart by their RTTA_IFINDEX only */
+	if ((alen = rtt_addr(gw, addr)) == 0)
+		return;
+	if ((p = rtt_put(rb, RTTA_GATEWAY, 1 + alen)) != NULL) {
+		p[0] = gw->sa_family;
+		memcpy(p + 1, addr, alen);
+	}
+}
+
+/*
+ * Re-encodes kernel route change notification @m, possibly a RTM_BATCH,
+ *  for sockets using ROUTE_TLV.
+ * Returns NULL for replies, other messages and on failure, which are
+ *  delivered as they are.
+ */
+static struct mbuf *
+rtsock_msg_tlv(struct mbuf *m)
+{
+	struct rt_msghdr *rtm, *r;
+	struct rt_addrinfo info;
+	struct rtt_buf rb;
+	struct mbuf *t = NULL;
+	char *buf;
+	int len = m->m_pkthdr.len, off;
+	uint32_t fibnum;
+
+	if (len < sizeof(*rtm) || (buf = malloc(2 * len, M_TEMP,
+	    M_NOWAIT)) == NULL)
+		return (NULL);
+	m_copydata(m, 0, len, buf);
+	rtm = (struct rt_msghdr *)buf;
+	if (rtm->rtm_version != RTM_VERSION || rtm->rtm_pid != 0)
+		goto done;
+	switch (rtm->rtm_type) {
+	case RTM_ADD:
+	case RTM_DELETE:
+	case RTM_CHANGE:
+		off = 0;
+		break;
+	case RTM_BATCH:
+		off = sizeof(*rtm);
+		break;
+	default:
+		goto done;
+	}
+
+	/* TLV messages are smaller than their rt_msghdr version */
+	bzero(&rb, sizeof(rb));
+	rb.rb_base = buf + len;
+	rb.rb_size = len;
+	fibnum = (m->m_flags & RTS_FILTER_FIB) ? M_GETFIB(m) : RT_ALL_FIBS;
+	for (; len - off >= sizeof(*r); off += r->rtm_msglen) {
+		r = (struct rt_msghdr *)(buf + off);
+		if (r->rtm_msglen < sizeof(*r) || r->rtm_msglen > len - off)
+			break;
+		bzero(&info, sizeof(info));
+		info.rti_addrs = r->rtm_addrs;
+		if (rt_xaddrs((caddr_t)(r + 1), (caddr_t)r + r->rtm_msglen,
+		    &info) != 0 || info.rti_info[RTAX_DST] == NULL)
+			continue;
+
+		rtt_msg_begin(&rb, r->rtm_type, fibnum);
+		rtt_put_prefix(&rb, info.rti_info[RTAX_DST],
+		    rtt_sa_plen(info.rti_info[RTAX_DST],
+		    info.rti_info[RTAX_NETMASK]));
+		if (info.rti_info[RTAX_GATEWAY] != NULL)
+			rtt_put_gateway(&rb, info.rti_info[RTAX_GATEWAY]);
+		rtt_put_u32(&rb, RTTA_IFINDEX, r->rtm_index);
+		rtt_put_u32(&rb, RTTA_FLAGS, r->rtm_flags);
+		rtt_msg_end(&rb);
+	}
+
+	if (rb.rb_off > 0 && (t = m_gethdr(M_NOWAIT, MT_DATA)) != NULL &&
+	    m_append(t, rb.rb_off, rb.rb_base) == 0) {
+		m_freem(t);
+		t = NULL;
+	}
+done:
+	free(buf, M_TEMP);
+	return (t);
+}
+
+/* Passes the dump output on if less than @len bytes are left */
+static int
+rtt_dump_reserve(struct walkarg *w, int len)
+{
+	struct rtt_buf *rb = &w->w_rtt;
+	int error = 0;
+
+	if (rb->rb_off + len > rb->rb_size && rb->rb_off > 0) {
+		error = SYSCTL_OUT(w->w_req, rb->rb_base, rb->rb_off);
+		rb->rb_off = 0;
+	}
+	return (error);
+}
+
+/*
+ * Marks nexthop or group @bit as sent, returns true if it already was.
+ * Without memory for the bitmap objects are just sent again.
+ */
+static bool
+rtt_dump_seen(struct walkarg *w, u_int bit)
+{
+	uint32_t *seen;
+	u_int size;
+
+	if (bit >= w->w_seen_size) {
+		size = roundup2(bit + 1, 4096) * 2;
+		seen = malloc(size / NBBY, M_TEMP, M_NOWAIT | M_ZERO);
+		if (seen == NULL)
+			return (false);
+		if (w->w_seen != NULL) {
+			memcpy(seen, w->w_seen, w->w_seen_size / NBBY);
+			free(w->w_seen, M_TEMP);
+		}
+		w->w_seen = seen;
+		w->w_seen_size = size;
+	}
+	if (w->w_seen[bit / 32] & (1U << (bit % 32)))
+		return (true);
+	w->w_seen[bit / 32] |= 1U << (bit % 32);
+	return (false);
+}
+
+static int
+rtt_dump_nhop(struct walkarg *w, const struct nhop_object *nh)
+{
+	struct rtt_buf *rb = &w->w_rtt;
+	int error;
+
+	if (rtt_dump_seen(w, 2 * nhop_get_idx(nh)))
+		return (0);
+	if ((error = rtt_dump_reserve(w, RTT_MSG_MAX)) != 0)
+		return (error);
+	rtt_msg_begin(rb, RTT_NHOP, w->w_fibnum);
+	rtt_put_u32(rb, RTTA_NHIDX, nhop_get_idx(nh));
+	rtt_put_gateway(rb, &nh->gw_sa);
+	rtt_put_u32(rb, RTTA_IFINDEX, nh->nh_ifp->if_index);
+	rtt_put_u32(rb, RTTA_MTU, nh->nh_mtu);
+	rtt_put_u32(rb, RTTA_FLAGS, nhop_get_rtflags(nh));
+	rtt_msg_end(rb);
+
+	return (0);
+}
+
+#ifdef ROUTE_MPATH
+static int
+rtt_dump_nhgrp(struct walkarg *w, const struct nhgrp_object *nhg)
+{
+	const struct weightened_nhop *wn;
+	struct rtt_buf *rb = &w->w_rtt;
+	uint32_t num_nhops, v[2];
+	u_char *p;
+	int error;
+
+	if (rtt_dump_seen(w, 2 * nhgrp_get_idx(nhg) + 1))
+		return (0);
+	wn = nhgrp_get_nhops(nhg, &num_nhops);
+	for (int i = 0; i < num_nhops; i++) {
+		if ((error = rtt_dump_nhop(w, wn[i].nh)) != 0)
+			return (error);
+	}
+	error = rtt_dump_reserve(w, RTT_MSG_MAX +
+	    num_nhops * (sizeof(struct rt_tlv) + sizeof(v)));
+	if (error != 0)
+		return (error);
+	rtt_msg_begin(rb, RTT_NHGRP, w->w_fibnum);
+	rtt_put_u32(rb, RTTA_NHGRPIDX, nhgrp_get_idx(nhg));
+	for (int i = 0; i < num_nhops; i++) {
+		v[0] = nhop_get_idx(wn[i].nh);
+		v[1] = wn[i].weight;
+		if ((p = rtt_put(rb, RTTA_NHWEIGHT, sizeof(v))) != NULL)
+			memcpy(p, v, sizeof(v));
+	}
+	rtt_msg_end(rb);
+
+	return (0);
+}
+#endif
+
+static int
+sysctl_dumpentry_tlv(struct rtentry *rt, void *vw)
+{
+	struct walkarg *w = vw;
+	struct rtt_buf *rb = &w->w_rtt;
+	struct nhop_object *nh;
+	uint32_t idx, scopeid;
+	int error, plen = 0, attr;
+
+	NET_EPOCH_ASSERT();
+
+	/* rib_walk() does not stop on errors */
+	if (w->w_error != 0)
+		return (w->w_error);
+	if (!rt_is_exportable(rt, w->w_req->td->td_ucred))
+		return (0);
+
+	nh = rt_get_raw_nhop(rt);
+#ifdef ROUTE_MPATH
+	if (NH_IS_NHGRP(nh)) {
+		error = rtt_dump_nhgrp(w, (struct nhgrp_object *)nh);
+		attr = RTTA_NHGRPIDX;
+		idx = nhgrp_get_idx((struct nhgrp_object *)nh);
+	} else
+#endif
+	{
+		error = rtt_dump_nhop(w, nh);
+		attr = RTTA_NHIDX;
+		idx = nhop_get_idx(nh);
+	}
+	if (error == 0)
+		error = rtt_dump_reserve(w, RTT_MSG_MAX);
+	if (error != 0) {
+		w->w_error = error;
+		return (error);
+	}
+
+	switch (w->family) {
+#ifdef INET
+	case AF_INET: {
+		struct in_addr addr;
+
+		rt_get_inet_prefix_plen(rt, &addr, &plen, &scopeid);
+		break;
+	}
+#endif
+#ifdef INET6
+	case AF_INET6: {
+		struct in6_addr addr6;
+
+		rt_get_inet6_prefix_plen(rt, &addr6, &plen, &scopeid);
+		break;
+	}
+#endif
+	}
+	export_rtaddrs(rt, w->dst, w->mask);
+
+	rtt_msg_begin(rb, RTM_GET, w->w_fibnum);
+	rtt_put_prefix(rb, w->dst, plen);
+	rtt_put_u32(rb, attr, idx);
+	rtt_put_u32(rb, RTTA_FLAGS, rt->rte_flags | RTF_UP);
+	if (rt->rt_weight != RT_DEFAULT_WEIGHT)
+		rtt_put_u32(rb, RTTA_WEIGHT, rt->rt_weight);
+	rtt_msg_end(rb);
+
+	return (0);
+}
+
+static int
+rtable_sysctl_dump_tlv(uint32_t fibnum, int family, int flags,
+    struct walkarg *w)
+{
+	union sockaddr_union sa_dst, sa_mask;
+	int error;
+
+	if (w->w_arena == NULL)
+		return (ENOMEM);
+
+	w->family = family;
+	w->w_fibnum = fibnum;
+	w->dst = (struct sockaddr *)&sa_dst;
+	w->mask = (struct sockaddr *)&sa_mask;
+	init_sockaddrs_family(family, w->dst, w->mask);
+	w->w_rtt.rb_base = w->w_arena;
+	w->w_rtt.rb_size = w->w_arena_size;
+	w->w_rtt.rb_delta = (flags & RTT_F_DELTA) != 0;
+
+	rib_walk(fibnum, family, false, sysctl_dumpentry_tlv, w);
+
+	error = w->w_error;
+	if (error == 0)
+		error = rtt_dump_reserve(w, w->w_rtt.rb_size + 1);
+	free(w->w_seen, M_TEMP);
+	w->w_seen = NULL;
+
+	return (error);
+}
+
+/*
+ * NET_RT_DUMPNH: routes as (prefix, plen, nexthop index) records.
+ */
+static int
+sysctl_dumpentry_nh(struct rtentry *rt, void *vw)
+{
+	struct walkarg *w = vw;
+	struct rt_nhroute *rtn;
+	struct nhop_object *nh;
+	struct in6_addr addr6;
+	struct in_addr addr4;
+	uint32_t scopeid;
+	const void *addr = NULL;
+	int error, len, plen = 0;
+
+	NET_EPOCH_ASSERT();
+
+	if (w->w_error != 0)
+		return (w->w_error);
+	if (!rt_is_exportable(rt, w->w_req->td->td_ucred))
+		return (0);
+
+	switch (w->family) {
+#ifdef INET
+	case AF_INET:
+		rt_get_inet_prefix_plen(rt, &addr4, &plen, &scopeid);
+		addr = &addr4;
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		rt_get_inet6_prefix_plen(rt, &addr6, &plen, &scopeid);
+		addr = &addr6;
+		break;
+#endif
+	}
+	if (addr == NULL)
+		return (0);
+
+	len = sizeof(*rtn) + roundup2(howmany(plen, 8), 4);
+	if (w->w_arena_off + len > w->w_arena_size &&
+	    (error = sysctl_flush_arena(w)) != 0) {
+		w->w_error = error;
+		return (error);
+	}
+	rtn = (struct rt_nhroute *)(w->w_arena + w->w_arena_off);
+	bzero(rtn, len);
+	rtn->rtn_msglen = len;
+	rtn->rtn_version = RTM_VERSION;
+	rtn->rtn_type = RTM_GET;
+	rtn->rtn_flags = rt->rte_flags | RTF_UP;
+	rtn->rtn_plen = plen;
+	nh = rt_get_raw_nhop(rt);
+#ifdef ROUTE_MPATH
+	if (NH_IS_NHGRP(nh)) {
+		rtn->rtn_nhidx = nhgrp_get_idx((struct nhgrp_object *)nh);
+		rtn->rtn_flags |= RTF_MPATH;
+	} else
+#endif
+	{
+		rtn->rtn_nhidx = nhop_get_idx(nh);
+		rtn->rtn_flags |= nhop_get_rtflags(nh);
+	}
+	memcpy(rtn + 1, addr, howmany(plen, 8));
+	w->w_arena_off += len;
+
+	return (0);
+}
+
+static int
+sysctl_dumpnh_section(struct walkarg *w, int op, u_int count)
+{
+	struct rt_nhsection rns;
+
+	bzero(&rns, sizeof(rns));
+	rns.rns_msglen = sizeof(rns);
+	rns.rns_version = RTM_VERSION;
+	rns.rns_type = RTM_NHSECTION;
+	rns.rns_op = op;
+	rns.rns_count = count;
+	return (SYSCTL_OUT(w->w_req, &rns, sizeof(rns)));
+}
+
+/*
+ * Dumps the nexthops, the nexthop groups and then the routes of @family
+ *  in @fibnum, each nexthop being sent once rather than with every route.
+ */
+static int
+rtable_sysctl_dump_nh(uint32_t fibnum, int family, struct walkarg *w)
+{
+	struct rib_head *rnh;
+	int error;
+
+	if (w->w_arena == NULL)
+		return (ENOMEM);
+	if ((rnh = rt_tables_get_rnh(fibnum, family)) == NULL)
+		return (rt_tables_has_family(family) ? 0 : EAFNOSUPPORT);
+	w->family = family;
+
+	error = sysctl_dumpnh_section(w, NET_RT_NHOP, nhops_get_count(rnh));
+	if (error == 0)
+		error = nhops_dump_sysctl(rnh, w->w_req);
+#ifdef ROUTE_MPATH
+	if (error == 0)
+		error = sysctl_dumpnh_section(w, NET_RT_NHGRP,
+		    nhgrp_get_count(rnh));
+	if (error == 0)
+		error = nhgrp_dump_sysctl(rnh, w->w_req);
+#else
+	if (error == 0)
+		error = sysctl_dumpnh_section(w, NET_RT_NHGRP, 0);
+#endif
+	if (error == 0)
+		error = sysctl_dumpnh_section(w, NET_RT_DUMP,
+		    rnh->rnh_prefixes);
+	if (error != 0)
+		return (error);
+
+	rib_walk(fibnum, family, false, sysctl_dumpentry_nh, w);
+	error = w->w_error;
+	if (error == 0)
+		error = sysctl_flush_arena(w);
+
+	return (error);
+}
+
 static int
 sysctl_dumpentry(struct rtentry *rt, void *vw)
 {
 	struct walkarg *w = vw;
 	struct nhop_object *nh;
+	int error;
 
 	NET_EPOCH_ASSERT();
 
 	if (!rt_is_exportable(rt, w->w_req->td->td_ucred))
 		return (0);
+	if (w->w_cursor_plen >= 0 && !rt_after_cursor(rt, w))
+		return (0);
 
+	w->w_route_off = w->w_arena_off;
 	export_rtaddrs(rt, w->dst, w->mask);
 	nh = rt_get_raw_nhop(rt);
 #ifdef ROUTE_MPATH
 	if (NH_IS_NHGRP(nh)) {
 		const struct weightened_nhop *wn;
 		uint32_t num_nhops;
-		int error;
 		wn = nhgrp_get_nhops((struct nhgrp_object *)nh, &num_nhops);
 		for (int i = 0; i < num_nhops; i++) {
 			error = sysctl_dumpnhop(rt, wn[i].nh, wn[i].weight, w);
 			if (error != 0)
-				return (error);
+				break;
 		}
 	} else
 #endif
-		sysctl_dumpnhop(rt, nh, rt->rt_weight, w);
+		error = sysctl_dumpnhop(rt, nh, rt->rt_weight, w);
+
+	if (error != 0) {
+		/* Resumable dumps only return complete routes */
+		if (w->w_chunk) {
+			w->w_arena_off = w->w_route_off;
+			w->w_full = true;
+		}
+		return (error);
+	}
+	w->w_count++;
 
 	return (0);
 }
@@ -2292,7 +3421,22 @@ sysctl_dumpnhop(struct rtentry *rt, struct nhop_object *nh, uint32_t weight,
 		if (nh->nh_ifp->if_flags & IFF_POINTOPOINT)
 			info.rti_info[RTAX_BRD] = nh->nh_ifa->ifa_dstaddr;
 	}
-	if ((error = rtsock_msg_buffer(RTM_GET, &info, w, &size)) != 0)
+	if (w->w_arena != NULL) {
+		/* Serialize straight into the arena */
+		w->w_tmem = w->w_arena + w->w_arena_off;
+		w->w_tmemsize = w->w_arena_size - w->w_arena_off;
+	}
+	error = rtsock_msg_buffer(RTM_GET, &info, w, &size);
+	if (error == ENOBUFS && w->w_arena != NULL && !w->w_chunk &&
+	    w->w_arena_off > 0) {
+		/* Arena is full, pass it on and retry */
+		if ((error = sysctl_flush_arena(w)) != 0)
+			return (error);
+		w->w_tmem = w->w_arena;
+		w->w_tmemsize = w->w_arena_size;
+		error = rtsock_msg_buffer(RTM_GET, &info, w, &size);
+	}
+	if (error != 0)
 		return (error);
 	if (w->w_req && w->w_tmem) {
 		struct rt_msghdr *rtm = (struct rt_msghdr *)w->w_tmem;
@@ -2313,6 +3457,10 @@ sysctl_dumpnhop(struct rtentry *rt, struct nhop_object *nh, uint32_t weight,
 		rtm->rtm_rmx.rmx_weight = weight;
 		rtm->rtm_index = nh->nh_ifp->if_index;
 		rtm->rtm_addrs = info.rti_addrs;
+		if (w->w_arena != NULL) {
+			w->w_arena_off += size;
+			return (0);
+		}
 		error = SYSCTL_OUT(w->w_req, (caddr_t)rtm, size);
 		return (error);
 	}
@@ -2574,10 +3722,12 @@ sysctl_ifmalist(int af, struct walkarg *w)
 	return (error);
 }
 
-static void
+static int
 rtable_sysctl_dump(uint32_t fibnum, int family, struct walkarg *w)
 {
 	union sockaddr_union sa_dst, sa_mask;
+	caddr_t tmem = w->w_tmem;
+	int tmemsize = w->w_tmemsize;
 
 	w->family = family;
 	w->dst = (struct sockaddr *)&sa_dst;
@@ -2586,6 +3736,55 @@ rtable_sysctl_dump(uint32_t fibnum, int family, struct walkarg *w)
 	init_sockaddrs_family(family, w->dst, w->mask);
 
 	rib_walk(fibnum, family, false, sysctl_dumpentry, w);
+
+	w->w_tmem = tmem;
+	w->w_tmemsize = tmemsize;
+	return (sysctl_flush_arena(w));
+}
+
+/*
+ * Dumps routes of @family in @fibnum following the cursor in @name
+ *  (plen and address words, none to start) into the caller buffer.
+ * The walk stops at the first route not fitting the buffer, so each
+ *  call takes a single copyout. Returns ENOMEM if no route fits.
+ */
+static int
+rtable_sysctl_dump_cursor(uint32_t fibnum, int family, int *name,
+    u_int namelen, struct walkarg *w)
+{
+	size_t alen;
+	int error;
+
+	switch (family) {
+#ifdef INET
+	case AF_INET:
+		alen = sizeof(struct in_addr);
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		alen = sizeof(struct in6_addr);
+		break;
+#endif
+	default:
+		return (EAFNOSUPPORT);
+	}
+
+	if (w->w_arena == NULL)
+		return (ENOMEM);
+	if (namelen != 0) {
+		if (namelen != 1 + howmany(alen, sizeof(int)) ||
+		    name[0] < 0 || name[0] > alen * 8)
+			return (EINVAL);
+		w->w_cursor_plen = name[0];
+		memcpy(&w->w_cursor, &name[1], alen);
+	}
+	w->w_chunk = true;
+
+	error = rtable_sysctl_dump(fibnum, family, w);
+	if (error == 0 && w->w_full && w->w_count == 0)
+		error = ENOMEM;
+	return (error);
 }
 
 static int
@@ -2607,7 +3806,8 @@ sysctl_rtsock(SYSCTL_HANDLER_ARGS)
 	namelen--;
 	if (req->newptr)
 		return (EPERM);
-	if (name[1] == NET_RT_DUMP || name[1] == NET_RT_NHOP || name[1] == NET_RT_NHGRP) {
+	if (name[1] == NET_RT_DUMP || name[1] == NET_RT_NHOP ||
+	    name[1] == NET_RT_NHGRP || name[1] == NET_RT_DUMPNH) {
 		if (namelen == 3)
 			fib = req->td->td_proc->p_fibnum;
 		else if (namelen == 4)
@@ -2617,6 +3817,23 @@ sysctl_rtsock(SYSCTL_HANDLER_ARGS)
 			return ((namelen < 3) ? EISDIR : ENOTDIR);
 		if (fib < 0 || fib >= rt_numfibs)
 			return (EINVAL);
+	} else if (name[1] == NET_RT_DUMPT) {
+		if (namelen != 4 && namelen != 5)
+			return ((namelen < 4) ? EISDIR : ENOTDIR);
+		fib = (name[3] == RT_ALL_FIBS) ?
+		    req->td->td_proc->p_fibnum : name[3];
+		if (fib < 0 || fib >= rt_numfibs)
+			return (EINVAL);
+	} else if (name[1] == NET_RT_DUMPC) {
+		if (namelen < 4)
+			return (EISDIR);
+		fib = (name[3] == RT_ALL_FIBS) ?
+		    req->td->td_proc->p_fibnum : name[3];
+		if (fib < 0 || fib >= rt_numfibs)
+			return (EINVAL);
+		/* Replies are sized by the caller buffer */
+		if (req->oldptr == NULL)
+			return (EINVAL);
 	} else if (namelen != 3)
 		return ((namelen < 3) ? EISDIR : ENOTDIR);
 	af = name[0];
@@ -2626,6 +3843,7 @@ sysctl_rtsock(SYSCTL_HANDLER_ARGS)
 	w.w_op = name[1];
 	w.w_arg = name[2];
 	w.w_req = req;
+	w.w_cursor_plen = -1;
 
 	error = sysctl_wire_old_buffer(req, 0);
 	if (error)
@@ -2638,6 +3856,15 @@ sysctl_rtsock(SYSCTL_HANDLER_ARGS)
 	w.w_tmemsize = 65536;
 	w.w_tmem = malloc(w.w_tmemsize, M_TEMP, M_WAITOK);
 
+	/* Route dumps are batched, so a copyout takes many messages */
+	if (w.w_op == NET_RT_DUMPC)
+		w.w_arena_size = MIN(req->oldlen - req->oldidx, rts_dump_chunk_max);
+	else if (w.w_op == NET_RT_DUMP || w.w_op == NET_RT_FLAGS ||
+	    w.w_op == NET_RT_DUMPT || w.w_op == NET_RT_DUMPNH)
+		w.w_arena_size = rts_dump_arena;
+	if (w.w_arena_size > 0)
+		w.w_arena = malloc(w.w_arena_size, M_TEMP, M_WAITOK);
+
 	NET_EPOCH_ENTER(et);
 	switch (w.w_op) {
 	case NET_RT_DUMP:
@@ -2667,10 +3894,29 @@ sysctl_rtsock(SYSCTL_HANDLER_ARGS)
 			rnh = rt_tables_get_rnh(fib, i);
 			if (rnh != NULL) {
 				rtable_sysctl_dump(fib, i, &w);
-			} else if (af != 0)
+			} else if (af != 0 && !rt_tables_has_family(af))
 				error = EAFNOSUPPORT;
 		}
 		break;
+	case NET_RT_DUMPC:
+		/* A table not instantiated yet is empty */
+		if (rt_tables_get_rnh(fib, af) == NULL) {
+			error = rt_tables_has_family(af) ? 0 : EAFNOSUPPORT;
+			break;
+		}
+		error = rtable_sysctl_dump_cursor(fib, af, &name[4], namelen - 4, &w);
+		break;
+	case NET_RT_DUMPT:
+		if (rt_tables_get_rnh(fib, af) == NULL) {
+			error = rt_tables_has_family(af) ? 0 : EAFNOSUPPORT;
+			break;
+		}
+		error = rtable_sysctl_dump_tlv(fib, af,
+		    (namelen == 5) ? name[4] : 0, &w);
+		break;
+	case NET_RT_DUMPNH:
+		error = rtable_sysctl_dump_nh(fib, af, &w);
+		break;
 	case NET_RT_NHOP:
 	case NET_RT_NHGRP:
 		/* Allow dumping one specific af/fib at a time */
@@ -2708,6 +3954,7 @@ sysctl_rtsock(SYSCTL_HANDLER_ARGS)
 	}
 	NET_EPOCH_EXIT(et);
 
+	free(w.w_arena, M_TEMP);
 	free(w.w_tmem, M_TEMP);
 	return (error);
 }
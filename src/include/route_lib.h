@@ -25,10 +25,81 @@ struct rib_head;
 int route_lib_init(void);
 void route_lib_cleanup(void);
 
+/*
+ * Backs the route entries of tables created from now on, once a table
+ * has grown past one huge page of them, and the large flat arrays such
+ * as frozen copies with huge pages: explicit ones when the system has
+ * some reserved, transparent ones otherwise. Fewer TLB misses on large
+ * tables at the cost of memory being mapped in 2MB steps.
+ */
+void route_lib_set_hugepages(int enable);
+
+/*
+ * Startup profile
+ *
+ * Time spent bringing the library and its tables up since
+ * route_lib_init(), table creation split by phase. A table sets up its
+ * route entry zone with its first route and its latency histograms with
+ * its first timed operation, so tables that stay empty cost neither;
+ * that setup is accounted as deferred. Nexthops and multipath groups
+ * are shared by all tables and created with the first route using them.
+ * ris_first_lookup_ns is the time from route_lib_init() to the first
+ * route_lookup(), fib4_lookup() or fib6_lookup(), 0 until then.
+ */
+struct route_init_stats {
+    uint64_t ris_lib_ns;          /* route_lib_init() */
+    uint64_t ris_tables;          /* Tables created */
+    uint64_t ris_table_ns;        /* Creating them */
+    uint64_t ris_head_ns;         /*   of which radix tree heads */
+    uint64_t ris_counters_ns;     /*   of which statistics counters */
+    uint64_t ris_deferred;        /* Zones and histograms set up on first use */
+    uint64_t ris_deferred_ns;     /* Setting them up */
+    uint64_t ris_first_lookup_ns;
+};
+
+void route_lib_get_init_stats(struct route_init_stats* out);
+
 /* Routing table management */
 struct rib_head* route_table_create(int family, u_int fibnum);
 void route_table_destroy(struct rib_head* rh);
 
+/*
+ * Overlays
+ *
+ * route_table_create_overlay() creates table @fibnum as an overlay of
+ * @base: the overlay only stores its own routes and lookups return the
+ * longest match of either table, the overlay winning between routes of
+ * the same prefix. A base route is hidden by overriding it, with a
+ * ROUTE_RTF_REJECT or ROUTE_RTF_BLACKHOLE route for instance. The base
+ * is shared by all its overlays and cannot change while it has any:
+ * changes fail with ROUTE_EBUSY and route_table_destroy() leaves it in
+ * place, errno set to EBUSY. Overlays cannot serve as base.
+ * route_walk() of an overlay returns the merged routes; parallel walks,
+ * cursors, snapshots and rs_nodes only cover its own ones.
+ */
+struct rib_head* route_table_create_overlay(struct rib_head* base, u_int fibnum);
+
+/*
+ * Removes every route of @rh at once. The tree is swapped for an empty
+ * one and the old routes are released together with the zone they were
+ * allocated from, instead of being deleted one by one. Datapath lookups
+ * in the table miss while the flush is in progress. The flush is
+ * accounted as one rs_flushes event and count deletes.
+ */
+int route_table_flush(struct rib_head* rh);
+
+/*
+ * Compacts @rh after churn has scattered its routes over the heap: the
+ * routes are copied, in walk order, to a tree whose entries are packed
+ * in a new zone, which then replaces the old tree without lookups
+ * missing. Each call copies up to @budget routes, all of them if
+ * @budget <= 0, so that the work can be spread between other changes to
+ * the table, which go to both trees meanwhile. Returns 1 while routes
+ * are left to copy and ROUTE_OK once the new tree is in place, counted
+ * in rs_compactions. Flushes and loads drop a compaction in progress.
+ */
+int route_table_compact(struct rib_head* rh, int budget);
+
 /* Route operations */
 typedef enum {
     RT_OP_ADD,
@@ -52,10 +123,487 @@ int route_delete(struct rib_head* rh, struct sockaddr* dst, struct sockaddr* net
 int route_lookup(struct rib_head* rh, struct sockaddr* dst, struct route_info* ri_out);
 int route_change(struct rib_head* rh, struct route_info* ri);
 
-/* Route enumeration */
+/*
+ * Epoch sections
+ *
+ * Routes and nexthops are freed once no thread can still hold them,
+ * tracked by the network epoch. Pointers returned by the lookups stay
+ * valid from route_epoch_enter() until the matching route_epoch_exit()
+ * of the same thread. Sections nest. A thread must not change a table
+ * while inside one: the change may wait for the sections to end.
+ */
+void route_epoch_enter(void);
+void route_epoch_exit(void);
+
+/*
+ * Optimistic lookups
+ *
+ * route_lookup() takes no lock and may run on any number of threads
+ * alongside the one writer of the table. The writer makes a per-table
+ * sequence odd around each change to the tree, and a match overlapping
+ * one is redone; readers never block the writer. route_change() is a
+ * delete and an add, two changes: a lookup between them sees neither
+ * route and gets the covering one or ROUTE_ENOENT. Removed routes are
+ * freed an epoch later, so pointers returned in @ri_out stay valid while
+ * the caller is inside route_epoch_enter(). A table from
+ * route_table_restore() answers route_lookup() from its image, as it
+ * does datapath lookups, until the first operation of its writer waits
+ * for the rebuild; readers never wait for it.
+ */
+
+/*
+ * Multipath
+ *
+ * route_add_mpath() adds the route @ri over up to ROUTE_MPATH_MAX
+ * gateways of @gws instead of ri_gateway, all with ri_flags. The
+ * gateways form a group of slots shared out in proportion to the
+ * weights; a flow goes to slot flowid % slots. Groups get about 8 slots
+ * per member, 64 to 4096, with weights rounded to fit if need be, and
+ * every member keeps at least one slot. Lookups filling a route_info,
+ * and nexthop lookups without a flow, return the first member.
+ */
+#define ROUTE_MPATH_MAX 1024
+
+struct route_mpath_gw {
+    struct sockaddr* rmg_gateway;
+    int rmg_ifindex;
+    uint32_t rmg_weight;          /* 0 counts as 1 */
+};
+
+int route_add_mpath(struct rib_head* rh, const struct route_info* ri,
+                    const struct route_mpath_gw* gws, size_t count);
+
+/*
+ * Lookup cache
+ *
+ * With the cache enabled, route_lookup() keeps the result for each
+ * destination in a per-thread cache, matches and misses alike, and
+ * answers repeated destinations from it with one probe. Entries are
+ * tagged with the table generation, so any change to the table
+ * invalidates them. Off by default; counted in rs_cache_hits.
+ */
+int route_table_set_lookup_cache(struct rib_head* rh, int enable);
+
+/*
+ * Host route table
+ *
+ * With the host table enabled, routes of full-length prefixes (/32 and
+ * /128, or no netmask) are also kept in a hash by address that
+ * route_lookup() and datapath lookups probe before the tree, so that
+ * host destinations take one probe instead of a trie descent. Routes
+ * stay in the tree as well. Enabling indexes the existing routes; off
+ * by default. Overlays only index their own routes.
+ */
+int route_table_set_host_table(struct rib_head* rh, int enable);
+
+/*
+ * Bulk loading
+ *
+ * Populates the empty table @rh with @count routes at once, building
+ * the radix tree from the sorted routes instead of inserting them one
+ * by one. Meant for filling a table before it carries traffic.
+ * Fails with ROUTE_EEXIST if the table is not empty or a route is
+ * duplicated, in which case no route is added.
+ */
+int route_table_load(struct rib_head* rh, const struct route_info* routes, size_t count);
+
+/*
+ * Loads @nbatches independent tables at once on up to @nthreads threads,
+ * including the calling one: each batch is passed to route_table_load()
+ * and, with ROUTE_LOAD_FREEZE, the table is then frozen (see
+ * route_table_freeze()) by the same thread. Tables must be distinct.
+ * rlb_error is set for every batch; the first failing one in array order
+ * is returned, ROUTE_OK if all were loaded.
+ */
+#define ROUTE_LOAD_FREEZE    0x01
+
+struct route_load_batch {
+    struct rib_head* rlb_rh;
+    const struct route_info* rlb_routes;
+    size_t rlb_count;
+    int rlb_error;                /* Set on return */
+};
+
+int route_tables_load(struct route_load_batch* batches, size_t nbatches,
+                      int nthreads, int flags);
+
+/*
+ * Snapshots
+ *
+ * route_table_save() writes the routes of @rh to the versioned image
+ * @path, replacing it atomically. Only contiguous netmasks and single
+ * path routes are supported, ROUTE_ENOTSUPP is returned otherwise.
+ * route_table_restore() maps such an image read-only and creates table
+ * @fibnum from it: datapath lookups are served from the mapped image
+ * right away while the radix tree is rebuilt in the background. Other
+ * operations on the table wait for the rebuild to complete.
+ */
+int route_table_save(struct rib_head* rh, const char* path);
+struct rib_head* route_table_restore(const char* path, u_int fibnum);
+
+/*
+ * Exported tables
+ *
+ * route_table_export() publishes the routes of @rh for lookups from
+ * other processes: it replaces the snapshot image @path (same limits as
+ * route_table_save()) and then bumps a generation number kept in
+ * "@path.gen". Put both on a memory file system such as /dev/shm to
+ * share them without disk I/O. Exports do not trim the journal.
+ * Readers attach to @path and look up in the mapped image without locks
+ * or IPC; a lookup seeing a new generation first maps the new image, the
+ * only time it makes system calls. Pointers in @ri_out stay valid until
+ * such a switch or route_export_detach(). A reader is used by one thread
+ * at a time. route_export_generation() returns the generation mapped.
+ */
+struct route_export_reader;
+
+int route_table_export(struct rib_head* rh, const char* path);
+struct route_export_reader* route_export_attach(const char* path);
+void route_export_detach(struct route_export_reader* rx);
+int route_export_lookup(struct route_export_reader* rx, const struct sockaddr* dst,
+                        struct route_info* ri_out);
+uint64_t route_export_generation(const struct route_export_reader* rx);
+
+/*
+ * Delta export
+ *
+ * With a delta log of up to @max prefixes (0 disables it), every change
+ * to @rh gets a number and the log keeps the last state of each changed
+ * prefix. route_table_changes() returns the net changes numbered past
+ * @since, oldest first, up to @max of them, and sets *@genp to the
+ * number to pass next time: routes changed several times in between
+ * show up once, in their last state. Deltas point into the log, valid
+ * until the next change to @rh. ROUTE_ESTALE means changes past @since
+ * were lost, after a flush, when more than @max prefixes changed since,
+ * or for 0: walk the table for a full resync, then go on from the
+ * number returned in *@genp. As other changes, these run on the thread
+ * changing @rh.
+ */
+#define ROUTE_DELTA_SET  1            /* Route added or replaced */
+#define ROUTE_DELTA_DEL  2
+
+struct route_delta {
+    uint64_t rd_gen;              /* Change number */
+    int rd_op;                    /* ROUTE_DELTA_* */
+    struct route_info rd_info;    /* Prefix, and the route for ROUTE_DELTA_SET */
+};
+
+int route_table_set_delta_log(struct rib_head* rh, size_t max);
+int route_table_changes(struct rib_head* rh, uint64_t since, struct route_delta* deltas,
+                        int max, uint64_t* genp);
+
+/*
+ * Staged changes
+ *
+ * A stage buffers changes to @rh and keeps only the net pending state of
+ * each prefix: a route withdrawn and announced again, or changed several
+ * times, is committed once, and not at all if it ends up as it was in
+ * the table. route_stage_add() sets the route of a prefix, adding or
+ * replacing it. Pending changes are committed when @max_pending prefixes
+ * are pending, when a change comes @window_ms or more after the oldest
+ * pending one (0 for no window), and on route_stage_commit(). Call
+ * route_stage_poll() periodically to honor the window when changes stop
+ * coming. Staging returns the result of the commit it triggered if any,
+ * the first failure of the batch; errors of single routes are otherwise
+ * only counted. Destroying a stage commits it. As other changes, stages
+ * run on the thread changing @rh, and lookups see staged changes once
+ * committed.
+ */
+struct route_stage_stats {
+    u_long rss_staged;            /* Changes staged */
+    u_long rss_absorbed;          /* Changes that never reached the tree */
+    u_long rss_applied;           /* Tree changes made by commits */
+    u_long rss_failed;            /* Tree changes that failed */
+    u_long rss_commits;
+    u_long rss_pending;           /* Prefixes with pending changes */
+};
+
+struct route_stage;
+
+struct route_stage* route_stage_create(struct rib_head* rh, size_t max_pending,
+                                       u_int window_ms);
+void route_stage_destroy(struct route_stage* st);
+int route_stage_add(struct route_stage* st, const struct route_info* ri);
+int route_stage_delete(struct route_stage* st, struct sockaddr* dst, struct sockaddr* netmask);
+int route_stage_commit(struct route_stage* st);
+int route_stage_poll(struct route_stage* st);
+int route_stage_get_stats(const struct route_stage* st, struct route_stage_stats* stats);
+
+/*
+ * Route origins
+ *
+ * An origin set keeps the candidate routes that several sources (static
+ * routes, OSPF, BGP sessions...) offer for the prefixes of @rh, and
+ * installs only the best candidate of each prefix in the table.
+ * route_origins_add() sets the candidate of @source for the prefix of
+ * @ri, replacing the previous one of that source; route_origins_delete()
+ * withdraws it, and route_origins_withdraw() withdraws every candidate
+ * of @source. The lowest @pref wins, as administrative distances do,
+ * then the lowest source. The table, its lookup structures and
+ * subscribers only see a change when the winner of a prefix changes;
+ * updates to losing candidates, or that leave the same route on top,
+ * stop here. Updates return the result of the table change they made,
+ * if any. Routes of prefixes the set does not know are left alone, and
+ * destroying the set leaves the installed winners in the table.
+ */
+struct route_origins_stats {
+    u_long ros_updates;           /* Candidates set or withdrawn */
+    u_long ros_absorbed;          /* Updates that left the table as it was */
+    u_long ros_applied;           /* Table changes made */
+    u_long ros_failed;            /* Table changes that failed */
+    u_long ros_prefixes;
+    u_long ros_candidates;
+};
+
+struct route_origins;
+
+struct route_origins* route_origins_create(struct rib_head* rh);
+void route_origins_destroy(struct route_origins* ro);
+int route_origins_add(struct route_origins* ro, u_int source, u_int pref,
+                      const struct route_info* ri);
+int route_origins_delete(struct route_origins* ro, u_int source, struct sockaddr* dst,
+                         struct sockaddr* netmask);
+int route_origins_withdraw(struct route_origins* ro, u_int source);
+int route_origins_get_stats(const struct route_origins* ro, struct route_origins_stats* stats);
+
+/*
+ * Change journal
+ *
+ * route_journal_open() appends every later change to @rh to journal
+ * @path, creating it if needed. Changes are queued in memory and a
+ * writer thread writes and syncs them in groups, so they do not wait on
+ * the disk; route_journal_sync() waits until every change made so far is
+ * durable. Records are numbered: an image saved by route_table_save()
+ * holds the number of the last change it covers and the journal drops
+ * the records up to it. Recovery restores the image, then
+ * route_journal_replay() applies the records past it; replay before
+ * opening the journal again. A record torn by a crash ends the replay
+ * and is cut by the next route_journal_open(). As with snapshots, only
+ * single path routes can be journaled: route_add_mpath() fails with
+ * ROUTE_ENOTSUPP while a journal is open. route_table_destroy() closes
+ * the journal.
+ */
+int route_journal_open(struct rib_head* rh, const char* path);
+int route_journal_sync(struct rib_head* rh);
+void route_journal_close(struct rib_head* rh);
+int route_journal_replay(struct rib_head* rh, const char* path);
+
+/*
+ * Datapath lookups
+ *
+ * Lock-free longest-match lookups in table @fibnum of the family, going
+ * through the table datapath pointer under the network epoch. Pointers
+ * returned in @ri_out stay valid while the caller is inside
+ * route_epoch_enter() or until the route is deleted.
+ * Lookups are not accounted in route_stats.
+ */
+int fib4_lookup(u_int fibnum, struct in_addr dst, uint32_t scopeid,
+                struct route_info* ri_out);
+int fib6_lookup(u_int fibnum, const struct in6_addr* dst, uint32_t scopeid,
+                struct route_info* ri_out);
+
+/*
+ * Burst variants of the lookups above for packet vectors: @count keys
+ * resolved in one epoch section, interleaving the lookups on frozen
+ * tables (see route_table_freeze()) to overlap their cache misses.
+ * Entry i of @ri_out is zeroed when dsts[i] has no route.
+ * Returns the number of keys that matched a route.
+ */
+int fib4_lookup_burst(u_int fibnum, const struct in_addr* dsts, size_t count,
+                      struct route_info* ri_out);
+int fib6_lookup_burst(u_int fibnum, const struct in6_addr* dsts, uint32_t scopeid,
+                      size_t count, struct route_info* ri_out);
+
+/*
+ * Nexthops
+ *
+ * Routes with the same gateway, flags and interface share a nexthop,
+ * numbered from 1 in a dense array common to all tables. The nhidx
+ * lookups return the number of the nexthop of the longest match instead
+ * of filling a route_info, 0 when there is none. route_nhop_array()
+ * returns the array and its size, unused slots zeroed; the array grows
+ * by replacement, so fetch it after the lookups it is to resolve.
+ * Numbers and array stay valid while the caller is inside route_epoch_enter():
+ * once the last route of a nexthop is gone its number is reused.
+ */
+struct route_nhop {
+    const struct sockaddr* rnh_gateway;  /* NULL without gateway */
+    int rnh_flags;
+    int rnh_ifindex;
+};
+
+uint32_t fib4_lookup_nhidx(u_int fibnum, struct in_addr dst, uint32_t scopeid);
+uint32_t fib6_lookup_nhidx(u_int fibnum, const struct in6_addr* dst, uint32_t scopeid);
+const struct route_nhop* route_nhop_array(uint32_t* count);
+
+/*
+ * Burst nexthop lookups with the multipath selection done in the same
+ * pass: entry i of @nhidx_out is the nexthop flowids[i] selects in the
+ * route of dsts[i], 0 when there is none. Returns the number of hits.
+ */
+int fib4_lookup_nhidx_burst(u_int fibnum, const struct in_addr* dsts, const uint32_t* flowids,
+                            size_t count, uint32_t* nhidx_out);
+int fib6_lookup_nhidx_burst(u_int fibnum, const struct in6_addr* dsts, uint32_t scopeid,
+                            const uint32_t* flowids, size_t count, uint32_t* nhidx_out);
+
+/*
+ * Label tables
+ *
+ * An MPLS label FIB for @fibnum, next to its IP tables: an exact-match
+ * table of incoming labels, each forwarded to a nexthop or a multipath
+ * group with the label swapped for rli_outlabel, or popped when that is
+ * ROUTE_LABEL_IMPNULL. Nexthops and groups are interned with those of
+ * the IP routes, so labels and routes over the same gateway share one
+ * nexthop number. A single path label is one word of an array indexed
+ * by label, the only memory fib_label_lookup_nhidx() reads for it.
+ * route_lfib_add() and route_lfib_add_mpath() set a label, replacing
+ * its previous entry. Lookups and walks fill the gateway of the first
+ * member of multipath labels. As with route tables, one thread changes
+ * a label table while any thread looks it up; there is one per fib,
+ * route_lfib_create() fails with EEXIST for a second one.
+ */
+#define ROUTE_LABEL_MAX      ((1u << 20) - 1)
+#define ROUTE_LABEL_IMPNULL  3        /* Pop the label */
+
+struct route_label_info {
+    uint32_t rli_label;
+    uint32_t rli_outlabel;        /* Swapped in, ROUTE_LABEL_IMPNULL to pop */
+    struct sockaddr* rli_gateway;
+    int rli_flags;
+    int rli_ifindex;
+};
+
+typedef int (*route_label_walker_f)(struct route_label_info* li, void* arg);
+
+struct route_lfib;
+
+struct route_lfib* route_lfib_create(u_int fibnum);
+void route_lfib_destroy(struct route_lfib* lf);
+int route_lfib_add(struct route_lfib* lf, const struct route_label_info* li);
+int route_lfib_add_mpath(struct route_lfib* lf, const struct route_label_info* li,
+                         const struct route_mpath_gw* gws, size_t count);
+int route_lfib_delete(struct route_lfib* lf, uint32_t label);
+int route_lfib_lookup(struct route_lfib* lf, uint32_t label, struct route_label_info* li_out);
+int route_lfib_walk(struct route_lfib* lf, route_label_walker_f walker, void* arg);
+
+/*
+ * Datapath label lookups in the label table of @fibnum: the nexthop
+ * @flowid selects for @label, 0 if none, with its outgoing label. The
+ * burst variant fills entry i of both arrays for labels[i] and returns
+ * the number of hits.
+ */
+uint32_t fib_label_lookup_nhidx(u_int fibnum, uint32_t label, uint32_t flowid,
+                                uint32_t* outlabel);
+int fib_label_lookup_nhidx_burst(u_int fibnum, const uint32_t* labels, const uint32_t* flowids,
+                                 size_t count, uint32_t* nhidx_out, uint32_t* outlabels);
+
+/*
+ * Builds a compact, read-only copy of the tree of @rh for the datapath
+ * lookups above: nodes packed in breadth-first order in one array
+ * instead of radix nodes spread over the route entries. The next change
+ * to the table drops the copy and lookups go back to the tree until the
+ * table is frozen again; freezing an unchanged table does nothing.
+ * The copy of an overlay is compiled from the merged view.
+ * Fails with ROUTE_EINVAL if a netmask is not contiguous.
+ */
+int route_table_freeze(struct rib_head* rh);
+
+/*
+ * NUMA replicas
+ *
+ * With replicas enabled, route_table_freeze() builds one copy per memory
+ * node, each from a thread bound to the node so that its memory is local
+ * there, and datapath lookups use the copy of the calling thread's node.
+ * A thread's node is looked up on its first lookup; threads that are not
+ * bound to one node can set it with route_thread_set_node(), -1 meaning
+ * look it up again. Nodes are only reported on Linux, other systems
+ * have a single one. Route entries themselves are not replicated.
+ */
+int route_table_set_numa(struct rib_head* rh, int enable);
+void route_thread_set_node(int node);
+
+/*
+ * Route enumeration
+ *
+ * route_walk() calls @walker with each route of @rh, by key and most
+ * specific mask first, until @walker returns non-zero. @walker may
+ * delete the route it is given, whose @ri is not to be used after, but
+ * no other route: routes further on may already be queued for it.
+ * Returns the number of routes passed to @walker.
+ */
 typedef int (*route_walker_f)(struct route_info* ri, void* arg);
 int route_walk(struct rib_head* rh, route_walker_f walker, void* arg);
 
+/*
+ * Walks @rh on up to @nthreads threads, including the calling one, each
+ * taking subtrees of the radix tree in turn. Without ROUTE_WALK_ORDERED
+ * @walker is called concurrently from all of them in no particular
+ * order. With ROUTE_WALK_ORDERED routes are collected per subtree and
+ * @walker is called from the calling thread in the route_walk() order.
+ * The table must not be modified during the walk.
+ * Returns the number of routes passed to @walker, as route_walk().
+ */
+#define ROUTE_WALK_ORDERED   0x01
+
+int route_walk_parallel(struct rib_head* rh, route_walker_f walker, void* arg,
+                        int nthreads, int flags);
+
+/*
+ * Prefix queries
+ *
+ * route_lookup_covering() passes the routes covering prefix @dst/@netmask,
+ * itself included, most specific first. route_walk_more_specific() passes
+ * the prefix and the routes inside of it in the route_walk() order. A NULL
+ * @netmask is a host prefix. Overlays report their own routes and the base
+ * ones they do not override. A non-zero return from @walker ends the query.
+ * Both return the number of routes passed to @walker, or a negative error
+ * code; ROUTE_EINVAL if @dst is not of the table's family.
+ */
+int route_lookup_covering(struct rib_head* rh, struct sockaddr* dst, struct sockaddr* netmask,
+                          route_walker_f walker, void* arg);
+int route_walk_more_specific(struct rib_head* rh, struct sockaddr* dst,
+                             struct sockaddr* netmask, route_walker_f walker, void* arg);
+
+/*
+ * Hit counts
+ *
+ * With sampling enabled, one lookup of @rh in @rate on average, at
+ * random, adds @rate to the hit count of the route it matched; 0
+ * disables sampling, which leaves the counts as they are. Counts are
+ * kept per route in a few shards picked by thread, so that lookups on
+ * other threads rarely update the same counter. Lookups through
+ * route_lookup() and the radix datapath, its frozen copies and host
+ * table included, are sampled; those answered by a fib_algo module are
+ * not. route_walk_hits() walks
+ * the routes as route_walk() with their estimated hits, clearing them
+ * with ROUTE_HITS_RESET. Replacing a route starts its count over, and
+ * the base routes of an overlay count the lookups of every table
+ * sharing them.
+ */
+#define ROUTE_HITS_MAXRATE   (1u << 24)
+#define ROUTE_HITS_RESET     0x01
+
+typedef int (*route_hits_walker_f)(struct route_info* ri, uint64_t hits, void* arg);
+
+int route_table_set_hit_sampling(struct rib_head* rh, u_int rate);
+int route_walk_hits(struct rib_head* rh, route_hits_walker_f walker, void* arg, int flags);
+
+/*
+ * Resumable walk: each route_cursor_next() call passes up to @limit
+ * routes to @walker in the route_walk() order, picking up after the last
+ * route of the previous call. The table may change between calls; the
+ * cursor then seeks past the last route it returned, so every route
+ * present for the whole walk is seen exactly once.
+ * Returns the number of routes passed to @walker, 0 once the walk is
+ * over, or a negative error code. A non-zero return from @walker ends
+ * the call early, the next one resuming after that route.
+ */
+struct route_cursor;
+
+struct route_cursor* route_cursor_create(struct rib_head* rh);
+int route_cursor_next(struct route_cursor* rc, route_walker_f walker, void* arg, int limit);
+void route_cursor_destroy(struct route_cursor* rc);
+
 /* Radix tree operations (low-level interface) */
 struct radix_node_head* radix_node_head_create(void);
 void radix_node_head_destroy(struct radix_node_head* rnh);
@@ -69,12 +617,125 @@ struct route_stats {
     u_long rs_deletes;     /* Number of deletes */
     u_long rs_changes;     /* Number of changes */
     u_long rs_nodes;       /* Number of nodes */
+    u_long rs_cache_hits;  /* Lookups answered by the lookup cache */
+    u_long rs_flushes;     /* route_table_flush() calls */
+    u_long rs_compactions; /* Completed route_table_compact() runs */
+};
+
+/*
+ * Per-operation latency, log2 histogram: bucket i counts operations that
+ * took [2^i, 2^(i+1)) nanoseconds, the last bucket everything slower.
+ * route_lookup() is sampled, one call in ROUTE_LAT_LOOKUP_SAMPLE per
+ * thread; rebuilds are route_table_load() and route_table_freeze().
+ */
+#define ROUTE_LAT_BUCKETS        40
+#define ROUTE_LAT_LOOKUP_SAMPLE  16
+
+struct route_latency {
+    uint64_t rl_count;     /* Operations timed */
+    uint64_t rl_sum_ns;    /* Total time */
+    uint64_t rl_max_ns;    /* Slowest operation */
+    uint64_t rl_buckets[ROUTE_LAT_BUCKETS];
+};
+
+struct route_stats_ext {
+    struct route_stats rse_stats;
+    struct route_latency rse_add;
+    struct route_latency rse_delete;
+    struct route_latency rse_change;
+    struct route_latency rse_lookup;
+    struct route_latency rse_rebuild;
+    uint64_t rse_reclaim_pending;  /* Deleted entries waiting for readers */
+    uint64_t rse_reclaim_bytes;    /* Memory they hold */
 };
 
 int route_get_stats(struct rib_head* rh, struct route_stats* stats);
+int route_get_stats_ext(struct rib_head* rh, struct route_stats_ext* stats);
+uint64_t route_latency_percentile(const struct route_latency* rl, double pct);
 void route_print_table(struct rib_head* rh);
 int route_validate_table(struct rib_head* rh);
 
+/*
+ * Incremental validation: each route_validate_step() call runs the
+ * route_validate_table() checks on about @limit more nodes of the tree,
+ * in key order, so that a table can be checked continuously in small
+ * steps between changes. Returns the number of nodes checked, 0 once a
+ * pass over the tree is over, the next call starting another one, or
+ * ROUTE_EINVAL at the first inconsistent node. A pass running across
+ * changes to the table goes on after the last route it checked.
+ */
+struct route_validator;
+
+struct route_validator* route_validator_create(struct rib_head* rh);
+int route_validate_step(struct route_validator* rv, int limit);
+void route_validator_destroy(struct route_validator* rv);
+
+/*
+ * Sharded tables
+ *
+ * A sharded table splits its routes by the first @bits bits of their
+ * address (1 to ROUTE_SHARD_MAXBITS) into 2^bits tables, each with a
+ * writer lock of its own, so that threads changing routes of different
+ * shards do so in parallel. Prefixes shorter than @bits go to a shared
+ * top table with its own lock. Unlike plain tables, a sharded table may
+ * be changed from any number of threads at once.
+ * Lookups try the shard of the destination, then the top table, without
+ * locks; so do datapath lookups in @fibnum when its slot was free.
+ * route_sharded_lookup() is a datapath lookup: pointers in @ri_out stay
+ * valid until the route is deleted. Walks return the top routes first,
+ * then the routes of each shard in turn. Netmasks must be contiguous.
+ */
+#define ROUTE_SHARD_MAXBITS 8
+
+struct route_sharded;
+
+struct route_sharded* route_sharded_create(int family, u_int fibnum, int bits);
+void route_sharded_destroy(struct route_sharded* rs);
+int route_sharded_add(struct route_sharded* rs, struct route_info* ri);
+int route_sharded_delete(struct route_sharded* rs, struct sockaddr* dst,
+                         struct sockaddr* netmask);
+int route_sharded_change(struct route_sharded* rs, struct route_info* ri);
+int route_sharded_lookup(struct route_sharded* rs, const struct sockaddr* dst,
+                         struct route_info* ri_out);
+int route_sharded_walk(struct route_sharded* rs, route_walker_f walker, void* arg);
+int route_sharded_freeze(struct route_sharded* rs);
+int route_sharded_get_stats(struct route_sharded* rs, struct route_stats* stats);
+
+/*
+ * Asynchronous changes
+ *
+ * route_async_create() starts a writer thread applying the changes
+ * submitted to @rh, so that callers do not wait for them. Any number of
+ * threads submit ops to a ring of @entries slots (a power of two) with a
+ * tag of their choosing; ROUTE_EBUSY with errno EAGAIN means the ring is
+ * full. The sockaddrs of @ri are copied. The writer applies the ops in
+ * submission order, in batches when they queue up, and posts a
+ * completion with the tag and the ROUTE_* result for each of them on a
+ * ring of twice @entries. route_async_reap() takes up to @max
+ * completions, waiting for one if @wait; the writer stops applying ops
+ * while the completion ring is full. While attached, the writer is the
+ * only writer of @rh; datapath lookups go on as usual.
+ * route_async_destroy() waits for the ops submitted so far and drops
+ * their pending completions.
+ */
+#define ROUTE_ASYNC_ADD     1
+#define ROUTE_ASYNC_DELETE  2
+#define ROUTE_ASYNC_CHANGE  3
+
+struct route_async_cqe {
+    uint64_t rac_tag;             /* Tag given at submission */
+    int rac_op;                   /* ROUTE_ASYNC_* */
+    int rac_result;               /* ROUTE_* code */
+};
+
+struct route_async;
+
+struct route_async* route_async_create(struct rib_head* rh, u_int entries);
+void route_async_destroy(struct route_async* ra);
+int route_async_submit(struct route_async* ra, int op, const struct route_info* ri,
+                       uint64_t tag);
+int route_async_reap(struct route_async* ra, struct route_async_cqe* cqes, int max, int wait);
+
 /* Error codes */
 #define ROUTE_OK         0
 #define ROUTE_EINVAL    -1
@@ -82,6 +743,8 @@ int route_validate_table(struct rib_head* rh);
 #define ROUTE_EEXIST    -3
 #define ROUTE_ENOMEM    -4
 #define ROUTE_ENOTSUPP  -5
+#define ROUTE_EBUSY     -6
+#define ROUTE_ESTALE    -7
 
 /* Route flags (compatible with FreeBSD RTF_* flags) */
 #define ROUTE_RTF_UP         0x1     /* Route usable */
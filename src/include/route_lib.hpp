@@ -0,0 +1,380 @@
+/*
+ * FreeBSD Routing Library - C++ API
+ *
+ * Header-only C++17 layer over route_lib.h:
+ *
+ * - Ipv4Prefix/Ipv6Prefix: typed value keys. The sockaddrs route_lib
+ *   takes are built on the stack of each call, never on the heap.
+ * - RibTable<Prefix>: move-only owner of a rib_head, destroyed with the
+ *   handle. Rib4 and Rib6 name the two instantiations.
+ * - lookup() returns a RouteView, a copy of the route_info whose
+ *   pointers refer to the route entry itself; nothing is allocated.
+ *   The view holds an EpochGuard, so the entry outlives it.
+ * - walk() takes any callable. Each callable type gets its own
+ *   route_walker_f thunk, so the call to it is inlined in the thunk.
+ *
+ * Errors are the ROUTE_* codes of the C API, nothing throws.
+ */
+
+#ifndef _ROUTE_LIB_HPP_
+#define _ROUTE_LIB_HPP_
+
+#include "route_lib.h"
+
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace route {
+
+/* IPv4 prefix, host bits cleared */
+struct Ipv4Prefix {
+    using address_type = in_addr;
+    using sockaddr_type = sockaddr_in;
+    static constexpr int family = AF_INET;
+    static constexpr int max_len = 32;
+
+    in_addr addr;
+    uint8_t len;
+
+    Ipv4Prefix() noexcept : addr{}, len(0) {}
+    Ipv4Prefix(in_addr a, int l) noexcept : addr(a), len(clamp(l)) {
+        addr.s_addr &= mask_bits(len);
+    }
+    /* @a in host byte order, 0x0a000000 for 10.0.0.0 */
+    Ipv4Prefix(uint32_t a, int l) noexcept : Ipv4Prefix(in_addr{htonl(a)}, l) {}
+
+    static void make_sockaddr(sockaddr_in& sin, in_addr a) noexcept {
+        std::memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_len = sizeof(sin);
+        sin.sin_addr = a;
+    }
+    void make_netmask(sockaddr_in& sin) const noexcept {
+        make_sockaddr(sin, in_addr{mask_bits(len)});
+    }
+
+    /* Prefix of a route_lib route, NULL netmask meaning a host route */
+    static Ipv4Prefix from_route(const route_info& ri) noexcept {
+        const auto* dst = reinterpret_cast<const sockaddr_in*>(ri.ri_dst);
+        const auto* mask = reinterpret_cast<const sockaddr_in*>(ri.ri_netmask);
+
+        if (mask == nullptr) {
+            return Ipv4Prefix(dst->sin_addr, max_len);
+        }
+        return Ipv4Prefix(dst->sin_addr, __builtin_popcount(mask->sin_addr.s_addr));
+    }
+
+    friend bool operator==(const Ipv4Prefix& a, const Ipv4Prefix& b) noexcept {
+        return a.addr.s_addr == b.addr.s_addr && a.len == b.len;
+    }
+    friend bool operator!=(const Ipv4Prefix& a, const Ipv4Prefix& b) noexcept {
+        return !(a == b);
+    }
+
+private:
+    static uint8_t clamp(int l) noexcept {
+        return static_cast<uint8_t>(l < 0 ? 0 : (l > max_len ? max_len : l));
+    }
+    /* Netmask of @l bits, network byte order */
+    static uint32_t mask_bits(int l) noexcept {
+        return l == 0 ? 0 : htonl(~UINT32_C(0) << (max_len - l));
+    }
+};
+
+/* IPv6 prefix, host bits cleared. Scope ids are not part of the key. */
+struct Ipv6Prefix {
+    using address_type = in6_addr;
+    using sockaddr_type = sockaddr_in6;
+    static constexpr int family = AF_INET6;
+    static constexpr int max_len = 128;
+
+    in6_addr addr;
+    uint8_t len;
+
+    Ipv6Prefix() noexcept : addr{}, len(0) {}
+    Ipv6Prefix(const in6_addr& a, int l) noexcept : addr(a), len(clamp(l)) {
+        for (int i = 0; i < 16; i++) {
+            addr.s6_addr[i] &= mask_byte(len, i);
+        }
+    }
+
+    static void make_sockaddr(sockaddr_in6& sin6, const in6_addr& a) noexcept {
+        std::memset(&sin6, 0, sizeof(sin6));
+        sin6.sin6_family = AF_INET6;
+        sin6.sin6_len = sizeof(sin6);
+        sin6.sin6_addr = a;
+    }
+    void make_netmask(sockaddr_in6& sin6) const noexcept {
+        in6_addr m;
+
+        for (int i = 0; i < 16; i++) {
+            m.s6_addr[i] = mask_byte(len, i);
+        }
+        make_sockaddr(sin6, m);
+    }
+
+    static Ipv6Prefix from_route(const route_info& ri) noexcept {
+        const auto* dst = reinterpret_cast<const sockaddr_in6*>(ri.ri_dst);
+        const auto* mask = reinterpret_cast<const sockaddr_in6*>(ri.ri_netmask);
+        int l = 0;
+
+        if (mask == nullptr) {
+            return Ipv6Prefix(dst->sin6_addr, max_len);
+        }
+        for (int i = 0; i < 16; i++) {
+            l += __builtin_popcount(mask->sin6_addr.s6_addr[i]);
+        }
+        return Ipv6Prefix(dst->sin6_addr, l);
+    }
+
+    friend bool operator==(const Ipv6Prefix& a, const Ipv6Prefix& b) noexcept {
+        return a.len == b.len && std::memcmp(&a.addr, &b.addr, sizeof(a.addr)) == 0;
+    }
+    friend bool operator!=(const Ipv6Prefix& a, const Ipv6Prefix& b) noexcept {
+        return !(a == b);
+    }
+
+private:
+    static uint8_t clamp(int l) noexcept {
+        return static_cast<uint8_t>(l < 0 ? 0 : (l > max_len ? max_len : l));
+    }
+    /* Byte @i of the netmask of @l bits */
+    static uint8_t mask_byte(int l, int i) noexcept {
+        int bits = l - i * 8;
+
+        if (bits >= 8) {
+            return 0xff;
+        }
+        return bits <= 0 ? 0 : static_cast<uint8_t>(0xff << (8 - bits));
+    }
+};
+
+template <class Prefix>
+class RouteView;
+
+/*
+ * An epoch section, route_epoch_enter() to route_epoch_exit(), for the
+ * life of the guard. Guards nest and move, but stay on the thread that
+ * made them, which must not change a table while holding one.
+ */
+class EpochGuard {
+public:
+    EpochGuard() noexcept : held_(true) { route_epoch_enter(); }
+    ~EpochGuard() { reset(); }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+
+    EpochGuard(EpochGuard&& other) noexcept : held_(std::exchange(other.held_, false)) {}
+    EpochGuard& operator=(EpochGuard&& other) noexcept {
+        if (this != &other) {
+            reset();
+            held_ = std::exchange(other.held_, false);
+        }
+        return *this;
+    }
+
+    explicit operator bool() const noexcept { return held_; }
+
+    /* Leaves the section before the guard goes away */
+    void reset() noexcept {
+        if (held_) {
+            route_epoch_exit();
+            held_ = false;
+        }
+    }
+
+private:
+    template <class Prefix>
+    friend class RouteView;
+
+    struct empty_tag {};
+    explicit EpochGuard(empty_tag) noexcept : held_(false) {}
+
+    bool held_;
+};
+
+/*
+ * A route returned by lookup() or passed to walk(). Its pointers refer to
+ * the route entry. A view from lookup() holds the epoch guard of the
+ * lookup, so they stay valid for as long as the view exists; views move
+ * but do not copy. A view passed to walk() is valid during the call.
+ * A default constructed view, or the one of a missed lookup, is empty.
+ */
+template <class Prefix>
+class RouteView {
+public:
+    RouteView() noexcept : ri_{}, guard_(EpochGuard::empty_tag{}) {}
+    explicit RouteView(const route_info& ri) noexcept
+        : ri_(ri), guard_(EpochGuard::empty_tag{}) {}
+    RouteView(const route_info& ri, EpochGuard&& guard) noexcept
+        : ri_(ri), guard_(std::move(guard)) {}
+
+    /* A moved-from view is empty, its section went with the route */
+    RouteView(RouteView&& other) noexcept
+        : ri_(std::exchange(other.ri_, route_info{})), guard_(std::move(other.guard_)) {}
+    RouteView& operator=(RouteView&& other) noexcept {
+        ri_ = std::exchange(other.ri_, route_info{});
+        guard_ = std::move(other.guard_);
+        return *this;
+    }
+
+    explicit operator bool() const noexcept { return ri_.ri_dst != nullptr; }
+
+    /* Empties the view, leaving its epoch section */
+    void reset() noexcept { *this = RouteView(); }
+
+    Prefix prefix() const noexcept { return Prefix::from_route(ri_); }
+    const sockaddr* gateway() const noexcept { return ri_.ri_gateway; }
+    int flags() const noexcept { return ri_.ri_flags; }
+    int ifindex() const noexcept { return ri_.ri_ifindex; }
+    u_int fibnum() const noexcept { return ri_.ri_fibnum; }
+    const route_info& info() const noexcept { return ri_; }
+
+private:
+    route_info ri_;
+    EpochGuard guard_;
+};
+
+/*
+ * Owner of one route_lib table of the Prefix family. Handles move but do
+ * not copy; the table is destroyed with the last handle owning it.
+ */
+template <class Prefix>
+class RibTable {
+public:
+    using address_type = typename Prefix::address_type;
+    using sockaddr_type = typename Prefix::sockaddr_type;
+    using view_type = RouteView<Prefix>;
+
+    static constexpr int default_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+
+    RibTable() noexcept : rh_(nullptr) {}
+    /* Takes ownership of @rh */
+    explicit RibTable(rib_head* rh) noexcept : rh_(rh) {}
+    ~RibTable() { reset(); }
+
+    RibTable(const RibTable&) = delete;
+    RibTable& operator=(const RibTable&) = delete;
+
+    RibTable(RibTable&& other) noexcept : rh_(other.release()) {}
+    RibTable& operator=(RibTable&& other) noexcept {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+
+    /* Table @fibnum; empty handle with errno set on failure */
+    static RibTable create(u_int fibnum) noexcept {
+        return RibTable(route_table_create(Prefix::family, fibnum));
+    }
+
+    explicit operator bool() const noexcept { return rh_ != nullptr; }
+    rib_head* get() const noexcept { return rh_; }
+
+    rib_head* release() noexcept {
+        rib_head* rh = rh_;
+
+        rh_ = nullptr;
+        return rh;
+    }
+    void reset(rib_head* rh = nullptr) noexcept {
+        if (rh_ != nullptr) {
+            route_table_destroy(rh_);
+        }
+        rh_ = rh;
+    }
+
+    /* Adds @p via @gw; full length prefixes are added as host routes */
+    int add(const Prefix& p, const address_type& gw, int flags = default_flags,
+            int ifindex = 0) noexcept {
+        sockaddr_type gw_sa;
+
+        Prefix::make_sockaddr(gw_sa, gw);
+        return add(p, reinterpret_cast<sockaddr*>(&gw_sa), flags, ifindex);
+    }
+    int add(const Prefix& p, const sockaddr* gw, int flags = default_flags,
+            int ifindex = 0) noexcept {
+        sockaddr_type dst, mask;
+        route_info ri;
+
+        std::memset(&ri, 0, sizeof(ri));
+        Prefix::make_sockaddr(dst, p.addr);
+        ri.ri_dst = reinterpret_cast<sockaddr*>(&dst);
+        if (p.len < Prefix::max_len) {
+            p.make_netmask(mask);
+            ri.ri_netmask = reinterpret_cast<sockaddr*>(&mask);
+        } else {
+            flags |= ROUTE_RTF_HOST;
+        }
+        ri.ri_gateway = const_cast<sockaddr*>(gw);
+        ri.ri_flags = flags;
+        ri.ri_ifindex = ifindex;
+        return route_add(rh_, &ri);
+    }
+
+    int remove(const Prefix& p) noexcept {
+        sockaddr_type dst, mask;
+
+        Prefix::make_sockaddr(dst, p.addr);
+        if (p.len == Prefix::max_len) {
+            return route_delete(rh_, reinterpret_cast<sockaddr*>(&dst), nullptr);
+        }
+        p.make_netmask(mask);
+        return route_delete(rh_, reinterpret_cast<sockaddr*>(&dst),
+                            reinterpret_cast<sockaddr*>(&mask));
+    }
+
+    /* Longest match of @dst, an empty view if there is none */
+    view_type lookup(const address_type& dst) const noexcept {
+        EpochGuard guard;
+        sockaddr_type sa;
+        route_info ri;
+
+        Prefix::make_sockaddr(sa, dst);
+        if (route_lookup(rh_, reinterpret_cast<sockaddr*>(&sa), &ri) != ROUTE_OK) {
+            return view_type();
+        }
+        return view_type(ri, std::move(guard));
+    }
+
+    /*
+     * Calls @f with the view of each route, in route_walk() order. @f
+     * returns void, or a value that ends the walk when non-zero as the
+     * return of a route_walker_f does. Returns what route_walk() does.
+     */
+    template <class F>
+    int walk(F&& f) const {
+        using Fn = std::remove_reference_t<F>;
+
+        return route_walk(rh_, &walk_thunk<Fn>,
+                          const_cast<void*>(static_cast<const void*>(std::addressof(f))));
+    }
+
+private:
+    template <class Fn>
+    static int walk_thunk(route_info* ri, void* arg) {
+        Fn& f = *static_cast<Fn*>(arg);
+
+        if constexpr (std::is_void_v<std::invoke_result_t<Fn&, view_type>>) {
+            f(view_type(*ri));
+            return 0;
+        } else {
+            return f(view_type(*ri)) ? 1 : 0;
+        }
+    }
+
+    rib_head* rh_;
+};
+
+using Rib4 = RibTable<Ipv4Prefix>;
+using Rib6 = RibTable<Ipv6Prefix>;
+
+} /* namespace route */
+
+#endif /* _ROUTE_LIB_HPP_ */
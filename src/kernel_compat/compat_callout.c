@@ -0,0 +1,572 @@
+/*
+ * Userland Callout and Taskqueue Implementation
+ *
+ * - Worker pool: one deque per worker thread. Tasks enqueued from a
+ *   worker go to the owner end of its deque and are popped LIFO, tasks
+ *   enqueued from other threads are spread round-robin. A worker whose
+ *   deque is empty steals from the other end of the other deques before
+ *   going to sleep.
+ * - Task state (queued/running/pending count) is protected by the pool
+ *   lock, deques by their own locks. Lock order: pool, then deque.
+ * - Timer wheel: CALLOUT_WHEEL_SIZE slots of 1ms, callouts hashed by
+ *   expiry time. The timer thread sleeps until the next occupied slot,
+ *   expired callouts are handed to the pool. Lock order: wheel, then
+ *   pool.
+ */
+
+#include "compat_shim.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TASK_WORKERS_MIN        2
+#define TASK_WORKERS_MAX        16
+#define TASK_CACHE_LINE         64
+
+#define CALLOUT_WHEEL_SIZE      512     /* Power of 2, ms */
+#define CALLOUT_WHEEL_MASK      (CALLOUT_WHEEL_SIZE - 1)
+
+struct task_worker {
+    pthread_mutex_t         tw_lock;        /* Protects the deque */
+    struct task            *tw_head;        /* Owner end */
+    struct task            *tw_tail;        /* Thieves end */
+    pthread_t               tw_thread;
+    int                     tw_id;
+} __attribute__((aligned(TASK_CACHE_LINE)));
+
+struct task_pool {
+    pthread_mutex_t         tp_lock;        /* Task state, idle workers */
+    pthread_cond_t          tp_cv;          /* Wakes idle workers */
+    pthread_cond_t          tp_done_cv;     /* Wakes taskqueue_drain() */
+    _Atomic unsigned int    tp_queued;      /* Tasks in the deques */
+    int                     tp_idle;
+    int                     tp_nworkers;
+    _Atomic unsigned int    tp_next;        /* Round-robin for non-workers */
+    struct task_worker      tp_workers[TASK_WORKERS_MAX];
+};
+
+struct callout_wheel {
+    pthread_mutex_t         cw_lock;        /* Protects wheel and callouts */
+    pthread_cond_t          cw_cv;          /* Wakes the timer thread */
+    struct callout         *cw_slots[CALLOUT_WHEEL_SIZE];
+    uint64_t                cw_tick;        /* Last processed ms */
+    uint64_t                cw_wakeup;      /* Timer thread sleeps until */
+    u_int                   cw_count;       /* Callouts on the wheel */
+    pthread_t               cw_thread;
+};
+
+struct taskqueue {
+    const char             *tq_name;
+};
+
+static struct taskqueue taskqueue_thread_tq = { "thread" };
+static struct taskqueue taskqueue_fast_tq = { "fast" };
+struct taskqueue *taskqueue_thread = &taskqueue_thread_tq;
+struct taskqueue *taskqueue_fast = &taskqueue_fast_tq;
+
+static struct task_pool task_pool = {
+    .tp_lock = PTHREAD_MUTEX_INITIALIZER,
+    .tp_cv = PTHREAD_COND_INITIALIZER,
+    .tp_done_cv = PTHREAD_COND_INITIALIZER,
+};
+
+static struct callout_wheel callout_wheel = {
+    .cw_lock = PTHREAD_MUTEX_INITIALIZER,
+    .cw_cv = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t task_pool_once = PTHREAD_ONCE_INIT;
+static pthread_once_t callout_wheel_once = PTHREAD_ONCE_INIT;
+static __thread struct task_worker *task_curworker;
+
+static void *task_worker_thread(void *arg);
+static void *callout_wheel_thread(void *arg);
+static void callout_task(void *context, int pending);
+
+uint64_t
+callout_compat_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * Worker pool
+ */
+
+static void
+task_pool_start(void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = (ncpu < TASK_WORKERS_MIN) ? TASK_WORKERS_MIN :
+        (ncpu > TASK_WORKERS_MAX) ? TASK_WORKERS_MAX : (int)ncpu;
+
+    for (int i = 0; i < n; i++) {
+        struct task_worker *tw = &task_pool.tp_workers[i];
+
+        pthread_mutex_init(&tw->tw_lock, NULL);
+        tw->tw_id = i;
+    }
+    task_pool.tp_nworkers = n;
+    for (int i = 0; i < n; i++) {
+        struct task_worker *tw = &task_pool.tp_workers[i];
+
+        if (pthread_create(&tw->tw_thread, NULL, task_worker_thread, tw) != 0) {
+            panic("task_pool_start: unable to create worker");
+        }
+        pthread_detach(tw->tw_thread);
+    }
+}
+
+/* Pushes @task to the owner end of @tw. Pool lock held. */
+static void
+task_push(struct task_worker *tw, struct task *task)
+{
+    pthread_mutex_lock(&tw->tw_lock);
+    task->ta_prev = NULL;
+    task->ta_next = tw->tw_head;
+    if (tw->tw_head != NULL)
+        tw->tw_head->ta_prev = task;
+    else
+        tw->tw_tail = task;
+    tw->tw_head = task;
+    task->ta_worker = tw;
+    pthread_mutex_unlock(&tw->tw_lock);
+    atomic_fetch_add(&task_pool.tp_queued, 1);
+}
+
+/* Unlinks @task from @tw. Deque lock held. */
+static void
+task_unlink(struct task_worker *tw, struct task *task)
+{
+    if (task->ta_prev != NULL)
+        task->ta_prev->ta_next = task->ta_next;
+    else
+        tw->tw_head = task->ta_next;
+    if (task->ta_next != NULL)
+        task->ta_next->ta_prev = task->ta_prev;
+    else
+        tw->tw_tail = task->ta_prev;
+    task->ta_next = task->ta_prev = NULL;
+    task->ta_worker = NULL;
+    atomic_fetch_sub(&task_pool.tp_queued, 1);
+}
+
+/* Takes a task from the owner end of @tw, or from the thieves end when @steal */
+static struct task *
+task_take(struct task_worker *tw, bool steal)
+{
+    struct task *task;
+
+    pthread_mutex_lock(&tw->tw_lock);
+    task = steal ? tw->tw_tail : tw->tw_head;
+    if (task != NULL)
+        task_unlink(tw, task);
+    pthread_mutex_unlock(&tw->tw_lock);
+    return task;
+}
+
+static struct task *
+task_next(struct task_worker *self)
+{
+    struct task *task;
+    int n = task_pool.tp_nworkers;
+
+    if ((task = task_take(self, false)) != NULL)
+        return task;
+    for (int i = 1; i < n; i++) {
+        struct task_worker *victim = &task_pool.tp_workers[(self->tw_id + i) % n];
+
+        if ((task = task_take(victim, true)) != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+static void
+task_run(struct task_worker *self, struct task *task)
+{
+    int pending;
+
+    pthread_mutex_lock(&task_pool.tp_lock);
+    pending = task->ta_pending;
+    task->ta_pending = 0;
+    task->ta_flags = (task->ta_flags & ~TASK_QUEUED) | TASK_RUNNING;
+    pthread_mutex_unlock(&task_pool.tp_lock);
+
+    task->ta_func(task->ta_context, pending);
+
+    pthread_mutex_lock(&task_pool.tp_lock);
+    task->ta_flags &= ~TASK_RUNNING;
+    if (task->ta_pending > 0) {
+        /* Enqueued while running, run it again */
+        task->ta_flags |= TASK_QUEUED;
+        task_push(self, task);
+    }
+    pthread_cond_broadcast(&task_pool.tp_done_cv);
+    pthread_mutex_unlock(&task_pool.tp_lock);
+}
+
+static void *
+task_worker_thread(void *arg)
+{
+    struct task_worker *self = arg;
+    struct task *task;
+
+    task_curworker = self;
+    for (;;) {
+        if ((task = task_next(self)) != NULL) {
+            task_run(self, task);
+            continue;
+        }
+        pthread_mutex_lock(&task_pool.tp_lock);
+        if (atomic_load(&task_pool.tp_queued) == 0) {
+            task_pool.tp_idle++;
+            pthread_cond_wait(&task_pool.tp_cv, &task_pool.tp_lock);
+            task_pool.tp_idle--;
+        }
+        pthread_mutex_unlock(&task_pool.tp_lock);
+    }
+    return NULL;
+}
+
+int
+taskqueue_enqueue(struct taskqueue *tq, struct task *task)
+{
+    struct task_worker *tw;
+
+    (void)tq;
+    pthread_once(&task_pool_once, task_pool_start);
+
+    pthread_mutex_lock(&task_pool.tp_lock);
+    if (task->ta_flags & (TASK_QUEUED | TASK_RUNNING)) {
+        /* Coalesce, a running task is requeued when it returns */
+        if (task->ta_pending < USHRT_MAX)
+            task->ta_pending++;
+        pthread_mutex_unlock(&task_pool.tp_lock);
+        return 0;
+    }
+    task->ta_pending = 1;
+    task->ta_flags |= TASK_QUEUED;
+    tw = task_curworker;
+    if (tw == NULL) {
+        tw = &task_pool.tp_workers[atomic_fetch_add(&task_pool.tp_next, 1) %
+            task_pool.tp_nworkers];
+    }
+    task_push(tw, task);
+    if (task_pool.tp_idle > 0)
+        pthread_cond_signal(&task_pool.tp_cv);
+    pthread_mutex_unlock(&task_pool.tp_lock);
+    return 0;
+}
+
+/*
+ * Removes @task from the pool if it has not started yet.
+ * Returns EBUSY if it is running or about to run, 0 otherwise.
+ */
+int
+taskqueue_cancel(struct taskqueue *tq, struct task *task, u_int *pendp)
+{
+    struct task_worker *tw;
+    int error = 0;
+
+    (void)tq;
+    pthread_mutex_lock(&task_pool.tp_lock);
+    if (pendp != NULL)
+        *pendp = task->ta_pending;
+    if (task->ta_flags & TASK_RUNNING) {
+        error = EBUSY;
+    } else if (task->ta_flags & TASK_QUEUED) {
+        /* The deque of a queued task only changes under the pool lock */
+        tw = task->ta_worker;
+        if (tw != NULL) {
+            pthread_mutex_lock(&tw->tw_lock);
+            task_unlink(tw, task);
+            pthread_mutex_unlock(&tw->tw_lock);
+            task->ta_flags &= ~TASK_QUEUED;
+            task->ta_pending = 0;
+        } else {
+            /* Taken by a worker, which is waiting for the pool lock */
+            error = EBUSY;
+        }
+    }
+    pthread_mutex_unlock(&task_pool.tp_lock);
+    return error;
+}
+
+/* Returns true if @task is queued or running */
+static bool
+task_busy(struct task *task)
+{
+    bool busy;
+
+    pthread_mutex_lock(&task_pool.tp_lock);
+    busy = (task->ta_flags & (TASK_QUEUED | TASK_RUNNING)) != 0;
+    pthread_mutex_unlock(&task_pool.tp_lock);
+    return busy;
+}
+
+/* Waits until @task is neither queued nor running */
+void
+taskqueue_drain(struct taskqueue *tq, struct task *task)
+{
+    (void)tq;
+    pthread_mutex_lock(&task_pool.tp_lock);
+    while (task->ta_flags & (TASK_QUEUED | TASK_RUNNING))
+        pthread_cond_wait(&task_pool.tp_done_cv, &task_pool.tp_lock);
+    pthread_mutex_unlock(&task_pool.tp_lock);
+}
+
+/*
+ * Timer wheel
+ */
+
+static void
+callout_wheel_start(void)
+{
+    callout_wheel.cw_tick = callout_compat_now_ms();
+    if (pthread_create(&callout_wheel.cw_thread, NULL, callout_wheel_thread, NULL) != 0) {
+        panic("callout_wheel_start: unable to create timer thread");
+    }
+    pthread_detach(callout_wheel.cw_thread);
+}
+
+/* Wheel lock held */
+static void
+callout_unlink(struct callout *c)
+{
+    if (c->c_next != NULL)
+        c->c_next->c_prev = c->c_prev;
+    *c->c_prev = c->c_next;
+    c->c_next = NULL;
+    c->c_prev = NULL;
+    __atomic_fetch_and(&c->c_flags, ~CALLOUT_PENDING, __ATOMIC_RELAXED);
+    callout_wheel.cw_count--;
+}
+
+/* Runs expired callouts of the slot @idx. Wheel lock held. */
+static void
+callout_wheel_expire(u_int idx, uint64_t now)
+{
+    struct callout *c, *next;
+
+    for (c = callout_wheel.cw_slots[idx]; c != NULL; c = next) {
+        next = c->c_next;
+        if (c->c_time > now)
+            continue;
+        callout_unlink(c);
+        c->c_fire_gen = c->c_gen;
+        taskqueue_enqueue(taskqueue_fast, &c->c_task);
+    }
+}
+
+/* Returns the expiry time of the earliest occupied slot within a rotation */
+static uint64_t
+callout_wheel_next(uint64_t now)
+{
+    for (uint64_t t = now + 1; t <= now + CALLOUT_WHEEL_SIZE; t++) {
+        for (struct callout *c = callout_wheel.cw_slots[t & CALLOUT_WHEEL_MASK];
+             c != NULL; c = c->c_next) {
+            if (c->c_time <= t)
+                return t;
+        }
+    }
+    return now + CALLOUT_WHEEL_SIZE;
+}
+
+static void *
+callout_wheel_thread(void *arg)
+{
+    struct callout_wheel *cw = &callout_wheel;
+    struct timespec ts;
+    uint64_t now;
+
+    (void)arg;
+    pthread_mutex_lock(&cw->cw_lock);
+    for (;;) {
+        now = callout_compat_now_ms();
+        if (now - cw->cw_tick >= CALLOUT_WHEEL_SIZE) {
+            for (u_int i = 0; i < CALLOUT_WHEEL_SIZE; i++)
+                callout_wheel_expire(i, now);
+            cw->cw_tick = now;
+        } else {
+            while (cw->cw_tick < now) {
+                cw->cw_tick++;
+                callout_wheel_expire(cw->cw_tick & CALLOUT_WHEEL_MASK, now);
+            }
+        }
+
+        if (cw->cw_count == 0) {
+            cw->cw_wakeup = UINT64_MAX;
+            pthread_cond_wait(&cw->cw_cv, &cw->cw_lock);
+            continue;
+        }
+        cw->cw_wakeup = callout_wheel_next(now);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)(cw->cw_wakeup - now) * 1000000;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&cw->cw_cv, &cw->cw_lock, &ts);
+    }
+    return NULL;
+}
+
+/*
+ * Callouts
+ */
+
+void
+callout_init(struct callout *c, int mpsafe)
+{
+    (void)mpsafe;
+    memset(c, 0, sizeof(*c));
+    TASK_INIT(&c->c_task, 0, callout_task, c);
+}
+
+void
+callout_init_rm(struct callout *c, struct rmlock *rm, int flags)
+{
+    callout_init(c, 1);
+    c->c_rmlock = rm;
+    c->c_lflags = flags & (CALLOUT_RETURNUNLOCKED | CALLOUT_SHAREDLOCK);
+}
+
+/* Task handler, runs the callout unless it was stopped or rescheduled */
+static void
+callout_task(void *context, int pending)
+{
+    struct callout *c = context;
+    struct rm_priotracker tracker;
+    void (*func)(void *);
+    void *arg;
+    bool run;
+
+    (void)pending;
+    if (c->c_rmlock != NULL) {
+        if (c->c_lflags & CALLOUT_SHAREDLOCK)
+            rm_rlock(c->c_rmlock, &tracker);
+        else
+            rm_wlock(c->c_rmlock);
+    }
+
+    pthread_mutex_lock(&callout_wheel.cw_lock);
+    run = (c->c_fire_gen == c->c_gen) && !(c->c_flags & CALLOUT_PENDING);
+    if (run)
+        c->c_fire_gen = c->c_gen - 1;   /* Consumed, callout_stop() returns 0 */
+    func = c->c_func;
+    arg = c->c_arg;
+    pthread_mutex_unlock(&callout_wheel.cw_lock);
+
+    if (run)
+        func(arg);
+
+    if (c->c_rmlock != NULL && (!run || !(c->c_lflags & CALLOUT_RETURNUNLOCKED))) {
+        if (c->c_lflags & CALLOUT_SHAREDLOCK)
+            rm_runlock(c->c_rmlock, &tracker);
+        else
+            rm_wunlock(c->c_rmlock);
+    }
+}
+
+/*
+ * Schedules @c to run @func in @sbt from now, rescheduling it if it is
+ *  pending. @prec and @flags are ignored, expiry is rounded up to 1ms.
+ * Returns 1 if a pending callout was rescheduled, 0 otherwise.
+ */
+int
+callout_reset_sbt(struct callout *c, sbintime_t sbt, sbintime_t prec,
+                  void (*func)(void *), void *arg, int flags)
+{
+    struct callout_wheel *cw = &callout_wheel;
+    uint64_t ms, now;
+    int cancelled = 0;
+
+    (void)prec;
+    (void)flags;
+    ms = (sbt <= 0) ? 0 : (uint64_t)((sbt + SBT_1MS - 1) / SBT_1MS);
+    pthread_once(&callout_wheel_once, callout_wheel_start);
+
+    pthread_mutex_lock(&cw->cw_lock);
+    if (c->c_flags & CALLOUT_DRAINING) {
+        pthread_mutex_unlock(&cw->cw_lock);
+        return 0;
+    }
+    if (c->c_flags & CALLOUT_PENDING) {
+        callout_unlink(c);
+        cancelled = 1;
+    }
+    c->c_gen++;
+    c->c_func = func;
+    c->c_arg = arg;
+
+    /* Slots up to cw_tick have been processed in this rotation */
+    now = callout_compat_now_ms();
+    c->c_time = max(now + ms, cw->cw_tick + 1);
+    c->c_prev = &cw->cw_slots[c->c_time & CALLOUT_WHEEL_MASK];
+    c->c_next = *c->c_prev;
+    if (c->c_next != NULL)
+        c->c_next->c_prev = &c->c_next;
+    *c->c_prev = c;
+    __atomic_fetch_or(&c->c_flags, CALLOUT_PENDING | CALLOUT_ACTIVE, __ATOMIC_RELAXED);
+    cw->cw_count++;
+    if (c->c_time < cw->cw_wakeup)
+        pthread_cond_signal(&cw->cw_cv);
+    pthread_mutex_unlock(&cw->cw_lock);
+
+    return cancelled;
+}
+
+/*
+ * Cancels @c if it is pending or expired but not started yet.
+ * Does not wait for a running handler.
+ * Returns 1 if the callout was cancelled, 0 otherwise.
+ */
+int
+callout_stop(struct callout *c)
+{
+    struct callout_wheel *cw = &callout_wheel;
+    int cancelled = 0;
+
+    pthread_mutex_lock(&cw->cw_lock);
+    if (c->c_flags & CALLOUT_PENDING) {
+        callout_unlink(c);
+        cancelled = 1;
+    } else if (c->c_fire_gen == c->c_gen && task_busy(&c->c_task)) {
+        /* Expired, the handler checks c_gen before running */
+        cancelled = 1;
+    }
+    c->c_gen++;
+    __atomic_fetch_and(&c->c_flags, ~CALLOUT_ACTIVE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cw->cw_lock);
+
+    return cancelled;
+}
+
+/*
+ * Cancels @c and waits for a running handler to return. Reschedules
+ *  done by the handler meanwhile are ignored.
+ */
+int
+callout_drain(struct callout *c)
+{
+    int cancelled;
+
+    pthread_mutex_lock(&callout_wheel.cw_lock);
+    __atomic_fetch_or(&c->c_flags, CALLOUT_DRAINING, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&callout_wheel.cw_lock);
+
+    cancelled = callout_stop(c);
+    taskqueue_drain(taskqueue_fast, &c->c_task);
+
+    pthread_mutex_lock(&callout_wheel.cw_lock);
+    __atomic_fetch_and(&c->c_flags, ~CALLOUT_DRAINING, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&callout_wheel.cw_lock);
+
+    return cancelled;
+}
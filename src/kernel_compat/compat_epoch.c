@@ -0,0 +1,676 @@
+/*
+ * Userland Epoch Implementation
+ *
+ * Epoch-based reclamation for the FreeBSD routing code running in
+ * userland, modeled on the XNU backend (src/xnu_kernel):
+ *
+ * - Per-thread records: each reader thread registers a cache-line sized
+ *   record on first use. Entering a section publishes the current global
+ *   epoch in the record, leaving clears it. No shared cache line is
+ *   written on the read side.
+ * - Quiescent-state detection: a grace period advances the global epoch
+ *   and waits until every record is either idle or has observed the new
+ *   epoch.
+ * - Deferred callbacks: epoch_call() queues the context. A reclaimer
+ *   thread batches queued callbacks, runs one grace period per batch and
+ *   then invokes them.
+ * - Memory pressure: the callbacks queued or being run, and the bytes
+ *   they will free (epoch_call_size()), are weighed against two limits.
+ *   Past 90% of either, the reclaimer stops batching and reclaims right
+ *   away, so deferred frees stay bounded under churn. After each batch
+ *   the reclaimer hands the items it freed back to their UMA zones.
+ *
+ * Building with -DCOMPAT_EPOCH_XNU selects the XNU grace-period engine
+ * for the reclaimer: instead of spinning on the records until a grace
+ * period ends, it polls for its end every EPOCH_GP_POLL_MS and sleeps in
+ * between, so a long reader section costs no CPU. Under high pressure it
+ * polls back to back.
+ */
+
+#include "compat_shim.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* Records and epochs are plain libc allocations */
+#undef free
+
+#define EPOCH_MAX               8       /* Max epochs per process */
+#define EPOCH_CACHE_LINE        64
+#define EPOCH_RECLAIM_MS        10      /* Reclaimer batching interval */
+#define EPOCH_IDLE              0       /* Record not in a section */
+#define EPOCH_CB_LIMIT          (1024 * 1024)   /* Default pressure limit */
+#define EPOCH_MEM_LIMIT         (64 * 1024 * 1024)  /* Default byte limit */
+#ifdef COMPAT_EPOCH_XNU
+#define EPOCH_GP_POLL_MS        1       /* Grace period poll interval */
+#endif
+
+struct epoch_record {
+    _Atomic uint64_t        er_epoch;       /* Observed epoch or EPOCH_IDLE */
+    uint32_t                er_nesting;     /* Section nesting depth */
+    _Atomic int             er_active;      /* Record owned by a thread */
+    struct epoch_record    *er_next;        /* Epoch record list */
+    struct epoch           *er_parent;
+} __attribute__((aligned(EPOCH_CACHE_LINE)));
+
+struct epoch {
+    _Atomic uint64_t        e_epoch;        /* Global epoch counter */
+    char                    e_pad[EPOCH_CACHE_LINE - sizeof(uint64_t)];
+    const char             *e_name;
+    int                     e_flags;
+    int                     e_id;
+    uint64_t                e_gen;          /* Unique allocation number */
+    pthread_key_t           e_key;          /* Record release on thread exit */
+
+    pthread_mutex_t         e_lock;         /* Protects fields below */
+    struct epoch_record    *e_records;      /* All registered records */
+    pthread_mutex_t         e_cb_lock;      /* Protects callback queue */
+    pthread_cond_t          e_cb_cv;        /* Wakes the reclaimer */
+    pthread_cond_t          e_drain_cv;     /* Wakes drain waiters */
+    struct epoch_context   *e_cb_head;
+    struct epoch_context  **e_cb_tail;
+    uint64_t                e_cb_pending;   /* Queued, not yet run */
+    uint64_t                e_cb_inflight;  /* Taken by the reclaimer */
+    uint64_t                e_cb_bytes;     /* Bytes of the queued callbacks */
+    uint64_t                e_cb_inflight_bytes;
+    uint64_t                e_cb_limit;     /* Callbacks for full pressure */
+    uint64_t                e_mem_limit;    /* Bytes for full pressure */
+    int                     e_pressure;     /* EPOCH_PRESSURE_* */
+
+    pthread_t               e_reclaimer;
+    bool                    e_running;
+
+    /* Statistics */
+    _Atomic uint64_t        e_grace_periods;
+    _Atomic uint64_t        e_callbacks_done;
+    _Atomic uint64_t        e_emergency_reclaims;
+};
+
+static struct epoch *epoch_array[EPOCH_MAX];
+static uint64_t epoch_gen;
+static pthread_mutex_t epoch_array_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Thread record cache, validated by the epoch allocation number */
+static __thread struct {
+    uint64_t                gen;
+    struct epoch_record    *er;
+} epoch_thread_records[EPOCH_MAX];
+
+static void *epoch_reclaimer_thread(void *arg);
+
+/* Deferred callback batches: epoch, callbacks; grace is the end of the wait */
+SDT_PROBE_DEFINE2(route, epoch, reclaim, start, "epoch_t", "uint64_t");
+SDT_PROBE_DEFINE2(route, epoch, reclaim, grace, "epoch_t", "uint64_t");
+SDT_PROBE_DEFINE2(route, epoch, reclaim, done, "epoch_t", "uint64_t");
+/* Pressure level raised: epoch, level, callbacks outstanding */
+SDT_PROBE_DEFINE3(route, epoch, pressure, raise, "epoch_t", "int", "uint64_t");
+
+/* ===== Per-thread records ===== */
+
+static void
+epoch_record_release(void *arg)
+{
+    struct epoch_record *er = arg;
+
+    atomic_store_explicit(&er->er_epoch, EPOCH_IDLE, memory_order_release);
+    er->er_nesting = 0;
+    atomic_store_explicit(&er->er_active, 0, memory_order_release);
+}
+
+/*
+ * Returns the calling thread record for @epoch, registering a free or a
+ * new one on first use. Records are never freed while the epoch exists.
+ */
+static struct epoch_record *
+epoch_record_get(struct epoch *epoch)
+{
+    struct epoch_record *er;
+    int expected;
+
+    if (__predict_true(epoch_thread_records[epoch->e_id].gen == epoch->e_gen))
+        return epoch_thread_records[epoch->e_id].er;
+
+    pthread_mutex_lock(&epoch->e_lock);
+    for (er = epoch->e_records; er != NULL; er = er->er_next) {
+        expected = 0;
+        if (atomic_compare_exchange_strong(&er->er_active, &expected, 1))
+            break;
+    }
+    if (er == NULL) {
+        if (posix_memalign((void **)&er, EPOCH_CACHE_LINE, sizeof(*er)) != 0)
+            panic("epoch_record_get: out of memory");
+        memset(er, 0, sizeof(*er));
+        er->er_parent = epoch;
+        atomic_store(&er->er_active, 1);
+        er->er_next = epoch->e_records;
+        epoch->e_records = er;
+    }
+    pthread_mutex_unlock(&epoch->e_lock);
+
+    pthread_setspecific(epoch->e_key, er);
+    epoch_thread_records[epoch->e_id].gen = epoch->e_gen;
+    epoch_thread_records[epoch->e_id].er = er;
+    return er;
+}
+
+/* ===== Allocation ===== */
+
+epoch_t
+epoch_alloc(const char *name, int flags)
+{
+    struct epoch *epoch;
+    int id;
+
+    pthread_mutex_lock(&epoch_array_lock);
+    for (id = 0; id < EPOCH_MAX; id++) {
+        if (epoch_array[id] == NULL)
+            break;
+    }
+    if (id == EPOCH_MAX) {
+        pthread_mutex_unlock(&epoch_array_lock);
+        printf("[EPOCH] ERROR: No free epoch slots for '%s'\n", name);
+        return NULL;
+    }
+
+    if (posix_memalign((void **)&epoch, EPOCH_CACHE_LINE, sizeof(*epoch)) != 0) {
+        pthread_mutex_unlock(&epoch_array_lock);
+        return NULL;
+    }
+    memset(epoch, 0, sizeof(*epoch));
+    atomic_init(&epoch->e_epoch, 1);
+    epoch->e_name = name ? name : "unnamed_epoch";
+    epoch->e_flags = flags;
+    epoch->e_id = id;
+    epoch->e_gen = ++epoch_gen;
+    epoch->e_cb_tail = &epoch->e_cb_head;
+    epoch->e_cb_limit = EPOCH_CB_LIMIT;
+    epoch->e_mem_limit = EPOCH_MEM_LIMIT;
+    pthread_key_create(&epoch->e_key, epoch_record_release);
+    pthread_mutex_init(&epoch->e_lock, NULL);
+    pthread_mutex_init(&epoch->e_cb_lock, NULL);
+    pthread_cond_init(&epoch->e_cb_cv, NULL);
+    pthread_cond_init(&epoch->e_drain_cv, NULL);
+
+    epoch->e_running = true;
+    if (pthread_create(&epoch->e_reclaimer, NULL, epoch_reclaimer_thread,
+                       epoch) != 0) {
+        pthread_mutex_unlock(&epoch_array_lock);
+        printf("[EPOCH] ERROR: Failed to start reclaimer for '%s'\n",
+               epoch->e_name);
+        pthread_key_delete(epoch->e_key);
+        free(epoch);
+        return NULL;
+    }
+
+    epoch_array[id] = epoch;
+    pthread_mutex_unlock(&epoch_array_lock);
+
+    return epoch;
+}
+
+void
+epoch_free(epoch_t epoch)
+{
+    struct epoch_record *er, *next;
+
+    if (epoch == NULL)
+        return;
+
+    /* Run everything still queued, then stop the reclaimer */
+    epoch_drain_callbacks(epoch);
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    epoch->e_running = false;
+    pthread_cond_signal(&epoch->e_cb_cv);
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+    pthread_join(epoch->e_reclaimer, NULL);
+
+    pthread_mutex_lock(&epoch_array_lock);
+    epoch_array[epoch->e_id] = NULL;
+    pthread_mutex_unlock(&epoch_array_lock);
+
+    for (er = epoch->e_records; er != NULL; er = next) {
+        next = er->er_next;
+        free(er);
+    }
+    pthread_key_delete(epoch->e_key);
+    pthread_mutex_destroy(&epoch->e_lock);
+    pthread_mutex_destroy(&epoch->e_cb_lock);
+    pthread_cond_destroy(&epoch->e_cb_cv);
+    pthread_cond_destroy(&epoch->e_drain_cv);
+    free(epoch);
+}
+
+/* ===== Read side ===== */
+
+void
+epoch_enter_preempt(epoch_t epoch, epoch_tracker_t et)
+{
+    struct epoch_record *er;
+
+    if (epoch == NULL)
+        return;
+
+    er = epoch_record_get(epoch);
+    et->et_record = er;
+    if (er->er_nesting++ > 0)
+        return;
+
+    atomic_store_explicit(&er->er_epoch,
+        atomic_load_explicit(&epoch->e_epoch, memory_order_acquire),
+        memory_order_relaxed);
+    /* Publish the record before any protected data is read */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void
+epoch_exit_preempt(epoch_t epoch, epoch_tracker_t et)
+{
+    struct epoch_record *er;
+
+    if (epoch == NULL)
+        return;
+
+    er = et->et_record;
+    KASSERT(er != NULL && er->er_nesting > 0, ("epoch_exit: not in section"));
+    if (--er->er_nesting > 0)
+        return;
+
+    atomic_store_explicit(&er->er_epoch, EPOCH_IDLE, memory_order_release);
+}
+
+int
+in_epoch(epoch_t epoch)
+{
+    struct epoch_record *er;
+
+    if (epoch == NULL)
+        return 1;
+
+    if (epoch_thread_records[epoch->e_id].gen != epoch->e_gen)
+        return 0;
+    er = epoch_thread_records[epoch->e_id].er;
+    return (er->er_nesting > 0);
+}
+
+/* ===== Grace periods ===== */
+
+#ifdef COMPAT_EPOCH_XNU
+/*
+ * Tells whether all the readers that could have observed an epoch older
+ * than @target have left their sections, without waiting for them.
+ */
+static bool
+epoch_grace_done(struct epoch *epoch, uint64_t target)
+{
+    struct epoch_record *er;
+    uint64_t seen;
+    bool done = true;
+
+    pthread_mutex_lock(&epoch->e_lock);
+    for (er = epoch->e_records; er != NULL; er = er->er_next) {
+        seen = atomic_load_explicit(&er->er_epoch, memory_order_acquire);
+        if (seen != EPOCH_IDLE && seen < target) {
+            done = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&epoch->e_lock);
+
+    return done;
+}
+#endif
+
+/*
+ * Advances the global epoch and waits until all the readers that could
+ * have observed the previous one have left their sections.
+ */
+void
+epoch_wait_preempt(epoch_t epoch)
+{
+    struct epoch_record *er, *head;
+    uint64_t target, seen;
+    int spins;
+
+    if (epoch == NULL)
+        return;
+
+    KASSERT(!in_epoch(epoch), ("epoch_wait_preempt: called inside section"));
+
+    /* Order prior unlinks before the records are sampled */
+    target = atomic_fetch_add_explicit(&epoch->e_epoch, 1,
+                                       memory_order_seq_cst) + 1;
+
+    /*
+     * Records are only ever pushed at the head, so the list from the
+     * head sampled here stays walkable without the lock, which a reader
+     * registering its first section needs. Records pushed later enter
+     * at the new epoch and need no wait.
+     */
+    pthread_mutex_lock(&epoch->e_lock);
+    head = epoch->e_records;
+    pthread_mutex_unlock(&epoch->e_lock);
+
+    for (er = head; er != NULL; er = er->er_next) {
+        spins = 0;
+        for (;;) {
+            seen = atomic_load_explicit(&er->er_epoch, memory_order_acquire);
+            if (seen == EPOCH_IDLE || seen >= target)
+                break;
+            if (++spins > 100)
+                sched_yield();
+        }
+    }
+
+    atomic_fetch_add_explicit(&epoch->e_grace_periods, 1, memory_order_relaxed);
+}
+
+/* ===== Deferred callbacks ===== */
+
+static int
+epoch_pressure_level(uint64_t count, uint64_t limit)
+{
+
+    if (count > limit / 10 * 9)
+        return (EPOCH_PRESSURE_CRITICAL);
+    if (count > limit / 10 * 7)
+        return (EPOCH_PRESSURE_HIGH);
+    if (count > limit / 2)
+        return (EPOCH_PRESSURE_MODERATE);
+    return (EPOCH_PRESSURE_NORMAL);
+}
+
+/*
+ * Recomputes the pressure level from the callbacks queued or being run
+ * and the bytes they hold. Called with the callback lock held. Returns
+ * the new level.
+ */
+static int
+epoch_pressure_update(struct epoch *epoch)
+{
+    uint64_t count = epoch->e_cb_pending + epoch->e_cb_inflight;
+    uint64_t bytes = epoch->e_cb_bytes + epoch->e_cb_inflight_bytes;
+    int level, mem_level;
+
+    level = epoch_pressure_level(count, epoch->e_cb_limit);
+    mem_level = epoch_pressure_level(bytes, epoch->e_mem_limit);
+    if (mem_level > level)
+        level = mem_level;
+
+    if (level > epoch->e_pressure)
+        SDT_PROBE3(route, epoch, pressure, raise, epoch, level, count);
+    epoch->e_pressure = level;
+    return level;
+}
+
+/*
+ * Waits on the callback condition for up to @ms milliseconds.
+ * Called with the callback lock held.
+ */
+static void
+epoch_cb_timedwait(struct epoch *epoch, int ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += ms * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&epoch->e_cb_cv, &epoch->e_cb_lock, &ts);
+}
+
+void
+epoch_call(epoch_t epoch, epoch_callback_t callback, epoch_context_t ctx)
+{
+
+    epoch_call_size(epoch, callback, ctx, 0);
+}
+
+/*
+ * Same as epoch_call(), @size being the bytes @callback will free. They
+ * count against the memory limit until the callback has run.
+ */
+void
+epoch_call_size(epoch_t epoch, epoch_callback_t callback, epoch_context_t ctx,
+                size_t size)
+{
+
+    if (epoch == NULL) {
+        callback(ctx);
+        return;
+    }
+
+    ctx->ec_callback = callback;
+    ctx->ec_next = NULL;
+    ctx->ec_size = size;
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    *epoch->e_cb_tail = ctx;
+    epoch->e_cb_tail = &ctx->ec_next;
+    epoch->e_cb_bytes += size;
+    /* Critical pressure cuts the batching delay short */
+    if (epoch->e_cb_pending++ == 0 ||
+        (epoch->e_pressure < EPOCH_PRESSURE_CRITICAL &&
+         epoch_pressure_update(epoch) == EPOCH_PRESSURE_CRITICAL))
+        pthread_cond_signal(&epoch->e_cb_cv);
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+}
+
+/*
+ * Waits until every callback queued before the call has been run.
+ */
+void
+epoch_drain_callbacks(epoch_t epoch)
+{
+
+    if (epoch == NULL)
+        return;
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    /* Cut the batching delay short */
+    pthread_cond_signal(&epoch->e_cb_cv);
+    while (epoch->e_cb_pending > 0 || epoch->e_cb_inflight > 0)
+        pthread_cond_wait(&epoch->e_drain_cv, &epoch->e_cb_lock);
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+}
+
+/*
+ * Sets the number of outstanding callbacks @epoch weighs its memory
+ * pressure against.
+ */
+void
+epoch_set_callback_limit(epoch_t epoch, uint64_t limit)
+{
+
+    if (epoch == NULL)
+        return;
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    epoch->e_cb_limit = (limit > 0) ? limit : EPOCH_CB_LIMIT;
+    epoch_pressure_update(epoch);
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+}
+
+/*
+ * Sets the bytes of outstanding callbacks @epoch weighs its memory
+ * pressure against.
+ */
+void
+epoch_set_memory_limit(epoch_t epoch, uint64_t bytes)
+{
+
+    if (epoch == NULL)
+        return;
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    epoch->e_mem_limit = (bytes > 0) ? bytes : EPOCH_MEM_LIMIT;
+    epoch_pressure_update(epoch);
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+}
+
+/*
+ * Returns the memory pressure level of @epoch, EPOCH_PRESSURE_*.
+ */
+int
+epoch_pressure(epoch_t epoch)
+{
+    int level;
+
+    if (epoch == NULL)
+        return (EPOCH_PRESSURE_NORMAL);
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    level = epoch->e_pressure;
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+    return (level);
+}
+
+/*
+ * Returns the number of batches reclaimed without batching delay because
+ * of critical pressure.
+ */
+uint64_t
+epoch_emergency_reclaims(epoch_t epoch)
+{
+
+    if (epoch == NULL)
+        return (0);
+    return (atomic_load_explicit(&epoch->e_emergency_reclaims,
+                                 memory_order_relaxed));
+}
+
+/*
+ * Returns the number of callbacks queued or being run, a snapshot.
+ */
+uint64_t
+epoch_pending(epoch_t epoch)
+{
+    uint64_t pending;
+
+    if (epoch == NULL)
+        return (0);
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    pending = epoch->e_cb_pending + epoch->e_cb_inflight;
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+    return (pending);
+}
+
+/*
+ * Returns the bytes held by the callbacks queued or being run, a snapshot.
+ */
+uint64_t
+epoch_pending_bytes(epoch_t epoch)
+{
+    uint64_t bytes;
+
+    if (epoch == NULL)
+        return (0);
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    bytes = epoch->e_cb_bytes + epoch->e_cb_inflight_bytes;
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+    return (bytes);
+}
+
+/*
+ * Takes the queued callbacks as the next batch. Called with the callback
+ * lock held. Returns the batch and stores its size in @countp.
+ */
+static struct epoch_context *
+epoch_batch_take(struct epoch *epoch, uint64_t *countp)
+{
+    struct epoch_context *batch = epoch->e_cb_head;
+
+    *countp = epoch->e_cb_pending;
+    epoch->e_cb_head = NULL;
+    epoch->e_cb_tail = &epoch->e_cb_head;
+    epoch->e_cb_pending = 0;
+    epoch->e_cb_inflight = *countp;
+    epoch->e_cb_inflight_bytes = epoch->e_cb_bytes;
+    epoch->e_cb_bytes = 0;
+    if (epoch->e_pressure == EPOCH_PRESSURE_CRITICAL)
+        atomic_fetch_add_explicit(&epoch->e_emergency_reclaims, 1,
+                                  memory_order_relaxed);
+    return batch;
+}
+
+/*
+ * Runs the @count callbacks of @batch, whose grace period has ended, and
+ * returns the items they freed to their zone depots, where allocating
+ * threads pick them up instead of carving new slabs.
+ * Called without the callback lock, returns with it held.
+ */
+static void
+epoch_batch_run(struct epoch *epoch, struct epoch_context *batch,
+                uint64_t count)
+{
+    struct epoch_context *ctx;
+
+    SDT_PROBE2(route, epoch, reclaim, grace, epoch, count);
+    while ((ctx = batch) != NULL) {
+        batch = ctx->ec_next;
+        ctx->ec_callback(ctx);
+    }
+    uma_thread_flush();
+    SDT_PROBE2(route, epoch, reclaim, done, epoch, count);
+    atomic_fetch_add_explicit(&epoch->e_callbacks_done, count,
+                              memory_order_relaxed);
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    epoch->e_cb_inflight = 0;
+    epoch->e_cb_inflight_bytes = 0;
+    epoch_pressure_update(epoch);
+    pthread_cond_broadcast(&epoch->e_drain_cv);
+}
+
+static void *
+epoch_reclaimer_thread(void *arg)
+{
+    struct epoch *epoch = arg;
+    struct epoch_context *batch;
+    uint64_t count;
+#ifdef COMPAT_EPOCH_XNU
+    uint64_t target;
+#endif
+
+    pthread_mutex_lock(&epoch->e_cb_lock);
+    for (;;) {
+        while (epoch->e_cb_pending == 0 && epoch->e_running)
+            pthread_cond_wait(&epoch->e_cb_cv, &epoch->e_cb_lock);
+        if (epoch->e_cb_pending == 0 && !epoch->e_running)
+            break;
+
+        /* Let more callbacks accumulate to amortize the grace period */
+        if (epoch->e_running && epoch->e_pressure < EPOCH_PRESSURE_CRITICAL)
+            epoch_cb_timedwait(epoch, EPOCH_RECLAIM_MS);
+
+        batch = epoch_batch_take(epoch, &count);
+        pthread_mutex_unlock(&epoch->e_cb_lock);
+
+        SDT_PROBE2(route, epoch, reclaim, start, epoch, count);
+#ifdef COMPAT_EPOCH_XNU
+        /* Poll for the end of the grace period instead of spinning */
+        target = atomic_fetch_add_explicit(&epoch->e_epoch, 1,
+                                           memory_order_seq_cst) + 1;
+        while (!epoch_grace_done(epoch, target)) {
+            pthread_mutex_lock(&epoch->e_cb_lock);
+            if (epoch->e_pressure < EPOCH_PRESSURE_HIGH && epoch->e_running)
+                epoch_cb_timedwait(epoch, EPOCH_GP_POLL_MS);
+            pthread_mutex_unlock(&epoch->e_cb_lock);
+            sched_yield();
+        }
+        atomic_fetch_add_explicit(&epoch->e_grace_periods, 1,
+                                  memory_order_relaxed);
+#else
+        epoch_wait_preempt(epoch);
+#endif
+        epoch_batch_run(epoch, batch, count);
+    }
+    pthread_mutex_unlock(&epoch->e_cb_lock);
+
+    return NULL;
+}
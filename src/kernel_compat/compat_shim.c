@@ -2,17 +2,62 @@
  * Kernel Compatibility Implementation
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* MAP_HUGETLB, madvise() */
+#endif
+
+/* Before compat_shim.h overrides malloc() and free() */
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#define malloc_usable(ptr) malloc_size(ptr)
+#else
+#include <malloc.h>
+#define malloc_usable(ptr) malloc_usable_size(ptr)
+#endif
+
 #include "compat_shim.h"
 
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <mach/vm_statistics.h>
+#endif
+
 /* Global variables */
 int maxfib = 16;
 volatile time_t time_second;
 epoch_t net_epoch_preempt = NULL;
 struct thread* curthread = NULL;
 
+/* Counter slot of the current thread, 1-based so that 0 means unassigned */
+__thread int counter_curslot_id;
+static _Atomic unsigned int counter_next_slot;
+
+/* Read locks held by the current thread, for rmlock read recursion */
+__thread struct rm_priotracker *rm_curtrackers;
+__thread uint32_t rm_cursample;
+
 /* Initialize kernel compatibility layer */
 void kernel_compat_init(void) {
+    const char* probes = getenv("SDT_PROBES");
+
     time_second = time(NULL);
+    if (net_epoch_preempt == NULL)
+        net_epoch_preempt = epoch_alloc("net_epoch_preempt", EPOCH_PREEMPT);
+    if (probes != NULL) {
+        char buf[256], *p, *last;
+
+        snprintf(buf, sizeof(buf), "%s", probes);
+        for (p = strtok_r(buf, ",", &last); p; p = strtok_r(NULL, ",", &last))
+            sdt_probe_enable(p, true);
+    }
+}
+
+/* Assign counter slots to threads round-robin */
+int counter_slot_assign(void) {
+    counter_curslot_id = (int)(atomic_fetch_add(&counter_next_slot, 1) % COUNTER_SLOTS) + 1;
+    return counter_curslot_id;
 }
 
 /* Socket address comparison utility */
@@ -24,4 +69,369 @@ int sa_equal(const struct sockaddr* a, const struct sockaddr* b) {
         return 0;
 
     return (memcmp(a, b, a->sa_len) == 0);
-}
\ No newline at end of file
+}
+
+/* ===== Memory type accounting ===== */
+
+/* Counters of one thread slot, all types on the same cache lines */
+struct malloc_type_slot {
+    _Atomic int64_t     mt_bytes;
+    _Atomic int64_t     mt_objects;
+    _Atomic uint64_t    mt_allocs;
+    _Atomic uint64_t    mt_frees;
+};
+
+static struct malloc_type_slot malloc_type_slots[COUNTER_SLOTS][M_NTYPES]
+    __attribute__((aligned(COUNTER_CACHE_LINE)));
+
+/* Approximate live bytes, for the high-water mark */
+static _Atomic int64_t malloc_type_cur[M_NTYPES];
+static _Atomic uint64_t malloc_type_hiwat[M_NTYPES];
+static __thread int64_t malloc_type_pending[M_NTYPES];
+
+static const char* malloc_type_names[M_NTYPES] = {
+    [0] = "other",
+    [M_RTABLE] = "routetbl",
+    [M_IFADDR] = "ifaddr",
+    [M_IFMADDR] = "ether_multi",
+    [M_RTMASK] = "rtmask",
+    [M_RTSADDR] = "rtsaddr",
+    [M_NHOP] = "nhops",
+    [M_NHGRP] = "nhgrp",
+    [M_TEMP] = "temp",
+};
+
+static inline int malloc_type_index(int type) {
+    return (type > 0 && type < M_NTYPES) ? type : 0;
+}
+
+/* Folds the bytes of the current thread into the high-water mark */
+static void malloc_type_settle(int type) {
+    int64_t cur;
+    uint64_t hiwat;
+
+    cur = atomic_fetch_add_explicit(&malloc_type_cur[type], malloc_type_pending[type],
+                                    memory_order_relaxed) + malloc_type_pending[type];
+    malloc_type_pending[type] = 0;
+    hiwat = atomic_load_explicit(&malloc_type_hiwat[type], memory_order_relaxed);
+    while (cur > 0 && (uint64_t)cur > hiwat &&
+           !atomic_compare_exchange_weak_explicit(&malloc_type_hiwat[type], &hiwat,
+                                                  (uint64_t)cur, memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+static void malloc_type_update(int type, int64_t bytes, bool alloc) {
+    struct malloc_type_slot* mt = &malloc_type_slots[counter_curslot()][type];
+
+    atomic_fetch_add_explicit(&mt->mt_bytes, bytes, memory_order_relaxed);
+    if (alloc) {
+        atomic_fetch_add_explicit(&mt->mt_objects, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&mt->mt_allocs, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_sub_explicit(&mt->mt_objects, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&mt->mt_frees, 1, memory_order_relaxed);
+    }
+
+    malloc_type_pending[type] += bytes;
+    if (malloc_type_pending[type] >= MALLOC_HIWAT_BATCH ||
+        malloc_type_pending[type] <= -MALLOC_HIWAT_BATCH)
+        malloc_type_settle(type);
+}
+
+void malloc_type_alloc(int type, void* ptr) {
+    malloc_type_update(malloc_type_index(type), (int64_t)malloc_usable(ptr), true);
+}
+
+void malloc_type_free(int type, void* ptr) {
+    malloc_type_update(malloc_type_index(type), -(int64_t)malloc_usable(ptr), false);
+}
+
+const char* malloc_type_name(int type) {
+    return malloc_type_names[malloc_type_index(type)];
+}
+
+void malloc_type_fetch(int type, struct malloc_type_stats* stats) {
+    int64_t bytes = 0, objects = 0;
+
+    type = malloc_type_index(type);
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < COUNTER_SLOTS; i++) {
+        struct malloc_type_slot* mt = &malloc_type_slots[i][type];
+
+        bytes += atomic_load_explicit(&mt->mt_bytes, memory_order_relaxed);
+        objects += atomic_load_explicit(&mt->mt_objects, memory_order_relaxed);
+        stats->mts_allocs += atomic_load_explicit(&mt->mt_allocs, memory_order_relaxed);
+        stats->mts_frees += atomic_load_explicit(&mt->mt_frees, memory_order_relaxed);
+    }
+    /* Slots are read one by one, so the sums may be briefly off */
+    stats->mts_bytes = (bytes > 0) ? (uint64_t)bytes : 0;
+    stats->mts_objects = (objects > 0) ? (uint64_t)objects : 0;
+    stats->mts_hiwat = atomic_load_explicit(&malloc_type_hiwat[type], memory_order_relaxed);
+    if (stats->mts_hiwat < stats->mts_bytes)
+        stats->mts_hiwat = stats->mts_bytes;
+}
+
+uint64_t malloc_type_total(void) {
+    struct malloc_type_stats mts;
+    uint64_t total = 0;
+
+    for (int type = 0; type < M_NTYPES; type++) {
+        malloc_type_fetch(type, &mts);
+        total += mts.mts_bytes;
+    }
+    return total;
+}
+
+/* Prints the types in use and the UMA zones, like vmstat -m and -z */
+void malloc_type_report(FILE* fp) {
+    struct malloc_type_stats mts;
+
+    fprintf(fp, "%-12s %12s %10s %12s %12s\n", "Type", "InUse", "MemUse", "HighUse",
+            "Requests");
+    for (int type = 0; type < M_NTYPES; type++) {
+        malloc_type_fetch(type, &mts);
+        if (mts.mts_allocs == 0)
+            continue;
+        fprintf(fp, "%-12s %12llu %9lluK %11lluK %12llu\n", malloc_type_names[type],
+                (unsigned long long)mts.mts_objects,
+                (unsigned long long)((mts.mts_bytes + 1023) / 1024),
+                (unsigned long long)((mts.mts_hiwat + 1023) / 1024),
+                (unsigned long long)mts.mts_allocs);
+    }
+    uma_zone_report(fp);
+}
+
+/* ===== Huge page backed memory ===== */
+
+static _Atomic uint64_t hugepage_regions;
+static _Atomic uint64_t hugepage_bytes;
+static _Atomic uint64_t hugepage_explicit;
+static _Atomic bool hugepage_explicit_failed;   /* None reserved, stop asking */
+
+void* hugepage_alloc(size_t size, bool* explicit) {
+    char *raw, *ptr;
+    size_t len;
+
+    size = roundup2(size, HUGEPAGE_SIZE);
+    if (explicit != NULL)
+        *explicit = false;
+
+    ptr = MAP_FAILED;
+    if (!atomic_load_explicit(&hugepage_explicit_failed, memory_order_relaxed)) {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#elif defined(__APPLE__) && defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+                   VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#endif
+        if (ptr == MAP_FAILED)
+            atomic_store_explicit(&hugepage_explicit_failed, true, memory_order_relaxed);
+    }
+    if (ptr != MAP_FAILED) {
+        atomic_fetch_add_explicit(&hugepage_explicit, 1, memory_order_relaxed);
+        if (explicit != NULL)
+            *explicit = true;
+    } else {
+        /* Over-map to align the region, then trim both ends */
+        len = size + HUGEPAGE_SIZE;
+        raw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        ptr = (char*)roundup2((uintptr_t)raw, HUGEPAGE_SIZE);
+        if (ptr > raw)
+            munmap(raw, ptr - raw);
+        if (raw + len > ptr + size)
+            munmap(ptr + size, raw + len - (ptr + size));
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    atomic_fetch_add_explicit(&hugepage_regions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hugepage_bytes, size, memory_order_relaxed);
+    return ptr;
+}
+
+void hugepage_free(void* ptr, size_t size) {
+    if (ptr == NULL)
+        return;
+    size = roundup2(size, HUGEPAGE_SIZE);
+    munmap(ptr, size);
+    atomic_fetch_sub_explicit(&hugepage_regions, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&hugepage_bytes, size, memory_order_relaxed);
+}
+
+void hugepage_fetch(struct hugepage_stats* stats) {
+    stats->hs_regions = atomic_load_explicit(&hugepage_regions, memory_order_relaxed);
+    stats->hs_bytes = atomic_load_explicit(&hugepage_bytes, memory_order_relaxed);
+    stats->hs_explicit = atomic_load_explicit(&hugepage_explicit, memory_order_relaxed);
+}
+
+/* Regions handed out by bsd_malloc(), few and large: a plain list */
+struct malloc_hugepage_region {
+    struct malloc_hugepage_region* mhr_next;
+    void*       mhr_ptr;
+    size_t      mhr_size;
+};
+
+_Atomic uint32_t malloc_hugepage_types;
+_Atomic uint64_t malloc_hugepage_live;
+static struct malloc_hugepage_region* malloc_hugepage_regions;
+static pthread_mutex_t malloc_hugepage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void malloc_type_set_hugepage(int type, bool enable) {
+    if (type <= 0 || type >= M_NTYPES)
+        return;
+    if (enable)
+        atomic_fetch_or_explicit(&malloc_hugepage_types, 1u << type, memory_order_relaxed);
+    else
+        atomic_fetch_and_explicit(&malloc_hugepage_types, ~(1u << type), memory_order_relaxed);
+}
+
+void* malloc_hugepage(size_t size, int type) {
+    struct malloc_hugepage_region* r;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return NULL;
+    if ((r->mhr_ptr = hugepage_alloc(size, NULL)) == NULL) {
+        (free)(r);
+        return NULL;
+    }
+    r->mhr_size = roundup2(size, HUGEPAGE_SIZE);
+
+    pthread_mutex_lock(&malloc_hugepage_lock);
+    r->mhr_next = malloc_hugepage_regions;
+    malloc_hugepage_regions = r;
+    atomic_fetch_add_explicit(&malloc_hugepage_live, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&malloc_hugepage_lock);
+
+    malloc_type_update(malloc_type_index(type), (int64_t)r->mhr_size, true);
+    return r->mhr_ptr;
+}
+
+/* Releases @ptr if it is a bsd_malloc() huge page region */
+bool free_hugepage(void* ptr, int type) {
+    struct malloc_hugepage_region *r, **rp;
+
+    pthread_mutex_lock(&malloc_hugepage_lock);
+    for (rp = &malloc_hugepage_regions; (r = *rp) != NULL; rp = &r->mhr_next) {
+        if (r->mhr_ptr == ptr) {
+            *rp = r->mhr_next;
+            atomic_fetch_sub_explicit(&malloc_hugepage_live, 1, memory_order_relaxed);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&malloc_hugepage_lock);
+    if (r == NULL)
+        return false;
+
+    malloc_type_update(malloc_type_index(type), -(int64_t)r->mhr_size, false);
+    hugepage_free(r->mhr_ptr, r->mhr_size);
+    (free)(r);
+    return true;
+}
+
+/* ===== Static tracepoints ===== */
+
+static struct sdt_probe* sdt_probes;
+static pthread_mutex_t sdt_probes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sdt_record sdt_ring[SDT_TRACE_RECORDS];
+static _Atomic uint64_t sdt_ring_pos;
+
+void sdt_probe_register(struct sdt_probe* probe) {
+    pthread_mutex_lock(&sdt_probes_lock);
+    probe->sdtp_next = sdt_probes;
+    sdt_probes = probe;
+    pthread_mutex_unlock(&sdt_probes_lock);
+}
+
+/* Enables or disables the probes matching @pattern, returns their number */
+int sdt_probe_enable(const char* pattern, bool enable) {
+    struct sdt_probe* probe;
+    int count = 0;
+
+    pthread_mutex_lock(&sdt_probes_lock);
+    for (probe = sdt_probes; probe; probe = probe->sdtp_next) {
+        if (fnmatch(pattern, probe->sdtp_name, 0) == 0) {
+            atomic_store_explicit(&probe->sdtp_enabled, enable, memory_order_relaxed);
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&sdt_probes_lock);
+    return count;
+}
+
+void sdt_probe_fire(struct sdt_probe* probe, uintptr_t a0, uintptr_t a1, uintptr_t a2,
+                    uintptr_t a3, uintptr_t a4) {
+    struct sdt_record* sr;
+    struct timespec ts;
+    uint64_t pos;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pos = atomic_fetch_add_explicit(&sdt_ring_pos, 1, memory_order_relaxed);
+    sr = &sdt_ring[pos & (SDT_TRACE_RECORDS - 1)];
+
+    /* Readers skip the record until its sequence matches */
+    atomic_store_explicit(&sr->sr_seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sr->sr_nsec = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    sr->sr_probe = probe;
+    sr->sr_slot = counter_curslot();
+    sr->sr_args[0] = a0;
+    sr->sr_args[1] = a1;
+    sr->sr_args[2] = a2;
+    sr->sr_args[3] = a3;
+    sr->sr_args[4] = a4;
+    atomic_store_explicit(&sr->sr_seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&probe->sdtp_fired, 1, memory_order_relaxed);
+}
+
+/*
+ * Copies up to @nrecs records following @pos to @recs and advances @pos.
+ * Records overwritten or still being written are skipped.
+ */
+size_t sdt_trace_read(struct sdt_record* recs, size_t nrecs, uint64_t* pos) {
+    uint64_t end = atomic_load_explicit(&sdt_ring_pos, memory_order_acquire);
+    size_t n = 0;
+
+    if (end - *pos > SDT_TRACE_RECORDS)
+        *pos = end - SDT_TRACE_RECORDS;
+    for (; *pos < end && n < nrecs; (*pos)++) {
+        struct sdt_record* sr = &sdt_ring[*pos & (SDT_TRACE_RECORDS - 1)];
+        struct sdt_record* out = &recs[n];
+
+        if (atomic_load_explicit(&sr->sr_seq, memory_order_acquire) != *pos + 1)
+            continue;
+        out->sr_nsec = sr->sr_nsec;
+        out->sr_probe = sr->sr_probe;
+        out->sr_slot = sr->sr_slot;
+        memcpy(out->sr_args, sr->sr_args, sizeof(out->sr_args));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&sr->sr_seq, memory_order_relaxed) != *pos + 1)
+            continue;
+        atomic_store_explicit(&out->sr_seq, *pos + 1, memory_order_relaxed);
+        n++;
+    }
+    return n;
+}
+
+/* Prints the records still in the ring, oldest first */
+void sdt_trace_dump(FILE* fp) {
+    struct sdt_record recs[64];
+    uint64_t pos = 0;
+    size_t n;
+
+    while ((n = sdt_trace_read(recs, 64, &pos)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            fprintf(fp, "%llu.%09llu %2d %s", (unsigned long long)(recs[i].sr_nsec / 1000000000ULL),
+                    (unsigned long long)(recs[i].sr_nsec % 1000000000ULL), recs[i].sr_slot,
+                    recs[i].sr_probe->sdtp_name);
+            for (int j = 0; j < SDT_MAX_ARGS; j++)
+                fprintf(fp, " %#lx", (unsigned long)recs[i].sr_args[j]);
+            fprintf(fp, "\n");
+        }
+    }
+}
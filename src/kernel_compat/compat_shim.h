@@ -18,6 +18,9 @@
 #include <assert.h>
 #include <time.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sched.h>
 
 /* Network headers */
 #include <sys/types.h>
@@ -66,15 +69,87 @@ typedef unsigned int bsd_rt_gen_t;
 #define M_NOWAIT    0x0001
 #define M_ZERO      0x0100
 
-/* Memory type tags (ignored in userland) */
-#define M_RTABLE    1
+/*
+ * Memory types (malloc(9) equivalent)
+ *
+ * Allocations are accounted per type in compat_shim.c: live bytes and
+ * objects in per-thread slots, plus a high-water mark of the bytes kept
+ * within MALLOC_HIWAT_BATCH per thread. Sizes are the usable size of
+ * the libc allocation, so the numbers include allocator rounding.
+ * malloc_type_report() shows them with the UMA zones (rtentries).
+ */
+#define M_RTABLE    1   /* Routing tables */
 #define M_IFADDR    2
 #define M_IFMADDR   3
+#define M_RTMASK    4   /* Radix netmasks and mask lists */
+#define M_RTSADDR   5   /* Route sockaddrs */
+#define M_NHOP      6   /* Nexthops */
+#define M_NHGRP     7   /* Nexthop groups */
+#define M_TEMP      8
+#define M_NTYPES    9   /* Type 0 holds unknown types */
+
+#define MALLOC_HIWAT_BATCH  (64 * 1024)
+
+struct malloc_type_stats {
+    uint64_t    mts_bytes;          /* Live bytes */
+    uint64_t    mts_objects;        /* Live allocations */
+    uint64_t    mts_allocs;         /* malloc() calls */
+    uint64_t    mts_frees;          /* free() calls */
+    uint64_t    mts_hiwat;          /* Most live bytes seen */
+};
+
+void malloc_type_alloc(int type, void* ptr);
+void malloc_type_free(int type, void* ptr);
+const char* malloc_type_name(int type);
+void malloc_type_fetch(int type, struct malloc_type_stats* stats);
+uint64_t malloc_type_total(void);
+void malloc_type_report(FILE* fp);
+
+/*
+ * Huge page backed memory
+ *
+ * hugepage_alloc() maps @size bytes, rounded up to and aligned on
+ * HUGEPAGE_SIZE: explicit huge pages when the system has some reserved
+ * (MAP_HUGETLB on Linux, superpages on macOS), otherwise regular pages
+ * with transparent huge pages requested through madvise(). *@explicit,
+ * if not NULL, tells which. Regions are returned with hugepage_free()
+ * and the same size.
+ *
+ * bsd_malloc() takes allocations of HUGEPAGE_MALLOC_MIN bytes or more
+ * from there for the types enabled with malloc_type_set_hugepage(), for
+ * large flat tables. UMA zones created with UMA_ZONE_HUGEPAGE do the same
+ * for their slabs once they hold a huge page worth of them.
+ */
+#define HUGEPAGE_SIZE       ((size_t)2 << 20)
+#define HUGEPAGE_MALLOC_MIN (HUGEPAGE_SIZE / 2)
+
+struct hugepage_stats {
+    uint64_t    hs_regions;         /* Regions mapped */
+    uint64_t    hs_bytes;           /* Memory they hold */
+    uint64_t    hs_explicit;        /* Regions on explicit huge pages */
+};
+
+void* hugepage_alloc(size_t size, bool* explicit);
+void hugepage_free(void* ptr, size_t size);
+void hugepage_fetch(struct hugepage_stats* stats);
+
+extern _Atomic uint32_t malloc_hugepage_types;  /* Bit per enabled type */
+extern _Atomic uint64_t malloc_hugepage_live;   /* bsd_malloc() regions */
+void malloc_type_set_hugepage(int type, bool enable);
+void* malloc_hugepage(size_t size, int type);
+bool free_hugepage(void* ptr, int type);
 
-/* Simple wrapper to handle M_ZERO flag */
 static inline void* bsd_malloc(size_t size, int type, int flags) {
-    (void)type; /* Ignored in userland */
-    void* ptr = malloc(size);
+    void* ptr;
+
+    if (size >= HUGEPAGE_MALLOC_MIN && type > 0 && type < M_NTYPES &&
+        (atomic_load_explicit(&malloc_hugepage_types, memory_order_relaxed) & (1u << type))) {
+        /* Mapped memory comes zeroed */
+        if ((ptr = malloc_hugepage(size, type)) != NULL) {
+            return ptr;
+        }
+    }
+    ptr = malloc(size);
     if (ptr && (flags & M_ZERO)) {
         memset(ptr, 0, size);
     }
@@ -82,11 +157,22 @@ static inline void* bsd_malloc(size_t size, int type, int flags) {
         fprintf(stderr, "FATAL: malloc failed\n");
         abort();
     }
+    if (ptr) {
+        malloc_type_alloc(type, ptr);
+    }
     return ptr;
 }
 
 static inline void bsd_free(void* ptr, int type) {
-    (void)type; /* Ignored in userland */
+    /* Huge page regions are aligned on their size, few heap blocks are */
+    if (((uintptr_t)ptr & (HUGEPAGE_SIZE - 1)) == 0 && ptr &&
+        atomic_load_explicit(&malloc_hugepage_live, memory_order_relaxed) != 0 &&
+        free_hugepage(ptr, type)) {
+        return;
+    }
+    if (ptr) {
+        malloc_type_free(type, ptr);
+    }
     free(ptr);
 }
 
@@ -96,43 +182,147 @@ static inline void bsd_free(void* ptr, int type) {
 #define malloc(size, type, flags) bsd_malloc(size, type, flags)
 #define free(ptr, type) bsd_free(ptr, type)
 
+/*
+ * UMA zones (compat_uma.c)
+ *
+ * Fixed-size items carved from per-zone slabs, with per-thread magazines
+ * in front of the zone lock. Same interface as uma(9); slab memory is
+ * only released by uma_zdestroy().
+ */
+struct uma_zone;
+typedef struct uma_zone* uma_zone_t;
+
+typedef int  (*uma_ctor)(void *mem, int size, void *arg, int flags);
+typedef void (*uma_dtor)(void *mem, int size, void *arg);
+typedef int  (*uma_init)(void *mem, int size, int flags);
+typedef void (*uma_fini)(void *mem, int size);
+
+#define UMA_ALIGN_PTR   (sizeof(void *) - 1)
+#define UMA_ALIGN_CACHE (64 - 1)
+
+#define UMA_ZONE_HUGEPAGE   0x01000000  /* Huge page slabs, see hugepage_alloc() */
+
+struct uma_zone_stats {
+    uint64_t    uzs_allocs;         /* uma_zalloc() calls */
+    uint64_t    uzs_frees;          /* uma_zfree() calls */
+    uint64_t    uzs_slabs;          /* Slabs allocated */
+    uint64_t    uzs_slab_bytes;     /* Memory held by slabs */
+    size_t      uzs_item_size;      /* Aligned item size */
+};
+
+uma_zone_t uma_zcreate(const char *name, size_t size, uma_ctor ctor,
+                       uma_dtor dtor, uma_init uminit, uma_fini fini,
+                       int align, uint32_t flags);
+void  uma_zdestroy(uma_zone_t zone);
+void *uma_zalloc_arg(uma_zone_t zone, void *arg, int flags);
+void  uma_zfree_arg(uma_zone_t zone, void *item, void *arg);
+int   uma_zone_get_cur(uma_zone_t zone);
+void  uma_zone_get_stats(uma_zone_t zone, struct uma_zone_stats *stats);
+void  uma_zone_report(FILE *fp);
+uint64_t uma_zone_total(void);
+void  uma_thread_flush(void);
+
+#define uma_zalloc(zone, flags) uma_zalloc_arg(zone, NULL, flags)
+#define uma_zfree(zone, item) uma_zfree_arg(zone, item, NULL)
+
 /* === Phase 5: Level 2 Threading - Real pthread-based rmlock === */
 
 /*
- * FreeBSD rmlock (Read-Mostly Lock) Implementation using pthread_rwlock_t
+ * FreeBSD rmlock (Read-Mostly Lock) Implementation
  *
  * Provides:
- * - Multiple concurrent readers
- * - Single exclusive writer
- * - Reader preference (FreeBSD rmlock behavior)
+ * - Multiple concurrent readers counted in per-thread slots: a reader
+ *   only writes the cache line of its slot, shared with no other lock
+ * - Single exclusive writer, which flags the lock and drains the slots
+ * - Writer preference: new readers back off while a writer is pending,
+ *   writers are served in arrival order
+ * - Optional fair mode (RM_FAIR or rm_wlock_advanced()): a writer first
+ *   lets in the readers which queued behind the previous writer
+ * - Read recursion, a thread holding the lock for read never blocks on it
  * - Lock tracking and debugging
+ *
+ * Statistics are accumulated with relaxed atomics, read side ones in the
+ * reader slots. Read hold times are sampled once every RM_STATS_SAMPLE
+ * acquisitions of a thread, so the read path only reads the clock on
+ * sampled sections. rm_get_stats() returns a snapshot.
  */
 
 /* Lock flags - must be defined before function implementations */
 #define RM_DUPOK    0x01
+#define RM_FAIR     0x100       /* Phase-fair writers by default */
 #define RA_LOCKED   0x01
 #define RA_WLOCKED  0x02
 
+#define RM_READER_SLOTS     64
+#define RM_CACHE_LINE       64
+
+#ifndef RM_STATS_SAMPLE
+#ifdef DEBUG_THREADING_VERBOSE
+#define RM_STATS_SAMPLE     1
+#else
+#define RM_STATS_SAMPLE     64          /* Power of 2 */
+#endif
+#endif
+
+struct rm_reader_slot {
+    _Atomic uint32_t    rs_readers;     /* Readers inside through this slot */
+    _Atomic uint64_t    rs_reads;       /* Read lock acquisitions */
+    _Atomic uint64_t    rs_contended;   /* Readers blocked by a writer */
+    _Atomic uint64_t    rs_samples;     /* Sampled read sections */
+    _Atomic uint64_t    rs_hold_ns;     /* Hold time of sampled sections */
+} __attribute__((aligned(RM_CACHE_LINE)));
+
+/* Snapshot of rmlock statistics */
+struct rm_stats {
+    uint64_t    rms_reads;              /* Read lock acquisitions */
+    uint64_t    rms_writes;             /* Write lock acquisitions */
+    uint64_t    rms_read_contended;     /* Readers blocked by a writer */
+    uint64_t    rms_write_contended;    /* Writers queued behind a writer */
+    uint64_t    rms_read_samples;       /* Sampled read sections */
+    uint64_t    rms_read_hold_ns;       /* Hold time of sampled read sections */
+    uint64_t    rms_write_wait_ns;      /* Time writers waited, drain included */
+    uint64_t    rms_write_hold_ns;      /* Time the lock was held for writing */
+    uint32_t    rms_readers;            /* Readers inside the lock */
+    uint32_t    rms_writers;            /* Writer pending or owning the lock */
+};
+
 struct rmlock {
-    pthread_rwlock_t    rw_lock;        /* Actual pthread read-write lock */
+    struct rm_reader_slot rm_slots[RM_READER_SLOTS];
+    _Atomic uint32_t   rm_writer;       /* Writer pending or owning the lock */
+    int                rm_flags;
+    pthread_mutex_t    rm_mtx;          /* Writer queue and blocked readers */
+    pthread_cond_t     rm_rcv;          /* Readers waiting for the writer */
+    pthread_cond_t     rm_wcv;          /* Writers waiting for their turn */
+    uint32_t           rm_rwaiters;     /* Blocked readers */
+    uint32_t           rm_wnext;        /* Writer tickets */
+    uint32_t           rm_wserving;
     const char         *name;           /* Lock name for debugging */
-    pthread_mutex_t     stats_lock;     /* Protects statistics */
-    uint32_t           readers;         /* Current reader count */
     uint32_t           writers;         /* Current writer count (0 or 1) */
-    uint64_t           total_reads;     /* Total read lock acquisitions */
-    uint64_t           total_writes;    /* Total write lock acquisitions */
+    _Atomic uint64_t   rm_writes;       /* Write lock acquisitions */
+    _Atomic uint64_t   rm_wcontended;   /* Writers queued behind a writer */
+    _Atomic uint64_t   rm_wwait_ns;     /* Time writers waited */
+    _Atomic uint64_t   rm_whold_ns;     /* Time held for writing */
+    uint64_t           rm_wstart;       /* Current write section start */
 #ifdef DEBUG_THREADING
     pthread_t          writer_thread;   /* Current writer thread */
-    struct timespec    last_acquire;    /* Last lock acquire time */
 #endif
 };
 
 struct rm_priotracker {
     pthread_t          thread_id;       /* Thread holding read lock */
     struct rmlock     *lock_ptr;        /* Back pointer to lock */
-    struct timespec    acquire_time;    /* When read lock was acquired */
+    uint64_t           rmp_start;       /* Sampled section start, 0 otherwise */
+    struct rm_reader_slot *rmp_slot;    /* Slot the reader is counted in */
+    struct rm_priotracker *rmp_next;    /* Read locks held by the thread */
 };
 
+/* Read locks held by the current thread, most recent first */
+extern __thread struct rm_priotracker *rm_curtrackers;
+/* Read acquisitions of the current thread, drives sampling */
+extern __thread uint32_t rm_cursample;
+
+static inline int counter_curslot(void);
+
 struct mtx {
     pthread_mutex_t    mutex;
     const char        *name;
@@ -147,25 +337,18 @@ rm_init_flags(struct rmlock *rm, const char *name, int flags)
 
     memset(rm, 0, sizeof(*rm));
     rm->name = name ? name : "unnamed_rmlock";
+    rm->rm_flags = flags;
 
-    /* Initialize pthread read-write lock with reader preference */
-    pthread_rwlockattr_t attr;
-    pthread_rwlockattr_init(&attr);
-    #ifdef __APPLE__
-    /* macOS doesn't have PTHREAD_RWLOCK_PREFER_READER_NP, but defaults to reader preference */
-    #endif
-
-    ret = pthread_rwlock_init(&rm->rw_lock, &attr);
-    pthread_rwlockattr_destroy(&attr);
+    ret = pthread_mutex_init(&rm->rm_mtx, NULL);
     if (ret != 0) {
-        printf("[RMLOCK] ERROR: Failed to init rwlock '%s': %d\n", rm->name, ret);
+        printf("[RMLOCK] ERROR: Failed to init mutex '%s': %d\n", rm->name, ret);
         return ret;
     }
-
-    ret = pthread_mutex_init(&rm->stats_lock, NULL);
-    if (ret != 0) {
-        pthread_rwlock_destroy(&rm->rw_lock);
-        printf("[RMLOCK] ERROR: Failed to init stats lock '%s': %d\n", rm->name, ret);
+    if ((ret = pthread_cond_init(&rm->rm_rcv, NULL)) != 0 ||
+        (ret = pthread_cond_init(&rm->rm_wcv, NULL)) != 0) {
+        pthread_cond_destroy(&rm->rm_rcv);
+        pthread_mutex_destroy(&rm->rm_mtx);
+        printf("[RMLOCK] ERROR: Failed to init condvars '%s': %d\n", rm->name, ret);
         return ret;
     }
 
@@ -173,104 +356,196 @@ rm_init_flags(struct rmlock *rm, const char *name, int flags)
     return 0;
 }
 
+static inline uint32_t
+rm_readers(struct rmlock *rm)
+{
+    uint32_t readers = 0;
+
+    for (int i = 0; i < RM_READER_SLOTS; i++)
+        readers += atomic_load_explicit(&rm->rm_slots[i].rs_readers, memory_order_relaxed);
+    return readers;
+}
+
+static inline uint64_t
+rm_nanotime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Counters are read one by one; the snapshot is not atomic as a whole */
+static inline void
+rm_get_stats(struct rmlock *rm, struct rm_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < RM_READER_SLOTS; i++) {
+        struct rm_reader_slot *slot = &rm->rm_slots[i];
+
+        stats->rms_readers += atomic_load_explicit(&slot->rs_readers, memory_order_relaxed);
+        stats->rms_reads += atomic_load_explicit(&slot->rs_reads, memory_order_relaxed);
+        stats->rms_read_contended += atomic_load_explicit(&slot->rs_contended,
+                                                          memory_order_relaxed);
+        stats->rms_read_samples += atomic_load_explicit(&slot->rs_samples, memory_order_relaxed);
+        stats->rms_read_hold_ns += atomic_load_explicit(&slot->rs_hold_ns, memory_order_relaxed);
+    }
+    stats->rms_writes = atomic_load_explicit(&rm->rm_writes, memory_order_relaxed);
+    stats->rms_write_contended = atomic_load_explicit(&rm->rm_wcontended, memory_order_relaxed);
+    stats->rms_write_wait_ns = atomic_load_explicit(&rm->rm_wwait_ns, memory_order_relaxed);
+    stats->rms_write_hold_ns = atomic_load_explicit(&rm->rm_whold_ns, memory_order_relaxed);
+    stats->rms_writers = atomic_load_explicit(&rm->rm_writer, memory_order_relaxed);
+}
+
 static inline void
 rm_destroy(struct rmlock *rm)
 {
-    if (rm->readers > 0 || rm->writers > 0) {
+    uint32_t readers = rm_readers(rm);
+
+    if (readers > 0 || rm->writers > 0) {
         printf("[RMLOCK] WARNING: Destroying '%s' with active locks (R:%u W:%u)\n",
-               rm->name, rm->readers, rm->writers);
+               rm->name, readers, rm->writers);
     }
 
+    struct rm_stats st;
+    rm_get_stats(rm, &st);
     printf("[RMLOCK] Destroying '%s' (Total: R=%llu W=%llu)\n",
-           rm->name, (unsigned long long)rm->total_reads, (unsigned long long)rm->total_writes);
+           rm->name, (unsigned long long)st.rms_reads, (unsigned long long)st.rms_writes);
 
-    pthread_rwlock_destroy(&rm->rw_lock);
-    pthread_mutex_destroy(&rm->stats_lock);
+    pthread_cond_destroy(&rm->rm_wcv);
+    pthread_cond_destroy(&rm->rm_rcv);
+    pthread_mutex_destroy(&rm->rm_mtx);
+}
+
+static inline int
+rm_rowned(struct rmlock *rm)
+{
+    for (struct rm_priotracker *t = rm_curtrackers; t != NULL; t = t->rmp_next) {
+        if (t->lock_ptr == rm)
+            return 1;
+    }
+    return 0;
 }
 
 static inline void
 rm_rlock(struct rmlock *rm, struct rm_priotracker *tracker)
 {
-    int ret;
-
-    /* Acquire read lock */
-    ret = pthread_rwlock_rdlock(&rm->rw_lock);
-    if (ret != 0) {
-        printf("[RMLOCK] FATAL: Read lock failed on '%s': %d\n", rm->name, ret);
-        abort();
+    struct rm_reader_slot *slot = &rm->rm_slots[counter_curslot() % RM_READER_SLOTS];
+
+    /*
+     * Announce the reader, then check for writers. The writer does the
+     * opposite, so one of them always sees the other.
+     * A recursing reader keeps the writer draining and goes in.
+     */
+    atomic_fetch_add_explicit(&slot->rs_readers, 1, memory_order_seq_cst);
+    if (__builtin_expect(atomic_load_explicit(&rm->rm_writer, memory_order_seq_cst) != 0, 0) &&
+        !rm_rowned(rm)) {
+        atomic_fetch_sub_explicit(&slot->rs_readers, 1, memory_order_release);
+
+        /* Writers update rm_writer under rm_mtx, so this cannot race */
+        atomic_fetch_add_explicit(&slot->rs_contended, 1, memory_order_relaxed);
+        pthread_mutex_lock(&rm->rm_mtx);
+        rm->rm_rwaiters++;
+        while (atomic_load_explicit(&rm->rm_writer, memory_order_relaxed) != 0)
+            pthread_cond_wait(&rm->rm_rcv, &rm->rm_mtx);
+        atomic_fetch_add_explicit(&slot->rs_readers, 1, memory_order_seq_cst);
+        if (--rm->rm_rwaiters == 0)
+            pthread_cond_broadcast(&rm->rm_wcv);
+        pthread_mutex_unlock(&rm->rm_mtx);
     }
+    atomic_fetch_add_explicit(&slot->rs_reads, 1, memory_order_relaxed);
 
     /* Set up tracker */
     tracker->thread_id = pthread_self();
     tracker->lock_ptr = rm;
-    clock_gettime(CLOCK_MONOTONIC, &tracker->acquire_time);
-
-    /* Update statistics */
-    pthread_mutex_lock(&rm->stats_lock);
-    rm->readers++;
-    rm->total_reads++;
-    pthread_mutex_unlock(&rm->stats_lock);
+    tracker->rmp_slot = slot;
+    tracker->rmp_next = rm_curtrackers;
+    rm_curtrackers = tracker;
+    tracker->rmp_start = 0;
+    if ((++rm_cursample & (RM_STATS_SAMPLE - 1)) == 0)
+        tracker->rmp_start = rm_nanotime();
 
 #ifdef DEBUG_THREADING_VERBOSE
     printf("[RMLOCK] Read lock acquired on '%s' by thread %lu (active readers: %u)\n",
-           rm->name, (unsigned long)tracker->thread_id, rm->readers);
+           rm->name, (unsigned long)tracker->thread_id, rm_readers(rm));
 #endif
 }
 
 static inline void
 rm_runlock(struct rmlock *rm, struct rm_priotracker *tracker)
 {
-    int ret;
-    struct timespec now, hold_time;
-
-    /* Calculate how long we held the lock */
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    hold_time.tv_sec = now.tv_sec - tracker->acquire_time.tv_sec;
-    hold_time.tv_nsec = now.tv_nsec - tracker->acquire_time.tv_nsec;
-    if (hold_time.tv_nsec < 0) {
-        hold_time.tv_sec--;
-        hold_time.tv_nsec += 1000000000L;
+    struct rm_reader_slot *slot = tracker->rmp_slot;
+    struct rm_priotracker **tp;
+    uint64_t hold_ns = 0;
+
+    /* Account how long sampled sections held the lock */
+    if (tracker->rmp_start != 0) {
+        hold_ns = rm_nanotime() - tracker->rmp_start;
+        atomic_fetch_add_explicit(&slot->rs_samples, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&slot->rs_hold_ns, hold_ns, memory_order_relaxed);
     }
 
-    /* Update statistics */
-    pthread_mutex_lock(&rm->stats_lock);
-    rm->readers--;
-    pthread_mutex_unlock(&rm->stats_lock);
+    for (tp = &rm_curtrackers; *tp != NULL; tp = &(*tp)->rmp_next) {
+        if (*tp == tracker) {
+            *tp = tracker->rmp_next;
+            break;
+        }
+    }
 
-    /* Release read lock */
-    ret = pthread_rwlock_unlock(&rm->rw_lock);
-    if (ret != 0) {
-        printf("[RMLOCK] FATAL: Read unlock failed on '%s': %d\n", rm->name, ret);
+    /* Release read lock, a draining writer polls the slot */
+    if (atomic_fetch_sub_explicit(&slot->rs_readers, 1, memory_order_release) == 0) {
+        printf("[RMLOCK] FATAL: Read unlock of unlocked '%s'\n", rm->name);
         abort();
     }
 
 #ifdef DEBUG_THREADING_VERBOSE
-    printf("[RMLOCK] Read lock released on '%s' by thread %lu (held %ld.%09ld sec)\n",
-           rm->name, (unsigned long)tracker->thread_id, hold_time.tv_sec, hold_time.tv_nsec);
+    printf("[RMLOCK] Read lock released on '%s' by thread %lu (held %llu ns)\n",
+           rm->name, (unsigned long)tracker->thread_id, (unsigned long long)hold_ns);
+#else
+    (void)rm;
+    (void)hold_ns;
 #endif
 }
 
+/*
+ * Acquires @rm for writing. In @fair_mode the writer waits for the
+ * readers blocked by previous writers to get in first.
+ */
 static inline void
-rm_wlock(struct rmlock *rm)
+rm_wlock_advanced(struct rmlock *rm, bool fair_mode)
 {
-    int ret;
-
-    /* Acquire exclusive write lock */
-    ret = pthread_rwlock_wrlock(&rm->rw_lock);
-    if (ret != 0) {
-        printf("[RMLOCK] FATAL: Write lock failed on '%s': %d\n", rm->name, ret);
-        abort();
+    uint64_t start = rm_nanotime();
+    uint32_t ticket;
+
+    pthread_mutex_lock(&rm->rm_mtx);
+    ticket = rm->rm_wnext++;
+    if (ticket != rm->rm_wserving)
+        atomic_fetch_add_explicit(&rm->rm_wcontended, 1, memory_order_relaxed);
+    while (ticket != rm->rm_wserving ||
+           atomic_load_explicit(&rm->rm_writer, memory_order_relaxed) != 0 ||
+           (fair_mode && rm->rm_rwaiters > 0))
+        pthread_cond_wait(&rm->rm_wcv, &rm->rm_mtx);
+    atomic_store_explicit(&rm->rm_writer, 1, memory_order_seq_cst);
+    pthread_mutex_unlock(&rm->rm_mtx);
+
+    /* Wait for the readers which got in before us */
+    for (int i = 0; i < RM_READER_SLOTS; i++) {
+        for (int spins = 0;
+             atomic_load_explicit(&rm->rm_slots[i].rs_readers, memory_order_acquire) != 0;
+             spins++) {
+            if (spins > 100)
+                sched_yield();
+        }
     }
 
-    /* Update statistics */
-    pthread_mutex_lock(&rm->stats_lock);
+    /* Update statistics, writes are timed as draining dwarfs the clock reads */
     rm->writers = 1;
-    rm->total_writes++;
+    rm->rm_wstart = rm_nanotime();
+    atomic_fetch_add_explicit(&rm->rm_writes, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&rm->rm_wwait_ns, rm->rm_wstart - start, memory_order_relaxed);
 #ifdef DEBUG_THREADING
     rm->writer_thread = pthread_self();
-    clock_gettime(CLOCK_MONOTONIC, &rm->last_acquire);
 #endif
-    pthread_mutex_unlock(&rm->stats_lock);
 
 #ifdef DEBUG_THREADING_VERBOSE
     printf("[RMLOCK] Write lock acquired on '%s' by thread %lu\n",
@@ -279,37 +554,32 @@ rm_wlock(struct rmlock *rm)
 }
 
 static inline void
-rm_wunlock(struct rmlock *rm)
+rm_wlock(struct rmlock *rm)
 {
-    int ret;
-
-#ifdef DEBUG_THREADING
-    /* Calculate write lock hold time */
-    struct timespec now, hold_time;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    hold_time.tv_sec = now.tv_sec - rm->last_acquire.tv_sec;
-    hold_time.tv_nsec = now.tv_nsec - rm->last_acquire.tv_nsec;
-    if (hold_time.tv_nsec < 0) {
-        hold_time.tv_sec--;
-        hold_time.tv_nsec += 1000000000L;
-    }
-#endif
+    rm_wlock_advanced(rm, (rm->rm_flags & RM_FAIR) != 0);
+}
 
+static inline void
+rm_wunlock(struct rmlock *rm)
+{
     /* Update statistics */
-    pthread_mutex_lock(&rm->stats_lock);
+    uint64_t hold_ns = rm_nanotime() - rm->rm_wstart;
+    atomic_fetch_add_explicit(&rm->rm_whold_ns, hold_ns, memory_order_relaxed);
     rm->writers = 0;
-    pthread_mutex_unlock(&rm->stats_lock);
 
-    /* Release write lock */
-    ret = pthread_rwlock_unlock(&rm->rw_lock);
-    if (ret != 0) {
-        printf("[RMLOCK] FATAL: Write unlock failed on '%s': %d\n", rm->name, ret);
-        abort();
-    }
+    /* Release write lock, wake blocked readers and the next writer */
+    pthread_mutex_lock(&rm->rm_mtx);
+    atomic_store_explicit(&rm->rm_writer, 0, memory_order_release);
+    rm->rm_wserving++;
+    if (rm->rm_rwaiters > 0)
+        pthread_cond_broadcast(&rm->rm_rcv);
+    if (rm->rm_wnext != rm->rm_wserving)
+        pthread_cond_broadcast(&rm->rm_wcv);
+    pthread_mutex_unlock(&rm->rm_mtx);
 
 #ifdef DEBUG_THREADING_VERBOSE
-    printf("[RMLOCK] Write lock released on '%s' by thread %lu (held %ld.%09ld sec)\n",
-           rm->name, (unsigned long)pthread_self(), hold_time.tv_sec, hold_time.tv_nsec);
+    printf("[RMLOCK] Write lock released on '%s' by thread %lu (held %llu ns)\n",
+           rm->name, (unsigned long)pthread_self(), (unsigned long long)hold_ns);
 #endif
 }
 
@@ -317,13 +587,12 @@ static inline void
 rm_assert(struct rmlock *rm, int what)
 {
 #ifdef DEBUG_THREADING
-    pthread_mutex_lock(&rm->stats_lock);
     switch (what) {
     case RA_LOCKED:
-        /* Assert either read or write locked */
-        if (rm->readers == 0 && rm->writers == 0) {
+        /* Assert either read or write locked by current thread */
+        if (!rm_rowned(rm) &&
+            (rm->writers == 0 || rm->writer_thread != pthread_self())) {
             printf("[RMLOCK] ASSERTION FAILED: '%s' not locked\n", rm->name);
-            pthread_mutex_unlock(&rm->stats_lock);
             abort();
         }
         break;
@@ -331,17 +600,14 @@ rm_assert(struct rmlock *rm, int what)
         /* Assert write locked by current thread */
         if (rm->writers == 0) {
             printf("[RMLOCK] ASSERTION FAILED: '%s' not write locked\n", rm->name);
-            pthread_mutex_unlock(&rm->stats_lock);
             abort();
         }
         if (rm->writer_thread != pthread_self()) {
             printf("[RMLOCK] ASSERTION FAILED: '%s' write locked by different thread\n", rm->name);
-            pthread_mutex_unlock(&rm->stats_lock);
             abort();
         }
         break;
     }
-    pthread_mutex_unlock(&rm->stats_lock);
 #else
     /* No-op in non-debug builds */
     (void)rm;
@@ -367,6 +633,12 @@ rm_assert(struct rmlock *rm, int what)
 /* Utility macros */
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) > (b) ? (a) : (b))
+#ifndef roundup2
+#define roundup2(x, y) (((x) + ((y) - 1)) & ~((y) - 1))
+#endif
+#ifndef __containerof
+#define __containerof(x, s, m) ((s *)((char *)(x) - offsetof(s, m)))
+#endif
 
 #define bootverbose 0
 #define cold 0
@@ -415,48 +687,252 @@ struct ifaddr {
 #define if_ref(ifp) do { (void)(ifp); } while(0)
 #define if_rele(ifp) do { (void)(ifp); } while(0)
 
-/* === Phase 9: VNET/Epoch Support (No-op) === */
+/* === Phase 9: VNET/Epoch Support === */
 struct vnet;
+
+/*
+ * Userland epoch (compat_epoch.c)
+ *
+ * Readers publish the global epoch they observed in a per-thread record.
+ * Deferred callbacks are run by a reclaimer thread once every record is
+ * either outside a section or has observed a newer epoch.
+ * A NULL epoch (before kernel_compat_init()) keeps the old behaviour:
+ * sections are no-ops and callbacks run immediately.
+ */
 struct epoch;
 typedef struct epoch* epoch_t;
-typedef struct {} epoch_tracker_t;
+
+struct epoch_context {
+    struct epoch_context   *ec_next;        /* Reclaimer queue linkage */
+    void                  (*ec_callback)(struct epoch_context *);
+    size_t                  ec_size;        /* Bytes freed by the callback */
+};
+typedef struct epoch_context* epoch_context_t;
+typedef void (*epoch_callback_t)(epoch_context_t);
+
+struct epoch_record;
+struct epoch_tracker {
+    struct epoch_record    *et_record;      /* Thread record of the section */
+};
+typedef struct epoch_tracker* epoch_tracker_t;
+
+#define EPOCH_PREEMPT   0x01
+
+/* Memory pressure levels, from the callbacks or bytes outstanding vs. the limits */
+#define EPOCH_PRESSURE_NORMAL   0       /* Up to 50% */
+#define EPOCH_PRESSURE_MODERATE 1       /* Over 50% */
+#define EPOCH_PRESSURE_HIGH     2       /* Over 70% */
+#define EPOCH_PRESSURE_CRITICAL 3       /* Over 90%, reclaimed without delay */
 
 extern epoch_t net_epoch_preempt;
 
+epoch_t epoch_alloc(const char *name, int flags);
+void    epoch_free(epoch_t epoch);
+void    epoch_enter_preempt(epoch_t epoch, epoch_tracker_t et);
+void    epoch_exit_preempt(epoch_t epoch, epoch_tracker_t et);
+void    epoch_wait_preempt(epoch_t epoch);
+void    epoch_call(epoch_t epoch, epoch_callback_t callback, epoch_context_t ctx);
+void    epoch_call_size(epoch_t epoch, epoch_callback_t callback,
+                        epoch_context_t ctx, size_t size);
+void    epoch_drain_callbacks(epoch_t epoch);
+uint64_t epoch_pending(epoch_t epoch);
+uint64_t epoch_pending_bytes(epoch_t epoch);
+void    epoch_set_callback_limit(epoch_t epoch, uint64_t limit);
+void    epoch_set_memory_limit(epoch_t epoch, uint64_t bytes);
+int     epoch_pressure(epoch_t epoch);
+uint64_t epoch_emergency_reclaims(epoch_t epoch);
+int     in_epoch(epoch_t epoch);
+
 #define VNET(sym) sym
 #define VNET_DECLARE(type, name) extern type name
 #define VNET_DEFINE(type, name) type name
 
-#define NET_EPOCH_ENTER(et) do { (void)(et); } while(0)
-#define NET_EPOCH_EXIT(et) do { (void)(et); } while(0)
-#define NET_EPOCH_WAIT() do { } while(0)
-#define NET_EPOCH_CALL(func, arg) func(arg)
-#define NET_EPOCH_ASSERT() do { } while(0)
-
-#define epoch_enter_preempt(epoch, et) do { (void)(epoch); (void)(et); } while(0)
-#define epoch_exit_preempt(epoch, et) do { (void)(epoch); (void)(et); } while(0)
+#define NET_EPOCH_ENTER(et) epoch_enter_preempt(net_epoch_preempt, &(et))
+#define NET_EPOCH_EXIT(et) epoch_exit_preempt(net_epoch_preempt, &(et))
+#define NET_EPOCH_WAIT() epoch_wait_preempt(net_epoch_preempt)
+#define NET_EPOCH_CALL(func, arg) epoch_call(net_epoch_preempt, func, arg)
+#define NET_EPOCH_CALL_SIZE(func, arg, size) \
+    epoch_call_size(net_epoch_preempt, func, arg, size)
+#define NET_EPOCH_ASSERT() MPASS(in_epoch(net_epoch_preempt))
 
 #define CURVNET_SET(vnet) do { (void)(vnet); } while(0)
 #define CURVNET_RESTORE() do { } while(0)
 
 /* === Phase 10: Counter Support === */
-typedef uint64_t* counter_u64_t;
 
-#define counter_u64_alloc(flags) ((counter_u64_t)calloc(1, sizeof(uint64_t)))
-#define counter_u64_free(counter) free(counter)
-#define counter_u64_add(counter, val) (*(counter) += (val))
-#define counter_u64_fetch(counter) (*(counter))
+/*
+ * Sharded counters (counter(9) equivalent)
+ *
+ * A counter is an array of COUNTER_SLOTS cache-line padded slots. Each
+ * thread is assigned a slot on first use and updates only that slot, so
+ * concurrent writers on different slots never share a cache line.
+ * counter_u64_fetch() sums all slots and is not a point-in-time snapshot.
+ */
+#define COUNTER_SLOTS       64
+#define COUNTER_CACHE_LINE  64
+
+struct counter_slot {
+    _Atomic uint64_t    cs_value;
+    char                cs_pad[COUNTER_CACHE_LINE - sizeof(uint64_t)];
+} __attribute__((aligned(COUNTER_CACHE_LINE)));
+
+typedef struct counter_slot* counter_u64_t;
+
+extern __thread int counter_curslot_id;
+int counter_slot_assign(void);
+
+static inline int
+counter_curslot(void)
+{
+    int slot = counter_curslot_id;
+
+    if (__builtin_expect(slot == 0, 0))
+        slot = counter_slot_assign();
+    return slot - 1;
+}
+
+static inline counter_u64_t
+counter_u64_alloc(int flags)
+{
+    counter_u64_t c;
+
+    if (posix_memalign((void **)&c, COUNTER_CACHE_LINE,
+                       sizeof(struct counter_slot) * COUNTER_SLOTS) != 0) {
+        if (!(flags & M_NOWAIT)) {
+            fprintf(stderr, "FATAL: counter_u64_alloc failed\n");
+            abort();
+        }
+        return NULL;
+    }
+    memset(c, 0, sizeof(struct counter_slot) * COUNTER_SLOTS);
+    return c;
+}
+
+static inline void
+counter_u64_free(counter_u64_t c)
+{
+    /* Not a malloc(9) allocation, see counter_u64_alloc() */
+    (free)(c);
+}
+
+static inline void
+counter_u64_add(counter_u64_t c, int64_t inc)
+{
+    atomic_fetch_add_explicit(&c[counter_curslot()].cs_value, (uint64_t)inc,
+                              memory_order_relaxed);
+}
+
+static inline uint64_t
+counter_u64_fetch(counter_u64_t c)
+{
+    uint64_t sum = 0;
+
+    for (int i = 0; i < COUNTER_SLOTS; i++)
+        sum += atomic_load_explicit(&c[i].cs_value, memory_order_relaxed);
+    return sum;
+}
+
+static inline void
+counter_u64_zero(counter_u64_t c)
+{
+    for (int i = 0; i < COUNTER_SLOTS; i++)
+        atomic_store_explicit(&c[i].cs_value, 0, memory_order_relaxed);
+}
+
+/* === Phase 11: Callout and Taskqueue Support === */
+
+/*
+ * Callouts and tasks (compat_callout.c)
+ *
+ * Tasks run on a pool of worker threads. Each worker owns a deque: a
+ * task enqueued while a worker is running is pushed to and popped from
+ * that worker's end, idle workers steal from the other end of the other
+ * deques. A task enqueued again before it runs is coalesced and its
+ * handler gets the number of enqueues, as taskqueue(9). A task never
+ * runs concurrently with itself.
+ *
+ * Callouts are kept in a hashed timer wheel with 1ms slots, advanced by
+ * a timer thread. Expired callouts are run as tasks on the pool. For
+ * callouts initialised with callout_init_rm() the handler runs with the
+ * lock held, and callout_stop() called with the lock held guarantees
+ * the handler will not run.
+ * The pool and the timer thread are started on first use.
+ */
+typedef int64_t sbintime_t;
+
+#define SBT_1S      ((sbintime_t)1 << 32)
+#define SBT_1MS     (SBT_1S / 1000)
+#define SBT_1US     (SBT_1S / 1000000)
+
+typedef void task_fn_t(void *context, int pending);
+
+struct task_worker;
+struct task {
+    struct task        *ta_next;        /* Worker deque linkage */
+    struct task        *ta_prev;
+    struct task_worker *ta_worker;      /* Deque holding the task */
+    int                 ta_pending;     /* Enqueues since the last run */
+    int                 ta_flags;       /* TASK_ flags */
+    task_fn_t          *ta_func;
+    void               *ta_context;
+};
+
+#define TASK_QUEUED     0x01
+#define TASK_RUNNING    0x02
+
+#define TASK_INIT(task, priority, func, context) do {   \
+    memset((task), 0, sizeof(*(task)));                 \
+    (task)->ta_func = (func);                           \
+    (task)->ta_context = (context);                     \
+} while (0)
+
+/* All taskqueues share the worker pool */
+struct taskqueue;
+extern struct taskqueue *taskqueue_thread;
+extern struct taskqueue *taskqueue_fast;
+
+int     taskqueue_enqueue(struct taskqueue *tq, struct task *task);
+int     taskqueue_cancel(struct taskqueue *tq, struct task *task, u_int *pendp);
+void    taskqueue_drain(struct taskqueue *tq, struct task *task);
 
-/* === Phase 11: Callout Support === */
 struct callout {
-    int c_flags;
-    void (*c_func)(void*);
-    void* c_arg;
+    struct callout     *c_next;         /* Wheel slot linkage */
+    struct callout    **c_prev;
+    uint64_t            c_time;         /* Expiry, compat clock ms */
+    uint64_t            c_gen;          /* Bumped by every reset/stop */
+    uint64_t            c_fire_gen;     /* c_gen when it expired */
+    void              (*c_func)(void *);
+    void               *c_arg;
+    struct rmlock      *c_rmlock;       /* Lock held around the handler */
+    int                 c_lflags;       /* CALLOUT_ lock flags */
+    int                 c_flags;        /* CALLOUT_ state flags */
+    struct task         c_task;         /* Handler invocation */
 };
 
-#define callout_init(c, flag) memset(c, 0, sizeof(*(c)))
-#define callout_stop(c) do { (void)(c); } while(0)
-#define callout_reset(c, to, func, arg) do { (void)(c); (void)(to); (void)(func); (void)(arg); } while(0)
+/* State flags */
+#define CALLOUT_PENDING         0x01    /* On the wheel */
+#define CALLOUT_ACTIVE          0x02    /* Scheduled, callout_deactivate() clears */
+#define CALLOUT_DRAINING        0x04    /* callout_drain() in progress */
+/* Lock flags */
+#define CALLOUT_RETURNUNLOCKED  0x10    /* Handler releases the lock */
+#define CALLOUT_SHAREDLOCK      0x20    /* Handler runs with a read lock */
+
+void    callout_init(struct callout *c, int mpsafe);
+void    callout_init_rm(struct callout *c, struct rmlock *rm, int flags);
+int     callout_reset_sbt(struct callout *c, sbintime_t sbt, sbintime_t prec,
+                          void (*func)(void *), void *arg, int flags);
+int     callout_stop(struct callout *c);
+int     callout_drain(struct callout *c);
+uint64_t callout_compat_now_ms(void);
+
+#define callout_reset(c, to_ticks, func, arg) \
+    callout_reset_sbt((c), (sbintime_t)(to_ticks) * (SBT_1S / hz), 0, (func), (arg), 0)
+#define callout_pending(c) \
+    (__atomic_load_n(&(c)->c_flags, __ATOMIC_RELAXED) & CALLOUT_PENDING)
+#define callout_active(c) \
+    (__atomic_load_n(&(c)->c_flags, __ATOMIC_RELAXED) & CALLOUT_ACTIVE)
+#define callout_deactivate(c) \
+    __atomic_fetch_and(&(c)->c_flags, ~CALLOUT_ACTIVE, __ATOMIC_RELAXED)
 
 /* === Phase 12: Sysctl Support === */
 #define SYSCTL_NODE(parent, nbr, name, access, handler, descr)
@@ -502,4 +978,84 @@ void kernel_compat_init(void);
 /* Socket address utilities */
 int sa_equal(const struct sockaddr* a, const struct sockaddr* b);
 
+/* === Phase 18: Static Tracepoints (sdt(9) subset) === */
+
+/*
+ * SDT probes recorded into a process-wide ring buffer (compat_shim.c).
+ * A disabled probe costs a load and a predicted branch; arguments are
+ * only evaluated when it fires. Probes are named
+ * "provider:module:function:name" and are enabled at run time with
+ * sdt_probe_enable() or the SDT_PROBES environment variable, a comma
+ * separated list of fnmatch(3) patterns read by kernel_compat_init().
+ */
+#define SDT_TRACE_RECORDS   8192    /* Ring size, a power of 2 */
+#define SDT_MAX_ARGS        5
+
+struct sdt_probe {
+    const char*         sdtp_name;
+    _Atomic int         sdtp_enabled;
+    _Atomic uint64_t    sdtp_fired;
+    struct sdt_probe*   sdtp_next;
+};
+
+struct sdt_record {
+    _Atomic uint64_t        sr_seq;     /* Position + 1 once complete */
+    uint64_t                sr_nsec;    /* CLOCK_MONOTONIC */
+    const struct sdt_probe* sr_probe;
+    int                     sr_slot;    /* Counter slot of the thread */
+    uintptr_t               sr_args[SDT_MAX_ARGS];
+};
+
+void sdt_probe_register(struct sdt_probe* probe);
+void sdt_probe_fire(struct sdt_probe* probe, uintptr_t a0, uintptr_t a1, uintptr_t a2,
+                    uintptr_t a3, uintptr_t a4);
+int sdt_probe_enable(const char* pattern, bool enable);
+size_t sdt_trace_read(struct sdt_record* recs, size_t nrecs, uint64_t* pos);
+void sdt_trace_dump(FILE* fp);
+
+#define SDT_PROBE_NAME(prov, mod, func, name) sdt_##prov##_##mod##_##func##_##name
+
+#define SDT_PROVIDER_DEFINE(prov)
+#define SDT_PROVIDER_DECLARE(prov)
+#define SDT_PROBE_DECLARE(prov, mod, func, name) \
+    extern struct sdt_probe SDT_PROBE_NAME(prov, mod, func, name)
+
+#define SDT_PROBE_DEFINE(prov, mod, func, name)                                 \
+    struct sdt_probe SDT_PROBE_NAME(prov, mod, func, name) = {                  \
+        .sdtp_name = #prov ":" #mod ":" #func ":" #name };                      \
+    static void __attribute__((constructor))                                   \
+    SDT_PROBE_NAME(prov, mod, func, name##_register)(void) {                    \
+        sdt_probe_register(&SDT_PROBE_NAME(prov, mod, func, name));             \
+    }
+/* Argument types are only documentation here */
+#define SDT_PROBE_DEFINE0(prov, mod, func, name) SDT_PROBE_DEFINE(prov, mod, func, name)
+#define SDT_PROBE_DEFINE1(prov, mod, func, name, t0) SDT_PROBE_DEFINE(prov, mod, func, name)
+#define SDT_PROBE_DEFINE2(prov, mod, func, name, t0, t1) \
+    SDT_PROBE_DEFINE(prov, mod, func, name)
+#define SDT_PROBE_DEFINE3(prov, mod, func, name, t0, t1, t2) \
+    SDT_PROBE_DEFINE(prov, mod, func, name)
+#define SDT_PROBE_DEFINE4(prov, mod, func, name, t0, t1, t2, t3) \
+    SDT_PROBE_DEFINE(prov, mod, func, name)
+#define SDT_PROBE_DEFINE5(prov, mod, func, name, t0, t1, t2, t3, t4) \
+    SDT_PROBE_DEFINE(prov, mod, func, name)
+
+#define SDT_PROBE(prov, mod, func, name, a0, a1, a2, a3, a4) do {              \
+    struct sdt_probe* _p = &SDT_PROBE_NAME(prov, mod, func, name);             \
+    if (__builtin_expect(atomic_load_explicit(&_p->sdtp_enabled,               \
+                                              memory_order_relaxed), 0))       \
+        sdt_probe_fire(_p, (uintptr_t)(a0), (uintptr_t)(a1), (uintptr_t)(a2), \
+                       (uintptr_t)(a3), (uintptr_t)(a4));                      \
+} while (0)
+#define SDT_PROBE0(prov, mod, func, name) SDT_PROBE(prov, mod, func, name, 0, 0, 0, 0, 0)
+#define SDT_PROBE1(prov, mod, func, name, a0) \
+    SDT_PROBE(prov, mod, func, name, a0, 0, 0, 0, 0)
+#define SDT_PROBE2(prov, mod, func, name, a0, a1) \
+    SDT_PROBE(prov, mod, func, name, a0, a1, 0, 0, 0)
+#define SDT_PROBE3(prov, mod, func, name, a0, a1, a2) \
+    SDT_PROBE(prov, mod, func, name, a0, a1, a2, 0, 0)
+#define SDT_PROBE4(prov, mod, func, name, a0, a1, a2, a3) \
+    SDT_PROBE(prov, mod, func, name, a0, a1, a2, a3, 0)
+#define SDT_PROBE5(prov, mod, func, name, a0, a1, a2, a3, a4) \
+    SDT_PROBE(prov, mod, func, name, a0, a1, a2, a3, a4)
+
 #endif /* _KERNEL_COMPAT_SHIM_H_ */
\ No newline at end of file
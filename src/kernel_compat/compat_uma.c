@@ -0,0 +1,546 @@
+/*
+ * Userland UMA Zone Implementation
+ *
+ * Fixed-size item allocator with the uma(9) interface used by the
+ * routing code (rtentry, nhop and route_lib entries):
+ *
+ * - Slabs: items are carved from large page-aligned slabs, so there is
+ *   no per-item malloc header and items of one type stay packed together.
+ * - Magazines: each thread keeps an alloc and a free bucket per zone.
+ *   uma_zalloc()/uma_zfree() only take the zone lock when both buckets
+ *   are exhausted (alloc) or full (free), and then exchange a whole
+ *   bucket with the zone depot.
+ * - Slab memory is only returned to the system by uma_zdestroy(). The
+ *   uminit/fini hooks run once per item when it is carved and destroyed.
+ * - UMA_ZONE_HUGEPAGE zones take huge page slabs once their regular slabs
+ *   add up to a huge page, so that small zones do not waste one.
+ */
+
+#include "compat_shim.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* Slabs and buckets are plain libc allocations */
+#undef malloc
+#undef free
+
+#define UMA_MAX_ZONES           128     /* Max zones per process */
+#define UMA_SLAB_SIZE           (64 * 1024)
+#define UMA_SLAB_ALIGN          4096
+#define UMA_CACHE_LINE          64
+#define UMA_SLAB_MIN_ITEMS      8
+#define UMA_BUCKET_SIZE         64      /* Items per magazine */
+
+struct uma_bucket {
+    struct uma_bucket      *ub_next;        /* Depot linkage */
+    int                     ub_cnt;         /* Items held */
+    void                   *ub_items[UMA_BUCKET_SIZE];
+};
+
+struct uma_slab {
+    struct uma_slab        *us_next;
+    char                   *us_end;         /* End of carved items */
+    size_t                  us_size;
+    bool                    us_mapped;      /* From hugepage_alloc() */
+};
+
+struct uma_zone {
+    const char             *uz_name;
+    size_t                  uz_size;        /* Requested item size */
+    size_t                  uz_rsize;       /* Aligned item stride */
+    size_t                  uz_slabsize;
+    size_t                  uz_slabhdr;     /* Offset of the first item */
+    uma_ctor                uz_ctor;
+    uma_dtor                uz_dtor;
+    uma_init                uz_init;
+    uma_fini                uz_fini;
+    uint32_t                uz_flags;
+    int                     uz_id;
+    uint64_t                uz_gen;         /* Unique allocation number */
+
+    pthread_mutex_t         uz_lock;        /* Protects fields below */
+    void                   *uz_free;        /* Free items, linked by 1st word */
+    struct uma_bucket      *uz_full;        /* Depot of full buckets */
+    struct uma_bucket      *uz_empty;       /* Depot of empty buckets */
+    struct uma_slab        *uz_slabs;       /* All slabs, newest first */
+    char                   *uz_carve;       /* Uncarved part of newest slab */
+    char                   *uz_carve_end;
+    uint64_t                uz_nslabs;
+    uint64_t                uz_slab_bytes;
+
+    /* Statistics */
+    counter_u64_t           uz_allocs;
+    counter_u64_t           uz_frees;
+};
+
+struct uma_cache {
+    uint64_t                uc_gen;         /* Zone the buckets belong to */
+    struct uma_bucket      *uc_alloc;
+    struct uma_bucket      *uc_free;
+};
+
+static struct uma_zone *uma_zones[UMA_MAX_ZONES];
+static uint64_t uma_gen;
+static pthread_mutex_t uma_zones_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t uma_cache_key;
+static pthread_once_t uma_cache_once = PTHREAD_ONCE_INIT;
+
+/* Thread magazines, validated by the zone allocation number */
+static __thread struct uma_cache uma_thread_caches[UMA_MAX_ZONES];
+
+/* ===== Zone depot (zone lock held) ===== */
+
+static struct uma_slab *
+uma_slab_alloc(struct uma_zone *zone)
+{
+    struct uma_slab *slab = NULL;
+    size_t size = zone->uz_slabsize;
+    bool mapped = false;
+
+    if ((zone->uz_flags & UMA_ZONE_HUGEPAGE) &&
+        zone->uz_slab_bytes >= HUGEPAGE_SIZE) {
+        size = roundup2(size, HUGEPAGE_SIZE);
+        mapped = (slab = hugepage_alloc(size, NULL)) != NULL;
+    }
+    if (!mapped) {
+        size = zone->uz_slabsize;
+        if (posix_memalign((void **)&slab, UMA_SLAB_ALIGN, size) != 0)
+            return NULL;
+    }
+
+    slab->us_end = (char *)slab + zone->uz_slabhdr;
+    slab->us_size = size;
+    slab->us_mapped = mapped;
+    slab->us_next = zone->uz_slabs;
+    zone->uz_slabs = slab;
+    zone->uz_carve = slab->us_end;
+    zone->uz_carve_end = (char *)slab + size;
+    zone->uz_nslabs++;
+    zone->uz_slab_bytes += size;
+    return slab;
+}
+
+/*
+ * Returns a free item from the zone, carving a new one from the newest
+ * slab when the free list is empty.
+ */
+static void *
+uma_zone_item(struct uma_zone *zone, int flags)
+{
+    void *item;
+
+    if (zone->uz_free != NULL) {
+        item = zone->uz_free;
+        zone->uz_free = *(void **)item;
+        return item;
+    }
+
+    if (zone->uz_carve == NULL ||
+        zone->uz_carve + zone->uz_rsize > zone->uz_carve_end) {
+        if (uma_slab_alloc(zone) == NULL)
+            return NULL;
+    }
+
+    item = zone->uz_carve;
+    if (zone->uz_init != NULL &&
+        zone->uz_init(item, (int)zone->uz_size, flags) != 0)
+        return NULL;
+    zone->uz_carve += zone->uz_rsize;
+    zone->uz_slabs->us_end = zone->uz_carve;
+    return item;
+}
+
+static struct uma_bucket *
+uma_bucket_get(struct uma_zone *zone)
+{
+    struct uma_bucket *b;
+
+    if ((b = zone->uz_empty) != NULL) {
+        zone->uz_empty = b->ub_next;
+    } else if ((b = malloc(sizeof(*b))) == NULL) {
+        return NULL;
+    }
+    b->ub_next = NULL;
+    b->ub_cnt = 0;
+    return b;
+}
+
+static void
+uma_bucket_put(struct uma_zone *zone, struct uma_bucket *b)
+{
+    if (b->ub_cnt > 0) {
+        b->ub_next = zone->uz_full;
+        zone->uz_full = b;
+    } else {
+        b->ub_next = zone->uz_empty;
+        zone->uz_empty = b;
+    }
+}
+
+/* ===== Per-thread magazines ===== */
+
+static void
+uma_cache_drop(struct uma_cache *cache)
+{
+    /* Items of a destroyed zone are gone with its slabs */
+    free(cache->uc_alloc);
+    free(cache->uc_free);
+    cache->uc_alloc = NULL;
+    cache->uc_free = NULL;
+    cache->uc_gen = 0;
+}
+
+static void
+uma_cache_flush(struct uma_zone *zone, struct uma_cache *cache)
+{
+    pthread_mutex_lock(&zone->uz_lock);
+    if (cache->uc_alloc != NULL)
+        uma_bucket_put(zone, cache->uc_alloc);
+    if (cache->uc_free != NULL)
+        uma_bucket_put(zone, cache->uc_free);
+    pthread_mutex_unlock(&zone->uz_lock);
+    cache->uc_alloc = NULL;
+    cache->uc_free = NULL;
+    cache->uc_gen = 0;
+}
+
+/* Returns magazines of an exiting thread to their zones */
+static void
+uma_cache_release(void *arg)
+{
+    struct uma_cache *caches = arg;
+    struct uma_zone *zone;
+
+    pthread_mutex_lock(&uma_zones_lock);
+    for (int id = 0; id < UMA_MAX_ZONES; id++) {
+        if (caches[id].uc_gen == 0)
+            continue;
+        zone = uma_zones[id];
+        if (zone != NULL && zone->uz_gen == caches[id].uc_gen)
+            uma_cache_flush(zone, &caches[id]);
+        else
+            uma_cache_drop(&caches[id]);
+    }
+    pthread_mutex_unlock(&uma_zones_lock);
+}
+
+static void
+uma_cache_key_init(void)
+{
+    pthread_key_create(&uma_cache_key, uma_cache_release);
+}
+
+static struct uma_cache *
+uma_cache_get(struct uma_zone *zone)
+{
+    struct uma_cache *cache = &uma_thread_caches[zone->uz_id];
+
+    if (__predict_true(cache->uc_gen == zone->uz_gen))
+        return cache;
+
+    /* Slot last used by a zone that has since been destroyed */
+    if (cache->uc_gen != 0)
+        uma_cache_drop(cache);
+    if (pthread_getspecific(uma_cache_key) == NULL)
+        pthread_setspecific(uma_cache_key, uma_thread_caches);
+    cache->uc_gen = zone->uz_gen;
+    return cache;
+}
+
+/*
+ * Refills the alloc bucket of @cache, preferring a full bucket from the
+ * depot over carving items one by one.
+ */
+static int
+uma_cache_refill(struct uma_zone *zone, struct uma_cache *cache, int flags)
+{
+    struct uma_bucket *b;
+    void *item;
+
+    pthread_mutex_lock(&zone->uz_lock);
+    if ((b = zone->uz_full) != NULL) {
+        zone->uz_full = b->ub_next;
+        if (cache->uc_alloc != NULL)
+            uma_bucket_put(zone, cache->uc_alloc);
+        cache->uc_alloc = b;
+    } else {
+        if (cache->uc_alloc == NULL)
+            cache->uc_alloc = uma_bucket_get(zone);
+        b = cache->uc_alloc;
+        while (b != NULL && b->ub_cnt < UMA_BUCKET_SIZE / 2) {
+            if ((item = uma_zone_item(zone, flags)) == NULL)
+                break;
+            b->ub_items[b->ub_cnt++] = item;
+        }
+    }
+    pthread_mutex_unlock(&zone->uz_lock);
+
+    return (b != NULL && b->ub_cnt > 0) ? 0 : ENOMEM;
+}
+
+/* ===== Zone management ===== */
+
+uma_zone_t
+uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
+    uma_init uminit, uma_fini fini, int align, uint32_t flags)
+{
+    struct uma_zone *zone;
+    size_t rsize;
+    int id;
+
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    rsize = roundup2(size, (size_t)align + 1);
+
+    zone = calloc(1, sizeof(*zone));
+    if (zone == NULL)
+        return NULL;
+
+    zone->uz_name = name;
+    zone->uz_size = size;
+    zone->uz_rsize = rsize;
+    zone->uz_slabhdr = roundup2(sizeof(struct uma_slab),
+        max((size_t)align + 1, (size_t)UMA_CACHE_LINE));
+    zone->uz_slabsize = UMA_SLAB_SIZE;
+    while (zone->uz_slabsize < rsize * UMA_SLAB_MIN_ITEMS + zone->uz_slabhdr)
+        zone->uz_slabsize *= 2;
+    zone->uz_ctor = ctor;
+    zone->uz_dtor = dtor;
+    zone->uz_init = uminit;
+    zone->uz_fini = fini;
+    zone->uz_flags = flags;
+    pthread_mutex_init(&zone->uz_lock, NULL);
+    zone->uz_allocs = counter_u64_alloc(M_WAITOK);
+    zone->uz_frees = counter_u64_alloc(M_WAITOK);
+
+    pthread_once(&uma_cache_once, uma_cache_key_init);
+
+    pthread_mutex_lock(&uma_zones_lock);
+    for (id = 0; id < UMA_MAX_ZONES; id++) {
+        if (uma_zones[id] == NULL)
+            break;
+    }
+    if (id == UMA_MAX_ZONES) {
+        pthread_mutex_unlock(&uma_zones_lock);
+        panic("uma_zcreate: too many zones");
+    }
+    zone->uz_id = id;
+    zone->uz_gen = ++uma_gen;
+    uma_zones[id] = zone;
+    pthread_mutex_unlock(&uma_zones_lock);
+
+    return zone;
+}
+
+/*
+ * Destroys @zone and releases all of its slabs. All items must have been
+ * freed. Magazines cached by other threads are discarded lazily.
+ */
+void
+uma_zdestroy(uma_zone_t zone)
+{
+    struct uma_cache *cache;
+    struct uma_bucket *b;
+    struct uma_slab *slab;
+
+    if (zone == NULL)
+        return;
+
+    pthread_mutex_lock(&uma_zones_lock);
+    uma_zones[zone->uz_id] = NULL;
+    pthread_mutex_unlock(&uma_zones_lock);
+
+    cache = &uma_thread_caches[zone->uz_id];
+    if (cache->uc_gen == zone->uz_gen)
+        uma_cache_drop(cache);
+
+    while ((b = zone->uz_full) != NULL) {
+        zone->uz_full = b->ub_next;
+        free(b);
+    }
+    while ((b = zone->uz_empty) != NULL) {
+        zone->uz_empty = b->ub_next;
+        free(b);
+    }
+    while ((slab = zone->uz_slabs) != NULL) {
+        zone->uz_slabs = slab->us_next;
+        if (zone->uz_fini != NULL) {
+            char *item = (char *)slab + zone->uz_slabhdr;
+            for (; item < slab->us_end; item += zone->uz_rsize)
+                zone->uz_fini(item, (int)zone->uz_size);
+        }
+        if (slab->us_mapped)
+            hugepage_free(slab, slab->us_size);
+        else
+            free(slab);
+    }
+
+    counter_u64_free(zone->uz_allocs);
+    counter_u64_free(zone->uz_frees);
+    pthread_mutex_destroy(&zone->uz_lock);
+    free(zone);
+}
+
+/* ===== Allocation ===== */
+
+void *
+uma_zalloc_arg(uma_zone_t zone, void *arg, int flags)
+{
+    struct uma_cache *cache;
+    struct uma_bucket *b;
+    void *item;
+
+    cache = uma_cache_get(zone);
+    b = cache->uc_alloc;
+    if (__predict_false(b == NULL || b->ub_cnt == 0)) {
+        if (cache->uc_free != NULL && cache->uc_free->ub_cnt > 0) {
+            cache->uc_alloc = cache->uc_free;
+            cache->uc_free = b;
+        } else if (uma_cache_refill(zone, cache, flags) != 0) {
+            if (!(flags & M_NOWAIT))
+                panic("uma_zalloc: out of memory");
+            return NULL;
+        }
+        b = cache->uc_alloc;
+    }
+    item = b->ub_items[--b->ub_cnt];
+
+    if (flags & M_ZERO)
+        memset(item, 0, zone->uz_size);
+    if (zone->uz_ctor != NULL &&
+        zone->uz_ctor(item, (int)zone->uz_size, arg, flags) != 0) {
+        b->ub_items[b->ub_cnt++] = item;
+        return NULL;
+    }
+    counter_u64_add(zone->uz_allocs, 1);
+    return item;
+}
+
+void
+uma_zfree_arg(uma_zone_t zone, void *item, void *arg)
+{
+    struct uma_cache *cache;
+    struct uma_bucket *b;
+
+    if (item == NULL)
+        return;
+
+    if (zone->uz_dtor != NULL)
+        zone->uz_dtor(item, (int)zone->uz_size, arg);
+    counter_u64_add(zone->uz_frees, 1);
+
+    cache = uma_cache_get(zone);
+    b = cache->uc_free;
+    if (__predict_false(b == NULL || b->ub_cnt == UMA_BUCKET_SIZE)) {
+        if (cache->uc_alloc != NULL &&
+            cache->uc_alloc->ub_cnt < UMA_BUCKET_SIZE) {
+            cache->uc_free = cache->uc_alloc;
+            cache->uc_alloc = b;
+        } else {
+            /* Hand the full bucket to the depot and take an empty one */
+            pthread_mutex_lock(&zone->uz_lock);
+            if (b != NULL)
+                uma_bucket_put(zone, b);
+            cache->uc_free = uma_bucket_get(zone);
+            if (cache->uc_free == NULL) {
+                *(void **)item = zone->uz_free;
+                zone->uz_free = item;
+                pthread_mutex_unlock(&zone->uz_lock);
+                return;
+            }
+            pthread_mutex_unlock(&zone->uz_lock);
+        }
+        b = cache->uc_free;
+    }
+    b->ub_items[b->ub_cnt++] = item;
+}
+
+/*
+ * Returns the calling thread magazines to their zone depots, so that the
+ * items it freed are reused by other threads right away. The epoch
+ * reclaimer calls this after each batch of deferred frees.
+ */
+void
+uma_thread_flush(void)
+{
+    struct uma_cache *cache;
+    struct uma_zone *zone;
+
+    pthread_mutex_lock(&uma_zones_lock);
+    for (int id = 0; id < UMA_MAX_ZONES; id++) {
+        cache = &uma_thread_caches[id];
+        if (cache->uc_gen == 0)
+            continue;
+        zone = uma_zones[id];
+        if (zone != NULL && zone->uz_gen == cache->uc_gen)
+            uma_cache_flush(zone, cache);
+        else
+            uma_cache_drop(cache);
+    }
+    pthread_mutex_unlock(&uma_zones_lock);
+}
+
+/* ===== Statistics ===== */
+
+int
+uma_zone_get_cur(uma_zone_t zone)
+{
+    int64_t cur;
+
+    cur = (int64_t)(counter_u64_fetch(zone->uz_allocs) -
+        counter_u64_fetch(zone->uz_frees));
+    return (cur < 0) ? 0 : (int)cur;
+}
+
+void
+uma_zone_get_stats(uma_zone_t zone, struct uma_zone_stats *stats)
+{
+    pthread_mutex_lock(&zone->uz_lock);
+    stats->uzs_slabs = zone->uz_nslabs;
+    stats->uzs_slab_bytes = zone->uz_slab_bytes;
+    pthread_mutex_unlock(&zone->uz_lock);
+    stats->uzs_item_size = zone->uz_rsize;
+    stats->uzs_allocs = counter_u64_fetch(zone->uz_allocs);
+    stats->uzs_frees = counter_u64_fetch(zone->uz_frees);
+}
+
+/* Prints the zones in use, for malloc_type_report() */
+void
+uma_zone_report(FILE *fp)
+{
+    struct uma_zone_stats uzs;
+
+    fprintf(fp, "%-12s %12s %10s %12s %12s\n", "Zone", "Used", "Size", "Slabs",
+        "Requests");
+    pthread_mutex_lock(&uma_zones_lock);
+    for (int id = 0; id < UMA_MAX_ZONES; id++) {
+        if (uma_zones[id] == NULL)
+            continue;
+        uma_zone_get_stats(uma_zones[id], &uzs);
+        fprintf(fp, "%-12s %12llu %10zu %11lluK %12llu\n", uma_zones[id]->uz_name,
+            (unsigned long long)(uzs.uzs_allocs - uzs.uzs_frees), uzs.uzs_item_size,
+            (unsigned long long)(uzs.uzs_slab_bytes / 1024),
+            (unsigned long long)uzs.uzs_allocs);
+    }
+    pthread_mutex_unlock(&uma_zones_lock);
+}
+
+/* Memory held by the slabs of all zones */
+uint64_t
+uma_zone_total(void)
+{
+    struct uma_zone_stats uzs;
+    uint64_t total = 0;
+
+    pthread_mutex_lock(&uma_zones_lock);
+    for (int id = 0; id < UMA_MAX_ZONES; id++) {
+        if (uma_zones[id] == NULL)
+            continue;
+        uma_zone_get_stats(uma_zones[id], &uzs);
+        total += uzs.uzs_slab_bytes;
+    }
+    pthread_mutex_unlock(&uma_zones_lock);
+    return total;
+}
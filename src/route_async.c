@@ -0,0 +1,377 @@
+/*
+ * FreeBSD Routing Library - Asynchronous Changes
+ *
+ * route_async_create() starts a writer thread for a table; changes are
+ * queued with route_async_submit() and their results collected with
+ * route_async_reap().
+ */
+
+#include "route_lib_var.h"
+
+/*
+ * Asynchronous changes
+ *
+ * Both rings are bounded multi-producer multi-consumer queues: each slot
+ * carries a sequence number telling producers and consumers whose turn
+ * it is, so they only contend on the ring position they claim. The
+ * writer sleeps when it has nothing to do, or no room to complete;
+ * whoever gives it work or room wakes it, checking ra_sleeping after a
+ * full fence so that the writer cannot miss them while falling asleep.
+ */
+#define ROUTE_ASYNC_BATCH  64             /* Ops between completion wakeups */
+
+struct route_ring_slot {
+    _Atomic size_t rrs_seq;
+};
+
+struct route_ring {
+    _Atomic size_t rr_enq __attribute__((aligned(COUNTER_CACHE_LINE)));
+    _Atomic size_t rr_deq __attribute__((aligned(COUNTER_CACHE_LINE)));
+    size_t rr_mask;
+    size_t rr_esize;                      /* Slot size, sequence included */
+    char* rr_slots;
+};
+
+struct route_async_sqe {
+    uint64_t ras_tag;
+    int ras_op;
+    int ras_flags;
+    int ras_ifindex;
+    int ras_has_mask;
+    int ras_has_gw;
+    union route_sa ras_dst;
+    union route_sa ras_mask;
+    union route_sa ras_gw;
+};
+
+struct route_async {
+    struct route_ring ra_sq;
+    struct route_ring ra_cq;
+    struct rib_head* ra_rh;
+    pthread_t ra_thread;
+    pthread_mutex_t ra_lock;
+    pthread_cond_t ra_work;               /* Writer: ops or completion room */
+    pthread_cond_t ra_done;               /* Reapers: completions */
+    _Atomic int ra_sleeping;              /* Writer waits on ra_work */
+    _Atomic int ra_waiters;               /* Reapers waiting on ra_done */
+    _Atomic int ra_stop;
+};
+
+#define ROUTE_RING_SLOT(r, pos) \
+    ((struct route_ring_slot*)((r)->rr_slots + ((pos) & (r)->rr_mask) * (r)->rr_esize))
+
+static int route_ring_init(struct route_ring* r, size_t entries, size_t size) {
+    r->rr_esize = roundup2(sizeof(struct route_ring_slot) + size, sizeof(uint64_t));
+    r->rr_slots = bsd_malloc(entries * r->rr_esize, M_RTABLE, M_WAITOK | M_ZERO);
+    if (!r->rr_slots) {
+        return ENOMEM;
+    }
+    r->rr_mask = entries - 1;
+    for (size_t i = 0; i < entries; i++) {
+        atomic_init(&ROUTE_RING_SLOT(r, i)->rrs_seq, i);
+    }
+    atomic_init(&r->rr_enq, 0);
+    atomic_init(&r->rr_deq, 0);
+    return 0;
+}
+
+/* Returns 0 if the ring is full */
+static int route_ring_push(struct route_ring* r, const void* e, size_t size) {
+    size_t pos = atomic_load_explicit(&r->rr_enq, memory_order_relaxed);
+    struct route_ring_slot* s;
+
+    for (;;) {
+        s = ROUTE_RING_SLOT(r, pos);
+        intptr_t d = (intptr_t)atomic_load_explicit(&s->rrs_seq, memory_order_acquire) -
+                     (intptr_t)pos;
+        if (d == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->rr_enq, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (d < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->rr_enq, memory_order_relaxed);
+        }
+    }
+    memcpy(s + 1, e, size);
+    atomic_store_explicit(&s->rrs_seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/* Returns 0 if the ring is empty */
+static int route_ring_pop(struct route_ring* r, void* e, size_t size) {
+    size_t pos = atomic_load_explicit(&r->rr_deq, memory_order_relaxed);
+    struct route_ring_slot* s;
+
+    for (;;) {
+        s = ROUTE_RING_SLOT(r, pos);
+        intptr_t d = (intptr_t)atomic_load_explicit(&s->rrs_seq, memory_order_acquire) -
+                     (intptr_t)(pos + 1);
+        if (d == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->rr_deq, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (d < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->rr_deq, memory_order_relaxed);
+        }
+    }
+    memcpy(e, s + 1, size);
+    atomic_store_explicit(&s->rrs_seq, pos + r->rr_mask + 1, memory_order_release);
+    return 1;
+}
+
+static int route_ring_has_room(struct route_ring* r) {
+    size_t pos = atomic_load_explicit(&r->rr_enq, memory_order_acquire);
+
+    return (intptr_t)atomic_load_explicit(&ROUTE_RING_SLOT(r, pos)->rrs_seq,
+                                          memory_order_acquire) - (intptr_t)pos >= 0;
+}
+
+static int route_ring_empty(struct route_ring* r) {
+    size_t pos = atomic_load_explicit(&r->rr_deq, memory_order_acquire);
+
+    return atomic_load_explicit(&ROUTE_RING_SLOT(r, pos)->rrs_seq, memory_order_acquire) !=
+        pos + 1;
+}
+
+/* Called after giving the writer work or completion room */
+static void route_async_kick(struct route_async* ra) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ra->ra_sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&ra->ra_lock);
+        atomic_store_explicit(&ra->ra_sleeping, 0, memory_order_relaxed);
+        pthread_cond_signal(&ra->ra_work);
+        pthread_mutex_unlock(&ra->ra_lock);
+    }
+}
+
+static void route_async_notify(struct route_async* ra) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ra->ra_waiters, memory_order_relaxed)) {
+        pthread_mutex_lock(&ra->ra_lock);
+        pthread_cond_broadcast(&ra->ra_done);
+        pthread_mutex_unlock(&ra->ra_lock);
+    }
+}
+
+/* Sleeps until kicked, unless @ready turns true meanwhile */
+static void route_async_sleep(struct route_async* ra, int (*ready)(struct route_async*)) {
+    atomic_store_explicit(&ra->ra_sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ready(ra)) {
+        atomic_store_explicit(&ra->ra_sleeping, 0, memory_order_relaxed);
+        return;
+    }
+    pthread_mutex_lock(&ra->ra_lock);
+    while (atomic_load_explicit(&ra->ra_sleeping, memory_order_relaxed)) {
+        pthread_cond_wait(&ra->ra_work, &ra->ra_lock);
+    }
+    pthread_mutex_unlock(&ra->ra_lock);
+}
+
+static int route_async_has_ops(struct route_async* ra) {
+    return !route_ring_empty(&ra->ra_sq) || atomic_load(&ra->ra_stop);
+}
+
+static int route_async_has_room(struct route_async* ra) {
+    return route_ring_has_room(&ra->ra_cq) || atomic_load(&ra->ra_stop);
+}
+
+static int route_async_apply(struct route_async* ra, struct route_async_sqe* sqe) {
+    struct route_info ri = {
+        .ri_dst = &sqe->ras_dst.sa,
+        .ri_netmask = sqe->ras_has_mask ? &sqe->ras_mask.sa : NULL,
+        .ri_gateway = sqe->ras_has_gw ? &sqe->ras_gw.sa : NULL,
+        .ri_flags = sqe->ras_flags,
+        .ri_ifindex = sqe->ras_ifindex,
+        .ri_fibnum = ra->ra_rh->rh_fibnum
+    };
+
+    switch (sqe->ras_op) {
+        case ROUTE_ASYNC_ADD:
+            return route_add(ra->ra_rh, &ri);
+        case ROUTE_ASYNC_DELETE:
+            return route_delete(ra->ra_rh, ri.ri_dst, ri.ri_netmask);
+        default:
+            return route_change(ra->ra_rh, &ri);
+    }
+}
+
+static void* route_async_writer(void* arg) {
+    struct route_async* ra = arg;
+    struct route_async_sqe sqe;
+    struct route_async_cqe cqe;
+    int n = 0;
+
+    for (;;) {
+        if (!route_ring_pop(&ra->ra_sq, &sqe, sizeof(sqe))) {
+            if (n > 0) {
+                route_async_notify(ra);
+                n = 0;
+            }
+            /* Ops submitted before the stop are visible once it is */
+            if (atomic_load(&ra->ra_stop)) {
+                if (route_ring_empty(&ra->ra_sq)) {
+                    break;
+                }
+                continue;
+            }
+            route_async_sleep(ra, route_async_has_ops);
+            continue;
+        }
+
+        cqe.rac_tag = sqe.ras_tag;
+        cqe.rac_op = sqe.ras_op;
+        cqe.rac_result = route_async_apply(ra, &sqe);
+
+        /* Completions are dropped only once the reapers are gone */
+        while (!route_ring_push(&ra->ra_cq, &cqe, sizeof(cqe)) && !atomic_load(&ra->ra_stop)) {
+            route_async_notify(ra);
+            n = 0;
+            route_async_sleep(ra, route_async_has_room);
+        }
+        if (++n == ROUTE_ASYNC_BATCH) {
+            route_async_notify(ra);
+            n = 0;
+        }
+    }
+    return NULL;
+}
+
+struct route_async* route_async_create(struct rib_head* rh, u_int entries) {
+    struct route_async* ra;
+
+    if (!rh || entries < 2 || entries > (1u << 20) ||
+        (entries & (entries - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ra = bsd_malloc(sizeof(*ra), M_RTABLE, M_WAITOK | M_ZERO);
+    if (!ra) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* Twice the completions, so that a full queue can be completed */
+    if (route_ring_init(&ra->ra_sq, entries, sizeof(struct route_async_sqe)) != 0 ||
+        route_ring_init(&ra->ra_cq, 2 * entries, sizeof(struct route_async_cqe)) != 0) {
+        bsd_free(ra->ra_sq.rr_slots, M_RTABLE);
+        bsd_free(ra, M_RTABLE);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ra->ra_rh = rh;
+    pthread_mutex_init(&ra->ra_lock, NULL);
+    pthread_cond_init(&ra->ra_work, NULL);
+    pthread_cond_init(&ra->ra_done, NULL);
+
+    if (pthread_create(&ra->ra_thread, NULL, route_async_writer, ra) != 0) {
+        pthread_cond_destroy(&ra->ra_done);
+        pthread_cond_destroy(&ra->ra_work);
+        pthread_mutex_destroy(&ra->ra_lock);
+        bsd_free(ra->ra_cq.rr_slots, M_RTABLE);
+        bsd_free(ra->ra_sq.rr_slots, M_RTABLE);
+        bsd_free(ra, M_RTABLE);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return ra;
+}
+
+void route_async_destroy(struct route_async* ra) {
+    if (!ra) return;
+
+    /* The writer applies what was submitted before leaving */
+    atomic_store(&ra->ra_stop, 1);
+    pthread_mutex_lock(&ra->ra_lock);
+    atomic_store_explicit(&ra->ra_sleeping, 0, memory_order_relaxed);
+    pthread_cond_signal(&ra->ra_work);
+    pthread_cond_broadcast(&ra->ra_done);
+    pthread_mutex_unlock(&ra->ra_lock);
+    pthread_join(ra->ra_thread, NULL);
+
+    pthread_cond_destroy(&ra->ra_done);
+    pthread_cond_destroy(&ra->ra_work);
+    pthread_mutex_destroy(&ra->ra_lock);
+    bsd_free(ra->ra_cq.rr_slots, M_RTABLE);
+    bsd_free(ra->ra_sq.rr_slots, M_RTABLE);
+    bsd_free(ra, M_RTABLE);
+}
+
+static int route_async_copy_sa(union route_sa* to, const struct sockaddr* sa) {
+    if (sa->sa_len > sizeof(*to)) {
+        return 0;
+    }
+    memcpy(to, sa, sa->sa_len);
+    return 1;
+}
+
+int route_async_submit(struct route_async* ra, int op, const struct route_info* ri,
+                       uint64_t tag) {
+    struct route_async_sqe sqe;
+
+    if (!ra || !ri || !ri->ri_dst || ri->ri_dst->sa_family != ra->ra_rh->rh_family ||
+        (op != ROUTE_ASYNC_ADD && op != ROUTE_ASYNC_DELETE && op != ROUTE_ASYNC_CHANGE)) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.ras_tag = tag;
+    sqe.ras_op = op;
+    sqe.ras_flags = ri->ri_flags;
+    sqe.ras_ifindex = ri->ri_ifindex;
+    sqe.ras_has_mask = (ri->ri_netmask != NULL);
+    sqe.ras_has_gw = (ri->ri_gateway != NULL);
+    if (!route_async_copy_sa(&sqe.ras_dst, ri->ri_dst) ||
+        (ri->ri_netmask && !route_async_copy_sa(&sqe.ras_mask, ri->ri_netmask)) ||
+        (ri->ri_gateway && !route_async_copy_sa(&sqe.ras_gw, ri->ri_gateway))) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    if (!route_ring_push(&ra->ra_sq, &sqe, sizeof(sqe))) {
+        errno = EAGAIN;
+        return ROUTE_EBUSY;
+    }
+    route_async_kick(ra);
+    return ROUTE_OK;
+}
+
+int route_async_reap(struct route_async* ra, struct route_async_cqe* cqes, int max, int wait) {
+    int n = 0;
+
+    if (!ra || !cqes || max <= 0) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    for (;;) {
+        while (n < max && route_ring_pop(&ra->ra_cq, &cqes[n], sizeof(*cqes))) {
+            n++;
+        }
+        if (n > 0 || !wait || atomic_load(&ra->ra_stop)) {
+            break;
+        }
+        pthread_mutex_lock(&ra->ra_lock);
+        atomic_fetch_add(&ra->ra_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (route_ring_empty(&ra->ra_cq) && !atomic_load(&ra->ra_stop)) {
+            pthread_cond_wait(&ra->ra_done, &ra->ra_lock);
+        }
+        atomic_fetch_sub(&ra->ra_waiters, 1);
+        pthread_mutex_unlock(&ra->ra_lock);
+    }
+
+    if (n > 0) {
+        route_async_kick(ra);           /* The writer may wait for room */
+    }
+    return n;
+}
@@ -0,0 +1,295 @@
+/*
+ * FreeBSD Routing Library - Delta Logs
+ *
+ * route_table_set_delta_log() keeps the changes of a table since a
+ * generation for route_table_changes(). Staged changes and route origins
+ * keep their pending state in logs of the same kind.
+ */
+
+#include "route_lib_var.h"
+
+void route_delta_unlink(struct route_delta_log* dl, struct route_delta_ent* de) {
+    if (de->de_prev) {
+        de->de_prev->de_next = de->de_next;
+    } else {
+        dl->dl_head = de->de_next;
+    }
+    if (de->de_next) {
+        de->de_next->de_prev = de->de_prev;
+    } else {
+        dl->dl_tail = de->de_prev;
+    }
+}
+
+void route_delta_append(struct route_delta_log* dl, struct route_delta_ent* de) {
+    de->de_next = NULL;
+    de->de_prev = dl->dl_tail;
+    if (dl->dl_tail) {
+        dl->dl_tail->de_next = de;
+    } else {
+        dl->dl_head = de;
+    }
+    dl->dl_tail = de;
+}
+
+void route_delta_unhash(struct route_delta_log* dl, struct route_delta_ent* de) {
+    struct route_delta_ent** pp = &dl->dl_hash[de->de_hash & dl->dl_hmask];
+
+    while (*pp != de) {
+        pp = &(*pp)->de_hnext;
+    }
+    *pp = de->de_hnext;
+}
+
+void route_delta_clear(struct route_delta_log* dl) {
+    struct route_delta_ent* de;
+
+    while ((de = dl->dl_head) != NULL) {
+        dl->dl_head = de->de_next;
+        bsd_free(de, M_RTABLE);
+    }
+    dl->dl_tail = NULL;
+    dl->dl_count = 0;
+    memset(dl->dl_hash, 0, (dl->dl_hmask + 1) * sizeof(*dl->dl_hash));
+}
+
+/* Sets up the empty log @dl of up to @max prefixes, returns an errno value */
+int route_delta_init(struct route_delta_log* dl, int family, size_t max) {
+    size_t buckets;
+
+    if (route_snap_addr(family, &dl->dl_off, &dl->dl_len) != 0) {
+        return EAFNOSUPPORT;
+    }
+    for (buckets = 64; buckets < max; buckets *= 2)
+        ;
+    dl->dl_hash = bsd_malloc(buckets * sizeof(*dl->dl_hash), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!dl->dl_hash) {
+        return ENOMEM;
+    }
+    dl->dl_hmask = buckets - 1;
+    dl->dl_max = max;
+    return 0;
+}
+
+void route_delta_fini(struct route_delta_log* dl) {
+    route_delta_clear(dl);
+    bsd_free(dl->dl_hash, M_RTABLE);
+}
+
+void route_delta_drop(struct rib_head* rh) {
+    struct route_delta_log* dl = rh->rh_deltas;
+
+    if (!dl) {
+        return;
+    }
+    rh->rh_deltas = NULL;
+    route_delta_fini(dl);
+    bsd_free(dl, M_RTABLE);
+}
+
+/* Fills the key of @de from @ri, returns 0 if it does not fit */
+int route_delta_key(const struct route_delta_log* dl, struct route_delta_ent* de,
+                    const struct route_info* ri) {
+    const struct sockaddr* dst = ri->ri_dst;
+    const struct sockaddr* mask = ri->ri_netmask;
+    uint8_t* addr = (uint8_t*)&de->de_dst + dl->dl_off;
+    uint32_t h = 2166136261u;  /* FNV-1a */
+
+    if (dst->sa_len > sizeof(de->de_dst) || dst->sa_len < dl->dl_off + dl->dl_len ||
+        (mask && mask->sa_len > sizeof(de->de_mask))) {
+        return 0;
+    }
+    memset(&de->de_dst, 0, sizeof(de->de_dst));
+    memset(&de->de_mask, 0, sizeof(de->de_mask));
+    memcpy(&de->de_dst, dst, dst->sa_len);
+    de->de_has_mask = (mask != NULL);
+    if (mask) {
+        const uint8_t* m = (const uint8_t*)&de->de_mask + dl->dl_off;
+
+        memcpy(&de->de_mask, mask, mask->sa_len);
+        for (size_t i = 0; i < dl->dl_len; i++) {
+            addr[i] &= (dl->dl_off + i < mask->sa_len) ? m[i] : 0;
+        }
+    }
+    for (size_t i = 0; i < dl->dl_len; i++) {
+        h = (h ^ addr[i]) * 16777619u;
+        if (mask) {
+            h = (h ^ ((const uint8_t*)&de->de_mask)[dl->dl_off + i]) * 16777619u;
+        }
+    }
+    de->de_hash = h ^ de->de_has_mask;
+    return 1;
+}
+
+static int route_delta_same(const struct route_delta_log* dl, const struct route_delta_ent* a,
+                            const struct route_delta_ent* b) {
+    return a->de_hash == b->de_hash && a->de_has_mask == b->de_has_mask &&
+        memcmp((const uint8_t*)&a->de_dst + dl->dl_off,
+               (const uint8_t*)&b->de_dst + dl->dl_off, dl->dl_len) == 0 &&
+        (!a->de_has_mask ||
+         memcmp((const uint8_t*)&a->de_mask + dl->dl_off,
+                (const uint8_t*)&b->de_mask + dl->dl_off, dl->dl_len) == 0);
+}
+
+struct route_delta_ent* route_delta_find(const struct route_delta_log* dl,
+                                         const struct route_delta_ent* key) {
+    struct route_delta_ent* de;
+
+    for (de = dl->dl_hash[key->de_hash & dl->dl_hmask]; de; de = de->de_hnext) {
+        if (route_delta_same(dl, de, key)) {
+            return de;
+        }
+    }
+    return NULL;
+}
+
+/* Sets the route state of @de, as after @op (ROUTE_DELTA_*) of @ri */
+void route_delta_set(struct route_delta_ent* de, int op, const struct route_info* ri) {
+    de->de_op = op;
+    de->de_has_gw = 0;
+    de->de_flags = 0;
+    de->de_ifindex = 0;
+    if (op == ROUTE_DELTA_SET) {
+        de->de_flags = ri->ri_flags;
+        de->de_ifindex = ri->ri_ifindex;
+        if (ri->ri_gateway && ri->ri_gateway->sa_len <= sizeof(de->de_gw)) {
+            memcpy(&de->de_gw, ri->ri_gateway, ri->ri_gateway->sa_len);
+            de->de_has_gw = 1;
+        }
+    }
+}
+
+void route_delta_info(const struct route_delta_ent* de, u_int fibnum, struct route_info* ri) {
+    *ri = (struct route_info){
+        .ri_dst = (struct sockaddr*)&de->de_dst.sa,
+        .ri_netmask = de->de_has_mask ? (struct sockaddr*)&de->de_mask.sa : NULL,
+        .ri_gateway = de->de_has_gw ? (struct sockaddr*)&de->de_gw.sa : NULL,
+        .ri_flags = de->de_flags,
+        .ri_ifindex = de->de_ifindex,
+        .ri_fibnum = fibnum
+    };
+}
+
+/* Records the change @op of route @ri, NULL for a flush */
+void route_delta_note(struct rib_head* rh, uint32_t op, const struct route_info* ri) {
+    struct route_delta_log* dl = rh->rh_deltas;
+    struct route_delta_ent key, *de;
+
+    if (!dl) {
+        return;
+    }
+    dl->dl_gen++;
+
+    /* A flush deletes every route: only a full resync tells which */
+    if (op == RJ_OP_FLUSH || !route_delta_key(dl, &key, ri)) {
+        route_delta_clear(dl);
+        dl->dl_floor = dl->dl_gen;
+        return;
+    }
+
+    if ((de = route_delta_find(dl, &key)) != NULL) {
+        route_delta_unlink(dl, de);
+    } else {
+        if (dl->dl_count == dl->dl_max) {
+            /* Consumers behind the oldest change can no longer catch up */
+            struct route_delta_ent* old = dl->dl_head;
+
+            route_delta_unlink(dl, old);
+            route_delta_unhash(dl, old);
+            dl->dl_floor = old->de_gen;
+            bsd_free(old, M_RTABLE);
+            dl->dl_count--;
+        }
+        de = bsd_malloc(sizeof(*de), M_RTABLE, M_NOWAIT);
+        if (!de) {
+            route_delta_clear(dl);
+            dl->dl_floor = dl->dl_gen;
+            return;
+        }
+        memcpy(de, &key, sizeof(*de));
+        de->de_hnext = dl->dl_hash[de->de_hash & dl->dl_hmask];
+        dl->dl_hash[de->de_hash & dl->dl_hmask] = de;
+        dl->dl_count++;
+    }
+
+    de->de_gen = dl->dl_gen;
+    route_delta_set(de, (op == RJ_OP_SET) ? ROUTE_DELTA_SET : ROUTE_DELTA_DEL, ri);
+    route_delta_append(dl, de);
+}
+
+int route_table_set_delta_log(struct rib_head* rh, size_t max) {
+    struct route_delta_log* dl;
+
+    if (!rh || max > ROUTE_DELTA_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    route_delta_drop(rh);
+    if (max == 0) {
+        return ROUTE_OK;
+    }
+
+    dl = bsd_malloc(sizeof(*dl), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!dl) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    if ((error = route_delta_init(dl, rh->rh_family, max)) != 0) {
+        bsd_free(dl, M_RTABLE);
+        errno = error;
+        return (error == ENOMEM) ? ROUTE_ENOMEM : ROUTE_ENOTSUPP;
+    }
+
+    /* Nothing before now is logged, consumers start with a resync */
+    dl->dl_gen = dl->dl_floor = 1;
+    rh->rh_deltas = dl;
+    return ROUTE_OK;
+}
+
+int route_table_changes(struct rib_head* rh, uint64_t since, struct route_delta* deltas,
+                        int max, uint64_t* genp) {
+    struct route_delta_log* dl;
+    struct route_delta_ent* de;
+    int n = 0;
+
+    if (!rh || !rh->rh_deltas || !genp || (max > 0 && !deltas) || max < 0) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    dl = rh->rh_deltas;
+    if (since < dl->dl_floor || since > dl->dl_gen) {
+        *genp = dl->dl_gen;
+        errno = ESTALE;
+        return ROUTE_ESTALE;
+    }
+
+    /* Back from the newest change to the first one past @since */
+    for (de = dl->dl_tail; de && de->de_prev && de->de_prev->de_gen > since; de = de->de_prev)
+        ;
+    if (de && de->de_gen <= since) {
+        de = NULL;
+    }
+    for (; de && n < max; de = de->de_next, n++) {
+        struct route_delta* d = &deltas[n];
+
+        d->rd_gen = de->de_gen;
+        d->rd_op = de->de_op;
+        route_delta_info(de, rh->rh_fibnum, &d->rd_info);
+    }
+
+    /* A partial batch resumes after its last delta */
+    *genp = !de ? dl->dl_gen : (n > 0 ? deltas[n - 1].rd_gen : since);
+    return n;
+}
@@ -0,0 +1,227 @@
+/*
+ * FreeBSD Routing Library - Exported Tables
+ *
+ * route_table_export() publishes the snapshot image of a table at a path
+ * that other processes map with route_export_attach() and look up with
+ * route_export_lookup(), without any call into the writer.
+ */
+
+#include "route_lib_var.h"
+
+/*
+ * Exported tables
+ *
+ * An export is a snapshot image replaced atomically at @path, plus the
+ * generation word in "@path.gen", bumped after each replacement. Readers
+ * map both; the image is never written in place, so a lookup only has to
+ * load the generation to know whether its mapping is current.
+ */
+#define ROUTE_EXPORT_MAGIC  0x52584745  /* "RXGE" */
+
+struct route_export_gen {
+    uint32_t rxg_magic;
+    uint32_t rxg_pad;
+    _Atomic uint64_t rxg_gen;
+};
+
+struct route_export_reader {
+    char rx_path[PATH_MAX];
+    struct route_export_gen* rx_genp;
+    uint64_t rx_gen;                    /* Generation of rx_snap */
+    struct route_snap rx_snap;          /* rs_hdr is NULL until mapped */
+};
+
+/* Maps the generation word of export @path, creating it if @create */
+static struct route_export_gen* route_export_gen_map(const char* path, int create) {
+    char gpath[PATH_MAX];
+    struct route_export_gen* g;
+    struct stat st;
+    int fd;
+
+    if (snprintf(gpath, sizeof(gpath), "%s.gen", path) >= (int)sizeof(gpath)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    fd = open(gpath, create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 ||
+        (st.st_size < (off_t)sizeof(*g) && (!create || ftruncate(fd, sizeof(*g)) != 0))) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    g = mmap(NULL, sizeof(*g), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (g == MAP_FAILED) {
+        return NULL;
+    }
+    if (create && g->rxg_magic == 0) {
+        g->rxg_magic = ROUTE_EXPORT_MAGIC;
+    }
+    if (g->rxg_magic != ROUTE_EXPORT_MAGIC) {
+        munmap(g, sizeof(*g));
+        errno = EINVAL;
+        return NULL;
+    }
+    return g;
+}
+
+int route_table_export(struct rib_head* rh, const char* path) {
+    struct route_export_gen* g;
+    void* img;
+    size_t size;
+
+    if (!rh || !path) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    if (!(g = route_export_gen_map(path, 1))) {
+        return ROUTE_EINVAL;
+    }
+    error = route_snap_build(rh, &img, &size);
+    if (error == 0) {
+        error = route_snap_write(path, img, size);
+        bsd_free(img, M_RTABLE);
+    }
+    /* Readers seeing the new generation find the new image at @path */
+    if (error == 0) {
+        atomic_fetch_add_explicit(&g->rxg_gen, 1, memory_order_release);
+    }
+    munmap(g, sizeof(*g));
+
+    if (error != 0) {
+        errno = error;
+        switch (error) {
+            case ENOMEM:
+                return ROUTE_ENOMEM;
+            case EOPNOTSUPP:
+                return ROUTE_ENOTSUPP;
+            default:
+                return ROUTE_EINVAL;
+        }
+    }
+    return ROUTE_OK;
+}
+
+static void route_export_unmap(struct route_export_reader* rx) {
+    if (rx->rx_snap.rs_hdr) {
+        munmap((void*)rx->rx_snap.rs_hdr, rx->rx_snap.rs_size);
+        rx->rx_snap.rs_hdr = NULL;
+    }
+}
+
+/* Maps the image of generation @gen, keeping the old one on failure */
+static int route_export_remap(struct route_export_reader* rx, uint64_t gen) {
+    struct route_snap* rs = &rx->rx_snap;
+    struct stat st;
+    void* img;
+    int fd, error;
+
+    fd = open(rx->rx_path, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct route_snap_hdr)) {
+        close(fd);
+        return EINVAL;
+    }
+    img = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED) {
+        return errno;
+    }
+    if ((error = route_snap_validate(img, st.st_size)) != 0) {
+        munmap(img, st.st_size);
+        return error;
+    }
+
+    route_export_unmap(rx);
+    rs->rs_hdr = img;
+    rs->rs_nhops = (const struct route_snap_nhop*)(rs->rs_hdr + 1);
+    rs->rs_prefixes = (const struct route_snap_prefix*)(rs->rs_nhops + rs->rs_hdr->rsh_nnhops);
+    rs->rs_size = st.st_size;
+    route_snap_addr(rs->rs_hdr->rsh_family, &rs->rs_addr_off, &rs->rs_addr_len);
+    rx->rx_gen = gen;
+    return 0;
+}
+
+struct route_export_reader* route_export_attach(const char* path) {
+    struct route_export_reader* rx;
+    int error;
+
+    if (!path || strlen(path) >= sizeof(rx->rx_path)) {
+        errno = path ? ENAMETOOLONG : EINVAL;
+        return NULL;
+    }
+    rx = bsd_malloc(sizeof(*rx), M_RTABLE, M_WAITOK | M_ZERO);
+    if (!rx) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    strcpy(rx->rx_path, path);
+    if (!(rx->rx_genp = route_export_gen_map(path, 0))) {
+        error = errno;
+        bsd_free(rx, M_RTABLE);
+        errno = error;
+        return NULL;
+    }
+    error = route_export_remap(rx, atomic_load_explicit(&rx->rx_genp->rxg_gen,
+                                                        memory_order_acquire));
+    if (error != 0) {
+        route_export_detach(rx);
+        errno = error;
+        return NULL;
+    }
+    return rx;
+}
+
+void route_export_detach(struct route_export_reader* rx) {
+    if (!rx) return;
+
+    route_export_unmap(rx);
+    munmap(rx->rx_genp, sizeof(*rx->rx_genp));
+    bsd_free(rx, M_RTABLE);
+}
+
+int route_export_lookup(struct route_export_reader* rx, const struct sockaddr* dst,
+                        struct route_info* ri_out) {
+    const struct route_snap_prefix* p;
+    struct route_snap* rs;
+    uint64_t gen;
+
+    if (!rx || !dst || !ri_out) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    /* A failed remap keeps serving the previous image and retries next time */
+    gen = atomic_load_explicit(&rx->rx_genp->rxg_gen, memory_order_acquire);
+    if (gen != rx->rx_gen) {
+        route_export_remap(rx, gen);
+    }
+
+    rs = &rx->rx_snap;
+    if (dst->sa_family != rs->rs_hdr->rsh_family ||
+        dst->sa_len < rs->rs_addr_off + rs->rs_addr_len) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (!(p = route_snap_match(rs, dst))) {
+        errno = ENOENT;
+        return ROUTE_ENOENT;
+    }
+    route_snap_fill(rs, p, ri_out);
+    return ROUTE_OK;
+}
+
+uint64_t route_export_generation(const struct route_export_reader* rx) {
+    return rx ? rx->rx_gen : 0;
+}
@@ -0,0 +1,539 @@
+/*
+ * FreeBSD Routing Library - Change Journal
+ *
+ * route_journal_open() logs every change of a table to a file written
+ * in groups by a thread of its own, route_journal_replay() applies such
+ * a file to a table, restored from a snapshot or empty.
+ */
+
+#include "route_lib_var.h"
+
+/*
+ * Change journal
+ *
+ * Every change to a table with a journal is appended to rj_pend as a
+ * fixed size record and the writer thread is woken up. The writer takes
+ * all records pending at once, writes them with a single write() and
+ * syncs the file once for the group, so changes never wait on the disk.
+ * Records carry the table sequence number, which snapshots also store:
+ * a restored table replays the records past the one of its image.
+ */
+#define ROUTE_JRNL_MAGIC    0x524a4e4c  /* "RJNL" */
+#define ROUTE_JRNL_VERSION  1
+
+struct route_jrnl_hdr {
+    uint32_t rjh_magic;
+    uint32_t rjh_version;
+    uint32_t rjh_family;
+    uint32_t rjh_pad;
+};
+
+struct route_jrnl_rec {
+    uint32_t rjr_csum;            /* FNV-1a of the rest of the record */
+    uint32_t rjr_op;              /* RJ_OP_* */
+    uint64_t rjr_seq;
+    int32_t rjr_flags;
+    int32_t rjr_ifindex;
+    uint32_t rjr_fibnum;
+    uint32_t rjr_pad;
+    union route_sa rjr_dst;
+    union route_sa rjr_mask;      /* sa_len 0 for host routes */
+    union route_sa rjr_gw;        /* sa_len 0 without gateway */
+};
+
+struct route_journal {
+    pthread_mutex_t rj_lock;
+    pthread_cond_t rj_work;       /* Records pending, trim or stop */
+    pthread_cond_t rj_done;       /* rj_synced moved */
+    struct route_jrnl_rec* rj_pend; /* Appended to by changes */
+    size_t rj_npend;
+    size_t rj_pend_max;
+    struct route_jrnl_rec* rj_out;  /* Being written */
+    size_t rj_out_max;
+    uint64_t rj_synced;           /* Last record on disk */
+    uint64_t rj_trim;             /* Drop records up to this one, 0 if none */
+    int rj_error;                 /* Sticky, errno value */
+    int rj_stop;
+    int rj_fd;
+    char* rj_path;
+    pthread_t rj_thread;
+};
+
+static uint32_t route_jrnl_csum(const struct route_jrnl_rec* r) {
+    const uint8_t* p = (const uint8_t*)r + sizeof(r->rjr_csum);
+    uint32_t h = 2166136261u;  /* FNV-1a */
+
+    for (size_t i = 0; i < sizeof(*r) - sizeof(r->rjr_csum); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Number of sound records of the image, stopping at the first torn one */
+static int route_jrnl_scan(const void* img, size_t size, int family, size_t* nrecp) {
+    const struct route_jrnl_hdr* hdr = img;
+    const struct route_jrnl_rec* recs = (const struct route_jrnl_rec*)(hdr + 1);
+    size_t i, n;
+
+    if (size < sizeof(*hdr) || hdr->rjh_magic != ROUTE_JRNL_MAGIC ||
+        hdr->rjh_version != ROUTE_JRNL_VERSION || hdr->rjh_family != (uint32_t)family) {
+        return EINVAL;
+    }
+    n = (size - sizeof(*hdr)) / sizeof(*recs);
+    for (i = 0; i < n; i++) {
+        const struct route_jrnl_rec* r = &recs[i];
+        if (r->rjr_csum != route_jrnl_csum(r) || (i > 0 && r->rjr_seq <= recs[i - 1].rjr_seq) ||
+            r->rjr_op < RJ_OP_SET || r->rjr_op > RJ_OP_FLUSH ||
+            r->rjr_dst.sa.sa_len > sizeof(union route_sa) ||
+            r->rjr_mask.sa.sa_len > sizeof(union route_sa) ||
+            r->rjr_gw.sa.sa_len > sizeof(union route_sa) ||
+            (r->rjr_op != RJ_OP_FLUSH && r->rjr_dst.sa.sa_family != family)) {
+            break;
+        }
+    }
+    *nrecp = i;
+    return 0;
+}
+
+/* Maps journal @path, NULL with errno set on failure */
+static const void* route_jrnl_map(const char* path, size_t* sizep) {
+    struct stat st;
+    void* img;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct route_jrnl_hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED) {
+        return NULL;
+    }
+    *sizep = st.st_size;
+    return img;
+}
+
+static int route_jrnl_sync(int fd) {
+#if defined(__linux__)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+/* Rewrites the journal without the records up to @seq, on the writer thread */
+static int route_jrnl_compact(struct route_journal* rj, uint64_t seq) {
+    const struct route_jrnl_rec* recs;
+    size_t size, skip = 0, keep;
+    const void* img;
+    int fd, error;
+
+    img = route_jrnl_map(rj->rj_path, &size);
+    if (!img) {
+        return errno;
+    }
+    recs = (const struct route_jrnl_rec*)((const struct route_jrnl_hdr*)img + 1);
+    keep = (size - sizeof(struct route_jrnl_hdr)) / sizeof(*recs);
+    while (skip < keep && recs[skip].rjr_seq <= seq) {
+        skip++;
+    }
+    keep -= skip;
+
+    char* buf = bsd_malloc(sizeof(struct route_jrnl_hdr) + keep * sizeof(*recs),
+                           M_RTABLE, M_NOWAIT);
+    if (!buf) {
+        munmap((void*)img, size);
+        return ENOMEM;
+    }
+    memcpy(buf, img, sizeof(struct route_jrnl_hdr));
+    memcpy(buf + sizeof(struct route_jrnl_hdr), recs + skip, keep * sizeof(*recs));
+    munmap((void*)img, size);
+
+    error = route_snap_write(rj->rj_path, buf,
+                             sizeof(struct route_jrnl_hdr) + keep * sizeof(*recs));
+    bsd_free(buf, M_RTABLE);
+    if (error != 0) {
+        return error;
+    }
+
+    /* Appends go to the new file from now on */
+    fd = open(rj->rj_path, O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        return errno;
+    }
+    close(rj->rj_fd);
+    rj->rj_fd = fd;
+    return 0;
+}
+
+static void* route_jrnl_writer(void* arg) {
+    struct route_journal* rj = arg;
+
+    pthread_mutex_lock(&rj->rj_lock);
+    for (;;) {
+        while (rj->rj_npend == 0 && rj->rj_trim == 0 && !rj->rj_stop) {
+            pthread_cond_wait(&rj->rj_work, &rj->rj_lock);
+        }
+        if (rj->rj_npend == 0 && rj->rj_trim == 0) {
+            break;
+        }
+
+        /* Take the whole group, changes go on filling the other buffer */
+        struct route_jrnl_rec* recs = rj->rj_pend;
+        size_t n = rj->rj_npend, max = rj->rj_pend_max;
+        uint64_t trim = rj->rj_trim;
+        int error = 0;
+
+        rj->rj_pend = rj->rj_out;
+        rj->rj_pend_max = rj->rj_out_max;
+        rj->rj_npend = 0;
+        rj->rj_out = recs;
+        rj->rj_out_max = max;
+        rj->rj_trim = 0;
+        pthread_mutex_unlock(&rj->rj_lock);
+
+        if (n > 0) {
+            error = route_write_full(rj->rj_fd, recs, n * sizeof(*recs));
+            if (error == 0 && route_jrnl_sync(rj->rj_fd) != 0) {
+                error = errno;
+            }
+        }
+        if (error == 0 && trim != 0) {
+            error = route_jrnl_compact(rj, trim);
+        }
+
+        pthread_mutex_lock(&rj->rj_lock);
+        if (error != 0 && rj->rj_error == 0) {
+            rj->rj_error = error;
+        }
+        if (error == 0 && n > 0) {
+            rj->rj_synced = recs[n - 1].rjr_seq;
+        }
+        pthread_cond_broadcast(&rj->rj_done);
+    }
+    pthread_mutex_unlock(&rj->rj_lock);
+    return NULL;
+}
+
+void route_journal_log(struct rib_head* rh, uint32_t op, const struct route_info* ri) {
+    struct route_journal* rj = rh->rh_journal;
+    struct route_jrnl_rec* r;
+
+    if (!rj) {
+        return;
+    }
+
+    pthread_mutex_lock(&rj->rj_lock);
+    if (rj->rj_error != 0) {
+        goto out;
+    }
+    if (ri && (ri->ri_dst->sa_len > sizeof(union route_sa) ||
+               (ri->ri_netmask && ri->ri_netmask->sa_len > sizeof(union route_sa)) ||
+               (ri->ri_gateway && ri->ri_gateway->sa_len > sizeof(union route_sa)))) {
+        rj->rj_error = EOPNOTSUPP;
+        goto out;
+    }
+    if (rj->rj_npend == rj->rj_pend_max) {
+        size_t max = rj->rj_pend_max ? 2 * rj->rj_pend_max : 64;
+        r = bsd_malloc(max * sizeof(*r), M_RTABLE, M_NOWAIT);
+        if (!r) {
+            rj->rj_error = ENOMEM;
+            goto out;
+        }
+        if (rj->rj_npend > 0) {
+            memcpy(r, rj->rj_pend, rj->rj_npend * sizeof(*r));
+        }
+        bsd_free(rj->rj_pend, M_RTABLE);
+        rj->rj_pend = r;
+        rj->rj_pend_max = max;
+    }
+
+    r = &rj->rj_pend[rj->rj_npend++];
+    memset(r, 0, sizeof(*r));
+    r->rjr_op = op;
+    r->rjr_seq = ++rh->rh_seq;
+    if (ri) {
+        memcpy(&r->rjr_dst, ri->ri_dst, ri->ri_dst->sa_len);
+        if (ri->ri_netmask) {
+            memcpy(&r->rjr_mask, ri->ri_netmask, ri->ri_netmask->sa_len);
+        }
+        if (op == RJ_OP_SET) {
+            if (ri->ri_gateway) {
+                memcpy(&r->rjr_gw, ri->ri_gateway, ri->ri_gateway->sa_len);
+            }
+            r->rjr_flags = ri->ri_flags;
+            r->rjr_ifindex = ri->ri_ifindex;
+            r->rjr_fibnum = ri->ri_fibnum;
+        }
+    }
+    r->rjr_csum = route_jrnl_csum(r);
+    if (rj->rj_npend == 1) {
+        pthread_cond_signal(&rj->rj_work);
+    }
+out:
+    pthread_mutex_unlock(&rj->rj_lock);
+}
+
+void route_journal_trim(struct rib_head* rh, uint64_t seq) {
+    struct route_journal* rj = rh->rh_journal;
+
+    if (!rj || seq == 0) {
+        return;
+    }
+    pthread_mutex_lock(&rj->rj_lock);
+    rj->rj_trim = seq;
+    pthread_cond_signal(&rj->rj_work);
+    pthread_mutex_unlock(&rj->rj_lock);
+}
+
+static void route_journal_free(struct route_journal* rj) {
+    if (rj->rj_fd >= 0) {
+        close(rj->rj_fd);
+    }
+    pthread_cond_destroy(&rj->rj_done);
+    pthread_cond_destroy(&rj->rj_work);
+    pthread_mutex_destroy(&rj->rj_lock);
+    bsd_free(rj->rj_pend, M_RTABLE);
+    bsd_free(rj->rj_out, M_RTABLE);
+    bsd_free(rj->rj_path, M_RTABLE);
+    bsd_free(rj, M_RTABLE);
+}
+
+/* Checks journal @fd and cuts a torn tail, returns 0 or an errno value */
+static int route_jrnl_recover(int fd, const char* path, int family, uint64_t* seqp) {
+    struct route_jrnl_hdr hdr;
+    struct stat st;
+    const void* img;
+    size_t size, n = 0;
+    int error;
+
+    if (fstat(fd, &st) != 0) {
+        return errno;
+    }
+    if (st.st_size == 0) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.rjh_magic = ROUTE_JRNL_MAGIC;
+        hdr.rjh_version = ROUTE_JRNL_VERSION;
+        hdr.rjh_family = family;
+        error = route_write_full(fd, &hdr, sizeof(hdr));
+        if (error == 0 && fsync(fd) != 0) {
+            error = errno;
+        }
+        *seqp = 0;
+        return error;
+    }
+
+    img = route_jrnl_map(path, &size);
+    if (!img) {
+        return errno;
+    }
+    error = route_jrnl_scan(img, size, family, &n);
+    if (error == 0) {
+        const struct route_jrnl_rec* recs =
+            (const struct route_jrnl_rec*)((const struct route_jrnl_hdr*)img + 1);
+        *seqp = n > 0 ? recs[n - 1].rjr_seq : 0;
+    }
+    munmap((void*)img, size);
+
+    /* A crash in the middle of a group leaves a partial record behind */
+    size_t valid = sizeof(hdr) + n * sizeof(struct route_jrnl_rec);
+    if (error == 0 && valid < size && (ftruncate(fd, valid) != 0 || fsync(fd) != 0)) {
+        error = errno;
+    }
+    return error;
+}
+
+int route_journal_open(struct rib_head* rh, const char* path) {
+    struct route_journal* rj;
+    size_t off, len;
+    uint64_t seq = 0;
+    int fd, error;
+
+    if (!rh || !path) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (rh->rh_journal) {
+        errno = EBUSY;
+        return ROUTE_EBUSY;
+    }
+    if (route_snap_addr(rh->rh_family, &off, &len) != 0) {
+        errno = EOPNOTSUPP;
+        return ROUTE_ENOTSUPP;
+    }
+
+    error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return ROUTE_EINVAL;
+    }
+    error = route_jrnl_recover(fd, path, rh->rh_family, &seq);
+    if (error != 0) {
+        close(fd);
+        errno = error;
+        return ROUTE_EINVAL;
+    }
+
+    rj = bsd_malloc(sizeof(*rj), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (rj) {
+        rj->rj_path = bsd_malloc(strlen(path) + 1, M_RTABLE, M_NOWAIT);
+    }
+    if (!rj || !rj->rj_path) {
+        if (rj) {
+            bsd_free(rj, M_RTABLE);
+        }
+        close(fd);
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    memcpy(rj->rj_path, path, strlen(path) + 1);
+    rj->rj_fd = fd;
+    pthread_mutex_init(&rj->rj_lock, NULL);
+    pthread_cond_init(&rj->rj_work, NULL);
+    pthread_cond_init(&rj->rj_done, NULL);
+
+    /* Numbers go on from the table or the journal, whichever is ahead */
+    rh->rh_seq = max(rh->rh_seq, seq);
+    rj->rj_synced = rh->rh_seq;
+
+    if (pthread_create(&rj->rj_thread, NULL, route_jrnl_writer, rj) != 0) {
+        route_journal_free(rj);
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    rh->rh_journal = rj;
+    return ROUTE_OK;
+}
+
+int route_journal_sync(struct rib_head* rh) {
+    struct route_journal* rj;
+    int error;
+
+    if (!rh || !rh->rh_journal) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    rj = rh->rh_journal;
+
+    pthread_mutex_lock(&rj->rj_lock);
+    while (rj->rj_synced < rh->rh_seq && rj->rj_error == 0) {
+        pthread_cond_wait(&rj->rj_done, &rj->rj_lock);
+    }
+    error = rj->rj_error;
+    pthread_mutex_unlock(&rj->rj_lock);
+
+    if (error != 0) {
+        errno = error;
+        switch (error) {
+            case ENOMEM:
+                return ROUTE_ENOMEM;
+            case EOPNOTSUPP:
+                return ROUTE_ENOTSUPP;
+            default:
+                return ROUTE_EINVAL;
+        }
+    }
+    return ROUTE_OK;
+}
+
+void route_journal_close(struct rib_head* rh) {
+    struct route_journal* rj;
+
+    if (!rh || !rh->rh_journal) {
+        return;
+    }
+    rj = rh->rh_journal;
+    rh->rh_journal = NULL;
+
+    /* The writer drains what is pending before leaving */
+    pthread_mutex_lock(&rj->rj_lock);
+    rj->rj_stop = 1;
+    pthread_cond_signal(&rj->rj_work);
+    pthread_mutex_unlock(&rj->rj_lock);
+    pthread_join(rj->rj_thread, NULL);
+
+    route_journal_free(rj);
+}
+
+/* Applies record @r to @rh, deletes of missing routes are not errors */
+static int route_jrnl_apply(struct rib_head* rh, const struct route_jrnl_rec* r) {
+    struct route_info ri;
+    union route_sa dst, mask, gw;
+    int error;
+
+    if (r->rjr_op == RJ_OP_FLUSH) {
+        return route_table_flush(rh);
+    }
+
+    /* The radix calls want writable keys */
+    memcpy(&dst, &r->rjr_dst, sizeof(dst));
+    memcpy(&mask, &r->rjr_mask, sizeof(mask));
+    memcpy(&gw, &r->rjr_gw, sizeof(gw));
+    memset(&ri, 0, sizeof(ri));
+    ri.ri_dst = &dst.sa;
+    ri.ri_netmask = mask.sa.sa_len ? &mask.sa : NULL;
+    ri.ri_gateway = gw.sa.sa_len ? &gw.sa : NULL;
+    ri.ri_flags = r->rjr_flags;
+    ri.ri_ifindex = r->rjr_ifindex;
+    ri.ri_fibnum = r->rjr_fibnum;
+
+    error = rib_del(rh, ri.ri_dst, ri.ri_netmask);
+    if (error == ROUTE_ENOENT) {
+        error = ROUTE_OK;
+    }
+    if (error == ROUTE_OK && r->rjr_op == RJ_OP_SET) {
+        error = rib_add(rh, &ri);
+    }
+    return error;
+}
+
+int route_journal_replay(struct rib_head* rh, const char* path) {
+    const struct route_jrnl_rec* recs;
+    const void* img;
+    size_t size, n;
+    int error;
+
+    if (!rh || !path) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (rh->rh_journal) {
+        errno = EBUSY;
+        return ROUTE_EBUSY;
+    }
+
+    img = route_jrnl_map(path, &size);
+    if (!img) {
+        return errno == ENOENT ? ROUTE_ENOENT : ROUTE_EINVAL;
+    }
+    error = route_jrnl_scan(img, size, rh->rh_family, &n);
+    if (error != 0) {
+        munmap((void*)img, size);
+        errno = error;
+        return ROUTE_EINVAL;
+    }
+
+    recs = (const struct route_jrnl_rec*)((const struct route_jrnl_hdr*)img + 1);
+    error = ROUTE_OK;
+    for (size_t i = 0; i < n && error == ROUTE_OK; i++) {
+        if (recs[i].rjr_seq <= rh->rh_seq) {
+            continue;  /* Already in the image */
+        }
+        error = route_jrnl_apply(rh, &recs[i]);
+        if (error == ROUTE_OK) {
+            rh->rh_seq = recs[i].rjr_seq;
+        }
+    }
+    munmap((void*)img, size);
+    return error;
+}
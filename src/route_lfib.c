@@ -0,0 +1,353 @@
+/*
+ * FreeBSD Routing Library - Label Tables
+ *
+ * route_lfib_create() sets up the MPLS label table of a FIB, looked up
+ * by fib_label_lookup_nhidx() and fib_label_lookup_nhidx_burst().
+ */
+
+#include "route_lib_var.h"
+
+/*
+ * Label tables
+ *
+ * A dense array of one word per label, mapped on demand so that only
+ * the pages of labels in use take memory. A single path label packs its
+ * nexthop number and outgoing label in the word; a multipath one points
+ * to a route_label_ent holding the group. Words change with one store,
+ * and the entries and nexthop references they held are released after
+ * an epoch.
+ */
+#define LFIB_VALID      (1ull << 63)
+#define LFIB_INDIRECT   (1ull << 62)
+#define LFIB_OUT_SHIFT  32
+#define LFIB_NSLOTS     (ROUTE_LABEL_MAX + 1)
+
+struct route_label_ent {
+    struct epoch_context le_ctx;
+    struct route_nhgrp* le_nhgrp;     /* Multipath group */
+    uint32_t le_nhidx;                /* Nexthop of a released single path word */
+    uint32_t le_outlabel;
+};
+
+struct route_lfib {
+    _Atomic uint64_t* lf_slots;       /* LFIB_NSLOTS words */
+    u_int lf_fibnum;
+    u_long lf_count;                  /* Labels set */
+};
+
+static struct route_lfib* _Atomic route_label_dp[ROUTE_DP_MAXFIBS];
+
+static inline struct route_label_ent* lfib_ent(uint64_t w) {
+    return (struct route_label_ent*)(uintptr_t)(w & ~(LFIB_VALID | LFIB_INDIRECT));
+}
+
+/* Nexthop @flowid selects in word @w, 0 if unset, and its outgoing label */
+static inline uint32_t lfib_select(uint64_t w, uint32_t flowid, uint32_t* outlabel) {
+    if (!(w & LFIB_VALID)) {
+        *outlabel = 0;
+        return 0;
+    }
+    if (w & LFIB_INDIRECT) {
+        const struct route_label_ent* le = lfib_ent(w);
+        const struct route_nhgrp* ng = le->le_nhgrp;
+
+        *outlabel = le->le_outlabel;
+        return ng->ng_members[ng->ng_slots[flowid % ng->ng_nslots]];
+    }
+    *outlabel = (uint32_t)(w >> LFIB_OUT_SHIFT) & ROUTE_LABEL_MAX;
+    return (uint32_t)w;
+}
+
+static void lfib_ent_free(struct route_label_ent* le) {
+    if (le->le_nhidx) {
+        route_nhop_release(le->le_nhidx, 1);
+    }
+    if (le->le_nhgrp) {
+        route_nhgrp_release(le->le_nhgrp);
+    }
+    bsd_free(le, M_RTABLE);
+}
+
+static void lfib_ent_free_epoch(epoch_context_t ctx) {
+    lfib_ent_free(__containerof(ctx, struct route_label_ent, le_ctx));
+}
+
+/*
+ * Stores word @w for @label. @gc, zeroed, carries the release of a
+ * single path word it replaces and is freed otherwise.
+ */
+static void lfib_publish(struct route_lfib* lf, uint32_t label, uint64_t w,
+                         struct route_label_ent* gc) {
+    uint64_t old = atomic_load_explicit(&lf->lf_slots[label], memory_order_relaxed);
+
+    atomic_store_explicit(&lf->lf_slots[label], w, memory_order_release);
+    lf->lf_count += !!(w & LFIB_VALID) - !!(old & LFIB_VALID);
+    if (!(old & LFIB_VALID)) {
+        bsd_free(gc, M_RTABLE);
+    } else if (old & LFIB_INDIRECT) {
+        bsd_free(gc, M_RTABLE);
+        NET_EPOCH_CALL(lfib_ent_free_epoch, &lfib_ent(old)->le_ctx);
+    } else {
+        gc->le_nhidx = (uint32_t)old;
+        NET_EPOCH_CALL(lfib_ent_free_epoch, &gc->le_ctx);
+    }
+}
+
+struct route_lfib* route_lfib_create(u_int fibnum) {
+    struct route_lfib *lf, *expected = NULL;
+
+    if (!g_route_lib_initialized || fibnum >= ROUTE_DP_MAXFIBS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    lf = bsd_malloc(sizeof(*lf), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!lf) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    lf->lf_slots = mmap(NULL, LFIB_NSLOTS * sizeof(*lf->lf_slots), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (lf->lf_slots == MAP_FAILED) {
+        bsd_free(lf, M_RTABLE);
+        errno = ENOMEM;
+        return NULL;
+    }
+    lf->lf_fibnum = fibnum;
+
+    if (!atomic_compare_exchange_strong_explicit(&route_label_dp[fibnum], &expected, lf,
+                                                 memory_order_release, memory_order_relaxed)) {
+        munmap((void*)lf->lf_slots, LFIB_NSLOTS * sizeof(*lf->lf_slots));
+        bsd_free(lf, M_RTABLE);
+        errno = EEXIST;
+        return NULL;
+    }
+    return lf;
+}
+
+void route_lfib_destroy(struct route_lfib* lf) {
+    if (!lf) return;
+
+    atomic_store_explicit(&route_label_dp[lf->lf_fibnum], NULL, memory_order_release);
+    NET_EPOCH_WAIT();
+
+    for (uint32_t label = 0; label < LFIB_NSLOTS && lf->lf_count > 0; label++) {
+        uint64_t w = atomic_load_explicit(&lf->lf_slots[label], memory_order_relaxed);
+
+        if (!(w & LFIB_VALID)) {
+            continue;
+        }
+        if (w & LFIB_INDIRECT) {
+            lfib_ent_free(lfib_ent(w));
+        } else {
+            route_nhop_release((uint32_t)w, 1);
+        }
+        lf->lf_count--;
+    }
+    munmap((void*)lf->lf_slots, LFIB_NSLOTS * sizeof(*lf->lf_slots));
+    bsd_free(lf, M_RTABLE);
+}
+
+int route_lfib_add(struct route_lfib* lf, const struct route_label_info* li) {
+    struct route_label_ent* gc;
+    struct route_nhop_ent* ne;
+
+    if (!lf || !li || li->rli_label > ROUTE_LABEL_MAX || li->rli_outlabel > ROUTE_LABEL_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    gc = bsd_malloc(sizeof(*gc), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!gc) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    ne = route_nhop_get(li->rli_gateway, li->rli_flags, li->rli_ifindex, 1);
+    if (!ne) {
+        bsd_free(gc, M_RTABLE);
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    lfib_publish(lf, li->rli_label, LFIB_VALID |
+                 ((uint64_t)li->rli_outlabel << LFIB_OUT_SHIFT) | ne->ne_idx, gc);
+    return ROUTE_OK;
+}
+
+int route_lfib_add_mpath(struct route_lfib* lf, const struct route_label_info* li,
+                         const struct route_mpath_gw* gws, size_t count) {
+    struct route_info ri = { .ri_flags = li ? li->rli_flags : 0 };
+    struct route_label_ent *le, *gc;
+
+    if (!lf || !li || li->rli_label > ROUTE_LABEL_MAX || li->rli_outlabel > ROUTE_LABEL_MAX ||
+        !gws || count == 0 || count > ROUTE_MPATH_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    le = bsd_malloc(sizeof(*le), M_RTABLE, M_NOWAIT | M_ZERO);
+    gc = bsd_malloc(sizeof(*gc), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (le && gc) {
+        le->le_nhgrp = route_nhgrp_build(&ri, gws, count);
+    }
+    if (!le || !gc || !le->le_nhgrp) {
+        bsd_free(le, M_RTABLE);
+        bsd_free(gc, M_RTABLE);
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    le->le_outlabel = li->rli_outlabel;
+    lfib_publish(lf, li->rli_label, LFIB_VALID | LFIB_INDIRECT | (uintptr_t)le, gc);
+    return ROUTE_OK;
+}
+
+int route_lfib_delete(struct route_lfib* lf, uint32_t label) {
+    struct route_label_ent* gc;
+
+    if (!lf || label > ROUTE_LABEL_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (!(atomic_load_explicit(&lf->lf_slots[label], memory_order_relaxed) & LFIB_VALID)) {
+        errno = ENOENT;
+        return ROUTE_ENOENT;
+    }
+
+    gc = bsd_malloc(sizeof(*gc), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!gc) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    lfib_publish(lf, label, 0, gc);
+    return ROUTE_OK;
+}
+
+/* Fills @li from word @w of @label, the first member if multipath */
+static void lfib_fill(uint32_t label, uint64_t w, struct route_label_info* li) {
+    const struct route_nhop* nh;
+    struct epoch_tracker et;
+    uint32_t nhidx, out;
+
+    if (w & LFIB_INDIRECT) {
+        nhidx = lfib_ent(w)->le_nhgrp->ng_members[0];
+        out = lfib_ent(w)->le_outlabel;
+    } else {
+        nhidx = lfib_select(w, 0, &out);
+    }
+
+    /* The array can be replaced as it grows, not the nexthop we hold */
+    NET_EPOCH_ENTER(et);
+    nh = &route_nhop_array(NULL)[nhidx];
+    *li = (struct route_label_info){
+        .rli_label = label,
+        .rli_outlabel = out,
+        .rli_gateway = (struct sockaddr*)nh->rnh_gateway,
+        .rli_flags = nh->rnh_flags,
+        .rli_ifindex = nh->rnh_ifindex
+    };
+    NET_EPOCH_EXIT(et);
+}
+
+int route_lfib_lookup(struct route_lfib* lf, uint32_t label, struct route_label_info* li_out) {
+    uint64_t w;
+
+    if (!lf || label > ROUTE_LABEL_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    w = atomic_load_explicit(&lf->lf_slots[label], memory_order_relaxed);
+    if (!(w & LFIB_VALID)) {
+        errno = ENOENT;
+        return ROUTE_ENOENT;
+    }
+    if (li_out) {
+        lfib_fill(label, w, li_out);
+    }
+    return ROUTE_OK;
+}
+
+int route_lfib_walk(struct route_lfib* lf, route_label_walker_f walker, void* arg) {
+    struct route_label_info li;
+    int count = 0;
+
+    if (!lf || !walker) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    for (uint32_t label = 0; label < LFIB_NSLOTS && (u_long)count < lf->lf_count; label++) {
+        uint64_t w = atomic_load_explicit(&lf->lf_slots[label], memory_order_relaxed);
+
+        if (!(w & LFIB_VALID)) {
+            continue;
+        }
+        lfib_fill(label, w, &li);
+        count++;
+        if (walker(&li, arg)) {
+            break;
+        }
+    }
+    return count;
+}
+
+uint32_t fib_label_lookup_nhidx(u_int fibnum, uint32_t label, uint32_t flowid,
+                                uint32_t* outlabel) {
+    struct epoch_tracker et;
+    struct route_lfib* lf;
+    uint32_t nhidx = 0, out = 0;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS || label > ROUTE_LABEL_MAX) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    NET_EPOCH_ENTER(et);
+    lf = atomic_load_explicit(&route_label_dp[fibnum], memory_order_acquire);
+    if (lf) {
+        nhidx = lfib_select(atomic_load_explicit(&lf->lf_slots[label], memory_order_acquire),
+                            flowid, &out);
+    }
+    NET_EPOCH_EXIT(et);
+
+    if (outlabel) {
+        *outlabel = out;
+    }
+    return nhidx;
+}
+
+int fib_label_lookup_nhidx_burst(u_int fibnum, const uint32_t* labels, const uint32_t* flowids,
+                                 size_t count, uint32_t* nhidx_out, uint32_t* outlabels) {
+    struct epoch_tracker et;
+    struct route_lfib* lf;
+    int hits = 0;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS ||
+        (count > 0 && (!labels || !flowids || !nhidx_out || !outlabels)) || count > INT_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    NET_EPOCH_ENTER(et);
+    lf = atomic_load_explicit(&route_label_dp[fibnum], memory_order_acquire);
+    for (size_t i = 0; i < count; i += ROUTE_DP_BURST) {
+        size_t n = min(count - i, (size_t)ROUTE_DP_BURST);
+
+        /* Issue the loads of the whole burst before using any */
+        for (size_t j = 0; lf && j < n; j++) {
+            if (labels[i + j] <= ROUTE_LABEL_MAX) {
+                __builtin_prefetch((const void*)&lf->lf_slots[labels[i + j]]);
+            }
+        }
+        for (size_t j = i; j < i + n; j++) {
+            uint64_t w = 0;
+
+            if (lf && labels[j] <= ROUTE_LABEL_MAX) {
+                w = atomic_load_explicit(&lf->lf_slots[labels[j]], memory_order_acquire);
+            }
+            nhidx_out[j] = lfib_select(w, flowids[j], &outlabels[j]);
+            hits += (nhidx_out[j] != 0);
+        }
+    }
+    NET_EPOCH_EXIT(et);
+
+    return hits;
+}
@@ -5,348 +5,4224 @@
  * leverages our proven FreeBSD radix tree port for enterprise-scale routing.
  */
 
-#include "route_lib.h"
-#include "compat_shim.h"
-#include "radix.h"
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-#include <errno.h>
-#include <arpa/inet.h>
+#include "route_lib_var.h"
 
 /* Internal structures */
-struct route_entry {
-    struct sockaddr* re_dst;      /* Destination (in heap) */
-    struct sockaddr* re_mask;     /* Mask (in heap) */
-    struct sockaddr* re_gateway;  /* Gateway (in heap) */
-    int re_flags;                 /* Route flags */
-    int re_ifindex;              /* Interface index */
-    u_int re_fibnum;             /* FIB number */
-    struct radix_node re_nodes[2]; /* FreeBSD radix requires 2 nodes */
+
+/* Interned netmask, shared by all routes with the same mask */
+struct route_mask {
+    struct route_mask* rm_next;   /* Hash chain */
+    uint32_t rm_hash;
+    u_int rm_refcnt;              /* Routes using the mask */
+    struct sockaddr rm_sa;        /* Mask, rm_sa.sa_len bytes */
+};
+
+#define ROUTE_MASK_HASH_SIZE 256
+
+#define ROUTE_NHOP_HASH_SIZE 256
+#define ROUTE_NHOP_MINSLOTS  64
+
+/* Nexthop array seen by the datapath, replaced as a whole when it grows */
+struct route_nhop_tab {
+    uint32_t nt_size;             /* Slots, slot 0 is never used */
+    struct epoch_context nt_ctx;
+    struct route_nhop nt_nhops[];
+};
+
+#define ROUTE_NHGRP_HASH_SIZE 256
+
+/* Slots of a group: ROUTE_NHGRP_MEMBER_SLOTS per member, within these */
+#define ROUTE_NHGRP_MINSLOTS     64
+#define ROUTE_NHGRP_MAXSLOTS     4096
+#define ROUTE_NHGRP_MEMBER_SLOTS 8
+
+/*
+ * Routes of full-length prefixes by address, see route_table_set_host_table().
+ * Open addressing with linear probing; at most half of the slots are used,
+ * deleted routes included, so probes always end at an empty slot.
+ */
+struct route_hosts {
+    uint32_t rht_mask;            /* Slots - 1, a power of 2 */
+    uint32_t rht_count;           /* Routes */
+    uint32_t rht_used;            /* Routes and deleted slots */
+    int rht_family;
+    size_t rht_off;               /* Address within the keys */
+    size_t rht_len;
+    struct epoch_context rht_ctx;
+    struct route_entry* _Atomic rht_slots[];
 };
 
-struct rib_head {
-    struct radix_node_head* rh_rnh;  /* Radix tree head */
-    int rh_family;                   /* Address family */
-    u_int rh_fibnum;                /* FIB number */
-    struct route_stats rh_stats;     /* Statistics */
+#define ROUTE_HOSTS_MINSLOTS 64
+
+/* Memory nodes replicas are kept for, and CPUs mapped to them */
+#define ROUTE_NUMA_MAXNODES 8
+#define ROUTE_NUMA_MAXCPUS  1024
+
+/* Lookup-only copy of a table tree, see route_table_freeze() */
+struct route_frozen {
+    struct rn_frozen* rz_rf[ROUTE_NUMA_MAXNODES];  /* Per node replica */
+    int rz_nrf;                   /* Replicas, rz_rf[0] is always set */
+    struct epoch_context rz_ctx;
 };
 
+static struct route_dp* _Atomic route_inet_dp[ROUTE_DP_MAXFIBS];
+static struct route_dp* _Atomic route_inet6_dp[ROUTE_DP_MAXFIBS];
+
 /* Global initialization state */
-static int g_route_lib_initialized = 0;
+int g_route_lib_initialized = 0;
+
+/* Route entries, one slab-backed item per route */
+static uma_zone_t route_entry_zone;
+
+/* Tables created from now on use huge pages, see route_lib_set_hugepages() */
+static int route_hugepages;
+
+/* Startup profile, see route_lib_get_init_stats() */
+static uint64_t route_init_start;
+static _Atomic uint64_t route_init_lib_ns;
+static _Atomic uint64_t route_init_tables;
+static _Atomic uint64_t route_init_table_ns;
+static _Atomic uint64_t route_init_head_ns;
+static _Atomic uint64_t route_init_counters_ns;
+static _Atomic uint64_t route_init_deferred;
+static _Atomic uint64_t route_init_deferred_ns;
+static _Atomic uint64_t route_init_lookup_ns;
+
+/* Global mask table, shared by all tables and families */
+static struct route_mask* route_mask_hash[ROUTE_MASK_HASH_SIZE];
+static pthread_mutex_t route_mask_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Contiguous masks in plain sockaddr_in and sockaddr_in6, by prefix
+ * length. These are not interned: route_mask_get() hands them out
+ * without taking the lock or a reference.
+ */
+#define RM_BYTE(p, i) \
+    ((p) >= 8 * ((i) + 1) ? 0xff : (p) <= 8 * (i) ? 0 : (0xff00 >> ((p) - 8 * (i))) & 0xff)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RM_ADDR4(p) \
+    ((uint32_t)RM_BYTE(p, 0) << 24 | RM_BYTE(p, 1) << 16 | RM_BYTE(p, 2) << 8 | RM_BYTE(p, 3))
+#else
+#define RM_ADDR4(p) \
+    ((uint32_t)RM_BYTE(p, 3) << 24 | RM_BYTE(p, 2) << 16 | RM_BYTE(p, 1) << 8 | RM_BYTE(p, 0))
+#endif
+#define RM_MASK4(p) { \
+    .sin_len = sizeof(struct sockaddr_in), .sin_family = AF_INET, \
+    .sin_addr.s_addr = RM_ADDR4(p) }
+#define RM_MASK6(p) { \
+    .sin6_len = sizeof(struct sockaddr_in6), .sin6_family = AF_INET6, \
+    .sin6_addr.s6_addr = { \
+        RM_BYTE(p, 0), RM_BYTE(p, 1), RM_BYTE(p, 2), RM_BYTE(p, 3), \
+        RM_BYTE(p, 4), RM_BYTE(p, 5), RM_BYTE(p, 6), RM_BYTE(p, 7), \
+        RM_BYTE(p, 8), RM_BYTE(p, 9), RM_BYTE(p, 10), RM_BYTE(p, 11), \
+        RM_BYTE(p, 12), RM_BYTE(p, 13), RM_BYTE(p, 14), RM_BYTE(p, 15) } }
+#define RM_X8(X, p) X(p), X((p) + 1), X((p) + 2), X((p) + 3), \
+    X((p) + 4), X((p) + 5), X((p) + 6), X((p) + 7)
+
+static const struct sockaddr_in route_masks4[33] = {
+    RM_X8(RM_MASK4, 0), RM_X8(RM_MASK4, 8), RM_X8(RM_MASK4, 16), RM_X8(RM_MASK4, 24),
+    RM_MASK4(32)
+};
+static const struct sockaddr_in6 route_masks6[129] = {
+    RM_X8(RM_MASK6, 0), RM_X8(RM_MASK6, 8), RM_X8(RM_MASK6, 16), RM_X8(RM_MASK6, 24),
+    RM_X8(RM_MASK6, 32), RM_X8(RM_MASK6, 40), RM_X8(RM_MASK6, 48), RM_X8(RM_MASK6, 56),
+    RM_X8(RM_MASK6, 64), RM_X8(RM_MASK6, 72), RM_X8(RM_MASK6, 80), RM_X8(RM_MASK6, 88),
+    RM_X8(RM_MASK6, 96), RM_X8(RM_MASK6, 104), RM_X8(RM_MASK6, 112), RM_X8(RM_MASK6, 120),
+    RM_MASK6(128)
+};
+
+/*
+ * Global nexthops, by value in the hash and by number in route_nhop_ents.
+ * Numbers are handed out lowest first to keep the array dense.
+ */
+static struct route_nhop_ent* route_nhop_hash[ROUTE_NHOP_HASH_SIZE];
+static struct route_nhop_ent** route_nhop_ents;  /* nt_size slots, NULL if free */
+static uint32_t route_nhop_hint = 1;              /* No free slot below */
+static struct route_nhop_tab* _Atomic route_nhop_tab;
+static pthread_mutex_t route_nhop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Global multipath groups, under route_nhop_lock */
+static struct route_nhgrp* route_nhgrp_hash[ROUTE_NHGRP_HASH_SIZE];
+
+static void route_frozen_drop(struct rib_head* rh);
+static void route_compact_add(struct rib_head* rh, struct route_entry* re);
+static void route_compact_del(struct rib_head* rh, struct route_entry* re);
+static void route_compact_abort(struct rib_head* rh);
+
+/* Changes go to the delta log and the journal, whichever are enabled */
+static void route_log_change(struct rib_head* rh, uint32_t op, const struct route_info* ri) {
+    route_delta_note(rh, op, ri);
+    route_journal_log(rh, op, ri);
+}
+static int rib_key_offset(int family);
+
+/* Table ids, tags of the lookup cache entries */
+static _Atomic uint64_t route_table_ids;
+
+/*
+ * Per-thread destination cache of route_lookup(), direct mapped. An entry
+ * is only used while its table is at the generation it was filled at, so
+ * any change to the tree invalidates the whole table's entries at once.
+ */
+#define ROUTE_LCACHE_SIZE 4096
+#define ROUTE_LCACHE_KEYLEN (sizeof(struct sockaddr_in6) - offsetof(struct sockaddr_in6, sin6_addr))
+
+struct route_lcache_ent {
+    uint64_t le_table;             /* rh_id, 0 when empty */
+    u_long le_gen;                 /* rh_gen when filled */
+    struct route_entry* le_re;     /* NULL for a cached miss */
+    uint8_t le_len;
+    uint8_t le_key[ROUTE_LCACHE_KEYLEN];
+};
+
+static __thread struct route_lcache_ent* route_lcache;
+static pthread_key_t route_lcache_key;
+static pthread_once_t route_lcache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Memory nodes, as reported by Linux sysfs; a single node elsewhere.
+ * Threads look their node up once, see route_thread_set_node().
+ */
+static int route_numa_nodes = 1;
+static uint8_t route_numa_cpu_node[ROUTE_NUMA_MAXCPUS];
+#if defined(__linux__)
+static cpu_set_t route_numa_cpus[ROUTE_NUMA_MAXNODES];
+#endif
+static pthread_once_t route_numa_once = PTHREAD_ONCE_INIT;
+static __thread int route_thread_node = -1;
 
 /* Helper functions */
-static struct sockaddr* copy_sockaddr(const struct sockaddr* src) {
+
+/* Copies @src into the inline storage, falling back to the heap if it does not fit */
+static struct sockaddr* copy_sockaddr(const struct sockaddr* src, union route_sa* store) {
     if (!src) return NULL;
 
-    struct sockaddr* copy = bsd_malloc(src->sa_len, M_RTABLE, M_WAITOK | M_ZERO);
+    struct sockaddr* copy = &store->sa;
+    if (src->sa_len > sizeof(*store)) {
+        copy = bsd_malloc(src->sa_len, M_RTSADDR, M_NOWAIT | M_ZERO);
+    }
     if (copy) {
         memcpy(copy, src, src->sa_len);
     }
-    return copy;
+    return copy;
+}
+
+static void free_sockaddr(struct sockaddr* sa, union route_sa* store) {
+    if (sa && sa != &store->sa) {
+        bsd_free(sa, M_RTSADDR);
+    }
+}
+
+static uint32_t route_mask_hashval(const struct sockaddr* sa) {
+    const uint8_t* p = (const uint8_t*)sa;
+    uint32_t h = 2166136261u;  /* FNV-1a */
+
+    for (int i = 0; i < sa->sa_len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Returns the entry of route_masks4 or route_masks6 equal to @mask, NULL
+ * unless it is a contiguous mask with every other field zero.
+ */
+static struct sockaddr* route_mask_static(const struct sockaddr* mask) {
+    const uint8_t* p = (const uint8_t*)mask;
+    size_t off, alen, i;
+    int plen = 0;
+
+    switch (mask->sa_family) {
+        case AF_INET:
+            off = offsetof(struct sockaddr_in, sin_addr);
+            alen = sizeof(struct in_addr);
+            if (mask->sa_len != sizeof(struct sockaddr_in)) {
+                return NULL;
+            }
+            break;
+        case AF_INET6:
+            off = offsetof(struct sockaddr_in6, sin6_addr);
+            alen = sizeof(struct in6_addr);
+            if (mask->sa_len != sizeof(struct sockaddr_in6)) {
+                return NULL;
+            }
+            break;
+        default:
+            return NULL;
+    }
+
+    for (i = offsetof(struct sockaddr, sa_data); i < mask->sa_len; i++) {
+        if (i < off || i >= off + alen) {
+            if (p[i] != 0) {
+                return NULL;
+            }
+        } else if (p[i] == 0xff && plen == (int)(i - off) * 8) {
+            plen += 8;
+        } else if (p[i] != 0) {
+            /* One partial byte of leading ones, right after the full ones */
+            if (plen != (int)(i - off) * 8 || (uint8_t)(p[i] | (p[i] - 1)) != 0xff) {
+                return NULL;
+            }
+            plen += 8 - __builtin_ctz(p[i]);
+        }
+    }
+
+    if (mask->sa_family == AF_INET) {
+        return (struct sockaddr*)&route_masks4[plen];
+    }
+    return (struct sockaddr*)&route_masks6[plen];
+}
+
+static int route_mask_is_static(const struct sockaddr* mask) {
+    uintptr_t p = (uintptr_t)mask;
+
+    return (p >= (uintptr_t)route_masks4 && p < (uintptr_t)(route_masks4 + 33)) ||
+        (p >= (uintptr_t)route_masks6 && p < (uintptr_t)(route_masks6 + 129));
+}
+
+/* Returns a referenced interned copy of @mask, or its static one */
+static struct sockaddr* route_mask_get(const struct sockaddr* mask) {
+    struct sockaddr* sm = route_mask_static(mask);
+    uint32_t hash;
+    struct route_mask** head;
+    struct route_mask* rm;
+
+    if (sm) {
+        return sm;
+    }
+    hash = route_mask_hashval(mask);
+    head = &route_mask_hash[hash % ROUTE_MASK_HASH_SIZE];
+
+    pthread_mutex_lock(&route_mask_lock);
+    for (rm = *head; rm; rm = rm->rm_next) {
+        if (rm->rm_hash == hash && sa_equal(&rm->rm_sa, mask)) {
+            break;
+        }
+    }
+    if (!rm) {
+        size_t len = offsetof(struct route_mask, rm_sa) +
+            max((size_t)mask->sa_len, sizeof(struct sockaddr));
+        rm = bsd_malloc(len, M_RTMASK, M_NOWAIT | M_ZERO);
+        if (rm) {
+            memcpy(&rm->rm_sa, mask, mask->sa_len);
+            rm->rm_hash = hash;
+            rm->rm_next = *head;
+            *head = rm;
+        }
+    }
+    if (rm) {
+        rm->rm_refcnt++;
+    }
+    pthread_mutex_unlock(&route_mask_lock);
+
+    return rm ? &rm->rm_sa : NULL;
+}
+
+/* Drops @refs references to the interned @mask */
+static void route_mask_release(struct sockaddr* mask, u_int refs) {
+    struct route_mask* rm;
+    struct route_mask** prev;
+
+    if (route_mask_is_static(mask)) {
+        return;
+    }
+    rm = __containerof(mask, struct route_mask, rm_sa);
+    pthread_mutex_lock(&route_mask_lock);
+    rm->rm_refcnt -= refs;
+    if (rm->rm_refcnt == 0) {
+        prev = &route_mask_hash[rm->rm_hash % ROUTE_MASK_HASH_SIZE];
+        while (*prev != rm) {
+            prev = &(*prev)->rm_next;
+        }
+        *prev = rm->rm_next;
+        bsd_free(rm, M_RTMASK);
+    }
+    pthread_mutex_unlock(&route_mask_lock);
+}
+
+static uint32_t route_nhop_hashval(const struct sockaddr* gw, int flags, int ifindex) {
+    const uint8_t* p = (const uint8_t*)gw;
+    uint32_t h = 2166136261u;  /* FNV-1a */
+
+    for (int i = 0; gw && i < gw->sa_len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    h = (h ^ (uint32_t)flags) * 16777619u;
+    return (h ^ (uint32_t)ifindex) * 16777619u;
+}
+
+static int route_nhop_equal(const struct route_nhop_ent* ne, const struct sockaddr* gw,
+                            int flags, int ifindex) {
+    if (ne->ne_flags != flags || ne->ne_ifindex != ifindex) {
+        return 0;
+    }
+    if (!ne->ne_gw || !gw) {
+        return ne->ne_gw == gw;
+    }
+    return sa_equal(ne->ne_gw, gw);
+}
+
+static void route_nhop_tab_free_epoch(epoch_context_t ctx) {
+    bsd_free(__containerof(ctx, struct route_nhop_tab, nt_ctx), M_NHOP);
+}
+
+/*
+ * Makes room for nexthop @idx, with route_nhop_lock held. A larger array
+ * replaces the published one, which is freed once lookups are done with it.
+ */
+static int route_nhop_grow(uint32_t idx) {
+    struct route_nhop_tab* old = atomic_load_explicit(&route_nhop_tab, memory_order_relaxed);
+    uint32_t size = old ? old->nt_size : 0;
+    struct route_nhop_ent** ents;
+    struct route_nhop_tab* nt;
+
+    if (idx < size) {
+        return 0;
+    }
+    size = max(2 * size, ROUTE_NHOP_MINSLOTS);
+    nt = bsd_malloc(sizeof(*nt) + size * sizeof(nt->nt_nhops[0]), M_NHOP, M_NOWAIT | M_ZERO);
+    ents = bsd_malloc(size * sizeof(*ents), M_NHOP, M_NOWAIT | M_ZERO);
+    if (!nt || !ents) {
+        if (nt) {
+            bsd_free(nt, M_NHOP);
+        }
+        if (ents) {
+            bsd_free(ents, M_NHOP);
+        }
+        return ENOMEM;
+    }
+    nt->nt_size = size;
+    if (old) {
+        memcpy(nt->nt_nhops, old->nt_nhops, old->nt_size * sizeof(nt->nt_nhops[0]));
+        memcpy(ents, route_nhop_ents, old->nt_size * sizeof(*ents));
+        bsd_free(route_nhop_ents, M_NHOP);
+    }
+    route_nhop_ents = ents;
+    atomic_store_explicit(&route_nhop_tab, nt, memory_order_release);
+    if (old) {
+        NET_EPOCH_CALL_SIZE(route_nhop_tab_free_epoch, &old->nt_ctx,
+                            sizeof(*old) + old->nt_size * sizeof(old->nt_nhops[0]));
+    }
+    return 0;
+}
+
+/* Returns the nexthop of @gw, @flags and @ifindex, with @refs references */
+struct route_nhop_ent* route_nhop_get(const struct sockaddr* gw, int flags, int ifindex,
+                                      u_int refs) {
+    uint32_t hash = route_nhop_hashval(gw, flags, ifindex);
+    struct route_nhop_ent** head = &route_nhop_hash[hash % ROUTE_NHOP_HASH_SIZE];
+    struct route_nhop_ent* ne;
+    struct route_nhop_tab* nt;
+    uint32_t idx;
+
+    pthread_mutex_lock(&route_nhop_lock);
+    for (ne = *head; ne; ne = ne->ne_next) {
+        if (ne->ne_hash == hash && route_nhop_equal(ne, gw, flags, ifindex)) {
+            break;
+        }
+    }
+    if (!ne) {
+        nt = atomic_load_explicit(&route_nhop_tab, memory_order_relaxed);
+        for (idx = route_nhop_hint; nt && idx < nt->nt_size && route_nhop_ents[idx]; idx++) {
+        }
+        ne = bsd_malloc(sizeof(*ne), M_NHOP, M_NOWAIT | M_ZERO);
+        if (ne && gw) {
+            ne->ne_gw = copy_sockaddr(gw, &ne->ne_gw_sa);
+        }
+        if (!ne || (gw && !ne->ne_gw) || route_nhop_grow(idx) != 0) {
+            if (ne) {
+                free_sockaddr(ne->ne_gw, &ne->ne_gw_sa);
+                bsd_free(ne, M_NHOP);
+            }
+            pthread_mutex_unlock(&route_nhop_lock);
+            return NULL;
+        }
+        ne->ne_hash = hash;
+        ne->ne_idx = idx;
+        ne->ne_flags = flags;
+        ne->ne_ifindex = ifindex;
+        ne->ne_next = *head;
+        *head = ne;
+        route_nhop_ents[idx] = ne;
+        route_nhop_hint = idx + 1;
+
+        /* Routes using it are published after this */
+        nt = atomic_load_explicit(&route_nhop_tab, memory_order_relaxed);
+        nt->nt_nhops[idx].rnh_gateway = ne->ne_gw;
+        nt->nt_nhops[idx].rnh_flags = flags;
+        nt->nt_nhops[idx].rnh_ifindex = ifindex;
+    }
+    ne->ne_refcnt += refs;
+    pthread_mutex_unlock(&route_nhop_lock);
+
+    return ne;
+}
+
+/*
+ * Drops @refs references to nexthop @idx. Its number can be reused right
+ * away: routes holding the last references are out of lookups' reach.
+ */
+void route_nhop_release(uint32_t idx, u_int refs) {
+    struct route_nhop_ent* ne;
+    struct route_nhop_ent** prev;
+    struct route_nhop_tab* nt;
+
+    pthread_mutex_lock(&route_nhop_lock);
+    ne = route_nhop_ents[idx];
+    ne->ne_refcnt -= refs;
+    if (ne->ne_refcnt == 0) {
+        prev = &route_nhop_hash[ne->ne_hash % ROUTE_NHOP_HASH_SIZE];
+        while (*prev != ne) {
+            prev = &(*prev)->ne_next;
+        }
+        *prev = ne->ne_next;
+        route_nhop_ents[idx] = NULL;
+        nt = atomic_load_explicit(&route_nhop_tab, memory_order_relaxed);
+        memset(&nt->nt_nhops[idx], 0, sizeof(nt->nt_nhops[idx]));
+        route_nhop_hint = min(route_nhop_hint, idx);
+        free_sockaddr(ne->ne_gw, &ne->ne_gw_sa);
+        bsd_free(ne, M_NHOP);
+    }
+    pthread_mutex_unlock(&route_nhop_lock);
+}
+
+/* Takes one more reference to nexthop @idx */
+static struct route_nhop_ent* route_nhop_ref(uint32_t idx) {
+    struct route_nhop_ent* ne;
+
+    pthread_mutex_lock(&route_nhop_lock);
+    ne = route_nhop_ents[idx];
+    ne->ne_refcnt++;
+    pthread_mutex_unlock(&route_nhop_lock);
+
+    return ne;
+}
+
+/* Drops the nexthop references of @nmembers group members, a run of equal ones at once */
+static void route_nhop_release_members(const uint32_t* members, uint32_t nmembers) {
+    uint32_t i, j;
+
+    for (i = 0; i < nmembers; i = j) {
+        for (j = i + 1; j < nmembers && members[j] == members[i]; j++) {
+        }
+        route_nhop_release(members[i], j - i);
+    }
+}
+
+static uint32_t route_nhgrp_hashval(const uint32_t* members, uint32_t nmembers,
+                                    const uint16_t* slots, uint32_t nslots) {
+    uint32_t h = 2166136261u;  /* FNV-1a */
+
+    for (uint32_t i = 0; i < nmembers; i++) {
+        h = (h ^ members[i]) * 16777619u;
+    }
+    for (uint32_t i = 0; i < nslots; i++) {
+        h = (h ^ slots[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Returns the referenced group of the @nmembers nexthops of @members
+ * over @nslots @slots, taking over the member references: they are
+ * dropped if the group already exists.
+ */
+static struct route_nhgrp* route_nhgrp_get(const uint32_t* members, uint32_t nmembers,
+                                           const uint16_t* slots, uint32_t nslots) {
+    uint32_t hash = route_nhgrp_hashval(members, nmembers, slots, nslots);
+    struct route_nhgrp** head = &route_nhgrp_hash[hash % ROUTE_NHGRP_HASH_SIZE];
+    struct route_nhgrp* ng;
+
+    pthread_mutex_lock(&route_nhop_lock);
+    for (ng = *head; ng; ng = ng->ng_next) {
+        if (ng->ng_hash == hash && ng->ng_nmembers == nmembers && ng->ng_nslots == nslots &&
+            memcmp(ng->ng_members, members, nmembers * sizeof(*members)) == 0 &&
+            memcmp(ng->ng_slots, slots, nslots * sizeof(*slots)) == 0) {
+            break;
+        }
+    }
+    if (ng) {
+        ng->ng_refcnt++;
+        pthread_mutex_unlock(&route_nhop_lock);
+        route_nhop_release_members(members, nmembers);
+        return ng;
+    }
+    ng = bsd_malloc(sizeof(*ng) + nmembers * sizeof(*members) + nslots * sizeof(*slots),
+                    M_NHGRP, M_NOWAIT | M_ZERO);
+    if (ng) {
+        ng->ng_slots = (uint16_t*)&ng->ng_members[nmembers];
+        memcpy(ng->ng_members, members, nmembers * sizeof(*members));
+        memcpy(ng->ng_slots, slots, nslots * sizeof(*slots));
+        ng->ng_nmembers = nmembers;
+        ng->ng_nslots = nslots;
+        ng->ng_hash = hash;
+        ng->ng_refcnt = 1;
+        ng->ng_next = *head;
+        *head = ng;
+    }
+    pthread_mutex_unlock(&route_nhop_lock);
+
+    if (!ng) {
+        route_nhop_release_members(members, nmembers);
+    }
+    return ng;
+}
+
+void route_nhgrp_release(struct route_nhgrp* ng) {
+    struct route_nhgrp** prev;
+
+    pthread_mutex_lock(&route_nhop_lock);
+    if (--ng->ng_refcnt > 0) {
+        pthread_mutex_unlock(&route_nhop_lock);
+        return;
+    }
+    prev = &route_nhgrp_hash[ng->ng_hash % ROUTE_NHGRP_HASH_SIZE];
+    while (*prev != ng) {
+        prev = &(*prev)->ng_next;
+    }
+    *prev = ng->ng_next;
+    pthread_mutex_unlock(&route_nhop_lock);
+
+    route_nhop_release_members(ng->ng_members, ng->ng_nmembers);
+    bsd_free(ng, M_NHGRP);
+}
+
+static uint32_t route_gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Member of a group being compiled, see route_nhgrp_share() */
+struct nhgrp_share {
+    uint64_t ns_rem;              /* Remainder of the member's quota */
+    uint32_t ns_idx;
+};
+
+static int nhgrp_share_cmp(const void* a, const void* b) {
+    const struct nhgrp_share* x = a;
+    const struct nhgrp_share* y = b;
+
+    if (x->ns_rem != y->ns_rem) {
+        return x->ns_rem > y->ns_rem ? -1 : 1;
+    }
+    return x->ns_idx < y->ns_idx ? -1 : (x->ns_idx > y->ns_idx);
+}
+
+/*
+ * Shares @nslots slots out between the @count members of weights @w
+ * summing to @sum, at least one each, into @counts. Past the reserved
+ * slot, members get the whole part of their quota of the rest and the
+ * slots left over go to the largest remainders, so the sort makes it
+ * O(n log n). Returns 0 if out of memory.
+ */
+static int route_nhgrp_share(const uint32_t* w, uint32_t count, uint64_t sum, uint32_t nslots,
+                             uint32_t* counts) {
+    uint32_t left = nslots - count;
+    struct nhgrp_share* ns;
+
+    ns = bsd_malloc(count * sizeof(*ns), M_TEMP, M_NOWAIT);
+    if (!ns) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t q = (uint64_t)w[i] * (nslots - count);
+
+        counts[i] = 1 + (uint32_t)(q / sum);
+        left -= counts[i] - 1;
+        ns[i].ns_rem = q % sum;
+        ns[i].ns_idx = i;
+    }
+    qsort(ns, count, sizeof(*ns), nhgrp_share_cmp);
+    for (uint32_t i = 0; i < left; i++) {
+        counts[ns[i].ns_idx]++;
+    }
+    bsd_free(ns, M_TEMP);
+    return 1;
+}
+
+/*
+ * Compiles the group of @ri over the @count gateways of @gws. The
+ * weights, reduced by their gcd, give the slot count, each member's
+ * slots in a row as calc_nhgrp_slots() lays them out. Groups needing
+ * more than ROUTE_NHGRP_MEMBER_SLOTS slots per member, within
+ * ROUTE_NHGRP_MINSLOTS and ROUTE_NHGRP_MAXSLOTS, are shared out by
+ * route_nhgrp_share() instead, which keeps every member in the group.
+ */
+struct route_nhgrp* route_nhgrp_build(const struct route_info* ri,
+                                      const struct route_mpath_gw* gws, size_t count) {
+    uint32_t members[ROUTE_MPATH_MAX], w[ROUTE_MPATH_MAX], counts[ROUTE_MPATH_MAX];
+    uint16_t slots[ROUTE_NHGRP_MAXSLOTS];
+    uint64_t sum = 0;
+    uint32_t g = 0, nslots, cap, n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        w[i] = max(gws[i].rmg_weight, 1u);
+        sum += w[i];
+        g = route_gcd(w[i], g);
+    }
+    cap = (uint32_t)min(max(count * ROUTE_NHGRP_MEMBER_SLOTS, (size_t)ROUTE_NHGRP_MINSLOTS),
+                        (size_t)ROUTE_NHGRP_MAXSLOTS);
+    if (sum / g <= cap) {
+        nslots = (uint32_t)(sum / g);
+        for (size_t i = 0; i < count; i++) {
+            counts[i] = w[i] / g;
+        }
+    } else {
+        nslots = cap;
+        if (!route_nhgrp_share(w, count, sum, nslots, counts)) {
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct route_nhop_ent* ne;
+
+        ne = route_nhop_get(gws[i].rmg_gateway, ri->ri_flags, gws[i].rmg_ifindex, 1);
+        if (!ne) {
+            route_nhop_release_members(members, i);
+            return NULL;
+        }
+        members[i] = ne->ne_idx;
+        for (uint32_t k = 0; k < counts[i]; k++) {
+            slots[n++] = (uint16_t)i;
+        }
+    }
+    return route_nhgrp_get(members, count, slots, nslots);
+}
+
+/* Interns the nexthop of @ri for @re, the first member of its group if any; 0 on failure */
+static int route_entry_set_nhop(struct route_entry* re, const struct route_info* ri) {
+    struct route_nhop_ent* ne;
+
+    if (re->re_nhgrp) {
+        ne = route_nhop_ref(re->re_nhgrp->ng_members[0]);
+    } else {
+        ne = route_nhop_get(ri->ri_gateway, ri->ri_flags, ri->ri_ifindex, 1);
+    }
+    if (!ne) {
+        return 0;
+    }
+    re->re_nhidx = ne->ne_idx;
+    re->re_gateway = ne->ne_gw;
+    return 1;
+}
+
+static void free_route_entry(struct route_entry* re) {
+    free_sockaddr(re->re_dst, &re->re_dst_sa);
+    if (re->re_mask) {
+        route_mask_release(re->re_mask, 1);
+    }
+    if (re->re_nhidx) {
+        route_nhop_release(re->re_nhidx, 1);
+    }
+    if (re->re_nhgrp) {
+        route_nhgrp_release(re->re_nhgrp);
+    }
+    uma_zfree(re->re_zone, re);
+}
+
+static void free_route_entry_epoch(epoch_context_t ctx) {
+    free_route_entry(__containerof(ctx, struct route_entry, re_epoch_ctx));
+}
+
+static void fill_route_info(const struct route_entry* re, struct route_info* ri) {
+    ri->ri_dst = re->re_dst;
+    ri->ri_netmask = re->re_mask;
+    ri->ri_gateway = re->re_gateway;
+    ri->ri_flags = re->re_flags;
+    ri->ri_ifindex = re->re_ifindex;
+    ri->ri_fibnum = re->re_fibnum;
+}
+
+static int rib_counters_alloc(struct rib_counters* rc) {
+    counter_u64_t* c = (counter_u64_t*)rc;
+
+    for (size_t i = 0; i < RIB_COUNTERS_NUM; i++) {
+        c[i] = counter_u64_alloc(M_NOWAIT);
+        if (!c[i]) {
+            while (i-- > 0) {
+                counter_u64_free(c[i]);
+            }
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void rib_counters_free(struct rib_counters* rc) {
+    counter_u64_t* c = (counter_u64_t*)rc;
+
+    for (size_t i = 0; i < RIB_COUNTERS_NUM; i++) {
+        counter_u64_free(c[i]);
+    }
+}
+
+/* Accounts setup done on first use of a table, which began at @start */
+static void route_init_defer(uint64_t start) {
+    atomic_fetch_add_explicit(&route_init_deferred, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&route_init_deferred_ns, rm_nanotime() - start,
+                              memory_order_relaxed);
+}
+
+/*
+ * Histograms of @rh, allocated by the first timed operation. Lookups
+ * are timed too, so concurrent readers may race to allocate them.
+ */
+static struct rib_lat_shard* rib_lat_shards(struct rib_head* rh) {
+    struct rib_lat_shard* lat = atomic_load_explicit(&rh->rh_lat, memory_order_acquire);
+    struct rib_lat_shard* expected = NULL;
+    uint64_t start;
+
+    if (__predict_false(lat == NULL)) {
+        start = rm_nanotime();
+        lat = bsd_malloc(sizeof(*lat) * RIB_LAT_SHARDS, M_RTABLE, M_NOWAIT | M_ZERO);
+        if (!lat) {
+            return NULL;
+        }
+        if (!atomic_compare_exchange_strong_explicit(&rh->rh_lat, &expected, lat,
+                                                     memory_order_acq_rel,
+                                                     memory_order_acquire)) {
+            bsd_free(lat, M_RTABLE);
+            return expected;
+        }
+        route_init_defer(start);
+    }
+    return lat;
+}
+
+static void rib_lat_free(struct rib_head* rh) {
+    bsd_free(atomic_load_explicit(&rh->rh_lat, memory_order_relaxed), M_RTABLE);
+    rh->rh_lat = NULL;
+}
+
+static inline uint64_t rib_lat_start(void) {
+    return rm_nanotime();
+}
+
+static void rib_lat_record(struct rib_head* rh, int op, uint64_t start) {
+    /* Taken first, setting up the histograms is not part of the operation */
+    uint64_t ns = rm_nanotime() - start;
+    struct rib_lat_shard* lat = rib_lat_shards(rh);
+    int b = (ns > 1) ? 63 - __builtin_clzll(ns) : 0;
+
+    if (!lat) {
+        return;
+    }
+
+    struct rib_lat_shard* ls = &lat[counter_curslot() % RIB_LAT_SHARDS];
+    struct rib_lat_hist* lh = &ls->ls_hist[op];
+
+    if (b >= ROUTE_LAT_BUCKETS) {
+        b = ROUTE_LAT_BUCKETS - 1;
+    }
+
+    atomic_fetch_add_explicit(&ls->ls_begin, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_fetch_add_explicit(&lh->lh_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&lh->lh_sum_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&lh->lh_buckets[b], 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&lh->lh_max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&lh->lh_max_ns, &max, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+    }
+    atomic_fetch_add_explicit(&ls->ls_end, 1, memory_order_release);
+}
+
+/* Lookups are timed one in ROUTE_LAT_LOOKUP_SAMPLE, the clock costs about as much */
+static __thread u_int rib_lat_tick;
+
+static inline int rib_lat_sample(void) {
+    return (++rib_lat_tick % ROUTE_LAT_LOOKUP_SAMPLE) == 0;
+}
+
+/*
+ * Hit sampling. Each thread skips a random number of lookups between
+ * samples, rh_hit_rate on average, so that regular traffic such as
+ * bursts of ROUTE_DP_BURST keys cannot line up with the samples. A
+ * sample adds the rate to the thread's shard of the route, making the
+ * counts estimates of the hits whatever the rate was at the time.
+ */
+static __thread int rib_hit_skip;
+static __thread uint32_t rib_hit_rng;
+
+static void rib_hit_sample(struct route_entry* re, u_int rate) {
+    uint32_t x = rib_hit_rng ? rib_hit_rng : ((uint32_t)(uintptr_t)&rib_hit_rng | 1);
+
+    x ^= x << 13;  /* xorshift32 */
+    x ^= x >> 17;
+    x ^= x << 5;
+    rib_hit_rng = x;
+    rib_hit_skip = 1 + x % (2 * rate - 1);
+    atomic_fetch_add_explicit(&re->re_hits[counter_curslot() & (ROUTE_HIT_SHARDS - 1)], rate,
+                              memory_order_relaxed);
+}
+
+static inline void rib_hit(struct rib_head* rh, struct route_entry* re) {
+    u_int rate = atomic_load_explicit(&rh->rh_hit_rate, memory_order_relaxed);
+
+    if (__builtin_expect(rate != 0, 0) && --rib_hit_skip <= 0) {
+        rib_hit_sample(re, rate);
+    }
+}
+
+/* Hits of @re, cleared if @reset */
+static uint64_t route_entry_hits(struct route_entry* re, int reset) {
+    uint64_t hits = 0;
+
+    for (int i = 0; i < ROUTE_HIT_SHARDS; i++) {
+        hits += reset ? atomic_exchange_explicit(&re->re_hits[i], 0, memory_order_relaxed) :
+            atomic_load_explicit(&re->re_hits[i], memory_order_relaxed);
+    }
+    return hits;
+}
+
+/* Retries of a shard copy that raced with an update, before taking it anyway */
+#define RIB_LAT_RETRIES 8
+
+static void rib_lat_fetch(struct rib_head* rh, struct route_latency out[RL_NTYPES]) {
+    struct rib_lat_shard* lat = atomic_load_explicit(&rh->rh_lat, memory_order_acquire);
+
+    memset(out, 0, sizeof(*out) * RL_NTYPES);
+
+    for (int i = 0; lat && i < RIB_LAT_SHARDS; i++) {
+        struct rib_lat_shard* ls = &lat[i];
+        struct route_latency copy[RL_NTYPES];
+
+        for (int tries = 0; ; tries++) {
+            uint64_t end = atomic_load_explicit(&ls->ls_end, memory_order_acquire);
+
+            for (int op = 0; op < RL_NTYPES; op++) {
+                struct rib_lat_hist* lh = &ls->ls_hist[op];
+
+                copy[op].rl_count = atomic_load_explicit(&lh->lh_count, memory_order_relaxed);
+                copy[op].rl_sum_ns = atomic_load_explicit(&lh->lh_sum_ns, memory_order_relaxed);
+                copy[op].rl_max_ns = atomic_load_explicit(&lh->lh_max_ns, memory_order_relaxed);
+                for (int b = 0; b < ROUTE_LAT_BUCKETS; b++) {
+                    copy[op].rl_buckets[b] =
+                        atomic_load_explicit(&lh->lh_buckets[b], memory_order_relaxed);
+                }
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&ls->ls_begin, memory_order_relaxed) == end ||
+                tries == RIB_LAT_RETRIES) {
+                break;
+            }
+        }
+
+        for (int op = 0; op < RL_NTYPES; op++) {
+            out[op].rl_count += copy[op].rl_count;
+            out[op].rl_sum_ns += copy[op].rl_sum_ns;
+            out[op].rl_max_ns = max(out[op].rl_max_ns, copy[op].rl_max_ns);
+            for (int b = 0; b < ROUTE_LAT_BUCKETS; b++) {
+                out[op].rl_buckets[b] += copy[op].rl_buckets[b];
+            }
+        }
+    }
+}
+
+static void route_lcache_release(void* arg) {
+    bsd_free(arg, M_RTABLE);
+}
+
+static void route_lcache_key_init(void) {
+    pthread_key_create(&route_lcache_key, route_lcache_release);
+}
+
+/*
+ * Returns the cache slot of @dst in @rh, NULL when @dst cannot be cached.
+ * The key is the part of the sockaddr the radix tree compares.
+ */
+static struct route_lcache_ent* route_lcache_slot(struct rib_head* rh,
+                                                  const struct sockaddr* dst,
+                                                  const uint8_t** key, size_t* len) {
+    size_t off, end;
+
+    switch (rh->rh_family) {
+        case AF_INET:
+            off = offsetof(struct sockaddr_in, sin_addr);
+            end = sizeof(struct sockaddr_in);
+            break;
+        case AF_INET6:
+            off = offsetof(struct sockaddr_in6, sin6_addr);
+            end = sizeof(struct sockaddr_in6);
+            break;
+        default:
+            return NULL;
+    }
+    if (dst->sa_family != rh->rh_family) {
+        return NULL;
+    }
+
+    if (!route_lcache) {
+        pthread_once(&route_lcache_once, route_lcache_key_init);
+        route_lcache = bsd_malloc(sizeof(*route_lcache) * ROUTE_LCACHE_SIZE, M_RTABLE,
+                                  M_NOWAIT | M_ZERO);
+        if (!route_lcache) {
+            return NULL;
+        }
+        pthread_setspecific(route_lcache_key, route_lcache);
+    }
+
+    *key = (const uint8_t*)dst + off;
+    *len = end - off;
+
+    /* FNV-1a over the key and the table */
+    uint32_t h = 2166136261u ^ (uint32_t)rh->rh_id;
+    for (size_t i = 0; i < *len; i++) {
+        h = (h ^ (*key)[i]) * 16777619u;
+    }
+    return &route_lcache[(h ^ (h >> 16)) & (ROUTE_LCACHE_SIZE - 1)];
+}
+
+int route_table_set_lookup_cache(struct rib_head* rh, int enable) {
+    if (!rh) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    rh->rh_lcache = enable ? 1 : 0;
+    /* Entries filled before a disable must not be trusted after an enable */
+    rib_gen_bump(rh);
+    return ROUTE_OK;
+}
+
+#if defined(__linux__)
+/* Parses the cpulist of sysfs node @node, "0-3,8-11" */
+static int route_numa_read_node(int node) {
+    char path[64], buf[1024];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    if (!fgets(buf, sizeof(buf), f)) {
+        buf[0] = '\0';
+    }
+    fclose(f);
+
+    for (char* p = buf; *p >= '0' && *p <= '9'; ) {
+        long lo = strtol(p, &p, 10), hi = lo;
+
+        if (*p == '-') {
+            hi = strtol(p + 1, &p, 10);
+        }
+        for (long cpu = lo; cpu <= hi && cpu < ROUTE_NUMA_MAXCPUS; cpu++) {
+            route_numa_cpu_node[cpu] = (uint8_t)node;
+            CPU_SET(cpu, &route_numa_cpus[node]);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return 1;
+}
+#endif
+
+static void route_numa_init(void) {
+#if defined(__linux__)
+    for (int node = 0; node < ROUTE_NUMA_MAXNODES; node++) {
+        CPU_ZERO(&route_numa_cpus[node]);
+    }
+    for (int node = 0; node < ROUTE_NUMA_MAXNODES; node++) {
+        if (!route_numa_read_node(node)) {
+            break;
+        }
+        route_numa_nodes = node + 1;
+    }
+#endif
+}
+
+void route_thread_set_node(int node) {
+    route_thread_node = node;
+}
+
+/* Node of the calling thread, looked up on its first lookup */
+static int route_numa_node(void) {
+    if (route_thread_node < 0) {
+        int cpu = -1;
+
+        pthread_once(&route_numa_once, route_numa_init);
+#if defined(__linux__)
+        cpu = sched_getcpu();
+#endif
+        route_thread_node = (cpu >= 0 && cpu < ROUTE_NUMA_MAXCPUS) ?
+            route_numa_cpu_node[cpu] : 0;
+    }
+    return route_thread_node;
+}
+
+/* Replica of the frozen copy @rz closest to the calling thread */
+static inline const struct rn_frozen* route_frozen_local(const struct route_frozen* rz) {
+    if (rz->rz_nrf == 1) {
+        return rz->rz_rf[0];
+    }
+    return rz->rz_rf[route_numa_node() % rz->rz_nrf];
+}
+
+/*
+ * Host route table
+ *
+ * The writer inserts and deletes in place, a deleted route leaving a
+ * marker that probes skip, and replaces the whole table to grow it or
+ * drop the markers. Datapath readers probe without locks; deleted
+ * entries and replaced tables are freed after an epoch. A route that
+ * could not be inserted is still found in the tree.
+ */
+static char route_hosts_dead;
+#define ROUTE_HOSTS_DEAD ((struct route_entry*)&route_hosts_dead)
+
+static inline uint32_t route_hosts_hashval(const uint8_t* key, size_t len) {
+    uint32_t h = 2166136261u;  /* FNV-1a */
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+    return h ^ (h >> 16);
+}
+
+/* Route of @dst in @ht, NULL if it has none */
+static inline struct route_entry* route_hosts_match(const struct route_hosts* ht,
+                                                    const struct sockaddr* dst) {
+    const uint8_t* key = (const uint8_t*)dst + ht->rht_off;
+    struct route_entry* re;
+
+    if (dst->sa_family != ht->rht_family || dst->sa_len < ht->rht_off + ht->rht_len) {
+        return NULL;
+    }
+    for (uint32_t i = route_hosts_hashval(key, ht->rht_len); ; i++) {
+        re = atomic_load_explicit(&ht->rht_slots[i & ht->rht_mask], memory_order_acquire);
+        if (!re) {
+            return NULL;
+        }
+        if (re != ROUTE_HOSTS_DEAD &&
+            memcmp((const uint8_t*)re->re_dst + ht->rht_off, key, ht->rht_len) == 0) {
+            return re;
+        }
+    }
+}
+
+/* Host route of @dst in @rh, probed before the tree */
+static inline struct radix_node* rib_host_match(struct rib_head* rh, const struct sockaddr* dst) {
+    struct route_hosts* ht = atomic_load_explicit(&rh->rh_hosts, memory_order_acquire);
+    struct route_entry* re;
+
+    if (!ht || !(re = route_hosts_match(ht, dst))) {
+        return NULL;
+    }
+    return &re->re_nodes[0];
+}
+
+/* Whether @re is the route of a full-length prefix, all of its address a key */
+static int route_hosts_eligible(const struct route_hosts* ht, const struct route_entry* re) {
+    const uint8_t* mask = (const uint8_t*)re->re_mask;
+
+    if (re->re_dst->sa_family != ht->rht_family ||
+        re->re_dst->sa_len < ht->rht_off + ht->rht_len) {
+        return 0;
+    }
+    if (!mask) {
+        return 1;
+    }
+    if (re->re_mask->sa_len < ht->rht_off + ht->rht_len) {
+        return 0;
+    }
+    for (size_t i = 0; i < ht->rht_len; i++) {
+        if (mask[ht->rht_off + i] != 0xff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static struct route_hosts* route_hosts_alloc(int family, uint32_t nslots) {
+    struct route_hosts* ht;
+    size_t off, len;
+
+    if (route_snap_addr(family, &off, &len) != 0) {
+        return NULL;
+    }
+    ht = bsd_malloc(sizeof(*ht) + nslots * sizeof(ht->rht_slots[0]), M_RTABLE,
+                    M_NOWAIT | M_ZERO);
+    if (ht) {
+        ht->rht_mask = nslots - 1;
+        ht->rht_family = family;
+        ht->rht_off = off;
+        ht->rht_len = len;
+    }
+    return ht;
+}
+
+static void route_hosts_free_epoch(epoch_context_t ctx) {
+    bsd_free(__containerof(ctx, struct route_hosts, rht_ctx), M_RTABLE);
+}
+
+/* Stores @re, whose address is not in @ht yet, reusing the first deleted slot */
+static void route_hosts_put(struct route_hosts* ht, struct route_entry* re) {
+    const uint8_t* key = (const uint8_t*)re->re_dst + ht->rht_off;
+    uint32_t i = route_hosts_hashval(key, ht->rht_len) & ht->rht_mask;
+    struct route_entry* cur;
+
+    while ((cur = atomic_load_explicit(&ht->rht_slots[i], memory_order_relaxed)) != NULL &&
+           cur != ROUTE_HOSTS_DEAD) {
+        i = (i + 1) & ht->rht_mask;
+    }
+    if (!cur) {
+        ht->rht_used++;
+    }
+    ht->rht_count++;
+    atomic_store_explicit(&ht->rht_slots[i], re, memory_order_release);
+}
+
+/* Replaces the table of @rh with one of its live routes, sized for growth */
+static struct route_hosts* route_hosts_rehash(struct rib_head* rh, struct route_hosts* old) {
+    uint32_t nslots = ROUTE_HOSTS_MINSLOTS;
+    struct route_hosts* ht;
+
+    while (nslots < 4 * (old->rht_count + 1)) {
+        if (nslots > UINT32_MAX / 4) {
+            return NULL;
+        }
+        nslots <<= 1;
+    }
+    if ((ht = route_hosts_alloc(old->rht_family, nslots)) == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i <= old->rht_mask; i++) {
+        struct route_entry* re = atomic_load_explicit(&old->rht_slots[i], memory_order_relaxed);
+
+        if (re && re != ROUTE_HOSTS_DEAD) {
+            route_hosts_put(ht, re);
+        }
+    }
+    atomic_store_explicit(&rh->rh_hosts, ht, memory_order_release);
+    NET_EPOCH_CALL(route_hosts_free_epoch, &old->rht_ctx);
+    return ht;
+}
+
+/* Adds the new route @re of @rh to its host table if it is a host route */
+static void route_hosts_insert(struct rib_head* rh, struct route_entry* re) {
+    struct route_hosts* ht = atomic_load_explicit(&rh->rh_hosts, memory_order_relaxed);
+
+    if (!ht || !route_hosts_eligible(ht, re)) {
+        return;
+    }
+    if (2 * (ht->rht_used + 1) > ht->rht_mask + 1 &&
+        (ht = route_hosts_rehash(rh, ht)) == NULL) {
+        return;
+    }
+    route_hosts_put(ht, re);
+}
+
+/* Takes the deleted route @re of @rh out of its host table */
+static void route_hosts_remove(struct rib_head* rh, struct route_entry* re) {
+    struct route_hosts* ht = atomic_load_explicit(&rh->rh_hosts, memory_order_relaxed);
+    struct route_entry* cur;
+    uint32_t i;
+
+    if (!ht || !route_hosts_eligible(ht, re)) {
+        return;
+    }
+    i = route_hosts_hashval((const uint8_t*)re->re_dst + ht->rht_off, ht->rht_len);
+    for (i &= ht->rht_mask; (cur = atomic_load_explicit(&ht->rht_slots[i],
+                                                        memory_order_relaxed)) != NULL;
+         i = (i + 1) & ht->rht_mask) {
+        if (cur == re) {
+            atomic_store_explicit(&ht->rht_slots[i], ROUTE_HOSTS_DEAD, memory_order_release);
+            ht->rht_count--;
+            return;
+        }
+    }
+}
+
+/* Empties the host table of @rh, for a tree replaced as a whole */
+static void route_hosts_clear(struct rib_head* rh) {
+    struct route_hosts* ht = atomic_load_explicit(&rh->rh_hosts, memory_order_relaxed);
+
+    if (!ht) {
+        return;
+    }
+    for (uint32_t i = 0; i <= ht->rht_mask; i++) {
+        atomic_store_explicit(&ht->rht_slots[i], NULL, memory_order_relaxed);
+    }
+    ht->rht_count = 0;
+    ht->rht_used = 0;
+}
+
+static void route_hosts_drop(struct rib_head* rh) {
+    struct route_hosts* ht = atomic_exchange_explicit(&rh->rh_hosts, NULL, memory_order_acq_rel);
+
+    if (ht) {
+        NET_EPOCH_CALL(route_hosts_free_epoch, &ht->rht_ctx);
+    }
+}
+
+static int route_hosts_fill_callback(struct radix_node* rn, void* arg) {
+    if (!(rn->rn_flags & RNF_ROOT)) {
+        route_hosts_insert(arg, (struct route_entry*)
+            ((char*)rn - offsetof(struct route_entry, re_nodes[0])));
+    }
+    return 0;
+}
+
+int route_table_set_host_table(struct rib_head* rh, int enable) {
+    struct route_hosts* ht;
+
+    if (!rh) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    if (!enable) {
+        route_hosts_drop(rh);
+        return ROUTE_OK;
+    }
+    if (atomic_load_explicit(&rh->rh_hosts, memory_order_relaxed)) {
+        return ROUTE_OK;
+    }
+    if (rh->rh_family != AF_INET && rh->rh_family != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return ROUTE_ENOTSUPP;
+    }
+    if ((ht = route_hosts_alloc(rh->rh_family, ROUTE_HOSTS_MINSLOTS)) == NULL) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+
+    /* Lookups go to the tree for routes not inserted yet */
+    atomic_store_explicit(&rh->rh_hosts, ht, memory_order_release);
+    rh->rh_rnh->rnh_walktree(&rh->rh_rnh->rh, route_hosts_fill_callback, rh);
+    return ROUTE_OK;
+}
+
+/* Prefix length of @mask in a tree of @family, NULL for a host route */
+static int rib_mask_plen(const u_char* mask, int family) {
+    int plen = 0;
+
+    if (!mask) {
+        return INT_MAX;
+    }
+    for (int i = rib_key_offset(family) >> 3; i < *mask; i++) {
+        plen += __builtin_popcount(mask[i]);
+    }
+    return plen;
+}
+
+/* Prefix length of leaf @rn in a tree of @family, host routes longest */
+static int rib_plen(const struct radix_node* rn, int family) {
+    return rib_mask_plen((const u_char*)rn->rn_mask, family);
+}
+
+/*
+ * Changes to the live tree are bracketed by rib_write_begin() and
+ * rib_write_end(), which keep rh_wseq odd in between. Readers take no
+ * lock: a match that overlapped a change is thrown away and redone.
+ * Nodes, entries and the radix mask annotations are freed an epoch after
+ * their removal, and a swapped tree is released only once the writer
+ * has waited for the epoch, so a reader racing the writer only risks a
+ * wrong answer, never freed memory.
+ */
+static inline void rib_write_begin(struct rib_head* rh) {
+    u_int seq = atomic_load_explicit(&rh->rh_wseq, memory_order_relaxed);
+
+    atomic_store_explicit(&rh->rh_wseq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void rib_write_end(struct rib_head* rh) {
+    u_int seq = atomic_load_explicit(&rh->rh_wseq, memory_order_relaxed);
+
+    atomic_store_explicit(&rh->rh_wseq, seq + 1, memory_order_release);
+}
+
+static inline u_int rib_read_begin(const struct rib_head* rh) {
+    u_int seq;
+
+    for (int spins = 0;
+         ((seq = atomic_load_explicit(&rh->rh_wseq, memory_order_acquire)) & 1) != 0;
+         spins++) {
+        if (spins > 100) {
+            sched_yield();
+        }
+    }
+    return seq;
+}
+
+static inline int rib_read_retry(const struct rib_head* rh, u_int seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&rh->rh_wseq, memory_order_relaxed) != seq;
+}
+
+/*
+ * Longest match of @dst in the tree of @rh. The match of an overlay is
+ * the longer of its own and the base one, its own winning ties so that
+ * it overrides base routes of the same prefix.
+ */
+static struct radix_node* rib_match_once(struct rib_head* rh, const struct sockaddr* dst) {
+    struct rib_head* base = rh->rh_base;
+    struct route_frozen* rz;
+    struct radix_node_head* rnh;
+    struct radix_node *rn, *brn;
+
+    /* Nothing is longer than an own host route */
+    if ((rn = rib_host_match(rh, dst)) != NULL) {
+        return rn;
+    }
+    rnh = rib_rnh(rh);
+    rn = rnh->rnh_matchaddr(dst, &rnh->rh);
+    if (rn && (rn->rn_flags & RNF_ROOT)) {
+        rn = NULL;
+    }
+    if (!base) {
+        return rn;
+    }
+
+    rz = atomic_load_explicit(&base->rh_frozen, memory_order_acquire);
+    if (rz) {
+        brn = rn_frozen_match(dst, route_frozen_local(rz));
+    } else {
+        rnh = rib_rnh(base);
+        brn = rnh->rnh_matchaddr(dst, &rnh->rh);
+    }
+    if (!brn || (brn->rn_flags & RNF_ROOT)) {
+        return rn;
+    }
+    if (!rn || rib_plen(brn, rh->rh_family) > rib_plen(rn, rh->rh_family)) {
+        return brn;
+    }
+    return rn;
+}
+
+/* rib_match_once() redone until no change to the tree overlapped it */
+static struct radix_node* rib_match(struct rib_head* rh, const struct sockaddr* dst) {
+    struct radix_node* rn;
+    u_int seq;
+
+    do {
+        seq = rib_read_begin(rh);
+        rn = rib_match_once(rh, dst);
+    } while (rib_read_retry(rh, seq));
+    return rn;
+}
+
+/* Tables serving as the base of overlays are immutable */
+static int rib_busy(struct rib_head* rh) {
+    if (atomic_load_explicit(&rh->rh_overlays, memory_order_acquire) != 0) {
+        errno = EBUSY;
+        return 1;
+    }
+    return 0;
+}
+
+/* Default datapath: radix longest match, on the frozen copy if any */
+static struct radix_node* radix_dp_match(struct rib_head* rh, const struct sockaddr* dst) {
+    struct route_frozen* rz = atomic_load_explicit(&rh->rh_frozen, memory_order_acquire);
+    struct radix_node* rn;
+
+    if (!rz) {
+        rn = rib_match(rh, dst);
+    } else if ((rn = rib_host_match(rh, dst)) == NULL) {
+        rn = rn_frozen_match(dst, route_frozen_local(rz));
+    }
+    return (rn && !(rn->rn_flags & RNF_ROOT)) ? rn : NULL;
+}
+
+static int radix_dp_lookup(void* arg, const struct sockaddr* dst, struct route_info* ri_out) {
+    struct radix_node* rn = radix_dp_match(arg, dst);
+    struct route_entry* re;
+
+    if (!rn) {
+        return ROUTE_ENOENT;
+    }
+    re = (struct route_entry*)((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+    rib_hit(arg, re);
+    if (ri_out) {
+        fill_route_info(re, ri_out);
+    }
+    return ROUTE_OK;
+}
+
+static uint32_t radix_dp_nhidx(void* arg, const struct sockaddr* dst) {
+    struct radix_node* rn = radix_dp_match(arg, dst);
+    struct route_entry* re;
+
+    if (!rn) {
+        return 0;
+    }
+    re = (struct route_entry*)((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+    rib_hit(arg, re);
+    return re->re_nhidx;
+}
+
+static void radix_dp_match_burst(struct rib_head* rh, const struct sockaddr* const* dsts,
+                                 int count, struct radix_node** rns) {
+    struct route_frozen* rz = atomic_load_explicit(&rh->rh_frozen, memory_order_acquire);
+
+    if (rz && atomic_load_explicit(&rh->rh_hosts, memory_order_relaxed)) {
+        /* Only keys without a host route go to the frozen copy */
+        const struct sockaddr* miss[ROUTE_DP_BURST];
+        struct radix_node* mrns[ROUTE_DP_BURST];
+        int idx[ROUTE_DP_BURST], n = 0;
+
+        for (int i = 0; i < count; i++) {
+            if ((rns[i] = rib_host_match(rh, dsts[i])) == NULL) {
+                miss[n] = dsts[i];
+                idx[n++] = i;
+            }
+        }
+        if (n > 0) {
+            rn_frozen_match_burst((const void* const*)miss, n, mrns, route_frozen_local(rz));
+            for (int i = 0; i < n; i++) {
+                rns[idx[i]] = mrns[i];
+            }
+        }
+    } else if (rz) {
+        rn_frozen_match_burst((const void* const*)dsts, count, rns, route_frozen_local(rz));
+    } else {
+        for (int i = 0; i < count; i++) {
+            rns[i] = rib_match(rh, dsts[i]);
+        }
+    }
+}
+
+static int radix_dp_burst(void* arg, const struct sockaddr* const* dsts, int count,
+                          struct route_info* ri_out) {
+    struct radix_node* rns[ROUTE_DP_BURST];
+    int hits = 0;
+
+    radix_dp_match_burst(arg, dsts, count, rns);
+    for (int i = 0; i < count; i++) {
+        struct route_entry* re;
+
+        if (!rns[i] || (rns[i]->rn_flags & RNF_ROOT)) {
+            memset(&ri_out[i], 0, sizeof(ri_out[i]));
+            continue;
+        }
+        re = (struct route_entry*)((char*)rns[i] - offsetof(struct route_entry, re_nodes[0]));
+        rib_hit(arg, re);
+        fill_route_info(re, &ri_out[i]);
+        hits++;
+    }
+    return hits;
+}
+
+/* Nexthop of @re for @flowid, read from the group slots if multipath */
+static inline uint32_t route_entry_nhidx(const struct route_entry* re, uint32_t flowid) {
+    const struct route_nhgrp* ng = re->re_nhgrp;
+
+    return ng ? ng->ng_members[ng->ng_slots[flowid % ng->ng_nslots]] : re->re_nhidx;
+}
+
+static int radix_dp_nhidx_burst(void* arg, const struct sockaddr* const* dsts,
+                                const uint32_t* flowids, int count, uint32_t* nhidx_out) {
+    struct radix_node* rns[ROUTE_DP_BURST];
+    int hits = 0;
+
+    radix_dp_match_burst(arg, dsts, count, rns);
+    for (int i = 0; i < count; i++) {
+        struct route_entry* re;
+
+        if (!rns[i] || (rns[i]->rn_flags & RNF_ROOT)) {
+            nhidx_out[i] = 0;
+            continue;
+        }
+        re = (struct route_entry*)((char*)rns[i] - offsetof(struct route_entry, re_nodes[0]));
+        rib_hit(arg, re);
+        nhidx_out[i] = route_entry_nhidx(re, flowids[i]);
+        hits++;
+    }
+    return hits;
+}
+
+struct route_dp* _Atomic* get_family_dp(int family) {
+    switch (family) {
+        case AF_INET:
+            return route_inet_dp;
+        case AF_INET6:
+            return route_inet6_dp;
+        default:
+            return NULL;
+    }
+}
+
+/* Tree walk callback for route_walk */
+struct walk_ctx {
+    route_walker_f walker;
+    void* arg;
+    int count;
+    struct radix_head* shadow;  /* Routes also found there are skipped */
+    route_hits_walker_f hwalker; /* Called instead of walker if set */
+    int hreset;                 /* Clear the hits passed to hwalker */
+};
+
+static int route_walk_callback(struct radix_node* rn, void* arg) {
+    struct walk_ctx* ctx = (struct walk_ctx*)arg;
+
+    /* Skip internal nodes - only process leaves with route entries */
+    if (!(rn->rn_flags & RNF_ROOT) && rn->rn_key) {
+        if (ctx->shadow && rn_lookup(rn->rn_key, rn->rn_mask, ctx->shadow)) {
+            return 0;
+        }
+
+        struct route_entry* re = (struct route_entry*)
+            ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+
+        struct route_info ri = {
+            .ri_dst = re->re_dst,
+            .ri_netmask = re->re_mask,
+            .ri_gateway = re->re_gateway,
+            .ri_flags = re->re_flags,
+            .ri_ifindex = re->re_ifindex,
+            .ri_fibnum = re->re_fibnum
+        };
+
+        ctx->count++;
+        if (ctx->hwalker) {
+            return ctx->hwalker(&ri, route_entry_hits(re, ctx->hreset), ctx->arg);
+        }
+        return ctx->walker(&ri, ctx->arg);
+    }
+    return 0;
+}
+
+/* A batch of route_walk_callback(), the entries prefetched up front */
+static int route_walk_batch_callback(struct radix_node** rns, int n, void* arg) {
+    int error;
+
+    for (int i = 0; i < n; i++) {
+        __builtin_prefetch((char*)rns[i] - offsetof(struct route_entry, re_nodes[0]));
+    }
+    for (int i = 0; i < n; i++) {
+        if ((error = route_walk_callback(rns[i], arg)) != 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+/* API Implementation */
+
+int route_lib_init(void) {
+    if (g_route_lib_initialized) {
+        return ROUTE_OK;
+    }
+
+    route_init_start = rm_nanotime();
+    atomic_store_explicit(&route_init_tables, 0, memory_order_relaxed);
+    atomic_store_explicit(&route_init_table_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&route_init_head_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&route_init_counters_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&route_init_deferred, 0, memory_order_relaxed);
+    atomic_store_explicit(&route_init_deferred_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&route_init_lookup_ns, 0, memory_order_relaxed);
+
+    /* Initialize compatibility layer */
+    kernel_compat_init();
+
+    route_entry_zone = uma_zcreate("route_entry", sizeof(struct route_entry),
+                                   NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
+    if (!route_entry_zone) {
+        return ROUTE_ENOMEM;
+    }
+
+    g_route_lib_initialized = 1;
+    atomic_store_explicit(&route_init_lib_ns, rm_nanotime() - route_init_start,
+                          memory_order_relaxed);
+    return ROUTE_OK;
+}
+
+void route_lib_get_init_stats(struct route_init_stats* out) {
+    if (!out) {
+        return;
+    }
+    out->ris_lib_ns = atomic_load_explicit(&route_init_lib_ns, memory_order_relaxed);
+    out->ris_tables = atomic_load_explicit(&route_init_tables, memory_order_relaxed);
+    out->ris_table_ns = atomic_load_explicit(&route_init_table_ns, memory_order_relaxed);
+    out->ris_head_ns = atomic_load_explicit(&route_init_head_ns, memory_order_relaxed);
+    out->ris_counters_ns = atomic_load_explicit(&route_init_counters_ns, memory_order_relaxed);
+    out->ris_deferred = atomic_load_explicit(&route_init_deferred, memory_order_relaxed);
+    out->ris_deferred_ns = atomic_load_explicit(&route_init_deferred_ns, memory_order_relaxed);
+    out->ris_first_lookup_ns = atomic_load_explicit(&route_init_lookup_ns, memory_order_relaxed);
+}
+
+/* Notes the time to the first lookup, one load on the later ones */
+static inline void route_init_lookup(void) {
+    uint64_t expected = 0;
+
+    if (__predict_false(atomic_load_explicit(&route_init_lookup_ns,
+                                             memory_order_relaxed) == 0)) {
+        atomic_compare_exchange_strong_explicit(&route_init_lookup_ns, &expected,
+                                                max(rm_nanotime() - route_init_start, 1),
+                                                memory_order_relaxed, memory_order_relaxed);
+    }
+}
+
+/* All tables must have been destroyed, their entries go away with the zone */
+void route_lib_cleanup(void) {
+    if (g_route_lib_initialized) {
+        /* Run pending deferred frees before releasing the slabs */
+        epoch_drain_callbacks(net_epoch_preempt);
+        uma_zdestroy(route_entry_zone);
+        route_entry_zone = NULL;
+        g_route_lib_initialized = 0;
+    }
+}
+
+void route_lib_set_hugepages(int enable) {
+    route_hugepages = !!enable;
+    malloc_type_set_hugepage(M_RTABLE, route_hugepages);
+}
+
+/* Radix tree key offset of @family, in bits */
+static int rib_key_offset(int family) {
+    switch (family) {
+        case AF_INET:
+            return offsetof(struct sockaddr_in, sin_addr) << 3;
+        case AF_INET6:
+            return offsetof(struct sockaddr_in6, sin6_addr) << 3;
+        default:
+            return 0;
+    }
+}
+
+/* Radix tree of a @family table, with the fixed-width lookup of its keys */
+static int rib_inithead(struct radix_node_head** rnhp, int family) {
+    if (rn_inithead((void**)rnhp, rib_key_offset(family)) != 1) {
+        return 0;
+    }
+    switch (family) {
+        case AF_INET:
+            (*rnhp)->rnh_matchaddr = rn_match_in4;
+            break;
+        case AF_INET6:
+            (*rnhp)->rnh_matchaddr = rn_match_in6;
+            break;
+    }
+    return 1;
+}
+
+/*
+ * Route entries of a table come from a zone of its own so that the whole
+ * table can be released at once. Tables share route_entry_zone once the
+ * process is out of zones.
+ */
+static uma_zone_t rib_zone_create(void) {
+    uma_zone_t zone = uma_zcreate("rib_entry", sizeof(struct route_entry),
+                                  NULL, NULL, NULL, NULL, UMA_ALIGN_PTR,
+                                  route_hugepages ? UMA_ZONE_HUGEPAGE : 0);
+    return zone ? zone : route_entry_zone;
+}
+
+/* Zone of the entries of @rh, created with its first route */
+static uma_zone_t rib_zone(struct rib_head* rh) {
+    if (__predict_false(rh->rh_zone == NULL)) {
+        uint64_t start = rm_nanotime();
+
+        rh->rh_zone = rib_zone_create();
+        route_init_defer(start);
+    }
+    return rh->rh_zone;
+}
+
+/* Interned masks and nexthops seen by a release walk, references dropped in batches */
+#define RIB_RELEASE_MASKS 16
+#define RIB_RELEASE_NHOPS 16
+
+struct rib_release_ctx {
+    struct radix_node_head* rnh;
+    int shared;                     /* Entries go back one by one */
+    int nmasks;
+    int nnhops;
+    struct {
+        struct sockaddr* mask;
+        u_int refs;
+    } masks[RIB_RELEASE_MASKS];
+    struct {
+        uint32_t idx;
+        u_int refs;
+    } nhops[RIB_RELEASE_NHOPS];
+};
+
+static void rib_release_masks(struct rib_release_ctx* ctx) {
+    for (int i = 0; i < ctx->nmasks; i++) {
+        route_mask_release(ctx->masks[i].mask, ctx->masks[i].refs);
+    }
+    ctx->nmasks = 0;
+}
+
+static void rib_release_nhops(struct rib_release_ctx* ctx) {
+    for (int i = 0; i < ctx->nnhops; i++) {
+        route_nhop_release(ctx->nhops[i].idx, ctx->nhops[i].refs);
+    }
+    ctx->nnhops = 0;
+}
+
+static int rib_release_callback(struct radix_node* rn, void* arg) {
+    struct rib_release_ctx* ctx = arg;
+    struct route_entry* re = (struct route_entry*)
+        ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+
+    if (ctx->shared) {
+        /* The walk tolerates deleting the current leaf */
+        ctx->rnh->rnh_deladdr(re->re_dst, re->re_mask, &ctx->rnh->rh);
+        free_route_entry(re);
+        return 0;
+    }
+
+    /* Only what lives outside the zone, the entries go with it */
+    free_sockaddr(re->re_dst, &re->re_dst_sa);
+    if (re->re_nhgrp) {
+        route_nhgrp_release(re->re_nhgrp);
+    }
+    if (re->re_nhidx) {
+        int i;
+
+        for (i = 0; i < ctx->nnhops && ctx->nhops[i].idx != re->re_nhidx; i++) {
+        }
+        if (i == RIB_RELEASE_NHOPS) {
+            rib_release_nhops(ctx);
+            i = 0;
+        }
+        if (i == ctx->nnhops) {
+            ctx->nhops[i].idx = re->re_nhidx;
+            ctx->nhops[i].refs = 0;
+            ctx->nnhops++;
+        }
+        ctx->nhops[i].refs++;
+    }
+    if (re->re_mask) {
+        int i;
+
+        for (i = 0; i < ctx->nmasks && ctx->masks[i].mask != re->re_mask; i++) {
+        }
+        if (i == RIB_RELEASE_MASKS) {
+            rib_release_masks(ctx);
+            i = 0;
+        }
+        if (i == ctx->nmasks) {
+            ctx->masks[i].mask = re->re_mask;
+            ctx->masks[i].refs = 0;
+            ctx->nmasks++;
+        }
+        ctx->masks[i].refs++;
+    }
+    return 0;
+}
+
+/*
+ * Frees the tree @rnh and its route entries, allocated from @zone. The
+ * tree must be unreachable from the datapath and quiesced. A private
+ * zone is destroyed as a whole, without unlinking a single route. A
+ * tree that never had routes has no zone yet.
+ */
+static void rib_release_tree(struct radix_node_head* rnh, uma_zone_t zone) {
+    struct rib_release_ctx ctx = {
+        .rnh = rnh,
+        .shared = (zone == route_entry_zone),
+    };
+
+    if (!rnh) {
+        return;
+    }
+    rnh->rnh_walktree(&rnh->rh, rib_release_callback, &ctx);
+    rib_release_masks(&ctx);
+    rib_release_nhops(&ctx);
+    if (!ctx.shared) {
+        rn_freemasks(&rnh->rh);
+    }
+    rn_detachhead((void**)&rnh);
+
+    if (!ctx.shared && zone) {
+        /* Deleted routes may still be queued for a deferred free */
+        epoch_drain_callbacks(net_epoch_preempt);
+        uma_zdestroy(zone);
+    }
+}
+
+/* Creates a table, attached to the datapath slot of @fibnum if @attach and the slot is free */
+static struct rib_head* rib_create(int family, u_int fibnum, struct rib_head* base, int attach) {
+    if (!g_route_lib_initialized) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    uint64_t start = rm_nanotime(), t;
+    struct radix_node_head* rnh = NULL;
+    struct rib_head* rh = bsd_malloc(sizeof(*rh), M_RTABLE, M_WAITOK | M_ZERO);
+    if (!rh) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    t = rm_nanotime();
+    if (rib_inithead(&rnh, family) != 1) {
+        bsd_free(rh, M_RTABLE);
+        errno = ENOMEM;
+        return NULL;
+    }
+    rh->rh_rnh = rnh;
+    atomic_fetch_add_explicit(&route_init_head_ns, rm_nanotime() - t, memory_order_relaxed);
+
+    t = rm_nanotime();
+    if (rib_counters_alloc(&rh->rh_stats) != 0) {
+        rn_detachhead((void**)&rnh);
+        bsd_free(rh, M_RTABLE);
+        errno = ENOMEM;
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&route_init_counters_ns, rm_nanotime() - t, memory_order_relaxed);
+
+    /* The entry zone and latency histograms wait for their first use */
+    rh->rh_family = family;
+    rh->rh_fibnum = fibnum;
+    rh->rh_id = atomic_fetch_add_explicit(&route_table_ids, 1, memory_order_relaxed) + 1;
+    if (base) {
+        rh->rh_base = base;
+        atomic_fetch_add_explicit(&base->rh_overlays, 1, memory_order_acq_rel);
+    }
+
+    /* Attach to the datapath unless the fib slot is already taken */
+    rh->rh_dp.f = radix_dp_lookup;
+    rh->rh_dp.fb = radix_dp_burst;
+    rh->rh_dp.fn = radix_dp_nhidx;
+    rh->rh_dp.fnb = radix_dp_nhidx_burst;
+    rh->rh_dp.arg = rh;
+    struct route_dp* _Atomic* dp = get_family_dp(family);
+    if (attach && dp && fibnum < ROUTE_DP_MAXFIBS) {
+        struct route_dp* expected = NULL;
+        atomic_compare_exchange_strong(&dp[fibnum], &expected, &rh->rh_dp);
+    }
+
+    atomic_fetch_add_explicit(&route_init_tables, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&route_init_table_ns, rm_nanotime() - start, memory_order_relaxed);
+    return rh;
+}
+
+struct rib_head* route_table_create(int family, u_int fibnum) {
+    return rib_create(family, fibnum, NULL, 1);
+}
+
+struct rib_head* route_table_create_overlay(struct rib_head* base, u_int fibnum) {
+    /* Overlays do not stack */
+    if (!base || base->rh_base) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (route_snap_settle(base) != ROUTE_OK) {
+        return NULL;
+    }
+    return rib_create(base->rh_family, fibnum, base, 1);
+}
+
+void route_table_destroy(struct rib_head* rh) {
+    if (!rh) return;
+    if (rib_busy(rh)) {
+        return;
+    }
+
+    /* Detach from the datapath and wait for in-flight lookups */
+    struct route_dp* _Atomic* dp = get_family_dp(rh->rh_family);
+    if (dp && rh->rh_fibnum < ROUTE_DP_MAXFIBS) {
+        struct route_dp* expected = &rh->rh_dp;
+        atomic_compare_exchange_strong(&dp[rh->rh_fibnum], &expected, NULL);
+        NET_EPOCH_WAIT();
+    }
+
+    /* A failed rebuild still drops the snapshot */
+    route_snap_settle(rh);
+    route_frozen_drop(rh);
+    route_hosts_drop(rh);
+    route_delta_drop(rh);
+    route_journal_close(rh);
+    route_compact_abort(rh);
+
+    rib_release_tree(rh->rh_rnh, rh->rh_zone);
+    rh->rh_rnh = NULL;
+    if (rh->rh_base) {
+        atomic_fetch_sub_explicit(&rh->rh_base->rh_overlays, 1, memory_order_acq_rel);
+    }
+
+    rib_lat_free(rh);
+    rib_counters_free(&rh->rh_stats);
+    bsd_free(rh, M_RTABLE);
+}
+
+int route_table_flush(struct rib_head* rh) {
+    struct radix_node_head* old_rnh;
+    struct radix_node_head* rnh = NULL;
+    uma_zone_t old_zone;
+
+    if (!rh) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    if (rib_busy(rh)) {
+        return ROUTE_EBUSY;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    if (rib_inithead(&rnh, rh->rh_family) != 1) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    route_compact_abort(rh);
+
+    /* Lookups miss while the tree is swapped */
+    struct route_dp* _Atomic* dp = get_family_dp(rh->rh_family);
+    int attached = 0;
+    if (dp && rh->rh_fibnum < ROUTE_DP_MAXFIBS) {
+        struct route_dp* expected = &rh->rh_dp;
+        attached = atomic_compare_exchange_strong(&dp[rh->rh_fibnum], &expected, NULL);
+    }
+    route_frozen_drop(rh);
+    route_hosts_clear(rh);
+
+    old_rnh = rh->rh_rnh;
+    old_zone = rh->rh_zone;
+    rib_write_begin(rh);
+    rib_rnh_swap(rh, rnh);
+    rh->rh_zone = NULL;  /* Created again by the next route */
+    rib_write_end(rh);
+    rib_gen_bump(rh);
+
+    /* Datapath and route_lookup() readers may still be in the old tree */
+    NET_EPOCH_WAIT();
+
+    if (attached) {
+        struct route_dp* expected = NULL;
+        atomic_compare_exchange_strong(&dp[rh->rh_fibnum], &expected, &rh->rh_dp);
+    }
+
+    u_long count = counter_u64_fetch(rh->rh_stats.rc_nodes);
+    rib_release_tree(old_rnh, old_zone);
+
+    counter_u64_add(rh->rh_stats.rc_deletes, count);
+    counter_u64_zero(rh->rh_stats.rc_nodes);
+    counter_u64_add(rh->rh_stats.rc_flushes, 1);
+    route_log_change(rh, RJ_OP_FLUSH, NULL);
+
+    return ROUTE_OK;
+}
+
+/*
+ * Compaction
+ *
+ * Routes are copied in the route_walk() order to a new tree, their
+ * entries allocated from a new zone, so that entries and the tree nodes
+ * in them are packed in the order lookups reach them. Changes made
+ * between slices go to both trees; a route found in the new tree already
+ * is not copied again. Once the walk is over the new tree replaces the
+ * old one under the readers, which are on one or the other for a whole
+ * lookup, and the old one is released after an epoch.
+ */
+struct route_compact {
+    struct radix_node_head* rc_rnh;  /* Tree being built */
+    uma_zone_t rc_zone;
+    u_long rc_gen;                   /* Table generation rc_next is valid for */
+    struct radix_node* rc_next;      /* Next leaf to copy */
+    int rc_started;
+    int rc_has_mask;
+    union route_sa rc_key;           /* Last route copied */
+    union route_sa rc_mask;
+};
+
+/* Copy of @re from @zone, holding its own mask and nexthop references */
+static struct route_entry* route_entry_clone(const struct route_entry* re, uma_zone_t zone) {
+    struct route_entry* ce = uma_zalloc(zone, M_NOWAIT | M_ZERO);
+
+    if (!ce) {
+        return NULL;
+    }
+    ce->re_zone = zone;
+    ce->re_dst = copy_sockaddr(re->re_dst, &ce->re_dst_sa);
+    if (!ce->re_dst) {
+        uma_zfree(zone, ce);
+        return NULL;
+    }
+    ce->re_mask = re->re_mask ? route_mask_get(re->re_mask) : NULL;
+    ce->re_gateway = re->re_gateway;
+    ce->re_flags = re->re_flags;
+    ce->re_ifindex = re->re_ifindex;
+    ce->re_fibnum = re->re_fibnum;
+    for (int i = 0; i < ROUTE_HIT_SHARDS; i++) {
+        atomic_store_explicit(&ce->re_hits[i],
+                              atomic_load_explicit(&re->re_hits[i], memory_order_relaxed),
+                              memory_order_relaxed);
+    }
+    if (re->re_nhidx) {
+        ce->re_nhidx = route_nhop_ref(re->re_nhidx)->ne_idx;
+    }
+    if (re->re_nhgrp) {
+        pthread_mutex_lock(&route_nhop_lock);
+        re->re_nhgrp->ng_refcnt++;
+        pthread_mutex_unlock(&route_nhop_lock);
+        ce->re_nhgrp = re->re_nhgrp;
+    }
+    return ce;
+}
+
+/* Copies @re to the new tree of @rc unless a route of its prefix is there */
+static int route_compact_copy(struct route_compact* rc, const struct route_entry* re) {
+    struct route_entry* ce;
+
+    if (rc->rc_rnh->rnh_lookup(re->re_dst, re->re_mask, &rc->rc_rnh->rh)) {
+        return ROUTE_OK;
+    }
+    if ((ce = route_entry_clone(re, rc->rc_zone)) == NULL) {
+        return ROUTE_ENOMEM;
+    }
+    if (!rc->rc_rnh->rnh_addaddr(ce->re_dst, ce->re_mask, &rc->rc_rnh->rh, ce->re_nodes)) {
+        free_route_entry(ce);
+        return ROUTE_ENOMEM;
+    }
+    return ROUTE_OK;
+}
+
+/* Drops the compaction in progress of @rh, if any */
+static void route_compact_abort(struct rib_head* rh) {
+    struct route_compact* rc = rh->rh_compact;
+
+    if (!rc) {
+        return;
+    }
+    rh->rh_compact = NULL;
+    /* Never published, but deleted routes may be queued for a free */
+    rib_release_tree(rc->rc_rnh, rc->rc_zone);
+    bsd_free(rc, M_RTABLE);
+}
+
+/* Mirrors the route @re added to @rh in the tree being built */
+static void route_compact_add(struct rib_head* rh, struct route_entry* re) {
+    if (rh->rh_compact && route_compact_copy(rh->rh_compact, re) != ROUTE_OK) {
+        route_compact_abort(rh);
+    }
+}
+
+/* Mirrors the deletion of @re from @rh in the tree being built */
+static void route_compact_del(struct rib_head* rh, struct route_entry* re) {
+    struct route_compact* rc = rh->rh_compact;
+    struct radix_node* rn;
+
+    if (!rc) {
+        return;
+    }
+    rn = rc->rc_rnh->rnh_deladdr(re->re_dst, re->re_mask, &rc->rc_rnh->rh);
+    if (rn) {
+        free_route_entry((struct route_entry*)
+            ((char*)rn - offsetof(struct route_entry, re_nodes[0])));
+    }
+}
+
+/* Puts the tree built by the compaction of @rh in place of its own */
+static void route_compact_finish(struct rib_head* rh) {
+    struct route_compact* rc = rh->rh_compact;
+    struct radix_node_head* old_rnh = rh->rh_rnh;
+    uma_zone_t old_zone = rh->rh_zone;
+    int frozen = atomic_load_explicit(&rh->rh_frozen, memory_order_relaxed) != NULL;
+    int hosts = atomic_load_explicit(&rh->rh_hosts, memory_order_relaxed) != NULL;
+
+    rh->rh_compact = NULL;
+    rib_write_begin(rh);
+    rib_rnh_swap(rh, rc->rc_rnh);
+    rh->rh_zone = rc->rc_zone;
+    rib_write_end(rh);
+    rib_gen_bump(rh);
+    bsd_free(rc, M_RTABLE);
+
+    /* The host table and frozen copy point to the old entries */
+    if (hosts) {
+        route_hosts_drop(rh);
+        route_table_set_host_table(rh, 1);
+    }
+    if (frozen) {
+        route_frozen_drop(rh);
+        route_table_freeze(rh);
+    }
+
+    NET_EPOCH_WAIT();
+    rib_release_tree(old_rnh, old_zone);
+    counter_u64_add(rh->rh_stats.rc_compactions, 1);
+}
+
+int route_table_compact(struct rib_head* rh, int budget) {
+    struct route_compact* rc;
+    struct route_entry* re;
+    struct radix_node* rn;
+    int error;
+
+    if (!rh) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (rib_busy(rh)) {
+        return ROUTE_EBUSY;
+    }
+
+    error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    if ((rc = rh->rh_compact) == NULL) {
+        rc = bsd_malloc(sizeof(*rc), M_RTABLE, M_NOWAIT | M_ZERO);
+        if (!rc) {
+            errno = ENOMEM;
+            return ROUTE_ENOMEM;
+        }
+        if (rib_inithead(&rc->rc_rnh, rh->rh_family) != 1) {
+            bsd_free(rc, M_RTABLE);
+            errno = ENOMEM;
+            return ROUTE_ENOMEM;
+        }
+        rc->rc_zone = rib_zone_create();
+        rh->rh_compact = rc;
+    }
+
+    if (!rc->rc_started) {
+        rn = rn_seek_after(NULL, NULL, &rh->rh_rnh->rh);
+        rc->rc_started = 1;
+    } else if (rc->rc_gen == rib_gen(rh)) {
+        rn = rc->rc_next;
+    } else {
+        rn = rn_seek_after(&rc->rc_key, rc->rc_has_mask ? &rc->rc_mask : NULL,
+                           &rh->rh_rnh->rh);
+    }
+
+    for (int count = 0; rn != NULL && (budget <= 0 || count < budget); count++) {
+        re = (struct route_entry*)((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+        rn = rn_next_leaf(rn);
+
+        if (route_compact_copy(rc, re) != ROUTE_OK) {
+            route_compact_abort(rh);
+            errno = ENOMEM;
+            return ROUTE_ENOMEM;
+        }
+        memcpy(&rc->rc_key, re->re_dst, min(re->re_dst->sa_len, sizeof(rc->rc_key)));
+        rc->rc_has_mask = re->re_mask != NULL;
+        if (re->re_mask) {
+            memcpy(&rc->rc_mask, re->re_mask, min(re->re_mask->sa_len, sizeof(rc->rc_mask)));
+        }
+    }
+
+    if (rn != NULL) {
+        rc->rc_next = rn;
+        rc->rc_gen = rib_gen(rh);
+        return 1;
+    }
+    route_compact_finish(rh);
+    return ROUTE_OK;
+}
+
+/* Adds @ri, over the @count gateways of @gws instead of ri_gateway if set */
+static int rib_add_mpath(struct rib_head* rh, const struct route_info* ri,
+                         const struct route_mpath_gw* gws, size_t count) {
+    if (!rh || !ri || !ri->ri_dst || (gws && (count == 0 || count > ROUTE_MPATH_MAX))) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (rib_busy(rh)) {
+        return ROUTE_EBUSY;
+    }
+    /* Journals hold single path routes, as snapshots do */
+    if (gws && rh->rh_journal) {
+        errno = EOPNOTSUPP;
+        return ROUTE_ENOTSUPP;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    /* Allocate route entry */
+    struct route_entry* re = uma_zalloc(rib_zone(rh), M_NOWAIT | M_ZERO);
+    if (!re) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    re->re_zone = rh->rh_zone;
+
+    /* Copy addresses into the entry (FreeBSD radix stores pointers) */
+    re->re_dst = copy_sockaddr(ri->ri_dst, &re->re_dst_sa);
+    re->re_mask = ri->ri_netmask ? route_mask_get(ri->ri_netmask) : NULL;
+    re->re_flags = ri->ri_flags;
+    re->re_ifindex = ri->ri_ifindex;
+    re->re_fibnum = ri->ri_fibnum;
+    if (gws) {
+        re->re_nhgrp = route_nhgrp_build(ri, gws, count);
+    }
+
+    if (!re->re_dst || (ri->ri_netmask && !re->re_mask) || (gws && !re->re_nhgrp) ||
+        !route_entry_set_nhop(re, ri)) {
+        free_route_entry(re);
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+
+    /* Add to radix tree */
+    rib_write_begin(rh);
+    struct radix_node* rn = rh->rh_rnh->rnh_addaddr(
+        re->re_dst, re->re_mask, &rh->rh_rnh->rh, re->re_nodes);
+    rib_write_end(rh);
+
+    if (!rn) {
+        free_route_entry(re);
+        errno = EEXIST;  /* Likely duplicate */
+        return ROUTE_EEXIST;
+    }
+    route_hosts_insert(rh, re);
+    route_compact_add(rh, re);
+    route_frozen_drop(rh);
+    rib_gen_bump(rh);
+
+    /* Update statistics */
+    counter_u64_add(rh->rh_stats.rc_adds, 1);
+    counter_u64_add(rh->rh_stats.rc_nodes, 1);
+
+    return ROUTE_OK;
+}
+
+int rib_add(struct rib_head* rh, const struct route_info* ri) {
+    return rib_add_mpath(rh, ri, NULL, 0);
+}
+
+static int bulk_entry_cmp(const void* a, const void* b) {
+    const u_char* ka = ((const struct rn_bulk_entry*)a)->rbe_key;
+    const u_char* kb = ((const struct rn_bulk_entry*)b)->rbe_key;
+
+    /* The first byte is the length, so keys of different size never tie */
+    return memcmp(ka, kb, min(*ka, *kb));
+}
+
+/* Bulk loads the radix tree of @rh, see route_table_load() */
+int rib_load(struct rib_head* rh, const struct route_info* routes, size_t count) {
+    if (count == 0) {
+        return ROUTE_OK;
+    }
+    route_compact_abort(rh);
+
+    struct rn_bulk_entry* ents = bsd_malloc(count * sizeof(*ents), M_RTABLE, M_WAITOK | M_ZERO);
+    if (!ents) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+
+    /* Set up all entries first, the tree is built at once */
+    size_t n;
+    int error = 0;
+    for (n = 0; n < count; n++) {
+        const struct route_info* ri = &routes[n];
+        if (!ri->ri_dst) {
+            error = EINVAL;
+            break;
+        }
+
+        struct route_entry* re = uma_zalloc(rib_zone(rh), M_NOWAIT | M_ZERO);
+        if (!re) {
+            error = ENOMEM;
+            break;
+        }
+        re->re_zone = rh->rh_zone;
+        re->re_dst = copy_sockaddr(ri->ri_dst, &re->re_dst_sa);
+        re->re_mask = ri->ri_netmask ? route_mask_get(ri->ri_netmask) : NULL;
+        re->re_flags = ri->ri_flags;
+        re->re_ifindex = ri->ri_ifindex;
+        re->re_fibnum = ri->ri_fibnum;
+
+        ents[n].rbe_key = re->re_dst;
+        ents[n].rbe_mask = re->re_mask;
+        ents[n].rbe_nodes = re->re_nodes;
+        if (!re->re_dst || (ri->ri_netmask && !re->re_mask) ||
+            !route_entry_set_nhop(re, ri)) {
+            n++;
+            error = ENOMEM;
+            break;
+        }
+    }
+
+    if (error == 0) {
+        qsort(ents, count, sizeof(*ents), bulk_entry_cmp);
+        rib_write_begin(rh);
+        error = rn_bulkload(&rh->rh_rnh->rh, ents, (int)count);
+        rib_write_end(rh);
+    }
+
+    if (error != 0) {
+        /* Nothing was published, entries can go right away */
+        for (size_t i = 0; i < n; i++) {
+            free_route_entry((struct route_entry*)
+                ((char*)ents[i].rbe_nodes - offsetof(struct route_entry, re_nodes[0])));
+        }
+        bsd_free(ents, M_RTABLE);
+        errno = error;
+        switch (error) {
+            case EEXIST:
+                return ROUTE_EEXIST;
+            case ENOMEM:
+                return ROUTE_ENOMEM;
+            default:
+                return ROUTE_EINVAL;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        route_hosts_insert(rh, (struct route_entry*)
+            ((char*)ents[i].rbe_nodes - offsetof(struct route_entry, re_nodes[0])));
+    }
+    bsd_free(ents, M_RTABLE);
+
+    /* Update statistics */
+    counter_u64_add(rh->rh_stats.rc_adds, count);
+    counter_u64_add(rh->rh_stats.rc_nodes, count);
+
+    return ROUTE_OK;
+}
+
+int route_table_load(struct rib_head* rh, const struct route_info* routes, size_t count) {
+    if (!rh || (!routes && count > 0) || count > INT_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (rib_busy(rh)) {
+        return ROUTE_EBUSY;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    route_frozen_drop(rh);
+
+    uint64_t start = rib_lat_start();
+    error = rib_load(rh, routes, count);
+    rib_gen_bump(rh);
+    rib_lat_record(rh, RL_REBUILD, start);
+
+    for (size_t i = 0; error == ROUTE_OK && i < count; i++) {
+        route_log_change(rh, RJ_OP_SET, &routes[i]);
+    }
+    return error;
+}
+
+#define ROUTE_LOAD_MAXTHREADS 64
+
+/* Workers of route_tables_load(), taking batches in turn */
+struct pload_ctx {
+    struct route_load_batch* batches;
+    size_t nbatches;
+    int flags;
+    _Atomic size_t next;
+};
+
+static void* route_load_worker(void* arg) {
+    struct pload_ctx* ctx = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&ctx->next, 1)) < ctx->nbatches) {
+        struct route_load_batch* b = &ctx->batches[i];
+
+        b->rlb_error = route_table_load(b->rlb_rh, b->rlb_routes, b->rlb_count);
+        if (b->rlb_error == ROUTE_OK && (ctx->flags & ROUTE_LOAD_FREEZE)) {
+            b->rlb_error = route_table_freeze(b->rlb_rh);
+        }
+    }
+    return NULL;
+}
+
+int route_tables_load(struct route_load_batch* batches, size_t nbatches,
+                      int nthreads, int flags) {
+    pthread_t threads[ROUTE_LOAD_MAXTHREADS];
+    struct pload_ctx ctx;
+    int nstarted;
+
+    if ((!batches && nbatches > 0) || nthreads < 1 || (flags & ~ROUTE_LOAD_FREEZE)) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    /* Tables are filled without locking, each by a single worker */
+    for (size_t i = 0; i < nbatches; i++) {
+        if (!batches[i].rlb_rh) {
+            errno = EINVAL;
+            return ROUTE_EINVAL;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (batches[j].rlb_rh == batches[i].rlb_rh) {
+                errno = EINVAL;
+                return ROUTE_EINVAL;
+            }
+        }
+    }
+
+    if (nthreads > ROUTE_LOAD_MAXTHREADS) {
+        nthreads = ROUTE_LOAD_MAXTHREADS;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.batches = batches;
+    ctx.nbatches = nbatches;
+    ctx.flags = flags;
+
+    /* The calling thread is one of the workers */
+    nstarted = 0;
+    for (int i = 1; i < nthreads && (size_t)i < nbatches; i++) {
+        if (pthread_create(&threads[nstarted], NULL, route_load_worker, &ctx) != 0) {
+            break;
+        }
+        nstarted++;
+    }
+    route_load_worker(&ctx);
+    for (int i = 0; i < nstarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < nbatches; i++) {
+        if (batches[i].rlb_error != ROUTE_OK) {
+            return batches[i].rlb_error;
+        }
+    }
+    return ROUTE_OK;
+}
+
+int rib_del(struct rib_head* rh, struct sockaddr* dst, struct sockaddr* netmask) {
+    if (!rh || !dst) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (rib_busy(rh)) {
+        return ROUTE_EBUSY;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    /* Find and delete from radix tree */
+    rib_write_begin(rh);
+    struct radix_node* rn = rh->rh_rnh->rnh_deladdr(dst, netmask, &rh->rh_rnh->rh);
+    rib_write_end(rh);
+
+    if (!rn) {
+        errno = ENOENT;
+        return ROUTE_ENOENT;
+    }
+
+    /* Free the route entry once datapath readers are done with it */
+    struct route_entry* re = (struct route_entry*)
+        ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+
+    route_hosts_remove(rh, re);
+    route_compact_del(rh, re);
+    route_frozen_drop(rh);
+    rib_gen_bump(rh);
+
+    NET_EPOCH_CALL(free_route_entry_epoch, &re->re_epoch_ctx);
+
+    /* Update statistics */
+    counter_u64_add(rh->rh_stats.rc_deletes, 1);
+    counter_u64_add(rh->rh_stats.rc_nodes, -1);
+
+    return ROUTE_OK;
+}
+
+int route_add(struct rib_head* rh, struct route_info* ri) {
+    uint64_t start = rib_lat_start();
+    int error = rib_add(rh, ri);
+
+    if (error == ROUTE_OK) {
+        route_log_change(rh, RJ_OP_SET, ri);
+    }
+    if (rh) {
+        rib_lat_record(rh, RL_ADD, start);
+    }
+    return error;
+}
+
+int route_add_mpath(struct rib_head* rh, const struct route_info* ri,
+                    const struct route_mpath_gw* gws, size_t count) {
+    if (!gws) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    uint64_t start = rib_lat_start();
+    int error = rib_add_mpath(rh, ri, gws, count);
+
+    if (error == ROUTE_OK) {
+        route_log_change(rh, RJ_OP_SET, ri);
+    }
+    if (rh) {
+        rib_lat_record(rh, RL_ADD, start);
+    }
+    return error;
+}
+
+int route_delete(struct rib_head* rh, struct sockaddr* dst, struct sockaddr* netmask) {
+    uint64_t start = rib_lat_start();
+    int error = rib_del(rh, dst, netmask);
+
+    if (error == ROUTE_OK) {
+        struct route_info ri = { .ri_dst = dst, .ri_netmask = netmask };
+        route_log_change(rh, RJ_OP_DEL, &ri);
+    }
+    if (rh) {
+        rib_lat_record(rh, RL_DELETE, start);
+    }
+    return error;
+}
+
+/* The network epoch for callers without the compat headers, nested by the record */
+static __thread struct epoch_tracker route_epoch_et;
+
+void route_epoch_enter(void) {
+    NET_EPOCH_ENTER(route_epoch_et);
+}
+
+void route_epoch_exit(void) {
+    NET_EPOCH_EXIT(route_epoch_et);
+}
+
+int route_lookup(struct rib_head* rh, struct sockaddr* dst, struct route_info* ri_out) {
+    if (!rh || !dst) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    counter_u64_add(rh->rh_stats.rc_lookups, 1);
+    route_init_lookup();
+
+    int sampled = rib_lat_sample();
+    uint64_t start = sampled ? rib_lat_start() : 0;
+
+    /* Repeated destinations are answered from the thread's cache */
+    struct route_lcache_ent* le = NULL;
+    struct route_snap* rs;
+    struct epoch_tracker et;
+    const uint8_t* key;
+    size_t klen;
+    struct radix_node* rn;
+    u_long gen;
+
+    /* Keeps a route deleted meanwhile by the writer from being freed */
+    NET_EPOCH_ENTER(et);
+
+    /*
+     * Only the writer settles a restored table, readers are answered from
+     * the image until then, like datapath lookups.
+     */
+    rs = atomic_load_explicit(&rh->rh_snap, memory_order_acquire);
+    if (rs) {
+        int error = snap_dp_lookup(rs, dst, ri_out);
+
+        NET_EPOCH_EXIT(et);
+        counter_u64_add(error == ROUTE_OK ? rh->rh_stats.rc_hits : rh->rh_stats.rc_misses, 1);
+        if (sampled) {
+            rib_lat_record(rh, RL_LOOKUP, start);
+        }
+        if (error != ROUTE_OK) {
+            errno = ENOENT;
+        }
+        return error;
+    }
+
+    /* Read before matching, a result racing a change is tagged stale */
+    gen = atomic_load_explicit(&rh->rh_gen, memory_order_acquire);
+    if (rh->rh_lcache) {
+        le = route_lcache_slot(rh, dst, &key, &klen);
+    }
+    if (le && le->le_table == rh->rh_id && le->le_gen == gen &&
+        le->le_len == klen && memcmp(le->le_key, key, klen) == 0) {
+        counter_u64_add(rh->rh_stats.rc_cache_hits, 1);
+        rn = le->le_re ? &le->le_re->re_nodes[0] : NULL;
+    } else {
+        /* Perform radix tree lookup */
+        rn = rib_match(rh, dst);
+        if (le) {
+            le->le_table = rh->rh_id;
+            le->le_gen = gen;
+            le->le_re = rn ? (struct route_entry*)
+                ((char*)rn - offsetof(struct route_entry, re_nodes[0])) : NULL;
+            le->le_len = (uint8_t)klen;
+            memcpy(le->le_key, key, klen);
+        }
+    }
+
+    if (!rn) {
+        NET_EPOCH_EXIT(et);
+        counter_u64_add(rh->rh_stats.rc_misses, 1);
+        if (sampled) {
+            rib_lat_record(rh, RL_LOOKUP, start);
+        }
+        errno = ENOENT;
+        return ROUTE_ENOENT;
+    }
+
+    counter_u64_add(rh->rh_stats.rc_hits, 1);
+
+    /* Extract route entry */
+    struct route_entry* re = (struct route_entry*)
+        ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+
+    rib_hit(rh, re);
+    if (ri_out) {
+        fill_route_info(re, ri_out);
+    }
+    NET_EPOCH_EXIT(et);
+    if (sampled) {
+        rib_lat_record(rh, RL_LOOKUP, start);
+    }
+
+    return ROUTE_OK;
+}
+
+static int fib_dp_lookup(int family, u_int fibnum, const struct sockaddr* dst,
+                         struct route_info* ri_out) {
+    struct route_dp* _Atomic* dp = get_family_dp(family);
+    struct epoch_tracker et;
+    struct route_dp* d;
+    int error = ROUTE_ENOENT;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    route_init_lookup();
+    NET_EPOCH_ENTER(et);
+    d = atomic_load_explicit(&dp[fibnum], memory_order_acquire);
+    if (d) {
+        error = d->f(d->arg, dst, ri_out);
+    }
+    NET_EPOCH_EXIT(et);
+
+    if (error != ROUTE_OK) {
+        errno = ENOENT;
+    }
+    return error;
+}
+
+int fib4_lookup(u_int fibnum, struct in_addr dst, uint32_t scopeid,
+                struct route_info* ri_out) {
+    struct sockaddr_in sin = {
+        .sin_len = sizeof(sin),
+        .sin_family = AF_INET,
+        .sin_addr = dst
+    };
+
+    (void)scopeid;
+    return fib_dp_lookup(AF_INET, fibnum, (struct sockaddr*)&sin, ri_out);
+}
+
+int fib6_lookup(u_int fibnum, const struct in6_addr* dst, uint32_t scopeid,
+                struct route_info* ri_out) {
+    if (!dst) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    struct sockaddr_in6 sin6 = {
+        .sin6_len = sizeof(sin6),
+        .sin6_family = AF_INET6,
+        .sin6_addr = *dst,
+        .sin6_scope_id = scopeid
+    };
+
+    return fib_dp_lookup(AF_INET6, fibnum, (struct sockaddr*)&sin6, ri_out);
+}
+
+static uint32_t fib_dp_nhidx(int family, u_int fibnum, const struct sockaddr* dst) {
+    struct route_dp* _Atomic* dp = get_family_dp(family);
+    struct epoch_tracker et;
+    struct route_dp* d;
+    uint32_t nhidx = 0;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    NET_EPOCH_ENTER(et);
+    d = atomic_load_explicit(&dp[fibnum], memory_order_acquire);
+    if (d) {
+        nhidx = d->fn(d->arg, dst);
+    }
+    NET_EPOCH_EXIT(et);
+
+    if (nhidx == 0) {
+        errno = ENOENT;
+    }
+    return nhidx;
+}
+
+uint32_t fib4_lookup_nhidx(u_int fibnum, struct in_addr dst, uint32_t scopeid) {
+    struct sockaddr_in sin = {
+        .sin_len = sizeof(sin),
+        .sin_family = AF_INET,
+        .sin_addr = dst
+    };
+
+    (void)scopeid;
+    return fib_dp_nhidx(AF_INET, fibnum, (struct sockaddr*)&sin);
+}
+
+uint32_t fib6_lookup_nhidx(u_int fibnum, const struct in6_addr* dst, uint32_t scopeid) {
+    if (!dst) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    struct sockaddr_in6 sin6 = {
+        .sin6_len = sizeof(sin6),
+        .sin6_family = AF_INET6,
+        .sin6_addr = *dst,
+        .sin6_scope_id = scopeid
+    };
+
+    return fib_dp_nhidx(AF_INET6, fibnum, (struct sockaddr*)&sin6);
+}
+
+const struct route_nhop* route_nhop_array(uint32_t* count) {
+    struct route_nhop_tab* nt = atomic_load_explicit(&route_nhop_tab, memory_order_acquire);
+
+    if (count) {
+        *count = nt ? nt->nt_size : 0;
+    }
+    return nt ? nt->nt_nhops : NULL;
+}
+
+/* Runs up to ROUTE_DP_BURST lookups through @d, misses are zeroed */
+static int fib_dp_burst(struct route_dp* d, const struct sockaddr* const* dsts,
+                        int count, struct route_info* ri_out) {
+    int hits = 0;
+
+    if (!d) {
+        memset(ri_out, 0, count * sizeof(*ri_out));
+        return 0;
+    }
+    if (d->fb) {
+        return d->fb(d->arg, dsts, count, ri_out);
+    }
+    for (int i = 0; i < count; i++) {
+        if (d->f(d->arg, dsts[i], &ri_out[i]) == ROUTE_OK) {
+            hits++;
+        } else {
+            memset(&ri_out[i], 0, sizeof(ri_out[i]));
+        }
+    }
+    return hits;
+}
+
+int fib4_lookup_burst(u_int fibnum, const struct in_addr* dsts, size_t count,
+                      struct route_info* ri_out) {
+    struct sockaddr_in sins[ROUTE_DP_BURST];
+    const struct sockaddr* keys[ROUTE_DP_BURST];
+    struct epoch_tracker et;
+    struct route_dp* d;
+    int hits = 0;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS || (count > 0 && (!dsts || !ri_out)) ||
+        count > INT_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    for (int i = 0; i < ROUTE_DP_BURST; i++) {
+        memset(&sins[i], 0, sizeof(sins[i]));
+        sins[i].sin_family = AF_INET;
+        sins[i].sin_len = sizeof(sins[i]);
+        keys[i] = (const struct sockaddr*)&sins[i];
+    }
+
+    /* One epoch section and datapath load for the whole burst */
+    NET_EPOCH_ENTER(et);
+    d = atomic_load_explicit(&route_inet_dp[fibnum], memory_order_acquire);
+    for (size_t i = 0; i < count; i += ROUTE_DP_BURST) {
+        int n = (int)min(count - i, (size_t)ROUTE_DP_BURST);
+
+        for (int j = 0; j < n; j++) {
+            sins[j].sin_addr = dsts[i + j];
+        }
+        hits += fib_dp_burst(d, keys, n, &ri_out[i]);
+    }
+    NET_EPOCH_EXIT(et);
+
+    return hits;
+}
+
+int fib6_lookup_burst(u_int fibnum, const struct in6_addr* dsts, uint32_t scopeid,
+                      size_t count, struct route_info* ri_out) {
+    struct sockaddr_in6 sins[ROUTE_DP_BURST];
+    const struct sockaddr* keys[ROUTE_DP_BURST];
+    struct epoch_tracker et;
+    struct route_dp* d;
+    int hits = 0;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS || (count > 0 && (!dsts || !ri_out)) ||
+        count > INT_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    for (int i = 0; i < ROUTE_DP_BURST; i++) {
+        memset(&sins[i], 0, sizeof(sins[i]));
+        sins[i].sin6_family = AF_INET6;
+        sins[i].sin6_len = sizeof(sins[i]);
+        sins[i].sin6_scope_id = scopeid;
+        keys[i] = (const struct sockaddr*)&sins[i];
+    }
+
+    NET_EPOCH_ENTER(et);
+    d = atomic_load_explicit(&route_inet6_dp[fibnum], memory_order_acquire);
+    for (size_t i = 0; i < count; i += ROUTE_DP_BURST) {
+        int n = (int)min(count - i, (size_t)ROUTE_DP_BURST);
+
+        for (int j = 0; j < n; j++) {
+            sins[j].sin6_addr = dsts[i + j];
+        }
+        hits += fib_dp_burst(d, keys, n, &ri_out[i]);
+    }
+    NET_EPOCH_EXIT(et);
+
+    return hits;
+}
+
+/* Runs up to ROUTE_DP_BURST nexthop lookups through @d, misses are 0 */
+static int fib_dp_nhidx_burst(struct route_dp* d, const struct sockaddr* const* dsts,
+                              const uint32_t* flowids, int count, uint32_t* nhidx_out) {
+    int hits = 0;
+
+    if (!d) {
+        memset(nhidx_out, 0, count * sizeof(*nhidx_out));
+        return 0;
+    }
+    if (d->fnb) {
+        return d->fnb(d->arg, dsts, flowids, count, nhidx_out);
+    }
+    for (int i = 0; i < count; i++) {
+        nhidx_out[i] = d->fn(d->arg, dsts[i]);
+        hits += (nhidx_out[i] != 0);
+    }
+    return hits;
+}
+
+int fib4_lookup_nhidx_burst(u_int fibnum, const struct in_addr* dsts, const uint32_t* flowids,
+                            size_t count, uint32_t* nhidx_out) {
+    struct sockaddr_in sins[ROUTE_DP_BURST];
+    const struct sockaddr* keys[ROUTE_DP_BURST];
+    struct epoch_tracker et;
+    struct route_dp* d;
+    int hits = 0;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS || (count > 0 && (!dsts || !flowids || !nhidx_out)) ||
+        count > INT_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    for (int i = 0; i < ROUTE_DP_BURST; i++) {
+        memset(&sins[i], 0, sizeof(sins[i]));
+        sins[i].sin_family = AF_INET;
+        sins[i].sin_len = sizeof(sins[i]);
+        keys[i] = (const struct sockaddr*)&sins[i];
+    }
+
+    NET_EPOCH_ENTER(et);
+    d = atomic_load_explicit(&route_inet_dp[fibnum], memory_order_acquire);
+    for (size_t i = 0; i < count; i += ROUTE_DP_BURST) {
+        int n = (int)min(count - i, (size_t)ROUTE_DP_BURST);
+
+        for (int j = 0; j < n; j++) {
+            sins[j].sin_addr = dsts[i + j];
+        }
+        hits += fib_dp_nhidx_burst(d, keys, &flowids[i], n, &nhidx_out[i]);
+    }
+    NET_EPOCH_EXIT(et);
+
+    return hits;
+}
+
+int fib6_lookup_nhidx_burst(u_int fibnum, const struct in6_addr* dsts, uint32_t scopeid,
+                            const uint32_t* flowids, size_t count, uint32_t* nhidx_out) {
+    struct sockaddr_in6 sins[ROUTE_DP_BURST];
+    const struct sockaddr* keys[ROUTE_DP_BURST];
+    struct epoch_tracker et;
+    struct route_dp* d;
+    int hits = 0;
+
+    if (fibnum >= ROUTE_DP_MAXFIBS || (count > 0 && (!dsts || !flowids || !nhidx_out)) ||
+        count > INT_MAX) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    for (int i = 0; i < ROUTE_DP_BURST; i++) {
+        memset(&sins[i], 0, sizeof(sins[i]));
+        sins[i].sin6_family = AF_INET6;
+        sins[i].sin6_len = sizeof(sins[i]);
+        sins[i].sin6_scope_id = scopeid;
+        keys[i] = (const struct sockaddr*)&sins[i];
+    }
+
+    NET_EPOCH_ENTER(et);
+    d = atomic_load_explicit(&route_inet6_dp[fibnum], memory_order_acquire);
+    for (size_t i = 0; i < count; i += ROUTE_DP_BURST) {
+        int n = (int)min(count - i, (size_t)ROUTE_DP_BURST);
+
+        for (int j = 0; j < n; j++) {
+            sins[j].sin6_addr = dsts[i + j];
+        }
+        hits += fib_dp_nhidx_burst(d, keys, &flowids[i], n, &nhidx_out[i]);
+    }
+    NET_EPOCH_EXIT(et);
+
+    return hits;
+}
+
+int route_change(struct rib_head* rh, struct route_info* ri) {
+    if (!rh || !ri || !ri->ri_dst) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    uint64_t start = rib_lat_start();
+
+    /* Delete + add, lookups in between miss the route (see route_lib.h) */
+    int result = rib_del(rh, ri->ri_dst, ri->ri_netmask);
+    int deleted = result == ROUTE_OK;
+    if (result == ROUTE_OK || result == ROUTE_ENOENT) {
+        result = rib_add(rh, ri);
+    }
+    if (result == ROUTE_OK) {
+        counter_u64_add(rh->rh_stats.rc_changes, 1);
+        route_log_change(rh, RJ_OP_SET, ri);
+    } else if (deleted) {
+        route_log_change(rh, RJ_OP_DEL, ri);
+    }
+
+    rib_lat_record(rh, RL_CHANGE, start);
+    return result;
+}
+
+static int rib_walk(struct rib_head* rh, struct walk_ctx* ctx) {
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    /* Overlays: own routes, then the base ones they do not override */
+    error = rn_walktree_batch(&rh->rh_rnh->rh, route_walk_batch_callback, ctx);
+    if (error == 0 && rh->rh_base) {
+        struct radix_node_head* bh = rh->rh_base->rh_rnh;
+
+        ctx->shadow = &rh->rh_rnh->rh;
+        rn_walktree_batch(&bh->rh, route_walk_batch_callback, ctx);
+    }
+
+    return ctx->count;
+}
+
+int route_walk(struct rib_head* rh, route_walker_f walker, void* arg) {
+    if (!rh || !walker) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    struct walk_ctx ctx = {
+        .walker = walker,
+        .arg = arg,
+        .count = 0
+    };
+
+    return rib_walk(rh, &ctx);
+}
+
+int route_table_set_hit_sampling(struct rib_head* rh, u_int rate) {
+    if (!rh || rate > ROUTE_HITS_MAXRATE) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    atomic_store_explicit(&rh->rh_hit_rate, rate, memory_order_relaxed);
+    return ROUTE_OK;
+}
+
+int route_walk_hits(struct rib_head* rh, route_hits_walker_f walker, void* arg, int flags) {
+    if (!rh || !walker || (flags & ~ROUTE_HITS_RESET)) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    struct walk_ctx ctx = {
+        .arg = arg,
+        .hwalker = walker,
+        .hreset = !!(flags & ROUTE_HITS_RESET)
+    };
+
+    return rib_walk(rh, &ctx);
+}
+
+/*
+ * Prefix queries
+ *
+ * Both go down the tree from the prefix instead of looking it up once
+ * per length: the covering routes are the leaves rn_match() backtracks
+ * through, the more specifics the subtree below the last node within the
+ * mask. Neither allocates.
+ */
+#define ROUTE_COVER_MAX    130  /* One route per length and a host route */
+
+struct cover_ctx {
+    struct radix_node* rns[ROUTE_COVER_MAX];
+    int count;
+    int plen;                   /* Of the query, longer routes are skipped */
+    int family;
+    struct radix_head* shadow;  /* Routes also found there are skipped */
+};
+
+static int route_cover_callback(struct radix_node* rn, void* arg) {
+    struct cover_ctx* ctx = (struct cover_ctx*)arg;
+
+    if (rib_plen(rn, ctx->family) > ctx->plen ||
+        (ctx->shadow && rn_lookup(rn->rn_key, rn->rn_mask, ctx->shadow))) {
+        return 0;
+    }
+    if (ctx->count < ROUTE_COVER_MAX) {
+        ctx->rns[ctx->count++] = rn;
+    }
+    return 0;
+}
+
+/* Copies @dst to @key with the bits outside of @netmask cleared */
+static int route_prefix_key(struct rib_head* rh, const struct sockaddr* dst,
+                            const struct sockaddr* netmask, struct sockaddr_storage* key) {
+    int off = rib_key_offset(rh->rh_family) >> 3;
+
+    if (dst->sa_family != rh->rh_family || dst->sa_len > sizeof(*key) ||
+        dst->sa_len <= off) {
+        return ROUTE_EINVAL;
+    }
+    memcpy(key, dst, dst->sa_len);
+    if (netmask) {
+        const u_char* m = (const u_char*)netmask;
+        u_char* k = (u_char*)key;
+
+        for (int i = off; i < dst->sa_len; i++) {
+            k[i] &= i < netmask->sa_len ? m[i] : 0;
+        }
+    }
+    return ROUTE_OK;
+}
+
+int route_lookup_covering(struct rib_head* rh, struct sockaddr* dst, struct sockaddr* netmask,
+                          route_walker_f walker, void* arg) {
+    struct sockaddr_storage key;
+    struct cover_ctx ctx;
+    struct route_info ri;
+
+    if (!rh || !dst || !walker || route_prefix_key(rh, dst, netmask, &key) != ROUTE_OK) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    ctx.count = 0;
+    ctx.family = rh->rh_family;
+    ctx.plen = rib_mask_plen((const u_char*)netmask, rh->rh_family);
+    ctx.shadow = NULL;
+    rn_match_all(&key, &rh->rh_rnh->rh, route_cover_callback, &ctx);
+    if (rh->rh_base) {
+        ctx.shadow = &rh->rh_rnh->rh;
+        rn_match_all(&key, &rh->rh_base->rh_rnh->rh, route_cover_callback, &ctx);
+    }
+
+    /* Most specific first; there is at most one route per length */
+    for (int i = 1; i < ctx.count; i++) {
+        struct radix_node* rn = ctx.rns[i];
+        int plen = rib_plen(rn, ctx.family), j;
+
+        for (j = i; j > 0 && rib_plen(ctx.rns[j - 1], ctx.family) < plen; j--) {
+            ctx.rns[j] = ctx.rns[j - 1];
+        }
+        ctx.rns[j] = rn;
+    }
+
+    for (int i = 0; i < ctx.count; i++) {
+        fill_route_info((struct route_entry*)
+            ((char*)ctx.rns[i] - offsetof(struct route_entry, re_nodes[0])), &ri);
+        if (walker(&ri, arg)) {
+            return i + 1;
+        }
+    }
+    return ctx.count;
+}
+
+int route_walk_more_specific(struct rib_head* rh, struct sockaddr* dst,
+                             struct sockaddr* netmask, route_walker_f walker, void* arg) {
+    struct sockaddr_storage key;
+
+    if (!rh || !dst || !walker || route_prefix_key(rh, dst, netmask, &key) != ROUTE_OK) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    struct walk_ctx ctx = {
+        .walker = walker,
+        .arg = arg,
+        .count = 0
+    };
+
+    /* Overlays: own routes, then the base ones they do not override */
+    error = rn_walk_subtree(&rh->rh_rnh->rh, &key, netmask, route_walk_callback, &ctx);
+    if (error == 0 && rh->rh_base) {
+        ctx.shadow = &rh->rh_rnh->rh;
+        rn_walk_subtree(&rh->rh_base->rh_rnh->rh, &key, netmask, route_walk_callback, &ctx);
+    }
+
+    return ctx.count;
+}
+
+/*
+ * Cursors
+ *
+ * A cursor keeps the leaf to resume from while the table is unchanged
+ * and the key and mask of the last route it returned. Once the table
+ * generation moves the leaf may be gone, so the walk seeks back to the
+ * first route after the saved one: routes left untouched by the changes
+ * are returned exactly once and in order.
+ */
+struct route_cursor {
+    struct rib_head* rc_rh;
+    u_long rc_gen;                /* Table generation rc_next is valid for */
+    struct radix_node* rc_next;   /* Next leaf, NULL when done */
+    int rc_started;
+    int rc_done;
+    int rc_has_mask;
+    union route_sa rc_key;        /* Last route returned */
+    union route_sa rc_mask;
+};
+
+struct route_cursor* route_cursor_create(struct rib_head* rh) {
+    struct route_cursor* rc;
+
+    if (!rh) {
+        errno = EINVAL;
+        return NULL;
+    }
+    rc = bsd_malloc(sizeof(*rc), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!rc) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    rc->rc_rh = rh;
+    return rc;
+}
+
+void route_cursor_destroy(struct route_cursor* rc) {
+    bsd_free(rc, M_RTABLE);
+}
+
+int route_cursor_next(struct route_cursor* rc, route_walker_f walker, void* arg, int limit) {
+    struct rib_head* rh;
+    struct radix_node* rn;
+    struct route_entry* re;
+    struct route_info ri;
+    int count = 0, error;
+
+    if (!rc || !walker || limit <= 0) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (rc->rc_done) {
+        return 0;
+    }
+
+    rh = rc->rc_rh;
+    error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    if (!rc->rc_started) {
+        rn = rn_seek_after(NULL, NULL, &rh->rh_rnh->rh);
+        rc->rc_started = 1;
+    } else if (rc->rc_gen == rib_gen(rh)) {
+        rn = rc->rc_next;
+    } else {
+        rn = rn_seek_after(&rc->rc_key, rc->rc_has_mask ? &rc->rc_mask : NULL,
+                           &rh->rh_rnh->rh);
+    }
+
+    for (; rn != NULL && count < limit; count++) {
+        re = (struct route_entry*)((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+        rn = rn_next_leaf(rn);
+
+        memcpy(&rc->rc_key, re->re_dst, min(re->re_dst->sa_len, sizeof(rc->rc_key)));
+        rc->rc_has_mask = re->re_mask != NULL;
+        if (re->re_mask) {
+            memcpy(&rc->rc_mask, re->re_mask, min(re->re_mask->sa_len, sizeof(rc->rc_mask)));
+        }
+
+        fill_route_info(re, &ri);
+        if (walker(&ri, arg) != 0) {
+            count++;
+            break;
+        }
+    }
+
+    rc->rc_next = rn;
+    rc->rc_gen = rib_gen(rh);
+    if (rn == NULL) {
+        rc->rc_done = 1;
+    }
+    return count;
+}
+
+/*
+ * Parallel walks
+ *
+ * The tree is split into subtrees by expanding internal nodes from the
+ * top until there are enough partitions for the workers, keeping the
+ * partitions in key order. Workers pick partitions from a shared index
+ * so a skewed tree still keeps all of them busy. Ordered walks let the
+ * workers collect routes per partition and emit them from the calling
+ * thread in partition order.
+ */
+#define ROUTE_WALK_PARTS_PER_THREAD 8
+#define ROUTE_WALK_MAXPARTS 1024
+#define ROUTE_WALK_MAXTHREADS 64
+
+struct walk_part {
+    struct radix_node* wp_rn;       /* Subtree root */
+    struct route_info* wp_routes;   /* Collected routes, ordered walks */
+    size_t wp_count;
+    size_t wp_size;
+    int wp_error;
+};
+
+struct pwalk_ctx {
+    struct walk_part* parts;
+    int nparts;
+    int flags;
+    route_walker_f walker;
+    void* arg;
+    _Atomic int next;               /* Next partition to pick */
+    _Atomic int stop;               /* Walker asked to stop */
+    _Atomic int count;
+};
+
+/* Replaces internal nodes in @parts by their children until there are @want */
+static int route_walk_partition(struct radix_node* top, struct radix_node** parts, int want) {
+    int nparts = 1, expanded = 1;
+
+    parts[0] = top;
+    while (nparts < want && expanded) {
+        expanded = 0;
+        for (int i = 0; i < nparts && nparts < want; i++) {
+            struct radix_node* rn = parts[i];
+
+            if (rn->rn_bit < 0) {
+                continue;
+            }
+            memmove(&parts[i + 2], &parts[i + 1], (nparts - i - 1) * sizeof(parts[0]));
+            parts[i] = rn->rn_left;
+            parts[i + 1] = rn->rn_right;
+            nparts++;
+            i++;
+            expanded = 1;
+        }
+    }
+    return nparts;
+}
+
+static int route_walk_part_add(struct walk_part* wp, const struct route_entry* re) {
+    if (wp->wp_count == wp->wp_size) {
+        size_t size = wp->wp_size ? wp->wp_size * 2 : 64;
+        struct route_info* routes = bsd_malloc(size * sizeof(*routes), M_RTABLE, M_NOWAIT);
+
+        if (!routes) {
+            return ROUTE_ENOMEM;
+        }
+        if (wp->wp_routes) {
+            memcpy(routes, wp->wp_routes, wp->wp_count * sizeof(*routes));
+            bsd_free(wp->wp_routes, M_RTABLE);
+        }
+        wp->wp_routes = routes;
+        wp->wp_size = size;
+    }
+    fill_route_info(re, &wp->wp_routes[wp->wp_count++]);
+    return ROUTE_OK;
+}
+
+/* In-order walk over the leaves of the subtree @rn, as rn_walktree() */
+static int route_walk_subtree(struct pwalk_ctx* ctx, struct walk_part* wp,
+                              struct radix_node* rn) {
+    if (atomic_load_explicit(&ctx->stop, memory_order_relaxed)) {
+        return 1;
+    }
+    if (rn->rn_bit >= 0) {
+        if (route_walk_subtree(ctx, wp, rn->rn_left) != 0) {
+            return 1;
+        }
+        return route_walk_subtree(ctx, wp, rn->rn_right);
+    }
+    for (; rn != NULL; rn = rn->rn_dupedkey) {
+        struct route_entry* re;
+        struct route_info ri;
+
+        if (rn->rn_flags & RNF_ROOT) {
+            continue;
+        }
+        re = (struct route_entry*)((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+        if (ctx->flags & ROUTE_WALK_ORDERED) {
+            wp->wp_error = route_walk_part_add(wp, re);
+            if (wp->wp_error != ROUTE_OK) {
+                atomic_store(&ctx->stop, 1);
+                return 1;
+            }
+            continue;
+        }
+        fill_route_info(re, &ri);
+        atomic_fetch_add_explicit(&ctx->count, 1, memory_order_relaxed);
+        if (ctx->walker(&ri, ctx->arg) != 0) {
+            atomic_store(&ctx->stop, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* route_walk_worker(void* arg) {
+    struct pwalk_ctx* ctx = arg;
+    int i;
+
+    while ((i = atomic_fetch_add(&ctx->next, 1)) < ctx->nparts) {
+        if (route_walk_subtree(ctx, &ctx->parts[i], ctx->parts[i].wp_rn) != 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int route_walk_parallel(struct rib_head* rh, route_walker_f walker, void* arg,
+                        int nthreads, int flags) {
+    struct radix_node* roots[ROUTE_WALK_MAXPARTS];
+    pthread_t threads[ROUTE_WALK_MAXTHREADS];
+    struct pwalk_ctx ctx;
+    int error, nstarted, want;
+
+    if (!rh || !walker || nthreads < 1 || (flags & ~ROUTE_WALK_ORDERED)) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    if (nthreads > ROUTE_WALK_MAXTHREADS) {
+        nthreads = ROUTE_WALK_MAXTHREADS;
+    }
+    want = nthreads * ROUTE_WALK_PARTS_PER_THREAD;
+    if (want > ROUTE_WALK_MAXPARTS) {
+        want = ROUTE_WALK_MAXPARTS;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.nparts = route_walk_partition(rh->rh_rnh->rh.rnh_treetop, roots, want);
+    ctx.parts = bsd_malloc(ctx.nparts * sizeof(*ctx.parts), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!ctx.parts) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    for (int i = 0; i < ctx.nparts; i++) {
+        ctx.parts[i].wp_rn = roots[i];
+    }
+    ctx.flags = flags;
+    ctx.walker = walker;
+    ctx.arg = arg;
+
+    /* The calling thread is one of the workers */
+    nstarted = 0;
+    for (int i = 1; i < nthreads && i < ctx.nparts; i++) {
+        if (pthread_create(&threads[nstarted], NULL, route_walk_worker, &ctx) != 0) {
+            break;
+        }
+        nstarted++;
+    }
+    route_walk_worker(&ctx);
+    for (int i = 0; i < nstarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    error = ROUTE_OK;
+    for (int i = 0; i < ctx.nparts; i++) {
+        struct walk_part* wp = &ctx.parts[i];
+
+        if (wp->wp_error != ROUTE_OK) {
+            error = wp->wp_error;
+        }
+        for (size_t j = 0; error == ROUTE_OK && j < wp->wp_count; j++) {
+            ctx.count++;
+            if (walker(&wp->wp_routes[j], arg) != 0) {
+                error = 1;
+            }
+        }
+        if (wp->wp_routes) {
+            bsd_free(wp->wp_routes, M_RTABLE);
+        }
+    }
+    bsd_free(ctx.parts, M_RTABLE);
+
+    if (error < 0) {
+        errno = ENOMEM;
+        return error;
+    }
+    return ctx.count;
+}
+
+/*
+ * Frozen datapath
+ *
+ * The datapath runs on a compact copy of the tree until the next change,
+ * which drops the copy before it can point to a deleted route and sends
+ * lookups back to the tree. The current copy is also what tells whether
+ * the table changed since the last freeze.
+ */
+static void route_frozen_free_epoch(epoch_context_t ctx) {
+    struct route_frozen* rz = __containerof(ctx, struct route_frozen, rz_ctx);
+
+    for (int i = 0; i < rz->rz_nrf; i++) {
+        rn_frozen_free(rz->rz_rf[i]);
+    }
+    bsd_free(rz, M_RTABLE);
+}
+
+static void route_frozen_drop(struct rib_head* rh) {
+    struct route_frozen* rz;
+
+    if (atomic_load_explicit(&rh->rh_frozen, memory_order_relaxed) == NULL) {
+        return;
+    }
+    rz = atomic_exchange_explicit(&rh->rh_frozen, NULL, memory_order_acq_rel);
+    if (rz) {
+        NET_EPOCH_CALL(route_frozen_free_epoch, &rz->rz_ctx);
+    }
+}
+
+/* Builds one replica of the frozen copy, on a CPU of its node if any */
+struct route_frozen_bld {
+    struct rib_head* rh;
+    int off;
+    int node;
+    struct rn_frozen* rf;
+    int error;
+};
+
+static void* route_frozen_build(void* arg) {
+    struct route_frozen_bld* b = arg;
+    struct rib_head* rh = b->rh;
+
+#if defined(__linux__)
+    /* Memory goes to the node of the first thread touching it */
+    if (b->node >= 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(route_numa_cpus[b->node]),
+                               &route_numa_cpus[b->node]);
+    }
+#endif
+    if (rh->rh_base) {
+        /* Overlays are compiled with the base into a single copy */
+        b->error = rn_freeze_overlay(&rh->rh_rnh->rh, &rh->rh_base->rh_rnh->rh,
+                                     b->off, &b->rf);
+    } else {
+        b->error = rn_freeze(&rh->rh_rnh->rh, b->off, &b->rf);
+    }
+    return NULL;
+}
+
+int route_table_set_numa(struct rib_head* rh, int enable) {
+    if (!rh) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    pthread_once(&route_numa_once, route_numa_init);
+    if (rh->rh_numa != !!enable) {
+        rh->rh_numa = !!enable;
+        route_frozen_drop(rh);
+    }
+    return ROUTE_OK;
+}
+
+int route_table_freeze(struct rib_head* rh) {
+    struct route_frozen_bld bld[ROUTE_NUMA_MAXNODES];
+    pthread_t threads[ROUTE_NUMA_MAXNODES];
+    int started[ROUTE_NUMA_MAXNODES];
+    struct route_frozen* rz;
+    size_t off, len;
+    int error, nrf;
+
+    if (!rh) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+    if (atomic_load_explicit(&rh->rh_frozen, memory_order_relaxed) != NULL) {
+        return ROUTE_OK;
+    }
+    if (route_snap_addr(rh->rh_family, &off, &len) != 0) {
+        errno = EAFNOSUPPORT;
+        return ROUTE_ENOTSUPP;
+    }
+
+    rz = bsd_malloc(sizeof(*rz), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!rz) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+
+    /* Replicas are built concurrently, one thread per node */
+    nrf = rh->rh_numa ? route_numa_nodes : 1;
+    memset(bld, 0, sizeof(bld));
+    uint64_t start = rib_lat_start();
+    for (int i = 0; i < nrf; i++) {
+        bld[i].rh = rh;
+        bld[i].off = (int)off;
+        bld[i].node = i;
+        started[i] = nrf > 1 &&
+            pthread_create(&threads[i], NULL, route_frozen_build, &bld[i]) == 0;
+        if (!started[i]) {
+            bld[i].node = -1;
+            route_frozen_build(&bld[i]);
+        }
+    }
+    error = 0;
+    for (int i = 0; i < nrf; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (bld[i].error != 0) {
+            error = bld[i].error;
+        }
+        rz->rz_rf[i] = bld[i].rf;
+    }
+    rz->rz_nrf = nrf;
+    rib_lat_record(rh, RL_REBUILD, start);
+    if (error != 0) {
+        for (int i = 0; i < nrf; i++) {
+            rn_frozen_free(rz->rz_rf[i]);
+        }
+        bsd_free(rz, M_RTABLE);
+        errno = error;
+        return (error == ENOMEM) ? ROUTE_ENOMEM : ROUTE_EINVAL;
+    }
+
+    atomic_store_explicit(&rh->rh_frozen, rz, memory_order_release);
+    return ROUTE_OK;
+}
+
+struct radix_node_head* radix_node_head_create(void) {
+    struct radix_node_head* rnh = NULL;
+
+    if (rn_inithead((void**)&rnh, 0) != 1) {
+        return NULL;
+    }
+
+    return rnh;
 }
 
-static void free_sockaddr(struct sockaddr* sa) {
-    if (sa) {
-        bsd_free(sa, M_RTABLE);
+void radix_node_head_destroy(struct radix_node_head* rnh) {
+    if (rnh) {
+        rn_detachhead((void**)&rnh);
     }
 }
 
-/* Tree walk callback for route_walk */
-struct walk_ctx {
-    route_walker_f walker;
-    void* arg;
-    int count;
-};
-
-static int route_walk_callback(struct radix_node* rn, void* arg) {
-    struct walk_ctx* ctx = (struct walk_ctx*)arg;
+int route_get_stats(struct rib_head* rh, struct route_stats* stats) {
+    if (!rh || !stats) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
 
-    /* Skip internal nodes - only process leaves with route entries */
-    if (!(rn->rn_flags & RNF_ROOT) && rn->rn_key) {
-        struct route_entry* re = (struct route_entry*)
-            ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+    stats->rs_lookups = counter_u64_fetch(rh->rh_stats.rc_lookups);
+    stats->rs_hits = counter_u64_fetch(rh->rh_stats.rc_hits);
+    stats->rs_misses = counter_u64_fetch(rh->rh_stats.rc_misses);
+    stats->rs_adds = counter_u64_fetch(rh->rh_stats.rc_adds);
+    stats->rs_deletes = counter_u64_fetch(rh->rh_stats.rc_deletes);
+    stats->rs_changes = counter_u64_fetch(rh->rh_stats.rc_changes);
+    stats->rs_nodes = counter_u64_fetch(rh->rh_stats.rc_nodes);
+    stats->rs_cache_hits = counter_u64_fetch(rh->rh_stats.rc_cache_hits);
+    stats->rs_flushes = counter_u64_fetch(rh->rh_stats.rc_flushes);
+    stats->rs_compactions = counter_u64_fetch(rh->rh_stats.rc_compactions);
+    return ROUTE_OK;
+}
 
-        struct route_info ri = {
-            .ri_dst = re->re_dst,
-            .ri_netmask = re->re_mask,
-            .ri_gateway = re->re_gateway,
-            .ri_flags = re->re_flags,
-            .ri_ifindex = re->re_ifindex,
-            .ri_fibnum = re->re_fibnum
-        };
+int route_get_stats_ext(struct rib_head* rh, struct route_stats_ext* stats) {
+    struct route_latency lat[RL_NTYPES];
 
-        ctx->count++;
-        return ctx->walker(&ri, ctx->arg);
+    if (!rh || !stats) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
     }
-    return 0;
-}
 
-/* API Implementation */
+    route_get_stats(rh, &stats->rse_stats);
+    rib_lat_fetch(rh, lat);
+    stats->rse_add = lat[RL_ADD];
+    stats->rse_delete = lat[RL_DELETE];
+    stats->rse_change = lat[RL_CHANGE];
+    stats->rse_lookup = lat[RL_LOOKUP];
+    stats->rse_rebuild = lat[RL_REBUILD];
+    stats->rse_reclaim_pending = epoch_pending(net_epoch_preempt);
+    stats->rse_reclaim_bytes = epoch_pending_bytes(net_epoch_preempt);
+    return ROUTE_OK;
+}
 
-int route_lib_init(void) {
-    if (g_route_lib_initialized) {
-        return ROUTE_OK;
+/* Upper bound of the bucket holding the @pct percentile, capped by the maximum */
+uint64_t route_latency_percentile(const struct route_latency* rl, double pct) {
+    if (!rl || rl->rl_count == 0) {
+        return 0;
     }
 
-    /* Initialize compatibility layer */
-    kernel_compat_init();
+    uint64_t rank = (uint64_t)(rl->rl_count * (pct / 100.0) + 0.5);
+    uint64_t seen = 0;
 
-    g_route_lib_initialized = 1;
-    return ROUTE_OK;
+    rank = max(rank, (uint64_t)1);
+    for (int b = 0; b < ROUTE_LAT_BUCKETS - 1; b++) {
+        seen += rl->rl_buckets[b];
+        if (seen >= rank) {
+            return min((2ULL << b) - 1, rl->rl_max_ns);
+        }
+    }
+    return rl->rl_max_ns;
 }
 
-void route_lib_cleanup(void) {
-    if (g_route_lib_initialized) {
-        g_route_lib_initialized = 0;
+void route_print_table(struct rib_head* rh) {
+    if (!rh) return;
+
+    struct route_stats_ext ext;
+    route_get_stats_ext(rh, &ext);
+    struct route_stats st = ext.rse_stats;
+
+    printf("Route Table (Family: %d, FIB: %u):\n", rh->rh_family, rh->rh_fibnum);
+    printf("Statistics:\n");
+    printf("  Nodes: %lu\n", st.rs_nodes);
+    printf("  Lookups: %lu (hits: %lu, misses: %lu, cached: %lu)\n",
+           st.rs_lookups, st.rs_hits, st.rs_misses, st.rs_cache_hits);
+    printf("  Operations: %lu adds, %lu deletes, %lu changes\n",
+           st.rs_adds, st.rs_deletes, st.rs_changes);
+
+    const struct {
+        const char* name;
+        const struct route_latency* rl;
+    } lat[] = {
+        { "add", &ext.rse_add },
+        { "delete", &ext.rse_delete },
+        { "change", &ext.rse_change },
+        { "lookup", &ext.rse_lookup },
+        { "rebuild", &ext.rse_rebuild },
+    };
+    printf("Latency (ns, p50/p99/p99.9/max):\n");
+    for (size_t i = 0; i < sizeof(lat) / sizeof(lat[0]); i++) {
+        if (lat[i].rl->rl_count == 0) {
+            continue;
+        }
+        printf("  %-8s %llu/%llu/%llu/%llu (%llu timed)\n", lat[i].name,
+               (unsigned long long)route_latency_percentile(lat[i].rl, 50.0),
+               (unsigned long long)route_latency_percentile(lat[i].rl, 99.0),
+               (unsigned long long)route_latency_percentile(lat[i].rl, 99.9),
+               (unsigned long long)lat[i].rl->rl_max_ns,
+               (unsigned long long)lat[i].rl->rl_count);
     }
+    printf("  Reclaim backlog: %llu (%llu bytes)\n",
+           (unsigned long long)ext.rse_reclaim_pending,
+           (unsigned long long)ext.rse_reclaim_bytes);
 }
 
-struct rib_head* route_table_create(int family, u_int fibnum) {
-    if (!g_route_lib_initialized) {
+int route_validate_table(struct rib_head* rh) {
+    if (!rh) {
         errno = EINVAL;
-        return NULL;
+        return ROUTE_EINVAL;
     }
 
-    struct rib_head* rh = bsd_malloc(sizeof(*rh), M_RTABLE, M_WAITOK | M_ZERO);
-    if (!rh) {
-        errno = ENOMEM;
-        return NULL;
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
     }
 
-    /* Initialize radix tree based on address family */
-    int offset;
-    switch (family) {
-        case AF_INET:
-            offset = offsetof(struct sockaddr_in, sin_addr);
-            break;
-        case AF_INET6:
-            offset = offsetof(struct sockaddr_in6, sin6_addr);
-            break;
-        default:
-            offset = 0;  /* Default offset */
-            break;
+    if (rn_check(&rh->rh_rnh->rh) != 0) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
     }
+    return ROUTE_OK;
+}
 
-    if (rn_inithead((void**)&rh->rh_rnh, offset) != 1) {
-        bsd_free(rh, M_RTABLE);
+/*
+ * Incremental validation
+ *
+ * A validator resumes where its previous step stopped while the table
+ * is unchanged. After a change it seeks past the last leaf it checked,
+ * the way cursors do: nodes changed behind it are left to the next pass.
+ */
+struct route_validator {
+    struct rib_head* rv_rh;
+    u_long rv_gen;                /* Table generation rv_next is valid for */
+    struct radix_node* rv_next;   /* Leaf to resume from */
+    int rv_started;
+    int rv_done;
+    int rv_has_key;
+    int rv_has_mask;
+    union route_sa rv_key;        /* Last route checked */
+    union route_sa rv_mask;
+};
+
+struct route_validator* route_validator_create(struct rib_head* rh) {
+    struct route_validator* rv;
+
+    if (!rh) {
+        errno = EINVAL;
+        return NULL;
+    }
+    rv = bsd_malloc(sizeof(*rv), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!rv) {
         errno = ENOMEM;
         return NULL;
     }
+    rv->rv_rh = rh;
+    return rv;
+}
 
-    rh->rh_family = family;
-    rh->rh_fibnum = fibnum;
-    memset(&rh->rh_stats, 0, sizeof(rh->rh_stats));
-
-    return rh;
+void route_validator_destroy(struct route_validator* rv) {
+    bsd_free(rv, M_RTABLE);
 }
 
-void route_table_destroy(struct rib_head* rh) {
-    if (!rh) return;
+/* Saves the last route checked before leaf @next, the widest of its chain */
+static void route_validator_save(struct route_validator* rv, struct radix_node* next) {
+    struct radix_node *rn = next, *last = NULL;
 
-    /* TODO: Walk tree and free all route entries first */
-    if (rh->rh_rnh) {
-        rn_detachhead((void**)&rh->rh_rnh);
+    /* Rightmost leaf of the left subtree of the node checked last */
+    while (rn->rn_parent->rn_left == rn) {
+        rn = rn->rn_parent;
+    }
+    for (rn = rn->rn_parent->rn_left; rn->rn_bit >= 0;) {
+        rn = rn->rn_right;
+    }
+    for (; rn != NULL; rn = rn->rn_dupedkey) {
+        if (!(rn->rn_flags & RNF_ROOT)) {
+            last = rn;
+        }
     }
 
-    bsd_free(rh, M_RTABLE);
+    rv->rv_has_key = last != NULL;
+    if (!last) {
+        return;
+    }
+    memcpy(&rv->rv_key, last->rn_key,
+           min((size_t)*(const u_char*)last->rn_key, sizeof(rv->rv_key)));
+    rv->rv_has_mask = last->rn_mask != NULL;
+    if (last->rn_mask) {
+        memcpy(&rv->rv_mask, last->rn_mask,
+               min((size_t)*(const u_char*)last->rn_mask, sizeof(rv->rv_mask)));
+    }
 }
 
-int route_add(struct rib_head* rh, struct route_info* ri) {
-    if (!rh || !ri || !ri->ri_dst) {
+int route_validate_step(struct route_validator* rv, int limit) {
+    struct rib_head* rh;
+    struct radix_node* rn;
+    int count = limit, error;
+
+    if (!rv || limit <= 0) {
         errno = EINVAL;
         return ROUTE_EINVAL;
     }
-
-    /* Allocate route entry */
-    struct route_entry* re = bsd_malloc(sizeof(*re), M_RTABLE, M_WAITOK | M_ZERO);
-    if (!re) {
-        errno = ENOMEM;
-        return ROUTE_ENOMEM;
+    if (rv->rv_done) {
+        rv->rv_done = 0;
+        rv->rv_started = 0;
+        return 0;
     }
 
-    /* Copy addresses to heap (FreeBSD radix stores pointers) */
-    re->re_dst = copy_sockaddr(ri->ri_dst);
-    re->re_mask = copy_sockaddr(ri->ri_netmask);
-    re->re_gateway = copy_sockaddr(ri->ri_gateway);
-    re->re_flags = ri->ri_flags;
-    re->re_ifindex = ri->ri_ifindex;
-    re->re_fibnum = ri->ri_fibnum;
+    rh = rv->rv_rh;
+    error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
 
-    if (!re->re_dst) {
-        free_sockaddr(re->re_mask);
-        free_sockaddr(re->re_gateway);
-        bsd_free(re, M_RTABLE);
-        errno = ENOMEM;
-        return ROUTE_ENOMEM;
+    if (!rv->rv_started) {
+        rn = NULL;
+        rv->rv_started = 1;
+    } else if (rv->rv_gen == rib_gen(rh)) {
+        rn = rv->rv_next;
+    } else {
+        rn = rn_seek_after(rv->rv_has_key ? &rv->rv_key : NULL,
+                           rv->rv_has_mask ? &rv->rv_mask : NULL, &rh->rh_rnh->rh);
+        if (!rn) {
+            rv->rv_started = 0;  /* Nothing left past the last leaf */
+            return 0;
+        }
+        /* Duplicated keys are linked back to the chain head via rn_parent */
+        while (rn->rn_parent->rn_bit < 0) {
+            rn = rn->rn_parent;
+        }
     }
 
-    /* Add to radix tree */
-    struct radix_node* rn = rh->rh_rnh->rnh_addaddr(
-        re->re_dst, re->re_mask, &rh->rh_rnh->rh, re->re_nodes);
+    if (rn_check_range(&rh->rh_rnh->rh, &rn, &count) != 0) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
 
-    if (!rn) {
-        free_sockaddr(re->re_dst);
-        free_sockaddr(re->re_mask);
-        free_sockaddr(re->re_gateway);
-        bsd_free(re, M_RTABLE);
-        errno = EEXIST;  /* Likely duplicate */
-        return ROUTE_EEXIST;
+    if (rn) {
+        route_validator_save(rv, rn);
+    } else {
+        rv->rv_done = 1;
     }
+    rv->rv_next = rn;
+    rv->rv_gen = rib_gen(rh);
+    return count;
+}
 
-    /* Update statistics */
-    rh->rh_stats.rs_adds++;
-    rh->rh_stats.rs_nodes++;
+/*
+ * Sharded tables
+ *
+ * Shards and the top table are plain tables left off the datapath index;
+ * the sharded table takes their slot with a lookup function of its own.
+ * A route goes to a shard when its mask covers the shard bits, so any
+ * shard match is longer than a top one.
+ */
+struct route_shard {
+    struct rib_head* rsh_rh;
+    pthread_mutex_t rsh_lock;     /* Writers of the shard */
+} __attribute__((aligned(COUNTER_CACHE_LINE)));
 
-    return ROUTE_OK;
-}
+struct route_sharded {
+    int rs_family;
+    u_int rs_fibnum;
+    int rs_bits;
+    size_t rs_off;                /* Address within the keys */
+    struct route_dp rs_dp;
+    struct route_shard rs_top;    /* Prefixes shorter than rs_bits */
+    struct route_shard* rs_shards; /* 2^rs_bits */
+};
 
-int route_delete(struct rib_head* rh, struct sockaddr* dst, struct sockaddr* netmask) {
-    if (!rh || !dst) {
-        errno = EINVAL;
-        return ROUTE_EINVAL;
+/* Shard of the address of @sa, NULL if @sa is too short to have one */
+static struct route_shard* route_sharded_slot(struct route_sharded* rs,
+                                              const struct sockaddr* sa) {
+    if (sa->sa_len <= rs->rs_off) {
+        return NULL;
     }
+    return &rs->rs_shards[((const uint8_t*)sa)[rs->rs_off] >> (8 - rs->rs_bits)];
+}
 
-    /* Find and delete from radix tree */
-    struct radix_node* rn = rh->rh_rnh->rnh_deladdr(dst, netmask, &rh->rh_rnh->rh);
+/* Shard a route of @dst and @mask goes to */
+static struct route_shard* route_sharded_pick(struct route_sharded* rs,
+                                              const struct sockaddr* dst,
+                                              const struct sockaddr* mask) {
+    uint8_t top = (uint8_t)(0xff << (8 - rs->rs_bits));
 
-    if (!rn) {
-        errno = ENOENT;
-        return ROUTE_ENOENT;
+    if (mask && (mask->sa_len <= rs->rs_off ||
+                 (((const uint8_t*)mask)[rs->rs_off] & top) != top)) {
+        return &rs->rs_top;
     }
+    return route_sharded_slot(rs, dst);
+}
 
-    /* Free the route entry */
-    struct route_entry* re = (struct route_entry*)
-        ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+static int sharded_dp_lookup(void* arg, const struct sockaddr* dst, struct route_info* ri_out) {
+    struct route_sharded* rs = arg;
+    struct route_shard* sh = route_sharded_slot(rs, dst);
+    struct rib_head* rh;
 
-    free_sockaddr(re->re_dst);
-    free_sockaddr(re->re_mask);
-    free_sockaddr(re->re_gateway);
-    bsd_free(re, M_RTABLE);
+    if (sh) {
+        rh = sh->rsh_rh;
+        if (rh->rh_dp.f(rh->rh_dp.arg, dst, ri_out) == ROUTE_OK) {
+            return ROUTE_OK;
+        }
+    }
+    rh = rs->rs_top.rsh_rh;
+    return rh->rh_dp.f(rh->rh_dp.arg, dst, ri_out);
+}
 
-    /* Update statistics */
-    rh->rh_stats.rs_deletes++;
-    rh->rh_stats.rs_nodes--;
+static uint32_t sharded_dp_nhidx(void* arg, const struct sockaddr* dst) {
+    struct route_sharded* rs = arg;
+    struct route_shard* sh = route_sharded_slot(rs, dst);
+    struct rib_head* rh;
+    uint32_t nhidx;
 
-    return ROUTE_OK;
+    if (sh) {
+        rh = sh->rsh_rh;
+        if ((nhidx = rh->rh_dp.fn(rh->rh_dp.arg, dst)) != 0) {
+            return nhidx;
+        }
+    }
+    rh = rs->rs_top.rsh_rh;
+    return rh->rh_dp.fn(rh->rh_dp.arg, dst);
 }
 
-int route_lookup(struct rib_head* rh, struct sockaddr* dst, struct route_info* ri_out) {
-    if (!rh || !dst) {
-        errno = EINVAL;
-        return ROUTE_EINVAL;
+static int route_shard_init(struct route_shard* sh, int family, u_int fibnum) {
+    sh->rsh_rh = rib_create(family, fibnum, NULL, 0);
+    if (!sh->rsh_rh) {
+        return 0;
     }
+    pthread_mutex_init(&sh->rsh_lock, NULL);
+    return 1;
+}
 
-    rh->rh_stats.rs_lookups++;
+static void route_shard_fini(struct route_shard* sh) {
+    if (sh->rsh_rh) {
+        route_table_destroy(sh->rsh_rh);
+        pthread_mutex_destroy(&sh->rsh_lock);
+    }
+}
 
-    /* Perform radix tree lookup */
-    struct radix_node* rn = rh->rh_rnh->rnh_matchaddr(dst, &rh->rh_rnh->rh);
+struct route_sharded* route_sharded_create(int family, u_int fibnum, int bits) {
+    struct route_sharded* rs;
+    size_t len;
+    int nshards;
 
-    if (!rn) {
-        rh->rh_stats.rs_misses++;
-        errno = ENOENT;
-        return ROUTE_ENOENT;
+    if (bits < 1 || bits > ROUTE_SHARD_MAXBITS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    rs = bsd_malloc(sizeof(*rs), M_RTABLE, M_WAITOK | M_ZERO);
+    if (!rs) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (route_snap_addr(family, &rs->rs_off, &len) != 0) {
+        bsd_free(rs, M_RTABLE);
+        errno = EAFNOSUPPORT;
+        return NULL;
     }
+    rs->rs_family = family;
+    rs->rs_fibnum = fibnum;
+    rs->rs_bits = bits;
 
-    rh->rh_stats.rs_hits++;
+    nshards = 1 << bits;
+    rs->rs_shards = bsd_malloc(nshards * sizeof(*rs->rs_shards), M_RTABLE, M_WAITOK | M_ZERO);
+    if (!rs->rs_shards || !route_shard_init(&rs->rs_top, family, fibnum)) {
+        route_sharded_destroy(rs);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (int i = 0; i < nshards; i++) {
+        if (!route_shard_init(&rs->rs_shards[i], family, fibnum)) {
+            route_sharded_destroy(rs);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
 
-    /* Extract route entry */
-    struct route_entry* re = (struct route_entry*)
-        ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+    /* Attach to the datapath unless the fib slot is already taken */
+    rs->rs_dp.f = sharded_dp_lookup;
+    rs->rs_dp.fn = sharded_dp_nhidx;
+    rs->rs_dp.arg = rs;
+    struct route_dp* _Atomic* dp = get_family_dp(family);
+    if (fibnum < ROUTE_DP_MAXFIBS) {
+        struct route_dp* expected = NULL;
+        atomic_compare_exchange_strong(&dp[fibnum], &expected, &rs->rs_dp);
+    }
+    return rs;
+}
 
-    if (ri_out) {
-        ri_out->ri_dst = re->re_dst;
-        ri_out->ri_netmask = re->re_mask;
-        ri_out->ri_gateway = re->re_gateway;
-        ri_out->ri_flags = re->re_flags;
-        ri_out->ri_ifindex = re->re_ifindex;
-        ri_out->ri_fibnum = re->re_fibnum;
+void route_sharded_destroy(struct route_sharded* rs) {
+    if (!rs) return;
+
+    /* Detach from the datapath and wait for in-flight lookups */
+    struct route_dp* _Atomic* dp = get_family_dp(rs->rs_family);
+    if (rs->rs_fibnum < ROUTE_DP_MAXFIBS) {
+        struct route_dp* expected = &rs->rs_dp;
+        if (atomic_compare_exchange_strong(&dp[rs->rs_fibnum], &expected, NULL)) {
+            NET_EPOCH_WAIT();
+        }
     }
 
-    return ROUTE_OK;
+    route_shard_fini(&rs->rs_top);
+    if (rs->rs_shards) {
+        for (int i = 0; i < (1 << rs->rs_bits); i++) {
+            route_shard_fini(&rs->rs_shards[i]);
+        }
+        bsd_free(rs->rs_shards, M_RTABLE);
+    }
+    bsd_free(rs, M_RTABLE);
 }
 
-int route_change(struct rib_head* rh, struct route_info* ri) {
-    if (!rh || !ri || !ri->ri_dst) {
+int route_sharded_add(struct route_sharded* rs, struct route_info* ri) {
+    struct route_shard* sh;
+    int error;
+
+    if (!rs || !ri || !ri->ri_dst ||
+        !(sh = route_sharded_pick(rs, ri->ri_dst, ri->ri_netmask))) {
         errno = EINVAL;
         return ROUTE_EINVAL;
     }
+    pthread_mutex_lock(&sh->rsh_lock);
+    error = route_add(sh->rsh_rh, ri);
+    pthread_mutex_unlock(&sh->rsh_lock);
+    return error;
+}
 
-    /* For simplicity, implement as delete + add */
-    int result = route_delete(rh, ri->ri_dst, ri->ri_netmask);
-    if (result != ROUTE_OK && result != ROUTE_ENOENT) {
-        return result;
-    }
+int route_sharded_delete(struct route_sharded* rs, struct sockaddr* dst,
+                         struct sockaddr* netmask) {
+    struct route_shard* sh;
+    int error;
 
-    result = route_add(rh, ri);
-    if (result == ROUTE_OK) {
-        rh->rh_stats.rs_changes++;
+    if (!rs || !dst || !(sh = route_sharded_pick(rs, dst, netmask))) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
     }
-
-    return result;
+    pthread_mutex_lock(&sh->rsh_lock);
+    error = route_delete(sh->rsh_rh, dst, netmask);
+    pthread_mutex_unlock(&sh->rsh_lock);
+    return error;
 }
 
-int route_walk(struct rib_head* rh, route_walker_f walker, void* arg) {
-    if (!rh || !walker) {
+int route_sharded_change(struct route_sharded* rs, struct route_info* ri) {
+    struct route_shard* sh;
+    int error;
+
+    if (!rs || !ri || !ri->ri_dst ||
+        !(sh = route_sharded_pick(rs, ri->ri_dst, ri->ri_netmask))) {
         errno = EINVAL;
         return ROUTE_EINVAL;
     }
+    pthread_mutex_lock(&sh->rsh_lock);
+    error = route_change(sh->rsh_rh, ri);
+    pthread_mutex_unlock(&sh->rsh_lock);
+    return error;
+}
 
-    struct walk_ctx ctx = {
-        .walker = walker,
-        .arg = arg,
-        .count = 0
-    };
+int route_sharded_lookup(struct route_sharded* rs, const struct sockaddr* dst,
+                         struct route_info* ri_out) {
+    struct epoch_tracker et;
+    int error;
 
-    rh->rh_rnh->rnh_walktree(&rh->rh_rnh->rh, route_walk_callback, &ctx);
+    if (!rs || !dst || dst->sa_family != rs->rs_family) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
 
-    return ctx.count;
+    NET_EPOCH_ENTER(et);
+    error = sharded_dp_lookup(rs, dst, ri_out);
+    NET_EPOCH_EXIT(et);
+
+    if (error != ROUTE_OK) {
+        errno = ENOENT;
+    }
+    return error;
 }
 
-struct radix_node_head* radix_node_head_create(void) {
-    struct radix_node_head* rnh = NULL;
+/* Runs @fn on the table of every shard, top first, under the shard lock */
+static int route_sharded_foreach(struct route_sharded* rs,
+                                 int (*fn)(struct rib_head*, void*), void* arg) {
+    int error = ROUTE_OK;
 
-    if (rn_inithead((void**)&rnh, 0) != 1) {
-        return NULL;
+    for (int i = -1; i < (1 << rs->rs_bits) && error == ROUTE_OK; i++) {
+        struct route_shard* sh = (i < 0) ? &rs->rs_top : &rs->rs_shards[i];
+
+        pthread_mutex_lock(&sh->rsh_lock);
+        error = fn(sh->rsh_rh, arg);
+        pthread_mutex_unlock(&sh->rsh_lock);
     }
+    return error;
+}
 
-    return rnh;
+struct sharded_walk_ctx {
+    route_walker_f walker;
+    void* arg;
+    int count;
+    int stopped;
+};
+
+static int route_sharded_walk_walker(struct route_info* ri, void* arg) {
+    struct sharded_walk_ctx* ctx = arg;
+
+    ctx->stopped = ctx->walker(ri, ctx->arg);
+    return ctx->stopped;
 }
 
-void radix_node_head_destroy(struct radix_node_head* rnh) {
-    if (rnh) {
-        rn_detachhead((void**)&rnh);
+static int route_sharded_walk_one(struct rib_head* rh, void* arg) {
+    struct sharded_walk_ctx* ctx = arg;
+    int n = route_walk(rh, route_sharded_walk_walker, ctx);
+
+    if (n < 0) {
+        return n;
     }
+    ctx->count += n;
+    /* A walker ending the walk ends it for the remaining shards too */
+    return ctx->stopped ? ROUTE_ENOENT : ROUTE_OK;
 }
 
-int route_get_stats(struct rib_head* rh, struct route_stats* stats) {
-    if (!rh || !stats) {
+int route_sharded_walk(struct route_sharded* rs, route_walker_f walker, void* arg) {
+    struct sharded_walk_ctx ctx = { .walker = walker, .arg = arg };
+    int error;
+
+    if (!rs || !walker) {
         errno = EINVAL;
         return ROUTE_EINVAL;
     }
-
-    *stats = rh->rh_stats;
-    return ROUTE_OK;
+    error = route_sharded_foreach(rs, route_sharded_walk_one, &ctx);
+    if (error != ROUTE_OK && !ctx.stopped) {
+        return error;
+    }
+    return ctx.count;
 }
 
-void route_print_table(struct rib_head* rh) {
-    if (!rh) return;
-
-    printf("Route Table (Family: %d, FIB: %u):\n", rh->rh_family, rh->rh_fibnum);
-    printf("Statistics:\n");
-    printf("  Nodes: %lu\n", rh->rh_stats.rs_nodes);
-    printf("  Lookups: %lu (hits: %lu, misses: %lu)\n",
-           rh->rh_stats.rs_lookups, rh->rh_stats.rs_hits, rh->rh_stats.rs_misses);
-    printf("  Operations: %lu adds, %lu deletes, %lu changes\n",
-           rh->rh_stats.rs_adds, rh->rh_stats.rs_deletes, rh->rh_stats.rs_changes);
+static int route_sharded_freeze_one(struct rib_head* rh, void* arg) {
+    (void)arg;
+    return route_table_freeze(rh);
 }
 
-int route_validate_table(struct rib_head* rh) {
-    if (!rh) {
+int route_sharded_freeze(struct route_sharded* rs) {
+    if (!rs) {
         errno = EINVAL;
         return ROUTE_EINVAL;
     }
+    return route_sharded_foreach(rs, route_sharded_freeze_one, NULL);
+}
 
-    /* TODO: Implement tree consistency validation */
+static int route_sharded_stats_one(struct rib_head* rh, void* arg) {
+    struct route_stats* sum = arg;
+    struct route_stats st;
+    u_long* s = (u_long*)sum;
+    const u_long* v = (const u_long*)&st;
+
+    route_get_stats(rh, &st);
+    for (size_t i = 0; i < sizeof(st) / sizeof(u_long); i++) {
+        s[i] += v[i];
+    }
     return ROUTE_OK;
-}
\ No newline at end of file
+}
+
+int route_sharded_get_stats(struct route_sharded* rs, struct route_stats* stats) {
+    if (!rs || !stats) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    memset(stats, 0, sizeof(*stats));
+    return route_sharded_foreach(rs, route_sharded_stats_one, stats);
+}
@@ -0,0 +1,366 @@
+/*
+ * FreeBSD Routing Library - Internal Definitions
+ *
+ * Structures and helpers shared by the sources of the library: route_lib.c
+ * with the tables, their changes and lookups, and a file per subsystem
+ * built on them. Not installed, applications include route_lib.h.
+ */
+
+#ifndef _ROUTE_LIB_VAR_H_
+#define _ROUTE_LIB_VAR_H_
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* sched_getcpu(), pthread_setaffinity_np() */
+#endif
+
+#include "route_lib.h"
+#include "compat_shim.h"
+#include "radix.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+/* Internal structures */
+
+/* Inline sockaddr storage, large enough for AF_INET and AF_INET6 */
+union route_sa {
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+};
+
+/* Interned nexthop, shared by all routes with the same gateway, flags and interface */
+struct route_nhop_ent {
+    struct route_nhop_ent* ne_next;  /* Hash chain */
+    uint32_t ne_hash;
+    uint32_t ne_idx;              /* Slot in the nexthop array */
+    u_int ne_refcnt;              /* Routes using the nexthop */
+    int ne_flags;
+    int ne_ifindex;
+    struct sockaddr* ne_gw;       /* Gateway (inline unless oversized) */
+    union route_sa ne_gw_sa;
+};
+
+/*
+ * Interned multipath group, shared by all routes over the same members
+ * and compiled slots. Members get slots in proportion to their weight
+ * and a flow goes to slot flowid % ng_nslots. Slots hold 16-bit member
+ * indexes, each member holds a nexthop reference.
+ */
+struct route_nhgrp {
+    struct route_nhgrp* ng_next;  /* Hash chain */
+    uint32_t ng_hash;
+    u_int ng_refcnt;              /* Routes using the group */
+    uint32_t ng_nslots;
+    uint32_t ng_nmembers;
+    uint16_t* ng_slots;           /* Member of each slot, after ng_members */
+    uint32_t ng_members[];        /* Member nexthop numbers */
+};
+
+/* Shards of the per-route hit counts, see rib_hit() */
+#define ROUTE_HIT_SHARDS 4
+
+struct route_entry {
+    struct sockaddr* re_dst;      /* Destination (inline unless oversized) */
+    struct sockaddr* re_mask;     /* Interned mask (route_mask) */
+    struct sockaddr* re_gateway;  /* Gateway of the interned nexthop */
+    struct route_nhgrp* re_nhgrp; /* Multipath group, NULL if single path */
+    int re_flags;                 /* Route flags */
+    int re_ifindex;              /* Interface index */
+    u_int re_fibnum;             /* FIB number */
+    uint32_t re_nhidx;           /* Interned nexthop, first member if multipath */
+    struct radix_node re_nodes[2]; /* FreeBSD radix requires 2 nodes */
+    struct epoch_context re_epoch_ctx; /* Deferred free */
+    uma_zone_t re_zone;          /* Zone of the owning table */
+    union route_sa re_dst_sa;    /* Storage for dst */
+    _Atomic uint64_t re_hits[ROUTE_HIT_SHARDS]; /* Sampled hit estimates */
+};
+
+/* Datapath lookup function and its argument, as fib_dp in fib_algo.h */
+typedef int route_dp_lookup_f(void* arg, const struct sockaddr* dst,
+                              struct route_info* ri_out);
+
+/* Burst lookup, fills all @count entries of @ri_out and returns the hits */
+typedef int route_dp_burst_f(void* arg, const struct sockaddr* const* dsts,
+                             int count, struct route_info* ri_out);
+
+/* Nexthop lookup, the nexthop number of the match or 0 */
+typedef uint32_t route_dp_nhidx_f(void* arg, const struct sockaddr* dst);
+
+/* Burst nexthop lookup selecting multipath members by flow, returns the hits */
+typedef int route_dp_nhidx_burst_f(void* arg, const struct sockaddr* const* dsts,
+                                   const uint32_t* flowids, int count, uint32_t* nhidx_out);
+
+struct route_dp {
+    route_dp_lookup_f* f;
+    route_dp_burst_f* fb;  /* Optional, f is called per key otherwise */
+    route_dp_nhidx_f* fn;
+    route_dp_nhidx_burst_f* fnb;  /* Optional, fn is called per key otherwise */
+    void* arg;
+};
+
+/* Per-table statistics, sharded counters backing struct route_stats */
+struct rib_counters {
+    counter_u64_t rc_lookups;
+    counter_u64_t rc_hits;
+    counter_u64_t rc_misses;
+    counter_u64_t rc_adds;
+    counter_u64_t rc_deletes;
+    counter_u64_t rc_changes;
+    counter_u64_t rc_nodes;
+    counter_u64_t rc_cache_hits;
+    counter_u64_t rc_flushes;
+    counter_u64_t rc_compactions;
+};
+
+#define RIB_COUNTERS_NUM (sizeof(struct rib_counters) / sizeof(counter_u64_t))
+
+/* Timed operations, one histogram each */
+enum {
+    RL_ADD,
+    RL_DELETE,
+    RL_CHANGE,
+    RL_LOOKUP,
+    RL_REBUILD,
+    RL_NTYPES
+};
+
+#define RIB_LAT_SHARDS 8
+
+struct rib_lat_hist {
+    _Atomic uint64_t lh_count;
+    _Atomic uint64_t lh_sum_ns;
+    _Atomic uint64_t lh_max_ns;
+    _Atomic uint64_t lh_buckets[ROUTE_LAT_BUCKETS];
+};
+
+/*
+ * Latency histograms of a table, sharded like the counters. Updates are
+ * bracketed by ls_begin/ls_end so that a reader can tell whether its
+ * copy of the shard raced with one.
+ */
+struct rib_lat_shard {
+    _Atomic uint64_t ls_begin;
+    _Atomic uint64_t ls_end;
+    struct rib_lat_hist ls_hist[RL_NTYPES];
+} __attribute__((aligned(COUNTER_CACHE_LINE)));
+
+struct rib_head {
+    struct radix_node_head* _Atomic rh_rnh; /* Radix tree head, swapped under lookups */
+    uma_zone_t rh_zone;              /* Route entries, private unless shared, NULL until the first */
+    int rh_family;                   /* Address family */
+    u_int rh_fibnum;                /* FIB number */
+    struct rib_counters rh_stats;    /* Statistics */
+    struct rib_lat_shard* _Atomic rh_lat; /* Latency histograms, set up on first use */
+    struct route_dp rh_dp;           /* Datapath lookup */
+    struct route_snap* _Atomic rh_snap; /* Snapshot being loaded, if any */
+    struct route_frozen* _Atomic rh_frozen; /* Datapath copy, while current */
+    _Atomic u_long rh_gen;           /* Bumped by every change to the tree */
+    _Atomic u_int rh_wseq;           /* Odd while the tree is being changed */
+    uint64_t rh_id;                  /* Unique across tables, never reused */
+    int rh_lcache;                   /* route_lookup() goes through the cache */
+    struct rib_head* rh_base;        /* Shared base of an overlay, or NULL */
+    _Atomic u_int rh_overlays;       /* Overlays using this table as base */
+    int rh_numa;                     /* Frozen copy replicated per node */
+    struct route_journal* rh_journal; /* Change journal, if open */
+    uint64_t rh_seq;                 /* Last journaled change */
+    struct route_hosts* _Atomic rh_hosts; /* Host route table, if enabled */
+    struct route_delta_log* rh_deltas; /* Delta log, if enabled */
+    struct route_compact* rh_compact; /* Compaction in progress, if any */
+    _Atomic u_int rh_hit_rate;       /* Lookups sampled one in, 0 for none */
+};
+
+/* Per-family datapath index, tables with fibnum < ROUTE_DP_MAXFIBS */
+#define ROUTE_DP_MAXFIBS 256
+
+/* Keys handled per datapath burst call */
+#define ROUTE_DP_BURST 64
+
+/* Change journal records, see route_journal_open() */
+#define RJ_OP_SET    1  /* Route added or replaced */
+#define RJ_OP_DEL    2
+#define RJ_OP_FLUSH  3
+
+/*
+ * Lookup cache entries are tagged with rh_gen, which lock-free readers
+ * load; only the writer bumps it, once a change is in place.
+ */
+static inline u_long rib_gen(const struct rib_head* rh) {
+    return atomic_load_explicit(&rh->rh_gen, memory_order_relaxed);
+}
+
+static inline void rib_gen_bump(struct rib_head* rh) {
+    atomic_store_explicit(&rh->rh_gen, rib_gen(rh) + 1, memory_order_release);
+}
+
+/*
+ * Flushes and compactions put a new tree in place with rib_rnh_swap();
+ * lookups load it with rib_rnh() so that they see it built.
+ */
+static inline struct radix_node_head* rib_rnh(const struct rib_head* rh) {
+    return atomic_load_explicit(&rh->rh_rnh, memory_order_acquire);
+}
+
+static inline void rib_rnh_swap(struct rib_head* rh, struct radix_node_head* rnh) {
+    atomic_store_explicit(&rh->rh_rnh, rnh, memory_order_release);
+}
+
+/*
+ * Snapshots
+ *
+ * An image holds the table header, the nexthop table and the prefixes,
+ * all fixed size records so that the image can be served in place once
+ * mapped. Prefixes are grouped by length, host routes first and then
+ * from the longest to the shortest mask, each group sorted by masked
+ * address: a lookup is a binary search per non-empty group.
+ */
+
+#define ROUTE_SNAP_MAGIC    0x52534e50  /* "RSNP" */
+#define ROUTE_SNAP_VERSION  2
+#define ROUTE_SNAP_NGROUPS  130         /* Host routes, then /128 to /0 */
+
+struct route_snap_hdr {
+    uint32_t rsh_magic;
+    uint32_t rsh_version;
+    uint32_t rsh_family;
+    uint32_t rsh_fibnum;
+    uint32_t rsh_nnhops;
+    uint32_t rsh_nprefixes;
+    uint64_t rsh_size;                  /* Whole image size */
+    uint64_t rsh_seq;                   /* Last journaled change in the image */
+    uint32_t rsh_groups[ROUTE_SNAP_NGROUPS + 1]; /* First prefix of each group */
+    uint32_t rsh_pad;
+};
+
+struct route_snap_nhop {
+    union route_sa rsn_gw;              /* Zero sa_len without gateway */
+    int32_t rsn_flags;
+    int32_t rsn_ifindex;
+};
+
+struct route_snap_prefix {
+    union route_sa rsp_dst;
+    union route_sa rsp_mask;            /* Zero sa_len without netmask */
+    uint32_t rsp_nhidx;                 /* Index in the nexthop table */
+    uint32_t rsp_plen;
+};
+
+/* Mapped image of a restored table, serving lookups until the tree is built */
+struct route_snap {
+    const struct route_snap_hdr* rs_hdr;
+    const struct route_snap_nhop* rs_nhops;
+    const struct route_snap_prefix* rs_prefixes;
+    uint32_t* rs_nhidx;                 /* Interned nexthop of each image one */
+    size_t rs_size;
+    size_t rs_addr_off;                 /* Address offset and length in sockaddr */
+    size_t rs_addr_len;
+    struct rib_head* rs_rh;
+    struct route_dp rs_dp;
+    pthread_t rs_thread;
+    int rs_threaded;                    /* rs_thread is to be joined */
+    int rs_error;                       /* Background load result */
+};
+
+/*
+ * Delta logs
+ *
+ * A log keeps one entry per prefix changed since it was enabled, with
+ * the state after the last change, in a hash by prefix and on a list
+ * ordered by change number. A change to a logged prefix renumbers its
+ * entry and moves it to the tail, so the list holds each prefix once.
+ * Evicting the head, or losing a change, raises the floor below which
+ * consumers cannot be served.
+ */
+struct route_delta_ent {
+    struct route_delta_ent* de_hnext;   /* Hash chain */
+    struct route_delta_ent* de_prev;    /* Change order */
+    struct route_delta_ent* de_next;
+    uint64_t de_gen;
+    uint32_t de_hash;
+    int de_op;                          /* ROUTE_DELTA_* */
+    int de_flags;
+    int de_ifindex;
+    int de_has_mask;
+    int de_has_gw;
+    union route_sa de_dst;              /* Masked */
+    union route_sa de_mask;
+    union route_sa de_gw;
+};
+
+struct route_delta_log {
+    struct route_delta_ent** dl_hash;
+    size_t dl_hmask;
+    struct route_delta_ent* dl_head;    /* Oldest change */
+    struct route_delta_ent* dl_tail;
+    size_t dl_count;
+    size_t dl_max;
+    size_t dl_off;                      /* Address within the keys */
+    size_t dl_len;
+    uint64_t dl_gen;                    /* Last change */
+    uint64_t dl_floor;                  /* Changes up to this one are lost */
+};
+
+#define ROUTE_DELTA_MAX  (1u << 24)
+
+/* route_lib.c */
+extern int g_route_lib_initialized;
+
+struct route_nhop_ent* route_nhop_get(const struct sockaddr* gw, int flags, int ifindex,
+                                      u_int refs);
+void route_nhop_release(uint32_t idx, u_int refs);
+struct route_nhgrp* route_nhgrp_build(const struct route_info* ri,
+                                      const struct route_mpath_gw* gws, size_t count);
+void route_nhgrp_release(struct route_nhgrp* ng);
+struct route_dp* _Atomic* get_family_dp(int family);
+int rib_add(struct rib_head* rh, const struct route_info* ri);
+int rib_load(struct rib_head* rh, const struct route_info* routes, size_t count);
+int rib_del(struct rib_head* rh, struct sockaddr* dst, struct sockaddr* netmask);
+
+/* route_delta.c */
+void route_delta_unlink(struct route_delta_log* dl, struct route_delta_ent* de);
+void route_delta_append(struct route_delta_log* dl, struct route_delta_ent* de);
+void route_delta_unhash(struct route_delta_log* dl, struct route_delta_ent* de);
+void route_delta_clear(struct route_delta_log* dl);
+int route_delta_init(struct route_delta_log* dl, int family, size_t max);
+void route_delta_fini(struct route_delta_log* dl);
+void route_delta_drop(struct rib_head* rh);
+int route_delta_key(const struct route_delta_log* dl, struct route_delta_ent* de,
+                    const struct route_info* ri);
+struct route_delta_ent* route_delta_find(const struct route_delta_log* dl,
+                                         const struct route_delta_ent* key);
+void route_delta_set(struct route_delta_ent* de, int op, const struct route_info* ri);
+void route_delta_info(const struct route_delta_ent* de, u_int fibnum, struct route_info* ri);
+void route_delta_note(struct rib_head* rh, uint32_t op, const struct route_info* ri);
+
+/* route_journal.c */
+void route_journal_log(struct rib_head* rh, uint32_t op, const struct route_info* ri);
+void route_journal_trim(struct rib_head* rh, uint64_t seq);
+
+/* route_snap.c */
+int route_snap_addr(int family, size_t* off, size_t* len);
+int route_snap_validate(const void* img, size_t size);
+int route_snap_build(struct rib_head* rh, void** imgp, size_t* sizep);
+int route_write_full(int fd, const void* buf, size_t size);
+int route_snap_write(const char* path, const void* buf, size_t size);
+const struct route_snap_prefix* route_snap_match(const struct route_snap* rs,
+                                                 const struct sockaddr* dst);
+void route_snap_fill(const struct route_snap* rs, const struct route_snap_prefix* p,
+                     struct route_info* ri);
+int snap_dp_lookup(void* arg, const struct sockaddr* dst, struct route_info* ri_out);
+int route_snap_settle(struct rib_head* rh);
+
+/* route_stage.c */
+int route_delta_apply(struct rib_head* rh, const struct route_delta_ent* de, int* changedp);
+
+#endif /* _ROUTE_LIB_VAR_H_ */
@@ -0,0 +1,330 @@
+/*
+ * FreeBSD Routing Library - Route Origins
+ *
+ * route_origins_create() arbitrates between the routes several sources
+ * hold for the same prefixes and keeps the preferred one in the table.
+ */
+
+#include "route_lib_var.h"
+
+/*
+ * Route origins
+ *
+ * Each prefix has an entry in a delta log hash that holds the route last
+ * installed in the table, followed by its candidates sorted best first.
+ * Updates only re-sort the candidates; the table is changed only when the
+ * first candidate no longer matches the installed route. The hash grows
+ * with the number of prefixes.
+ */
+struct route_origin_cand {
+    struct route_origin_cand* oc_next;
+    u_int oc_source;
+    u_int oc_pref;
+    int oc_flags;
+    int oc_ifindex;
+    int oc_has_gw;
+    union route_sa oc_gw;
+};
+
+struct route_origin_pfx {
+    struct route_delta_ent op_state;    /* Prefix and installed route, first */
+    struct route_origin_cand* op_cands; /* Best first */
+};
+
+struct route_origins {
+    struct route_delta_log ro_log;
+    struct rib_head* ro_rh;
+    u_long ro_ncands;
+    struct route_origins_stats ro_stats;
+};
+
+struct route_origins* route_origins_create(struct rib_head* rh) {
+    struct route_origins* ro;
+    int error;
+
+    if (!rh) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ro = bsd_malloc(sizeof(*ro), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!ro) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((error = route_delta_init(&ro->ro_log, rh->rh_family, 0)) != 0) {
+        bsd_free(ro, M_RTABLE);
+        errno = error;
+        return NULL;
+    }
+    ro->ro_rh = rh;
+    return ro;
+}
+
+void route_origins_destroy(struct route_origins* ro) {
+    struct route_delta_ent* de;
+    struct route_origin_cand* oc;
+
+    if (!ro) return;
+
+    for (de = ro->ro_log.dl_head; de; de = de->de_next) {
+        struct route_origin_pfx* op = (struct route_origin_pfx*)de;
+
+        while ((oc = op->op_cands) != NULL) {
+            op->op_cands = oc->oc_next;
+            bsd_free(oc, M_RTABLE);
+        }
+    }
+    route_delta_fini(&ro->ro_log);
+    bsd_free(ro, M_RTABLE);
+}
+
+/* Doubles the hash of @dl, which keeps its size if that fails */
+static void route_origins_grow(struct route_delta_log* dl) {
+    size_t buckets = (dl->dl_hmask + 1) * 2;
+    struct route_delta_ent **hash, *de;
+
+    hash = bsd_malloc(buckets * sizeof(*hash), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!hash) {
+        return;
+    }
+    for (de = dl->dl_head; de; de = de->de_next) {
+        de->de_hnext = hash[de->de_hash & (buckets - 1)];
+        hash[de->de_hash & (buckets - 1)] = de;
+    }
+    bsd_free(dl->dl_hash, M_RTABLE);
+    dl->dl_hash = hash;
+    dl->dl_hmask = buckets - 1;
+}
+
+/* Adds an entry for the prefix of @key, with no route installed */
+static struct route_origin_pfx* route_origins_new(struct route_origins* ro,
+                                                  const struct route_delta_ent* key) {
+    struct route_delta_log* dl = &ro->ro_log;
+    struct route_origin_pfx* op;
+
+    op = bsd_malloc(sizeof(*op), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!op) {
+        return NULL;
+    }
+    memcpy(&op->op_state, key, sizeof(*key));
+    op->op_state.de_op = ROUTE_DELTA_DEL;
+    op->op_state.de_hnext = dl->dl_hash[key->de_hash & dl->dl_hmask];
+    dl->dl_hash[key->de_hash & dl->dl_hmask] = &op->op_state;
+    route_delta_append(dl, &op->op_state);
+    if (++dl->dl_count > 2 * (dl->dl_hmask + 1)) {
+        route_origins_grow(dl);
+    }
+    return op;
+}
+
+/* Frees @op once it has no candidates and nothing installed */
+static void route_origins_gc(struct route_origins* ro, struct route_origin_pfx* op) {
+    if (op->op_cands || op->op_state.de_op != ROUTE_DELTA_DEL) {
+        return;
+    }
+    route_delta_unhash(&ro->ro_log, &op->op_state);
+    route_delta_unlink(&ro->ro_log, &op->op_state);
+    ro->ro_log.dl_count--;
+    bsd_free(op, M_RTABLE);
+}
+
+static struct route_origin_cand* route_origins_unlink(struct route_origin_pfx* op,
+                                                      u_int source) {
+    struct route_origin_cand **pp, *oc;
+
+    for (pp = &op->op_cands; (oc = *pp) != NULL; pp = &oc->oc_next) {
+        if (oc->oc_source == source) {
+            *pp = oc->oc_next;
+            return oc;
+        }
+    }
+    return NULL;
+}
+
+/* Lower preferences win, then lower sources */
+static void route_origins_insert(struct route_origin_pfx* op, struct route_origin_cand* oc) {
+    struct route_origin_cand** pp = &op->op_cands;
+
+    while (*pp && ((*pp)->oc_pref < oc->oc_pref ||
+                   ((*pp)->oc_pref == oc->oc_pref && (*pp)->oc_source < oc->oc_source))) {
+        pp = &(*pp)->oc_next;
+    }
+    oc->oc_next = *pp;
+    *pp = oc;
+}
+
+/* Sets the route state of @de to candidate @oc, or to no route */
+static void route_origins_fill(struct route_delta_ent* de, const struct route_origin_cand* oc) {
+    de->de_op = oc ? ROUTE_DELTA_SET : ROUTE_DELTA_DEL;
+    de->de_flags = oc ? oc->oc_flags : 0;
+    de->de_ifindex = oc ? oc->oc_ifindex : 0;
+    de->de_has_gw = oc ? oc->oc_has_gw : 0;
+    if (oc && oc->oc_has_gw) {
+        memcpy(&de->de_gw, &oc->oc_gw, oc->oc_gw.sa.sa_len);
+    }
+}
+
+static int route_origins_same(const struct route_delta_ent* de,
+                              const struct route_origin_cand* oc) {
+    if (!oc) {
+        return de->de_op == ROUTE_DELTA_DEL;
+    }
+    return de->de_op == ROUTE_DELTA_SET && de->de_flags == oc->oc_flags &&
+        de->de_ifindex == oc->oc_ifindex && de->de_has_gw == oc->oc_has_gw &&
+        (!oc->oc_has_gw || (de->de_gw.sa.sa_len == oc->oc_gw.sa.sa_len &&
+                            memcmp(&de->de_gw, &oc->oc_gw, oc->oc_gw.sa.sa_len) == 0));
+}
+
+/*
+ * Installs the best candidate of @op, or deletes the route when none is
+ * left. A failed change keeps the installed state, so the next update of
+ * the prefix tries again.
+ */
+static int route_origins_select(struct route_origins* ro, struct route_origin_pfx* op) {
+    struct route_delta_ent want;
+    int changed, error;
+
+    if (route_origins_same(&op->op_state, op->op_cands)) {
+        ro->ro_stats.ros_absorbed++;
+        return ROUTE_OK;
+    }
+    memcpy(&want, &op->op_state, sizeof(want));
+    route_origins_fill(&want, op->op_cands);
+    error = route_delta_apply(ro->ro_rh, &want, &changed);
+    if (error != ROUTE_OK) {
+        ro->ro_stats.ros_failed++;
+        return error;
+    }
+    if (changed) {
+        ro->ro_stats.ros_applied++;
+    } else {
+        ro->ro_stats.ros_absorbed++;
+    }
+    route_origins_fill(&op->op_state, op->op_cands);
+    return ROUTE_OK;
+}
+
+/* Checks @ri and fills @key from it, returns the error to report if any */
+static int route_origins_key(struct route_origins* ro, struct route_delta_ent* key,
+                             const struct route_info* ri) {
+    if (!ro || !ri->ri_dst || ri->ri_dst->sa_family != ro->ro_rh->rh_family ||
+        !route_delta_key(&ro->ro_log, key, ri) ||
+        (ri->ri_gateway && ri->ri_gateway->sa_len > sizeof(key->de_gw))) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    return route_snap_settle(ro->ro_rh);
+}
+
+int route_origins_add(struct route_origins* ro, u_int source, u_int pref,
+                      const struct route_info* ri) {
+    struct route_delta_ent key;
+    struct route_origin_pfx* op;
+    struct route_origin_cand* oc;
+    int error;
+
+    if (!ri) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if ((error = route_origins_key(ro, &key, ri)) != ROUTE_OK) {
+        return error;
+    }
+
+    op = (struct route_origin_pfx*)route_delta_find(&ro->ro_log, &key);
+    if (!op && !(op = route_origins_new(ro, &key))) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    if (!(oc = route_origins_unlink(op, source))) {
+        oc = bsd_malloc(sizeof(*oc), M_RTABLE, M_NOWAIT);
+        if (!oc) {
+            route_origins_gc(ro, op);
+            errno = ENOMEM;
+            return ROUTE_ENOMEM;
+        }
+        ro->ro_ncands++;
+    }
+    oc->oc_source = source;
+    oc->oc_pref = pref;
+    oc->oc_flags = ri->ri_flags;
+    oc->oc_ifindex = ri->ri_ifindex;
+    oc->oc_has_gw = (ri->ri_gateway != NULL);
+    if (ri->ri_gateway) {
+        memcpy(&oc->oc_gw, ri->ri_gateway, ri->ri_gateway->sa_len);
+    }
+    route_origins_insert(op, oc);
+
+    ro->ro_stats.ros_updates++;
+    return route_origins_select(ro, op);
+}
+
+int route_origins_delete(struct route_origins* ro, u_int source, struct sockaddr* dst,
+                         struct sockaddr* netmask) {
+    struct route_info ri = { .ri_dst = dst, .ri_netmask = netmask };
+    struct route_delta_ent key;
+    struct route_origin_pfx* op;
+    struct route_origin_cand* oc;
+    int error;
+
+    if ((error = route_origins_key(ro, &key, &ri)) != ROUTE_OK) {
+        return error;
+    }
+
+    op = (struct route_origin_pfx*)route_delta_find(&ro->ro_log, &key);
+    if (!op || !(oc = route_origins_unlink(op, source))) {
+        errno = ENOENT;
+        return ROUTE_ENOENT;
+    }
+    bsd_free(oc, M_RTABLE);
+    ro->ro_ncands--;
+
+    ro->ro_stats.ros_updates++;
+    error = route_origins_select(ro, op);
+    route_origins_gc(ro, op);
+    return error;
+}
+
+int route_origins_withdraw(struct route_origins* ro, u_int source) {
+    struct route_delta_ent *de, *next;
+    struct route_origin_cand* oc;
+    int error, result = ROUTE_OK;
+
+    if (!ro) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if ((error = route_snap_settle(ro->ro_rh)) != ROUTE_OK) {
+        return error;
+    }
+
+    for (de = ro->ro_log.dl_head; de; de = next) {
+        struct route_origin_pfx* op = (struct route_origin_pfx*)de;
+
+        next = de->de_next;
+        if (!(oc = route_origins_unlink(op, source))) {
+            continue;
+        }
+        bsd_free(oc, M_RTABLE);
+        ro->ro_ncands--;
+        ro->ro_stats.ros_updates++;
+        error = route_origins_select(ro, op);
+        if (error != ROUTE_OK && result == ROUTE_OK) {
+            result = error;
+        }
+        route_origins_gc(ro, op);
+    }
+    return result;
+}
+
+int route_origins_get_stats(const struct route_origins* ro, struct route_origins_stats* stats) {
+    if (!ro || !stats) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    *stats = ro->ro_stats;
+    stats->ros_prefixes = ro->ro_log.dl_count;
+    stats->ros_candidates = ro->ro_ncands;
+    return ROUTE_OK;
+}
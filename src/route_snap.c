@@ -0,0 +1,621 @@
+/*
+ * FreeBSD Routing Library - Table Snapshots
+ *
+ * route_table_save() writes the image of a table, route_table_restore()
+ * maps one and serves lookups from it while the tree is rebuilt in the
+ * background. The image format is in route_lib_var.h.
+ */
+
+#include "route_lib_var.h"
+
+/* Sort record used while writing an image */
+struct route_snap_sort {
+    uint32_t rss_group;
+    uint8_t rss_addr[16];               /* Masked address */
+    struct route_entry* rss_re;
+};
+
+int route_snap_addr(int family, size_t* off, size_t* len) {
+    switch (family) {
+        case AF_INET:
+            *off = offsetof(struct sockaddr_in, sin_addr);
+            *len = sizeof(struct in_addr);
+            return 0;
+        case AF_INET6:
+            *off = offsetof(struct sockaddr_in6, sin6_addr);
+            *len = sizeof(struct in6_addr);
+            return 0;
+        default:
+            return EAFNOSUPPORT;
+    }
+}
+
+static uint8_t route_snap_mask_byte(u_int plen, size_t i) {
+    if (plen >= 8 * (i + 1)) {
+        return 0xff;
+    }
+    if (plen <= 8 * i) {
+        return 0;
+    }
+    return (uint8_t)(0xff << (8 - (plen - 8 * i)));
+}
+
+/* Returns the prefix length of @mask, -1 if it is not contiguous */
+static int route_snap_plen(const struct sockaddr* mask, size_t off, size_t len) {
+    const uint8_t* p = (const uint8_t*)mask;
+    int plen = 0, tail = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t b = (off + i < mask->sa_len) ? p[off + i] : 0;
+        if (tail) {
+            if (b != 0) {
+                return -1;
+            }
+            continue;
+        }
+        while (b & 0x80) {
+            b <<= 1;
+            plen++;
+        }
+        if (b != 0) {
+            return -1;
+        }
+        tail = (plen < 8 * (int)(i + 1));
+    }
+    return plen;
+}
+
+static u_int route_snap_group_plen(size_t len, int group) {
+    return (group == 0) ? 8 * len : 8 * len - (group - 1);
+}
+
+/* Compares @a and @b over the first @plen bits */
+static int route_snap_cmp(const uint8_t* a, const uint8_t* b, size_t len, u_int plen) {
+    for (size_t i = 0; i < len && 8 * i < plen; i++) {
+        uint8_t m = route_snap_mask_byte(plen, i);
+        int d = (a[i] & m) - (b[i] & m);
+        if (d != 0) {
+            return d;
+        }
+    }
+    return 0;
+}
+
+static int route_snap_sort_cmp(const void* a, const void* b) {
+    const struct route_snap_sort* x = a;
+    const struct route_snap_sort* y = b;
+
+    if (x->rss_group != y->rss_group) {
+        return (x->rss_group < y->rss_group) ? -1 : 1;
+    }
+    return memcmp(x->rss_addr, y->rss_addr, sizeof(x->rss_addr));
+}
+
+void route_snap_fill(const struct route_snap* rs, const struct route_snap_prefix* p,
+                     struct route_info* ri) {
+    const struct route_snap_nhop* nh = &rs->rs_nhops[p->rsp_nhidx];
+
+    ri->ri_dst = (struct sockaddr*)&p->rsp_dst.sa;
+    ri->ri_netmask = p->rsp_mask.sa.sa_len ? (struct sockaddr*)&p->rsp_mask.sa : NULL;
+    ri->ri_gateway = nh->rsn_gw.sa.sa_len ? (struct sockaddr*)&nh->rsn_gw.sa : NULL;
+    ri->ri_flags = nh->rsn_flags;
+    ri->ri_ifindex = nh->rsn_ifindex;
+    ri->ri_fibnum = rs->rs_rh ? rs->rs_rh->rh_fibnum : rs->rs_hdr->rsh_fibnum;
+}
+
+/* Longest match of @dst in the image */
+const struct route_snap_prefix* route_snap_match(const struct route_snap* rs,
+                                                 const struct sockaddr* dst) {
+    const struct route_snap_prefix* pfx = rs->rs_prefixes;
+    const uint8_t* addr = (const uint8_t*)dst + rs->rs_addr_off;
+
+    for (int g = 0; g < ROUTE_SNAP_NGROUPS; g++) {
+        uint32_t lo = rs->rs_hdr->rsh_groups[g], hi = rs->rs_hdr->rsh_groups[g + 1];
+        u_int plen = route_snap_group_plen(rs->rs_addr_len, g);
+
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int d = route_snap_cmp(addr, (const uint8_t*)&pfx[mid].rsp_dst + rs->rs_addr_off,
+                                   rs->rs_addr_len, plen);
+            if (d == 0) {
+                return &pfx[mid];
+            }
+            if (d < 0) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Datapath served from the mapped image */
+int snap_dp_lookup(void* arg, const struct sockaddr* dst, struct route_info* ri_out) {
+    const struct route_snap* rs = arg;
+    const struct route_snap_prefix* p = route_snap_match(rs, dst);
+
+    if (!p) {
+        return ROUTE_ENOENT;
+    }
+    if (ri_out) {
+        route_snap_fill(rs, p, ri_out);
+    }
+    return ROUTE_OK;
+}
+
+static uint32_t snap_dp_nhidx(void* arg, const struct sockaddr* dst) {
+    const struct route_snap* rs = arg;
+    const struct route_snap_prefix* p = route_snap_match(rs, dst);
+
+    return p ? rs->rs_nhidx[p->rsp_nhidx] : 0;
+}
+
+/* Drops the nexthops interned for the image, the first @n of them */
+static void route_snap_nhops_release(struct route_snap* rs, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        route_nhop_release(rs->rs_nhidx[i], 1);
+    }
+    bsd_free(rs->rs_nhidx, M_RTABLE);
+    rs->rs_nhidx = NULL;
+}
+
+/* Interns the image nexthops so that it can answer nexthop lookups */
+static int route_snap_nhops_get(struct route_snap* rs) {
+    uint32_t n = rs->rs_hdr->rsh_nnhops;
+
+    rs->rs_nhidx = bsd_malloc(max(n, 1u) * sizeof(*rs->rs_nhidx), M_RTABLE, M_NOWAIT);
+    if (!rs->rs_nhidx) {
+        return ENOMEM;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        const struct route_snap_nhop* nh = &rs->rs_nhops[i];
+        struct route_nhop_ent* ne = route_nhop_get(
+            nh->rsn_gw.sa.sa_len ? &nh->rsn_gw.sa : NULL, nh->rsn_flags, nh->rsn_ifindex, 1);
+
+        if (!ne) {
+            route_snap_nhops_release(rs, i);
+            return ENOMEM;
+        }
+        rs->rs_nhidx[i] = ne->ne_idx;
+    }
+    return 0;
+}
+
+/* Checks the image is consistent before anything trusts its offsets */
+int route_snap_validate(const void* img, size_t size) {
+    const struct route_snap_hdr* hdr = img;
+    const struct route_snap_nhop* nhops;
+    const struct route_snap_prefix* pfx;
+    size_t off, len;
+
+    if (size < sizeof(*hdr) || hdr->rsh_magic != ROUTE_SNAP_MAGIC ||
+        hdr->rsh_version != ROUTE_SNAP_VERSION || hdr->rsh_size != size ||
+        route_snap_addr(hdr->rsh_family, &off, &len) != 0) {
+        return EINVAL;
+    }
+    if (sizeof(*hdr) + (uint64_t)hdr->rsh_nnhops * sizeof(*nhops) +
+        (uint64_t)hdr->rsh_nprefixes * sizeof(*pfx) != size) {
+        return EINVAL;
+    }
+    if (hdr->rsh_groups[0] != 0 || hdr->rsh_groups[ROUTE_SNAP_NGROUPS] != hdr->rsh_nprefixes) {
+        return EINVAL;
+    }
+    for (int g = 0; g < ROUTE_SNAP_NGROUPS; g++) {
+        if (hdr->rsh_groups[g] > hdr->rsh_groups[g + 1] ||
+            (g > (int)(8 * len + 1) && hdr->rsh_groups[g] != hdr->rsh_groups[g + 1])) {
+            return EINVAL;
+        }
+    }
+
+    nhops = (const struct route_snap_nhop*)(hdr + 1);
+    for (uint32_t i = 0; i < hdr->rsh_nnhops; i++) {
+        if (nhops[i].rsn_gw.sa.sa_len > sizeof(union route_sa)) {
+            return EINVAL;
+        }
+    }
+    pfx = (const struct route_snap_prefix*)(nhops + hdr->rsh_nnhops);
+    for (uint32_t i = 0; i < hdr->rsh_nprefixes; i++) {
+        const struct sockaddr* dst = &pfx[i].rsp_dst.sa;
+        if (pfx[i].rsp_nhidx >= hdr->rsh_nnhops || dst->sa_family != hdr->rsh_family ||
+            dst->sa_len < off + len || dst->sa_len > sizeof(union route_sa) ||
+            pfx[i].rsp_mask.sa.sa_len > sizeof(union route_sa)) {
+            return EINVAL;
+        }
+    }
+    return 0;
+}
+
+/* Writes all of @buf, returns 0 or an errno value */
+int route_write_full(int fd, const void* buf, size_t size) {
+    const char* p = buf;
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int route_snap_write(const char* path, const void* buf, size_t size) {
+    char tmp[PATH_MAX];
+    int fd, error;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return ENAMETOOLONG;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return errno;
+    }
+    error = route_write_full(fd, buf, size);
+    if (error == 0 && fsync(fd) != 0) {
+        error = errno;
+    }
+    close(fd);
+
+    /* Readers of @path only ever see a complete image */
+    if (error == 0 && rename(tmp, path) != 0) {
+        error = errno;
+    }
+    if (error != 0) {
+        unlink(tmp);
+    }
+    return error;
+}
+
+struct snap_walk_ctx {
+    struct route_snap_sort* recs;
+    size_t count;
+    size_t max;
+    size_t off;
+    size_t len;
+    int error;
+};
+
+static int route_snap_walk_callback(struct radix_node* rn, void* arg) {
+    struct snap_walk_ctx* ctx = arg;
+
+    if ((rn->rn_flags & RNF_ROOT) || !rn->rn_key) {
+        return 0;
+    }
+    if (ctx->count == ctx->max) {
+        ctx->error = EAGAIN;  /* Table changed under us */
+        return 1;
+    }
+
+    struct route_entry* re = (struct route_entry*)
+        ((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+    struct route_snap_sort* r = &ctx->recs[ctx->count];
+    int plen = (int)(8 * ctx->len);
+
+    if (re->re_mask) {
+        plen = route_snap_plen(re->re_mask, ctx->off, ctx->len);
+    }
+    if (plen < 0 || re->re_dst->sa_len > sizeof(union route_sa) ||
+        re->re_dst->sa_len < ctx->off + ctx->len ||
+        (re->re_mask && re->re_mask->sa_len > sizeof(union route_sa)) ||
+        (re->re_gateway && re->re_gateway->sa_len > sizeof(union route_sa)) ||
+        re->re_nhgrp) {
+        ctx->error = EOPNOTSUPP;
+        return 1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->rss_group = re->re_mask ? 1 + (8 * ctx->len - plen) : 0;
+    for (size_t i = 0; i < ctx->len; i++) {
+        r->rss_addr[i] = ((const uint8_t*)re->re_dst)[ctx->off + i] &
+            route_snap_mask_byte(plen, i);
+    }
+    r->rss_re = re;
+    ctx->count++;
+    return 0;
+}
+
+static int route_snap_count_callback(struct radix_node* rn, void* arg) {
+    if (!(rn->rn_flags & RNF_ROOT) && rn->rn_key) {
+        (*(size_t*)arg)++;
+    }
+    return 0;
+}
+
+/* Builds the image of @rh in memory, returns 0 or an errno value */
+int route_snap_build(struct rib_head* rh, void** imgp, size_t* sizep) {
+    struct snap_walk_ctx ctx;
+    struct route_snap_hdr* hdr;
+    struct route_snap_nhop* nhops;
+    struct route_snap_prefix* pfx;
+    uint32_t* nhhash;
+    size_t count = 0, hsize, size;
+    uint32_t nnhops = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (route_snap_addr(rh->rh_family, &ctx.off, &ctx.len) != 0) {
+        return EOPNOTSUPP;
+    }
+    rh->rh_rnh->rnh_walktree(&rh->rh_rnh->rh, route_snap_count_callback, &count);
+    if (count > UINT32_MAX / 2) {
+        return EOPNOTSUPP;
+    }
+
+    ctx.max = count;
+    ctx.recs = bsd_malloc(max(count, (size_t)1) * sizeof(*ctx.recs), M_RTABLE, M_NOWAIT);
+    for (hsize = 16; hsize < 2 * count; hsize <<= 1)
+        ;
+    nhhash = bsd_malloc(hsize * sizeof(*nhhash), M_RTABLE, M_NOWAIT);
+    size = sizeof(*hdr) + count * (sizeof(*nhops) + sizeof(*pfx));
+    hdr = bsd_malloc(size, M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!ctx.recs || !nhhash || !hdr) {
+        ctx.error = ENOMEM;
+        goto out;
+    }
+    rh->rh_rnh->rnh_walktree(&rh->rh_rnh->rh, route_snap_walk_callback, &ctx);
+    if (ctx.error != 0) {
+        goto out;
+    }
+    qsort(ctx.recs, ctx.count, sizeof(*ctx.recs), route_snap_sort_cmp);
+
+    /* Nexthops are shared by all routes with the same gateway, flags and ifindex */
+    memset(nhhash, 0xff, hsize * sizeof(*nhhash));
+    nhops = (struct route_snap_nhop*)(hdr + 1);
+    pfx = (struct route_snap_prefix*)(nhops + ctx.count);
+    for (size_t i = 0; i < ctx.count; i++) {
+        struct route_entry* re = ctx.recs[i].rss_re;
+        struct route_snap_nhop* nh = &nhops[nnhops];
+        uint32_t h = 2166136261u;  /* FNV-1a */
+
+        if (re->re_gateway) {
+            memcpy(&nh->rsn_gw, re->re_gateway, re->re_gateway->sa_len);
+        }
+        nh->rsn_flags = re->re_flags;
+        nh->rsn_ifindex = re->re_ifindex;
+        for (size_t j = 0; j < sizeof(*nh); j++) {
+            h = (h ^ ((const uint8_t*)nh)[j]) * 16777619u;
+        }
+        for (h &= hsize - 1; nhhash[h] != UINT32_MAX; h = (h + 1) & (hsize - 1)) {
+            if (memcmp(&nhops[nhhash[h]], nh, sizeof(*nh)) == 0) {
+                break;
+            }
+        }
+        if (nhhash[h] == UINT32_MAX) {
+            nhhash[h] = nnhops++;
+        } else {
+            memset(nh, 0, sizeof(*nh));
+        }
+
+        memcpy(&pfx[i].rsp_dst, re->re_dst, re->re_dst->sa_len);
+        if (re->re_mask) {
+            memcpy(&pfx[i].rsp_mask, re->re_mask, re->re_mask->sa_len);
+        }
+        pfx[i].rsp_nhidx = nhhash[h];
+        pfx[i].rsp_plen = route_snap_group_plen(ctx.len, ctx.recs[i].rss_group);
+        hdr->rsh_groups[ctx.recs[i].rss_group + 1]++;
+    }
+    for (int g = 0; g < ROUTE_SNAP_NGROUPS; g++) {
+        hdr->rsh_groups[g + 1] += hdr->rsh_groups[g];
+    }
+
+    /* Close the gap left by shared nexthops */
+    if (nnhops < ctx.count) {
+        memmove(nhops + nnhops, pfx, ctx.count * sizeof(*pfx));
+    }
+    size = sizeof(*hdr) + nnhops * sizeof(*nhops) + ctx.count * sizeof(*pfx);
+
+    hdr->rsh_magic = ROUTE_SNAP_MAGIC;
+    hdr->rsh_version = ROUTE_SNAP_VERSION;
+    hdr->rsh_family = rh->rh_family;
+    hdr->rsh_fibnum = rh->rh_fibnum;
+    hdr->rsh_nnhops = nnhops;
+    hdr->rsh_nprefixes = ctx.count;
+    hdr->rsh_size = size;
+    hdr->rsh_seq = rh->rh_seq;
+    *imgp = hdr;
+    *sizep = size;
+    hdr = NULL;
+out:
+    if (hdr) {
+        bsd_free(hdr, M_RTABLE);
+    }
+    if (nhhash) {
+        bsd_free(nhhash, M_RTABLE);
+    }
+    if (ctx.recs) {
+        bsd_free(ctx.recs, M_RTABLE);
+    }
+    return ctx.error;
+}
+
+int route_table_save(struct rib_head* rh, const char* path) {
+    if (!rh || !path) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    int error = route_snap_settle(rh);
+    if (error != ROUTE_OK) {
+        return error;
+    }
+
+    void* img;
+    size_t size;
+    error = route_snap_build(rh, &img, &size);
+    if (error == 0) {
+        error = route_snap_write(path, img, size);
+        bsd_free(img, M_RTABLE);
+    }
+
+    if (error != 0) {
+        errno = error;
+        switch (error) {
+            case ENOMEM:
+                return ROUTE_ENOMEM;
+            case EOPNOTSUPP:
+                return ROUTE_ENOTSUPP;
+            default:
+                return ROUTE_EINVAL;
+        }
+    }
+
+    /* The image now covers the journal up to here */
+    route_journal_trim(rh, rh->rh_seq);
+    return ROUTE_OK;
+}
+
+/* Builds the tree of the restored table and moves the datapath over to it */
+static int route_snap_load(struct route_snap* rs) {
+    uint32_t n = rs->rs_hdr->rsh_nprefixes;
+    struct rib_head* rh = rs->rs_rh;
+    struct route_info* routes;
+    int error;
+
+    routes = bsd_malloc(max(n, 1u) * sizeof(*routes), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!routes) {
+        errno = ENOMEM;
+        return ROUTE_ENOMEM;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        route_snap_fill(rs, &rs->rs_prefixes[i], &routes[i]);
+    }
+    error = rib_load(rh, routes, n);
+    bsd_free(routes, M_RTABLE);
+
+    if (error == ROUTE_OK) {
+        struct route_dp* _Atomic* dp = get_family_dp(rh->rh_family);
+        struct route_dp* expected = &rs->rs_dp;
+        if (rh->rh_fibnum < ROUTE_DP_MAXFIBS) {
+            atomic_compare_exchange_strong(&dp[rh->rh_fibnum], &expected, &rh->rh_dp);
+        }
+    }
+    return error;
+}
+
+static void* route_snap_loader(void* arg) {
+    struct route_snap* rs = arg;
+
+    rs->rs_error = route_snap_load(rs);
+    return NULL;
+}
+
+/*
+ * Waits for the background rebuild of a restored table and drops the image.
+ * A failed rebuild is retried once, then the table is left empty.
+ */
+int route_snap_settle(struct rib_head* rh) {
+    struct route_snap* rs = atomic_load_explicit(&rh->rh_snap, memory_order_relaxed);
+    int error;
+
+    if (!rs) {
+        return ROUTE_OK;
+    }
+    if (rs->rs_threaded) {
+        pthread_join(rs->rs_thread, NULL);
+        rs->rs_threaded = 0;
+    }
+    if (rs->rs_error != ROUTE_OK) {
+        rs->rs_error = route_snap_load(rs);
+    }
+
+    error = rs->rs_error;
+    if (error != ROUTE_OK && rh->rh_fibnum < ROUTE_DP_MAXFIBS) {
+        struct route_dp* _Atomic* dp = get_family_dp(rh->rh_family);
+        struct route_dp* expected = &rs->rs_dp;
+        atomic_compare_exchange_strong(&dp[rh->rh_fibnum], &expected, &rh->rh_dp);
+    }
+    /* Readers see the built tree from here on */
+    atomic_store_explicit(&rh->rh_snap, NULL, memory_order_release);
+
+    /* Datapath lookups and route_lookup() may still be reading the image */
+    NET_EPOCH_WAIT();
+    route_snap_nhops_release(rs, rs->rs_hdr->rsh_nnhops);
+    munmap((void*)rs->rs_hdr, rs->rs_size);
+    bsd_free(rs, M_RTABLE);
+
+    return error;
+}
+
+struct rib_head* route_table_restore(const char* path, u_int fibnum) {
+    struct route_snap* rs;
+    struct rib_head* rh;
+    struct stat st;
+    void* img;
+    int fd, error;
+
+    if (!path) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct route_snap_hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED) {
+        return NULL;
+    }
+    if ((error = route_snap_validate(img, st.st_size)) != 0) {
+        munmap(img, st.st_size);
+        errno = error;
+        return NULL;
+    }
+
+    const struct route_snap_hdr* hdr = img;
+    rh = route_table_create(hdr->rsh_family, fibnum);
+    rs = bsd_malloc(sizeof(*rs), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!rh || !rs) {
+        route_table_destroy(rh);
+        if (rs) {
+            bsd_free(rs, M_RTABLE);
+        }
+        munmap(img, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    rs->rs_hdr = hdr;
+    rs->rs_nhops = (const struct route_snap_nhop*)(hdr + 1);
+    rs->rs_prefixes = (const struct route_snap_prefix*)(rs->rs_nhops + hdr->rsh_nnhops);
+    rs->rs_size = st.st_size;
+    if (route_snap_nhops_get(rs) != 0) {
+        route_table_destroy(rh);
+        bsd_free(rs, M_RTABLE);
+        munmap(img, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    route_snap_addr(hdr->rsh_family, &rs->rs_addr_off, &rs->rs_addr_len);
+    rs->rs_rh = rh;
+    rh->rh_seq = hdr->rsh_seq;
+    rs->rs_dp.f = snap_dp_lookup;
+    rs->rs_dp.fn = snap_dp_nhidx;
+    rs->rs_dp.arg = rs;
+    atomic_store_explicit(&rh->rh_snap, rs, memory_order_release);
+
+    /* Serve the datapath from the image until the tree is built */
+    struct route_dp* _Atomic* dp = get_family_dp(rh->rh_family);
+    if (fibnum < ROUTE_DP_MAXFIBS) {
+        struct route_dp* expected = &rh->rh_dp;
+        atomic_compare_exchange_strong(&dp[fibnum], &expected, &rs->rs_dp);
+    }
+
+    if (pthread_create(&rs->rs_thread, NULL, route_snap_loader, rs) == 0) {
+        rs->rs_threaded = 1;
+    } else {
+        rs->rs_error = ROUTE_ENOMEM;  /* Loaded by the first operation */
+    }
+
+    return rh;
+}
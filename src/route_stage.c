@@ -0,0 +1,216 @@
+/*
+ * FreeBSD Routing Library - Staged Changes
+ *
+ * route_stage_create() collects changes to a table and commits their net
+ * effect when enough are pending, when the oldest has waited long enough
+ * or on route_stage_commit().
+ */
+
+#include "route_lib_var.h"
+
+/*
+ * Staged changes
+ *
+ * Pending changes are kept in a delta log as well, one entry per prefix
+ * with its net state: staging over a pending change replaces it. Commits
+ * compare each net state with the route in the tree and only touch the
+ * tree where they differ.
+ */
+struct route_stage {
+    struct route_delta_log st_log;      /* Pending state per prefix */
+    struct rib_head* st_rh;
+    uint64_t st_window_ns;              /* 0 to commit by count only */
+    uint64_t st_first_ns;               /* When the oldest pending change came */
+    struct route_stage_stats st_stats;
+};
+
+struct route_stage* route_stage_create(struct rib_head* rh, size_t max_pending,
+                                       u_int window_ms) {
+    struct route_stage* st;
+    int error;
+
+    if (!rh || max_pending == 0 || max_pending > ROUTE_DELTA_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    st = bsd_malloc(sizeof(*st), M_RTABLE, M_NOWAIT | M_ZERO);
+    if (!st) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((error = route_delta_init(&st->st_log, rh->rh_family, max_pending)) != 0) {
+        bsd_free(st, M_RTABLE);
+        errno = error;
+        return NULL;
+    }
+    st->st_rh = rh;
+    st->st_window_ns = (uint64_t)window_ms * 1000000;
+    return st;
+}
+
+void route_stage_destroy(struct route_stage* st) {
+    if (!st) return;
+
+    route_stage_commit(st);
+    route_delta_fini(&st->st_log);
+    bsd_free(st, M_RTABLE);
+}
+
+/* Same route as @re, which then needs no change */
+static int route_stage_same(const struct route_entry* re, const struct route_info* ri) {
+    if (re->re_nhgrp || re->re_flags != ri->ri_flags || re->re_ifindex != ri->ri_ifindex) {
+        return 0;
+    }
+    if (!re->re_gateway || !ri->ri_gateway) {
+        return re->re_gateway == ri->ri_gateway;
+    }
+    return re->re_gateway->sa_len == ri->ri_gateway->sa_len &&
+        memcmp(re->re_gateway, ri->ri_gateway, ri->ri_gateway->sa_len) == 0;
+}
+
+/*
+ * Makes the route of @de's prefix in @rh match its state, returns the
+ * result of the change if any. *@changedp is cleared when the tree
+ * already matched.
+ */
+int route_delta_apply(struct rib_head* rh, const struct route_delta_ent* de, int* changedp) {
+    struct route_entry* re = NULL;
+    struct radix_node* rn;
+    struct route_info ri;
+
+    route_delta_info(de, rh->rh_fibnum, &ri);
+    rn = rh->rh_rnh->rnh_lookup(ri.ri_dst, ri.ri_netmask, &rh->rh_rnh->rh);
+    if (rn && !(rn->rn_flags & RNF_ROOT)) {
+        re = (struct route_entry*)((char*)rn - offsetof(struct route_entry, re_nodes[0]));
+    }
+
+    *changedp = 0;
+    if (de->de_op == ROUTE_DELTA_DEL ? !re : (re && route_stage_same(re, &ri))) {
+        return ROUTE_OK;
+    }
+    *changedp = 1;
+    if (de->de_op == ROUTE_DELTA_DEL) {
+        return route_delete(rh, ri.ri_dst, ri.ri_netmask);
+    } else if (re) {
+        return route_change(rh, &ri);
+    }
+    return route_add(rh, &ri);
+}
+
+/* Applies the net state of @de, returns the result of the change if any */
+static int route_stage_apply(struct route_stage* st, const struct route_delta_ent* de) {
+    int changed, error;
+
+    error = route_delta_apply(st->st_rh, de, &changed);
+    if (!changed) {
+        st->st_stats.rss_absorbed++;
+    } else if (error == ROUTE_OK) {
+        st->st_stats.rss_applied++;
+    } else {
+        st->st_stats.rss_failed++;
+    }
+    return error;
+}
+
+int route_stage_commit(struct route_stage* st) {
+    struct route_delta_log* dl;
+    struct route_delta_ent* de;
+    int error, result = ROUTE_OK;
+
+    if (!st) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if ((error = route_snap_settle(st->st_rh)) != ROUTE_OK) {
+        return error;
+    }
+
+    /* Prefixes are independent, the order of the commits does not matter */
+    dl = &st->st_log;
+    for (de = dl->dl_head; de; de = de->de_next) {
+        error = route_stage_apply(st, de);
+        if (error != ROUTE_OK && result == ROUTE_OK) {
+            result = error;
+        }
+    }
+    route_delta_clear(dl);
+    st->st_stats.rss_commits++;
+    return result;
+}
+
+static int route_stage_op(struct route_stage* st, int op, const struct route_info* ri) {
+    struct route_delta_log* dl;
+    struct route_delta_ent key, *de;
+    uint64_t now;
+
+    if (!st || !ri || !ri->ri_dst || ri->ri_dst->sa_family != st->st_rh->rh_family) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    dl = &st->st_log;
+    if (!route_delta_key(dl, &key, ri) ||
+        (op == ROUTE_DELTA_SET && ri->ri_gateway &&
+         ri->ri_gateway->sa_len > sizeof(key.de_gw))) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+
+    now = rm_nanotime();
+    st->st_stats.rss_staged++;
+    if ((de = route_delta_find(dl, &key)) != NULL) {
+        st->st_stats.rss_absorbed++;
+    } else {
+        de = bsd_malloc(sizeof(*de), M_RTABLE, M_NOWAIT);
+        if (!de) {
+            errno = ENOMEM;
+            return ROUTE_ENOMEM;
+        }
+        memcpy(de, &key, sizeof(*de));
+        de->de_hnext = dl->dl_hash[de->de_hash & dl->dl_hmask];
+        dl->dl_hash[de->de_hash & dl->dl_hmask] = de;
+        if (dl->dl_count++ == 0) {
+            st->st_first_ns = now;
+        }
+        route_delta_append(dl, de);
+    }
+    route_delta_set(de, op, ri);
+
+    if (dl->dl_count >= dl->dl_max ||
+        (st->st_window_ns && now - st->st_first_ns >= st->st_window_ns)) {
+        return route_stage_commit(st);
+    }
+    return ROUTE_OK;
+}
+
+int route_stage_add(struct route_stage* st, const struct route_info* ri) {
+    return route_stage_op(st, ROUTE_DELTA_SET, ri);
+}
+
+int route_stage_delete(struct route_stage* st, struct sockaddr* dst, struct sockaddr* netmask) {
+    struct route_info ri = { .ri_dst = dst, .ri_netmask = netmask };
+
+    return route_stage_op(st, ROUTE_DELTA_DEL, &ri);
+}
+
+int route_stage_poll(struct route_stage* st) {
+    if (!st) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    if (st->st_log.dl_count > 0 && st->st_window_ns &&
+        rm_nanotime() - st->st_first_ns >= st->st_window_ns) {
+        return route_stage_commit(st);
+    }
+    return ROUTE_OK;
+}
+
+int route_stage_get_stats(const struct route_stage* st, struct route_stage_stats* stats) {
+    if (!st || !stats) {
+        errno = EINVAL;
+        return ROUTE_EINVAL;
+    }
+    *stats = st->st_stats;
+    stats->rss_pending = st->st_log.dl_count;
+    return ROUTE_OK;
+}
@@ -0,0 +1,936 @@
+/*
+ * BGP Table Replay Benchmark
+ *
+ * Loads a real table into route_lib and replays an update stream on it
+ * while reader threads run lookups, reporting percentile latencies.
+ *
+ * Inputs (RIB first, then the optional update stream):
+ * - MRT dumps: TABLE_DUMP, TABLE_DUMP_V2 RIB_IPV4/IPV6_UNICAST and
+ *   BGP4MP/BGP4MP_ET UPDATE messages (RFC 6396)
+ * - bgpdump -m output ("TABLE_DUMP2|ts|B|peer|as|prefix|path|origin|nh|...")
+ * - plain text: "prefix [nexthop]" for tables,
+ *   "timestamp A|W prefix [nexthop]" for updates
+ *
+ * Without a RIB a synthetic DFZ-shaped IPv4 table is used, and without
+ * an update stream churn is generated from the loaded table.
+ *
+ * Readers draw their destinations from test_traffic (Zipf over the
+ * table by default).
+ *
+ * Usage: test_bgp_replay [-r readers] [-n prefixes] [-u updates]
+ *                        [-s speed] [-t traffic] [rib [updates]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../kernel_compat/compat_shim.h"
+#include "route_lib.h"
+#include "test_traffic.h"
+
+/* Benchmark defaults */
+#define REPLAY_READERS          4
+#define REPLAY_SYNTH_PREFIXES   200000
+#define REPLAY_SYNTH_UPDATES    100000
+#define REPLAY_SYNTH_PEERS      32
+#define REPLAY_MAX_READERS      64
+#define REPLAY_SAMPLE_EVERY     16      /* Reader lookups per latency sample */
+#define REPLAY_READER_SAMPLES   (1 << 20)
+#define REPLAY_NH_HASH          (1 << 16)
+
+/* MRT record types and subtypes, RFC 6396 */
+#define MRT_TABLE_DUMP          12
+#define MRT_TABLE_DUMP_V2       13
+#define MRT_BGP4MP              16
+#define MRT_BGP4MP_ET           17
+
+#define MRT_RIB_IPV4_UNICAST    2
+#define MRT_RIB_IPV6_UNICAST    4
+
+#define MRT_BGP4MP_MESSAGE      1
+#define MRT_BGP4MP_MESSAGE_AS4  4
+#define MRT_BGP4MP_MESSAGE_LOCAL        6
+#define MRT_BGP4MP_MESSAGE_AS4_LOCAL    7
+
+#define BGP_MSG_UPDATE          2
+#define BGP_ATTR_NEXT_HOP       3
+#define BGP_ATTR_MP_REACH       14
+#define BGP_ATTR_MP_UNREACH     15
+#define BGP_ATTR_FLAG_EXTLEN    0x10
+
+#define REPLAY_ANNOUNCE         0
+#define REPLAY_WITHDRAW         1
+
+union replay_sa {
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+};
+
+/* One table entry or update */
+struct replay_ev {
+    union replay_sa re_dst;
+    uint64_t        re_ts;          /* Microseconds */
+    uint32_t        re_nh;          /* Index in the nexthop table */
+    uint8_t         re_family;
+    uint8_t         re_plen;
+    uint8_t         re_op;          /* REPLAY_ANNOUNCE or REPLAY_WITHDRAW */
+};
+
+struct replay_evs {
+    struct replay_ev *ev;
+    size_t          num;
+    size_t          cap;
+};
+
+/* Interned nexthops, their number is the table fan-out */
+struct replay_nh {
+    union replay_sa rn_sa;
+    uint32_t        rn_routes;      /* Table entries using it */
+};
+
+static struct replay_nh *nh_table;
+static uint32_t nh_count;
+static uint32_t nh_hash[REPLAY_NH_HASH];  /* Index + 1, 0 is empty */
+
+static union replay_sa masks4[33];
+static union replay_sa masks6[129];
+
+static struct rib_head *rib4, *rib6;
+static struct rmlock rib_lock;
+
+static struct replay_evs rib_evs, upd_evs;
+
+static atomic_bool readers_stop;
+
+/* Reader destinations per family, NULL when the table has none */
+static struct traffic_gen *traffic4, *traffic6;
+static uint32_t traffic6_share;     /* Out of 2^32, lookups going to IPv6 */
+
+struct reader_ctx {
+    pthread_t       thread;
+    uint32_t        seed;
+    uint64_t        lookups;
+    uint64_t        hits;
+    uint64_t       *samples;
+    size_t          nsamples;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t xorshift32(uint32_t *s) {
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static void init_sa(union replay_sa *sa, int family) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sa.sa_family = family;
+    sa->sa.sa_len = (family == AF_INET) ? sizeof(sa->sin) : sizeof(sa->sin6);
+}
+
+static uint8_t *sa_addr(union replay_sa *sa, int family) {
+    if (family == AF_INET)
+        return (uint8_t *)&sa->sin.sin_addr;
+    return (uint8_t *)&sa->sin6.sin6_addr;
+}
+
+static void init_masks(void) {
+    for (int plen = 0; plen <= 128; plen++) {
+        for (int f = 0; f < 2; f++) {
+            union replay_sa *m;
+            if (f == 0) {
+                if (plen > 32)
+                    continue;
+                m = &masks4[plen];
+                init_sa(m, AF_INET);
+            } else {
+                m = &masks6[plen];
+                init_sa(m, AF_INET6);
+            }
+            uint8_t *p = sa_addr(m, f == 0 ? AF_INET : AF_INET6);
+            for (int i = 0; i < plen / 8; i++)
+                p[i] = 0xff;
+            if (plen % 8)
+                p[plen / 8] = (uint8_t)(0xff << (8 - plen % 8));
+        }
+    }
+}
+
+static union replay_sa *ev_mask(const struct replay_ev *ev) {
+    return (ev->re_family == AF_INET) ? &masks4[ev->re_plen] :
+        &masks6[ev->re_plen];
+}
+
+static struct rib_head *ev_rib(const struct replay_ev *ev) {
+    return (ev->re_family == AF_INET) ? rib4 : rib6;
+}
+
+/* Returns the nexthop index of @sa, adding it on first use */
+static uint32_t nh_intern(const union replay_sa *sa) {
+    const uint8_t *p = (const uint8_t *)sa;
+    size_t len = sa->sa.sa_len;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619u;
+
+    for (uint32_t slot = h & (REPLAY_NH_HASH - 1);; slot = (slot + 1) & (REPLAY_NH_HASH - 1)) {
+        uint32_t idx = nh_hash[slot];
+        if (idx == 0) {
+            if (nh_count == REPLAY_NH_HASH / 2) {
+                /* Table full, fold the rest onto the last entry */
+                return nh_count - 1;
+            }
+            nh_table[nh_count].rn_sa = *sa;
+            nh_hash[slot] = ++nh_count;
+            return nh_count - 1;
+        }
+        if (memcmp(&nh_table[idx - 1].rn_sa, sa, len) == 0)
+            return idx - 1;
+    }
+}
+
+static struct replay_ev *evs_push(struct replay_evs *evs) {
+    if (evs->num == evs->cap) {
+        size_t cap = evs->cap ? evs->cap * 2 : 4096;
+        struct replay_ev *ev = bsd_malloc(cap * sizeof(*ev), M_RTABLE, M_WAITOK);
+        if (evs->ev) {
+            memcpy(ev, evs->ev, evs->num * sizeof(*ev));
+            bsd_free(evs->ev, M_RTABLE);
+        }
+        evs->ev = ev;
+        evs->cap = cap;
+    }
+    struct replay_ev *ev = &evs->ev[evs->num++];
+    memset(ev, 0, sizeof(*ev));
+    return ev;
+}
+
+/* Sets the prefix of @ev from @len bytes of address, clearing host bits */
+static int ev_set_prefix(struct replay_ev *ev, int family, const uint8_t *addr,
+                         size_t len, int plen) {
+    int maxlen = (family == AF_INET) ? 32 : 128;
+
+    if (plen < 0 || plen > maxlen || len < (size_t)(plen + 7) / 8)
+        return -1;
+    init_sa(&ev->re_dst, family);
+    uint8_t *p = sa_addr(&ev->re_dst, family);
+    memcpy(p, addr, (plen + 7) / 8);
+    if (plen % 8)
+        p[plen / 8] &= (uint8_t)(0xff << (8 - plen % 8));
+    ev->re_family = (uint8_t)family;
+    ev->re_plen = (uint8_t)plen;
+    return 0;
+}
+
+static uint32_t nh_from_bytes(int family, const uint8_t *addr) {
+    union replay_sa sa;
+
+    init_sa(&sa, family);
+    memcpy(sa_addr(&sa, family), addr, (family == AF_INET) ? 4 : 16);
+    return nh_intern(&sa);
+}
+
+/* Text input */
+
+static int parse_prefix(const char *s, struct replay_ev *ev) {
+    char buf[INET6_ADDRSTRLEN + 8];
+    uint8_t addr[16];
+    char *slash;
+    int family, plen;
+
+    if (strlen(s) >= sizeof(buf))
+        return -1;
+    strcpy(buf, s);
+    slash = strchr(buf, '/');
+    if (slash)
+        *slash++ = '\0';
+    family = strchr(buf, ':') ? AF_INET6 : AF_INET;
+    if (inet_pton(family, buf, addr) != 1)
+        return -1;
+    plen = slash ? atoi(slash) : (family == AF_INET ? 32 : 128);
+    return ev_set_prefix(ev, family, addr, sizeof(addr), plen);
+}
+
+static uint32_t parse_nexthop(const char *s) {
+    uint8_t addr[16];
+    int family;
+
+    if (s == NULL || *s == '\0')
+        return 0;
+    family = strchr(s, ':') ? AF_INET6 : AF_INET;
+    if (inet_pton(family, s, addr) != 1)
+        return 0;
+    return nh_from_bytes(family, addr);
+}
+
+static int split(char *line, const char *sep, char **tok, int max) {
+    int n = 0;
+    char *p = line;
+
+    while (n < max) {
+        tok[n++] = p;
+        p = strpbrk(p, sep);
+        if (p == NULL)
+            break;
+        *p++ = '\0';
+        if (sep[0] == ' ')
+            p += strspn(p, sep);
+    }
+    return n;
+}
+
+static void load_text(FILE *fp, struct replay_evs *evs) {
+    char line[4096];
+    char *tok[16];
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *s = line + strspn(line, " \t");
+        if (*s == '\0' || *s == '#')
+            continue;
+
+        struct replay_ev ev;
+        memset(&ev, 0, sizeof(ev));
+
+        if (strchr(s, '|')) {
+            /* bgpdump -m: type|time|B/A/W|peer|peer_as|prefix|path|origin|nexthop|... */
+            int n = split(s, "|", tok, 16);
+            if (n < 6)
+                continue;
+            if (tok[2][0] == 'W')
+                ev.re_op = REPLAY_WITHDRAW;
+            else if (tok[2][0] != 'A' && tok[2][0] != 'B')
+                continue;
+            if (parse_prefix(tok[5], &ev) != 0)
+                continue;
+            ev.re_ts = (uint64_t)(strtod(tok[1], NULL) * 1e6);
+            ev.re_nh = (ev.re_op == REPLAY_ANNOUNCE && n > 8) ? parse_nexthop(tok[8]) : 0;
+        } else {
+            int n = split(s, " \t", tok, 4);
+            if (strchr(tok[0], '/') || strchr(tok[0], ':')) {
+                /* prefix [nexthop] */
+                if (parse_prefix(tok[0], &ev) != 0)
+                    continue;
+                ev.re_nh = (n > 1) ? parse_nexthop(tok[1]) : 0;
+            } else {
+                /* timestamp A|W prefix [nexthop] */
+                if (n < 3 || parse_prefix(tok[2], &ev) != 0)
+                    continue;
+                ev.re_ts = (uint64_t)(strtod(tok[0], NULL) * 1e6);
+                ev.re_op = (tok[1][0] == 'W') ? REPLAY_WITHDRAW : REPLAY_ANNOUNCE;
+                ev.re_nh = (n > 3) ? parse_nexthop(tok[3]) : 0;
+            }
+        }
+        *evs_push(evs) = ev;
+    }
+}
+
+/* MRT input */
+
+static uint32_t be16(const uint8_t *p) { return ((uint32_t)p[0] << 8) | p[1]; }
+static uint32_t be32(const uint8_t *p) { return (be16(p) << 16) | be16(p + 2); }
+
+/* Finds the nexthop in a path attribute block, 0 if there is none */
+static uint32_t mrt_attr_nexthop(const uint8_t *p, size_t len, bool rib_entry) {
+    uint32_t nh = 0;
+
+    while (len >= 3) {
+        uint8_t flags = p[0], type = p[1];
+        size_t hlen = (flags & BGP_ATTR_FLAG_EXTLEN) ? 4 : 3;
+        if (len < hlen)
+            break;
+        size_t alen = (hlen == 4) ? be16(p + 2) : p[2];
+        const uint8_t *a = p + hlen;
+        if (len < hlen + alen)
+            break;
+
+        if (type == BGP_ATTR_NEXT_HOP && alen == 4) {
+            if (nh == 0)
+                nh = nh_from_bytes(AF_INET, a);
+        } else if (type == BGP_ATTR_MP_REACH && alen >= 1) {
+            /* TABLE_DUMP_V2 entries drop AFI/SAFI and the NLRI (RFC 6396 4.3.4) */
+            const uint8_t *n = a;
+            size_t nlen = alen;
+            if (!rib_entry || (a[0] != 16 && a[0] != 32)) {
+                n += 3;
+                nlen = (alen >= 3) ? alen - 3 : 0;
+            }
+            if (nlen >= 17 && (n[0] == 16 || n[0] == 32))
+                nh = nh_from_bytes(AF_INET6, n + 1);
+        }
+        p += hlen + alen;
+        len -= hlen + alen;
+    }
+    return nh;
+}
+
+/* Appends one event per prefix of an NLRI block */
+static void mrt_nlri(struct replay_evs *evs, int family, const uint8_t *p, size_t len,
+                     uint64_t ts, int op, uint32_t nh) {
+    while (len >= 1) {
+        int plen = p[0];
+        size_t blen = (plen + 7) / 8;
+        if (len < 1 + blen)
+            break;
+        struct replay_ev *ev = evs_push(evs);
+        if (ev_set_prefix(ev, family, p + 1, blen, plen) != 0) {
+            evs->num--;
+            break;
+        }
+        ev->re_ts = ts;
+        ev->re_op = (uint8_t)op;
+        ev->re_nh = nh;
+        p += 1 + blen;
+        len -= 1 + blen;
+    }
+}
+
+static void mrt_bgp4mp(struct replay_evs *evs, const uint8_t *p, size_t len,
+                       int subtype, uint64_t ts) {
+    size_t aslen = (subtype == MRT_BGP4MP_MESSAGE_AS4 ||
+        subtype == MRT_BGP4MP_MESSAGE_AS4_LOCAL) ? 4 : 2;
+    size_t off = 2 * aslen + 2;
+
+    if (len < off + 2)
+        return;
+    size_t alen = (be16(p + off) == 2) ? 16 : 4;
+    off += 2 + 2 * alen;
+
+    /* BGP header: marker, length, type */
+    if (len < off + 19 || p[off + 18] != BGP_MSG_UPDATE)
+        return;
+    p += off + 19;
+    len -= off + 19;
+
+    if (len < 2)
+        return;
+    size_t wlen = be16(p);
+    if (len < 2 + wlen + 2)
+        return;
+    mrt_nlri(evs, AF_INET, p + 2, wlen, ts, REPLAY_WITHDRAW, 0);
+    p += 2 + wlen;
+    len -= 2 + wlen;
+
+    size_t palen = be16(p);
+    if (len < 2 + palen)
+        return;
+    const uint8_t *attrs = p + 2;
+    uint32_t nh = mrt_attr_nexthop(attrs, palen, false);
+
+    /* IPv6 comes in MP_REACH/MP_UNREACH, unicast only */
+    for (const uint8_t *a = attrs; a + 3 <= attrs + palen;) {
+        size_t hlen = (a[0] & BGP_ATTR_FLAG_EXTLEN) ? 4 : 3;
+        size_t l = (hlen == 4) ? be16(a + 2) : a[2];
+        const uint8_t *v = a + hlen;
+        if (v + l > attrs + palen)
+            break;
+        if (a[1] == BGP_ATTR_MP_REACH && l >= 5 && be16(v) == 2 && v[2] == 1 &&
+            (size_t)5 + v[3] <= l)
+            mrt_nlri(evs, AF_INET6, v + 5 + v[3], l - 5 - v[3], ts, REPLAY_ANNOUNCE, nh);
+        else if (a[1] == BGP_ATTR_MP_UNREACH && l >= 3 && be16(v) == 2 && v[2] == 1)
+            mrt_nlri(evs, AF_INET6, v + 3, l - 3, ts, REPLAY_WITHDRAW, 0);
+        a = v + l;
+    }
+
+    mrt_nlri(evs, AF_INET, p + 2 + palen, len - 2 - palen, ts, REPLAY_ANNOUNCE, nh);
+}
+
+static void load_mrt(const uint8_t *buf, size_t size, struct replay_evs *evs) {
+    for (size_t off = 0; off + 12 <= size;) {
+        uint64_t ts = (uint64_t)be32(buf + off) * 1000000;
+        uint32_t type = be16(buf + off + 4), subtype = be16(buf + off + 6);
+        size_t len = be32(buf + off + 8);
+        const uint8_t *p = buf + off + 12;
+
+        if (off + 12 + len > size)
+            break;
+        off += 12 + len;
+
+        if (type == MRT_BGP4MP_ET) {
+            if (len < 4)
+                continue;
+            ts += be32(p);
+            p += 4;
+            len -= 4;
+            type = MRT_BGP4MP;
+        }
+
+        if (type == MRT_TABLE_DUMP_V2 &&
+            (subtype == MRT_RIB_IPV4_UNICAST || subtype == MRT_RIB_IPV6_UNICAST)) {
+            int family = (subtype == MRT_RIB_IPV4_UNICAST) ? AF_INET : AF_INET6;
+            if (len < 5)
+                continue;
+            int plen = p[4];
+            size_t blen = (plen + 7) / 8;
+            /* First RIB entry: peer index, originated time, attributes */
+            if (len < 5 + blen + 2 + 8)
+                continue;
+            struct replay_ev *ev = evs_push(evs);
+            if (ev_set_prefix(ev, family, p + 5, blen, plen) != 0) {
+                evs->num--;
+                continue;
+            }
+            const uint8_t *e = p + 5 + blen + 2;
+            size_t alen = be16(e + 6);
+            if (e + 8 + alen <= p + len)
+                ev->re_nh = mrt_attr_nexthop(e + 8, alen, true);
+            ev->re_ts = ts;
+        } else if (type == MRT_TABLE_DUMP && (subtype == 1 || subtype == 2)) {
+            int family = (subtype == 1) ? AF_INET : AF_INET6;
+            size_t alen = (family == AF_INET) ? 4 : 16;
+            /* view, seq, prefix, plen, status, time, peer ip, peer as, attr len */
+            size_t hdr = 4 + alen + 2 + 4 + alen + 2 + 2;
+            if (len < hdr)
+                continue;
+            struct replay_ev *ev = evs_push(evs);
+            if (ev_set_prefix(ev, family, p + 4, alen, p[4 + alen]) != 0) {
+                evs->num--;
+                continue;
+            }
+            size_t attrlen = be16(p + hdr - 2);
+            if (hdr + attrlen <= len)
+                ev->re_nh = mrt_attr_nexthop(p + hdr, attrlen, false);
+            ev->re_ts = ts;
+        } else if (type == MRT_BGP4MP &&
+                   (subtype == MRT_BGP4MP_MESSAGE || subtype == MRT_BGP4MP_MESSAGE_AS4 ||
+                    subtype == MRT_BGP4MP_MESSAGE_LOCAL ||
+                    subtype == MRT_BGP4MP_MESSAGE_AS4_LOCAL)) {
+            mrt_bgp4mp(evs, p, len, subtype, ts);
+        }
+    }
+}
+
+static int load_file(const char *path, struct replay_evs *evs) {
+    FILE *fp = fopen(path, "rb");
+    uint8_t hdr[12];
+
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* MRT if the first record header carries a known type */
+    size_t n = fread(hdr, 1, sizeof(hdr), fp);
+    uint32_t type = (n == sizeof(hdr)) ? be16(hdr + 4) : 0;
+    rewind(fp);
+
+    if (type == MRT_TABLE_DUMP || type == MRT_TABLE_DUMP_V2 ||
+        type == MRT_BGP4MP || type == MRT_BGP4MP_ET) {
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        rewind(fp);
+        uint8_t *buf = bsd_malloc(size > 0 ? size : 1, M_RTABLE, M_WAITOK);
+        if (fread(buf, 1, size, fp) != (size_t)size) {
+            fprintf(stderr, "%s: short read\n", path);
+            bsd_free(buf, M_RTABLE);
+            fclose(fp);
+            return -1;
+        }
+        load_mrt(buf, size, evs);
+        bsd_free(buf, M_RTABLE);
+    } else {
+        load_text(fp, evs);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Synthetic input */
+
+/* IPv4 prefix-length mix of the public table, parts per thousand */
+static const struct {
+    uint8_t     plen;
+    uint16_t    weight;
+} synth_plen_mix[] = {
+    { 8, 1 }, { 12, 2 }, { 14, 3 }, { 15, 4 }, { 16, 14 }, { 17, 8 },
+    { 18, 14 }, { 19, 25 }, { 20, 42 }, { 21, 45 }, { 22, 110 }, { 23, 80 },
+    { 24, 652 },
+};
+
+static void synth_table(size_t num) {
+    uint32_t seed = 0x9e3779b9;
+
+    for (uint32_t p = 0; p < REPLAY_SYNTH_PEERS; p++) {
+        union replay_sa sa;
+        init_sa(&sa, AF_INET);
+        sa.sin.sin_addr.s_addr = htonl(0xc0000200 + p + 1);  /* 192.0.2.x */
+        nh_intern(&sa);
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        struct replay_ev *ev = evs_push(&rib_evs);
+        uint32_t r = xorshift32(&seed) % 1000;
+        int plen = 24;
+
+        for (size_t b = 0; b < sizeof(synth_plen_mix) / sizeof(synth_plen_mix[0]); b++) {
+            if (r < synth_plen_mix[b].weight) {
+                plen = synth_plen_mix[b].plen;
+                break;
+            }
+            r -= synth_plen_mix[b].weight;
+        }
+
+        /* Unicast space 1.0.0.0 - 223.255.255.255 */
+        uint32_t addr = htonl((1 + xorshift32(&seed) % 223) << 24 |
+                              (xorshift32(&seed) & 0x00ffffff));
+        ev_set_prefix(ev, AF_INET, (const uint8_t *)&addr, 4, plen);
+        /* A few peers carry most paths */
+        uint32_t a = xorshift32(&seed) % REPLAY_SYNTH_PEERS;
+        uint32_t b = xorshift32(&seed) % REPLAY_SYNTH_PEERS;
+        ev->re_nh = 1 + a * b / REPLAY_SYNTH_PEERS;
+    }
+}
+
+/*
+ * Churn on the loaded table: path changes to another nexthop, withdraws,
+ * and re-announcements of withdrawn prefixes, 100us apart on average.
+ */
+static void synth_updates(size_t num) {
+    uint32_t seed = 0x7f4a7c15;
+    uint8_t *down;
+    uint64_t ts = 0;
+
+    if (rib_evs.num == 0)
+        return;
+    down = bsd_malloc(rib_evs.num, M_RTABLE, M_WAITOK | M_ZERO);
+
+    for (size_t i = 0; i < num; i++) {
+        size_t idx = xorshift32(&seed) % rib_evs.num;
+        struct replay_ev *ev = evs_push(&upd_evs);
+
+        *ev = rib_evs.ev[idx];
+        ts += xorshift32(&seed) % 200;
+        ev->re_ts = ts;
+        if (down[idx] || xorshift32(&seed) % 5 != 0) {
+            ev->re_op = REPLAY_ANNOUNCE;
+            ev->re_nh = (nh_count > 1) ? 1 + xorshift32(&seed) % (nh_count - 1) : 0;
+            down[idx] = 0;
+        } else {
+            ev->re_op = REPLAY_WITHDRAW;
+            down[idx] = 1;
+        }
+    }
+    bsd_free(down, M_RTABLE);
+}
+
+/* Measurement */
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *name, uint64_t *s, size_t n) {
+    if (n == 0) {
+        printf("   %-10s no samples\n", name);
+        return;
+    }
+    qsort(s, n, sizeof(*s), u64_cmp);
+    printf("   %-10s n=%zu p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu ns\n",
+           name, n,
+           (unsigned long long)s[(n - 1) * 50 / 100],
+           (unsigned long long)s[(n - 1) * 90 / 100],
+           (unsigned long long)s[(n - 1) * 99 / 100],
+           (unsigned long long)s[(n - 1) * 999 / 1000],
+           (unsigned long long)s[n - 1]);
+}
+
+static int apply_ev(const struct replay_ev *ev) {
+    struct route_info ri = {
+        .ri_dst = (struct sockaddr *)&ev->re_dst,
+        .ri_netmask = (struct sockaddr *)ev_mask(ev),
+        .ri_gateway = ev->re_nh ? (struct sockaddr *)&nh_table[ev->re_nh].rn_sa : NULL,
+    };
+    int error;
+
+    rm_wlock(&rib_lock);
+    if (ev->re_op == REPLAY_WITHDRAW)
+        error = route_delete(ev_rib(ev), ri.ri_dst, ri.ri_netmask);
+    else
+        error = route_change(ev_rib(ev), &ri);  /* Implicit replace */
+    rm_wunlock(&rib_lock);
+    return error;
+}
+
+static void *reader_thread(void *arg) {
+    struct reader_ctx *ctx = arg;
+    struct rm_priotracker tracker;
+    struct route_info ri;
+
+    struct traffic_stream ts4, ts6;
+    union replay_sa dst4, dst6;
+
+    if (traffic4)
+        traffic_stream_init(&ts4, traffic4, ctx->seed);
+    if (traffic6)
+        traffic_stream_init(&ts6, traffic6, ctx->seed + 1);
+    init_sa(&dst4, AF_INET);
+    init_sa(&dst6, AF_INET6);
+
+    while (!atomic_load_explicit(&readers_stop, memory_order_relaxed)) {
+        bool v6 = traffic6 && (!traffic4 || xorshift32(&ctx->seed) < traffic6_share);
+        struct rib_head *rh = v6 ? rib6 : rib4;
+        union replay_sa *dst = v6 ? &dst6 : &dst4;
+
+        traffic_next(v6 ? &ts6 : &ts4, sa_addr(dst, v6 ? AF_INET6 : AF_INET));
+
+        bool sample = (ctx->lookups % REPLAY_SAMPLE_EVERY) == 0;
+        uint64_t t0 = sample ? now_ns() : 0;
+        rm_rlock(&rib_lock, &tracker);
+        int error = route_lookup(rh, &dst->sa, &ri);
+        rm_runlock(&rib_lock, &tracker);
+        if (sample)
+            ctx->samples[ctx->nsamples++ % REPLAY_READER_SAMPLES] = now_ns() - t0;
+
+        ctx->lookups++;
+        if (error == ROUTE_OK)
+            ctx->hits++;
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-r readers] [-n prefixes] [-u updates] [-s speed] [-t traffic]\n"
+           "       [rib [updates]]\n", prog);
+    printf("  -r readers   lookup threads during the update replay (default %d)\n", REPLAY_READERS);
+    printf("  -n prefixes  synthetic table size without a RIB (default %d)\n", REPLAY_SYNTH_PREFIXES);
+    printf("  -u updates   synthetic churn without an update stream (default %d)\n", REPLAY_SYNTH_UPDATES);
+    printf("  -s speed     replay at speed x the recorded rate, 0 = unpaced (default)\n");
+    printf("  -t traffic   reader destinations: sequential, zipf[:s], uniform or\n"
+           "               trace:<path> (default %s, or %s)\n", "zipf", TRAFFIC_ENV);
+}
+
+int main(int argc, char *argv[]) {
+    int readers = REPLAY_READERS;
+    size_t synth_prefixes = REPLAY_SYNTH_PREFIXES;
+    size_t synth_upd = REPLAY_SYNTH_UPDATES;
+    double speed = 0;
+    const char *traffic = traffic_env_spec("zipf");
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:u:s:t:h")) != -1) {
+        switch (opt) {
+            case 'r': readers = atoi(optarg); break;
+            case 'n': synth_prefixes = strtoul(optarg, NULL, 10); break;
+            case 'u': synth_upd = strtoul(optarg, NULL, 10); break;
+            case 's': speed = strtod(optarg, NULL); break;
+            case 't': traffic = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (readers < 0 || readers > REPLAY_MAX_READERS) {
+        fprintf(stderr, "readers must be 0-%d\n", REPLAY_MAX_READERS);
+        return 1;
+    }
+
+    printf("BGP Table Replay Benchmark\n");
+    printf("==========================\n\n");
+
+    if (route_lib_init() != ROUTE_OK) {
+        fprintf(stderr, "route_lib_init failed\n");
+        return 1;
+    }
+    rm_init_flags(&rib_lock, "replay_rib", 0);
+    init_masks();
+    nh_table = bsd_malloc(REPLAY_NH_HASH / 2 * sizeof(*nh_table), M_RTABLE, M_WAITOK | M_ZERO);
+    nh_count = 1;   /* Index 0: no nexthop */
+
+    /* Phase 1: inputs */
+    if (optind < argc) {
+        if (load_file(argv[optind], &rib_evs) != 0)
+            return 1;
+        printf("RIB: %zu prefixes from %s\n", rib_evs.num, argv[optind]);
+    } else {
+        synth_table(synth_prefixes);
+        printf("RIB: %zu synthetic IPv4 prefixes\n", rib_evs.num);
+    }
+    if (optind + 1 < argc) {
+        if (load_file(argv[optind + 1], &upd_evs) != 0)
+            return 1;
+        printf("Updates: %zu from %s\n", upd_evs.num, argv[optind + 1]);
+    }
+    if (rib_evs.num == 0) {
+        fprintf(stderr, "empty RIB\n");
+        return 1;
+    }
+
+    /* Phase 2: table load */
+    rib4 = route_table_create(AF_INET, 0);
+    rib6 = route_table_create(AF_INET6, 0);
+    if (rib4 == NULL || rib6 == NULL) {
+        fprintf(stderr, "route_table_create failed\n");
+        return 1;
+    }
+
+    uint64_t *lat = bsd_malloc(rib_evs.num * sizeof(*lat), M_RTABLE, M_WAITOK);
+    size_t loaded = 0, dups;
+    uint64_t t_start = now_ns();
+    for (size_t i = 0; i < rib_evs.num; i++) {
+        uint64_t t0 = now_ns();
+        int error = apply_ev(&rib_evs.ev[i]);
+        lat[i] = now_ns() - t0;
+        if (error == ROUTE_OK) {
+            loaded++;
+            nh_table[rib_evs.ev[i].re_nh].rn_routes++;
+        }
+    }
+    double load_ms = (now_ns() - t_start) / 1e6;
+
+    struct route_stats st4, st6;
+    route_get_stats(rib4, &st4);
+    route_get_stats(rib6, &st6);
+    /* Repeated prefixes replace the earlier path */
+    dups = loaded - (st4.rs_nodes + st6.rs_nodes);
+
+    uint32_t nh_used = 0, nh_max = 0;
+    for (uint32_t i = 1; i < nh_count; i++) {
+        nh_used += (nh_table[i].rn_routes != 0);
+        if (nh_table[i].rn_routes > nh_max)
+            nh_max = nh_table[i].rn_routes;
+    }
+
+    printf("\nPhase 1: Table load\n");
+    printf("   %zu IPv4 + %zu IPv6 routes in %.2fms (%.2f routes/ms), %zu replaced\n",
+           (size_t)st4.rs_nodes, (size_t)st6.rs_nodes, load_ms, loaded / (load_ms + 0.001), dups);
+    printf("   Nexthop fan-out: %u nexthops, busiest carries %u routes\n", nh_used, nh_max);
+    print_latency("insert", lat, rib_evs.num);
+    bsd_free(lat, M_RTABLE);
+
+    if (upd_evs.num == 0) {
+        synth_updates(synth_upd);
+        printf("\nUpdates: %zu synthetic (path changes, withdraws, re-announcements)\n",
+               upd_evs.num);
+    }
+
+    /* Reader destinations over the loaded table */
+    size_t n4 = 0, n6 = 0;
+    traffic4 = (st4.rs_nodes > 0) ? traffic_create(AF_INET, traffic) : NULL;
+    traffic6 = (st6.rs_nodes > 0) ? traffic_create(AF_INET6, traffic) : NULL;
+    for (size_t i = 0; i < rib_evs.num; i++) {
+        struct replay_ev *ev = &rib_evs.ev[i];
+        struct traffic_gen *gen = (ev->re_family == AF_INET) ? traffic4 : traffic6;
+        if (gen && traffic_add_prefix(gen, sa_addr(&ev->re_dst, ev->re_family), ev->re_plen) == 0)
+            *(ev->re_family == AF_INET ? &n4 : &n6) += 1;
+    }
+    if ((traffic4 && traffic_prepare(traffic4, 0x5eed) != 0) ||
+        (traffic6 && traffic_prepare(traffic6, 0x5eed) != 0) ||
+        (readers > 0 && !traffic4 && !traffic6)) {
+        fprintf(stderr, "bad reader traffic '%s'\n", traffic);
+        return 1;
+    }
+    traffic6_share = (uint32_t)((double)n6 / (n4 + n6 + 0.001) * 4294967295.0);
+    if (traffic4 || traffic6)
+        printf("\nReader traffic: %s\n", traffic_name(traffic4 ? traffic4 : traffic6));
+
+    /* Phase 3: update replay under reader load */
+    struct reader_ctx *rctx = bsd_malloc((readers ? readers : 1) * sizeof(*rctx), M_RTABLE,
+                                         M_WAITOK | M_ZERO);
+    atomic_store(&readers_stop, false);
+    for (int i = 0; i < readers; i++) {
+        rctx[i].seed = 0x12345 + i * 7919;
+        rctx[i].samples = bsd_malloc(REPLAY_READER_SAMPLES * sizeof(uint64_t), M_RTABLE, M_WAITOK);
+        pthread_create(&rctx[i].thread, NULL, reader_thread, &rctx[i]);
+    }
+
+    lat = bsd_malloc((upd_evs.num ? upd_evs.num : 1) * sizeof(*lat), M_RTABLE, M_WAITOK);
+    size_t announces = 0, withdraws = 0, unknown = 0;
+    uint64_t ts0 = upd_evs.num ? upd_evs.ev[0].re_ts : 0;
+    t_start = now_ns();
+    for (size_t i = 0; i < upd_evs.num; i++) {
+        const struct replay_ev *ev = &upd_evs.ev[i];
+
+        if (speed > 0) {
+            /* Keep the recorded spacing, scaled */
+            uint64_t due = t_start + (uint64_t)((ev->re_ts - ts0) * 1000.0 / speed);
+            uint64_t now = now_ns();
+            if (due > now + 100000)
+                usleep((due - now) / 1000);
+            while (now_ns() < due)
+                ;
+        }
+
+        uint64_t t0 = now_ns();
+        int error = apply_ev(ev);
+        lat[i] = now_ns() - t0;
+        if (ev->re_op == REPLAY_WITHDRAW) {
+            withdraws++;
+            unknown += (error == ROUTE_ENOENT);
+        } else {
+            announces++;
+        }
+    }
+    double upd_ms = (now_ns() - t_start) / 1e6;
+
+    atomic_store(&readers_stop, true);
+    uint64_t lookups = 0, hits = 0;
+    size_t nsamples = 0;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(rctx[i].thread, NULL);
+        lookups += rctx[i].lookups;
+        hits += rctx[i].hits;
+        nsamples += (rctx[i].nsamples < REPLAY_READER_SAMPLES) ? rctx[i].nsamples :
+            REPLAY_READER_SAMPLES;
+    }
+
+    printf("\nPhase 2: Update replay, %d readers%s\n", readers,
+           speed > 0 ? "" : ", unpaced");
+    printf("   %zu announces + %zu withdraws (%zu unknown) in %.2fms (%.2f updates/ms)\n",
+           announces, withdraws, unknown, upd_ms, upd_evs.num / (upd_ms + 0.001));
+    print_latency("update", lat, upd_evs.num);
+    bsd_free(lat, M_RTABLE);
+
+    if (readers > 0) {
+        uint64_t *all = bsd_malloc((nsamples ? nsamples : 1) * sizeof(*all), M_RTABLE, M_WAITOK);
+        size_t n = 0;
+        for (int i = 0; i < readers; i++) {
+            size_t k = (rctx[i].nsamples < REPLAY_READER_SAMPLES) ? rctx[i].nsamples :
+                REPLAY_READER_SAMPLES;
+            memcpy(all + n, rctx[i].samples, k * sizeof(*all));
+            n += k;
+            bsd_free(rctx[i].samples, M_RTABLE);
+        }
+        printf("   %llu lookups, %.1f%% hit, %.2f lookups/ms\n",
+               (unsigned long long)lookups, lookups ? hits * 100.0 / lookups : 0.0,
+               lookups / (upd_ms + 0.001));
+        print_latency("lookup", all, n);
+        bsd_free(all, M_RTABLE);
+    }
+    bsd_free(rctx, M_RTABLE);
+
+    struct rm_stats rms;
+    rm_get_stats(&rib_lock, &rms);
+    printf("   Writer lock wait %.2fms, held %.2fms\n",
+           rms.rms_write_wait_ns / 1e6, rms.rms_write_hold_ns / 1e6);
+
+    traffic_destroy(traffic4);
+    traffic_destroy(traffic6);
+    route_table_destroy(rib4);
+    route_table_destroy(rib6);
+    rm_destroy(&rib_lock);
+    bsd_free(nh_table, M_RTABLE);
+    bsd_free(upd_evs.ev, M_RTABLE);
+    bsd_free(rib_evs.ev, M_RTABLE);
+    route_lib_cleanup();
+    return 0;
+}
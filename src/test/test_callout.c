@@ -0,0 +1,298 @@
+/*
+ * Userland Callout and Taskqueue Tests
+ *
+ * Verifies callout expiry, rescheduling and cancellation semantics,
+ * the rmlock stop guarantee, and that tasks are coalesced, never run
+ * concurrently with themselves and are all run when enqueued from
+ * many threads at once.
+ */
+
+#include "test_framework.h"
+#include "../kernel_compat/compat_shim.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define CALLOUT_TEST_WAIT_MS    2000
+#define CALLOUT_TEST_REARMS     5
+#define TASK_TEST_THREADS       4
+#define TASK_TEST_TASKS         256
+#define TASK_TEST_ROUNDS        200
+
+struct callout_test_arg {
+    struct callout          c;
+    _Atomic int             fired;
+    _Atomic uint64_t        fired_ms;
+    int                     rearm;
+};
+
+static void callout_test_handler(void* arg) {
+    struct callout_test_arg* ca = arg;
+
+    if (ca->rearm > 0) {
+        ca->rearm--;
+        callout_reset_sbt(&ca->c, SBT_1MS, 0, callout_test_handler, ca, 0);
+    }
+    atomic_store(&ca->fired_ms, callout_compat_now_ms());
+    atomic_fetch_add(&ca->fired, 1);
+}
+
+static int callout_test_wait(_Atomic int* counter, int value) {
+    uint64_t deadline = callout_compat_now_ms() + CALLOUT_TEST_WAIT_MS;
+
+    while (atomic_load(counter) < value) {
+        if (callout_compat_now_ms() > deadline)
+            return -1;
+        usleep(1000);
+    }
+    return 0;
+}
+
+static int test_callout_expiry(void) {
+    struct callout_test_arg ca = { 0 };
+    uint64_t start;
+
+    callout_init(&ca.c, 1);
+    start = callout_compat_now_ms();
+    TEST_ASSERT_EQ(0, callout_reset_sbt(&ca.c, 20 * SBT_1MS, 0, callout_test_handler, &ca, 0),
+                   "Idle callout should not report a cancellation");
+    TEST_ASSERT_NE(0, callout_pending(&ca.c), "Callout should be pending");
+    TEST_ASSERT_NE(0, callout_active(&ca.c), "Callout should be active");
+
+    TEST_ASSERT_EQ(0, callout_test_wait(&ca.fired, 1), "Callout did not fire");
+    TEST_ASSERT(atomic_load(&ca.fired_ms) >= start + 20, "Callout fired early");
+    TEST_ASSERT_EQ(0, callout_pending(&ca.c), "Fired callout should not be pending");
+
+    /* Ticks based API */
+    callout_reset(&ca.c, hz / 100, callout_test_handler, &ca);
+    TEST_ASSERT_EQ(0, callout_test_wait(&ca.fired, 2), "callout_reset() did not fire");
+
+    callout_drain(&ca.c);
+    TEST_PASS();
+}
+
+static int test_callout_reset_stop(void) {
+    struct callout_test_arg ca = { 0 };
+
+    callout_init(&ca.c, 1);
+
+    /* A stopped callout never fires */
+    callout_reset_sbt(&ca.c, 10 * SBT_1MS, 0, callout_test_handler, &ca, 0);
+    TEST_ASSERT_EQ(1, callout_stop(&ca.c), "Pending callout should be cancelled");
+    TEST_ASSERT_EQ(0, callout_active(&ca.c), "Stopped callout should be inactive");
+    TEST_ASSERT_EQ(0, callout_stop(&ca.c), "Second stop has nothing to cancel");
+    usleep(50 * 1000);
+    TEST_ASSERT_EQ(0, atomic_load(&ca.fired), "Stopped callout fired");
+
+    /* Rescheduling replaces the previous expiry */
+    callout_reset_sbt(&ca.c, 10 * SBT_1S, 0, callout_test_handler, &ca, 0);
+    TEST_ASSERT_EQ(1, callout_reset_sbt(&ca.c, 5 * SBT_1MS, 0, callout_test_handler, &ca, 0),
+                   "Rescheduling should cancel the pending expiry");
+    TEST_ASSERT_EQ(0, callout_test_wait(&ca.fired, 1), "Rescheduled callout did not fire");
+    usleep(20 * 1000);
+    TEST_ASSERT_EQ(1, atomic_load(&ca.fired), "Callout should fire once");
+
+    /* Expiry beyond one wheel rotation */
+    callout_reset_sbt(&ca.c, 700 * SBT_1MS, 0, callout_test_handler, &ca, 0);
+    usleep(300 * 1000);
+    TEST_ASSERT_EQ(1, atomic_load(&ca.fired), "Callout fired a rotation early");
+    TEST_ASSERT_EQ(0, callout_test_wait(&ca.fired, 2), "Long callout did not fire");
+
+    /* Handler rescheduling itself, then drained */
+    ca.rearm = CALLOUT_TEST_REARMS;
+    callout_reset_sbt(&ca.c, SBT_1MS, 0, callout_test_handler, &ca, 0);
+    TEST_ASSERT_EQ(0, callout_test_wait(&ca.fired, 3 + CALLOUT_TEST_REARMS),
+                   "Rearming callout stopped early");
+    callout_drain(&ca.c);
+    TEST_ASSERT_EQ(0, callout_pending(&ca.c), "Drained callout should not be pending");
+
+    TEST_PASS();
+}
+
+static struct rmlock callout_test_lock;
+static _Atomic int callout_test_locked;
+
+static void callout_test_locked_handler(void* arg) {
+    struct callout_test_arg* ca = arg;
+
+    /* Runs with the write lock held */
+    if (atomic_load(&callout_test_lock.rm_writer) != 0)
+        atomic_fetch_add(&callout_test_locked, 1);
+    atomic_fetch_add(&ca->fired, 1);
+}
+
+static int test_callout_rmlock(void) {
+    struct callout_test_arg ca = { 0 };
+
+    rm_init_flags(&callout_test_lock, "callout_test", 0);
+    callout_init_rm(&ca.c, &callout_test_lock, 0);
+    atomic_store(&callout_test_locked, 0);
+
+    /* Handler blocks on the lock, stop under the lock cancels it */
+    rm_wlock(&callout_test_lock);
+    callout_reset_sbt(&ca.c, SBT_1MS, 0, callout_test_locked_handler, &ca, 0);
+    usleep(30 * 1000);
+    TEST_ASSERT_EQ(1, callout_stop(&ca.c), "Expired callout should be cancelled");
+    rm_wunlock(&callout_test_lock);
+    callout_drain(&ca.c);
+    TEST_ASSERT_EQ(0, atomic_load(&ca.fired), "Handler ran after callout_stop()");
+
+    callout_reset_sbt(&ca.c, SBT_1MS, 0, callout_test_locked_handler, &ca, 0);
+    TEST_ASSERT_EQ(0, callout_test_wait(&ca.fired, 1), "Locked callout did not fire");
+    callout_drain(&ca.c);
+    TEST_ASSERT_EQ(1, atomic_load(&callout_test_locked), "Handler should hold the lock");
+
+    rm_destroy(&callout_test_lock);
+    TEST_PASS();
+}
+
+struct task_test_arg {
+    struct task             t;
+    _Atomic int             runs;
+    _Atomic int             pending;
+    _Atomic int             running;
+    _Atomic int             overlaps;
+    _Atomic int             release;
+};
+
+static void task_test_handler(void* arg, int pending) {
+    struct task_test_arg* ta = arg;
+
+    if (atomic_fetch_add(&ta->running, 1) != 0)
+        atomic_fetch_add(&ta->overlaps, 1);
+    while (!atomic_load(&ta->release))
+        usleep(1000);
+    atomic_fetch_add(&ta->pending, pending);
+    atomic_fetch_add(&ta->runs, 1);
+    atomic_fetch_sub(&ta->running, 1);
+}
+
+static int test_task_coalesce(void) {
+    struct task_test_arg ta = { 0 };
+    u_int pending;
+
+    TASK_INIT(&ta.t, 0, task_test_handler, &ta);
+
+    /* Enqueues while running are coalesced into one more run */
+    taskqueue_enqueue(taskqueue_thread, &ta.t);
+    while (atomic_load(&ta.running) == 0)
+        usleep(1000);
+    for (int i = 0; i < 3; i++)
+        taskqueue_enqueue(taskqueue_thread, &ta.t);
+    TEST_ASSERT_EQ(EBUSY, taskqueue_cancel(taskqueue_thread, &ta.t, &pending),
+                   "Running task cannot be cancelled");
+    TEST_ASSERT_EQ(3, pending, "Enqueues should be counted");
+    atomic_store(&ta.release, 1);
+    taskqueue_drain(taskqueue_thread, &ta.t);
+
+    TEST_ASSERT_EQ(2, atomic_load(&ta.runs), "Coalesced task should run twice");
+    TEST_ASSERT_EQ(4, atomic_load(&ta.pending), "Handler should see every enqueue");
+    TEST_ASSERT_EQ(0, atomic_load(&ta.overlaps), "Task ran concurrently with itself");
+
+    TEST_PASS();
+}
+
+static struct task_test_arg task_test_tasks[TASK_TEST_TASKS];
+
+static void* task_test_enqueuer(void* arg) {
+    (void)arg;
+    for (int r = 0; r < TASK_TEST_ROUNDS; r++) {
+        for (int i = 0; i < TASK_TEST_TASKS; i++)
+            taskqueue_enqueue(taskqueue_fast, &task_test_tasks[i].t);
+    }
+    return NULL;
+}
+
+static int test_task_concurrent(void) {
+    pthread_t threads[TASK_TEST_THREADS];
+    int runs = 0, pending = 0, overlaps = 0;
+    perf_timer_t timer;
+
+    for (int i = 0; i < TASK_TEST_TASKS; i++) {
+        memset(&task_test_tasks[i], 0, sizeof(task_test_tasks[i]));
+        atomic_store(&task_test_tasks[i].release, 1);
+        TASK_INIT(&task_test_tasks[i].t, 0, task_test_handler, &task_test_tasks[i]);
+    }
+
+    PERF_START(&timer);
+    for (int i = 0; i < TASK_TEST_THREADS; i++)
+        pthread_create(&threads[i], NULL, task_test_enqueuer, NULL);
+    for (int i = 0; i < TASK_TEST_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < TASK_TEST_TASKS; i++)
+        taskqueue_drain(taskqueue_fast, &task_test_tasks[i].t);
+    PERF_END(&timer);
+
+    for (int i = 0; i < TASK_TEST_TASKS; i++) {
+        runs += atomic_load(&task_test_tasks[i].runs);
+        pending += atomic_load(&task_test_tasks[i].pending);
+        overlaps += atomic_load(&task_test_tasks[i].overlaps);
+    }
+    test_log_info("%d enqueues, %d runs in %.2f ms",
+                  TASK_TEST_THREADS * TASK_TEST_ROUNDS * TASK_TEST_TASKS, runs,
+                  timer.elapsed_ms);
+
+    TEST_ASSERT_EQ(TASK_TEST_THREADS * TASK_TEST_ROUNDS * TASK_TEST_TASKS, pending,
+                   "Every enqueue should be accounted to a run");
+    TEST_ASSERT_EQ(0, overlaps, "Task ran concurrently with itself");
+
+    TEST_PASS();
+}
+
+/* Test suite definition */
+static test_case_t callout_tests[] = {
+    TEST_CASE(callout_expiry,
+              "Test callout fires after its timeout",
+              test_callout_expiry),
+
+    TEST_CASE(callout_reset_stop,
+              "Test callout rescheduling, stop and drain",
+              test_callout_reset_stop),
+
+    TEST_CASE(callout_rmlock,
+              "Test rmlock callouts and the stop guarantee",
+              test_callout_rmlock),
+
+    TEST_CASE(task_coalesce,
+              "Test task coalescing and cancel",
+              test_task_coalesce),
+
+    TEST_CASE(task_concurrent,
+              "Test tasks enqueued from many threads",
+              test_task_concurrent),
+
+    TEST_SUITE_END()
+};
+
+test_suite_t callout_test_suite = {
+    "Userland Callout Tests",
+    "Test suite for the compat callouts and taskqueues",
+    callout_tests,
+    0,  /* num_tests calculated at runtime */
+    NULL,
+    NULL  /* teardown */
+};
+
+/* Main test runner */
+int main(void) {
+    printf("Userland Callout Test Suite\n");
+    printf("===========================\n\n");
+
+    if (test_framework_init() != 0) {
+        fprintf(stderr, "Failed to initialize test framework\n");
+        return 1;
+    }
+
+    int count = 0;
+    while (callout_tests[count].name != NULL) {
+        count++;
+    }
+    callout_test_suite.num_tests = count;
+
+    int result = test_run_suite(&callout_test_suite);
+
+    test_print_summary();
+    test_framework_cleanup();
+
+    return (result != 0 || g_test_result.failed_tests > 0) ? 1 : 0;
+}
@@ -94,6 +94,327 @@ static int test_socket_address(void) {
     TEST_PASS();
 }
 
+#define COUNTER_TEST_THREADS 8
+#define COUNTER_TEST_ADDS    100000
+#define UMA_TEST_THREADS     8
+#define UMA_TEST_BATCH       1000
+#define UMA_TEST_ROUNDS      200
+
+static void* counter_adder(void* arg) {
+    counter_u64_t c = arg;
+
+    for (int i = 0; i < COUNTER_TEST_ADDS; i++) {
+        counter_u64_add(c, 1);
+    }
+    return NULL;
+}
+
+static int test_compat_counters(void) {
+    pthread_t threads[COUNTER_TEST_THREADS];
+    counter_u64_t c;
+
+    c = counter_u64_alloc(M_WAITOK);
+    TEST_ASSERT_NOT_NULL(c, "Should allocate counter");
+    TEST_ASSERT_EQ(0, counter_u64_fetch(c), "New counter should be zero");
+
+    counter_u64_add(c, 5);
+    counter_u64_add(c, -2);
+    TEST_ASSERT_EQ(3, counter_u64_fetch(c), "Counter should accept negative increments");
+    counter_u64_zero(c);
+
+    /* Concurrent increments must not be lost */
+    for (int i = 0; i < COUNTER_TEST_THREADS; i++) {
+        pthread_create(&threads[i], NULL, counter_adder, c);
+    }
+    for (int i = 0; i < COUNTER_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    TEST_ASSERT_EQ((uint64_t)COUNTER_TEST_THREADS * COUNTER_TEST_ADDS, counter_u64_fetch(c),
+                   "Sharded counter should sum all thread increments");
+
+    counter_u64_free(c);
+
+    TEST_PASS();
+}
+
+static void* uma_worker(void* arg) {
+    uma_zone_t zone = arg;
+    uint64_t* items[UMA_TEST_BATCH];
+
+    for (int round = 0; round < UMA_TEST_ROUNDS; round++) {
+        for (int i = 0; i < UMA_TEST_BATCH; i++) {
+            items[i] = uma_zalloc(zone, M_WAITOK);
+            *items[i] = (uintptr_t)items[i];
+        }
+        for (int i = 0; i < UMA_TEST_BATCH; i++) {
+            if (*items[i] != (uintptr_t)items[i]) {
+                return (void*)1;
+            }
+            uma_zfree(zone, items[i]);
+        }
+    }
+    return NULL;
+}
+
+static int test_compat_uma(void) {
+    pthread_t threads[UMA_TEST_THREADS];
+    struct uma_zone_stats stats;
+    uma_zone_t zone;
+    char *a, *b;
+    void* ret;
+
+    zone = uma_zcreate("test", 40, NULL, NULL, NULL, NULL, UMA_ALIGN_CACHE, 0);
+    TEST_ASSERT_NOT_NULL(zone, "Should create zone");
+
+    a = uma_zalloc(zone, M_WAITOK | M_ZERO);
+    b = uma_zalloc(zone, M_WAITOK | M_ZERO);
+    TEST_ASSERT_NOT_NULL(a, "Should allocate from zone");
+    TEST_ASSERT(a != b, "Items should be distinct");
+    TEST_ASSERT_EQ(0, (uintptr_t)a % 64, "Items should honour zone alignment");
+    TEST_ASSERT_EQ(0, a[39], "M_ZERO should clear the item");
+    TEST_ASSERT_EQ(2, uma_zone_get_cur(zone), "Two items should be in use");
+
+    /* A freed item is reused from the thread magazine */
+    uma_zfree(zone, b);
+    TEST_ASSERT(uma_zalloc(zone, M_WAITOK) == b, "Freed item should be reused first");
+    uma_zfree(zone, b);
+    uma_zfree(zone, a);
+
+    /* Concurrent alloc/free through per-thread magazines */
+    for (int i = 0; i < UMA_TEST_THREADS; i++) {
+        pthread_create(&threads[i], NULL, uma_worker, zone);
+    }
+    for (int i = 0; i < UMA_TEST_THREADS; i++) {
+        pthread_join(threads[i], &ret);
+        TEST_ASSERT(ret == NULL, "Items should not be shared between threads");
+    }
+
+    uma_zone_get_stats(zone, &stats);
+    TEST_ASSERT_EQ(0, uma_zone_get_cur(zone), "All items should be freed");
+    TEST_ASSERT_EQ(64, stats.uzs_item_size, "Item stride should be aligned");
+    TEST_ASSERT_EQ(stats.uzs_allocs, stats.uzs_frees, "Allocs and frees should balance");
+    TEST_ASSERT(stats.uzs_slabs > 0, "Zone should hold at least one slab");
+
+    uma_zdestroy(zone);
+
+    TEST_PASS();
+}
+
+static int test_compat_hugepage(void) {
+    struct hugepage_stats before, hs;
+    struct malloc_type_stats mts_before, mts;
+    struct uma_zone_stats stats;
+    uma_zone_t zone;
+    char *big, *small;
+    void* items[512];
+
+    hugepage_fetch(&before);
+    malloc_type_fetch(M_TEMP, &mts_before);
+
+    /* Large allocations of enabled types are mapped, small ones are not */
+    malloc_type_set_hugepage(M_TEMP, true);
+    big = bsd_malloc(3 * HUGEPAGE_SIZE / 2, M_TEMP, M_WAITOK | M_ZERO);
+    small = bsd_malloc(4096, M_TEMP, M_WAITOK);
+    TEST_ASSERT_NOT_NULL(big, "Should allocate a huge page region");
+    TEST_ASSERT_EQ(0, (uintptr_t)big % HUGEPAGE_SIZE, "Region should be aligned");
+    TEST_ASSERT_EQ(0, big[3 * HUGEPAGE_SIZE / 2 - 1], "Region should be zeroed");
+    hugepage_fetch(&hs);
+    TEST_ASSERT_EQ(before.hs_regions + 1, hs.hs_regions, "Only the large one should be mapped");
+    TEST_ASSERT_EQ(before.hs_bytes + 2 * HUGEPAGE_SIZE, hs.hs_bytes,
+                   "Region should be rounded to huge pages");
+    malloc_type_fetch(M_TEMP, &mts);
+    TEST_ASSERT(mts.mts_bytes >= mts_before.mts_bytes + 2 * HUGEPAGE_SIZE,
+                "Region should be accounted to its type");
+
+    malloc_type_set_hugepage(M_TEMP, false);
+    bsd_free(big, M_TEMP);
+    bsd_free(small, M_TEMP);
+    hugepage_fetch(&hs);
+    TEST_ASSERT_EQ(before.hs_regions, hs.hs_regions, "Region should be unmapped");
+    malloc_type_fetch(M_TEMP, &mts);
+    TEST_ASSERT_EQ(mts_before.mts_bytes, mts.mts_bytes, "Bytes should balance");
+
+    /* Zones switch to huge page slabs once they hold one huge page */
+    zone = uma_zcreate("test_huge", 4096, NULL, NULL, NULL, NULL, UMA_ALIGN_CACHE,
+                       UMA_ZONE_HUGEPAGE);
+    TEST_ASSERT_NOT_NULL(zone, "Should create zone");
+    for (int i = 0; i < 512; i++) {
+        items[i] = uma_zalloc(zone, M_WAITOK);
+        TEST_ASSERT_NOT_NULL(items[i], "Should allocate from zone");
+    }
+    uma_zone_get_stats(zone, &stats);
+    hugepage_fetch(&hs);
+    TEST_ASSERT(hs.hs_regions > before.hs_regions, "Zone should map huge page slabs");
+    TEST_ASSERT(stats.uzs_slab_bytes >= 2 * HUGEPAGE_SIZE, "Slab bytes should add up");
+    for (int i = 0; i < 512; i++) {
+        uma_zfree(zone, items[i]);
+    }
+    uma_zdestroy(zone);
+    hugepage_fetch(&hs);
+    TEST_ASSERT_EQ(before.hs_bytes, hs.hs_bytes, "Slabs should be unmapped");
+
+    TEST_PASS();
+}
+
+#define MALLOC_TEST_THREADS 4
+#define MALLOC_TEST_ALLOCS  1000
+
+static void* malloc_worker(void* arg) {
+    void* ptrs[MALLOC_TEST_ALLOCS];
+    (void)arg;
+
+    for (int i = 0; i < MALLOC_TEST_ALLOCS; i++) {
+        ptrs[i] = bsd_malloc(256, M_NHOP, M_WAITOK);
+    }
+    for (int i = 0; i < MALLOC_TEST_ALLOCS; i++) {
+        bsd_free(ptrs[i], M_NHOP);
+    }
+    return NULL;
+}
+
+static int test_compat_malloc_types(void) {
+    pthread_t threads[MALLOC_TEST_THREADS];
+    struct malloc_type_stats before, mts;
+    void* ptr;
+
+    TEST_ASSERT(strcmp(malloc_type_name(M_NHOP), "nhops") == 0, "Type should be named");
+    TEST_ASSERT(strcmp(malloc_type_name(1000), "other") == 0, "Unknown types share a slot");
+
+    malloc_type_fetch(M_NHGRP, &before);
+    ptr = bsd_malloc(1000, M_NHGRP, M_WAITOK);
+    malloc_type_fetch(M_NHGRP, &mts);
+    TEST_ASSERT_EQ(before.mts_objects + 1, mts.mts_objects, "Allocation should be counted");
+    TEST_ASSERT(mts.mts_bytes >= before.mts_bytes + 1000, "Bytes should be counted");
+    bsd_free(ptr, M_NHGRP);
+    malloc_type_fetch(M_NHGRP, &mts);
+    TEST_ASSERT_EQ(before.mts_objects, mts.mts_objects, "Free should be counted");
+    TEST_ASSERT_EQ(before.mts_bytes, mts.mts_bytes, "Bytes should balance");
+    TEST_ASSERT_EQ(before.mts_frees + 1, mts.mts_frees, "Frees should be counted");
+
+    /* Concurrent threads, high-water mark within a batch per thread */
+    malloc_type_fetch(M_NHOP, &before);
+    for (int i = 0; i < MALLOC_TEST_THREADS; i++) {
+        pthread_create(&threads[i], NULL, malloc_worker, NULL);
+    }
+    for (int i = 0; i < MALLOC_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    malloc_type_fetch(M_NHOP, &mts);
+    TEST_ASSERT_EQ(before.mts_bytes, mts.mts_bytes, "Bytes should balance across threads");
+    TEST_ASSERT_EQ(before.mts_allocs + MALLOC_TEST_THREADS * MALLOC_TEST_ALLOCS,
+                   mts.mts_allocs, "All allocations should be counted");
+    TEST_ASSERT(mts.mts_hiwat >= 256 * MALLOC_TEST_ALLOCS - MALLOC_HIWAT_BATCH,
+                "High-water mark should see the peak");
+
+    TEST_PASS();
+}
+
+SDT_PROBE_DEFINE2(route, test, sdt, fire, "int", "int");
+
+static int test_compat_sdt(void) {
+    struct sdt_record recs[4];
+    uint64_t pos = 0;
+    size_t n;
+
+    /* Disabled probes do not evaluate their arguments */
+    sdt_trace_read(recs, 0, &pos);
+    SDT_PROBE2(route, test, sdt, fire, (abort(), 1), 2);
+
+    TEST_ASSERT_EQ(1, sdt_probe_enable("route:test:*", true), "Pattern should match the probe");
+    SDT_PROBE2(route, test, sdt, fire, 1, 2);
+    SDT_PROBE2(route, test, sdt, fire, 3, 4);
+    TEST_ASSERT_EQ(1, sdt_probe_enable("route:test:sdt:fire", false), "Probe should be disabled");
+    SDT_PROBE2(route, test, sdt, fire, 5, 6);
+
+    n = sdt_trace_read(recs, 4, &pos);
+    TEST_ASSERT_EQ(2, n, "Enabled firings should be recorded");
+    TEST_ASSERT(strcmp(recs[0].sr_probe->sdtp_name, "route:test:sdt:fire") == 0,
+                "Record should name its probe");
+    TEST_ASSERT_EQ(1, recs[0].sr_args[0], "Arguments should be recorded");
+    TEST_ASSERT_EQ(4, recs[1].sr_args[1], "Records should be in order");
+    TEST_ASSERT(recs[1].sr_nsec >= recs[0].sr_nsec, "Timestamps should be monotonic");
+    TEST_ASSERT_EQ(0, sdt_trace_read(recs, 4, &pos), "Read should advance the position");
+
+    TEST_PASS();
+}
+
+#define RM_TEST_READERS     6
+#define RM_TEST_WRITERS     2
+#define RM_TEST_ROUNDS      2000
+
+static struct rmlock rm_test_lock;
+static uint64_t rm_test_a, rm_test_b;
+static _Atomic int rm_test_bad;
+
+static void* rm_reader(void* arg) {
+    struct rm_priotracker t1, t2;
+    (void)arg;
+
+    for (int i = 0; i < RM_TEST_ROUNDS; i++) {
+        rm_rlock(&rm_test_lock, &t1);
+        /* Recursion must not block behind a pending writer */
+        rm_rlock(&rm_test_lock, &t2);
+        if (rm_test_a != rm_test_b)
+            atomic_fetch_add(&rm_test_bad, 1);
+        rm_runlock(&rm_test_lock, &t2);
+        rm_runlock(&rm_test_lock, &t1);
+    }
+    return NULL;
+}
+
+static void* rm_writer(void* arg) {
+    bool fair = (arg != NULL);
+
+    for (int i = 0; i < RM_TEST_ROUNDS / 10; i++) {
+        rm_wlock_advanced(&rm_test_lock, fair);
+        rm_test_a++;
+        sched_yield();
+        rm_test_b++;
+        rm_wunlock(&rm_test_lock);
+    }
+    return NULL;
+}
+
+static int test_compat_rmlock(void) {
+    pthread_t threads[RM_TEST_READERS + RM_TEST_WRITERS];
+    struct rm_priotracker tracker;
+    struct rm_stats stats;
+
+    TEST_ASSERT_EQ(0, rm_init_flags(&rm_test_lock, "test_rmlock", 0), "Should init rmlock");
+
+    rm_rlock(&rm_test_lock, &tracker);
+    rm_get_stats(&rm_test_lock, &stats);
+    TEST_ASSERT_EQ(1, stats.rms_readers, "Reader should be accounted");
+    rm_runlock(&rm_test_lock, &tracker);
+
+    for (int i = 0; i < RM_TEST_READERS; i++) {
+        pthread_create(&threads[i], NULL, rm_reader, NULL);
+    }
+    for (int i = 0; i < RM_TEST_WRITERS; i++) {
+        pthread_create(&threads[RM_TEST_READERS + i], NULL, rm_writer,
+                       (i & 1) ? &stats : NULL);
+    }
+    for (int i = 0; i < RM_TEST_READERS + RM_TEST_WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    rm_get_stats(&rm_test_lock, &stats);
+    TEST_ASSERT_EQ(0, atomic_load(&rm_test_bad), "Readers should never see a writer");
+    TEST_ASSERT_EQ(1 + 2 * RM_TEST_READERS * RM_TEST_ROUNDS, stats.rms_reads,
+                   "All read acquisitions should be counted");
+    TEST_ASSERT_EQ(RM_TEST_WRITERS * (RM_TEST_ROUNDS / 10), stats.rms_writes,
+                   "All write acquisitions should be counted");
+    TEST_ASSERT(stats.rms_read_samples > 0, "Read sections should be sampled");
+    TEST_ASSERT(stats.rms_read_samples <= stats.rms_reads / RM_STATS_SAMPLE + RM_TEST_READERS + 1,
+                "Only one section out of RM_STATS_SAMPLE should be timed");
+    TEST_ASSERT_EQ(0, stats.rms_readers, "No reader should be left");
+    TEST_ASSERT_EQ(0, stats.rms_writers, "No writer should be left");
+
+    rm_destroy(&rm_test_lock);
+
+    TEST_PASS();
+}
+
 /* Test suite definition */
 static test_case_t compat_tests[] = {
     TEST_CASE(compat_basic,
@@ -112,6 +433,30 @@ static test_case_t compat_tests[] = {
               "Test socket address operations",
               test_socket_address),
 
+    TEST_CASE(compat_counters,
+              "Test sharded counter_u64 operations",
+              test_compat_counters),
+
+    TEST_CASE(compat_uma,
+              "Test UMA zone allocation and magazines",
+              test_compat_uma),
+
+    TEST_CASE(compat_malloc_types,
+              "Test per-type malloc accounting",
+              test_compat_malloc_types),
+
+    TEST_CASE(compat_hugepage,
+              "Test huge page backed malloc types and zones",
+              test_compat_hugepage),
+
+    TEST_CASE(compat_sdt,
+              "Test static tracepoints and the trace ring",
+              test_compat_sdt),
+
+    TEST_CASE(compat_rmlock,
+              "Test rmlock exclusion and statistics",
+              test_compat_rmlock),
+
     TEST_SUITE_END()
 };
 
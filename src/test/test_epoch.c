@@ -0,0 +1,379 @@
+/*
+ * Userland Epoch Tests
+ *
+ * Verifies that the compat epoch defers reclamation until all readers
+ * inside a section have left, and that concurrent readers never observe
+ * an object freed through NET_EPOCH_CALL().
+ */
+
+#include "test_framework.h"
+#include "../kernel_compat/compat_shim.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define EPOCH_TEST_READERS      4
+#define EPOCH_TEST_UPDATES      20000
+#define EPOCH_TEST_MAGIC        0x5eed5eedU
+#define EPOCH_TEST_PRESSURE_LIMIT 64
+#define EPOCH_TEST_PRESSURE_CBS 100
+#define EPOCH_TEST_SIZED_CBS    16
+
+struct epoch_test_obj {
+    uint32_t                magic;
+    uint32_t                value;
+    struct epoch_context    ctx;
+};
+
+static _Atomic(struct epoch_test_obj *) test_obj;
+static _Atomic int test_stop;
+static _Atomic int test_reader_ready;
+static _Atomic int test_reader_release;
+static _Atomic uint64_t test_freed;
+static _Atomic uint64_t test_bad_reads;
+static _Atomic int test_newcomer_done;
+
+static void test_obj_free_epoch(epoch_context_t ctx) {
+    struct epoch_test_obj* obj = __containerof(ctx, struct epoch_test_obj, ctx);
+
+    /* Poison before freeing so a premature reclaim is visible to readers */
+    obj->magic = 0;
+    bsd_free(obj, M_RTABLE);
+    atomic_fetch_add(&test_freed, 1);
+}
+
+static int epoch_setup(void) {
+    kernel_compat_init();
+    return (net_epoch_preempt != NULL) ? 0 : -1;
+}
+
+static int test_epoch_nesting(void) {
+    struct epoch_tracker et1, et2;
+
+    TEST_ASSERT_EQ(0, in_epoch(net_epoch_preempt), "Should start outside epoch");
+
+    NET_EPOCH_ENTER(et1);
+    TEST_ASSERT_NE(0, in_epoch(net_epoch_preempt), "Should be inside epoch");
+    NET_EPOCH_ENTER(et2);
+    NET_EPOCH_ASSERT();
+    NET_EPOCH_EXIT(et2);
+    TEST_ASSERT_NE(0, in_epoch(net_epoch_preempt), "Outer section still active");
+    NET_EPOCH_EXIT(et1);
+
+    TEST_ASSERT_EQ(0, in_epoch(net_epoch_preempt), "Should be outside epoch");
+
+    /* Grace period with no readers must not block */
+    NET_EPOCH_WAIT();
+
+    TEST_PASS();
+}
+
+static void* blocking_reader(void* arg) {
+    struct epoch_tracker et;
+    (void)arg;
+
+    NET_EPOCH_ENTER(et);
+    atomic_store(&test_reader_ready, 1);
+    while (!atomic_load(&test_reader_release))
+        usleep(1000);
+    NET_EPOCH_EXIT(et);
+
+    return NULL;
+}
+
+static int test_epoch_deferred_free(void) {
+    struct epoch_test_obj* obj;
+    pthread_t reader;
+
+    atomic_store(&test_freed, 0);
+    atomic_store(&test_reader_ready, 0);
+    atomic_store(&test_reader_release, 0);
+
+    pthread_create(&reader, NULL, blocking_reader, NULL);
+    while (!atomic_load(&test_reader_ready))
+        usleep(1000);
+
+    obj = bsd_malloc(sizeof(*obj), M_RTABLE, M_WAITOK | M_ZERO);
+    obj->magic = EPOCH_TEST_MAGIC;
+    NET_EPOCH_CALL(test_obj_free_epoch, &obj->ctx);
+
+    /* Reader is still in the section, callback must be held back */
+    usleep(50 * 1000);
+    TEST_ASSERT_EQ(0, atomic_load(&test_freed),
+                   "Callback ran while a reader was inside the epoch");
+
+    atomic_store(&test_reader_release, 1);
+    pthread_join(reader, NULL);
+    epoch_drain_callbacks(net_epoch_preempt);
+
+    TEST_ASSERT_EQ(1, atomic_load(&test_freed),
+                   "Callback should run after the reader left");
+
+    TEST_PASS();
+}
+
+static void* newcomer_reader(void* arg) {
+    struct epoch_tracker et;
+    (void)arg;
+
+    /* First section of the thread, registers its record */
+    NET_EPOCH_ENTER(et);
+    NET_EPOCH_EXIT(et);
+    atomic_store(&test_newcomer_done, 1);
+
+    return NULL;
+}
+
+static void* waiting_writer(void* arg) {
+    (void)arg;
+
+    NET_EPOCH_WAIT();
+    return NULL;
+}
+
+static int test_epoch_wait_newcomer(void) {
+    pthread_t reader, writer, newcomer;
+    int done = 0;
+
+    atomic_store(&test_reader_ready, 0);
+    atomic_store(&test_reader_release, 0);
+    atomic_store(&test_newcomer_done, 0);
+
+    pthread_create(&reader, NULL, blocking_reader, NULL);
+    while (!atomic_load(&test_reader_ready))
+        usleep(1000);
+    pthread_create(&writer, NULL, waiting_writer, NULL);
+    usleep(50 * 1000);
+
+    /* A grace period in progress must not keep new readers out */
+    pthread_create(&newcomer, NULL, newcomer_reader, NULL);
+    for (int i = 0; i < 2000 && !done; i++) {
+        usleep(1000);
+        done = atomic_load(&test_newcomer_done);
+    }
+
+    atomic_store(&test_reader_release, 1);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    pthread_join(newcomer, NULL);
+
+    TEST_ASSERT_NE(0, done, "A new reader should enter while a writer waits");
+
+    TEST_PASS();
+}
+
+static void* stress_reader(void* arg) {
+    struct epoch_tracker et;
+    struct epoch_test_obj* obj;
+    uint64_t* reads = arg;
+
+    atomic_fetch_add(&test_reader_ready, 1);
+    while (!atomic_load(&test_stop)) {
+        NET_EPOCH_ENTER(et);
+        obj = atomic_load_explicit(&test_obj, memory_order_acquire);
+        if (obj != NULL && obj->magic != EPOCH_TEST_MAGIC)
+            atomic_fetch_add(&test_bad_reads, 1);
+        NET_EPOCH_EXIT(et);
+        (*reads)++;
+    }
+
+    return NULL;
+}
+
+static int test_epoch_concurrent_reclaim(void) {
+    pthread_t readers[EPOCH_TEST_READERS];
+    uint64_t reads[EPOCH_TEST_READERS] = { 0 };
+    struct epoch_test_obj *obj, *old;
+    uint64_t total_reads = 0;
+    perf_timer_t timer;
+
+    atomic_store(&test_stop, 0);
+    atomic_store(&test_freed, 0);
+    atomic_store(&test_bad_reads, 0);
+    atomic_store(&test_reader_ready, 0);
+
+    for (int i = 0; i < EPOCH_TEST_READERS; i++)
+        pthread_create(&readers[i], NULL, stress_reader, &reads[i]);
+    while (atomic_load(&test_reader_ready) < EPOCH_TEST_READERS)
+        usleep(1000);
+
+    PERF_START(&timer);
+    for (uint32_t i = 0; i < EPOCH_TEST_UPDATES; i++) {
+        obj = bsd_malloc(sizeof(*obj), M_RTABLE, M_WAITOK | M_ZERO);
+        obj->magic = EPOCH_TEST_MAGIC;
+        obj->value = i;
+        old = atomic_exchange_explicit(&test_obj, obj, memory_order_acq_rel);
+        if (old != NULL)
+            NET_EPOCH_CALL(test_obj_free_epoch, &old->ctx);
+        if ((i % 1000) == 0)
+            sched_yield();
+    }
+    PERF_END(&timer);
+
+    atomic_store(&test_stop, 1);
+    for (int i = 0; i < EPOCH_TEST_READERS; i++) {
+        pthread_join(readers[i], NULL);
+        total_reads += reads[i];
+    }
+
+    old = atomic_exchange(&test_obj, NULL);
+    NET_EPOCH_CALL(test_obj_free_epoch, &old->ctx);
+    epoch_drain_callbacks(net_epoch_preempt);
+
+    test_log_info("%u updates, %llu reads in %.2f ms", EPOCH_TEST_UPDATES,
+                  (unsigned long long)total_reads, timer.elapsed_ms);
+
+    TEST_ASSERT_EQ(0, atomic_load(&test_bad_reads),
+                   "Readers observed reclaimed objects");
+    TEST_ASSERT_EQ(EPOCH_TEST_UPDATES, atomic_load(&test_freed),
+                   "All replaced objects should be reclaimed");
+
+    TEST_PASS();
+}
+
+static int test_epoch_pressure(void) {
+    struct epoch_test_obj* objs[EPOCH_TEST_PRESSURE_CBS];
+    uint64_t emergency;
+    pthread_t reader;
+
+    atomic_store(&test_freed, 0);
+    atomic_store(&test_reader_ready, 0);
+    atomic_store(&test_reader_release, 0);
+    emergency = epoch_emergency_reclaims(net_epoch_preempt);
+    epoch_set_callback_limit(net_epoch_preempt, EPOCH_TEST_PRESSURE_LIMIT);
+
+    pthread_create(&reader, NULL, blocking_reader, NULL);
+    while (!atomic_load(&test_reader_ready))
+        usleep(1000);
+
+    /* The reader holds every callback back past the limit */
+    for (int i = 0; i < EPOCH_TEST_PRESSURE_CBS; i++) {
+        objs[i] = bsd_malloc(sizeof(*objs[i]), M_RTABLE, M_WAITOK | M_ZERO);
+        objs[i]->magic = EPOCH_TEST_MAGIC;
+        NET_EPOCH_CALL(test_obj_free_epoch, &objs[i]->ctx);
+    }
+    TEST_ASSERT_EQ(EPOCH_PRESSURE_CRITICAL, epoch_pressure(net_epoch_preempt),
+                   "Callbacks past 90% of the limit should be critical");
+    TEST_ASSERT_EQ(0, atomic_load(&test_freed),
+                   "Pressure must not cut the grace period short");
+
+    atomic_store(&test_reader_release, 1);
+    pthread_join(reader, NULL);
+    epoch_drain_callbacks(net_epoch_preempt);
+
+    TEST_ASSERT_EQ(EPOCH_TEST_PRESSURE_CBS, atomic_load(&test_freed),
+                   "All callbacks should run after the reader left");
+    TEST_ASSERT_EQ(EPOCH_PRESSURE_NORMAL, epoch_pressure(net_epoch_preempt),
+                   "Pressure should drop once the callbacks ran");
+    TEST_ASSERT(epoch_emergency_reclaims(net_epoch_preempt) > emergency,
+                "Critical pressure should reclaim without batching");
+
+    epoch_set_callback_limit(net_epoch_preempt, 0);
+
+    TEST_PASS();
+}
+
+static int test_epoch_memory_limit(void) {
+    struct epoch_test_obj* objs[EPOCH_TEST_SIZED_CBS];
+    uint64_t size = sizeof(struct epoch_test_obj);
+    pthread_t reader;
+
+    atomic_store(&test_freed, 0);
+    atomic_store(&test_reader_ready, 0);
+    atomic_store(&test_reader_release, 0);
+    epoch_set_memory_limit(net_epoch_preempt, EPOCH_TEST_SIZED_CBS * size);
+
+    pthread_create(&reader, NULL, blocking_reader, NULL);
+    while (!atomic_load(&test_reader_ready))
+        usleep(1000);
+
+    /* Few callbacks, but the bytes they hold reach the memory limit */
+    for (int i = 0; i < EPOCH_TEST_SIZED_CBS; i++) {
+        objs[i] = bsd_malloc(sizeof(*objs[i]), M_RTABLE, M_WAITOK | M_ZERO);
+        objs[i]->magic = EPOCH_TEST_MAGIC;
+        NET_EPOCH_CALL_SIZE(test_obj_free_epoch, &objs[i]->ctx, size);
+    }
+    TEST_ASSERT_EQ(EPOCH_TEST_SIZED_CBS * size,
+                   epoch_pending_bytes(net_epoch_preempt),
+                   "Backlog should report the bytes of the queued callbacks");
+    TEST_ASSERT_EQ(EPOCH_PRESSURE_CRITICAL, epoch_pressure(net_epoch_preempt),
+                   "Bytes past 90% of the memory limit should be critical");
+
+    atomic_store(&test_reader_release, 1);
+    pthread_join(reader, NULL);
+    epoch_drain_callbacks(net_epoch_preempt);
+
+    TEST_ASSERT_EQ(EPOCH_TEST_SIZED_CBS, atomic_load(&test_freed),
+                   "All callbacks should run after the reader left");
+    TEST_ASSERT_EQ(0, epoch_pending_bytes(net_epoch_preempt),
+                   "Backlog bytes should drop once the callbacks ran");
+    TEST_ASSERT_EQ(EPOCH_PRESSURE_NORMAL, epoch_pressure(net_epoch_preempt),
+                   "Pressure should drop once the callbacks ran");
+
+    epoch_set_memory_limit(net_epoch_preempt, 0);
+
+    TEST_PASS();
+}
+
+/* Test suite definition */
+static test_case_t epoch_tests[] = {
+    TEST_CASE(epoch_nesting,
+              "Test epoch section nesting and in_epoch()",
+              test_epoch_nesting),
+
+    TEST_CASE(epoch_deferred_free,
+              "Test callbacks wait for active readers",
+              test_epoch_deferred_free),
+
+    TEST_CASE(epoch_wait_newcomer,
+              "Test new readers enter during a grace period",
+              test_epoch_wait_newcomer),
+
+    TEST_CASE(epoch_concurrent_reclaim,
+              "Test reclamation under concurrent readers",
+              test_epoch_concurrent_reclaim),
+
+    TEST_CASE(epoch_pressure,
+              "Test memory pressure levels and emergency reclaim",
+              test_epoch_pressure),
+
+    TEST_CASE(epoch_memory_limit,
+              "Test backlog bytes and the memory pressure limit",
+              test_epoch_memory_limit),
+
+    TEST_SUITE_END()
+};
+
+test_suite_t epoch_test_suite = {
+    "Userland Epoch Tests",
+    "Test suite for the compat epoch reclamation",
+    epoch_tests,
+    0,  /* num_tests calculated at runtime */
+    epoch_setup,
+    NULL  /* teardown */
+};
+
+/* Main test runner */
+int main(void) {
+    printf("Userland Epoch Test Suite\n");
+    printf("=========================\n\n");
+
+    if (test_framework_init() != 0) {
+        fprintf(stderr, "Failed to initialize test framework\n");
+        return 1;
+    }
+
+    int count = 0;
+    while (epoch_tests[count].name != NULL) {
+        count++;
+    }
+    epoch_test_suite.num_tests = count;
+
+    int result = test_run_suite(&epoch_test_suite);
+
+    test_print_summary();
+    test_framework_cleanup();
+
+    return (result != 0 || g_test_result.failed_tests > 0) ? 1 : 0;
+}
@@ -0,0 +1,624 @@
+/*
+ * Concurrent Lookup Scaling Benchmark
+ *
+ * Sweeps the number of reader and writer threads over a DFZ-shaped IPv4
+ * table and, for every lookup engine and lock backend, reports lookup
+ * throughput against the number of readers, in total and per thread,
+ * along with the latency of the changes made by the writers.
+ *
+ * Lock backends, taken around every lookup and every change:
+ * - rwlock: pthread_rwlock_t
+ * - rmlock: the compat rmlock, readers counted in per-thread slots
+ * - epoch:  no reader lock, lookups only run under the network epoch;
+ *           writers are serialized by a mutex
+ *
+ * Lookup engines, both reached through fib4_lookup():
+ * - radix:  the radix tree
+ * - frozen: the compact frozen copy of the tree, frozen again by the
+ *           writers every -b changes, lookups going to the tree until then
+ *
+ * Writers delete and re-add routes of their own share of the table at
+ * a fixed rate; every point starts and ends with the full table. Threads
+ * are pinned, readers from CPU 0 up and writers after them.
+ *
+ * Usage: test_lookup_scaling [-n routes] [-r readers] [-w writers] [-d ms]
+ *                            [-u rate] [-b batch] [-e engines] [-k locks]
+ *                            [-j file]
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* pthread_setaffinity_np() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+#include "../kernel_compat/compat_shim.h"
+#include "route_lib.h"
+#include "test_traffic.h"
+
+/* Benchmark defaults */
+#define SCALE_ROUTES            200000
+#define SCALE_DURATION_MS       200
+#define SCALE_WRITE_RATE        10000   /* Changes per second and writer */
+#define SCALE_FREEZE_BATCH      64
+#define SCALE_MAX_READERS       256
+#define SCALE_MAX_WRITERS       16
+#define SCALE_WRITE_SAMPLES     (1 << 16)
+#define SCALE_FIB               0
+
+enum { LOCK_RWLOCK, LOCK_RMLOCK, LOCK_EPOCH, LOCK_COUNT };
+enum { ENGINE_RADIX, ENGINE_FROZEN, ENGINE_COUNT };
+
+static const char *lock_names[LOCK_COUNT] = { "rwlock", "rmlock", "epoch" };
+static const char *engine_names[ENGINE_COUNT] = { "radix", "frozen" };
+
+enum { PHASE_SETUP, PHASE_RUN, PHASE_STOP };
+
+/* One point of the sweep */
+struct scale_point {
+    int engine;
+    int lock;
+    int readers;
+    int writers;
+    double secs;
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t thr_min;           /* Lookups of the slowest reader */
+    uint64_t thr_max;
+    uint64_t writes;
+    uint64_t wr_p50_ns;
+    uint64_t wr_p99_ns;
+    uint64_t wr_max_ns;
+};
+
+struct reader_ctx {
+    pthread_t thread;
+    int cpu;
+    uint32_t seed;
+    uint64_t lookups;
+    uint64_t hits;
+} __attribute__((aligned(64)));
+
+struct writer_ctx {
+    pthread_t thread;
+    int cpu;
+    int id;
+    int nwriters;
+    uint64_t writes;
+    uint64_t *samples;          /* Latencies, ring of SCALE_WRITE_SAMPLES */
+} __attribute__((aligned(64)));
+
+/* Workload */
+
+static struct sockaddr_in *keys;
+static struct sockaddr_in masks[33];
+static struct route_info *routes;       /* Unique prefixes only */
+static size_t num_routes;
+
+static struct rib_head *rib;
+static struct traffic_gen *traffic;
+
+static pthread_rwlock_t rw_lock;
+static struct rmlock rm_lock;
+static pthread_mutex_t wr_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int cur_lock, cur_engine;
+static _Atomic int phase;
+static _Atomic int ready;
+
+static int duration_ms = SCALE_DURATION_MS;
+static int write_rate = SCALE_WRITE_RATE;
+static int freeze_batch = SCALE_FREEZE_BATCH;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_pin(int cpu) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu > 0)
+        cpu %= (int)ncpu;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(__APPLE__)
+    /* Only an affinity hint on macOS: distinct tags go to distinct cores */
+    thread_affinity_policy_data_t pol = { cpu + 1 };
+    thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                      (thread_policy_t)&pol, THREAD_AFFINITY_POLICY_COUNT);
+#else
+    (void)cpu;
+#endif
+}
+
+static void init_sin(struct sockaddr_in *sin) {
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_len = sizeof(*sin);
+}
+
+/* DFZ-shaped IPv4 table, the same as test_microbench */
+static void build_routes(size_t n) {
+    static const uint8_t mix[] = { 16, 19, 20, 21, 22, 22, 23, 24, 24, 24, 24, 24, 24, 24 };
+    static struct sockaddr_in gw;
+    uint64_t seed = 0x243f6a8885a308d3ULL;
+
+    for (int p = 0; p <= 32; p++) {
+        init_sin(&masks[p]);
+        masks[p].sin_addr.s_addr = p ? htonl(~0U << (32 - p)) : 0;
+    }
+    init_sin(&gw);
+    gw.sin_addr.s_addr = htonl(0xc0a80001);
+
+    keys = bsd_malloc(n * sizeof(*keys), M_RTABLE, M_WAITOK | M_ZERO);
+    routes = bsd_malloc(n * sizeof(*routes), M_RTABLE, M_WAITOK | M_ZERO);
+
+    /* Spread route ids over 1.0.0.0 - 223.255.255.0 in /24 steps */
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        int plen = mix[(seed >> 33) % sizeof(mix)];
+        uint32_t net = (uint32_t)(0x01000000 + ((i * 2654435761U) % (222U << 16)) * 256);
+
+        init_sin(&keys[i]);
+        keys[i].sin_addr.s_addr = htonl(net & ~0U << (32 - plen));
+        routes[i].ri_dst = (struct sockaddr *)&keys[i];
+        routes[i].ri_netmask = (struct sockaddr *)&masks[plen];
+        routes[i].ri_gateway = (struct sockaddr *)&gw;
+        routes[i].ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+    }
+}
+
+/* Adds the routes, keeping the ones that are not duplicates */
+static int load_routes(size_t n) {
+    num_routes = 0;
+    for (size_t i = 0; i < n; i++) {
+        int error = route_add(rib, &routes[i]);
+
+        if (error == ROUTE_OK) {
+            routes[num_routes++] = routes[i];
+        } else if (error != ROUTE_EEXIST) {
+            return error;
+        }
+    }
+    return ROUTE_OK;
+}
+
+/* Locks */
+
+static void write_lock(void) {
+    switch (cur_lock) {
+        case LOCK_RWLOCK:
+            pthread_rwlock_wrlock(&rw_lock);
+            break;
+        case LOCK_RMLOCK:
+            rm_wlock(&rm_lock);
+            break;
+        default:
+            pthread_mutex_lock(&wr_mtx);
+            break;
+    }
+}
+
+static void write_unlock(void) {
+    switch (cur_lock) {
+        case LOCK_RWLOCK:
+            pthread_rwlock_unlock(&rw_lock);
+            break;
+        case LOCK_RMLOCK:
+            rm_wunlock(&rm_lock);
+            break;
+        default:
+            pthread_mutex_unlock(&wr_mtx);
+            break;
+    }
+}
+
+/* Makes sure lookups go to the tree: any change drops the frozen copy */
+static void table_thaw(void) {
+    route_delete(rib, routes[0].ri_dst, routes[0].ri_netmask);
+    route_add(rib, &routes[0]);
+}
+
+/* Threads */
+
+static void wait_start(void) {
+    atomic_fetch_add(&ready, 1);
+    while (atomic_load_explicit(&phase, memory_order_acquire) == PHASE_SETUP)
+        sched_yield();
+}
+
+static void *reader_thread(void *arg) {
+    struct reader_ctx *ctx = arg;
+    struct rm_priotracker tracker;
+    struct traffic_stream ts;
+    struct route_info ri;
+    struct in_addr dst;
+    uint64_t lookups = 0, hits = 0;
+    int lock = cur_lock, error;
+
+    bench_pin(ctx->cpu);
+    traffic_stream_init(&ts, traffic, ctx->seed);
+    wait_start();
+
+    while (atomic_load_explicit(&phase, memory_order_relaxed) == PHASE_RUN) {
+        traffic_next(&ts, &dst);
+        switch (lock) {
+            case LOCK_RWLOCK:
+                pthread_rwlock_rdlock(&rw_lock);
+                error = fib4_lookup(SCALE_FIB, dst, 0, &ri);
+                pthread_rwlock_unlock(&rw_lock);
+                break;
+            case LOCK_RMLOCK:
+                rm_rlock(&rm_lock, &tracker);
+                error = fib4_lookup(SCALE_FIB, dst, 0, &ri);
+                rm_runlock(&rm_lock, &tracker);
+                break;
+            default:
+                error = fib4_lookup(SCALE_FIB, dst, 0, &ri);
+                break;
+        }
+        lookups++;
+        hits += (error == ROUTE_OK);
+    }
+    ctx->lookups = lookups;
+    ctx->hits = hits;
+    return NULL;
+}
+
+static void *writer_thread(void *arg) {
+    struct writer_ctx *ctx = arg;
+    uint64_t interval = write_rate > 0 ? 1000000000ULL / write_rate : 0;
+    uint64_t next, writes = 0;
+    size_t k = ctx->id;
+    bool deleted = false;
+
+    bench_pin(ctx->cpu);
+    wait_start();
+
+    next = clock_ns();
+    while (atomic_load_explicit(&phase, memory_order_relaxed) == PHASE_RUN) {
+        if (interval > 0) {
+            uint64_t now = clock_ns();
+            if (now < next) {
+                if (next - now > 100000)
+                    usleep((next - now) / 1000);
+                continue;
+            }
+            next += interval;
+        }
+
+        /* Delete route k, then put it back and move on to the next one */
+        uint64_t t0 = clock_ns();
+        write_lock();
+        if (deleted)
+            route_add(rib, &routes[k]);
+        else
+            route_delete(rib, routes[k].ri_dst, routes[k].ri_netmask);
+        if (cur_engine == ENGINE_FROZEN && (writes + 1) % freeze_batch == 0)
+            route_table_freeze(rib);
+        write_unlock();
+        ctx->samples[writes++ % SCALE_WRITE_SAMPLES] = clock_ns() - t0;
+
+        if (deleted) {
+            k += ctx->nwriters;
+            if (k >= num_routes)
+                k = ctx->id;
+        }
+        deleted = !deleted;
+    }
+
+    /* Leave the table whole for the next point */
+    if (deleted) {
+        write_lock();
+        route_add(rib, &routes[k]);
+        write_unlock();
+    }
+    ctx->writes = writes;
+    return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void run_point(struct scale_point *pt, struct reader_ctx *rctx, struct writer_ctx *wctx) {
+    uint64_t t0, t1;
+
+    cur_lock = pt->lock;
+    cur_engine = pt->engine;
+    if (pt->engine == ENGINE_FROZEN)
+        route_table_freeze(rib);
+    else
+        table_thaw();
+
+    atomic_store(&phase, PHASE_SETUP);
+    atomic_store(&ready, 0);
+    for (int i = 0; i < pt->readers; i++) {
+        rctx[i].cpu = i;
+        rctx[i].seed = 0x12345 + i * 7919;
+        pthread_create(&rctx[i].thread, NULL, reader_thread, &rctx[i]);
+    }
+    for (int i = 0; i < pt->writers; i++) {
+        wctx[i].cpu = pt->readers + i;
+        wctx[i].id = i;
+        wctx[i].nwriters = pt->writers;
+        pthread_create(&wctx[i].thread, NULL, writer_thread, &wctx[i]);
+    }
+    while (atomic_load(&ready) < pt->readers + pt->writers)
+        sched_yield();
+
+    t0 = clock_ns();
+    atomic_store_explicit(&phase, PHASE_RUN, memory_order_release);
+    usleep(duration_ms * 1000);
+    atomic_store_explicit(&phase, PHASE_STOP, memory_order_release);
+    t1 = clock_ns();
+
+    pt->secs = (t1 - t0) / 1e9;
+    pt->thr_min = UINT64_MAX;
+    for (int i = 0; i < pt->readers; i++) {
+        pthread_join(rctx[i].thread, NULL);
+        pt->lookups += rctx[i].lookups;
+        pt->hits += rctx[i].hits;
+        if (rctx[i].lookups < pt->thr_min)
+            pt->thr_min = rctx[i].lookups;
+        if (rctx[i].lookups > pt->thr_max)
+            pt->thr_max = rctx[i].lookups;
+    }
+    if (pt->readers == 0)
+        pt->thr_min = 0;
+
+    /* Write latencies of all writers together */
+    size_t n = 0;
+    for (int i = 0; i < pt->writers; i++) {
+        pthread_join(wctx[i].thread, NULL);
+        pt->writes += wctx[i].writes;
+        n += wctx[i].writes < SCALE_WRITE_SAMPLES ? wctx[i].writes : SCALE_WRITE_SAMPLES;
+    }
+    if (n > 0) {
+        uint64_t *all = bsd_malloc(n * sizeof(*all), M_RTABLE, M_WAITOK);
+        size_t m = 0;
+        for (int i = 0; i < pt->writers; i++) {
+            size_t k = wctx[i].writes < SCALE_WRITE_SAMPLES ? wctx[i].writes : SCALE_WRITE_SAMPLES;
+            memcpy(all + m, wctx[i].samples, k * sizeof(*all));
+            m += k;
+        }
+        qsort(all, n, sizeof(*all), u64_cmp);
+        pt->wr_p50_ns = all[(n - 1) * 50 / 100];
+        pt->wr_p99_ns = all[(n - 1) * 99 / 100];
+        pt->wr_max_ns = all[n - 1];
+        bsd_free(all, M_RTABLE);
+    }
+}
+
+/* Output */
+
+static void print_header(int engine, int lock) {
+    printf("\nEngine %s, lock %s\n", engine_names[engine], lock_names[lock]);
+    printf("  %3s %4s  %10s %9s %9s %9s  %9s %8s %8s %9s\n", "wr", "rd", "Mlookup/s",
+           "per-thr", "min-thr", "max-thr", "writes/s", "wr p50", "wr p99", "wr max");
+}
+
+static void print_point(const struct scale_point *pt) {
+    double mlps = pt->lookups / pt->secs / 1e6;
+
+    printf("  %3d %4d  %10.2f %9.3f %9.3f %9.3f  %9.0f %8.1f %8.1f %9.1f\n",
+           pt->writers, pt->readers, mlps,
+           pt->readers ? mlps / pt->readers : 0.0,
+           pt->thr_min / pt->secs / 1e6, pt->thr_max / pt->secs / 1e6,
+           pt->writes / pt->secs,
+           pt->wr_p50_ns / 1e3, pt->wr_p99_ns / 1e3, pt->wr_max_ns / 1e3);
+}
+
+static int write_json(const char *path, const struct scale_point *pts, int npts) {
+    FILE *fp = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(fp, "{\n  \"suite\": \"lookup_scaling\",\n");
+    fprintf(fp, "  \"routes\": %zu,\n  \"traffic\": \"%s\",\n", num_routes, traffic_name(traffic));
+    fprintf(fp, "  \"duration_ms\": %d,\n  \"write_rate\": %d,\n", duration_ms, write_rate);
+    fprintf(fp, "  \"points\": [");
+    for (int i = 0; i < npts; i++) {
+        const struct scale_point *pt = &pts[i];
+        fprintf(fp, "%s\n    { \"engine\": \"%s\", \"lock\": \"%s\", \"writers\": %d, "
+                "\"readers\": %d, \"lookups_per_sec\": %.0f, \"min_thread_lookups_per_sec\": %.0f, "
+                "\"max_thread_lookups_per_sec\": %.0f, \"writes_per_sec\": %.0f, "
+                "\"write_p50_ns\": %llu, \"write_p99_ns\": %llu, \"write_max_ns\": %llu }",
+                i ? "," : "", engine_names[pt->engine], lock_names[pt->lock], pt->writers,
+                pt->readers, pt->lookups / pt->secs, pt->thr_min / pt->secs,
+                pt->thr_max / pt->secs, pt->writes / pt->secs,
+                (unsigned long long)pt->wr_p50_ns, (unsigned long long)pt->wr_p99_ns,
+                (unsigned long long)pt->wr_max_ns);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout)
+        fclose(fp);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-n routes] [-r readers] [-w writers] [-d ms] [-u rate] [-b batch]\n"
+           "       [-e engines] [-k locks] [-j file]\n", prog);
+    printf("  -n routes    table size (default %d)\n", SCALE_ROUTES);
+    printf("  -r readers   largest reader count, swept in powers of 2 (default: CPUs)\n");
+    printf("  -w writers   largest writer count, swept from 0 in powers of 2 (default 1)\n");
+    printf("  -d ms        duration of each point (default %d)\n", SCALE_DURATION_MS);
+    printf("  -u rate      changes per second and writer, 0 = unpaced (default %d)\n",
+           SCALE_WRITE_RATE);
+    printf("  -b batch     changes between freezes of the frozen engine (default %d)\n",
+           SCALE_FREEZE_BATCH);
+    printf("  -e engines   comma-separated subset of radix, frozen\n");
+    printf("  -k locks     comma-separated subset of rwlock, rmlock, epoch\n");
+    printf("  -j file      write JSON results to file, - for stdout\n");
+    printf("Lookup destinations follow %s (default zipf).\n", TRAFFIC_ENV);
+}
+
+static int selected(const char *list, const char *name) {
+    size_t len = strlen(name);
+
+    if (list == NULL)
+        return 1;
+    for (const char *p = list; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+            return 1;
+    }
+    return 0;
+}
+
+/* 1, 2, 4 ... up to @max, @max included; from 0 if @zero */
+static int sweep(int *counts, int max, bool zero) {
+    int n = 0;
+
+    if (zero)
+        counts[n++] = 0;
+    for (int c = 1; c < max; c <<= 1)
+        counts[n++] = c;
+    if (max > 0)
+        counts[n++] = max;
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    size_t nroutes = SCALE_ROUTES;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_readers = ncpu > 0 ? (int)ncpu : 4;
+    int max_writers = 1;
+    const char *engines = NULL, *locks = NULL, *json = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:w:d:u:b:e:k:j:h")) != -1) {
+        switch (opt) {
+            case 'n': nroutes = strtoul(optarg, NULL, 10); break;
+            case 'r': max_readers = atoi(optarg); break;
+            case 'w': max_writers = atoi(optarg); break;
+            case 'd': duration_ms = atoi(optarg); break;
+            case 'u': write_rate = atoi(optarg); break;
+            case 'b': freeze_batch = atoi(optarg); break;
+            case 'e': engines = optarg; break;
+            case 'k': locks = optarg; break;
+            case 'j': json = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (max_readers > SCALE_MAX_READERS)
+        max_readers = SCALE_MAX_READERS;
+    if (nroutes == 0 || max_readers < 1 || max_writers < 0 || max_writers > SCALE_MAX_WRITERS ||
+        duration_ms < 1 || write_rate < 0 || freeze_batch < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (route_lib_init() != ROUTE_OK) {
+        fprintf(stderr, "route_lib_init failed\n");
+        return 1;
+    }
+    pthread_rwlock_init(&rw_lock, NULL);
+    rm_init_flags(&rm_lock, "scale_rib", 0);
+
+    build_routes(nroutes);
+    rib = route_table_create(AF_INET, SCALE_FIB);
+    if (rib == NULL || load_routes(nroutes) != ROUTE_OK) {
+        fprintf(stderr, "route table load failed\n");
+        return 1;
+    }
+    if ((size_t)max_writers > num_routes)
+        max_writers = (int)num_routes;
+
+    traffic = traffic_create(AF_INET, traffic_env_spec("zipf"));
+    if (traffic == NULL)
+        return 1;
+    for (size_t i = 0; i < num_routes; i++) {
+        const struct sockaddr_in *mask = (const struct sockaddr_in *)routes[i].ri_netmask;
+        traffic_add_prefix(traffic, &((const struct sockaddr_in *)routes[i].ri_dst)->sin_addr,
+                           __builtin_popcount(mask->sin_addr.s_addr));
+    }
+    if (traffic_prepare(traffic, 0x5eed) != 0)
+        return 1;
+
+    int rcounts[16], wcounts[8];
+    int nr = sweep(rcounts, max_readers, false);
+    int nw = sweep(wcounts, max_writers, true);
+
+    printf("Concurrent Lookup Scaling\n");
+    printf("=========================\n");
+    printf("%zu routes, %s traffic, %d CPUs, %dms per point, %d changes/s per writer\n",
+           num_routes, traffic_name(traffic), (int)ncpu, duration_ms, write_rate);
+    printf("Lookup rates in millions per second, write latencies in us\n");
+
+    struct reader_ctx *rctx = bsd_malloc(max_readers * sizeof(*rctx), M_RTABLE,
+                                         M_WAITOK | M_ZERO);
+    struct writer_ctx *wctx = bsd_malloc((max_writers ? max_writers : 1) * sizeof(*wctx),
+                                         M_RTABLE, M_WAITOK | M_ZERO);
+    for (int i = 0; i < max_writers; i++)
+        wctx[i].samples = bsd_malloc(SCALE_WRITE_SAMPLES * sizeof(uint64_t), M_RTABLE, M_WAITOK);
+    struct scale_point *pts = bsd_malloc(ENGINE_COUNT * LOCK_COUNT * (nr + 1) * nw * sizeof(*pts),
+                                         M_RTABLE, M_WAITOK | M_ZERO);
+    int npts = 0;
+
+    /* Throughput against readers for each writer count; with writers, write latency too */
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        if (!selected(engines, engine_names[e]))
+            continue;
+        for (int l = 0; l < LOCK_COUNT; l++) {
+            if (!selected(locks, lock_names[l]))
+                continue;
+            print_header(e, l);
+            for (int w = 0; w < nw; w++) {
+                /* Writers alone first, as the baseline for their latency */
+                for (int r = wcounts[w] ? -1 : 0; r < nr; r++) {
+                    struct scale_point *pt = &pts[npts++];
+
+                    pt->engine = e;
+                    pt->lock = l;
+                    pt->writers = wcounts[w];
+                    pt->readers = r < 0 ? 0 : rcounts[r];
+                    run_point(pt, rctx, wctx);
+                    print_point(pt);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    int ret = 0;
+    if (json)
+        ret = write_json(json, pts, npts) != 0;
+
+    for (int i = 0; i < max_writers; i++)
+        bsd_free(wctx[i].samples, M_RTABLE);
+    bsd_free(wctx, M_RTABLE);
+    bsd_free(rctx, M_RTABLE);
+    bsd_free(pts, M_RTABLE);
+    traffic_destroy(traffic);
+    route_table_destroy(rib);
+    rm_destroy(&rm_lock);
+    pthread_rwlock_destroy(&rw_lock);
+    bsd_free(routes, M_RTABLE);
+    bsd_free(keys, M_RTABLE);
+    route_lib_cleanup();
+    return ret;
+}
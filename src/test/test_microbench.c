@@ -0,0 +1,551 @@
+/*
+ * Radix / route_lib Micro-benchmarks
+ *
+ * Per-operation latency of the lookup and update paths, sampled with
+ * the CPU tick counter (rdtsc, cntvct_el0, clock_gettime elsewhere)
+ * into log-linear histograms, after a warmup and with threads pinned.
+ * Reports p50/p90/p99/p99.9/max and optionally writes JSON for
+ * regression tracking.
+ *
+ * Usage: test_microbench [-n routes] [-l lookups] [-w warmup] [-t threads]
+ *                        [-b name[,name...]] [-j file]
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* pthread_setaffinity_np() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+#include "../kernel_compat/compat_shim.h"
+#include "radix.h"
+#include "route_lib.h"
+#include "test_traffic.h"
+
+/* Benchmark defaults */
+#define BENCH_ROUTES            200000
+#define BENCH_LOOKUPS           1000000
+#define BENCH_WARMUP            100000
+#define BENCH_MAX_THREADS       64
+#define BENCH_BURST             64
+
+/*
+ * Log-linear histogram in the HDR style: values below 2 * BENCH_SUB are
+ * exact, above that every power of two is cut in BENCH_SUB buckets, so
+ * the relative error stays under 1 / BENCH_SUB.
+ */
+#define BENCH_SUB_BITS          7
+#define BENCH_SUB               (1U << BENCH_SUB_BITS)
+#define BENCH_BUCKETS           ((64 - BENCH_SUB_BITS + 1) * BENCH_SUB)
+
+struct bench_hist {
+    uint64_t bh_count[BENCH_BUCKETS];
+    uint64_t bh_total;
+    uint64_t bh_sum;
+    uint64_t bh_max;
+};
+
+static inline void hist_record(struct bench_hist * h, uint64_t v) {
+    unsigned idx;
+
+    if (v < 2 * BENCH_SUB) {
+        idx = (unsigned)v;
+    } else {
+        unsigned e = 63 - __builtin_clzll(v) - BENCH_SUB_BITS;
+        idx = (e + 1) * BENCH_SUB + (unsigned)(v >> e) - BENCH_SUB;
+    }
+    h->bh_count[idx]++;
+    h->bh_total++;
+    h->bh_sum += v;
+    if (v > h->bh_max)
+        h->bh_max = v;
+}
+
+/* Middle of the bucket, the value reported for samples that fell in it */
+static uint64_t hist_value(unsigned idx) {
+    if (idx < 2 * BENCH_SUB)
+        return idx;
+    unsigned e = idx / BENCH_SUB - 1;
+    uint64_t m = idx % BENCH_SUB + BENCH_SUB;
+    return (m << e) + ((1ULL << e) >> 1);
+}
+
+static uint64_t hist_percentile(const struct bench_hist * h, double p) {
+    uint64_t want = (uint64_t)(p / 100.0 * h->bh_total + 0.5), seen = 0;
+
+    if (want == 0)
+        want = 1;
+    for (unsigned i = 0; i < BENCH_BUCKETS; i++) {
+        seen += h->bh_count[i];
+        if (seen >= want)
+            return (hist_value(i) < h->bh_max) ? hist_value(i) : h->bh_max;
+    }
+    return h->bh_max;
+}
+
+static void hist_merge(struct bench_hist * dst, const struct bench_hist * src) {
+    for (unsigned i = 0; i < BENCH_BUCKETS; i++)
+        dst->bh_count[i] += src->bh_count[i];
+    dst->bh_total += src->bh_total;
+    dst->bh_sum += src->bh_sum;
+    if (src->bh_max > dst->bh_max)
+        dst->bh_max = src->bh_max;
+}
+
+/* Timebase */
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t bench_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    /* lfence keeps the read from moving ahead of the measured operation */
+    __asm__ __volatile__("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#else
+    return clock_ns();
+#endif
+}
+
+static const char * bench_timebase(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return "rdtsc";
+#elif defined(__aarch64__)
+    return "cntvct_el0";
+#else
+    return "clock_gettime";
+#endif
+}
+
+static double ns_per_tick = 1.0;
+
+static void bench_calibrate(void) {
+    uint64_t n0 = clock_ns(), t0 = bench_ticks();
+    while (clock_ns() - n0 < 50 * 1000000ULL)
+        ;
+    uint64_t n1 = clock_ns(), t1 = bench_ticks();
+    ns_per_tick = (double)(n1 - n0) / (double)(t1 - t0);
+}
+
+static void bench_pin(int cpu) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu > 0)
+        cpu %= (int)ncpu;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(__APPLE__)
+    /* Only an affinity hint on macOS: distinct tags go to distinct cores */
+    thread_affinity_policy_data_t pol = { cpu + 1 };
+    thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                      (thread_policy_t)&pol, THREAD_AFFINITY_POLICY_COUNT);
+#else
+    (void)cpu;
+#endif
+}
+
+/* Workload */
+
+static struct sockaddr_in * keys;
+static struct sockaddr_in masks[33];
+static uint8_t * plens;
+static struct radix_node * nodes;       /* Two per route */
+static size_t num_routes;
+
+static struct radix_node_head * rnh;
+static struct rib_head * rib;
+static struct traffic_gen * traffic;
+
+static size_t num_lookups = BENCH_LOOKUPS;
+static size_t num_warmup = BENCH_WARMUP;
+static int num_threads = 1;
+
+static void init_sin(struct sockaddr_in * sin) {
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_len = sizeof(*sin);
+}
+
+/* DFZ-shaped IPv4 table, unique prefixes */
+static void build_routes(size_t n) {
+    static const uint8_t mix[] = { 16, 19, 20, 21, 22, 22, 23, 24, 24, 24, 24, 24, 24, 24 };
+    uint64_t seed = 0x243f6a8885a308d3ULL;
+
+    for (int p = 0; p <= 32; p++) {
+        init_sin(&masks[p]);
+        masks[p].sin_addr.s_addr = p ? htonl(~0U << (32 - p)) : 0;
+    }
+
+    keys = bsd_malloc(n * sizeof(*keys), M_RTABLE, M_WAITOK | M_ZERO);
+    plens = bsd_malloc(n, M_RTABLE, M_WAITOK | M_ZERO);
+    nodes = bsd_malloc(2 * n * sizeof(*nodes), M_RTABLE, M_WAITOK | M_ZERO);
+
+    /* Spread route ids over 1.0.0.0 - 223.255.255.0 in /24 steps */
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        int plen = mix[(seed >> 33) % sizeof(mix)];
+        uint32_t net = (uint32_t)(0x01000000 + ((i * 2654435761U) % (222U << 16)) * 256);
+
+        init_sin(&keys[i]);
+        keys[i].sin_addr.s_addr = htonl(net & ~0U << (32 - plen));
+        plens[i] = (uint8_t)plen;
+    }
+    num_routes = n;
+}
+
+static size_t radix_load(void) {
+    size_t added = 0;
+
+    memset(nodes, 0, 2 * num_routes * sizeof(*nodes));
+    for (size_t i = 0; i < num_routes; i++) {
+        if (rnh->rnh_addaddr(&keys[i], &masks[plens[i]], &rnh->rh, &nodes[2 * i]))
+            added++;
+        else
+            plens[i] |= 0x80;   /* Duplicate, left out of the add/delete runs */
+    }
+    return added;
+}
+
+static void radix_unload(void) {
+    for (size_t i = 0; i < num_routes; i++) {
+        if (!(plens[i] & 0x80))
+            rnh->rnh_deladdr(&keys[i], &masks[plens[i]], &rnh->rh);
+    }
+}
+
+/* Benchmarks */
+
+struct bench_result {
+    const char * name;
+    int threads;
+    struct bench_hist hist;
+};
+
+struct lookup_thread {
+    pthread_t thread;
+    int id;
+    int kind;
+    struct bench_hist * hist;
+};
+
+enum { LOOKUP_RN_MATCH, LOOKUP_ROUTE, LOOKUP_FIB4, LOOKUP_FIB4_BURST };
+
+static void * lookup_worker(void * arg) {
+    struct lookup_thread * lt = arg;
+    struct traffic_stream ts;
+    struct sockaddr_in dst;
+    struct route_info ri;
+    struct in_addr burst[BENCH_BURST];
+    struct route_info burst_ri[BENCH_BURST];
+    volatile uintptr_t sink = 0;
+
+    bench_pin(lt->id);
+    traffic_stream_init(&ts, traffic, 0xabcdef + lt->id);
+    init_sin(&dst);
+
+    for (size_t i = 0; i < num_warmup + num_lookups; i += (lt->kind == LOOKUP_FIB4_BURST) ?
+         BENCH_BURST : 1) {
+        if (lt->kind == LOOKUP_FIB4_BURST) {
+            for (int k = 0; k < BENCH_BURST; k++)
+                traffic_next(&ts, &burst[k]);
+        } else {
+            traffic_next(&ts, &dst.sin_addr);
+        }
+
+        uint64_t t0 = bench_ticks();
+        switch (lt->kind) {
+            case LOOKUP_RN_MATCH:
+                sink += (uintptr_t)rn_match(&dst, &rnh->rh);
+                break;
+            case LOOKUP_ROUTE:
+                sink += route_lookup(rib, (struct sockaddr *)&dst, &ri);
+                break;
+            case LOOKUP_FIB4:
+                sink += fib4_lookup(0, dst.sin_addr, 0, &ri);
+                break;
+            case LOOKUP_FIB4_BURST:
+                sink += fib4_lookup_burst(0, burst, BENCH_BURST, burst_ri);
+                break;
+        }
+        uint64_t dt = bench_ticks() - t0;
+
+        if (i >= num_warmup)
+            hist_record(lt->hist, (lt->kind == LOOKUP_FIB4_BURST) ? dt / BENCH_BURST : dt);
+    }
+    (void)sink;
+    return NULL;
+}
+
+static void run_lookups(struct bench_result * res, int kind) {
+    struct lookup_thread lt[BENCH_MAX_THREADS];
+    struct bench_hist * hists = bsd_malloc(num_threads * sizeof(*hists), M_RTABLE,
+                                          M_WAITOK | M_ZERO);
+
+    for (int i = 0; i < num_threads; i++) {
+        lt[i].id = i;
+        lt[i].kind = kind;
+        lt[i].hist = &hists[i];
+        pthread_create(&lt[i].thread, NULL, lookup_worker, &lt[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(lt[i].thread, NULL);
+        hist_merge(&res->hist, &hists[i]);
+    }
+    res->threads = num_threads;
+    bsd_free(hists, M_RTABLE);
+}
+
+static void run_rn_addroute(struct bench_result * res) {
+    bench_pin(0);
+    /* Warmup: one untimed fill and drain of the tree */
+    if (num_warmup > 0) {
+        radix_load();
+        radix_unload();
+    }
+    memset(nodes, 0, 2 * num_routes * sizeof(*nodes));
+    for (size_t i = 0; i < num_routes; i++) {
+        if (plens[i] & 0x80)
+            continue;
+        uint64_t t0 = bench_ticks();
+        rnh->rnh_addaddr(&keys[i], &masks[plens[i]], &rnh->rh, &nodes[2 * i]);
+        hist_record(&res->hist, bench_ticks() - t0);
+    }
+    res->threads = 1;
+}
+
+static void run_rn_delete(struct bench_result * res) {
+    bench_pin(0);
+    for (size_t i = 0; i < num_routes; i++) {
+        if (plens[i] & 0x80)
+            continue;
+        uint64_t t0 = bench_ticks();
+        rnh->rnh_deladdr(&keys[i], &masks[plens[i]], &rnh->rh);
+        hist_record(&res->hist, bench_ticks() - t0);
+    }
+    res->threads = 1;
+}
+
+/* Output */
+
+static void print_result(const struct bench_result * r) {
+    const struct bench_hist * h = &r->hist;
+
+    if (h->bh_total == 0)
+        return;
+    printf("  %-18s %2d  %10llu  %8.1f %8.1f %8.1f %8.1f %8.1f %10.1f\n",
+           r->name, r->threads, (unsigned long long)h->bh_total,
+           h->bh_sum * ns_per_tick / h->bh_total,
+           hist_percentile(h, 50) * ns_per_tick,
+           hist_percentile(h, 90) * ns_per_tick,
+           hist_percentile(h, 99) * ns_per_tick,
+           hist_percentile(h, 99.9) * ns_per_tick,
+           h->bh_max * ns_per_tick);
+}
+
+static int write_json(const char * path, const struct bench_result * res, int nres) {
+    FILE* fp = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(fp, "{\n  \"suite\": \"radix_microbench\",\n");
+    fprintf(fp, "  \"timebase\": \"%s\",\n  \"ns_per_tick\": %.6f,\n", bench_timebase(), ns_per_tick);
+    fprintf(fp, "  \"routes\": %zu,\n  \"traffic\": \"%s\",\n", num_routes, traffic_name(traffic));
+    fprintf(fp, "  \"results\": [");
+    for (int i = 0, first = 1; i < nres; i++) {
+        const struct bench_hist * h = &res[i].hist;
+        if (h->bh_total == 0)
+            continue;
+        fprintf(fp, "%s\n    { \"name\": \"%s\", \"threads\": %d, \"ops\": %llu, "
+                "\"mean_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, "
+                "\"p999_ns\": %.1f, \"max_ns\": %.1f }",
+                first ? "" : ",", res[i].name, res[i].threads,
+                (unsigned long long)h->bh_total, h->bh_sum * ns_per_tick / h->bh_total,
+                hist_percentile(h, 50) * ns_per_tick, hist_percentile(h, 90) * ns_per_tick,
+                hist_percentile(h, 99) * ns_per_tick, hist_percentile(h, 99.9) * ns_per_tick,
+                h->bh_max * ns_per_tick);
+        first = 0;
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout)
+        fclose(fp);
+    return 0;
+}
+
+static void usage(const char * prog) {
+    printf("Usage: %s [-n routes] [-l lookups] [-w warmup] [-t threads] [-b names] [-j file]\n",
+           prog);
+    printf("  -n routes    table size (default %d)\n", BENCH_ROUTES);
+    printf("  -l lookups   timed lookups per thread (default %d)\n", BENCH_LOOKUPS);
+    printf("  -w warmup    untimed lookups per thread first (default %d)\n", BENCH_WARMUP);
+    printf("  -t threads   pinned lookup threads (default 1)\n");
+    printf("  -b names     comma-separated subset: rn_match, rn_addroute, rn_delete,\n"
+           "               route_lookup, fib4_lookup, fib4_frozen, fib4_burst\n");
+    printf("  -j file      write JSON results to file, - for stdout\n");
+    printf("Lookup destinations follow %s (default zipf).\n", TRAFFIC_ENV);
+}
+
+static int selected(const char * list, const char * name) {
+    size_t len = strlen(name);
+
+    if (list == NULL)
+        return 1;
+    for (const char * p = list; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char * argv[]) {
+    size_t routes = BENCH_ROUTES;
+    const char* json = NULL;
+    const char* only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:w:t:b:j:h")) != -1) {
+        switch (opt) {
+            case 'n': routes = strtoul(optarg, NULL, 10); break;
+            case 'l': num_lookups = strtoul(optarg, NULL, 10); break;
+            case 'w': num_warmup = strtoul(optarg, NULL, 10); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'b': only = optarg; break;
+            case 'j': json = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (routes == 0 || num_threads < 1 || num_threads > BENCH_MAX_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (route_lib_init() != ROUTE_OK) {
+        fprintf(stderr, "route_lib_init failed\n");
+        return 1;
+    }
+    bench_calibrate();
+    build_routes(routes);
+
+    if (rn_inithead((void **)&rnh, offsetof(struct sockaddr_in, sin_addr) << 3) != 1) {
+        fprintf(stderr, "rn_inithead failed\n");
+        return 1;
+    }
+
+    traffic = traffic_create(AF_INET, traffic_env_spec("zipf"));
+    if (traffic == NULL)
+        return 1;
+    for (size_t i = 0; i < num_routes; i++)
+        traffic_add_prefix(traffic, &keys[i].sin_addr, plens[i]);
+    if (traffic_prepare(traffic, 0x5eed) != 0)
+        return 1;
+
+    printf("Radix Micro-benchmarks\n");
+    printf("======================\n");
+    printf("Timebase %s (%.3f ns/tick), %zu routes, %s traffic, %d thread(s)\n\n",
+           bench_timebase(), ns_per_tick, num_routes, traffic_name(traffic), num_threads);
+
+    struct bench_result * res = bsd_malloc(7 * sizeof(*res), M_RTABLE, M_WAITOK | M_ZERO);
+    int nres = 0;
+
+    /* Radix tree: inserts, lookups on the full tree, then deletes */
+    if (selected(only, "rn_addroute") || selected(only, "rn_delete")) {
+        res[nres].name = "rn_addroute";
+        run_rn_addroute(&res[nres]);
+        nres++;
+    } else {
+        radix_load();
+    }
+    if (selected(only, "rn_match")) {
+        res[nres].name = "rn_match";
+        run_lookups(&res[nres++], LOOKUP_RN_MATCH);
+    }
+    if (selected(only, "rn_addroute") || selected(only, "rn_delete")) {
+        res[nres].name = "rn_delete";
+        run_rn_delete(&res[nres]);
+        nres++;
+    } else {
+        radix_unload();
+    }
+
+    /* route_lib: locked lookup and the datapath variants */
+    rib = route_table_create(AF_INET, 0);
+    struct route_info * ri = bsd_malloc(num_routes * sizeof(*ri), M_RTABLE, M_WAITOK | M_ZERO);
+    size_t nri = 0;
+    for (size_t i = 0; i < num_routes; i++) {
+        if (plens[i] & 0x80)
+            continue;
+        ri[nri].ri_dst = (struct sockaddr *)&keys[i];
+        ri[nri].ri_netmask = (struct sockaddr *)&masks[plens[i] & 0x7f];
+        nri++;
+    }
+    if (rib == NULL || route_table_load(rib, ri, nri) != ROUTE_OK) {
+        fprintf(stderr, "route_table_load failed\n");
+        return 1;
+    }
+    bsd_free(ri, M_RTABLE);
+
+    if (selected(only, "route_lookup")) {
+        res[nres].name = "route_lookup";
+        run_lookups(&res[nres++], LOOKUP_ROUTE);
+    }
+    if (selected(only, "fib4_lookup")) {
+        res[nres].name = "fib4_lookup";
+        run_lookups(&res[nres++], LOOKUP_FIB4);
+    }
+    if ((selected(only, "fib4_frozen") || selected(only, "fib4_burst")) &&
+        route_table_freeze(rib) == ROUTE_OK) {
+        if (selected(only, "fib4_frozen")) {
+            res[nres].name = "fib4_frozen";
+            run_lookups(&res[nres++], LOOKUP_FIB4);
+        }
+        if (selected(only, "fib4_burst")) {
+            res[nres].name = "fib4_burst";     /* Per key, bursts of BENCH_BURST */
+            run_lookups(&res[nres++], LOOKUP_FIB4_BURST);
+        }
+    }
+
+    printf("  %-18s %2s  %10s  %8s %8s %8s %8s %8s %10s\n", "benchmark", "th", "ops",
+           "mean", "p50", "p90", "p99", "p99.9", "max (ns)");
+    for (int i = 0; i < nres; i++)
+        print_result(&res[i]);
+
+    int ret = 0;
+    if (json)
+        ret = write_json(json, res, nres) != 0;
+
+    route_table_destroy(rib);
+    rn_detachhead((void **)&rnh);
+    traffic_destroy(traffic);
+    bsd_free(res, M_RTABLE);
+    bsd_free(nodes, M_RTABLE);
+    bsd_free(plens, M_RTABLE);
+    bsd_free(keys, M_RTABLE);
+    route_lib_cleanup();
+    return ret;
+}
@@ -197,6 +197,138 @@ static int test_radix_multiple_routes(void) {
     TEST_PASS();
 }
 
+#define FIXED_TEST_ROUTES   4000
+#define FIXED_TEST_LOOKUPS  50000
+
+static uint64_t fixed_rand(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*
+ * Fills @sa with a @family address of @alen bytes at @koff: random low
+ * bytes under one of a few random high bytes, so that prefixes nest.
+ */
+static void fixed_key(struct sockaddr_storage* sa, int family, int salen,
+                      int koff, int alen, uint64_t* state) {
+    u_char* addr = (u_char*)sa + koff;
+
+    memset(sa, 0, sizeof(*sa));
+    sa->ss_family = family;
+    ((struct sockaddr*)sa)->sa_len = salen;
+    for (int i = 0; i < alen; i++) {
+        addr[i] = (u_char)fixed_rand(state);
+    }
+    addr[0] = (addr[0] & 0x03) | 0x20;
+}
+
+/*
+ * Checks that the fixed-width lookup of @family returns the same leaf as
+ * rn_match() on a table of nested prefixes, host routes and a default.
+ */
+static int fixed_match_check(int family) {
+    int alen = (family == AF_INET) ? 4 : 16;
+    int koff = (family == AF_INET) ? (int)offsetof(struct sockaddr_in, sin_addr) :
+                                     (int)offsetof(struct sockaddr_in6, sin6_addr);
+    int salen = (family == AF_INET) ? (int)sizeof(struct sockaddr_in) :
+                                      (int)sizeof(struct sockaddr_in6);
+    rn_matchaddr_f_t* fixed = (family == AF_INET) ? rn_match_in4 : rn_match_in6;
+    struct radix_node_head* rnh = NULL;
+    struct sockaddr_storage masks[129], dst;
+    struct sockaddr_storage* keys;
+    struct sockaddr_storage** key_masks;
+    struct radix_node* nodes;
+    char* added;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    int mismatches = 0;
+
+    if (!rn_inithead((void**)&rnh, koff << 3)) {
+        return -1;
+    }
+    keys = bsd_malloc(FIXED_TEST_ROUTES * sizeof(*keys), M_RTABLE, M_WAITOK | M_ZERO);
+    key_masks = bsd_malloc(FIXED_TEST_ROUTES * sizeof(*key_masks), M_RTABLE,
+                           M_WAITOK | M_ZERO);
+    nodes = bsd_malloc(2 * FIXED_TEST_ROUTES * sizeof(*nodes), M_RTABLE,
+                       M_WAITOK | M_ZERO);
+    added = bsd_malloc(FIXED_TEST_ROUTES, M_RTABLE, M_WAITOK | M_ZERO);
+
+    for (int plen = 0; plen <= alen * 8; plen++) {
+        u_char* m = (u_char*)&masks[plen] + koff;
+
+        memset(&masks[plen], 0, sizeof(masks[plen]));
+        masks[plen].ss_family = family;
+        ((struct sockaddr*)&masks[plen])->sa_len = salen;
+        for (int b = 0; b < plen; b++) {
+            m[b >> 3] |= 0x80 >> (b & 7);
+        }
+    }
+
+    for (int i = 0; i < FIXED_TEST_ROUTES; i++) {
+        int plen = (i == 0) ? 0 : (int)(fixed_rand(&state) % (alen * 8 + 1));
+        u_char* addr = (u_char*)&keys[i] + koff;
+
+        fixed_key(&keys[i], family, salen, koff, alen, &state);
+        /* Every 8th route is a host route without a mask */
+        key_masks[i] = (i % 8 == 7) ? NULL : &masks[plen];
+        if (key_masks[i] != NULL) {
+            for (int b = 0; b < alen; b++) {
+                addr[b] &= ((u_char*)key_masks[i] + koff)[b];
+            }
+        }
+        /* Duplicates are not added */
+        added[i] = rnh->rnh_addaddr(&keys[i], key_masks[i], &rnh->rh,
+                                    &nodes[2 * i]) != NULL;
+    }
+
+    for (int i = 0; i < FIXED_TEST_LOOKUPS; i++) {
+        fixed_key(&dst, family, salen, koff, alen, &state);
+        if (i & 1) {
+            /* Next to a route: its key with one bit flipped */
+            struct sockaddr_storage* key = &keys[fixed_rand(&state) % FIXED_TEST_ROUTES];
+            int bit = (int)(fixed_rand(&state) % (alen * 8));
+
+            memcpy((u_char*)&dst + koff, (u_char*)key + koff, alen);
+            ((u_char*)&dst + koff)[bit >> 3] ^= 0x80 >> (bit & 7);
+        }
+        if (rn_match(&dst, &rnh->rh) != fixed(&dst, &rnh->rh)) {
+            mismatches++;
+        }
+    }
+    /* Exact keys hit host routes and the end of every prefix */
+    for (int i = 0; i < FIXED_TEST_ROUTES; i++) {
+        if (!added[i]) {
+            continue;
+        }
+        if (rn_match(&keys[i], &rnh->rh) != fixed(&keys[i], &rnh->rh)) {
+            mismatches++;
+        }
+    }
+
+    for (int i = 0; i < FIXED_TEST_ROUTES; i++) {
+        if (added[i]) {
+            rnh->rnh_deladdr(&keys[i], key_masks[i], &rnh->rh);
+        }
+    }
+    rn_detachhead((void**)&rnh);
+    bsd_free(added, M_RTABLE);
+    bsd_free(nodes, M_RTABLE);
+    bsd_free(key_masks, M_RTABLE);
+    bsd_free(keys, M_RTABLE);
+
+    return mismatches;
+}
+
+static int test_radix_fixed_match(void) {
+    TEST_ASSERT_EQ(0, fixed_match_check(AF_INET),
+                   "IPv4 fixed-width lookups should match rn_match()");
+    TEST_ASSERT_EQ(0, fixed_match_check(AF_INET6),
+                   "IPv6 fixed-width lookups should match rn_match()");
+
+    TEST_PASS();
+}
+
 /* Test suite definition */
 static test_case_t radix_tests[] = {
     TEST_CASE(radix_node_head_creation,
@@ -215,6 +347,10 @@ static test_case_t radix_tests[] = {
               "Test handling multiple routes",
               test_radix_multiple_routes),
 
+    TEST_CASE(radix_fixed_match,
+              "Test fixed-width IPv4/IPv6 lookups against rn_match()",
+              test_radix_fixed_match),
+
     TEST_SUITE_END()
 };
 
@@ -25,6 +25,7 @@
 /* Include our threading-enabled FreeBSD compatibility layer */
 #include "../kernel_compat/compat_shim.h"
 #include "../freebsd/radix.h"
+#include "test_traffic.h"
 
 /* Test configuration */
 #define NUM_READER_THREADS  4
@@ -40,6 +41,9 @@ static atomic_uint_fast64_t total_routes_added = 0;
 static atomic_uint_fast64_t total_lookups_done = 0;
 static atomic_uint_fast64_t total_routes_found = 0;
 
+/* Reader destinations over the routes the writers install */
+static struct traffic_gen *reader_traffic = NULL;
+
 /* Statistics per thread */
 struct thread_stats {
     uint64_t operations;
@@ -157,25 +161,25 @@ void* writer_thread(void* arg) {
 /* Reader thread - performs concurrent lookups */
 void* reader_thread(void* arg) {
     struct thread_stats *stats = (struct thread_stats*)arg;
+    struct traffic_stream traffic;
     clock_gettime(CLOCK_MONOTONIC, &stats->start_time);
 
+    traffic_stream_init(&traffic, reader_traffic, 0x1000 + stats->thread_id);
+
     printf("[READER %d] Starting - will perform %d lookups\n", stats->thread_id, LOOKUPS_PER_READER);
 
     while (atomic_load(&test_running)) {
         /* Look for routes that writers might have added */
         for (int i = 0; i < 100 && atomic_load(&test_running) && stats->operations < LOOKUPS_PER_READER; i++) {
-            /* Generate route ID from across all writers */
-            uint32_t route_id = (stats->operations + stats->thread_id * 1000) % (NUM_WRITER_THREADS * ROUTES_PER_WRITER);
-
-            struct sockaddr_in *lookup_key = make_route_key(route_id);
-            if (!lookup_key) {
-                stats->errors++;
-                continue;
-            }
+            struct sockaddr_in lookup_key;
+            memset(&lookup_key, 0, sizeof(lookup_key));
+            lookup_key.sin_family = AF_INET;
+            lookup_key.sin_len = sizeof(lookup_key);
+            traffic_next(&traffic, &lookup_key.sin_addr);
 
             /* Perform lookup using FreeBSD radix tree (with rmlock protection) */
             struct radix_node *found = test_rnh->rnh_matchaddr(
-                (struct sockaddr*)lookup_key, &test_rnh->rh);
+                (struct sockaddr*)&lookup_key, &test_rnh->rh);
 
             stats->operations++;
             atomic_fetch_add(&total_lookups_done, 1);
@@ -185,8 +189,6 @@ void* reader_thread(void* arg) {
                 atomic_fetch_add(&total_routes_found, 1);
             }
 
-            bsd_free(lookup_key, M_RTABLE);
-
             if (stats->operations % 2000 == 0) {
                 printf("[READER %d] Performed %lu lookups (%lu found)\n",
                        stats->thread_id, stats->operations, stats->successes);
@@ -240,6 +242,25 @@ int main() {
     printf("✅ Radix tree initialized with real rmlock protection\n");
     printf("   Lock name: %s\n", test_rnh->rnh_lock.name);
 
+    /* Destinations for the readers, Zipf over all writer routes by default */
+    reader_traffic = traffic_create(AF_INET, traffic_env_spec("zipf"));
+    if (!reader_traffic) {
+        printf("ERROR: Bad %s traffic pattern\n", TRAFFIC_ENV);
+        return 1;
+    }
+    for (uint32_t id = 0; id < NUM_WRITER_THREADS * ROUTES_PER_WRITER; id++) {
+        struct sockaddr_in *key = make_route_key(id);
+        if (key) {
+            traffic_add_prefix(reader_traffic, &key->sin_addr, 24);
+            bsd_free(key, M_RTABLE);
+        }
+    }
+    if (traffic_prepare(reader_traffic, 0xc0ffee) != 0) {
+        printf("ERROR: Failed to prepare reader traffic\n");
+        return 1;
+    }
+    printf("   Reader traffic: %s\n", traffic_name(reader_traffic));
+
     /* Create thread statistics */
     struct thread_stats reader_stats[NUM_READER_THREADS];
     struct thread_stats writer_stats[NUM_WRITER_THREADS];
@@ -340,11 +361,13 @@ int main() {
     /* Print lock statistics */
     printf("\n🔒 rmlock Statistics\n");
     printf("====================\n");
+    struct rm_stats lock_stats;
+    rm_get_stats(&test_rnh->rnh_lock, &lock_stats);
     printf("Lock name:           %s\n", test_rnh->rnh_lock.name);
-    printf("Total read locks:    %llu\n", (unsigned long long)test_rnh->rnh_lock.total_reads);
-    printf("Total write locks:   %llu\n", (unsigned long long)test_rnh->rnh_lock.total_writes);
-    printf("Current readers:     %u\n", test_rnh->rnh_lock.readers);
-    printf("Current writers:     %u\n", test_rnh->rnh_lock.writers);
+    printf("Total read locks:    %llu\n", (unsigned long long)lock_stats.rms_reads);
+    printf("Total write locks:   %llu\n", (unsigned long long)lock_stats.rms_writes);
+    printf("Current readers:     %u\n", lock_stats.rms_readers);
+    printf("Current writers:     %u\n", lock_stats.rms_writers);
 
     /* Calculate success rate */
     uint64_t total_ops = total_writer_ops + total_reader_ops;
@@ -359,6 +382,7 @@ int main() {
     printf("Overall rate:        %.0f ops/sec\n", total_ops / test_duration);
 
     /* Cleanup */
+    traffic_destroy(reader_traffic);
     rm_destroy(&test_rnh->rnh_lock);
 
     printf("\n🏆 Concurrent Radix Tree Test COMPLETED!\n");
@@ -5,6 +5,7 @@
  */
 
 #include "test_framework.h"
+#include "test_traffic.h"
 #include "compat_shim.h"
 #include "radix.h"
 #include <arpa/inet.h>
@@ -27,7 +28,7 @@ typedef enum {
 
 /* Route generation helpers */
 static struct sockaddr_in *make_route_key(uint32_t route_id, route_pattern_t pattern) {
-    struct sockaddr_in *sa = bsd_malloc(sizeof(*sa), M_RTABLE, M_WAITOK | M_ZERO);
+    struct sockaddr_in *sa = bsd_malloc(sizeof(*sa), M_RTSADDR, M_WAITOK | M_ZERO);
     if (!sa) return NULL;
 
     sa->sin_len = sizeof(*sa);
@@ -244,7 +245,7 @@ static struct sockaddr_in *make_route_key(uint32_t route_id, route_pattern_t pat
 }
 
 static struct sockaddr_in *make_route_mask(uint32_t route_id, route_pattern_t pattern) {
-    struct sockaddr_in *sa = bsd_malloc(sizeof(*sa), M_RTABLE, M_WAITOK | M_ZERO);
+    struct sockaddr_in *sa = bsd_malloc(sizeof(*sa), M_RTSADDR, M_WAITOK | M_ZERO);
     if (!sa) return NULL;
 
     sa->sin_len = sizeof(*sa);
@@ -280,9 +281,9 @@ static struct sockaddr_in *make_route_mask(uint32_t route_id, route_pattern_t pa
 }
 
 /* Memory usage tracking */
+/* Live malloc(9) bytes of all types and UMA slab memory */
 static size_t get_allocated_memory(void) {
-    /* This is a simple approximation - in production you'd use actual malloc tracking */
-    return 0; /* TODO: Implement if needed */
+    return (size_t)(malloc_type_total() + uma_zone_total());
 }
 
 static const char *pattern_name(route_pattern_t pattern) {
@@ -302,6 +303,68 @@ static int count_nodes_callback(struct radix_node *rn, void *arg) {
     (*counter)++;
     return 0;
 }
+/* Prefix length of a leaf, from its mask as stored in the mask tree */
+static int leaf_plen(const struct radix_node *rn) {
+    const u_char *m = (const u_char *)rn->rn_mask;
+    int off = offsetof(struct sockaddr_in, sin_addr);
+    int plen = 0;
+
+    if (m == NULL)
+        return 32;
+    for (int i = off; i < *m && i < off + 4; i++)
+        plen += __builtin_popcount(m[i]);
+    return plen;
+}
+
+/*
+ * Lookups with production-like destinations: by default Zipf over the
+ * installed prefixes and uniform random addresses, or the RADIX_TRAFFIC
+ * pattern when set.
+ */
+static void run_traffic_lookups(struct radix_node_head *rnh, struct radix_node **nodes,
+                                int num_nodes, int num_lookups) {
+    const char *dflt[] = { "zipf", "uniform" };
+    const char *env = traffic_env_spec(NULL);
+    int nspecs = env ? 1 : 2;
+
+    for (int s = 0; s < nspecs; s++) {
+        struct traffic_gen *gen = traffic_create(AF_INET, env ? env : dflt[s]);
+        struct traffic_stream ts;
+        struct sockaddr_in dst;
+        perf_timer_t timer;
+        int hits = 0;
+
+        if (gen == NULL)
+            return;
+        for (int i = 0; i < num_nodes; i++) {
+            const struct sockaddr_in *key = (const struct sockaddr_in *)nodes[i]->rn_key;
+            traffic_add_prefix(gen, &key->sin_addr, leaf_plen(nodes[i]));
+        }
+        if (traffic_prepare(gen, 0x5ca1ab1e) != 0) {
+            traffic_destroy(gen);
+            return;
+        }
+        traffic_stream_init(&ts, gen, 1);
+
+        memset(&dst, 0, sizeof(dst));
+        dst.sin_family = AF_INET;
+        dst.sin_len = sizeof(dst);
+
+        PERF_START(&timer);
+        for (int i = 0; i < num_lookups; i++) {
+            traffic_next(&ts, &dst.sin_addr);
+            if (rnh->rnh_matchaddr(&dst, &rnh->rh))
+                hits++;
+        }
+        PERF_END(&timer);
+
+        printf("✅ %s traffic: %d/%d hits in %.2fms (%.2f lookups/ms)\n",
+               traffic_name(gen), hits, num_lookups, timer.elapsed_ms,
+               num_lookups / (timer.elapsed_ms + 0.001));
+        traffic_destroy(gen);
+    }
+}
+
 static int run_scale_test(int num_routes, route_pattern_t pattern, const char *test_name) {
     printf("\n=== %s: %d routes (%s pattern) ===\n", test_name, num_routes, pattern_name(pattern));
 
@@ -345,8 +408,8 @@ static int run_scale_test(int num_routes, route_pattern_t pattern, const char *t
                     successful_adds++;
                 } else {
                     bsd_free(nodes, M_RTABLE);
-                    bsd_free(key, M_RTABLE);
-                    bsd_free(mask, M_RTABLE);
+                    bsd_free(key, M_RTSADDR);
+                    bsd_free(mask, M_RTSADDR);
                 }
             }
         }
@@ -373,7 +436,10 @@ static int run_scale_test(int num_routes, route_pattern_t pattern, const char *t
 
     printf("✅ Added %d/%d routes in %.2fms (%.2f routes/ms)\n",
            successful_adds, num_routes, timer.elapsed_ms, add_rate);
-    printf("   Memory usage: %zu bytes increase\n", mem_after_add - mem_before);
+    printf("   Memory usage: %zu bytes increase (%.1f bytes/route)\n",
+           mem_after_add - mem_before,
+           (double)(mem_after_add - mem_before) / (successful_adds ? successful_adds : 1));
+    malloc_type_report(stdout);
 
     if (successful_adds < num_routes * 0.95) {
         printf("❌ FAIL: Too many route additions failed (%d/%d)\n",
@@ -417,7 +483,7 @@ static int run_scale_test(int num_routes, route_pattern_t pattern, const char *t
             if (found) {
                 successful_lookups++;
             }
-            bsd_free(lookup_key, M_RTABLE);
+            bsd_free(lookup_key, M_RTSADDR);
         }
 
         /* Progress indicator for large tests */
@@ -441,6 +507,10 @@ static int run_scale_test(int num_routes, route_pattern_t pattern, const char *t
     printf("✅ Found %d/%d routes in %.2fms (%.2f lookups/ms)\n",
            successful_lookups, successful_adds, timer.elapsed_ms, lookup_rate);
 
+    /* Phase 2b: Lookups with realistic destination locality */
+    printf("Phase 2b: Traffic lookups...\n");
+    run_traffic_lookups(rnh, route_nodes, successful_adds, successful_adds);
+
     /* Phase 3: Tree walk count */
     printf("Phase 3: Walking tree...\n");
     int walk_count = 0;
@@ -480,8 +550,8 @@ static int run_scale_test(int num_routes, route_pattern_t pattern, const char *t
             }
         }
 
-        if (del_key) bsd_free(del_key, M_RTABLE);
-        if (del_mask) bsd_free(del_mask, M_RTABLE);
+        if (del_key) bsd_free(del_key, M_RTSADDR);
+        if (del_mask) bsd_free(del_mask, M_RTSADDR);
 
         /* Progress indicator for large tests */
         if (num_routes >= 10000000 && (successful_deletes % 100000) == 0 && successful_deletes > 0) {
@@ -0,0 +1,444 @@
+/*
+ * Radix IPv6 Scale Test
+ *
+ * Large-scale stress testing of FreeBSD radix tree with 200K-1M IPv6
+ * prefixes drawn from a DFZ-like /32-/64 prefix-length mix.
+ */
+
+#include "test_framework.h"
+#include "test_traffic.h"
+#include "compat_shim.h"
+#include "radix.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <time.h>
+
+/* Scale test configuration */
+#define SCALE6_TEST_ROUTES_200K 200000
+#define SCALE6_TEST_ROUTES_500K 500000
+#define SCALE6_TEST_ROUTES_1M   1000000
+
+#define SCALE6_SEED             0x6a09e667f3bcc908ULL
+#define SCALE6_CLUSTER_SHIFT    3   /* 8 consecutive ids share a /32 */
+
+/*
+ * Prefix-length mix, in parts per thousand. Roughly the shape of the
+ * public IPv6 table: /48s dominate, /32 and /44 are the next buckets,
+ * and /56-/64 more-specifics make up the tail.
+ */
+static const struct {
+    uint8_t     plen;
+    uint16_t    weight;
+} scale6_plen_mix[] = {
+    { 32, 120 }, { 33,  10 }, { 34,  10 }, { 35,  10 }, { 36,  40 },
+    { 40,  60 }, { 42,  15 }, { 44,  80 }, { 45,  10 }, { 46,  30 },
+    { 47,  25 }, { 48, 450 }, { 52,  10 }, { 56,  50 }, { 60,  10 },
+    { 64,  20 },
+};
+#define SCALE6_PLEN_BUCKETS (sizeof(scale6_plen_mix) / sizeof(scale6_plen_mix[0]))
+
+/* One interned mask per prefix length; rn_addmask() copies what it keeps */
+static struct sockaddr_in6 scale6_masks[129];
+
+/* Bytes handed to the tree by this test (keys + radix node pairs) */
+static size_t scale6_bytes;
+
+static uint64_t scale6_mix64(uint64_t x) {
+    /* splitmix64 finalizer: cheap, deterministic, well distributed */
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void scale6_init_sin6(struct sockaddr_in6 *sin6) {
+    memset(sin6, 0, sizeof(*sin6));
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_len = sizeof(*sin6);
+}
+
+static void scale6_init_masks(void) {
+    for (int plen = 0; plen <= 128; plen++) {
+        struct sockaddr_in6 *m = &scale6_masks[plen];
+
+        scale6_init_sin6(m);
+        for (int i = 0; i < plen / 8; i++)
+            m->sin6_addr.s6_addr[i] = 0xff;
+        if (plen % 8)
+            m->sin6_addr.s6_addr[plen / 8] = (uint8_t)(0xff << (8 - plen % 8));
+    }
+}
+
+static int scale6_pick_plen(uint64_t h) {
+    uint32_t r = (uint32_t)(h % 1000);
+
+    for (size_t i = 0; i < SCALE6_PLEN_BUCKETS; i++) {
+        if (r < scale6_plen_mix[i].weight)
+            return scale6_plen_mix[i].plen;
+        r -= scale6_plen_mix[i].weight;
+    }
+    return 48;
+}
+
+static void scale6_put64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (56 - 8 * i));
+}
+
+/*
+ * Build prefix route_id. /32s are independent allocations; longer
+ * prefixes share their top 32 bits with the rest of their id cluster,
+ * so the tree sees the nested more-specifics a real table carries.
+ * Everything stays inside 2000::/4.
+ */
+static int make_route_key6(uint32_t route_id, struct sockaddr_in6 *sin6) {
+    uint64_t h = scale6_mix64(SCALE6_SEED ^ route_id);
+    uint64_t top, bot;
+    int plen = scale6_pick_plen(h);
+
+    if (plen == 32)
+        top = scale6_mix64(h);
+    else
+        top = scale6_mix64(SCALE6_SEED + (route_id >> SCALE6_CLUSTER_SHIFT));
+    top = (top >> 32) & 0x0fffffffULL;
+    top = ((0x2ULL << 28) | top) << 32;
+    top |= scale6_mix64(h ^ SCALE6_SEED) & 0xffffffffULL;
+    bot = 0;
+
+    /* Clear host bits past plen (plen <= 64 for every bucket) */
+    if (plen < 64)
+        top &= ~((1ULL << (64 - plen)) - 1);
+
+    scale6_init_sin6(sin6);
+    scale6_put64(&sin6->sin6_addr.s6_addr[0], top);
+    scale6_put64(&sin6->sin6_addr.s6_addr[8], bot);
+    return plen;
+}
+
+/* Fill the host bits of a prefix to get a datapath-style destination */
+static void make_route_dst6(const struct sockaddr_in6 *key, int plen, uint64_t h,
+                            struct sockaddr_in6 *dst) {
+    *dst = *key;
+    for (int i = plen; i < 128; i++) {
+        if ((h >> (i & 63)) & 1)
+            dst->sin6_addr.s6_addr[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+    }
+}
+
+/* Tree walk callback functions */
+static int count_nodes_callback(struct radix_node *rn, void *arg) {
+    (void)rn;
+    int *counter = (int*)arg;
+    (*counter)++;
+    return 0;
+}
+
+/*
+ * Lookups with production-like destinations: by default Zipf over the
+ * installed prefixes and uniform random addresses, or the RADIX_TRAFFIC
+ * pattern when set.
+ */
+static void run_traffic_lookups6(struct radix_node_head *rnh, const struct sockaddr_in6 *keys,
+                                 const uint8_t *plens, const uint32_t *added, int num_added) {
+    const char *dflt[] = { "zipf", "uniform" };
+    const char *env = traffic_env_spec(NULL);
+    int nspecs = env ? 1 : 2;
+
+    for (int s = 0; s < nspecs; s++) {
+        struct traffic_gen *gen = traffic_create(AF_INET6, env ? env : dflt[s]);
+        struct traffic_stream ts;
+        struct sockaddr_in6 dst;
+        perf_timer_t timer;
+        int hits = 0;
+
+        if (gen == NULL)
+            return;
+        for (int i = 0; i < num_added; i++)
+            traffic_add_prefix(gen, &keys[added[i]].sin6_addr, plens[added[i]]);
+        if (traffic_prepare(gen, SCALE6_SEED) != 0) {
+            traffic_destroy(gen);
+            return;
+        }
+        traffic_stream_init(&ts, gen, 1);
+        scale6_init_sin6(&dst);
+
+        PERF_START(&timer);
+        for (int i = 0; i < num_added; i++) {
+            traffic_next(&ts, &dst.sin6_addr);
+            if (rnh->rnh_matchaddr(&dst, &rnh->rh))
+                hits++;
+        }
+        PERF_END(&timer);
+
+        printf("✅ %s traffic: %d/%d hits in %.2fms (%.2f lookups/ms, %.0f ns/lookup)\n",
+               traffic_name(gen), hits, num_added, timer.elapsed_ms,
+               num_added / (timer.elapsed_ms + 0.001),
+               timer.elapsed_ms * 1e6 / (num_added + 0.001));
+        traffic_destroy(gen);
+    }
+}
+
+static int run_scale6_test(int num_routes, const char *test_name) {
+    printf("\n=== %s: %d IPv6 prefixes (/32-/64 mix) ===\n", test_name, num_routes);
+
+    perf_timer_t timer;
+    struct radix_node_head *rnh = NULL;
+    struct sockaddr_in6 *keys = NULL;
+    uint8_t *plens = NULL;
+    uint32_t *added = NULL;
+    int plen_count[129] = {0};
+    int successful_adds = 0;
+    int duplicates = 0;
+    int successful_lookups = 0;
+    int successful_deletes = 0;
+    int failed_deletes = 0;
+    int walk_count = 0;
+    double add_rate = 0, lookup_rate = 0, delete_rate = 0;
+
+    scale6_init_masks();
+    scale6_bytes = 0;
+
+    /* Initialize radix tree (offset is in bits) */
+    int offset = offsetof(struct sockaddr_in6, sin6_addr) << 3;
+    if (rn_inithead((void **)&rnh, offset) != 1) {
+        printf("FAIL: rn_inithead failed\n");
+        return -1;
+    }
+
+    /* Keys stay referenced by the leaves, so keep them in one array */
+    keys = bsd_malloc(num_routes * sizeof(*keys), M_RTABLE, M_WAITOK | M_ZERO);
+    plens = bsd_malloc(num_routes, M_RTABLE, M_WAITOK | M_ZERO);
+    added = bsd_malloc(num_routes * sizeof(*added), M_RTABLE, M_WAITOK | M_ZERO);
+
+    for (int i = 0; i < num_routes; i++)
+        plens[i] = (uint8_t)make_route_key6(i, &keys[i]);
+
+    /* Phase 1: Add routes */
+    printf("Phase 1: Adding %d prefixes...\n", num_routes);
+
+    PERF_START(&timer);
+    for (int i = 0; i < num_routes; i++) {
+        struct radix_node *nodes = bsd_malloc(2 * sizeof(struct radix_node), M_RTABLE, M_WAITOK | M_ZERO);
+        struct radix_node *rn = rnh->rnh_addaddr(&keys[i], &scale6_masks[plens[i]],
+                                                 &rnh->rh, nodes);
+        if (rn) {
+            added[successful_adds++] = i;
+            plen_count[plens[i]]++;
+        } else {
+            bsd_free(nodes, M_RTABLE);
+            duplicates++;
+        }
+
+        if (num_routes >= 100000 && (i + 1) % 100000 == 0) {
+            printf("  Added %d/%d prefixes (%.1f%%)...\n",
+                   i + 1, num_routes, ((i + 1) * 100.0) / num_routes);
+        }
+    }
+    PERF_END(&timer);
+
+    scale6_bytes = successful_adds * (sizeof(struct sockaddr_in6) + 2 * sizeof(struct radix_node));
+    add_rate = successful_adds / (timer.elapsed_ms + 0.001);
+
+    printf("✅ Added %d/%d prefixes in %.2fms (%.2f routes/ms, %.0f ns/insert)\n",
+           successful_adds, num_routes, timer.elapsed_ms, add_rate,
+           timer.elapsed_ms * 1e6 / (successful_adds + 0.001));
+    printf("   Duplicates rejected: %d\n", duplicates);
+    printf("   Prefix lengths:");
+    for (int p = 0; p <= 128; p++) {
+        if (plen_count[p] != 0)
+            printf(" /%d=%d", p, plen_count[p]);
+    }
+    printf("\n");
+    printf("   Memory: %zu bytes, %.1f bytes/prefix (key %zu + 2 radix nodes %zu)\n",
+           scale6_bytes, (double)scale6_bytes / (successful_adds + 0.001),
+           sizeof(struct sockaddr_in6), 2 * sizeof(struct radix_node));
+
+    if (successful_adds < num_routes * 0.99) {
+        printf("❌ FAIL: Too many prefix additions failed (%d/%d)\n",
+               successful_adds, num_routes);
+        goto cleanup;
+    }
+
+    /* Phase 2: Longest-match lookups on host addresses inside each prefix */
+    printf("Phase 2: Looking up %d destinations...\n", successful_adds);
+
+    PERF_START(&timer);
+    for (int i = 0; i < successful_adds; i++) {
+        uint32_t id = added[i];
+        struct sockaddr_in6 dst;
+
+        make_route_dst6(&keys[id], plens[id], scale6_mix64(id), &dst);
+        struct radix_node *found = rnh->rnh_matchaddr(&dst, &rnh->rh);
+        if (found) {
+            successful_lookups++;
+        }
+    }
+    PERF_END(&timer);
+
+    lookup_rate = successful_lookups / (timer.elapsed_ms + 0.001);
+    printf("✅ Found %d/%d destinations in %.2fms (%.2f lookups/ms, %.0f ns/lookup)\n",
+           successful_lookups, successful_adds, timer.elapsed_ms, lookup_rate,
+           timer.elapsed_ms * 1e6 / (successful_adds + 0.001));
+
+    /* Phase 2b: Lookups with realistic destination locality */
+    printf("Phase 2b: Traffic lookups...\n");
+    run_traffic_lookups6(rnh, keys, plens, added, successful_adds);
+
+    /* Phase 3: Tree walk count */
+    PERF_START(&timer);
+    rnh->rnh_walktree(&rnh->rh, count_nodes_callback, &walk_count);
+    PERF_END(&timer);
+
+    printf("✅ Tree walk found %d leaves in %.2fms\n", walk_count, timer.elapsed_ms);
+
+    /* Phase 4: Delete routes in a shuffled order */
+    printf("Phase 4: Deleting %d prefixes...\n", successful_adds);
+
+    for (int i = successful_adds - 1; i > 0; i--) {
+        int j = (int)(scale6_mix64(SCALE6_SEED ^ (uint64_t)i << 32) % (uint64_t)(i + 1));
+        uint32_t t = added[i];
+        added[i] = added[j];
+        added[j] = t;
+    }
+
+    PERF_START(&timer);
+    for (int i = 0; i < successful_adds; i++) {
+        uint32_t id = added[i];
+        struct radix_node *deleted = rnh->rnh_deladdr(&keys[id], &scale6_masks[plens[id]],
+                                                      &rnh->rh);
+        if (deleted) {
+            successful_deletes++;
+            bsd_free(deleted, M_RTABLE);
+        } else if (++failed_deletes <= 10) {
+            char buf[INET6_ADDRSTRLEN];
+            printf("  ❌ Failed to delete %s/%d\n",
+                   inet_ntop(AF_INET6, &keys[id].sin6_addr, buf, sizeof(buf)), plens[id]);
+        }
+    }
+    PERF_END(&timer);
+
+    delete_rate = successful_deletes / (timer.elapsed_ms + 0.001);
+    printf("✅ Deleted %d/%d prefixes in %.2fms (%.2f deletes/ms, %.0f ns/delete)\n",
+           successful_deletes, successful_adds, timer.elapsed_ms, delete_rate,
+           timer.elapsed_ms * 1e6 / (successful_adds + 0.001));
+
+    /* Final tree walk to verify cleanup */
+    walk_count = 0;
+    rnh->rnh_walktree(&rnh->rh, count_nodes_callback, &walk_count);
+    printf("✅ Tree after cleanup: %d leaves remaining\n", walk_count);
+
+    /* Summary */
+    printf("\n📊 Performance Summary:\n");
+    printf("   Add rate:    %.2f routes/ms\n", add_rate);
+    printf("   Lookup rate: %.2f lookups/ms\n", lookup_rate);
+    printf("   Delete rate: %.2f deletes/ms\n", delete_rate);
+    printf("   Memory:      %.1f bytes/prefix\n",
+           (double)scale6_bytes / (successful_adds + 0.001));
+
+cleanup:
+    /* Anything still in the tree after a failed run is reclaimed here */
+    for (int i = 0; i < successful_adds; i++) {
+        uint32_t id = added[i];
+        struct radix_node *rn = rnh->rnh_deladdr(&keys[id], &scale6_masks[plens[id]],
+                                                 &rnh->rh);
+        if (rn)
+            bsd_free(rn, M_RTABLE);
+    }
+    rn_detachhead((void **)&rnh);
+    bsd_free(added, M_RTABLE);
+    bsd_free(plens, M_RTABLE);
+    bsd_free(keys, M_RTABLE);
+
+    /* Every generated prefix is looked up and deleted exactly once */
+    int success = (successful_adds >= num_routes * 0.99 &&
+                   successful_lookups == successful_adds &&
+                   successful_deletes == successful_adds &&
+                   walk_count == 0);
+
+    return success ? 0 : -1;
+}
+
+/* Test cases */
+static int test_scale6_200k(void) {
+    return run_scale6_test(SCALE6_TEST_ROUTES_200K, "200K IPv6 Prefix Scale Test");
+}
+
+static int test_scale6_500k(void) {
+    printf("⚠️  WARNING: 500K prefix test - this will take several seconds!\n");
+    return run_scale6_test(SCALE6_TEST_ROUTES_500K, "500K IPv6 Prefix Stress Test");
+}
+
+static int test_scale6_1m(void) {
+    printf("⚠️  WARNING: 1M prefix test - this will take a while!\n");
+    return run_scale6_test(SCALE6_TEST_ROUTES_1M, "1M IPv6 Prefix Stress Test");
+}
+
+/* Test suite definition */
+static test_case_t radix_scale6_tests[] = {
+    TEST_CASE(scale6_200k,
+              "200K IPv6 prefixes add/lookup/delete",
+              test_scale6_200k),
+
+    TEST_CASE(scale6_500k,
+              "500K IPv6 prefix stress test",
+              test_scale6_500k),
+
+    TEST_CASE(scale6_1m,
+              "1M IPv6 prefix extreme stress test",
+              test_scale6_1m),
+
+    TEST_SUITE_END()
+};
+
+test_suite_t radix_scale6_test_suite = {
+    "Radix IPv6 Scale Tests",
+    "Large-scale IPv6 stress testing of FreeBSD radix tree",
+    radix_scale6_tests,
+    0,  /* num_tests calculated at runtime */
+    NULL, /* setup */
+    NULL  /* teardown */
+};
+
+/* Main test runner */
+int main(int argc, char* argv[]) {
+    (void)argc; (void)argv;
+
+    printf("FreeBSD Radix Tree IPv6 Scale Test Suite\n");
+    printf("========================================\n");
+    printf("Testing large-scale IPv6 prefix operations...\n\n");
+
+    /* Initialize test framework */
+    if (test_framework_init() != 0) {
+        fprintf(stderr, "Failed to initialize test framework\n");
+        return 1;
+    }
+
+    /* Initialize compatibility layer */
+    kernel_compat_init();
+
+    /* Count tests */
+    int count = 0;
+    while (radix_scale6_tests[count].name != NULL) {
+        count++;
+    }
+    radix_scale6_test_suite.num_tests = count;
+
+    printf("Running %d IPv6 scale tests...\n\n", count);
+
+    /* Run the test suite */
+    int result = test_run_suite(&radix_scale6_test_suite);
+
+    /* Print summary */
+    test_print_summary();
+
+    /* Clean up test framework */
+    test_framework_cleanup();
+
+    if (result != 0 || g_test_result.failed_tests > 0) {
+        printf("\n❌ IPv6 scale tests revealed issues.\n");
+        return 1;
+    }
+
+    printf("\n🚀 All IPv6 scale tests passed!\n");
+    return 0;
+}
@@ -378,13 +378,22 @@ int main() {
     /* Lock performance analysis */
     printf("🔒 rmlock Performance Analysis\n");
     printf("===============================\n");
+    struct rm_stats lock_stats;
+    rm_get_stats(&table_lock, &lock_stats);
     printf("Lock Statistics:\n");
-    printf("  Total read locks:  %llu\n", (unsigned long long)table_lock.total_reads);
-    printf("  Total write locks: %llu\n", (unsigned long long)table_lock.total_writes);
+    printf("  Total read locks:  %llu\n", (unsigned long long)lock_stats.rms_reads);
+    printf("  Total write locks: %llu\n", (unsigned long long)lock_stats.rms_writes);
     printf("  Lock operations:   %llu total\n",
-           (unsigned long long)(table_lock.total_reads + table_lock.total_writes));
+           (unsigned long long)(lock_stats.rms_reads + lock_stats.rms_writes));
     printf("  Lock rate:         %.0f locks/sec\n",
-           (table_lock.total_reads + table_lock.total_writes) / total_test_duration);
+           (lock_stats.rms_reads + lock_stats.rms_writes) / total_test_duration);
+    printf("  Contended:         %llu reads, %llu writes\n",
+           (unsigned long long)lock_stats.rms_read_contended,
+           (unsigned long long)lock_stats.rms_write_contended);
+    if (lock_stats.rms_read_samples > 0) {
+        printf("  Sampled read hold: %.2f μs\n",
+               lock_stats.rms_read_hold_ns / 1000.0 / lock_stats.rms_read_samples);
+    }
     printf("\n");
 
     printf("Lock Timing:\n");
@@ -102,9 +102,11 @@ int main() {
     pthread_join(writers[0], NULL);
 
     printf("✅ Final counter: %d\n", shared_counter);
+    struct rm_stats stats;
+    rm_get_stats(&global_lock, &stats);
     printf("📊 Lock stats: R=%llu W=%llu\n",
-           (unsigned long long)global_lock.total_reads,
-           (unsigned long long)global_lock.total_writes);
+           (unsigned long long)stats.rms_reads,
+           (unsigned long long)stats.rms_writes);
 
     rm_destroy(&global_lock);
     printf("🎉 SUCCESS: Level 2 rmlock works!\n");
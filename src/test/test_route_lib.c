@@ -0,0 +1,3246 @@
+/*
+ * Test suite for the route_lib implementation (src/route_lib.c)
+ */
+
+#include "test_framework.h"
+#include "../include/route_lib.h"
+#include "../kernel_compat/compat_shim.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define LOAD_TEST_ROUTES 1024
+
+/* Test setup and teardown */
+static int route_lib_test_setup(void) {
+    return route_lib_init();
+}
+
+static int route_lib_test_teardown(void) {
+    route_lib_cleanup();
+    return 0;
+}
+
+static void make_sin(struct sockaddr_in* sin, const char* addr) {
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_len = sizeof(*sin);
+    inet_pton(AF_INET, addr, &sin->sin_addr);
+}
+
+static int add_route4(struct rib_head* rh, const char* dst, const char* mask,
+                      const char* gw) {
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_info ri;
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, dst);
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    if (mask) {
+        make_sin(&mask_addr, mask);
+        ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    }
+    make_sin(&gw_addr, gw);
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+
+    return route_add(rh, &ri);
+}
+
+static int check_gateway(const struct route_info* ri, const char* gw) {
+    struct in_addr expected;
+
+    inet_pton(AF_INET, gw, &expected);
+    return ri->ri_gateway != NULL &&
+        ((const struct sockaddr_in*)ri->ri_gateway)->sin_addr.s_addr == expected.s_addr;
+}
+
+static int count_walker(struct route_info* ri, void* arg) {
+    (void)ri;
+    __atomic_fetch_add((int*)arg, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Test cases */
+static int test_fib4_lookup(void) {
+    struct rib_head* rh;
+    struct route_info ri;
+    struct in_addr dst;
+
+    rh = route_table_create(AF_INET, 0);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.1/16");
+
+    inet_pton(AF_INET, "10.1.2.3", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(0, dst, 0, &ri), "Should match 10.1/16");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Should pick the longest match");
+
+    inet_pton(AF_INET, "10.2.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(0, dst, 0, &ri), "Should match 10/8");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.1"), "Should fall back to 10/8");
+
+    inet_pton(AF_INET, "11.0.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(0, dst, 0, &ri), "Should miss 11/8");
+
+    /* Datapath lookups are not accounted */
+    struct route_stats stats;
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(0, stats.rs_lookups, "fib4_lookup should not bump rs_lookups");
+
+    route_table_destroy(rh);
+
+    inet_pton(AF_INET, "10.1.2.3", &dst);
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(0, dst, 0, &ri),
+                   "Destroyed table should be detached from the datapath");
+
+    TEST_PASS();
+}
+
+static int test_fib4_lookup_delete(void) {
+    struct rib_head* rh;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri;
+    struct in_addr dst;
+
+    rh = route_table_create(AF_INET, 0);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "172.16.0.0", "255.240.0.0", "10.0.0.1"),
+                   "Should add 172.16/12");
+
+    inet_pton(AF_INET, "172.17.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(0, dst, 0, &ri), "Should match 172.16/12");
+
+    make_sin(&dst_addr, "172.16.0.0");
+    make_sin(&mask_addr, "255.240.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 172.16/12");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(0, dst, 0, &ri), "Should miss after delete");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_delete_dupkey(void) {
+    static const char* masks[] = {
+        "255.255.255.0", "255.255.0.0", "255.255.255.240", "255.0.0.0"
+    };
+    struct rib_head* rh;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri;
+    struct in_addr dst;
+
+    rh = route_table_create(AF_INET, 0);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    /* Same key, one list of duplicated keys sorted by mask */
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", masks[i], "192.168.0.1"),
+                       "Should add 10.0.0.0 with each mask");
+    }
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.1.0", "255.255.255.0", "192.168.0.2"),
+                   "Should add 10.0.1/24");
+    TEST_ASSERT_EQ(ROUTE_OK, route_validate_table(rh), "Table should be consistent");
+
+    make_sin(&dst_addr, "10.0.0.0");
+    make_sin(&mask_addr, "255.255.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete from the middle of the list");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                              (struct sockaddr*)&mask_addr),
+                   "Should not delete 10/16 twice");
+    TEST_ASSERT_EQ(ROUTE_OK, route_validate_table(rh), "Table should be consistent");
+
+    make_sin(&mask_addr, "255.255.255.240");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete the head of the list");
+    TEST_ASSERT_EQ(ROUTE_OK, route_validate_table(rh), "Table should be consistent");
+
+    inet_pton(AF_INET, "10.0.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(0, dst, 0, &ri), "Should match 10.0.0/24");
+    inet_pton(AF_INET, "10.0.2.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(0, dst, 0, &ri), "Should fall back to 10/8");
+
+    make_sin(&mask_addr, "255.255.255.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 10.0.0/24");
+    make_sin(&mask_addr, "255.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete the last route of the list");
+    TEST_ASSERT_EQ(ROUTE_OK, route_validate_table(rh), "Table should be consistent");
+
+    inet_pton(AF_INET, "10.0.1.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(0, dst, 0, &ri), "Should still match 10.0.1/24");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Should return the remaining route");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_fib_lookup_invalid(void) {
+    struct route_info ri;
+    struct in_addr dst;
+
+    inet_pton(AF_INET, "10.0.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_EINVAL, fib4_lookup(100000, dst, 0, &ri),
+                   "Out of range fib should fail");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, fib6_lookup(0, NULL, 0, &ri),
+                   "NULL IPv6 destination should fail");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(7, dst, 0, &ri),
+                   "Lookup in a missing table should miss");
+
+    TEST_PASS();
+}
+
+static int test_route_mask_sharing(void) {
+    struct malloc_type_stats before, after;
+    struct rib_head *rh, *other;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri1, ri2;
+    const struct sockaddr* mask;
+
+    rh = route_table_create(AF_INET, 1);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.1"),
+                   "Should add 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.2.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.2/16");
+
+    make_sin(&dst_addr, "10.1.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri1),
+                   "Should match 10.1/16");
+    make_sin(&dst_addr, "10.2.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri2),
+                   "Should match 10.2/16");
+    TEST_ASSERT(ri1.ri_netmask == ri2.ri_netmask, "Routes should share the interned mask");
+    TEST_ASSERT(ri1.ri_dst != ri2.ri_dst, "Keys should be stored per route");
+    mask = ri2.ri_netmask;
+
+    /* The mask outlives a route while other routes still reference it */
+    make_sin(&dst_addr, "10.1.0.0");
+    make_sin(&mask_addr, "255.255.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 10.1/16");
+    epoch_drain_callbacks(net_epoch_preempt);
+    TEST_ASSERT(sa_equal(mask, (struct sockaddr*)&mask_addr),
+                "Shared mask should survive the delete");
+
+    /* Contiguous masks are shared by all tables without being allocated */
+    epoch_drain_callbacks(net_epoch_preempt);
+    malloc_type_fetch(M_RTMASK, &before);
+    other = route_table_create(AF_INET, 27);
+    TEST_ASSERT_NOT_NULL(other, "Should create a second table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(other, "172.16.0.0", "255.255.0.0", "192.168.0.3"),
+                   "Should add 172.16/16");
+    make_sin(&dst_addr, "172.16.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(other, (struct sockaddr*)&dst_addr, &ri1),
+                   "Should match 172.16/16");
+    TEST_ASSERT(ri1.ri_netmask == mask, "Tables should share the /16 mask");
+    malloc_type_fetch(M_RTMASK, &after);
+    TEST_ASSERT_EQ(before.mts_objects, after.mts_objects,
+                   "Contiguous masks should not be allocated");
+
+    /* Other masks are still interned */
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(other, "10.0.3.0", "255.0.255.0", "192.168.0.4"),
+                   "Should add a non-contiguous mask");
+    make_sin(&dst_addr, "10.9.3.9");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(other, (struct sockaddr*)&dst_addr, &ri1),
+                   "Should match the non-contiguous mask");
+    TEST_ASSERT(check_gateway(&ri1, "192.168.0.4"), "Should return the masked route");
+    malloc_type_fetch(M_RTMASK, &after);
+    TEST_ASSERT(after.mts_objects > before.mts_objects,
+                "Non-contiguous masks should be interned");
+    route_table_destroy(other);
+    malloc_type_fetch(M_RTMASK, &after);
+    TEST_ASSERT_EQ(before.mts_objects, after.mts_objects, "Masks should all be released");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int check_nhop(uint32_t nhidx, const char* gw) {
+    const struct route_nhop* nhops;
+    struct in_addr expected;
+    uint32_t count;
+
+    nhops = route_nhop_array(&count);
+    inet_pton(AF_INET, gw, &expected);
+    return nhidx != 0 && nhidx < count && nhops[nhidx].rnh_gateway != NULL &&
+        ((const struct sockaddr_in*)nhops[nhidx].rnh_gateway)->sin_addr.s_addr ==
+        expected.s_addr;
+}
+
+static int test_fib_lookup_nhidx(void) {
+    struct rib_head *rh, *restored;
+    struct sockaddr_in dst_addr, mask_addr;
+    const struct route_nhop* nhops;
+    struct in_addr dst1, dst2, dst3;
+    uint32_t nh1, nh2, count;
+    char path[64];
+
+    rh = route_table_create(AF_INET, 0);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "11.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 11/8");
+
+    inet_pton(AF_INET, "10.2.0.1", &dst1);
+    inet_pton(AF_INET, "10.1.0.1", &dst2);
+    inet_pton(AF_INET, "11.0.0.1", &dst3);
+    nh1 = fib4_lookup_nhidx(0, dst1, 0);
+    nh2 = fib4_lookup_nhidx(0, dst2, 0);
+    TEST_ASSERT(check_nhop(nh1, "192.168.0.1"), "10/8 should resolve to its gateway");
+    TEST_ASSERT(check_nhop(nh2, "192.168.0.2"), "10.1/16 should resolve to its gateway");
+    TEST_ASSERT_EQ(nh1, fib4_lookup_nhidx(0, dst3, 0), "Same gateways should share a nexthop");
+
+    inet_pton(AF_INET, "12.0.0.1", &dst1);
+    TEST_ASSERT_EQ(0u, fib4_lookup_nhidx(0, dst1, 0), "Misses should return 0");
+    TEST_ASSERT_EQ(0u, fib4_lookup_nhidx(100000, dst2, 0), "Out of range fib should fail");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    TEST_ASSERT_EQ(nh2, fib4_lookup_nhidx(0, dst2, 0), "Frozen copy should return the same");
+
+    /* Images answer with the nexthops of the restored table */
+    snprintf(path, sizeof(path), "/tmp/route_lib_nhidx.%d.snap", (int)getpid());
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_save(rh, path), "Should save the table");
+    restored = route_table_restore(path, 1);
+    unlink(path);
+    TEST_ASSERT_NOT_NULL(restored, "Should restore the table");
+    TEST_ASSERT_EQ(nh2, fib4_lookup_nhidx(1, dst2, 0), "Restored routes should share nexthops");
+    route_table_destroy(restored);
+
+    /* The nexthop goes away with its last route */
+    make_sin(&dst_addr, "10.1.0.0");
+    make_sin(&mask_addr, "255.255.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 10.1/16");
+    epoch_drain_callbacks(net_epoch_preempt);
+    nhops = route_nhop_array(&count);
+    TEST_ASSERT(nh2 < count && nhops[nh2].rnh_gateway == NULL,
+                "Unused nexthop slot should be cleared");
+    TEST_ASSERT(check_nhop(nh1, "192.168.0.1"), "Shared nexthop should remain");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int add_mpath4(struct rib_head* rh, const char* dst, const char* mask) {
+    struct sockaddr_in dst_addr, mask_addr, gw_addr[2];
+    struct route_mpath_gw gws[2];
+    struct route_info ri;
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, dst);
+    make_sin(&mask_addr, mask);
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+
+    /* 1:2, three slots */
+    make_sin(&gw_addr[0], "192.168.0.1");
+    make_sin(&gw_addr[1], "192.168.0.2");
+    gws[0] = (struct route_mpath_gw){ (struct sockaddr*)&gw_addr[0], 1, 1 };
+    gws[1] = (struct route_mpath_gw){ (struct sockaddr*)&gw_addr[1], 2, 2 };
+
+    return route_add_mpath(rh, &ri, gws, 2);
+}
+
+#define MPATH_TEST_KEYS 10
+
+static int check_mpath_burst(void) {
+    static const char* expected[] = { "192.168.0.1", "192.168.0.2", "192.168.0.2" };
+    struct in_addr dsts[MPATH_TEST_KEYS];
+    uint32_t flowids[MPATH_TEST_KEYS], nhidx[MPATH_TEST_KEYS];
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        inet_pton(AF_INET, (i & 1) ? "20.1.0.1" : "10.1.0.1", &dsts[i]);
+        flowids[i] = 100 + i;
+    }
+    for (; i < MPATH_TEST_KEYS; i++) {
+        inet_pton(AF_INET, (i & 1) ? "12.0.0.1" : "11.0.0.1", &dsts[i]);
+        flowids[i] = i;
+    }
+
+    TEST_ASSERT_EQ(8, fib4_lookup_nhidx_burst(0, dsts, flowids, MPATH_TEST_KEYS, nhidx),
+                   "All but the 12/8 keys should hit");
+    for (i = 0; i < 6; i++) {
+        TEST_ASSERT(check_nhop(nhidx[i], expected[flowids[i] % 3]),
+                    "Flow %u should go to slot %u", flowids[i], flowids[i] % 3);
+    }
+    for (; i < MPATH_TEST_KEYS; i += 2) {
+        TEST_ASSERT(check_nhop(nhidx[i], "192.168.0.3"), "Single path routes ignore the flow");
+        TEST_ASSERT_EQ(0u, nhidx[i + 1], "Misses should return 0");
+    }
+
+    TEST_PASS();
+}
+
+static int test_fib_lookup_mpath(void) {
+    struct rib_head* rh;
+    struct route_info ri;
+    struct in_addr dst;
+    char path[64];
+
+    rh = route_table_create(AF_INET, 0);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    TEST_ASSERT_EQ(ROUTE_OK, add_mpath4(rh, "10.0.0.0", "255.0.0.0"), "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_mpath4(rh, "20.0.0.0", "255.0.0.0"), "Should add 20/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "11.0.0.0", "255.0.0.0", "192.168.0.3"),
+                   "Should add 11/8");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_add_mpath(rh, &ri, NULL, 2),
+                   "Multipath routes need gateways");
+
+    TEST_ASSERT_EQ(0, check_mpath_burst(), "Should select members on the tree");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    TEST_ASSERT_EQ(0, check_mpath_burst(), "Should select members on the frozen copy");
+
+    inet_pton(AF_INET, "10.1.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(0, dst, 0, &ri), "Should match 10/8");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.1"), "Should return the first member");
+    TEST_ASSERT(check_nhop(fib4_lookup_nhidx(0, dst, 0), "192.168.0.1"),
+                "Flowless lookups should return the first member");
+
+    snprintf(path, sizeof(path), "/tmp/route_lib_mpath.%d.snap", (int)getpid());
+    TEST_ASSERT_EQ(ROUTE_ENOTSUPP, route_table_save(rh, path),
+                   "Snapshots should reject multipath routes");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int label_count_walker(struct route_label_info* li, void* arg) {
+    uint32_t* walk = arg;  /* Labels seen in order, last label */
+
+    if (walk[0] != 0 && li->rli_label <= walk[1]) {
+        return 1;
+    }
+    walk[0]++;
+    walk[1] = li->rli_label;
+    return 0;
+}
+
+static int test_route_lfib(void) {
+    struct sockaddr_in gw_addr[2], dst_addr;
+    uint32_t labels[4] = { 100, 300, 300, ROUTE_LABEL_MAX + 1 };
+    uint32_t flowids[4] = { 0, 0, 1, 0 };
+    uint32_t nhidx[4], outlabels[4], out, walk[2] = { 0, 0 };
+    struct route_mpath_gw gws[2];
+    struct route_label_info li;
+    struct route_lfib* lf;
+    struct rib_head* rh;
+
+    lf = route_lfib_create(31);
+    TEST_ASSERT_NOT_NULL(lf, "Should create a label table");
+    TEST_ASSERT_NULL(route_lfib_create(31), "Should allow one label table per fib");
+    TEST_ASSERT_EQ(EEXIST, errno, "A second label table should fail with EEXIST");
+
+    /* Swap 100 for 200 towards 192.168.0.1, pop explicit null */
+    make_sin(&gw_addr[0], "192.168.0.1");
+    make_sin(&gw_addr[1], "192.168.0.2");
+    li = (struct route_label_info){ 100, 200, (struct sockaddr*)&gw_addr[0],
+                                    ROUTE_RTF_UP | ROUTE_RTF_GATEWAY, 0 };
+    TEST_ASSERT_EQ(ROUTE_OK, route_lfib_add(lf, &li), "Should add label 100");
+    li = (struct route_label_info){ 0, ROUTE_LABEL_IMPNULL, (struct sockaddr*)&gw_addr[1],
+                                    ROUTE_RTF_GATEWAY, 2 };
+    TEST_ASSERT_EQ(ROUTE_OK, route_lfib_add(lf, &li), "Should add label 0");
+    li.rli_label = ROUTE_LABEL_MAX + 1;
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_lfib_add(lf, &li), "Should reject labels past 20 bits");
+
+    TEST_ASSERT(check_nhop(fib_label_lookup_nhidx(31, 100, 0, &out), "192.168.0.1"),
+                "Label 100 should go to 192.168.0.1");
+    TEST_ASSERT_EQ(200u, out, "Label 100 should be swapped for 200");
+    TEST_ASSERT(check_nhop(fib_label_lookup_nhidx(31, 0, 0, &out), "192.168.0.2"),
+                "Label 0 should go to 192.168.0.2");
+    TEST_ASSERT_EQ((uint32_t)ROUTE_LABEL_IMPNULL, out, "Label 0 should be popped");
+    TEST_ASSERT_EQ(0u, fib_label_lookup_nhidx(31, 101, 0, &out), "Label 101 should miss");
+
+    /* IP routes over the same gateway share the nexthop */
+    rh = route_table_create(AF_INET, 31);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    make_sin(&dst_addr, "10.0.0.0");
+    TEST_ASSERT_EQ(fib4_lookup_nhidx(31, dst_addr.sin_addr, 0),
+                   fib_label_lookup_nhidx(31, 100, 0, &out),
+                   "Labels and routes should share nexthops");
+
+    /* Multipath pop */
+    gws[0] = (struct route_mpath_gw){ (struct sockaddr*)&gw_addr[0], 1, 1 };
+    gws[1] = (struct route_mpath_gw){ (struct sockaddr*)&gw_addr[1], 2, 1 };
+    li = (struct route_label_info){ 300, ROUTE_LABEL_IMPNULL, NULL, ROUTE_RTF_GATEWAY, 0 };
+    TEST_ASSERT_EQ(ROUTE_OK, route_lfib_add_mpath(lf, &li, gws, 2), "Should add label 300");
+
+    TEST_ASSERT_EQ(3, fib_label_lookup_nhidx_burst(31, labels, flowids, 4, nhidx, outlabels),
+                   "All but the invalid label should hit");
+    TEST_ASSERT(check_nhop(nhidx[0], "192.168.0.1"), "Label 100 should hit in bursts");
+    TEST_ASSERT(check_nhop(nhidx[1], "192.168.0.1"), "Flow 0 should take the first member");
+    TEST_ASSERT(check_nhop(nhidx[2], "192.168.0.2"), "Flow 1 should take the second member");
+    TEST_ASSERT_EQ((uint32_t)ROUTE_LABEL_IMPNULL, outlabels[1], "Label 300 should be popped");
+    TEST_ASSERT_EQ(0u, nhidx[3], "Invalid labels should miss");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_lfib_lookup(lf, 300, &li), "Should look up label 300");
+    TEST_ASSERT(li.rli_gateway && ((struct sockaddr_in*)li.rli_gateway)->sin_addr.s_addr ==
+                gw_addr[0].sin_addr.s_addr, "Lookups should return the first member");
+    TEST_ASSERT_EQ(3, route_lfib_walk(lf, label_count_walker, walk), "Should walk three labels");
+    TEST_ASSERT_EQ(3u, walk[0], "Labels should be walked in order");
+
+    /* Replace and delete */
+    li = (struct route_label_info){ 300, 400, (struct sockaddr*)&gw_addr[1], ROUTE_RTF_GATEWAY, 2 };
+    TEST_ASSERT_EQ(ROUTE_OK, route_lfib_add(lf, &li), "Should replace label 300");
+    TEST_ASSERT(check_nhop(fib_label_lookup_nhidx(31, 300, 0, &out), "192.168.0.2"),
+                "Label 300 should go to 192.168.0.2 alone");
+    TEST_ASSERT_EQ(400u, out, "Label 300 should now be swapped");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lfib_delete(lf, 0), "Should delete label 0");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_lfib_delete(lf, 0), "Label 0 should be gone");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_lfib_lookup(lf, 0, &li), "Label 0 should miss");
+
+    route_lfib_destroy(lf);
+    TEST_ASSERT_EQ(0u, fib_label_lookup_nhidx(31, 100, 0, &out),
+                   "Destroyed label tables should miss");
+    lf = route_lfib_create(31);
+    TEST_ASSERT_NOT_NULL(lf, "Should create a label table again");
+    route_lfib_destroy(lf);
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+#define WIDE_MPATH_FLOWS 4096
+
+/* Adds 10/8 over @count gateways of weight @weight(i), member i on ifindex i + 1 */
+static int add_wide_mpath4(struct rib_head* rh, int count, uint32_t (*weight)(int)) {
+    static struct sockaddr_in gw_addr[ROUTE_MPATH_MAX + 1];
+    static struct route_mpath_gw gws[ROUTE_MPATH_MAX + 1];
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri;
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, "10.0.0.0");
+    make_sin(&mask_addr, "255.0.0.0");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+    for (int i = 0; i < count; i++) {
+        make_sin(&gw_addr[i], "172.16.0.0");
+        gw_addr[i].sin_addr.s_addr = htonl(0xac100000 | i);
+        gws[i] = (struct route_mpath_gw){ (struct sockaddr*)&gw_addr[i], i + 1, weight(i) };
+    }
+    return route_add_mpath(rh, &ri, gws, count);
+}
+
+/* Flows 0 to @nflows - 1 of 10/8 going to each of @count members */
+static void count_wide_mpath4(u_int fibnum, int nflows, int* counts, int count) {
+    static struct in_addr dsts[WIDE_MPATH_FLOWS];
+    static uint32_t flowids[WIDE_MPATH_FLOWS], nhidx[WIDE_MPATH_FLOWS];
+    const struct route_nhop* nhops;
+    uint32_t nnhops;
+
+    for (int i = 0; i < nflows; i++) {
+        inet_pton(AF_INET, "10.1.2.3", &dsts[i]);
+        flowids[i] = i;
+    }
+    fib4_lookup_nhidx_burst(fibnum, dsts, flowids, nflows, nhidx);
+    nhops = route_nhop_array(&nnhops);
+    memset(counts, 0, count * sizeof(*counts));
+    for (int i = 0; i < nflows; i++) {
+        int m = nhidx[i] < nnhops ? nhops[nhidx[i]].rnh_ifindex - 1 : -1;
+
+        if (m >= 0 && m < count) {
+            counts[m]++;
+        }
+    }
+}
+
+static uint32_t weight_equal(int i) {
+    (void)i;
+    return 5;
+}
+
+static uint32_t weight_ramp(int i) {
+    return i + 1;
+}
+
+static int test_route_mpath_wide(void) {
+    static int counts[ROUTE_MPATH_MAX];
+    struct sockaddr_in dst_addr, mask_addr;
+    struct rib_head* rh;
+    int total;
+
+    rh = route_table_create(AF_INET, 30);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, add_wide_mpath4(rh, ROUTE_MPATH_MAX + 1, weight_equal),
+                   "Should reject groups past ROUTE_MPATH_MAX");
+
+    /* Equal weights reduce to one slot per member */
+    TEST_ASSERT_EQ(ROUTE_OK, add_wide_mpath4(rh, ROUTE_MPATH_MAX, weight_equal),
+                   "Should add a %d-way group", ROUTE_MPATH_MAX);
+    count_wide_mpath4(30, WIDE_MPATH_FLOWS, counts, ROUTE_MPATH_MAX);
+    for (int i = 0; i < ROUTE_MPATH_MAX; i++) {
+        TEST_ASSERT_EQ(WIDE_MPATH_FLOWS / ROUTE_MPATH_MAX, counts[i],
+                       "Member %d should get one flow in %d", i, ROUTE_MPATH_MAX);
+    }
+
+    /*
+     * Weights 1 to 300 sum to 45150, past the 2400 slots of a 300 member
+     * group: members get a slot each and their share of the other 2100,
+     * rounded up or down
+     */
+    make_sin(&dst_addr, "10.0.0.0");
+    make_sin(&mask_addr, "255.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete the equal group");
+    TEST_ASSERT_EQ(ROUTE_OK, add_wide_mpath4(rh, 300, weight_ramp), "Should add a weighted group");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    count_wide_mpath4(30, 2400, counts, 300);
+    total = 0;
+    for (int i = 0; i < 300; i++) {
+        int quota = 1 + (i + 1) * 2100 / 45150;
+
+        TEST_ASSERT(counts[i] == quota || counts[i] == quota + 1,
+                    "Member %d should get %d slots, not %d", i, quota, counts[i]);
+        total += counts[i];
+    }
+    TEST_ASSERT_EQ(2400, total, "Every slot should go to a member");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+/* Mix of nested prefixes, host routes and a default route */
+struct load_routes {
+    struct sockaddr_in dsts[LOAD_TEST_ROUTES];
+    struct sockaddr_in masks[LOAD_TEST_ROUTES];
+    struct sockaddr_in gws[LOAD_TEST_ROUTES];
+    struct route_info routes[LOAD_TEST_ROUTES];
+};
+
+static struct load_routes load_routes;
+
+static void make_load_routes(struct load_routes* lr) {
+    char addr[INET_ADDRSTRLEN];
+
+    memset(lr, 0, sizeof(*lr));
+    for (int i = 0; i < LOAD_TEST_ROUTES; i++) {
+        const char* mask;
+
+        switch (i % 4) {
+            case 0:
+                snprintf(addr, sizeof(addr), "10.%d.0.0", i / 4);
+                mask = "255.255.0.0";
+                break;
+            case 1:
+                snprintf(addr, sizeof(addr), "10.%d.%d.0", i % 256, i / 256);
+                mask = "255.255.255.0";
+                break;
+            case 2:
+                snprintf(addr, sizeof(addr), "10.%d.%d.1", i % 256, i / 256);
+                mask = NULL;
+                break;
+            default:
+                snprintf(addr, sizeof(addr), "172.%d.%d.0", 16 + i % 16, i / 16);
+                mask = "255.255.255.128";
+                break;
+        }
+        if (i == LOAD_TEST_ROUTES - 1) {
+            strcpy(addr, "0.0.0.0");
+            mask = "0.0.0.0";
+        }
+        make_sin(&lr->dsts[i], addr);
+        make_sin(&lr->gws[i], "192.168.0.1");
+        lr->gws[i].sin_addr.s_addr = htonl(ntohl(lr->gws[i].sin_addr.s_addr) + i);
+        lr->routes[i].ri_dst = (struct sockaddr*)&lr->dsts[i];
+        if (mask) {
+            make_sin(&lr->masks[i], mask);
+            lr->routes[i].ri_netmask = (struct sockaddr*)&lr->masks[i];
+        }
+        lr->routes[i].ri_gateway = (struct sockaddr*)&lr->gws[i];
+        lr->routes[i].ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+    }
+}
+
+/* Returns the number of addresses tables @fib1 and @fib2 resolve differently */
+static int compare_fibs(u_int fib1, u_int fib2, const struct load_routes* lr) {
+    struct route_info ri1, ri2;
+    struct in_addr dst;
+    int mismatches = 0;
+
+    for (uint32_t i = 0; i < 4 * LOAD_TEST_ROUTES; i++) {
+        if (i & 1) {
+            dst.s_addr = htonl(0x0a000000 | (i * 2654435761U) >> 8);
+        } else {
+            dst.s_addr = htonl(ntohl(lr->dsts[(i / 2) % LOAD_TEST_ROUTES].sin_addr.s_addr) +
+                               (i & 6));
+        }
+        int error = fib4_lookup(fib1, dst, 0, &ri1);
+        if (fib4_lookup(fib2, dst, 0, &ri2) != error ||
+            (error == ROUTE_OK && !sa_equal(ri1.ri_gateway, ri2.ri_gateway))) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+static int test_route_table_load(void) {
+    struct route_info* routes = load_routes.routes;
+    struct rib_head *bulk, *incr;
+    struct route_stats stats;
+    struct route_info ri;
+    struct in_addr dst;
+
+    bulk = route_table_create(AF_INET, 2);
+    incr = route_table_create(AF_INET, 3);
+    TEST_ASSERT_NOT_NULL(bulk, "Should create bulk loaded table");
+    TEST_ASSERT_NOT_NULL(incr, "Should create incremental table");
+
+    make_load_routes(&load_routes);
+    for (int i = 0; i < LOAD_TEST_ROUTES; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, route_add(incr, &routes[i]), "Should add route");
+    }
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(bulk, routes, LOAD_TEST_ROUTES),
+                   "Should bulk load the table");
+    route_get_stats(bulk, &stats);
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, stats.rs_nodes, "All routes should be accounted");
+    TEST_ASSERT_EQ(0, compare_fibs(2, 3, &load_routes),
+                   "Both tables should resolve addresses the same way");
+
+    /* Bulk loaded routes are regular routes */
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(bulk, routes[0].ri_dst, routes[0].ri_netmask),
+                   "Should delete a bulk loaded route");
+    TEST_ASSERT_EQ(ROUTE_OK, route_add(bulk, &routes[0]), "Should add it back");
+
+    TEST_ASSERT_EQ(ROUTE_EEXIST, route_table_load(bulk, routes, LOAD_TEST_ROUTES),
+                   "Should not load a non-empty table");
+
+    route_table_destroy(bulk);
+    route_table_destroy(incr);
+
+    /* Duplicated routes fail the whole load */
+    bulk = route_table_create(AF_INET, 2);
+    TEST_ASSERT_NOT_NULL(bulk, "Should create bulk loaded table");
+    routes[1] = routes[0];
+    TEST_ASSERT_EQ(ROUTE_EEXIST, route_table_load(bulk, routes, 2),
+                   "Should reject duplicated routes");
+    inet_pton(AF_INET, "10.0.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(2, dst, 0, &ri),
+                   "Failed load should leave the table empty");
+    route_table_destroy(bulk);
+
+    TEST_PASS();
+}
+
+static int test_route_tables_load(void) {
+    struct route_load_batch batches[4];
+    struct rib_head *ref, *tables[5];
+
+    ref = route_table_create(AF_INET, 10);
+    TEST_ASSERT_NOT_NULL(ref, "Should create reference table");
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(ref, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the reference table");
+
+    memset(batches, 0, sizeof(batches));
+    for (int i = 0; i < 4; i++) {
+        tables[i] = batches[i].rlb_rh = route_table_create(AF_INET, 11 + i);
+        TEST_ASSERT_NOT_NULL(tables[i], "Should create table");
+        batches[i].rlb_routes = load_routes.routes;
+        batches[i].rlb_count = LOAD_TEST_ROUTES;
+    }
+    TEST_ASSERT_EQ(ROUTE_OK, route_tables_load(batches, 4, 4, ROUTE_LOAD_FREEZE),
+                   "Should load all tables");
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, batches[i].rlb_error, "Batch should succeed");
+        TEST_ASSERT_EQ(0, compare_fibs(10, 11 + i, &load_routes),
+                       "Table should resolve addresses as the reference");
+    }
+
+    /* Loaded tables are no longer empty, the failure is per batch */
+    tables[4] = batches[0].rlb_rh = route_table_create(AF_INET, 15);
+    TEST_ASSERT_EQ(ROUTE_EEXIST, route_tables_load(batches, 2, 2, 0),
+                   "Should report the failed batch");
+    TEST_ASSERT_EQ(ROUTE_OK, batches[0].rlb_error, "Empty table should load");
+    TEST_ASSERT_EQ(ROUTE_EEXIST, batches[1].rlb_error, "Loaded table should fail");
+    TEST_ASSERT_EQ(0, compare_fibs(10, 15, &load_routes),
+                   "Table should resolve addresses as the reference");
+
+    batches[0].rlb_rh = batches[1].rlb_rh;
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_tables_load(batches, 2, 2, 0),
+                   "Should reject a table loaded twice");
+
+    route_table_destroy(ref);
+    for (int i = 0; i < 5; i++) {
+        route_table_destroy(tables[i]);
+    }
+    TEST_PASS();
+}
+
+static int test_route_table_freeze(void) {
+    struct route_info* routes = load_routes.routes;
+    struct rib_head *frozen, *plain;
+
+    frozen = route_table_create(AF_INET, 4);
+    plain = route_table_create(AF_INET, 5);
+    TEST_ASSERT_NOT_NULL(frozen, "Should create frozen table");
+    TEST_ASSERT_NOT_NULL(plain, "Should create plain table");
+
+    /* Leave the default route out so that some lookups miss */
+    make_load_routes(&load_routes);
+    for (int i = 0; i < LOAD_TEST_ROUTES - 1; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, route_add(frozen, &routes[i]), "Should add route");
+        TEST_ASSERT_EQ(ROUTE_OK, route_add(plain, &routes[i]), "Should add route");
+    }
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(frozen), "Should freeze the table");
+    TEST_ASSERT_EQ(0, compare_fibs(4, 5, &load_routes),
+                   "Frozen copy should resolve addresses as the tree");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(frozen), "Refreezing should be a no-op");
+
+    /* Changes go back to the tree until the next freeze */
+    for (int i = 0; i < LOAD_TEST_ROUTES - 1; i += 3) {
+        TEST_ASSERT_EQ(ROUTE_OK, route_delete(frozen, routes[i].ri_dst, routes[i].ri_netmask),
+                       "Should delete route");
+        TEST_ASSERT_EQ(ROUTE_OK, route_delete(plain, routes[i].ri_dst, routes[i].ri_netmask),
+                       "Should delete route");
+    }
+    TEST_ASSERT_EQ(0, compare_fibs(4, 5, &load_routes),
+                   "Deleted routes should not be served from a stale copy");
+    TEST_ASSERT_EQ(ROUTE_OK, route_add(frozen, &routes[LOAD_TEST_ROUTES - 1]),
+                   "Should add the default route");
+    TEST_ASSERT_EQ(ROUTE_OK, route_add(plain, &routes[LOAD_TEST_ROUTES - 1]),
+                   "Should add the default route");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(frozen), "Should freeze the table again");
+    TEST_ASSERT_EQ(0, compare_fibs(4, 5, &load_routes),
+                   "Rebuilt copy should resolve addresses as the tree");
+
+    route_table_destroy(frozen);
+    route_table_destroy(plain);
+
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_table_freeze(NULL), "Should reject NULL table");
+
+    TEST_PASS();
+}
+
+static int test_route_table_numa(void) {
+    struct rib_head *numa, *plain;
+
+    numa = route_table_create(AF_INET, 16);
+    plain = route_table_create(AF_INET, 17);
+    TEST_ASSERT_NOT_NULL(numa, "Should create replicated table");
+    TEST_ASSERT_NOT_NULL(plain, "Should create plain table");
+
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(numa, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the replicated table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(plain, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the plain table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_numa(numa, 1), "Should enable replicas");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(numa), "Should freeze the replicas");
+
+    /* Whatever node a thread claims, its replica resolves as the tree */
+    for (int node = -1; node < 4; node++) {
+        route_thread_set_node(node);
+        TEST_ASSERT_EQ(0, compare_fibs(16, 17, &load_routes),
+                       "Replica should resolve addresses as the tree");
+    }
+    route_thread_set_node(-1);
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_numa(numa, 0), "Should disable replicas");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(numa), "Should freeze a single copy");
+    TEST_ASSERT_EQ(0, compare_fibs(16, 17, &load_routes),
+                   "Single copy should resolve addresses as the tree");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_table_set_numa(NULL, 1), "Should reject NULL table");
+
+    route_table_destroy(numa);
+    route_table_destroy(plain);
+    TEST_PASS();
+}
+
+/* Returns the number of burst results differing from single lookups in @fib */
+static int compare_burst(u_int fib, const struct in_addr* dsts, size_t count,
+                         struct route_info* ris, int* hits) {
+    struct route_info ri;
+    int mismatches = 0;
+
+    *hits = fib4_lookup_burst(fib, dsts, count, ris);
+    for (size_t i = 0; i < count; i++) {
+        if (fib4_lookup(fib, dsts[i], 0, &ri) == ROUTE_OK) {
+            if (!ris[i].ri_gateway || !sa_equal(ri.ri_gateway, ris[i].ri_gateway)) {
+                mismatches++;
+            }
+        } else if (ris[i].ri_dst != NULL) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+static int test_fib4_lookup_burst(void) {
+    const size_t count = 4 * LOAD_TEST_ROUTES + 3;
+    struct route_info* routes = load_routes.routes;
+    struct route_info* ris;
+    struct in_addr* dsts;
+    struct rib_head* rh;
+    int hits, frozen_hits;
+
+    rh = route_table_create(AF_INET, 6);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    make_load_routes(&load_routes);
+    for (int i = 0; i < LOAD_TEST_ROUTES - 1; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, route_add(rh, &routes[i]), "Should add route");
+    }
+
+    dsts = bsd_malloc(count * sizeof(*dsts), M_RTABLE, M_WAITOK | M_ZERO);
+    ris = bsd_malloc(count * sizeof(*ris), M_RTABLE, M_WAITOK | M_ZERO);
+    TEST_ASSERT(dsts != NULL && ris != NULL, "Should allocate burst");
+    for (uint32_t i = 0; i < count; i++) {
+        if (i & 1) {
+            dsts[i].s_addr = htonl(0x0a000000 | (i * 2654435761U) >> 8);
+        } else {
+            dsts[i].s_addr = htonl(ntohl(load_routes.dsts[(i / 2) % LOAD_TEST_ROUTES].sin_addr.s_addr) +
+                                   (i & 6));
+        }
+    }
+
+    TEST_ASSERT_EQ(0, compare_burst(6, dsts, count, ris, &hits),
+                   "Burst should resolve as single lookups on the tree");
+    TEST_ASSERT(hits > 0 && (size_t)hits < count, "Burst should both hit and miss");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    TEST_ASSERT_EQ(0, compare_burst(6, dsts, count, ris, &frozen_hits),
+                   "Burst should resolve as single lookups on the frozen copy");
+    TEST_ASSERT_EQ(hits, frozen_hits, "Frozen copy should match as many keys");
+
+    TEST_ASSERT_EQ(0, fib4_lookup_burst(6, dsts, 0, ris), "Empty burst should not match");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, fib4_lookup_burst(6, NULL, 1, ris),
+                   "Should reject NULL keys");
+
+    route_table_destroy(rh);
+    TEST_ASSERT_EQ(0, fib4_lookup_burst(6, dsts, count, ris),
+                   "Detached table should not match");
+    TEST_ASSERT(ris[0].ri_dst == NULL, "Misses should be zeroed");
+
+    bsd_free(dsts, M_RTABLE);
+    bsd_free(ris, M_RTABLE);
+
+    TEST_PASS();
+}
+
+static int test_route_table_snapshot(void) {
+    struct rib_head *orig, *restored;
+    struct sockaddr_in dst_addr;
+    struct route_stats stats;
+    struct route_info ri;
+    char path[64];
+    int count = 0;
+    FILE* f;
+
+    snprintf(path, sizeof(path), "/tmp/route_lib_test.%d.snap", (int)getpid());
+
+    orig = route_table_create(AF_INET, 2);
+    TEST_ASSERT_NOT_NULL(orig, "Should create IPv4 routing table");
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(orig, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_save(orig, path), "Should save the table");
+
+    /* Lookups are served from the image until the tree is rebuilt */
+    restored = route_table_restore(path, 3);
+    TEST_ASSERT_NOT_NULL(restored, "Should restore the table");
+    TEST_ASSERT_EQ(0, compare_fibs(2, 3, &load_routes),
+                   "Restored table should resolve addresses as the original");
+
+    /* Control path operations wait for the rebuild, route_lookup() does not */
+    make_sin(&dst_addr, "10.1.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(restored, (struct sockaddr*)&dst_addr, &ri),
+                   "Should look up in the image");
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, route_walk(restored, count_walker, &count),
+                   "Should walk the rebuilt tree");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(restored, (struct sockaddr*)&dst_addr, &ri),
+                   "Should look up in the rebuilt tree");
+    route_get_stats(restored, &stats);
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, stats.rs_nodes, "All routes should be restored");
+    TEST_ASSERT_EQ(0, compare_fibs(2, 3, &load_routes),
+                   "Rebuilt table should resolve addresses as the original");
+
+    route_table_destroy(restored);
+    route_table_destroy(orig);
+
+    /* Truncated images are rejected */
+    f = fopen(path, "r+");
+    TEST_ASSERT_NOT_NULL(f, "Should open the image");
+    TEST_ASSERT_EQ(0, ftruncate(fileno(f), 100), "Should truncate the image");
+    fclose(f);
+    TEST_ASSERT_NULL(route_table_restore(path, 3), "Should reject a truncated image");
+    unlink(path);
+
+    TEST_PASS();
+}
+
+static int test_route_export(void) {
+    struct route_export_reader* rx;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri;
+    struct rib_head* rh;
+    char path[64], gpath[80];
+    pid_t pid;
+    int status;
+
+    snprintf(path, sizeof(path), "/tmp/route_lib_export.%d", (int)getpid());
+    snprintf(gpath, sizeof(gpath), "%s.gen", path);
+    TEST_ASSERT_NULL(route_export_attach(path), "Should not attach before an export");
+
+    rh = route_table_create(AF_INET, 20);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_export(rh, path), "Should export the table");
+
+    rx = route_export_attach(path);
+    TEST_ASSERT_NOT_NULL(rx, "Should attach to the export");
+    TEST_ASSERT_EQ(1, route_export_generation(rx), "Should map the first generation");
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, route_export_lookup(rx, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10.1/16");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Should return the 10.1/16 route");
+    TEST_ASSERT_EQ(20, ri.ri_fibnum, "Should report the exported fib");
+    make_sin(&dst_addr, "11.0.0.1");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_export_lookup(rx, (struct sockaddr*)&dst_addr, &ri),
+                   "Should miss 11/8");
+
+    /* Readers switch to the next export on their next lookup */
+    make_sin(&dst_addr, "10.1.0.0");
+    make_sin(&mask_addr, "255.255.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "11.0.0.0", "255.0.0.0", "192.168.0.3"),
+                   "Should add 11/8");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_export(rh, path), "Should export the table again");
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, route_export_lookup(rx, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10/8");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.1"), "Should see the deletion");
+    TEST_ASSERT_EQ(2, route_export_generation(rx), "Should map the second generation");
+
+    /* Another process looks up in the same export */
+    pid = fork();
+    TEST_ASSERT(pid >= 0, "Should fork a reader process");
+    if (pid == 0) {
+        struct route_export_reader* crx = route_export_attach(path);
+
+        make_sin(&dst_addr, "11.2.3.4");
+        _exit(crx && route_export_lookup(crx, (struct sockaddr*)&dst_addr, &ri) == ROUTE_OK &&
+              check_gateway(&ri, "192.168.0.3") ? 0 : 1);
+    }
+    TEST_ASSERT_EQ(pid, waitpid(pid, &status, 0), "Should wait for the reader process");
+    TEST_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                "Reader process should match 11/8");
+
+    route_export_detach(rx);
+    route_table_destroy(rh);
+    unlink(path);
+    unlink(gpath);
+
+    TEST_PASS();
+}
+
+static int test_route_delta_export(void) {
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_delta deltas[8];
+    struct rib_head* rh;
+    uint64_t gen, base;
+    int n;
+
+    rh = route_table_create(AF_INET, 22);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_table_changes(rh, 0, deltas, 8, &gen),
+                   "Should need the delta log");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_delta_log(rh, 4), "Should enable the delta log");
+
+    /* Consumers start from a full resync */
+    TEST_ASSERT_EQ(ROUTE_ESTALE, route_table_changes(rh, 0, deltas, 8, &base),
+                   "Generation 0 should need a resync");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.2.0.0", "255.255.0.0", "192.168.0.3"),
+                   "Should add 10.2/16");
+    TEST_ASSERT_EQ(2, route_table_changes(rh, base, deltas, 8, &gen), "Should return both adds");
+    TEST_ASSERT_EQ(ROUTE_DELTA_SET, deltas[0].rd_op, "Adds should be sets");
+    TEST_ASSERT(check_gateway(&deltas[0].rd_info, "192.168.0.2"), "Should return 10.1/16 first");
+    TEST_ASSERT(check_gateway(&deltas[1].rd_info, "192.168.0.3"), "Should return 10.2/16 next");
+    TEST_ASSERT_EQ(deltas[1].rd_gen, gen, "Should resume after the last delta");
+    TEST_ASSERT_EQ(0, route_table_changes(rh, gen, deltas, 8, &gen), "Should be up to date");
+
+    /* Flaps collapse into the last state of each prefix */
+    base = gen;
+    make_sin(&dst_addr, "10.1.0.0");
+    make_sin(&mask_addr, "255.255.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.4"),
+                   "Should add 10.1/16 again");
+    make_sin(&dst_addr, "10.2.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 10.2/16");
+    TEST_ASSERT_EQ(1, route_table_changes(rh, base, deltas, 1, &gen),
+                   "Should stop at the batch size");
+    TEST_ASSERT_EQ(ROUTE_DELTA_SET, deltas[0].rd_op, "10.1/16 should be set");
+    TEST_ASSERT(check_gateway(&deltas[0].rd_info, "192.168.0.4"), "Should return the last gateway");
+    TEST_ASSERT_EQ(1, route_table_changes(rh, gen, deltas, 8, &gen),
+                   "Should return the rest of the changes");
+    TEST_ASSERT_EQ(ROUTE_DELTA_DEL, deltas[0].rd_op, "10.2/16 should be deleted");
+    TEST_ASSERT_NULL(deltas[0].rd_info.ri_gateway, "Deletes have no gateway");
+
+    /* Consumers behind evicted changes resync */
+    base = gen;
+    for (int i = 0; i < 5; i++) {
+        char addr[32];
+
+        snprintf(addr, sizeof(addr), "10.%d.0.0", 10 + i);
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, addr, "255.255.0.0", "192.168.0.5"),
+                       "Should add %s/16", addr);
+    }
+    TEST_ASSERT_EQ(ROUTE_ESTALE, route_table_changes(rh, base, deltas, 8, &gen),
+                   "Evicted changes should need a resync");
+    n = route_table_changes(rh, gen - 4, deltas, 8, &gen);
+    TEST_ASSERT_EQ(4, n, "Should keep the last changes");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_flush(rh), "Should flush the table");
+    TEST_ASSERT_EQ(ROUTE_ESTALE, route_table_changes(rh, gen, deltas, 8, &gen),
+                   "A flush should need a resync");
+    TEST_ASSERT_EQ(0, route_table_changes(rh, gen, deltas, 8, &gen),
+                   "Should go on after the flush");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_delta_log(rh, 0), "Should disable the delta log");
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_stage(void) {
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_stage_stats sst;
+    struct route_stats stats;
+    struct route_info ri, ri_out;
+    struct route_stage* st;
+    struct rib_head* rh;
+
+    rh = route_table_create(AF_INET, 23);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    st = route_stage_create(rh, 8, 0);
+    TEST_ASSERT_NOT_NULL(st, "Should create a stage");
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&mask_addr, "255.0.0.0");
+    make_sin(&gw_addr, "192.168.0.1");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+
+    /* A flap of 10/8 ending where it started never touches the tree */
+    make_sin(&dst_addr, "10.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_delete(st, (struct sockaddr*)&dst_addr,
+                                                (struct sockaddr*)&mask_addr),
+                   "Should stage the withdrawal of 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(23, dst_addr.sin_addr, 0, &ri_out),
+                   "Staged changes should not be visible yet");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_add(st, &ri), "Should stage 10/8 again");
+
+    /* 11/8 changes three times, 12/8 comes and goes */
+    make_sin(&dst_addr, "11.0.0.0");
+    for (int i = 2; i <= 4; i++) {
+        char gw[32];
+
+        snprintf(gw, sizeof(gw), "192.168.0.%d", i);
+        make_sin(&gw_addr, gw);
+        TEST_ASSERT_EQ(ROUTE_OK, route_stage_add(st, &ri), "Should stage 11/8 via %s", gw);
+    }
+    make_sin(&dst_addr, "12.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_add(st, &ri), "Should stage 12/8");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_delete(st, (struct sockaddr*)&dst_addr,
+                                                (struct sockaddr*)&mask_addr),
+                   "Should stage the withdrawal of 12/8");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_get_stats(st, &sst), "Should get stage stats");
+    TEST_ASSERT_EQ(7, sst.rss_staged, "Should count staged changes");
+    TEST_ASSERT_EQ(3, sst.rss_pending, "Should keep one change per prefix");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_commit(st), "Should commit");
+    route_stage_get_stats(st, &sst);
+    TEST_ASSERT_EQ(1, sst.rss_applied, "Only the add of 11/8 should reach the tree");
+    TEST_ASSERT_EQ(6, sst.rss_absorbed, "Other changes should be absorbed");
+    TEST_ASSERT_EQ(0, sst.rss_pending, "Nothing should be pending");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(2, stats.rs_adds, "The tree should see one add past 10/8");
+    TEST_ASSERT_EQ(0, stats.rs_deletes, "The tree should see no delete");
+
+    make_sin(&dst_addr, "11.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(23, dst_addr.sin_addr, 0, &ri_out),
+                   "Should match 11/8");
+    TEST_ASSERT(check_gateway(&ri_out, "192.168.0.4"), "Should commit the last gateway");
+    make_sin(&dst_addr, "12.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(23, dst_addr.sin_addr, 0, &ri_out),
+                   "12/8 should never be added");
+
+    /* A change of a committed route, then the batch size commits */
+    make_sin(&dst_addr, "11.0.0.0");
+    make_sin(&gw_addr, "192.168.0.5");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_add(st, &ri), "Should stage 11/8 via 192.168.0.5");
+    for (int i = 0; i < 7; i++) {
+        char addr[32];
+
+        snprintf(addr, sizeof(addr), "%d.0.0.0", 20 + i);
+        make_sin(&dst_addr, addr);
+        TEST_ASSERT_EQ(ROUTE_OK, route_stage_add(st, &ri), "Should stage %s/8", addr);
+    }
+    route_stage_get_stats(st, &sst);
+    TEST_ASSERT_EQ(2, sst.rss_commits, "A full stage should commit");
+    make_sin(&dst_addr, "11.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(23, dst_addr.sin_addr, 0, &ri_out),
+                   "Should match 11/8");
+    TEST_ASSERT(check_gateway(&ri_out, "192.168.0.5"), "Should change the committed route");
+
+    /* Destroy commits what is pending */
+    make_sin(&dst_addr, "30.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_add(st, &ri), "Should stage 30/8");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_poll(st), "Poll without a window should not commit");
+    route_stage_destroy(st);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(23, dst_addr.sin_addr, 0, &ri_out),
+                   "Destroy should commit 30/8");
+
+    /* The window commits once it has passed */
+    st = route_stage_create(rh, 8, 1);
+    TEST_ASSERT_NOT_NULL(st, "Should create a stage with a window");
+    make_sin(&dst_addr, "31.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_add(st, &ri), "Should stage 31/8");
+    usleep(2000);
+    TEST_ASSERT_EQ(ROUTE_OK, route_stage_poll(st), "Should commit on poll");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(23, dst_addr.sin_addr, 0, &ri_out),
+                   "Poll should commit 31/8");
+    route_stage_destroy(st);
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_origins(void) {
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_origins_stats ost;
+    struct route_stats stats;
+    struct route_info ri, ri_out;
+    struct route_origins* ro;
+    struct rib_head* rh;
+    enum { STATIC = 1, OSPF = 2, BGP = 3, BULK = 4 };
+
+    rh = route_table_create(AF_INET, 28);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    ro = route_origins_create(rh);
+    TEST_ASSERT_NOT_NULL(ro, "Should create an origin set");
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, "10.0.0.0");
+    make_sin(&mask_addr, "255.0.0.0");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+
+    make_sin(&gw_addr, "192.168.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_origins_add(ro, STATIC, 1, &ri), "Should add static 10/8");
+
+    /* Churn of a losing source never reaches the table */
+    for (int i = 2; i <= 5; i++) {
+        char gw[32];
+
+        snprintf(gw, sizeof(gw), "192.168.0.%d", i);
+        make_sin(&gw_addr, gw);
+        TEST_ASSERT_EQ(ROUTE_OK, route_origins_add(ro, BGP, 20, &ri),
+                       "Should add BGP 10/8 via %s", gw);
+    }
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(1, stats.rs_adds, "Only the static route should be added");
+    TEST_ASSERT_EQ(0, stats.rs_changes, "Losing candidates should not change the table");
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(28, dst_addr.sin_addr, 0, &ri_out),
+                   "Should match 10/8");
+    TEST_ASSERT(check_gateway(&ri_out, "192.168.0.1"), "The static route should win");
+
+    /* Withdrawing the winner installs the next best */
+    make_sin(&dst_addr, "10.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_origins_delete(ro, STATIC, (struct sockaddr*)&dst_addr,
+                                                  (struct sockaddr*)&mask_addr),
+                   "Should delete static 10/8");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(1, stats.rs_changes, "The BGP route should replace it");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri_out),
+                   "Should match 10/8");
+    TEST_ASSERT(check_gateway(&ri_out, "192.168.0.5"), "Should install the last BGP gateway");
+
+    /* A new winner with the same route leaves the table alone */
+    TEST_ASSERT_EQ(ROUTE_OK, route_origins_add(ro, OSPF, 110, &ri), "Should add OSPF 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, route_origins_withdraw(ro, BGP), "Should withdraw BGP");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(1, stats.rs_changes, "The same route from OSPF should not be changed");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_origins_delete(ro, BGP, (struct sockaddr*)&dst_addr,
+                                                      (struct sockaddr*)&mask_addr),
+                   "BGP should have no candidate left");
+
+    route_origins_get_stats(ro, &ost);
+    TEST_ASSERT_EQ(8, ost.ros_updates, "Should count updates");
+    TEST_ASSERT_EQ(2, ost.ros_applied, "Two updates should change the table");
+    TEST_ASSERT_EQ(6, ost.ros_absorbed, "The others should be absorbed");
+    TEST_ASSERT_EQ(1, ost.ros_prefixes, "Should track 10/8");
+    TEST_ASSERT_EQ(1, ost.ros_candidates, "Only OSPF should be left");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_origins_delete(ro, OSPF, (struct sockaddr*)&dst_addr,
+                                                  (struct sockaddr*)&mask_addr),
+                   "Should delete OSPF 10/8");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri_out),
+                   "The last withdrawal should delete 10/8");
+
+    /* Enough prefixes to grow the hash, withdrawn at once */
+    make_sin(&mask_addr, "255.255.255.0");
+    make_sin(&gw_addr, "192.168.0.9");
+    for (int i = 0; i < 1000; i++) {
+        dst_addr.sin_addr.s_addr = htonl(0x14000000 | (i << 8));
+        TEST_ASSERT_EQ(ROUTE_OK, route_origins_add(ro, BULK, 200, &ri), "Should add route %d", i);
+        TEST_ASSERT_EQ(ROUTE_OK, route_origins_add(ro, STATIC, 1, &ri),
+                       "Should add static route %d", i);
+    }
+    route_origins_get_stats(ro, &ost);
+    TEST_ASSERT_EQ(1000, ost.ros_prefixes, "Should track every prefix");
+    TEST_ASSERT_EQ(2000, ost.ros_candidates, "Should keep both candidates");
+    TEST_ASSERT_EQ(ROUTE_OK, route_origins_withdraw(ro, BULK), "Should withdraw the bulk source");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(1000, stats.rs_nodes, "Static routes should stay installed");
+    TEST_ASSERT_EQ(ROUTE_OK, route_origins_withdraw(ro, STATIC), "Should withdraw static");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(0, stats.rs_nodes, "Every route should be deleted");
+    route_origins_get_stats(ro, &ost);
+    TEST_ASSERT_EQ(0, ost.ros_prefixes, "Should drop prefixes without candidates");
+
+    route_origins_destroy(ro);
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+struct prefix_record {
+    int pr_count;
+    int pr_limit;               /* Stop after this many, 0 for all */
+    uint32_t pr_addr[64];
+    int pr_plen[64];
+};
+
+static int prefix_record_walker(struct route_info* ri, void* arg) {
+    struct prefix_record* pr = arg;
+    int plen = 32;
+
+    if (ri->ri_netmask) {
+        plen = __builtin_popcount(((struct sockaddr_in*)ri->ri_netmask)->sin_addr.s_addr);
+    }
+    if (pr->pr_count < 64) {
+        pr->pr_addr[pr->pr_count] = ntohl(((struct sockaddr_in*)ri->ri_dst)->sin_addr.s_addr);
+        pr->pr_plen[pr->pr_count] = plen;
+    }
+    pr->pr_count++;
+    return (pr->pr_limit != 0 && pr->pr_count == pr->pr_limit);
+}
+
+static void make_mask4(struct sockaddr_in* sin, int plen) {
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_len = sizeof(*sin);
+    sin->sin_addr.s_addr = htonl(plen ? ~0u << (32 - plen) : 0);
+}
+
+static int test_route_prefix_queries(void) {
+    static const char* const covering[] = { "10.1.2.0", "10.1.0.0", "10.0.0.0", "0.0.0.0" };
+    static const int covering_plen[] = { 24, 16, 8, 0 };
+    static const char* const specifics[] = {
+        "10.0.0.0", "10.1.0.0", "10.1.2.0", "10.1.2.3", "10.2.0.0"
+    };
+    struct sockaddr_in dst_addr, mask_addr;
+    struct prefix_record pr;
+    struct rib_head *rh, *ov;
+    uint32_t addrs[300];
+    int plens[300];
+
+    rh = route_table_create(AF_INET, 24);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    add_route4(rh, "0.0.0.0", "0.0.0.0", "192.168.0.1");
+    add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.2");
+    add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.3");
+    add_route4(rh, "10.1.2.0", "255.255.255.0", "192.168.0.4");
+    add_route4(rh, "10.1.2.3", NULL, "192.168.0.5");
+    add_route4(rh, "10.2.0.0", "255.255.0.0", "192.168.0.6");
+    add_route4(rh, "11.0.0.0", "255.0.0.0", "192.168.0.7");
+
+    /* The query prefix itself and the shorter ones, not the host route */
+    memset(&pr, 0, sizeof(pr));
+    make_sin(&dst_addr, "10.1.2.0");
+    make_mask4(&mask_addr, 24);
+    TEST_ASSERT_EQ(4, route_lookup_covering(rh, (struct sockaddr*)&dst_addr,
+                                            (struct sockaddr*)&mask_addr,
+                                            prefix_record_walker, &pr),
+                   "10.1.2/24 should have 4 covering routes");
+    for (int i = 0; i < 4; i++) {
+        make_sin(&dst_addr, covering[i]);
+        TEST_ASSERT(pr.pr_addr[i] == ntohl(dst_addr.sin_addr.s_addr) &&
+                    pr.pr_plen[i] == covering_plen[i],
+                    "Covering route %d should be %s/%d", i, covering[i], covering_plen[i]);
+    }
+
+    /* Host bits of the query are ignored, the walker can stop early */
+    memset(&pr, 0, sizeof(pr));
+    pr.pr_limit = 2;
+    make_sin(&dst_addr, "10.1.2.3");
+    make_mask4(&mask_addr, 20);
+    TEST_ASSERT_EQ(2, route_lookup_covering(rh, (struct sockaddr*)&dst_addr,
+                                            (struct sockaddr*)&mask_addr,
+                                            prefix_record_walker, &pr),
+                   "The walker should end the query");
+    TEST_ASSERT(pr.pr_plen[0] == 16 && pr.pr_plen[1] == 8, "Should stop after 10.1/16, 10/8");
+
+    memset(&pr, 0, sizeof(pr));
+    TEST_ASSERT_EQ(5, route_lookup_covering(rh, (struct sockaddr*)&dst_addr, NULL,
+                                            prefix_record_walker, &pr),
+                   "A host query should see the host route");
+    TEST_ASSERT_EQ(32, pr.pr_plen[0], "The host route should come first");
+
+    /* More specifics come in key order */
+    memset(&pr, 0, sizeof(pr));
+    make_sin(&dst_addr, "10.0.0.0");
+    make_mask4(&mask_addr, 8);
+    TEST_ASSERT_EQ(5, route_walk_more_specific(rh, (struct sockaddr*)&dst_addr,
+                                               (struct sockaddr*)&mask_addr,
+                                               prefix_record_walker, &pr),
+                   "10/8 should hold 5 routes");
+    for (int i = 0; i < 5; i++) {
+        make_sin(&dst_addr, specifics[i]);
+        TEST_ASSERT(pr.pr_addr[i] == ntohl(dst_addr.sin_addr.s_addr),
+                    "Route %d should be %s", i, specifics[i]);
+    }
+    memset(&pr, 0, sizeof(pr));
+    make_sin(&dst_addr, "10.3.0.0");
+    make_mask4(&mask_addr, 16);
+    TEST_ASSERT_EQ(0, route_walk_more_specific(rh, (struct sockaddr*)&dst_addr,
+                                               (struct sockaddr*)&mask_addr,
+                                               prefix_record_walker, &pr),
+                   "10.3/16 should be empty");
+
+    struct sockaddr_in6 sin6 = { .sin6_len = sizeof(sin6), .sin6_family = AF_INET6 };
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_walk_more_specific(rh, (struct sockaddr*)&sin6, NULL,
+                                                          prefix_record_walker, &pr),
+                   "Should reject a query of another family");
+
+    /* Overlays override base routes of the same prefix */
+    ov = route_table_create_overlay(rh, 25);
+    TEST_ASSERT_NOT_NULL(ov, "Should create an overlay");
+    add_route4(ov, "10.1.0.0", "255.255.0.0", "192.168.1.3");
+    add_route4(ov, "10.1.2.128", "255.255.255.128", "192.168.1.4");
+    memset(&pr, 0, sizeof(pr));
+    make_sin(&dst_addr, "10.1.2.200");
+    TEST_ASSERT_EQ(5, route_lookup_covering(ov, (struct sockaddr*)&dst_addr, NULL,
+                                            prefix_record_walker, &pr),
+                   "Should merge the overlay and base covering routes");
+    TEST_ASSERT(pr.pr_plen[0] == 25 && pr.pr_plen[2] == 16,
+                "Overlay routes should be sorted with the base ones");
+    memset(&pr, 0, sizeof(pr));
+    make_sin(&dst_addr, "10.1.0.0");
+    make_mask4(&mask_addr, 16);
+    TEST_ASSERT_EQ(4, route_walk_more_specific(ov, (struct sockaddr*)&dst_addr,
+                                               (struct sockaddr*)&mask_addr,
+                                               prefix_record_walker, &pr),
+                   "Should see 10.1/16 once");
+    route_table_destroy(ov);
+    route_table_destroy(rh);
+
+    /* Random tables against a linear scan */
+    rh = route_table_create(AF_INET, 24);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    srand(68);
+    for (int i = 0; i < 300; i++) {
+        struct route_info ri;
+        struct sockaddr_in gw_addr;
+
+        plens[i] = rand() % 33;
+        addrs[i] = (0x0a000000 | (rand() & 0x00ff00ff) | (rand() & 0xff00)) &
+            (plens[i] ? ~0u << (32 - plens[i]) : 0);
+        memset(&ri, 0, sizeof(ri));
+        dst_addr.sin_addr.s_addr = htonl(addrs[i]);
+        make_mask4(&mask_addr, plens[i]);
+        make_sin(&gw_addr, "192.168.0.1");
+        ri.ri_dst = (struct sockaddr*)&dst_addr;
+        ri.ri_netmask = (struct sockaddr*)&mask_addr;
+        ri.ri_gateway = (struct sockaddr*)&gw_addr;
+        if (route_add(rh, &ri) != ROUTE_OK) {
+            plens[i] = -1;  /* Duplicate */
+        }
+    }
+    for (int q = 0; q < 500; q++) {
+        int qplen = rand() % 33, ncover = 0, nspec = 0, n;
+        uint32_t qmask = qplen ? ~0u << (32 - qplen) : 0;
+        uint32_t qaddr = (0x0a000000 | (rand() & 0x00ff00ff) | (rand() & 0xff00)) & qmask;
+
+        for (int i = 0; i < 300; i++) {
+            uint32_t m = plens[i] > 0 ? ~0u << (32 - plens[i]) : 0;
+
+            if (plens[i] < 0) {
+                continue;
+            }
+            ncover += plens[i] <= qplen && ((addrs[i] ^ qaddr) & m) == 0;
+            nspec += plens[i] >= qplen && ((addrs[i] ^ qaddr) & qmask) == 0;
+        }
+        make_sin(&dst_addr, "0.0.0.0");
+        dst_addr.sin_addr.s_addr = htonl(qaddr);
+        make_mask4(&mask_addr, qplen);
+        memset(&pr, 0, sizeof(pr));
+        n = route_lookup_covering(rh, (struct sockaddr*)&dst_addr,
+                                  (struct sockaddr*)&mask_addr, prefix_record_walker, &pr);
+        TEST_ASSERT_EQ(ncover, n, "Query %d should find every covering route", q);
+        for (int i = 1; i < n; i++) {
+            TEST_ASSERT(pr.pr_plen[i] < pr.pr_plen[i - 1],
+                        "Query %d covering routes should get shorter", q);
+        }
+        memset(&pr, 0, sizeof(pr));
+        n = route_walk_more_specific(rh, (struct sockaddr*)&dst_addr,
+                                     (struct sockaddr*)&mask_addr, prefix_record_walker, &pr);
+        TEST_ASSERT_EQ(nspec, n, "Query %d should find every more specific route", q);
+    }
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+struct hit_record {
+    int hr_count;
+    uint32_t hr_addr[8];
+    uint64_t hr_hits[8];
+};
+
+static int hit_record_walker(struct route_info* ri, uint64_t hits, void* arg) {
+    struct hit_record* hr = arg;
+
+    if (hr->hr_count < 8) {
+        hr->hr_addr[hr->hr_count] = ntohl(((struct sockaddr_in*)ri->ri_dst)->sin_addr.s_addr);
+        hr->hr_hits[hr->hr_count] = hits;
+    }
+    hr->hr_count++;
+    return 0;
+}
+
+static int test_route_hits(void) {
+    struct in_addr dsts[64];
+    struct route_info ris[64];
+    struct sockaddr_in dst_addr;
+    struct hit_record hr;
+    struct rib_head* rh;
+    uint64_t total;
+
+    rh = route_table_create(AF_INET, 29);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_table_set_hit_sampling(rh, ROUTE_HITS_MAXRATE + 1),
+                   "Should reject rates past the maximum");
+
+    /* Nothing is counted until sampling is enabled */
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(29, dst_addr.sin_addr, 0, NULL), "Should match 10.1/16");
+    memset(&hr, 0, sizeof(hr));
+    TEST_ASSERT_EQ(2, route_walk_hits(rh, hit_record_walker, &hr, 0), "Should walk both routes");
+    TEST_ASSERT_EQ(0, hr.hr_hits[0] + hr.hr_hits[1], "Should count nothing by default");
+
+    /* One in one counts every lookup, whichever the path */
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_hit_sampling(rh, 1), "Should sample every lookup");
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(29, dst_addr.sin_addr, 0, NULL), "Should match");
+        TEST_ASSERT(fib4_lookup_nhidx(29, dst_addr.sin_addr, 0) != 0, "Should match a nexthop");
+        TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, NULL),
+                       "Should match");
+    }
+    for (int i = 0; i < 64; i++) {
+        dsts[i].s_addr = htonl(0x0a000000 | (i << 16) | i);
+    }
+    TEST_ASSERT_EQ(64, fib4_lookup_burst(29, dsts, 64, ris), "Burst keys should all match");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(29, dst_addr.sin_addr, 0, NULL),
+                   "Should match on the frozen copy");
+
+    memset(&hr, 0, sizeof(hr));
+    route_walk_hits(rh, hit_record_walker, &hr, ROUTE_HITS_RESET);
+    TEST_ASSERT_EQ(0x0a000000, hr.hr_addr[0], "Should walk 10/8 first");
+    TEST_ASSERT_EQ(63, hr.hr_hits[0], "10/8 should count its burst keys");
+    TEST_ASSERT_EQ(32, hr.hr_hits[1], "10.1/16 should count every lookup");
+    memset(&hr, 0, sizeof(hr));
+    route_walk_hits(rh, hit_record_walker, &hr, 0);
+    TEST_ASSERT_EQ(0, hr.hr_hits[0] + hr.hr_hits[1], "The reset should clear the counts");
+
+    /* Sampled counts estimate the hits */
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_hit_sampling(rh, 16), "Should sample one in 16");
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT_EQ(64, fib4_lookup_burst(29, dsts, 64, ris), "Burst keys should all match");
+    }
+    memset(&hr, 0, sizeof(hr));
+    route_walk_hits(rh, hit_record_walker, &hr, 0);
+    total = hr.hr_hits[0] + hr.hr_hits[1];
+    TEST_ASSERT(total > 64000 * 9 / 10 && total < 64000 * 11 / 10,
+                "Sampled hits %llu should be close to 64000", (unsigned long long)total);
+    TEST_ASSERT(hr.hr_hits[1] > 0 && hr.hr_hits[1] < 4000,
+                "10.1/16 should get its share, not %llu", (unsigned long long)hr.hr_hits[1]);
+
+    /* Disabling keeps the counts */
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_hit_sampling(rh, 0), "Should disable sampling");
+    fib4_lookup_burst(29, dsts, 64, ris);
+    memset(&hr, 0, sizeof(hr));
+    route_walk_hits(rh, hit_record_walker, &hr, 0);
+    TEST_ASSERT_EQ(total, hr.hr_hits[0] + hr.hr_hits[1], "Counts should stay once disabled");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_journal(void) {
+    struct rib_head *orig, *restored;
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_stats stats;
+    struct route_info ri;
+    char path[64], jpath[64];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "/tmp/route_lib_test.%d.snap", (int)getpid());
+    snprintf(jpath, sizeof(jpath), "/tmp/route_lib_test.%d.jrnl", (int)getpid());
+    unlink(jpath);
+
+    orig = route_table_create(AF_INET, 2);
+    TEST_ASSERT_NOT_NULL(orig, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_journal_open(orig, jpath), "Should open the journal");
+    TEST_ASSERT_EQ(ROUTE_EBUSY, route_journal_open(orig, jpath),
+                   "Should not open a second journal");
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(orig, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_save(orig, path), "Should save the table");
+
+    /* Changes past the image only live in the journal */
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(orig, "172.16.0.0", "255.240.0.0", "192.168.1.1"),
+                   "Should add 172.16/12");
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, "172.16.0.0");
+    make_sin(&mask_addr, "255.240.0.0");
+    make_sin(&gw_addr, "192.168.1.2");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+    TEST_ASSERT_EQ(ROUTE_OK, route_change(orig, &ri), "Should change 172.16/12");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(orig, load_routes.routes[2].ri_dst, NULL),
+                   "Should delete host 10.2.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(orig, "192.0.2.0", "255.255.255.0", "192.168.1.3"),
+                   "Should add 192.0.2/24");
+    TEST_ASSERT_EQ(ROUTE_OK, route_journal_sync(orig), "Should sync the journal");
+    route_table_destroy(orig);
+
+    /* A crash in the middle of a write leaves a partial record */
+    f = fopen(jpath, "a");
+    TEST_ASSERT_NOT_NULL(f, "Should open the journal");
+    fwrite("torn", 1, 4, f);
+    fclose(f);
+
+    restored = route_table_restore(path, 3);
+    TEST_ASSERT_NOT_NULL(restored, "Should restore the table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_journal_replay(restored, jpath), "Should replay the tail");
+    TEST_ASSERT_EQ(ROUTE_OK, route_journal_replay(restored, jpath),
+                   "Should replay again as a no-op");
+    route_get_stats(restored, &stats);
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES + 1, stats.rs_nodes, "Should end with the original routes");
+
+    make_sin(&dst_addr, "172.16.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(restored, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 172.16/12");
+    TEST_ASSERT(check_gateway(&ri, "192.168.1.2"), "Should return the changed gateway");
+    make_sin(&dst_addr, "10.2.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(restored, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match a cover of 10.2.0.1");
+    TEST_ASSERT_NOT_NULL(ri.ri_netmask, "Host route should stay deleted");
+    make_sin(&dst_addr, "192.0.2.1");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(restored, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 192.0.2/24");
+
+    /* Reopening cuts the torn record and goes on numbering */
+    TEST_ASSERT_EQ(ROUTE_OK, route_journal_open(restored, jpath), "Should reopen the journal");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_flush(restored), "Should flush the table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_journal_sync(restored), "Should sync the flush");
+    route_table_destroy(restored);
+
+    restored = route_table_restore(path, 3);
+    TEST_ASSERT_NOT_NULL(restored, "Should restore the table again");
+    TEST_ASSERT_EQ(ROUTE_OK, route_journal_replay(restored, jpath),
+                   "Should replay past the torn record");
+    route_get_stats(restored, &stats);
+    TEST_ASSERT_EQ(0, stats.rs_nodes, "Should replay the flush");
+    route_table_destroy(restored);
+
+    unlink(path);
+    unlink(jpath);
+
+    TEST_PASS();
+}
+
+/* Runs validation steps of @limit nodes to the end of a pass, -1 on error */
+static int validate_pass(struct route_validator* rv, int limit) {
+    int n, total = 0;
+
+    while ((n = route_validate_step(rv, limit)) > 0) {
+        total += n;
+    }
+    return n < 0 ? -1 : total;
+}
+
+static int test_route_validate_step(void) {
+    struct route_validator* rv;
+    struct rib_head* rh;
+    int full, total, n;
+
+    rh = route_table_create(AF_INET, 2);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(rh, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the table");
+
+    rv = route_validator_create(rh);
+    TEST_ASSERT_NOT_NULL(rv, "Should create a validator");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_validate_step(rv, 0), "Should reject an empty budget");
+
+    /* Routes and end markers, plus the internal nodes */
+    full = validate_pass(rv, INT_MAX);
+    TEST_ASSERT(full > LOAD_TEST_ROUTES + 2, "One step should check the whole tree");
+    total = validate_pass(rv, 16);
+    TEST_ASSERT_EQ(full, total, "Small steps should check the same nodes");
+
+    /* Steps go on across changes, past the last route checked */
+    total = 0;
+    for (int i = 0; (n = route_validate_step(rv, 64)) > 0; i++) {
+        TEST_ASSERT(n < 64 + 8, "Steps should stay within the budget");
+        total += n;
+        TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, load_routes.routes[4 * i].ri_dst,
+                                              load_routes.routes[4 * i].ri_netmask),
+                       "Should delete route %d", 4 * i);
+    }
+    TEST_ASSERT_EQ(0, n, "Pass should end without error");
+    TEST_ASSERT(total > 0 && total <= full, "Pass should check the changed tree once");
+    TEST_ASSERT(validate_pass(rv, 16) > 0, "Next pass should be consistent");
+
+    route_validator_destroy(rv);
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+/* Records the walk order, stopping after wr_limit routes if set */
+struct walk_record {
+    const struct sockaddr* wr_dsts[LOAD_TEST_ROUTES];
+    int wr_count;
+    int wr_limit;
+};
+
+static int record_walker(struct route_info* ri, void* arg) {
+    struct walk_record* wr = arg;
+
+    if (wr->wr_count < LOAD_TEST_ROUTES) {
+        wr->wr_dsts[wr->wr_count] = ri->ri_dst;
+    }
+    wr->wr_count++;
+    return (wr->wr_limit != 0 && wr->wr_count == wr->wr_limit);
+}
+
+static struct walk_record walk_seq, walk_par;
+
+static int test_route_walk_parallel(void) {
+    struct rib_head* rh;
+    int count = 0;
+
+    rh = route_table_create(AF_INET, 2);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(rh, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the table");
+
+    memset(&walk_seq, 0, sizeof(walk_seq));
+    memset(&walk_par, 0, sizeof(walk_par));
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, route_walk(rh, record_walker, &walk_seq),
+                   "Sequential walk should visit all routes");
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES,
+                   route_walk_parallel(rh, record_walker, &walk_par, 4, ROUTE_WALK_ORDERED),
+                   "Ordered walk should visit all routes");
+    TEST_ASSERT_EQ(0, memcmp(walk_seq.wr_dsts, walk_par.wr_dsts, sizeof(walk_seq.wr_dsts)),
+                   "Ordered walk should keep the sequential order");
+
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, route_walk_parallel(rh, count_walker, &count, 4, 0),
+                   "Unordered walk should visit all routes");
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, count, "Walker should see every route once");
+
+    /* Walker can stop an ordered walk */
+    memset(&walk_par, 0, sizeof(walk_par));
+    walk_par.wr_limit = 10;
+    TEST_ASSERT_EQ(10, route_walk_parallel(rh, record_walker, &walk_par, 4, ROUTE_WALK_ORDERED),
+                   "Ordered walk should stop when asked");
+
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_walk_parallel(rh, count_walker, &count, 0, 0),
+                   "Should reject zero threads");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+/* Records routes by value, they may be deleted while a cursor walks */
+struct walk_keys {
+    uint32_t wk_addr[2 * LOAD_TEST_ROUTES];
+    int wk_plen[2 * LOAD_TEST_ROUTES];   /* -1 for host routes */
+    int wk_count;
+};
+
+static int keys_walker(struct route_info* ri, void* arg) {
+    struct walk_keys* wk = arg;
+    int plen = -1;
+
+    if (ri->ri_netmask) {
+        plen = __builtin_popcount(((const struct sockaddr_in*)ri->ri_netmask)->sin_addr.s_addr);
+    }
+    if (wk->wk_count < 2 * LOAD_TEST_ROUTES) {
+        wk->wk_addr[wk->wk_count] = ((const struct sockaddr_in*)ri->ri_dst)->sin_addr.s_addr;
+        wk->wk_plen[wk->wk_count] = plen;
+    }
+    wk->wk_count++;
+    return 0;
+}
+
+static int delete_key(struct rib_head* rh, const struct walk_keys* wk, int i) {
+    struct sockaddr_in dst, mask;
+
+    make_sin(&dst, "0.0.0.0");
+    dst.sin_addr.s_addr = wk->wk_addr[i];
+    if (wk->wk_plen[i] >= 0) {
+        make_sin(&mask, "0.0.0.0");
+        mask.sin_addr.s_addr = htonl(wk->wk_plen[i] ? ~0u << (32 - wk->wk_plen[i]) : 0);
+    }
+    return route_delete(rh, (struct sockaddr*)&dst,
+                        wk->wk_plen[i] >= 0 ? (struct sockaddr*)&mask : NULL);
+}
+
+static struct walk_keys keys_seq, keys_cur;
+
+static int test_route_cursor(void) {
+    struct route_cursor* rc;
+    struct rib_head* rh;
+    int gone[LOAD_TEST_ROUTES] = { 0 };
+    int n, chunks = 0, expect = 0;
+
+    rh = route_table_create(AF_INET, 2);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(rh, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should load the table");
+
+    memset(&walk_seq, 0, sizeof(walk_seq));
+    memset(&walk_par, 0, sizeof(walk_par));
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, route_walk(rh, record_walker, &walk_seq),
+                   "Sequential walk should visit all routes");
+
+    /* Chunks of an unchanged table add up to a full walk */
+    rc = route_cursor_create(rh);
+    TEST_ASSERT_NOT_NULL(rc, "Should create a cursor");
+    while ((n = route_cursor_next(rc, record_walker, &walk_par, 7)) > 0) {
+        TEST_ASSERT(n <= 7, "Should not exceed the chunk size");
+    }
+    TEST_ASSERT_EQ(0, n, "Should end the walk without an error");
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, walk_par.wr_count, "Cursor should visit all routes");
+    TEST_ASSERT_EQ(0, memcmp(walk_seq.wr_dsts, walk_par.wr_dsts, sizeof(walk_seq.wr_dsts)),
+                   "Cursor should keep the sequential order");
+    TEST_ASSERT_EQ(0, route_cursor_next(rc, record_walker, &walk_par, 7),
+                   "Finished cursor should stay finished");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_cursor_next(rc, record_walker, &walk_par, 0),
+                   "Should reject an empty chunk");
+    route_cursor_destroy(rc);
+
+    /*
+     * Between chunks delete the last route returned and one ahead of the
+     * cursor, and add one: every other route shows up once, in order.
+     */
+    memset(&keys_seq, 0, sizeof(keys_seq));
+    memset(&keys_cur, 0, sizeof(keys_cur));
+    route_walk(rh, keys_walker, &keys_seq);
+    rc = route_cursor_create(rh);
+    TEST_ASSERT_NOT_NULL(rc, "Should create a cursor");
+    while (route_cursor_next(rc, keys_walker, &keys_cur, 7) > 0) {
+        char dst[INET_ADDRSTRLEN];
+        int last = keys_cur.wk_count - 1;
+
+        TEST_ASSERT_EQ(ROUTE_OK, delete_key(rh, &keys_cur, last),
+                       "Should delete the last route returned");
+        for (int i = 0; i < LOAD_TEST_ROUTES; i++) {
+            if (keys_seq.wk_addr[i] == keys_cur.wk_addr[last] &&
+                keys_seq.wk_plen[i] == keys_cur.wk_plen[last] && i + 20 < LOAD_TEST_ROUTES) {
+                TEST_ASSERT_EQ(ROUTE_OK, delete_key(rh, &keys_seq, i + 20),
+                               "Should delete a route ahead of the cursor");
+                gone[i + 20] = 1;
+                break;
+            }
+        }
+        snprintf(dst, sizeof(dst), "10.%d.%d.128", 200 + chunks % 50, chunks % 256);
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, dst, "255.255.255.128", "192.168.1.1"),
+                       "Should add a route");
+        chunks++;
+    }
+
+    for (int i = 0, j = 0; i < keys_cur.wk_count; i++) {
+        while (j < LOAD_TEST_ROUTES && gone[j]) {
+            j++;
+        }
+        if (j < LOAD_TEST_ROUTES && keys_cur.wk_addr[i] == keys_seq.wk_addr[j] &&
+            keys_cur.wk_plen[i] == keys_seq.wk_plen[j]) {
+            expect++;
+            j++;
+            continue;
+        }
+        TEST_ASSERT_EQ(25, keys_cur.wk_plen[i], "Only added routes should be out of order");
+    }
+    for (int i = 0; i < LOAD_TEST_ROUTES; i++) {
+        expect += gone[i];
+    }
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES, expect, "Should return every unchanged route once");
+    TEST_ASSERT(chunks > LOAD_TEST_ROUTES / 8, "Should have walked in chunks");
+    route_cursor_destroy(rc);
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int latency_sum(const struct route_latency* rl) {
+    uint64_t n = 0;
+
+    for (int b = 0; b < ROUTE_LAT_BUCKETS; b++) {
+        n += rl->rl_buckets[b];
+    }
+    return n == rl->rl_count;
+}
+
+static int test_route_stats_latency(void) {
+    struct rib_head* rh;
+    struct route_stats_ext ext;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri;
+    char addr[32];
+
+    rh = route_table_create(AF_INET, 0);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    for (int i = 0; i < 64; i++) {
+        snprintf(addr, sizeof(addr), "10.%d.0.0", i);
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, addr, "255.255.0.0", "192.168.0.1"),
+                       "Should add route");
+    }
+    for (int i = 0; i < 16; i++) {
+        snprintf(addr, sizeof(addr), "10.%d.0.0", i);
+        make_sin(&dst_addr, addr);
+        make_sin(&mask_addr, "255.255.0.0");
+        TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                              (struct sockaddr*)&mask_addr),
+                       "Should delete route");
+    }
+    make_sin(&dst_addr, "10.40.1.1");
+    for (int i = 0; i < 32 * ROUTE_LAT_LOOKUP_SAMPLE; i++) {
+        route_lookup(rh, (struct sockaddr*)&dst_addr, &ri);
+    }
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, "10.20.0.0");
+    make_sin(&mask_addr, "255.255.0.0");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_flags = ROUTE_RTF_UP;
+    TEST_ASSERT_EQ(ROUTE_OK, route_change(rh, &ri), "Should change route");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_get_stats_ext(rh, &ext), "Should fetch extended stats");
+    TEST_ASSERT_EQ(64, ext.rse_add.rl_count, "Change should not count as an add");
+    TEST_ASSERT_EQ(16, ext.rse_delete.rl_count, "Change should not count as a delete");
+    TEST_ASSERT_EQ(1, ext.rse_change.rl_count, "Should time the change");
+    TEST_ASSERT_EQ(32, ext.rse_lookup.rl_count, "Should sample one lookup in 16");
+    TEST_ASSERT_EQ(0, ext.rse_rebuild.rl_count, "Nothing was rebuilt");
+    TEST_ASSERT_EQ(ext.rse_stats.rs_lookups, 32 * ROUTE_LAT_LOOKUP_SAMPLE,
+                   "Every lookup is still counted");
+
+    TEST_ASSERT(latency_sum(&ext.rse_add), "Add buckets should add up");
+    TEST_ASSERT(latency_sum(&ext.rse_lookup), "Lookup buckets should add up");
+    uint64_t p50 = route_latency_percentile(&ext.rse_add, 50.0);
+    uint64_t p99 = route_latency_percentile(&ext.rse_add, 99.0);
+    TEST_ASSERT(p50 <= p99, "Percentiles should be ordered");
+    TEST_ASSERT(p99 <= ext.rse_add.rl_max_ns, "Percentiles should not pass the maximum");
+    TEST_ASSERT(ext.rse_add.rl_sum_ns >= ext.rse_add.rl_max_ns, "Sum should cover the maximum");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    route_get_stats_ext(rh, &ext);
+    TEST_ASSERT_EQ(1, ext.rse_rebuild.rl_count, "Should time the freeze");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_lookup_cache(void) {
+    struct rib_head* rh;
+    struct route_stats stats;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri;
+
+    rh = route_table_create(AF_INET, 0);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_lookup_cache(rh, 1), "Should enable the cache");
+
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+
+    make_sin(&dst_addr, "10.1.2.3");
+    for (int i = 0; i < 8; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                       "Should match 10/8");
+        TEST_ASSERT(check_gateway(&ri, "192.168.0.1"), "Should return 10/8");
+    }
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(7, stats.rs_cache_hits, "Repeated lookups should hit the cache");
+    TEST_ASSERT_EQ(8, stats.rs_hits, "Cached lookups are still hits");
+
+    /* A more specific route invalidates the cached result */
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10.1/16");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Should not return the cached 10/8");
+
+    /* So does a delete, misses are cached too */
+    make_sin(&mask_addr, "255.0.0.0");
+    make_sin(&dst_addr, "10.0.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr), "Should delete 10/8");
+    make_sin(&dst_addr, "10.2.0.1");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                   "Should miss after the delete");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                   "Should miss from the cache");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(8, stats.rs_cache_hits, "Should have cached the miss");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_lookup_cache(rh, 0), "Should disable the cache");
+    route_lookup(rh, (struct sockaddr*)&dst_addr, &ri);
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(8, stats.rs_cache_hits, "Disabled cache should not be used");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_host_table(void) {
+    const int nhosts = 1000;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct in_addr dsts[64];
+    struct route_info ri, ris[64];
+    struct rib_head* rh;
+    char addr[32];
+
+    rh = route_table_create(AF_INET, 18);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.2.0", "255.255.255.0", "192.168.0.2"),
+                   "Should add 10.1.2/24");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.2.3", "255.255.255.255", "192.168.0.3"),
+                   "Should add host 10.1.2.3/32");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_host_table(rh, 1), "Should enable the host table");
+
+    /* Hosts added before and after enabling, with and without a mask */
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.2.4", NULL, "192.168.0.4"),
+                   "Should add host 10.1.2.4");
+    for (int i = 0; i < nhosts; i++) {
+        snprintf(addr, sizeof(addr), "10.2.%d.%d", i >> 8, i & 255);
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, addr, "255.255.255.255", "192.168.0.5"),
+                       "Should add host %s", addr);
+    }
+
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10.1.2.3");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.3"), "Should return the /32 route");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(18, dst_addr.sin_addr, 0, &ri),
+                   "Datapath should match 10.1.2.3");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.3"), "Datapath should return the /32 route");
+    make_sin(&dst_addr, "10.1.2.4");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(18, dst_addr.sin_addr, 0, &ri),
+                   "Datapath should match 10.1.2.4");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.4"), "Unmasked routes should be hosts");
+    make_sin(&dst_addr, "10.1.2.5");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10.1.2/24");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Other addresses should go to the tree");
+
+    /* Deleted hosts fall back to 10/8, on the tree and on the frozen copy */
+    make_sin(&mask_addr, "255.255.255.255");
+    for (int i = 0; i < nhosts; i += 2) {
+        snprintf(addr, sizeof(addr), "10.2.%d.%d", i >> 8, i & 255);
+        make_sin(&dst_addr, addr);
+        TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                              (struct sockaddr*)&mask_addr),
+                       "Should delete host %s", addr);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < nhosts; i++) {
+            snprintf(addr, sizeof(addr), "10.2.%d.%d", i >> 8, i & 255);
+            make_sin(&dst_addr, addr);
+            TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(18, dst_addr.sin_addr, 0, &ri),
+                           "Datapath should match %s", addr);
+            TEST_ASSERT(check_gateway(&ri, (i & 1) ? "192.168.0.5" : "192.168.0.1"),
+                        "Wrong route for %s", addr);
+            dsts[i % 64] = dst_addr.sin_addr;
+        }
+        TEST_ASSERT_EQ(64, fib4_lookup_burst(18, dsts, 64, ris), "Burst should match all");
+        for (int i = 0; i < 64; i++) {
+            int host = (nhosts - 64 + i) & 1;
+            TEST_ASSERT(check_gateway(&ris[i], host ? "192.168.0.5" : "192.168.0.1"),
+                        "Burst should agree with single lookups");
+        }
+        TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    }
+
+    /* A flush empties the host table with the tree */
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_flush(rh), "Should flush the table");
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                   "Flushed hosts should miss");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.2.3", NULL, "192.168.0.6"),
+                   "Should add host 10.1.2.3 again");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(18, dst_addr.sin_addr, 0, &ri),
+                   "Datapath should match 10.1.2.3");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.6"), "Should return the new host route");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_host_table(rh, 0), "Should disable the host table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                   "Hosts should still be in the tree");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_table_set_host_table(NULL, 1), "Should reject NULL");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int add_sharded4(struct route_sharded* rs, const char* dst, const char* mask,
+                        const char* gw) {
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_info ri;
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, dst);
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    make_sin(&mask_addr, mask);
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    make_sin(&gw_addr, gw);
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+
+    return route_sharded_add(rs, &ri);
+}
+
+struct sharded_writer {
+    struct route_sharded* rs;
+    int first;          /* First octet of the routes to add */
+    int count;
+    int failed;
+};
+
+static void* sharded_writer_thread(void* arg) {
+    struct sharded_writer* w = arg;
+    char addr[32];
+
+    for (int i = 0; i < w->count; i++) {
+        snprintf(addr, sizeof(addr), "%d.%d.%d.0", w->first, i >> 8, i & 255);
+        if (add_sharded4(w->rs, addr, "255.255.255.0", "192.168.0.9") != ROUTE_OK) {
+            w->failed++;
+        }
+    }
+    return NULL;
+}
+
+static int test_route_sharded(void) {
+    const int nwriters = 4, per_writer = 500;
+    struct sharded_writer writers[4];
+    pthread_t threads[4];
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_info ri;
+    struct route_stats stats;
+    struct route_sharded* rs;
+    int walked = 0;
+
+    TEST_ASSERT_NULL(route_sharded_create(AF_INET, 19, 0), "Should reject 0 bits");
+    TEST_ASSERT_NULL(route_sharded_create(AF_INET, 19, ROUTE_SHARD_MAXBITS + 1),
+                     "Should reject too many bits");
+
+    rs = route_sharded_create(AF_INET, 19, 4);
+    TEST_ASSERT_NOT_NULL(rs, "Should create a sharded table");
+
+    /* 8/5 and the default go to the top table, the rest to shards */
+    TEST_ASSERT_EQ(ROUTE_OK, add_sharded4(rs, "0.0.0.0", "0.0.0.0", "192.168.0.1"),
+                   "Should add the default route");
+    TEST_ASSERT_EQ(ROUTE_OK, add_sharded4(rs, "8.0.0.0", "248.0.0.0", "192.168.0.2"),
+                   "Should add 8/5");
+    TEST_ASSERT_EQ(ROUTE_OK, add_sharded4(rs, "10.0.0.0", "255.0.0.0", "192.168.0.3"),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_sharded4(rs, "10.1.0.0", "255.255.0.0", "192.168.0.4"),
+                   "Should add 10.1/16");
+
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, route_sharded_lookup(rs, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10.1/16");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.4"), "Should pick the longest shard match");
+    make_sin(&dst_addr, "11.0.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(19, dst_addr.sin_addr, 0, &ri),
+                   "Datapath should match 8/5");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Empty shards should fall back to the top");
+    make_sin(&dst_addr, "200.0.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(19, dst_addr.sin_addr, 0, &ri),
+                   "Datapath should match the default route");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.1"), "Should return the default route");
+
+    /* Change and delete land in the shard the route was added to */
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, "10.1.0.0");
+    make_sin(&mask_addr, "255.255.0.0");
+    make_sin(&gw_addr, "192.168.0.5");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+    TEST_ASSERT_EQ(ROUTE_OK, route_sharded_change(rs, &ri), "Should change 10.1/16");
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, route_sharded_lookup(rs, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10.1/16");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.5"), "Should return the changed gateway");
+    make_sin(&dst_addr, "10.1.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_sharded_delete(rs, (struct sockaddr*)&dst_addr,
+                                                  (struct sockaddr*)&mask_addr),
+                   "Should delete 10.1/16");
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_OK, route_sharded_lookup(rs, (struct sockaddr*)&dst_addr, &ri),
+                   "Should match 10/8");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.3"), "Should fall back to 10/8");
+
+    /* Writers of different shards run at once */
+    for (int i = 0; i < nwriters; i++) {
+        writers[i] = (struct sharded_writer){ .rs = rs, .first = 32 + 16 * i,
+                                              .count = per_writer };
+        TEST_ASSERT_EQ(0, pthread_create(&threads[i], NULL, sharded_writer_thread, &writers[i]),
+                       "Should start writer %d", i);
+    }
+    for (int i = 0; i < nwriters; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQ(0, writers[i].failed, "Writer %d should add all its routes", i);
+    }
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_sharded_get_stats(rs, &stats), "Should get stats");
+    TEST_ASSERT_EQ(3 + nwriters * per_writer, stats.rs_nodes, "Should count all shards");
+    TEST_ASSERT_EQ(3 + nwriters * per_writer, route_sharded_walk(rs, count_walker, &walked),
+                   "Walk should visit all shards");
+    TEST_ASSERT_EQ(3 + nwriters * per_writer, walked, "Walker should see every route");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_sharded_freeze(rs), "Should freeze every shard");
+    make_sin(&dst_addr, "48.1.2.9");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(19, dst_addr.sin_addr, 0, &ri),
+                   "Datapath should match 48.1.2/24");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.9"), "Should return the writer route");
+
+    route_sharded_destroy(rs);
+    make_sin(&dst_addr, "10.1.2.3");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(19, dst_addr.sin_addr, 0, &ri),
+                   "Destroy should detach from the datapath");
+
+    TEST_PASS();
+}
+
+struct async_producer {
+    struct route_async* ra;
+    int first;          /* Second octet of the routes to add */
+    int count;
+    int failed;
+};
+
+static void* async_producer_thread(void* arg) {
+    struct async_producer* p = arg;
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_info ri;
+    char addr[32];
+
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&mask_addr, "255.255.255.0");
+    make_sin(&gw_addr, "192.168.0.9");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+    for (int i = 0; i < p->count; i++) {
+        int error;
+
+        snprintf(addr, sizeof(addr), "10.%d.%d.0", p->first + (i >> 8), i & 255);
+        make_sin(&dst_addr, addr);
+        while ((error = route_async_submit(p->ra, ROUTE_ASYNC_ADD, &ri,
+                                           ((uint64_t)p->first << 32) | i)) == ROUTE_EBUSY) {
+            sched_yield();
+        }
+        if (error != ROUTE_OK) {
+            p->failed++;
+        }
+    }
+    return NULL;
+}
+
+static int test_route_async(void) {
+    const int nproducers = 4, per_producer = 500;
+    struct async_producer producers[4];
+    struct route_async_cqe cqes[32];
+    pthread_t threads[4];
+    struct sockaddr_in dst_addr, mask_addr, gw_addr;
+    struct route_stats stats;
+    struct route_info ri, ri_out;
+    struct route_async* ra;
+    struct rib_head* rh;
+    int seen[4] = { 0 };
+    int done = 0, n;
+
+    rh = route_table_create(AF_INET, 21);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_NULL(route_async_create(rh, 100), "Should reject a ring of 100 entries");
+    ra = route_async_create(rh, 64);
+    TEST_ASSERT_NOT_NULL(ra, "Should start the async writer");
+
+    /* Producers outrun a small ring, completions are reaped meanwhile */
+    for (int i = 0; i < nproducers; i++) {
+        producers[i] = (struct async_producer){ .ra = ra, .first = 4 * i,
+                                                .count = per_producer };
+        TEST_ASSERT_EQ(0, pthread_create(&threads[i], NULL, async_producer_thread, &producers[i]),
+                       "Should start producer %d", i);
+    }
+    while (done < nproducers * per_producer) {
+        n = route_async_reap(ra, cqes, 32, 1);
+        TEST_ASSERT(n > 0, "Waiting reap should return completions");
+        for (int i = 0; i < n; i++) {
+            TEST_ASSERT_EQ(ROUTE_OK, cqes[i].rac_result, "Op %llx should succeed",
+                           (unsigned long long)cqes[i].rac_tag);
+            TEST_ASSERT_EQ(ROUTE_ASYNC_ADD, cqes[i].rac_op, "Should report the op");
+            /* Ops of one producer complete in submission order */
+            TEST_ASSERT_EQ(seen[(cqes[i].rac_tag >> 32) / 4]++, (int)(cqes[i].rac_tag & 0xffff),
+                           "Completions of a producer should come in order");
+        }
+        done += n;
+    }
+    for (int i = 0; i < nproducers; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQ(0, producers[i].failed, "Producer %d should submit all its ops", i);
+    }
+    TEST_ASSERT_EQ(0, route_async_reap(ra, cqes, 32, 0), "No completions should be left");
+
+    /* Results come back as from the synchronous calls */
+    memset(&ri, 0, sizeof(ri));
+    make_sin(&dst_addr, "10.0.1.0");
+    make_sin(&mask_addr, "255.255.255.0");
+    make_sin(&gw_addr, "192.168.0.10");
+    ri.ri_dst = (struct sockaddr*)&dst_addr;
+    ri.ri_netmask = (struct sockaddr*)&mask_addr;
+    ri.ri_gateway = (struct sockaddr*)&gw_addr;
+    ri.ri_flags = ROUTE_RTF_UP | ROUTE_RTF_GATEWAY;
+    TEST_ASSERT_EQ(ROUTE_OK, route_async_submit(ra, ROUTE_ASYNC_ADD, &ri, 1),
+                   "Should submit a duplicate add");
+    TEST_ASSERT_EQ(ROUTE_OK, route_async_submit(ra, ROUTE_ASYNC_CHANGE, &ri, 2),
+                   "Should submit a change");
+    make_sin(&dst_addr, "10.0.2.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_async_submit(ra, ROUTE_ASYNC_DELETE, &ri, 3),
+                   "Should submit a delete");
+    TEST_ASSERT_EQ(ROUTE_EINVAL, route_async_submit(ra, 42, &ri, 4), "Should reject bad ops");
+    for (done = 0; done < 3; done += n) {
+        n = route_async_reap(ra, &cqes[done], 3 - done, 1);
+    }
+    TEST_ASSERT_EQ(1, cqes[0].rac_tag, "Completions should come in order");
+    TEST_ASSERT_EQ(ROUTE_EEXIST, cqes[0].rac_result, "Duplicate add should fail");
+    TEST_ASSERT_EQ(ROUTE_OK, cqes[1].rac_result, "Change should succeed");
+    TEST_ASSERT_EQ(ROUTE_OK, cqes[2].rac_result, "Delete should succeed");
+
+    make_sin(&dst_addr, "10.0.1.1");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(21, dst_addr.sin_addr, 0, &ri_out),
+                   "Datapath should match 10.0.1/24");
+    TEST_ASSERT(check_gateway(&ri_out, "192.168.0.10"), "Should return the changed gateway");
+    make_sin(&dst_addr, "10.0.2.1");
+    TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(21, dst_addr.sin_addr, 0, &ri_out),
+                   "Deleted route should miss");
+
+    /* Destroy applies the ops still queued */
+    make_sin(&dst_addr, "10.0.2.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_async_submit(ra, ROUTE_ASYNC_ADD, &ri, 5),
+                   "Should submit an add");
+    route_async_destroy(ra);
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(nproducers * per_producer, stats.rs_nodes, "Should hold all routes");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_table_flush(void) {
+    struct rib_head* rh;
+    struct route_stats stats;
+    struct malloc_type_stats before, after;
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_info ri;
+    struct in_addr dst;
+
+    epoch_drain_callbacks(net_epoch_preempt);
+    malloc_type_fetch(M_RTMASK, &before);
+
+    rh = route_table_create(AF_INET, 7);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    make_load_routes(&load_routes);
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_load(rh, load_routes.routes, LOAD_TEST_ROUTES),
+                   "Should bulk load the table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "172.16.0.0", "255.240.0.0", "192.168.0.1"),
+                   "Should add 172.16/12");
+
+    /* Leaves a deferred free of the table zone behind */
+    make_sin(&dst_addr, "172.16.0.0");
+    make_sin(&mask_addr, "255.240.0.0");
+    TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                          (struct sockaddr*)&mask_addr),
+                   "Should delete 172.16/12");
+
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_flush(rh), "Should flush the table");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(0, stats.rs_nodes, "Flushed table should be empty");
+    TEST_ASSERT_EQ(1, stats.rs_flushes, "Should count one flush");
+    TEST_ASSERT_EQ(LOAD_TEST_ROUTES + 1, stats.rs_deletes, "Should account the routes");
+    int left = 0;
+    route_walk(rh, count_walker, &left);
+    TEST_ASSERT_EQ(0, left, "Walk should find no route");
+
+    for (int i = 0; i < LOAD_TEST_ROUTES; i++) {
+        dst = ((struct sockaddr_in*)load_routes.routes[i].ri_dst)->sin_addr;
+        TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(7, dst, 0, &ri),
+                       "Datapath should miss after the flush");
+    }
+
+    malloc_type_fetch(M_RTMASK, &after);
+    TEST_ASSERT_EQ(before.mts_objects, after.mts_objects,
+                   "Masks should all be released");
+
+    /* The table stays usable */
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8 after the flush");
+    inet_pton(AF_INET, "10.2.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(7, dst, 0, &ri), "Should match 10/8");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.1"), "Should return the new route");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+struct compact_reader {
+    struct in_addr cr_dst;      /* Never deleted */
+    _Atomic int cr_stop;
+    int cr_lookups;
+    int cr_misses;
+};
+
+static void* compact_reader_thread(void* arg) {
+    struct compact_reader* cr = arg;
+    struct route_info ri;
+
+    while (!atomic_load(&cr->cr_stop)) {
+        if (fib4_lookup(26, cr->cr_dst, 0, &ri) != ROUTE_OK) {
+            cr->cr_misses++;
+        }
+        cr->cr_lookups++;
+    }
+    return NULL;
+}
+
+static int test_route_table_compact(void) {
+    struct compact_reader cr = { .cr_stop = 0 };
+    struct sockaddr_in dst_addr, mask_addr;
+    struct route_stats stats;
+    struct route_info ri;
+    struct rib_head* rh;
+    pthread_t reader;
+    char addr[32];
+    int slices = 0, count = 0, rc;
+
+    rh = route_table_create(AF_INET, 26);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_set_host_table(rh, 1), "Should enable the host table");
+
+    /* Churn: 10.i.j/24 for even i stay, odd i come and go */
+    for (int i = 0; i < 32; i++) {
+        for (int j = 0; j < 32; j++) {
+            snprintf(addr, sizeof(addr), "10.%d.%d.0", i, j);
+            TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, addr, "255.255.255.0", "192.168.0.1"),
+                           "Should add %s/24", addr);
+        }
+    }
+    make_sin(&mask_addr, "255.255.255.0");
+    for (int i = 1; i < 32; i += 2) {
+        for (int j = 0; j < 32; j++) {
+            snprintf(addr, sizeof(addr), "10.%d.%d.0", i, j);
+            make_sin(&dst_addr, addr);
+            route_delete(rh, (struct sockaddr*)&dst_addr, (struct sockaddr*)&mask_addr);
+        }
+    }
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "172.16.0.1", NULL, "192.168.0.2"),
+                   "Should add a host route");
+
+    inet_pton(AF_INET, "10.0.0.1", &cr.cr_dst);
+    TEST_ASSERT_EQ(0, pthread_create(&reader, NULL, compact_reader_thread, &cr),
+                   "Should start the reader");
+
+    /* Changes between slices land on both sides of the copy */
+    while ((rc = route_table_compact(rh, 64)) == 1) {
+        snprintf(addr, sizeof(addr), "10.%d.0.0", 2 * (slices % 16));
+        make_sin(&dst_addr, addr);
+        if (slices % 16 != 0) {
+            TEST_ASSERT_EQ(ROUTE_OK, route_delete(rh, (struct sockaddr*)&dst_addr,
+                                                  (struct sockaddr*)&mask_addr),
+                           "Should delete %s/24 mid compaction", addr);
+        }
+        snprintf(addr, sizeof(addr), "10.%d.0.0", 2 * (slices % 16) + 1);
+        add_route4(rh, addr, "255.255.255.0", "192.168.0.3");
+        slices++;
+    }
+    atomic_store(&cr.cr_stop, 1);
+    pthread_join(reader, NULL);
+    TEST_ASSERT_EQ(ROUTE_OK, rc, "Compaction should complete");
+    TEST_ASSERT(slices >= 8, "Should take several slices, took %d", slices);
+    TEST_ASSERT_EQ(0, cr.cr_misses, "Lookups should not miss during the compaction");
+
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(1, stats.rs_compactions, "Should count the compaction");
+    route_walk(rh, count_walker, &count);
+    TEST_ASSERT_EQ((int)stats.rs_nodes, count, "The new tree should hold every route");
+    for (int i = 0; i < 32; i++) {
+        int deleted = (i % 2 == 0) ? (i / 2 < slices && i != 0) : (i / 2 >= slices);
+
+        snprintf(addr, sizeof(addr), "10.%d.0.1", i);
+        make_sin(&dst_addr, addr);
+        TEST_ASSERT_EQ(deleted ? ROUTE_ENOENT : ROUTE_OK,
+                       fib4_lookup(26, dst_addr.sin_addr, 0, &ri),
+                       "10.%d/24 should be %s", i, deleted ? "gone" : "present");
+        if (!deleted) {
+            TEST_ASSERT(check_gateway(&ri, i % 2 ? "192.168.0.3" : "192.168.0.1"),
+                        "10.%d/24 should keep its gateway", i);
+        }
+    }
+    make_sin(&dst_addr, "172.16.0.1");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(26, dst_addr.sin_addr, 0, &ri),
+                   "The host route should be in the new host table");
+    TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Should return the host route");
+
+    /* A frozen table is frozen again, a flush drops a compaction */
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(rh), "Should freeze the table");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_compact(rh, 0), "Should compact in one call");
+    make_sin(&dst_addr, "10.4.5.6");
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(26, dst_addr.sin_addr, 0, &ri), "Should match 10.4.5/24");
+    TEST_ASSERT_EQ(1, route_table_compact(rh, 1), "Should copy one route");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_flush(rh), "Should flush");
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_compact(rh, 1), "An empty table should compact at once");
+    route_get_stats(rh, &stats);
+    TEST_ASSERT_EQ(3, stats.rs_compactions, "Should count finished compactions only");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+struct optimistic_reader {
+    struct rib_head* or_rh;
+    int or_swaps;               /* Tree swapped under the reader, misses allowed */
+    _Atomic int or_stop;
+    int or_lookups;
+    int or_wrong;
+};
+
+/* Whether @ri of a lookup that returned @error is one the reader may see */
+static int optimistic_check(const struct optimistic_reader* or, int error,
+                            const struct route_info* ri, const char* gw1, const char* gw2) {
+    if (error != ROUTE_OK) {
+        return or->or_swaps;
+    }
+    if (or->or_swaps) {
+        return check_gateway(ri, "172.16.0.1") || check_gateway(ri, "172.16.0.2") ||
+            check_gateway(ri, "172.16.0.3") || check_gateway(ri, "172.16.0.4");
+    }
+    return check_gateway(ri, gw1) || check_gateway(ri, gw2);
+}
+
+static void* optimistic_reader_thread(void* arg) {
+    struct optimistic_reader* or = arg;
+    struct sockaddr_in host, churned;
+    struct route_info ri;
+    int error;
+
+    make_sin(&host, "192.168.1.1");
+    make_sin(&churned, "10.0.0.1");
+    while (!atomic_load(&or->or_stop)) {
+        route_epoch_enter();
+        error = route_lookup(or->or_rh, (struct sockaddr*)&host, &ri);
+        if (!optimistic_check(or, error, &ri, "172.16.0.1", "172.16.0.1")) {
+            or->or_wrong++;
+        }
+        /* 10.0.0/24 comes and goes over 10/8 */
+        error = route_lookup(or->or_rh, (struct sockaddr*)&churned, &ri);
+        if (!optimistic_check(or, error, &ri, "172.16.0.2", "172.16.0.3")) {
+            or->or_wrong++;
+        }
+        route_epoch_exit();
+        or->or_lookups += 2;
+    }
+    return NULL;
+}
+
+/* Starts readers of @rh, returns how many are running */
+static int optimistic_start(struct optimistic_reader* readers, pthread_t* threads, int n,
+                            struct rib_head* rh, int swaps) {
+    int started;
+
+    for (started = 0; started < n; started++) {
+        readers[started] = (struct optimistic_reader){ .or_rh = rh, .or_swaps = swaps };
+        if (pthread_create(&threads[started], NULL, optimistic_reader_thread,
+                           &readers[started]) != 0) {
+            break;
+        }
+    }
+    return started;
+}
+
+static void optimistic_stop(struct optimistic_reader* readers, pthread_t* threads, int n) {
+    for (int i = 0; i < n; i++) {
+        atomic_store(&readers[i].or_stop, 1);
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Reshapes the tree around both destinations, returns the failed changes */
+static int optimistic_churn(struct rib_head* rh) {
+    struct sockaddr_in dst_addr, mask_addr;
+    char addr[32];
+    int failed = 0;
+
+    make_sin(&mask_addr, "255.255.255.0");
+    for (int round = 0; round < 200; round++) {
+        for (int j = 0; j < 64; j++) {
+            snprintf(addr, sizeof(addr), "10.0.%d.0", j);
+            failed += add_route4(rh, addr, "255.255.255.0", "172.16.0.3") != ROUTE_OK;
+            snprintf(addr, sizeof(addr), "192.168.%d.0", j + 2);
+            failed += add_route4(rh, addr, "255.255.255.0", "172.16.0.4") != ROUTE_OK;
+        }
+        for (int j = 0; j < 64; j++) {
+            snprintf(addr, sizeof(addr), "10.0.%d.0", j);
+            make_sin(&dst_addr, addr);
+            failed += route_delete(rh, (struct sockaddr*)&dst_addr,
+                                   (struct sockaddr*)&mask_addr) != ROUTE_OK;
+            snprintf(addr, sizeof(addr), "192.168.%d.0", j + 2);
+            make_sin(&dst_addr, addr);
+            failed += route_delete(rh, (struct sockaddr*)&dst_addr,
+                                   (struct sockaddr*)&mask_addr) != ROUTE_OK;
+        }
+    }
+    return failed;
+}
+
+/* Swaps the whole tree by compactions and flushes, returns the failed steps */
+static int optimistic_swap(struct rib_head* rh) {
+    char addr[32];
+    int failed = 0, rc;
+
+    for (int round = 0; round < 20; round++) {
+        for (int j = 0; j < 256; j++) {
+            snprintf(addr, sizeof(addr), "10.%d.%d.0", j % 16, j / 16);
+            failed += add_route4(rh, addr, "255.255.255.0", "172.16.0.3") != ROUTE_OK;
+        }
+        while ((rc = route_table_compact(rh, 32)) == 1) {
+        }
+        failed += rc != ROUTE_OK;
+        failed += route_table_flush(rh) != ROUTE_OK;
+        failed += add_route4(rh, "192.168.1.0", "255.255.255.0", "172.16.0.1") != ROUTE_OK;
+        failed += add_route4(rh, "10.0.0.0", "255.0.0.0", "172.16.0.2") != ROUTE_OK;
+    }
+    return failed;
+}
+
+static int test_route_lookup_optimistic(void) {
+    struct optimistic_reader readers[2];
+    pthread_t threads[2];
+    struct rib_head* rh;
+    int started, failed, lookups[2], wrong[2];
+
+    rh = route_table_create(AF_INET, 32);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    if (add_route4(rh, "192.168.1.0", "255.255.255.0", "172.16.0.1") != ROUTE_OK ||
+        add_route4(rh, "10.0.0.0", "255.0.0.0", "172.16.0.2") != ROUTE_OK) {
+        route_table_destroy(rh);
+        TEST_ASSERT(0, "Should add 192.168.1/24 and 10/8");
+    }
+
+    /* Readers are joined before any result is checked */
+    started = optimistic_start(readers, threads, 2, rh, 0);
+    failed = (started == 2) ? optimistic_churn(rh) : 0;
+    optimistic_stop(readers, threads, started);
+    for (int i = 0; i < started; i++) {
+        lookups[i] = readers[i].or_lookups;
+        wrong[i] = readers[i].or_wrong;
+    }
+
+    /* Then trees swapped by flushes and compactions */
+    if (started == 2) {
+        started = optimistic_start(readers, threads, 2, rh, 1);
+        failed += (started == 2) ? optimistic_swap(rh) : 0;
+        optimistic_stop(readers, threads, started);
+    }
+    route_table_destroy(rh);
+
+    TEST_ASSERT_EQ(2, started, "Should start the readers");
+    TEST_ASSERT_EQ(0, failed, "Every change should succeed");
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT(lookups[i] > 0, "Reader %d should have looked up", i);
+        TEST_ASSERT_EQ(0, wrong[i], "Reader %d should only see whole changes", i);
+        TEST_ASSERT(readers[i].or_lookups > 0, "Reader %d should look up across swaps", i);
+        TEST_ASSERT_EQ(0, readers[i].or_wrong,
+                       "Reader %d should only see routes of the swapped trees", i);
+    }
+
+    TEST_PASS();
+}
+
+struct restore_reader {
+    struct rib_head* rr_rh;
+    _Atomic int rr_stop;
+    _Atomic int rr_lookups;
+    int rr_wrong;
+};
+
+static void* restore_reader_thread(void* arg) {
+    struct restore_reader* rr = arg;
+    struct sockaddr_in dst;
+    struct route_info ri;
+    char addr[32];
+
+    for (int i = 0; !atomic_load(&rr->rr_stop); i++) {
+        snprintf(addr, sizeof(addr), "10.%d.1.1", i % 64);
+        make_sin(&dst, addr);
+        route_epoch_enter();
+        if (route_lookup(rr->rr_rh, (struct sockaddr*)&dst, &ri) != ROUTE_OK ||
+            !check_gateway(&ri, "172.16.0.1")) {
+            rr->rr_wrong++;
+        }
+        route_epoch_exit();
+        atomic_fetch_add(&rr->rr_lookups, 1);
+    }
+    return NULL;
+}
+
+static int test_route_lookup_restored(void) {
+    struct restore_reader readers[2];
+    struct rib_head *orig, *restored;
+    pthread_t threads[2];
+    char path[64], addr[32];
+    int lookups;
+
+    snprintf(path, sizeof(path), "/tmp/route_lib_test_rr.%d.snap", (int)getpid());
+    orig = route_table_create(AF_INET, 35);
+    TEST_ASSERT_NOT_NULL(orig, "Should create IPv4 routing table");
+    for (int i = 0; i < 64; i++) {
+        snprintf(addr, sizeof(addr), "10.%d.0.0", i);
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(orig, addr, "255.255.0.0", "172.16.0.1"),
+                       "Should add %s/16", addr);
+    }
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_save(orig, path), "Should save the table");
+    route_table_destroy(orig);
+
+    restored = route_table_restore(path, 36);
+    TEST_ASSERT_NOT_NULL(restored, "Should restore the table");
+    for (int i = 0; i < 2; i++) {
+        readers[i] = (struct restore_reader){ .rr_rh = restored };
+        TEST_ASSERT_EQ(0, pthread_create(&threads[i], NULL, restore_reader_thread, &readers[i]),
+                       "Should start reader %d", i);
+    }
+
+    /* Readers do not settle the table, its writer does under them */
+    while (atomic_load(&readers[0].rr_lookups) < 100 ||
+           atomic_load(&readers[1].rr_lookups) < 100) {
+        sched_yield();
+    }
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(restored, "192.168.0.0", "255.255.0.0", "172.16.0.2"),
+                   "Should add a route once rebuilt");
+    lookups = atomic_load(&readers[0].rr_lookups);
+    while (atomic_load(&readers[0].rr_lookups) < lookups + 100) {
+        sched_yield();
+    }
+
+    for (int i = 0; i < 2; i++) {
+        atomic_store(&readers[i].rr_stop, 1);
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQ(0, readers[i].rr_wrong,
+                       "Reader %d should match through the image and the tree", i);
+    }
+
+    route_table_destroy(restored);
+    unlink(path);
+
+    TEST_PASS();
+}
+
+static int stop_walker(struct route_info* ri, void* arg) {
+    (void)ri;
+    return --*(int*)arg == 0;
+}
+
+static int delete_walker(struct route_info* ri, void* arg) {
+    return route_delete(arg, ri->ri_dst, ri->ri_netmask) != ROUTE_OK;
+}
+
+struct alternate_delete {
+    struct rib_head* ad_rh;
+    int ad_seen;
+};
+
+/* Deletes every other route it is given, from the first one */
+static int alternate_delete_walker(struct route_info* ri, void* arg) {
+    struct alternate_delete* ad = arg;
+
+    if (ad->ad_seen++ % 2 != 0) {
+        return 0;
+    }
+    return route_delete(ad->ad_rh, ri->ri_dst, ri->ri_netmask) != ROUTE_OK;
+}
+
+static int test_route_walk_batch(void) {
+    struct alternate_delete ad = { 0 };
+    struct sockaddr_in dst_addr;
+    struct route_info ri;
+    struct rib_head* rh;
+    char addr[32];
+    int count = 0, left = 20;
+
+    rh = route_table_create(AF_INET, 33);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+
+    /* Several batches, with chains of one key under different masks */
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "0.0.0.0", "0.0.0.0", "192.168.0.1"),
+                   "Should add the default route");
+    for (int i = 0; i < 40; i++) {
+        snprintf(addr, sizeof(addr), "10.%d.0.0", i);
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, addr, "255.255.0.0", "192.168.0.1"),
+                       "Should add %s/16", addr);
+        TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, addr, "255.255.255.0", "192.168.0.2"),
+                       "Should add %s/24", addr);
+    }
+
+    TEST_ASSERT_EQ(81, route_walk(rh, count_walker, &count), "Should walk every route");
+    TEST_ASSERT_EQ(81, count, "Should call the walker for every route");
+    TEST_ASSERT_EQ(20, route_walk(rh, stop_walker, &left), "Should stop mid batch");
+
+    /*
+     * Walkers may delete the route they are given. Every other one goes
+     * across batch boundaries: the default route, then the /16 of each
+     * key, which comes after its /24.
+     */
+    ad.ad_rh = rh;
+    TEST_ASSERT_EQ(81, route_walk(rh, alternate_delete_walker, &ad),
+                   "Should visit every route while deleting");
+    TEST_ASSERT_EQ(81, ad.ad_seen, "Should call the walker for every route");
+    count = 0;
+    TEST_ASSERT_EQ(40, route_walk(rh, count_walker, &count), "Half should be left");
+    for (int i = 0; i < 40; i++) {
+        snprintf(addr, sizeof(addr), "10.%d.0.1", i);
+        make_sin(&dst_addr, addr);
+        TEST_ASSERT_EQ(ROUTE_OK, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                       "Should keep 10.%d.0/24", i);
+        TEST_ASSERT(check_gateway(&ri, "192.168.0.2"), "Should match 10.%d.0/24", i);
+        snprintf(addr, sizeof(addr), "10.%d.1.1", i);
+        make_sin(&dst_addr, addr);
+        TEST_ASSERT_EQ(ROUTE_ENOENT, route_lookup(rh, (struct sockaddr*)&dst_addr, &ri),
+                       "Should have deleted 10.%d/16 and the default route", i);
+    }
+
+    TEST_ASSERT_EQ(40, route_walk(rh, delete_walker, rh), "Should delete while walking");
+    count = 0;
+    TEST_ASSERT_EQ(0, route_walk(rh, count_walker, &count), "No route should be left");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_init_stats(void) {
+    struct route_init_stats before, after;
+    struct route_stats_ext ext;
+    struct route_info ri;
+    struct in_addr dst;
+    struct rib_head* rh;
+
+    route_lib_get_init_stats(&before);
+    TEST_ASSERT(before.ris_lib_ns > 0, "Should time route_lib_init()");
+
+    /* Tables that never get a route set up neither zone nor histograms */
+    rh = route_table_create(AF_INET, 34);
+    TEST_ASSERT_NOT_NULL(rh, "Should create IPv4 routing table");
+    route_lib_get_init_stats(&after);
+    TEST_ASSERT_EQ(before.ris_tables + 1, after.ris_tables, "Should count the table");
+    TEST_ASSERT(after.ris_table_ns > before.ris_table_ns, "Should time the table");
+    TEST_ASSERT(after.ris_head_ns + after.ris_counters_ns <= after.ris_table_ns,
+                "Phases should be part of the table time");
+    TEST_ASSERT_EQ(before.ris_deferred, after.ris_deferred, "Nothing should be set up yet");
+    TEST_ASSERT_EQ(ROUTE_OK, route_get_stats_ext(rh, &ext), "Should get the stats");
+    TEST_ASSERT_EQ(0, (int)ext.rse_add.rl_count, "No operation should be timed");
+    route_table_destroy(rh);
+
+    rh = route_table_create(AF_INET, 34);
+    TEST_ASSERT_NOT_NULL(rh, "Should create the table again");
+    route_lib_get_init_stats(&before);
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8");
+    route_lib_get_init_stats(&after);
+    TEST_ASSERT_EQ(before.ris_deferred + 2, after.ris_deferred,
+                   "The first route should set up the zone and histograms");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.1.0.0", "255.255.0.0", "192.168.0.2"),
+                   "Should add 10.1/16");
+    route_lib_get_init_stats(&before);
+    TEST_ASSERT_EQ(after.ris_deferred, before.ris_deferred, "Setup should happen once");
+
+    /* A flush drops the zone, the next route sets up another one */
+    TEST_ASSERT_EQ(ROUTE_OK, route_table_flush(rh), "Should flush");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(rh, "10.0.0.0", "255.0.0.0", "192.168.0.1"),
+                   "Should add 10/8 after the flush");
+    route_lib_get_init_stats(&after);
+    TEST_ASSERT_EQ(before.ris_deferred + 1, after.ris_deferred, "Should set up a new zone");
+
+    inet_pton(AF_INET, "10.2.0.1", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(34, dst, 0, &ri), "Should match 10/8");
+    route_lib_get_init_stats(&after);
+    TEST_ASSERT(after.ris_first_lookup_ns > 0, "Should note the first lookup");
+
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_route_table_overlay(void) {
+    struct rib_head *base, *vrf;
+    struct route_info ri;
+    struct in_addr dst;
+    int count = 0;
+    const struct {
+        const char* dst;
+        const char* gw;     /* NULL when the lookup should miss */
+    } cases[] = {
+        { "10.1.2.3", "192.168.2.3" },     /* Overlay /24 under base /16 */
+        { "10.1.9.9", "192.168.1.1" },     /* Base /16 longer than overlay 10/8 */
+        { "10.9.9.9", "192.168.2.1" },     /* Overlay 10/8 overrides base 10/8 */
+        { "172.16.0.1", "192.168.2.2" },   /* Overlay only */
+        { "192.0.2.1", NULL },
+    };
+
+    base = route_table_create(AF_INET, 8);
+    TEST_ASSERT_NOT_NULL(base, "Should create base table");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(base, "10.0.0.0", "255.0.0.0", "192.168.1.0"),
+                   "Should add base 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(base, "10.1.0.0", "255.255.0.0", "192.168.1.1"),
+                   "Should add base 10.1/16");
+
+    vrf = route_table_create_overlay(base, 9);
+    TEST_ASSERT_NOT_NULL(vrf, "Should create overlay table");
+    TEST_ASSERT_NULL(route_table_create_overlay(vrf, 10), "Overlays should not stack");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(vrf, "10.0.0.0", "255.0.0.0", "192.168.2.1"),
+                   "Should override base 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(vrf, "172.16.0.0", "255.240.0.0", "192.168.2.2"),
+                   "Should add overlay 172.16/12");
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(vrf, "10.1.2.0", "255.255.255.0", "192.168.2.3"),
+                   "Should add overlay 10.1.2/24");
+
+    /* Through the tree, then through the merged frozen copy */
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            struct sockaddr_in sin;
+
+            make_sin(&sin, cases[i].dst);
+            dst = sin.sin_addr;
+            if (!cases[i].gw) {
+                TEST_ASSERT_EQ(ROUTE_ENOENT, route_lookup(vrf, (struct sockaddr*)&sin, &ri),
+                               "Lookup should miss");
+                TEST_ASSERT_EQ(ROUTE_ENOENT, fib4_lookup(9, dst, 0, &ri),
+                               "Datapath lookup should miss");
+                continue;
+            }
+            TEST_ASSERT_EQ(ROUTE_OK, route_lookup(vrf, (struct sockaddr*)&sin, &ri),
+                           "Lookup should match");
+            TEST_ASSERT(check_gateway(&ri, cases[i].gw), "Should return the longest match");
+            TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(9, dst, 0, &ri),
+                           "Datapath lookup should match");
+            TEST_ASSERT(check_gateway(&ri, cases[i].gw),
+                        "Datapath should return the longest match");
+        }
+        TEST_ASSERT_EQ(ROUTE_OK, route_table_freeze(vrf), "Should freeze the overlay");
+    }
+
+    route_walk(vrf, count_walker, &count);
+    TEST_ASSERT_EQ(4, count, "Walk should skip the overridden base route");
+
+    /* The base stays as it is while shared */
+    TEST_ASSERT_EQ(ROUTE_EBUSY, add_route4(base, "10.2.0.0", "255.255.0.0", "192.168.1.2"),
+                   "Base should be immutable");
+    TEST_ASSERT_EQ(ROUTE_EBUSY, route_table_flush(base), "Base should not be flushed");
+    route_table_destroy(base);
+    inet_pton(AF_INET, "10.1.9.9", &dst);
+    TEST_ASSERT_EQ(ROUTE_OK, fib4_lookup(8, dst, 0, &ri), "Base should not be destroyed");
+
+    route_table_destroy(vrf);
+    TEST_ASSERT_EQ(ROUTE_OK, add_route4(base, "10.2.0.0", "255.255.0.0", "192.168.1.2"),
+                   "Base should change once unshared");
+    route_table_destroy(base);
+
+    TEST_PASS();
+}
+
+/* Test suite definition */
+static test_case_t route_lib_tests[] = {
+    TEST_CASE(fib4_lookup,
+              "Test lock-free IPv4 datapath lookups",
+              test_fib4_lookup),
+
+    TEST_CASE(fib4_lookup_delete,
+              "Test datapath lookups after route deletion",
+              test_fib4_lookup_delete),
+
+    TEST_CASE(route_delete_dupkey,
+              "Test deletions within duplicated key lists",
+              test_route_delete_dupkey),
+
+    TEST_CASE(route_mask_sharing,
+              "Test netmask interning across routes",
+              test_route_mask_sharing),
+
+    TEST_CASE(fib_lookup_nhidx,
+              "Test datapath lookups of nexthop numbers",
+              test_fib_lookup_nhidx),
+
+    TEST_CASE(fib_lookup_mpath,
+              "Test multipath selection in burst nexthop lookups",
+              test_fib_lookup_mpath),
+
+    TEST_CASE(route_lfib,
+              "Test MPLS label tables",
+              test_route_lfib),
+
+    TEST_CASE(route_mpath_wide,
+              "Test wide and unevenly weighted multipath groups",
+              test_route_mpath_wide),
+
+    TEST_CASE(route_table_load,
+              "Test bulk loading against incremental inserts",
+              test_route_table_load),
+
+    TEST_CASE(route_tables_load,
+              "Test parallel loads of independent tables",
+              test_route_tables_load),
+
+    TEST_CASE(route_table_freeze,
+              "Test frozen datapath copies against the tree",
+              test_route_table_freeze),
+
+    TEST_CASE(route_table_numa,
+              "Test per-node frozen replicas against the tree",
+              test_route_table_numa),
+
+    TEST_CASE(fib4_lookup_burst,
+              "Test burst datapath lookups against single ones",
+              test_fib4_lookup_burst),
+
+    TEST_CASE(route_table_snapshot,
+              "Test snapshot save and restore",
+              test_route_table_snapshot),
+
+    TEST_CASE(route_journal,
+              "Test journal replay on top of a snapshot",
+              test_route_journal),
+
+    TEST_CASE(route_export,
+              "Test lookups in an exported table",
+              test_route_export),
+
+    TEST_CASE(route_delta_export,
+              "Test net changes since a generation",
+              test_route_delta_export),
+
+    TEST_CASE(route_stage,
+              "Test flap absorption by staged changes",
+              test_route_stage),
+
+    TEST_CASE(route_origins,
+              "Test best-path selection across route sources",
+              test_route_origins),
+
+    TEST_CASE(route_prefix_queries,
+              "Test covering and more specific prefix queries",
+              test_route_prefix_queries),
+
+    TEST_CASE(route_hits,
+              "Test sampled per-route hit counts",
+              test_route_hits),
+
+    TEST_CASE(route_table_compact,
+              "Test compaction in slices under lookups",
+              test_route_table_compact),
+
+    TEST_CASE(route_lookup_optimistic,
+              "Test route_lookup() alongside the writer",
+              test_route_lookup_optimistic),
+
+    TEST_CASE(route_lookup_restored,
+              "Test route_lookup() readers on a restored table",
+              test_route_lookup_restored),
+
+    TEST_CASE(route_walk_batch,
+              "Test batched walks across chains and deletes",
+              test_route_walk_batch),
+
+    TEST_CASE(route_init_stats,
+              "Test the startup profile and deferred table setup",
+              test_route_init_stats),
+
+    TEST_CASE(route_validate_step,
+              "Test incremental validation across table changes",
+              test_route_validate_step),
+
+    TEST_CASE(route_walk_parallel,
+              "Test partitioned multi-threaded walks",
+              test_route_walk_parallel),
+
+    TEST_CASE(route_cursor,
+              "Test chunked cursor walks across table changes",
+              test_route_cursor),
+
+    TEST_CASE(route_stats_latency,
+              "Test per-operation latency histograms",
+              test_route_stats_latency),
+
+    TEST_CASE(route_lookup_cache,
+              "Test the per-thread lookup cache invalidation",
+              test_route_lookup_cache),
+
+    TEST_CASE(route_host_table,
+              "Test the host route table in front of the tree",
+              test_route_host_table),
+
+    TEST_CASE(route_sharded,
+              "Test sharded tables with parallel writers",
+              test_route_sharded),
+
+    TEST_CASE(route_async,
+              "Test asynchronous changes through the rings",
+              test_route_async),
+
+    TEST_CASE(route_table_flush,
+              "Test whole-table flush through the table zone",
+              test_route_table_flush),
+
+    TEST_CASE(route_table_overlay,
+              "Test overlay tables over a shared base",
+              test_route_table_overlay),
+
+    TEST_CASE(fib_lookup_invalid,
+              "Test datapath lookup argument checks",
+              test_fib_lookup_invalid),
+
+    TEST_SUITE_END()
+};
+
+test_suite_t route_lib_test_suite = {
+    "Route Library Tests",
+    "Test suite for the route_lib API implementation",
+    route_lib_tests,
+    0,  /* num_tests calculated at runtime */
+    route_lib_test_setup,
+    route_lib_test_teardown
+};
+
+/* Main test runner */
+int main(void) {
+    printf("Route Library Test Suite\n");
+    printf("========================\n\n");
+
+    if (test_framework_init() != 0) {
+        fprintf(stderr, "Failed to initialize test framework\n");
+        return 1;
+    }
+
+    int count = 0;
+    while (route_lib_tests[count].name != NULL) {
+        count++;
+    }
+    route_lib_test_suite.num_tests = count;
+
+    int result = test_run_suite(&route_lib_test_suite);
+
+    test_print_summary();
+    test_framework_cleanup();
+
+    return (result != 0 || g_test_result.failed_tests > 0) ? 1 : 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Test suite for the C++ route_lib API (src/include/route_lib.hpp)
+ */
+
+#include "test_framework.h"
+#include "../include/route_lib.hpp"
+
+#include <type_traits>
+#include <vector>
+
+using route::Ipv4Prefix;
+using route::Ipv6Prefix;
+using route::Rib4;
+using route::Rib6;
+
+static_assert(!std::is_copy_constructible_v<Rib4>, "Tables should not copy");
+static_assert(std::is_nothrow_move_constructible_v<Rib4>, "Tables should move");
+static_assert(!std::is_copy_constructible_v<route::RouteView<Ipv4Prefix>>,
+              "Views should not copy their epoch section");
+static_assert(std::is_nothrow_move_assignable_v<route::RouteView<Ipv4Prefix>>,
+              "Views should move");
+
+static in_addr addr4(const char* s) {
+    in_addr a;
+
+    inet_pton(AF_INET, s, &a);
+    return a;
+}
+
+static in6_addr addr6(const char* s) {
+    in6_addr a;
+
+    inet_pton(AF_INET6, s, &a);
+    return a;
+}
+
+static in_addr gateway4(const route::RouteView<Ipv4Prefix>& rv) {
+    return reinterpret_cast<const sockaddr_in*>(rv.gateway())->sin_addr;
+}
+
+static int route_lib_cpp_test_setup(void) {
+    return route_lib_init();
+}
+
+static int route_lib_cpp_test_teardown(void) {
+    route_lib_cleanup();
+    return 0;
+}
+
+/* Test cases */
+static int test_prefix_keys(void) {
+    Ipv4Prefix p4(addr4("10.1.2.3"), 16);
+    Ipv6Prefix p6(addr6("2001:db8:1:ffff::1"), 52);
+
+    TEST_ASSERT(p4 == Ipv4Prefix(0x0a010000, 16), "Host bits should be cleared");
+    TEST_ASSERT_EQ(32, Ipv4Prefix(0x0a010203, 40).len, "Lengths should be clamped");
+    TEST_ASSERT(p6 == Ipv6Prefix(addr6("2001:db8:1:f000::"), 52),
+                "IPv6 host bits should be cleared");
+    TEST_ASSERT(p6 != Ipv6Prefix(addr6("2001:db8:1:f000::"), 48),
+                "Lengths should be part of the key");
+
+    TEST_PASS();
+}
+
+static int test_rib4_lookup(void) {
+    Rib4 rib = Rib4::create(0);
+
+    TEST_ASSERT(rib, "Should create IPv4 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, rib.add(Ipv4Prefix(0x0a000000, 8), addr4("192.168.0.1")),
+                   "Should add 10/8");
+    TEST_ASSERT_EQ(ROUTE_OK, rib.add(Ipv4Prefix(0x0a010000, 16), addr4("192.168.0.2")),
+                   "Should add 10.1/16");
+    TEST_ASSERT_EQ(ROUTE_OK, rib.add(Ipv4Prefix(0x0a010203, 32), addr4("192.168.0.3")),
+                   "Should add host 10.1.2.3");
+
+    auto rv = rib.lookup(addr4("10.1.2.3"));
+    TEST_ASSERT(rv, "Should match the host route");
+    TEST_ASSERT(rv.prefix() == Ipv4Prefix(0x0a010203, 32), "Should report the host prefix");
+    TEST_ASSERT(rv.flags() & ROUTE_RTF_HOST, "Full length prefixes should be host routes");
+
+    rv = rib.lookup(addr4("10.1.9.9"));
+    TEST_ASSERT(rv.prefix() == Ipv4Prefix(0x0a010000, 16), "Should pick the longest match");
+    TEST_ASSERT_EQ(addr4("192.168.0.2").s_addr, gateway4(rv).s_addr,
+                   "Should return the 10.1/16 gateway");
+
+    TEST_ASSERT(!rib.lookup(addr4("11.0.0.1")), "Should miss 11/8");
+
+    /* No view may be held across changes */
+    rv.reset();
+    TEST_ASSERT(!rv, "A reset view should be empty");
+    TEST_ASSERT_EQ(ROUTE_OK, rib.remove(Ipv4Prefix(0x0a010203, 32)),
+                   "Should delete the host route");
+    TEST_ASSERT_EQ(ROUTE_OK, rib.remove(Ipv4Prefix(0x0a010000, 16)), "Should delete 10.1/16");
+    TEST_ASSERT(rib.lookup(addr4("10.1.2.3")).prefix() == Ipv4Prefix(0x0a000000, 8),
+                "Should fall back to 10/8 after deletes");
+
+    TEST_PASS();
+}
+
+static int test_rib6_lookup(void) {
+    Rib6 rib = Rib6::create(0);
+
+    TEST_ASSERT(rib, "Should create IPv6 routing table");
+    TEST_ASSERT_EQ(ROUTE_OK, rib.add(Ipv6Prefix(addr6("2001:db8::"), 32), addr6("fe80::1")),
+                   "Should add 2001:db8::/32");
+    TEST_ASSERT_EQ(ROUTE_OK, rib.add(Ipv6Prefix(addr6("2001:db8:1::"), 48), addr6("fe80::2")),
+                   "Should add 2001:db8:1::/48");
+
+    auto rv = rib.lookup(addr6("2001:db8:1::5"));
+    TEST_ASSERT(rv, "Should match 2001:db8:1::/48");
+    TEST_ASSERT(rv.prefix() == Ipv6Prefix(addr6("2001:db8:1::"), 48),
+                "Should pick the longest match");
+    TEST_ASSERT(rib.lookup(addr6("2001:db8:2::1")).prefix() ==
+                Ipv6Prefix(addr6("2001:db8::"), 32), "Should fall back to /32");
+    TEST_ASSERT(!rib.lookup(addr6("2001:db9::1")), "Should miss outside /32");
+
+    TEST_PASS();
+}
+
+static int test_rib_move(void) {
+    Rib4 a = Rib4::create(0);
+    Rib4 b;
+
+    TEST_ASSERT_EQ(ROUTE_OK, a.add(Ipv4Prefix(0xac100000, 12), addr4("10.0.0.1")),
+                   "Should add 172.16/12");
+
+    b = std::move(a);
+    TEST_ASSERT(!a, "Moved-from handle should be empty");
+    TEST_ASSERT(b.lookup(addr4("172.16.0.1")), "Moved-to handle should own the routes");
+
+    Rib4 c(std::move(b));
+    TEST_ASSERT(!b && c, "Move construction should transfer ownership");
+
+    /* Assigning over a live handle destroys its table */
+    c = Rib4::create(0);
+    TEST_ASSERT(!c.lookup(addr4("172.16.0.1")), "Replaced table should be destroyed");
+
+    rib_head* rh = c.release();
+    TEST_ASSERT(!c, "Released handle should be empty");
+    route_table_destroy(rh);
+
+    TEST_PASS();
+}
+
+static int test_epoch_guard(void) {
+    Rib4 rib = Rib4::create(0);
+    route::RouteView<Ipv4Prefix> kept;
+
+    TEST_ASSERT_EQ(ROUTE_OK, rib.add(Ipv4Prefix(0x0a000000, 8), addr4("192.168.0.1")),
+                   "Should add 10/8");
+    {
+        route::EpochGuard outer;
+        auto rv = rib.lookup(addr4("10.0.0.1"));
+
+        TEST_ASSERT(outer && rv, "Lookups should nest in a held section");
+        kept = std::move(rv);
+        TEST_ASSERT(!rv, "A moved-from view should be empty");
+    }
+    TEST_ASSERT(kept.prefix() == Ipv4Prefix(0x0a000000, 8),
+                "A moved view should keep the route past the outer section");
+    TEST_ASSERT_EQ(addr4("192.168.0.1").s_addr, gateway4(kept).s_addr,
+                   "A moved view should keep its gateway");
+
+    route::EpochGuard g;
+    route::EpochGuard h(std::move(g));
+    TEST_ASSERT(!g && h, "Moving a guard should move the section");
+    h.reset();
+    TEST_ASSERT(!h, "A reset guard should have left the section");
+
+    kept.reset();
+    TEST_ASSERT_EQ(ROUTE_OK, rib.remove(Ipv4Prefix(0x0a000000, 8)),
+                   "Should delete 10/8 once no view holds a section");
+
+    TEST_PASS();
+}
+
+static int test_rib_walk(void) {
+    Rib4 rib = Rib4::create(0);
+    std::vector<Ipv4Prefix> seen;
+    int stopped = 0;
+
+    for (uint32_t i = 0; i < 64; i++) {
+        TEST_ASSERT_EQ(ROUTE_OK, rib.add(Ipv4Prefix(0x0a000000 | (i << 16), 16),
+                                         addr4("192.168.0.1")),
+                       "Should add 10.%u/16", i);
+    }
+
+    rib.walk([&](const route::RouteView<Ipv4Prefix>& rv) { seen.push_back(rv.prefix()); });
+    TEST_ASSERT_EQ(64u, seen.size(), "Void walkers should visit every route");
+    for (uint32_t i = 0; i < 64; i++) {
+        TEST_ASSERT(seen[i] == Ipv4Prefix(0x0a000000 | (i << 16), 16),
+                    "Route %u should come in key order", i);
+    }
+
+    rib.walk([&](const route::RouteView<Ipv4Prefix>&) { return ++stopped == 10; });
+    TEST_ASSERT_EQ(10, stopped, "A true result should end the walk");
+
+    TEST_PASS();
+}
+
+/* Test suite definition */
+static test_case_t route_lib_cpp_tests[] = {
+    TEST_CASE(prefix_keys,
+              "Test typed prefix keys",
+              test_prefix_keys),
+
+    TEST_CASE(rib4_lookup,
+              "Test IPv4 tables through the C++ API",
+              test_rib4_lookup),
+
+    TEST_CASE(rib6_lookup,
+              "Test IPv6 tables through the C++ API",
+              test_rib6_lookup),
+
+    TEST_CASE(rib_move,
+              "Test move-only table ownership",
+              test_rib_move),
+
+    TEST_CASE(epoch_guard,
+              "Test epoch guards held by views",
+              test_epoch_guard),
+
+    TEST_CASE(rib_walk,
+              "Test walks with lambdas",
+              test_rib_walk),
+
+    TEST_SUITE_END()
+};
+
+test_suite_t route_lib_cpp_test_suite = {
+    "Route Library C++ Tests",
+    "Test suite for the header-only C++ route_lib API",
+    route_lib_cpp_tests,
+    0,  /* num_tests calculated at runtime */
+    route_lib_cpp_test_setup,
+    route_lib_cpp_test_teardown
+};
+
+/* Main test runner */
+int main(void) {
+    printf("Route Library C++ Test Suite\n");
+    printf("============================\n\n");
+
+    if (test_framework_init() != 0) {
+        fprintf(stderr, "Failed to initialize test framework\n");
+        return 1;
+    }
+
+    int count = 0;
+    while (route_lib_cpp_tests[count].name != NULL) {
+        count++;
+    }
+    route_lib_cpp_test_suite.num_tests = count;
+
+    int result = test_run_suite(&route_lib_cpp_test_suite);
+
+    test_print_summary();
+    test_framework_cleanup();
+
+    return (result != 0 || g_test_result.failed_tests > 0) ? 1 : 0;
+}
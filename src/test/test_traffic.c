@@ -0,0 +1,315 @@
+/*
+ * Lookup traffic generator for the benchmarks
+ */
+
+#include "test_traffic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+struct traffic_prefix {
+    uint8_t tp_addr[16];
+    uint8_t tp_plen;
+};
+
+struct traffic_flow {
+    uint8_t tf_addr[16];
+    uint32_t tf_packets;
+};
+
+struct traffic_gen {
+    traffic_pattern_t tg_pattern;
+    int tg_alen;                  /* Address length, 4 or 16 */
+    char tg_name[64];
+
+    struct traffic_prefix* tg_prefixes;
+    size_t tg_nprefixes;
+    size_t tg_cap;
+    uint32_t* tg_rank;            /* Zipf rank - 1 -> prefix */
+
+    /* Rejection-inversion sampling constants, see traffic_zipf() */
+    double tg_s;
+    double tg_hx1;
+    double tg_hn;
+    double tg_sval;
+
+    struct traffic_flow* tg_flows;
+    size_t tg_nflows;
+};
+
+static uint64_t traffic_rand(uint64_t* s) {
+    /* splitmix64 */
+    uint64_t x = (*s += 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double traffic_unit(uint64_t* s) {
+    return (traffic_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Zipf sampling by rejection-inversion (Hormann & Derflinger, 1996):
+ * O(1) per draw without a CDF table, for any exponent s > 0.
+ */
+static double zipf_helper1(double x) {
+    return (fabs(x) > 1e-8) ? log1p(x) / x : 1.0 - x / 2.0;
+}
+
+static double zipf_helper2(double x) {
+    return (fabs(x) > 1e-8) ? expm1(x) / x : 1.0 + x / 2.0;
+}
+
+static double zipf_h(const struct traffic_gen* g, double x) {
+    return exp(-g->tg_s * log(x));
+}
+
+static double zipf_hint(const struct traffic_gen* g, double x) {
+    double lx = log(x);
+    return zipf_helper2((1.0 - g->tg_s) * lx) * lx;
+}
+
+static double zipf_hint_inv(const struct traffic_gen* g, double x) {
+    double t = x * (1.0 - g->tg_s);
+    if (t < -1.0)
+        t = -1.0;
+    return exp(zipf_helper1(t) * x);
+}
+
+static size_t traffic_zipf(const struct traffic_gen* g, uint64_t* rng) {
+    double n = (double)g->tg_nprefixes;
+
+    for (;;) {
+        double u = g->tg_hn + traffic_unit(rng) * (g->tg_hx1 - g->tg_hn);
+        double x = zipf_hint_inv(g, u);
+        double k = floor(x + 0.5);
+
+        if (k < 1)
+            k = 1;
+        else if (k > n)
+            k = n;
+        if (k - x <= g->tg_sval || u >= zipf_hint(g, k + 0.5) - zipf_h(g, k))
+            return (size_t)k - 1;
+    }
+}
+
+static int traffic_load_trace(struct traffic_gen* gen, const char* path) {
+    FILE* fp = fopen(path, "r");
+    char line[256];
+    size_t cap = 0;
+
+    if (!fp) {
+        fprintf(stderr, "traffic: cannot open trace %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char addr[INET6_ADDRSTRLEN];
+        unsigned long packets = 1;
+        char* s = line + strspn(line, " \t");
+
+        if (*s == '#' || *s == '\n' || *s == '\0')
+            continue;
+        if (sscanf(s, "%45s %lu", addr, &packets) < 1 || packets == 0)
+            continue;
+
+        if (gen->tg_nflows == cap) {
+            cap = cap ? cap * 2 : 1024;
+            struct traffic_flow* f = realloc(gen->tg_flows, cap * sizeof(*f));
+            if (!f) {
+                fclose(fp);
+                return -1;
+            }
+            gen->tg_flows = f;
+        }
+        struct traffic_flow* f = &gen->tg_flows[gen->tg_nflows];
+        memset(f, 0, sizeof(*f));
+        if (inet_pton(gen->tg_alen == 4 ? AF_INET : AF_INET6, addr, f->tf_addr) != 1)
+            continue;   /* Other family or garbage */
+        f->tf_packets = (packets > UINT32_MAX) ? UINT32_MAX : (uint32_t)packets;
+        gen->tg_nflows++;
+    }
+    fclose(fp);
+
+    if (gen->tg_nflows == 0) {
+        fprintf(stderr, "traffic: no usable flows in %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+struct traffic_gen* traffic_create(int family, const char* spec) {
+    struct traffic_gen* gen;
+
+    if ((family != AF_INET && family != AF_INET6) || !spec)
+        return NULL;
+    gen = calloc(1, sizeof(*gen));
+    if (!gen)
+        return NULL;
+    gen->tg_alen = (family == AF_INET) ? 4 : 16;
+    gen->tg_s = TRAFFIC_ZIPF_S;
+
+    if (strcmp(spec, "sequential") == 0) {
+        gen->tg_pattern = TRAFFIC_SEQUENTIAL;
+        snprintf(gen->tg_name, sizeof(gen->tg_name), "sequential");
+    } else if (strncmp(spec, "zipf", 4) == 0 && (spec[4] == '\0' || spec[4] == ':')) {
+        gen->tg_pattern = TRAFFIC_ZIPF;
+        if (spec[4] == ':')
+            gen->tg_s = strtod(spec + 5, NULL);
+        if (!(gen->tg_s > 0)) {
+            free(gen);
+            return NULL;
+        }
+        snprintf(gen->tg_name, sizeof(gen->tg_name), "zipf s=%.2f", gen->tg_s);
+    } else if (strcmp(spec, "uniform") == 0) {
+        gen->tg_pattern = TRAFFIC_UNIFORM;
+        snprintf(gen->tg_name, sizeof(gen->tg_name), "uniform");
+    } else if (strncmp(spec, "trace:", 6) == 0) {
+        gen->tg_pattern = TRAFFIC_TRACE;
+        if (traffic_load_trace(gen, spec + 6) != 0) {
+            traffic_destroy(gen);
+            return NULL;
+        }
+        snprintf(gen->tg_name, sizeof(gen->tg_name), "trace (%zu flows)", gen->tg_nflows);
+    } else {
+        fprintf(stderr, "traffic: unknown pattern '%s'\n", spec);
+        free(gen);
+        return NULL;
+    }
+    return gen;
+}
+
+void traffic_destroy(struct traffic_gen* gen) {
+    if (!gen)
+        return;
+    free(gen->tg_prefixes);
+    free(gen->tg_rank);
+    free(gen->tg_flows);
+    free(gen);
+}
+
+int traffic_add_prefix(struct traffic_gen* gen, const void* addr, int plen) {
+    if (!gen || !addr || plen < 0 || plen > gen->tg_alen * 8)
+        return -1;
+
+    if (gen->tg_nprefixes == gen->tg_cap) {
+        size_t cap = gen->tg_cap ? gen->tg_cap * 2 : 4096;
+        struct traffic_prefix* p = realloc(gen->tg_prefixes, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        gen->tg_prefixes = p;
+        gen->tg_cap = cap;
+    }
+
+    struct traffic_prefix* p = &gen->tg_prefixes[gen->tg_nprefixes++];
+    memset(p, 0, sizeof(*p));
+    memcpy(p->tp_addr, addr, gen->tg_alen);
+    p->tp_plen = (uint8_t)plen;
+    return 0;
+}
+
+int traffic_prepare(struct traffic_gen* gen, uint64_t seed) {
+    if (!gen)
+        return -1;
+    if (gen->tg_pattern != TRAFFIC_SEQUENTIAL && gen->tg_pattern != TRAFFIC_ZIPF)
+        return 0;
+    if (gen->tg_nprefixes == 0)
+        return -1;
+    if (gen->tg_pattern == TRAFFIC_SEQUENTIAL)
+        return 0;
+
+    /* Shuffle ranks so popular prefixes are spread over the table */
+    free(gen->tg_rank);
+    gen->tg_rank = malloc(gen->tg_nprefixes * sizeof(*gen->tg_rank));
+    if (!gen->tg_rank)
+        return -1;
+    for (size_t i = 0; i < gen->tg_nprefixes; i++)
+        gen->tg_rank[i] = (uint32_t)i;
+    for (size_t i = gen->tg_nprefixes - 1; i > 0; i--) {
+        size_t j = traffic_rand(&seed) % (i + 1);
+        uint32_t t = gen->tg_rank[i];
+        gen->tg_rank[i] = gen->tg_rank[j];
+        gen->tg_rank[j] = t;
+    }
+
+    gen->tg_hx1 = zipf_hint(gen, 1.5) - 1.0;
+    gen->tg_hn = zipf_hint(gen, gen->tg_nprefixes + 0.5);
+    gen->tg_sval = 2.0 - zipf_hint_inv(gen, zipf_hint(gen, 2.5) - zipf_h(gen, 2.0));
+    return 0;
+}
+
+traffic_pattern_t traffic_pattern(const struct traffic_gen* gen) {
+    return gen->tg_pattern;
+}
+
+const char* traffic_name(const struct traffic_gen* gen) {
+    return gen->tg_name;
+}
+
+const char* traffic_env_spec(const char* dflt) {
+    const char* spec = getenv(TRAFFIC_ENV);
+    return (spec && *spec) ? spec : dflt;
+}
+
+void traffic_stream_init(struct traffic_stream* ts, const struct traffic_gen* gen,
+                         uint64_t seed) {
+    memset(ts, 0, sizeof(*ts));
+    ts->ts_gen = gen;
+    ts->ts_rng = seed;
+    /* Streams start at different points of the trace */
+    if (gen->tg_pattern == TRAFFIC_TRACE)
+        ts->ts_pos = traffic_rand(&ts->ts_rng) % gen->tg_nflows;
+}
+
+/* Copies prefix @p to @addr with random host bits */
+static void traffic_fill_host(struct traffic_stream* ts, const struct traffic_prefix* p,
+                              uint8_t* addr) {
+    int alen = ts->ts_gen->tg_alen;
+    uint64_t r = traffic_rand(&ts->ts_rng);
+
+    memcpy(addr, p->tp_addr, alen);
+    for (int i = p->tp_plen / 8; i < alen; i++) {
+        uint8_t host = (i == p->tp_plen / 8) ? (uint8_t)(0xff >> (p->tp_plen % 8)) : 0xff;
+        if (i == 8)
+            r = traffic_rand(&ts->ts_rng);
+        addr[i] = (addr[i] & ~host) | ((uint8_t)(r >> ((i % 8) * 8)) & host);
+    }
+}
+
+void traffic_next(struct traffic_stream* ts, void* addr) {
+    const struct traffic_gen* g = ts->ts_gen;
+    uint8_t* out = addr;
+
+    switch (g->tg_pattern) {
+        case TRAFFIC_SEQUENTIAL:
+            traffic_fill_host(ts, &g->tg_prefixes[ts->ts_pos], out);
+            if (++ts->ts_pos == g->tg_nprefixes)
+                ts->ts_pos = 0;
+            break;
+
+        case TRAFFIC_ZIPF:
+            traffic_fill_host(ts, &g->tg_prefixes[g->tg_rank[traffic_zipf(g, &ts->ts_rng)]], out);
+            break;
+
+        case TRAFFIC_UNIFORM:
+            for (int i = 0; i < g->tg_alen; i += 8) {
+                uint64_t r = traffic_rand(&ts->ts_rng);
+                memcpy(out + i, &r, (g->tg_alen - i < 8) ? g->tg_alen - i : 8);
+            }
+            break;
+
+        case TRAFFIC_TRACE:
+            /* Every packet of a flow back to back, then the next flow */
+            if (ts->ts_burst == 0)
+                ts->ts_burst = g->tg_flows[ts->ts_pos].tf_packets;
+            memcpy(out, g->tg_flows[ts->ts_pos].tf_addr, g->tg_alen);
+            if (--ts->ts_burst == 0 && ++ts->ts_pos == g->tg_nflows)
+                ts->ts_pos = 0;
+            break;
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * Lookup traffic generator for the benchmarks
+ *
+ * Produces destination addresses with production-like locality instead
+ * of walking the inserted keys in order:
+ * - sequential: the prefixes in insertion order (the old behavior)
+ * - zipf:       prefixes by Zipf rank, popular ones scattered over the table
+ * - uniform:    uniformly random addresses, misses included
+ * - trace:      addresses replayed from a flow trace file
+ *
+ * Destinations drawn from a prefix get random host bits. A generator is
+ * read-only once built and may be shared; every thread draws from its
+ * own traffic_stream.
+ */
+
+#ifndef _TEST_TRAFFIC_H_
+#define _TEST_TRAFFIC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    TRAFFIC_SEQUENTIAL,
+    TRAFFIC_ZIPF,
+    TRAFFIC_UNIFORM,
+    TRAFFIC_TRACE
+} traffic_pattern_t;
+
+#define TRAFFIC_ZIPF_S          1.0     /* Default Zipf exponent */
+#define TRAFFIC_ENV             "RADIX_TRAFFIC"
+
+struct traffic_gen;
+
+struct traffic_stream {
+    const struct traffic_gen* ts_gen;
+    uint64_t ts_rng;
+    size_t ts_pos;                /* Sequential and trace position */
+    uint32_t ts_burst;            /* Packets left in the current trace flow */
+};
+
+/*
+ * Creates a generator for @family (AF_INET or AF_INET6) addresses.
+ * @spec is "sequential", "zipf[:s]", "uniform" or "trace:<path>".
+ * A trace file has one "address [packets]" flow per line; '#' starts
+ * a comment. Returns NULL on a bad spec or unreadable trace.
+ */
+struct traffic_gen* traffic_create(int family, const char* spec);
+void traffic_destroy(struct traffic_gen* gen);
+
+/* Adds a prefix for the sequential and zipf patterns, @addr in network order */
+int traffic_add_prefix(struct traffic_gen* gen, const void* addr, int plen);
+
+/*
+ * Finalizes the generator once all prefixes are in: builds the Zipf
+ * ranking from @seed. Must be called before streams are started.
+ */
+int traffic_prepare(struct traffic_gen* gen, uint64_t seed);
+
+traffic_pattern_t traffic_pattern(const struct traffic_gen* gen);
+const char* traffic_name(const struct traffic_gen* gen);
+
+/* Returns the spec in RADIX_TRAFFIC, or @dflt when it is unset */
+const char* traffic_env_spec(const char* dflt);
+
+void traffic_stream_init(struct traffic_stream* ts, const struct traffic_gen* gen,
+                         uint64_t seed);
+
+/* Writes the next destination to @addr: 4 or 16 bytes, network order */
+void traffic_next(struct traffic_stream* ts, void* addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TEST_TRAFFIC_H_ */